@@ -25,10 +25,17 @@
                                             <xsl:variable name="member" select="@member" />
                                             <xsl:variable name="of" select="../../value[@member='global-config']/value[@member=$member]/@value" />
                                             <td><xsl:value-of select="concat(translate(substring(@member, 1, 1), 'abcdefghijklmnopqrstuvwxyz', 'ABCDEFGHIJKLMNOPQRSTUVWXYZ'), substring(@member, 2))" /></td>
-                                            <td class="barmeter">
-                                                <span><xsl:value-of select="@value" /> of <xsl:value-of select="$of" /></span>
-                                                <div style="width: calc(100% * {@value} / {$of});">&#160;</div>
-                                            </td>
+                                            <xsl:choose>
+                                                <xsl:when test="$of &gt; 0">
+                                                    <td class="barmeter">
+                                                        <span><xsl:value-of select="@value" /> of <xsl:value-of select="$of" /></span>
+                                                        <div style="width: calc(100% * {@value} / {$of});">&#160;</div>
+                                                    </td>
+                                                </xsl:when>
+                                                <xsl:otherwise>
+                                                    <td><xsl:value-of select="@value" /></td>
+                                                </xsl:otherwise>
+                                            </xsl:choose>
                                         </tr>
                                     </xsl:for-each>
                                 </tbody>
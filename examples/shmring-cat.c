@@ -0,0 +1,181 @@
+/* shmring-cat
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Writes the stream of a mount with <shm-file> to stdout, from the live
+ * point on, to be piped into a transcoder or recorder on the same host:
+ *
+ *   shmring-cat /dev/shm/icecast-live.ring | ffmpeg -i - ...
+ *
+ * It follows the stream across reconnects of the source. Build with
+ *   cc -O2 -o shmring-cat shmring-cat.c
+ * The layout of the file is described in src/shmring.h of Icecast.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#define SHMRING_MAGIC           "ICESHMR1"
+#define SHMRING_STATE_ENDED     2
+
+typedef struct {
+    char magic[8];
+    uint32_t header_size;
+    volatile uint32_t state;
+    uint64_t size;
+    volatile uint64_t reserved;
+    volatile uint64_t written;
+    volatile uint32_t sequence;
+    uint32_t unused;
+    char content_type[128];
+} shmring_header_t;
+
+static void sleep_ms(long ms)
+{
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000};
+
+    nanosleep(&ts, NULL);
+}
+
+/* waits up to 1 s for sequence to change from seen */
+static void wait_for_data(shmring_header_t *header, uint32_t seen)
+{
+#ifdef __linux__
+    struct timespec timeout = {1, 0};
+
+    syscall(SYS_futex, &header->sequence, FUTEX_WAIT, seen, &timeout, NULL, 0);
+#else
+    (void)header;
+    (void)seen;
+    sleep_ms(20);
+#endif
+}
+
+static int write_all(const char *data, size_t len)
+{
+    while (len) {
+        ssize_t ret = write(STDOUT_FILENO, data, len);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/* follows one ring until it ends, returns -1 if stdout went away */
+static int follow(const char *filename)
+{
+    struct stat st;
+    shmring_header_t *header;
+    char *map;
+    char *data;
+    char *buffer;
+    uint64_t position;
+    int fd;
+    int ret = 0;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(shmring_header_t)) {
+        close(fd);
+        return 0;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 0;
+
+    header = (shmring_header_t *)map;
+    if (memcmp(header->magic, SHMRING_MAGIC, sizeof(header->magic)) != 0 ||
+            header->header_size + header->size > (uint64_t)st.st_size) {
+        munmap(map, st.st_size);
+        return 0;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    data = map + header->header_size;
+    buffer = malloc(header->size);
+    if (!buffer) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    fprintf(stderr, "shmring-cat: following %s (%s)\n", filename, header->content_type);
+    position = __atomic_load_n(&header->written, __ATOMIC_ACQUIRE);
+
+    while (1) {
+        uint32_t seen = __atomic_load_n(&header->sequence, __ATOMIC_ACQUIRE);
+        uint64_t written = __atomic_load_n(&header->written, __ATOMIC_ACQUIRE);
+        uint64_t len = written - position;
+        uint64_t copied = 0;
+
+        if (len == 0) {
+            if (__atomic_load_n(&header->state, __ATOMIC_ACQUIRE) == SHMRING_STATE_ENDED)
+                break;
+            wait_for_data(header, seen);
+            continue;
+        }
+
+        if (len > header->size)
+            len = header->size;
+        while (copied < len) {
+            uint64_t offset = (position + copied) % header->size;
+            uint64_t piece = header->size - offset;
+
+            if (piece > len - copied)
+                piece = len - copied;
+            memcpy(buffer + copied, data + offset, piece);
+            copied += piece;
+        }
+
+        /* the copy has to be done before reserved is loaded again */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&header->reserved, __ATOMIC_ACQUIRE) - position > header->size) {
+            /* overwritten while copying, skip ahead */
+            fprintf(stderr, "shmring-cat: fell behind, skipping\n");
+            position = __atomic_load_n(&header->written, __ATOMIC_ACQUIRE);
+            continue;
+        }
+
+        if (write_all(buffer, len) != 0) {
+            ret = -1;
+            break;
+        }
+        position += len;
+    }
+
+    free(buffer);
+    munmap(map, st.st_size);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s shm-file\n", argv[0]);
+        return 1;
+    }
+
+    while (follow(argv[1]) == 0)
+        sleep_ms(500);
+
+    return 0;
+}
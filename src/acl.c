@@ -13,6 +13,7 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 #include "acl.h"
 #include "admin.h"
@@ -21,6 +22,9 @@
 #include <stdio.h>
 
 #define MAX_ADMIN_COMMANDS 32
+/* admin commands with an ID below this, the built-in ones, have their
+ * policy decided in advance */
+#define ACL_ADMIN_DECIDED_COMMANDS  128
 
 /* define internal structure */
 struct acl_tag {
@@ -40,6 +44,9 @@ struct acl_tag {
     } admin_commands[MAX_ADMIN_COMMANDS];
     size_t admin_commands_len;
     acl_policy_t admin_command_policy;
+    /* one bit per command below ACL_ADMIN_DECIDED_COMMANDS, set if it is
+     * allowed, rebuilt whenever the lists above change */
+    uint64_t admin_allowed[ACL_ADMIN_DECIDED_COMMANDS / 64];
 
     /* web/ interface */
     acl_policy_t web_policy;
@@ -111,7 +118,7 @@ acl_t *acl_new(void)
     acl_set_method_str(ret, ACL_POLICY_ALLOW, "get,options");
 
     acl_set_admin_str(ret, ACL_POLICY_DENY, "*");
-    acl_set_admin_str(ret, ACL_POLICY_ALLOW, "buildm3u,publicstats,publicstats.json");
+    acl_set_admin_str(ret, ACL_POLICY_ALLOW, "buildm3u,publicstats,publicstats.json,publicstats.events");
 
     acl_set_web_policy(ret, ACL_POLICY_ALLOW);
 
@@ -283,6 +290,27 @@ acl_policy_t acl_test_method(acl_t * acl, httpp_request_type_e method)
 }
 
 /* admin/ interface specific functions */
+static acl_policy_t acl_lookup_admin(acl_t *acl, admin_command_id_t command)
+{
+    size_t i;
+
+    for (i = 0; i < acl->admin_commands_len; i++)
+        if (acl->admin_commands[i].command == command)
+            return acl->admin_commands[i].policy;
+
+    return acl->admin_command_policy;
+}
+
+static void acl_decide_admin(acl_t *acl)
+{
+    admin_command_id_t command;
+
+    memset(acl->admin_allowed, 0, sizeof(acl->admin_allowed));
+    for (command = 0; command < ACL_ADMIN_DECIDED_COMMANDS; command++)
+        if (acl_lookup_admin(acl, command) == ACL_POLICY_ALLOW)
+            acl->admin_allowed[command / 64] |= (uint64_t)1 << (command % 64);
+}
+
 int acl_set_admin_str__callbck(acl_t        *acl,
                                acl_policy_t policy,
                                const char   *str)
@@ -302,6 +330,7 @@ int acl_set_admin_str__callbck(acl_t        *acl,
         write_i++; /* no need to check bounds here as this loop can only compress the array */
        }
        acl->admin_commands_len = write_i;
+       acl_decide_admin(acl);
        return 0;
    }
 
@@ -311,21 +340,19 @@ int acl_set_admin_str__callbck(acl_t        *acl,
    acl->admin_commands[acl->admin_commands_len].command = command;
    acl->admin_commands[acl->admin_commands_len].policy  = policy;
    acl->admin_commands_len++;
+   acl_decide_admin(acl);
    return 0;
 }
 
 acl_policy_t acl_test_admin(acl_t *acl, admin_command_id_t command)
 {
-    size_t i;
-
     if (!acl)
         return ACL_POLICY_ERROR;
 
-    for (i = 0; i < acl->admin_commands_len; i++)
-        if (acl->admin_commands[i].command == command)
-            return acl->admin_commands[i].policy;
+    if (command >= 0 && command < ACL_ADMIN_DECIDED_COMMANDS)
+        return (acl->admin_allowed[command / 64] >> (command % 64)) & 1 ? ACL_POLICY_ALLOW : ACL_POLICY_DENY;
 
-    return acl->admin_command_policy;
+    return acl_lookup_admin(acl, command);
 }
 
 /* web/ interface specific functions */
@@ -19,7 +19,9 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <inttypes.h>
 #include <time.h>
+#include <fnmatch.h>
 #include <libxml/xmlmemory.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
@@ -59,6 +61,7 @@
 #include "common/net/sock.h"
 
 #include "admin.h"
+#include "atomic.h"
 #include "compat.h"
 #include "cfgfile.h"
 #include "connection.h"
@@ -80,6 +83,11 @@
 #include "logging.h"
 #include "auth.h"
 #include "acl.h"
+#include "matchfile.h"
+#include "relaymux.h"
+#include "cluster.h"
+#include "memgov.h"
+#include "flightrec.h"
 #ifdef _WIN32
 #define snprintf _snprintf
 #endif
@@ -108,6 +116,9 @@
 #define METADATA_RAW_REQUEST                "metadata"
 #define METADATA_HTML_REQUEST               "metadata.xsl"
 #define METADATA_JSON_REQUEST               "metadata.json"
+#define MULTIMETADATA_RAW_REQUEST           "multimetadata"
+#define MULTIMETADATA_HTML_REQUEST          "multimetadata.xsl"
+#define MULTIMETADATA_JSON_REQUEST          "multimetadata.json"
 #define LISTCLIENTS_RAW_REQUEST             "listclients"
 #define LISTCLIENTS_HTML_REQUEST            "listclients.xsl"
 #define LISTCLIENTS_JSON_REQUEST            "listclients.json"
@@ -116,6 +127,10 @@
 #define STATS_JSON_REQUEST                  "stats.json"
 #define PUBLICSTATS_RAW_REQUEST             "publicstats"
 #define PUBLICSTATS_JSON_REQUEST            "publicstats.json"
+#define STATS_EVENTS_REQUEST                "stats.events"
+#define PUBLICSTATS_EVENTS_REQUEST          "publicstats.events"
+#define METRICS_PLAINTEXT_REQUEST           "metrics"
+#define FLIGHTRECORDER_REQUEST              "flightrecorder"
 #define QUEUE_RELOAD_RAW_REQUEST            "reloadconfig"
 #define QUEUE_RELOAD_HTML_REQUEST           "reloadconfig.xsl"
 #define QUEUE_RELOAD_JSON_REQUEST           "reloadconfig.json"
@@ -126,6 +141,8 @@
 #define STREAMLIST_HTML_REQUEST             "streamlist.xsl"
 #define STREAMLIST_JSON_REQUEST             "streamlist.json"
 #define STREAMLIST_PLAINTEXT_REQUEST        "streamlist.txt"
+#define RELAYMUX_REQUEST                    "relaymux"
+#define CLUSTERLOAD_REQUEST                 "clusterload"
 #define LISTENSOCKETLIST_RAW_REQUEST        "listensocketlist"
 #define LISTENSOCKETLIST_HTML_REQUEST       "listensocketlist.xsl"
 #define MOVECLIENTS_RAW_REQUEST             "moveclients"
@@ -165,21 +182,33 @@ typedef enum {
     ADMIN_DASHBOARD_STATUS_ERROR = 2
 } admin_dashboard_status_t;
 
+/* groups a route may have */
+#define ADMIN_MAX_ROUTE_GROUPS  8
+
 typedef struct {
     const char *prefix;
     size_t length;
     const admin_command_handler_t *handlers;
+    /* resourcematch_t * of each route, compiled on first use */
+    void * volatile matchers;
 } admin_command_table_t;
 
 static void command_default_selector    (client_t *client, source_t *source, admin_format_t response);
 static void command_fallback            (client_t *client, source_t *source, admin_format_t response);
 static void command_metadata            (client_t *client, source_t *source, admin_format_t response);
 static void command_shoutcast_metadata  (client_t *client, source_t *source, admin_format_t response);
+static void command_multi_metadata      (client_t *client, source_t *source, admin_format_t response);
 static void command_show_listeners      (client_t *client, source_t *source, admin_format_t response);
 static void command_stats               (client_t *client, source_t *source, admin_format_t response);
 static void command_public_stats        (client_t *client, source_t *source, admin_format_t response);
+static void command_stats_events        (client_t *client, source_t *source, admin_format_t response);
+static void command_public_stats_events (client_t *client, source_t *source, admin_format_t response);
+static void command_metrics             (client_t *client, source_t *source, admin_format_t response);
+static void command_flightrecorder      (client_t *client, source_t *source, admin_format_t response);
 static void command_queue_reload        (client_t *client, source_t *source, admin_format_t response);
 static void command_list_mounts         (client_t *client, source_t *source, admin_format_t response);
+static void command_relaymux            (client_t *client, source_t *source, admin_format_t response);
+static void command_clusterload         (client_t *client, source_t *source, admin_format_t response);
 static void command_list_listen_sockets (client_t *client, source_t *source, admin_format_t response);
 static void command_move_clients        (client_t *client, source_t *source, admin_format_t response);
 static void command_kill_client         (client_t *client, source_t *source, admin_format_t response);
@@ -201,6 +230,9 @@ static const admin_command_handler_t handlers[] = {
     { METADATA_HTML_REQUEST,                ADMINTYPE_MOUNT,        ADMIN_FORMAT_HTML,          ADMINSAFE_UNSAFE,   command_metadata, NULL},
     { METADATA_JSON_REQUEST,                ADMINTYPE_MOUNT,        ADMIN_FORMAT_JSON,          ADMINSAFE_UNSAFE,   command_metadata, NULL},
     { SHOUTCAST_METADATA_REQUEST,           ADMINTYPE_MOUNT,        ADMIN_FORMAT_HTML,          ADMINSAFE_UNSAFE,   command_shoutcast_metadata, NULL},
+    { MULTIMETADATA_RAW_REQUEST,            ADMINTYPE_GENERAL,      ADMIN_FORMAT_RAW,           ADMINSAFE_UNSAFE,   command_multi_metadata, NULL},
+    { MULTIMETADATA_HTML_REQUEST,           ADMINTYPE_GENERAL,      ADMIN_FORMAT_HTML,          ADMINSAFE_UNSAFE,   command_multi_metadata, NULL},
+    { MULTIMETADATA_JSON_REQUEST,           ADMINTYPE_GENERAL,      ADMIN_FORMAT_JSON,          ADMINSAFE_UNSAFE,   command_multi_metadata, NULL},
     { LISTCLIENTS_RAW_REQUEST,              ADMINTYPE_MOUNT,        ADMIN_FORMAT_RAW,           ADMINSAFE_SAFE,     command_show_listeners, NULL},
     { LISTCLIENTS_HTML_REQUEST,             ADMINTYPE_MOUNT,        ADMIN_FORMAT_HTML,          ADMINSAFE_SAFE,     command_show_listeners, NULL},
     { LISTCLIENTS_JSON_REQUEST,             ADMINTYPE_MOUNT,        ADMIN_FORMAT_JSON,          ADMINSAFE_SAFE,     command_show_listeners, NULL},
@@ -210,6 +242,10 @@ static const admin_command_handler_t handlers[] = {
     { "stats.xml",                          ADMINTYPE_HYBRID,       ADMIN_FORMAT_RAW,           ADMINSAFE_SAFE,     command_stats, NULL},
     { PUBLICSTATS_RAW_REQUEST,              ADMINTYPE_HYBRID,       ADMIN_FORMAT_RAW,           ADMINSAFE_SAFE,     command_public_stats, NULL},
     { PUBLICSTATS_JSON_REQUEST,             ADMINTYPE_HYBRID,       ADMIN_FORMAT_JSON,          ADMINSAFE_SAFE,     command_public_stats, NULL},
+    { STATS_EVENTS_REQUEST,                 ADMINTYPE_GENERAL,      ADMIN_FORMAT_PLAINTEXT,     ADMINSAFE_SAFE,     command_stats_events, NULL},
+    { PUBLICSTATS_EVENTS_REQUEST,           ADMINTYPE_GENERAL,      ADMIN_FORMAT_PLAINTEXT,     ADMINSAFE_SAFE,     command_public_stats_events, NULL},
+    { METRICS_PLAINTEXT_REQUEST,            ADMINTYPE_GENERAL,      ADMIN_FORMAT_PLAINTEXT,     ADMINSAFE_SAFE,     command_metrics, NULL},
+    { FLIGHTRECORDER_REQUEST,               ADMINTYPE_GENERAL,      ADMIN_FORMAT_RAW,           ADMINSAFE_SAFE,     command_flightrecorder, NULL},
     { QUEUE_RELOAD_RAW_REQUEST,             ADMINTYPE_GENERAL,      ADMIN_FORMAT_RAW,           ADMINSAFE_UNSAFE,   command_queue_reload, NULL},
     { QUEUE_RELOAD_HTML_REQUEST,            ADMINTYPE_GENERAL,      ADMIN_FORMAT_HTML,          ADMINSAFE_UNSAFE,   command_queue_reload, NULL},
     { QUEUE_RELOAD_JSON_REQUEST,            ADMINTYPE_GENERAL,      ADMIN_FORMAT_JSON,          ADMINSAFE_UNSAFE,   command_queue_reload, NULL},
@@ -220,6 +256,8 @@ static const admin_command_handler_t handlers[] = {
     { STREAMLIST_PLAINTEXT_REQUEST,         ADMINTYPE_GENERAL,      ADMIN_FORMAT_PLAINTEXT,     ADMINSAFE_SAFE,     command_list_mounts, NULL},
     { STREAMLIST_HTML_REQUEST,              ADMINTYPE_GENERAL,      ADMIN_FORMAT_HTML,          ADMINSAFE_SAFE,     command_list_mounts, NULL},
     { STREAMLIST_JSON_REQUEST,              ADMINTYPE_GENERAL,      ADMIN_FORMAT_JSON,          ADMINSAFE_SAFE,     command_list_mounts, NULL},
+    { RELAYMUX_REQUEST,                     ADMINTYPE_GENERAL,      ADMIN_FORMAT_RAW,           ADMINSAFE_SAFE,     command_relaymux, NULL},
+    { CLUSTERLOAD_REQUEST,                  ADMINTYPE_GENERAL,      ADMIN_FORMAT_PLAINTEXT,     ADMINSAFE_SAFE,     command_clusterload, NULL},
     { LISTENSOCKETLIST_RAW_REQUEST,         ADMINTYPE_GENERAL,      ADMIN_FORMAT_RAW,           ADMINSAFE_SAFE,     command_list_listen_sockets, NULL},
     { LISTENSOCKETLIST_HTML_REQUEST,        ADMINTYPE_GENERAL,      ADMIN_FORMAT_HTML,          ADMINSAFE_SAFE,     command_list_listen_sockets, NULL},
     { MOVECLIENTS_RAW_REQUEST,              ADMINTYPE_MOUNT,        ADMIN_FORMAT_RAW,           ADMINSAFE_HYBRID,   command_move_clients, NULL},
@@ -339,6 +377,67 @@ static inline size_t admin_get_index_by_command(admin_command_id_t command)
     return command & 0x0FFFF;
 }
 
+/* Returns the compiled routes of table, NULL if they can not be compiled */
+static resourcematch_t **admin_get_matchers(const admin_command_table_t *table)
+{
+    admin_command_table_t *cache = (admin_command_table_t *)table;
+    resourcematch_t **matchers = atomic_ptr_load(&cache->matchers);
+    size_t i;
+
+    if (matchers)
+        return matchers;
+
+    matchers = calloc(table->length, sizeof(*matchers));
+    if (!matchers)
+        return NULL;
+
+    for (i = 0; i < table->length; i++) {
+        matchers[i] = resourcematch_compile(table->handlers[i].route);
+        if (!matchers[i] || resourcematch_get_groups(matchers[i]) > ADMIN_MAX_ROUTE_GROUPS) {
+            ICECAST_LOG_ERROR("Invalid admin route %#H", table->handlers[i].route);
+            while (i > 0)
+                resourcematch_free(matchers[i--]);
+            resourcematch_free(matchers[0]);
+            free(matchers);
+            return NULL;
+        }
+    }
+
+    /* another thread may have been faster */
+    if (!atomic_ptr_cas(&cache->matchers, NULL, matchers)) {
+        for (i = 0; i < table->length; i++)
+            resourcematch_free(matchers[i]);
+        free(matchers);
+        matchers = atomic_ptr_load(&cache->matchers);
+    }
+
+    return matchers;
+}
+
+static void admin_free_matchers(admin_command_table_t *table)
+{
+    resourcematch_t **matchers = atomic_ptr_exchange(&table->matchers, NULL);
+    size_t i;
+
+    if (!matchers)
+        return;
+
+    for (i = 0; i < table->length; i++)
+        resourcematch_free(matchers[i]);
+    free(matchers);
+}
+
+/* Matches suffix against the route at index of table */
+static resourcematch_result_t admin_match_route(const admin_command_table_t *table, size_t index, const char *suffix, resourcematch_extract_t *extract)
+{
+    resourcematch_t **matchers = admin_get_matchers(table);
+
+    if (!matchers)
+        return RESOURCEMATCH_ERROR;
+
+    return resourcematch_exec(matchers[index], suffix, extract);
+}
+
 admin_command_id_t admin_get_command(const char *command)
 {
     size_t i;
@@ -356,7 +455,7 @@ admin_command_id_t admin_get_command(const char *command)
     }
 
     for (i = 0; i < table->length; i++)
-        if (resourcematch_match(table->handlers[i].route, suffix, NULL) == RESOURCEMATCH_MATCH)
+        if (admin_match_route(table, i, suffix, NULL) == RESOURCEMATCH_MATCH)
             return admin_get_command_by_table_and_index(table, i);
 
     return ADMIN_COMMAND_ERROR;
@@ -418,6 +517,7 @@ int admin_command_table_unregister(const char *prefix)
 
     for (i = 0; i < (sizeof(command_tables)/sizeof(*command_tables)); i++) {
         if (command_tables[i].prefix != NULL && strcmp(command_tables[i].prefix, prefix) == 0) {
+            admin_free_matchers(&(command_tables[i]));
             memset(&(command_tables[i]), 0, sizeof(command_tables[i]));
             return 0;
         }
@@ -601,11 +701,57 @@ void admin_send_response(xmlDocPtr       doc,
 }
 
 
+/* writes what xml2json would render for the document of admin_send_response_simple() */
+static int admin_send_response_simple_json(client_t *client, const char *message, int success)
+{
+    json_renderer_t *renderer = json_renderer_create(JSON_RENDERER_FLAGS_NONE);
+    xmlNodePtr modules;
+    char *json;
+
+    if (!renderer)
+        return -1;
+
+    json_renderer_begin(renderer, JSON_ELEMENT_TYPE_ARRAY);
+    json_renderer_begin(renderer, JSON_ELEMENT_TYPE_OBJECT);
+    json_renderer_write_key(renderer, "name", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_string(renderer, "iceresponse", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_key(renderer, "ns", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_string(renderer, XMLNS_LEGACY_RESPONSE, JSON_RENDERER_FLAGS_NONE);
+    json_renderer_end(renderer);
+    json_renderer_begin(renderer, JSON_ELEMENT_TYPE_OBJECT);
+
+    modules = module_container_get_modulelist_as_xml(global.modulecontainer);
+    if (modules) {
+        json_renderer_write_key(renderer, "modules", JSON_RENDERER_FLAGS_NONE);
+        xml2json_render_node(renderer, NULL, modules, XMLNS_LEGACY_RESPONSE);
+        xmlFreeNode(modules);
+    }
+
+    if (message && *message) {
+        json_renderer_write_key(renderer, "message", JSON_RENDERER_FLAGS_NONE);
+        json_renderer_write_string(renderer, message, JSON_RENDERER_FLAGS_NONE);
+    }
+    json_renderer_write_key(renderer, "success", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_boolean(renderer, success);
+
+    json = json_renderer_finish(&renderer);
+    if (!json)
+        return -1;
+
+    client_send_buffer(client, 200, "application/json", "utf-8", json, -1, "Warning: 299 - \"JSON rendering is experimental\"\r\n");
+    free(json);
+
+    return 0;
+}
+
 static void admin_send_response_simple(client_t *client, source_t *source, admin_format_t response, const char *message, int success)
 {
     xmlDocPtr doc;
     xmlNodePtr node;
 
+    if (response == ADMIN_FORMAT_JSON && admin_send_response_simple_json(client, message, success) == 0)
+        return;
+
     doc = xmlNewDoc (XMLSTR("1.0"));
     node = admin_build_rootnode(doc, "iceresponse");
     xmlNewTextChild(node, NULL, XMLSTR("message"), XMLSTR(message));
@@ -701,7 +847,8 @@ void admin_handle_request(client_t *client, const char *uri)
             if (handler->function) {
                 handler->function(client, source, format);
             } else {
-                resourcematch_extract_t *extract = NULL;
+                resourcematch_group_t group[ADMIN_MAX_ROUTE_GROUPS];
+                resourcematch_extract_t extract = {ADMIN_MAX_ROUTE_GROUPS, group};
                 const char *suffix = strchr(uri, '/');
 
                 if (!suffix) {
@@ -709,9 +856,8 @@ void admin_handle_request(client_t *client, const char *uri)
                 } else {
                     suffix++;
 
-                    if (resourcematch_match(handler->route, suffix, &extract) == RESOURCEMATCH_MATCH) {
-                        handler->function_with_parameters(client, source, format, extract);
-                        resourcematch_extract_free(extract);
+                    if (admin_match_route(admin_get_table(client->admin_command), admin_get_index_by_command(client->admin_command), suffix, &extract) == RESOURCEMATCH_MATCH) {
+                        handler->function_with_parameters(client, source, format, &extract);
                     } else {
                         client_send_error_by_id(client, ICECAST_ERROR_ADMIN_UNRECOGNISED_COMMAND);
                     }
@@ -762,6 +908,89 @@ static void command_default_selector    (client_t *client, source_t *source, adm
 }
 
 
+/* Selects listeners for listclients and the bulk forms of killclient and
+ * moveclients. A listener must match all of the given parameters.
+ */
+typedef struct {
+    time_t now;
+    /* NULL or 0 to not filter on it */
+    const char *ip;
+    bool has_prefix;
+    matchfile_prefix_t prefix;
+    const char *useragent;
+    const char *username;
+    unsigned int min_connected;
+    unsigned int max_connected;
+    size_t matched;
+} admin_client_filter_t;
+
+/* returns 1 if a filter was given, 0 if none was, and -1 if it is invalid */
+static int admin_client_filter_parse(client_t *client, admin_client_filter_t *filter)
+{
+    const char *tmp;
+
+    memset(filter, 0, sizeof(*filter));
+    filter->now = time(NULL);
+
+    /* an address with a /prefix length, otherwise the start of one */
+    if ((COMMAND_OPTIONAL(client, "ip", filter->ip)) && strchr(filter->ip, '/')) {
+        if (matchfile_prefix_parse(&(filter->prefix), filter->ip) != 0)
+            return -1;
+        filter->has_prefix = true;
+    }
+    COMMAND_OPTIONAL(client, "useragent", filter->useragent);
+    COMMAND_OPTIONAL(client, "username", filter->username);
+    COMMAND_OPTIONAL(client, "minconnected", tmp);
+    filter->min_connected = util_str_to_unsigned_int(tmp, 0);
+    COMMAND_OPTIONAL(client, "maxconnected", tmp);
+    filter->max_connected = util_str_to_unsigned_int(tmp, 0);
+
+    return filter->ip || filter->useragent || filter->username || filter->min_connected || filter->max_connected;
+}
+
+static int admin_client_filter_match(client_t *client, void *userdata)
+{
+    admin_client_filter_t *filter = userdata;
+    unsigned long connected = (unsigned long)(filter->now - client->con->con_time);
+
+    if (filter->has_prefix) {
+        if (!matchfile_prefix_match(&(filter->prefix), client->con->ip))
+            return 0;
+    } else if (filter->ip && strncmp(client->con->ip, filter->ip, strlen(filter->ip)) != 0) {
+        return 0;
+    }
+
+    if (filter->useragent) {
+        const char *useragent = httpp_getvar(client->parser, "user-agent");
+        if (!useragent || !strstr(useragent, filter->useragent))
+            return 0;
+    }
+
+    if (filter->username && (!client->username || strcmp(client->username, filter->username) != 0))
+        return 0;
+
+    if (filter->min_connected && connected < filter->min_connected)
+        return 0;
+    if (filter->max_connected && connected > filter->max_connected)
+        return 0;
+
+    filter->matched++;
+    return 1;
+}
+
+static int admin_kill_client_filtered(client_t *client, void *userdata)
+{
+    if (admin_client_filter_match(client, userdata)) {
+        /* This tags it for removal on the next iteration of the main source
+         * loop
+         */
+        client->con->discon_reason = "killed";
+        client->con->error = 1;
+    }
+
+    return 0;
+}
+
 static void command_move_clients(client_t   *client,
                                  source_t   *source,
                                  admin_format_t response)
@@ -773,6 +1002,8 @@ static void command_move_clients(client_t   *client,
     source_t *dest;
     char buf[255];
     int parameters_passed = 0;
+    admin_client_filter_t filter;
+    int filtered;
 
     ICECAST_LOG_DEBUG("Doing optional check");
     if((COMMAND_OPTIONAL(client, "destination", dest_source))) {
@@ -784,6 +1015,7 @@ static void command_move_clients(client_t   *client,
         idtext = NULL;
     }
     COMMAND_OPTIONAL(client, "direction", directiontext);
+    filtered = idtext ? 0 : admin_client_filter_parse(client, &filter);
 
     ICECAST_LOG_DEBUG("Done optional check (%d)", parameters_passed);
     if (!parameters_passed) {
@@ -802,6 +1034,11 @@ static void command_move_clients(client_t   *client,
     if (admin_enforce_unsafe(client))
         return;
 
+    if (filtered < 0) {
+        client_send_error_by_id(client, ICECAST_ERROR_ADMIN_MISSING_PARAMETER);
+        return;
+    }
+
     dest = source_find_mount(dest_source);
 
     if (dest == NULL) {
@@ -821,10 +1058,17 @@ static void command_move_clients(client_t   *client,
 
     ICECAST_LOG_INFO("source is \"%s\", destination is \"%s\"", source->mount, dest->mount);
 
-    source_move_clients(source, dest, idtext ? &id : NULL, navigation_str_to_direction(directiontext, NAVIGATION_DIRECTION_REPLACE_ALL));
+    if (filtered) {
+        size_t moved = source_move_clients_matching(source, dest, admin_client_filter_match, &filter, navigation_str_to_direction(directiontext, NAVIGATION_DIRECTION_REPLACE_ALL));
+
+        snprintf(buf, sizeof(buf), "%zu clients moved from %s to %s",
+            moved, source->mount, dest_source);
+    } else {
+        source_move_clients(source, dest, idtext ? &id : NULL, navigation_str_to_direction(directiontext, NAVIGATION_DIRECTION_REPLACE_ALL));
 
-    snprintf(buf, sizeof(buf), "Clients moved from %s to %s",
-        source->mount, dest_source);
+        snprintf(buf, sizeof(buf), "Clients moved from %s to %s",
+            source->mount, dest_source);
+    }
 
     admin_send_response_simple(client, source, response, buf, 1);
 }
@@ -838,8 +1082,7 @@ static inline xmlNodePtr __add_listener(client_t        *client,
     xmlNodePtr node;
     char buf[22];
 
-    /* TODO: kh has support for a child node "lag". We should add that.
-     * BEFORE RELEASE NEXT DOCUMENT #2097: Changed case of child nodes to lower case.
+    /* BEFORE RELEASE NEXT DOCUMENT #2097: Changed case of child nodes to lower case.
      * The case of <ID>, <IP>, <UserAgent> and <Connected> got changed to lower case.
      */
 
@@ -869,6 +1112,10 @@ static inline xmlNodePtr __add_listener(client_t        *client,
     snprintf(buf, sizeof(buf), "%lu", (unsigned long)(now - client->con->con_time));
     xmlNewTextChild(node, NULL, XMLSTR(mode == OMODE_LEGACY ? "Connected" : "connected"), XMLSTR(buf));
 
+    /* bytes behind the newest data at the last sample */
+    snprintf(buf, sizeof(buf), "%" PRIu64, client->lag);
+    xmlNewTextChild(node, NULL, XMLSTR("lag"), XMLSTR(buf));
+
     if (client->username)
         xmlNewTextChild(node, NULL, XMLSTR("username"), XMLSTR(client->username));
 
@@ -894,20 +1141,46 @@ static inline xmlNodePtr __add_listener(client_t        *client,
     return node;
 }
 
+typedef struct {
+    xmlNodePtr parent;
+    operation_mode mode;
+    /* listeners matching the filter to skip and the most to add, 0 for all */
+    size_t offset;
+    size_t limit;
+    size_t added;
+    admin_client_filter_t filter;
+} admin_listeners_t;
+
+static int __add_listener_filtered(client_t *client, void *userdata)
+{
+    admin_listeners_t *listeners = userdata;
+
+    if (!admin_client_filter_match(client, &(listeners->filter)))
+        return 0;
+
+    if (listeners->offset) {
+        listeners->offset--;
+        return 0;
+    }
+
+    __add_listener(client, listeners->parent, listeners->filter.now, listeners->mode);
+    listeners->added++;
+
+    return listeners->limit && listeners->added >= listeners->limit;
+}
+
 void admin_add_listeners_to_mount(source_t          *source,
                                   xmlNodePtr        parent,
                                   operation_mode    mode)
 {
-    time_t now = time(NULL);
-    avl_node *client_node;
+    admin_listeners_t listeners;
 
-    avl_tree_rlock(source->client_tree);
-    client_node = avl_get_first(source->client_tree);
-    while(client_node) {
-        __add_listener((client_t *)client_node->key, parent, now, mode);
-        client_node = avl_get_next(client_node);
-    }
-    avl_tree_unlock(source->client_tree);
+    memset(&listeners, 0, sizeof(listeners));
+    listeners.parent = parent;
+    listeners.mode = mode;
+    listeners.filter.now = time(NULL);
+
+    source_walk_listeners(source, __add_listener_filtered, &listeners);
 }
 
 static void command_show_listeners(client_t *client,
@@ -916,8 +1189,23 @@ static void command_show_listeners(client_t *client,
 {
     xmlDocPtr doc;
     xmlNodePtr node, srcnode;
+    admin_listeners_t listeners;
+    const char *tmp;
     char buf[22];
 
+    memset(&listeners, 0, sizeof(listeners));
+    listeners.mode = client->mode;
+
+    if (admin_client_filter_parse(client, &(listeners.filter)) < 0) {
+        client_send_error_by_id(client, ICECAST_ERROR_ADMIN_MISSING_PARAMETER);
+        return;
+    }
+
+    COMMAND_OPTIONAL(client, "offset", tmp);
+    listeners.offset = util_str_to_unsigned_int(tmp, 0);
+    COMMAND_OPTIONAL(client, "limit", tmp);
+    listeners.limit = util_str_to_unsigned_int(tmp, 0);
+
     doc = xmlNewDoc(XMLSTR("1.0"));
     node = admin_build_rootnode(doc, "icestats");
     srcnode = xmlNewChild(node, NULL, XMLSTR("source"), NULL);
@@ -929,7 +1217,8 @@ static void command_show_listeners(client_t *client,
     /* BEFORE RELEASE NEXT DOCUMENT #2097: Changed "Listeners" to lower case. */
     xmlNewTextChild(srcnode, NULL, XMLSTR(client->mode == OMODE_LEGACY ? "Listeners" : "listeners"), XMLSTR(buf));
 
-    admin_add_listeners_to_mount(source, srcnode, client->mode);
+    listeners.parent = srcnode;
+    source_walk_listeners(source, __add_listener_filtered, &listeners);
 
     admin_send_response(doc, client, response,
         LISTCLIENTS_HTML_REQUEST);
@@ -1119,7 +1408,21 @@ static void command_kill_client(client_t *client,
     client_t *listener;
     char buf[50] = "";
 
-    COMMAND_REQUIRE(client, "id", idtext);
+    if (!(COMMAND_OPTIONAL(client, "id", idtext))) {
+        admin_client_filter_t filter;
+
+        if (admin_client_filter_parse(client, &filter) != 1) {
+            client_send_error_by_id(client, ICECAST_ERROR_ADMIN_MISSING_PARAMETER);
+            return;
+        }
+
+        /* tagged in batches, so the source is not held up for long */
+        source_walk_listeners(source, admin_kill_client_filtered, &filter);
+        ICECAST_LOG_INFO("Admin request: %zu clients removed from %s", filter.matched, source->mount);
+        snprintf(buf, sizeof(buf), "%zu clients removed", filter.matched);
+        admin_send_response_simple(client, source, response, buf, 1);
+        return;
+    }
 
     id = atoi(idtext);
 
@@ -1133,6 +1436,7 @@ static void command_kill_client(client_t *client,
         /* This tags it for removal on the next iteration of the main source
          * loop
          */
+        listener->con->discon_reason = "killed";
         listener->con->error = 1;
         memset(buf, '\000', sizeof(buf));
         snprintf(buf, sizeof(buf)-1, "Client %d removed", id);
@@ -1171,13 +1475,46 @@ static void command_fallback(client_t *client,
     html_success(client, source, response, "Fallback configured");
 }
 
+/* Passes an updinfo request on to the format of source. Returns 0 on
+ * success or -1 if the format does not take metadata updates. */
+static int admin_metadata_update(source_t *source, const char *song, const char *title, const char *artist, const char *charset, const char *url)
+{
+    format_plugin_t *plugin = source->format;
+
+    if (!plugin || !plugin->set_tag)
+        return -1;
+
+    if (song) {
+        if (artist || title) {
+            ICECAST_LOG_WARN("Metadata request mountpoint %H contains \"song\" but also \"artist\" and/or \"title\"", source->mount);
+        }
+
+        plugin->set_tag (plugin, "song", song, charset);
+        ICECAST_LOG_INFO("Metadata on mountpoint %H changed to \"%H\"", source->mount, song);
+    } else {
+        if (artist && title) {
+            plugin->set_tag(plugin, "title", title, charset);
+            plugin->set_tag(plugin, "artist", artist, charset);
+            ICECAST_LOG_INFO("Metadata on mountpoint %H changed to \"%H - %H\"",
+                source->mount, artist, title);
+        }
+    }
+    if (url) {
+        plugin->set_tag(plugin, "url", url, charset);
+        ICECAST_LOG_INFO("Metadata (url) on mountpoint %H changed to \"%H\"", source->mount, url);
+    }
+    /* updates are now done, let them be pushed into the stream */
+    plugin->set_tag (plugin, NULL, NULL, NULL);
+
+    return 0;
+}
+
 static void command_metadata(client_t *client,
                              source_t *source,
                              admin_format_t response)
 {
     const char *action;
     const char *song, *title, *artist, *charset, *url;
-    format_plugin_t *plugin;
     int same_ip = 1;
 
     ICECAST_LOG_DEBUG("Got metadata update request");
@@ -1199,34 +1536,11 @@ static void command_metadata(client_t *client,
         return;
     }
 
-    plugin = source->format;
     if (source->client && strcmp(client->con->ip, source->client->con->ip) != 0)
         if (response == ADMIN_FORMAT_RAW && acl_test_admin(client->acl, client->admin_command) != ACL_POLICY_ALLOW)
             same_ip = 0;
 
-    if (same_ip && plugin && plugin->set_tag) {
-        if (song) {
-            if (artist || title) {
-                ICECAST_LOG_WARN("Metadata request mountpoint %H contains \"song\" but also \"artist\" and/or \"title\"", source->mount);
-            }
-
-            plugin->set_tag (plugin, "song", song, charset);
-            ICECAST_LOG_INFO("Metadata on mountpoint %H changed to \"%H\"", source->mount, song);
-        } else {
-            if (artist && title) {
-                plugin->set_tag(plugin, "title", title, charset);
-                plugin->set_tag(plugin, "artist", artist, charset);
-                ICECAST_LOG_INFO("Metadata on mountpoint %H changed to \"%H - %H\"",
-                    source->mount, artist, title);
-            }
-        }
-        if (url) {
-            plugin->set_tag(plugin, "url", url, charset);
-            ICECAST_LOG_INFO("Metadata (url) on mountpoint %H changed to \"%H\"", source->mount, url);
-        }
-        /* updates are now done, let them be pushed into the stream */
-        plugin->set_tag (plugin, NULL, NULL, NULL);
-    } else {
+    if (!same_ip || admin_metadata_update(source, song, title, artist, charset, url) != 0) {
         ICECAST_LOG_ERROR("Got legacy shoutcast-style metadata update command "
             "on source that does not accept it at mountpoint %H", source->mount);
 
@@ -1237,6 +1551,54 @@ static void command_metadata(client_t *client,
     admin_send_response_simple(client, source, response, "Metadata update successful", 1);
 }
 
+/* The same update as metadata for all running mounts matching the pattern
+ * given as mounts, for stations that carry the same song on many mounts.
+ * Mounts with the same resulting ICY metadata share one block of it.
+ */
+static void command_multi_metadata(client_t *client,
+                                   source_t *source,
+                                   admin_format_t response)
+{
+    const char *action;
+    const char *pattern;
+    const char *song, *title, *artist, *charset, *url;
+    avl_node *node;
+    size_t updated = 0;
+    char buf[64];
+
+    (void)source;
+
+    ICECAST_LOG_DEBUG("Got multi mount metadata update request");
+
+    COMMAND_REQUIRE(client, "mounts", pattern);
+    COMMAND_REQUIRE(client, "mode", action);
+    COMMAND_OPTIONAL(client, "song", song);
+    COMMAND_OPTIONAL(client, "title", title);
+    COMMAND_OPTIONAL(client, "artist", artist);
+    COMMAND_OPTIONAL(client, "charset", charset);
+    COMMAND_OPTIONAL(client, "url", url);
+
+    if (strcmp (action, "updinfo") != 0) {
+        admin_send_response_simple(client, NULL, response, "No such action", 0);
+        return;
+    }
+
+    avl_tree_rlock(global.source_tree);
+    for (node = avl_get_first(global.source_tree); node; node = avl_get_next(node)) {
+        source_t *current = node->key;
+
+        if (!current->running || fnmatch(pattern, current->mount, FNM_PATHNAME) != 0)
+            continue;
+
+        if (admin_metadata_update(current, song, title, artist, charset, url) == 0)
+            updated++;
+    }
+    avl_tree_unlock(global.source_tree);
+
+    snprintf(buf, sizeof(buf), "Metadata updated on %zu mounts", updated);
+    admin_send_response_simple(client, NULL, response, buf, 1);
+}
+
 static void command_shoutcast_metadata(client_t *client,
                                        source_t *source,
                                        admin_format_t response)
@@ -1285,29 +1647,131 @@ static void command_shoutcast_metadata(client_t *client,
     }
 }
 
-static void command_stats(client_t *client, source_t *source, admin_format_t response)
+/* XML and JSON come prerendered from the snapshots of stats_get_rendered() */
+static void admin_send_stats(client_t *client, admin_format_t response, unsigned int flags, const char *mount)
 {
-    unsigned int flags = (source) ? STATS_XML_FLAG_SHOW_HIDDEN|STATS_XML_FLAG_SHOW_LISTENERS : STATS_XML_FLAG_SHOW_HIDDEN;
-    const char *mount = (source) ? source->mount : NULL;
     xmlDocPtr doc;
 
-    ICECAST_LOG_DEBUG("Stats request, sending xml stats");
+    if (response == ADMIN_FORMAT_RAW || response == ADMIN_FORMAT_JSON) {
+        size_t len = 0;
+        char *buff = stats_get_rendered(flags, mount, client, response, &len);
+
+        if (buff) {
+            if (response == ADMIN_FORMAT_RAW) {
+                client_send_buffer(client, 200, "text/xml", "utf-8", buff, len, NULL);
+            } else {
+                client_send_buffer(client, 200, "application/json", "utf-8", buff, len, "Warning: 299 - \"JSON rendering is experimental\"\r\n");
+            }
+            free(buff);
+            return;
+        }
+    }
 
     doc = stats_get_xml(flags, mount, client);
     admin_send_response(doc, client, response, STATS_HTML_REQUEST);
     xmlFreeDoc(doc);
+}
+
+static void command_stats(client_t *client, source_t *source, admin_format_t response)
+{
+    unsigned int flags = (source) ? STATS_XML_FLAG_SHOW_HIDDEN|STATS_XML_FLAG_SHOW_LISTENERS : STATS_XML_FLAG_SHOW_HIDDEN;
+    const char *mount = (source) ? source->mount : NULL;
+
+    ICECAST_LOG_DEBUG("Stats request, sending xml stats");
+
+    admin_send_stats(client, response, flags, mount);
     return;
 }
 
 static void command_public_stats        (client_t *client, source_t *source, admin_format_t response)
 {
     const char *mount = (source) ? source->mount : NULL;
-    xmlDocPtr doc = stats_get_xml(STATS_XML_FLAG_PUBLIC_VIEW, mount, client);
-    admin_send_response(doc, client, response, STATS_HTML_REQUEST);
-    xmlFreeDoc(doc);
+
+    admin_send_stats(client, response, STATS_XML_FLAG_PUBLIC_VIEW, mount);
     return;
 }
 
+/* the mount is optional and need not be running, so it is not looked up */
+static void command_stats_events(client_t *client, source_t *source, admin_format_t response)
+{
+    const char *mount;
+
+    COMMAND_OPTIONAL(client, "mount", mount);
+
+    ICECAST_LOG_DEBUG("Stats events request");
+
+    stats_send_events(client, mount, 0);
+}
+
+static void command_public_stats_events(client_t *client, source_t *source, admin_format_t response)
+{
+    const char *mount;
+
+    COMMAND_OPTIONAL(client, "mount", mount);
+
+    ICECAST_LOG_DEBUG("Public stats events request");
+
+    stats_send_events(client, mount, 1);
+}
+
+static void command_metrics(client_t *client, source_t *source, admin_format_t response)
+{
+    ssize_t ret;
+
+    ICECAST_LOG_DEBUG("Metrics request");
+
+    ret = util_http_build_header(client->refbuf->data,
+                                 PER_CLIENT_REFBUF_SIZE, 0,
+                                 0, 200, NULL,
+                                 "application/openmetrics-text; version=1.0.0", "utf-8",
+                                 "", NULL, client);
+
+    if (ret == -1 || ret >= PER_CLIENT_REFBUF_SIZE) {
+        ICECAST_LOG_ERROR("Dropping client as we can not build response headers.");
+        client_send_error_by_id(client, ICECAST_ERROR_GEN_HEADER_GEN_FAILED);
+        return;
+    }
+
+    client->refbuf->len = strlen (client->refbuf->data);
+    client->respcode = 200;
+
+    client->refbuf->next = stats_get_metrics();
+    fserve_add_client (client, NULL);
+}
+
+static void command_flightrecorder(client_t *client, source_t *source, admin_format_t response)
+{
+    refbuf_t *dump;
+    ssize_t ret;
+
+    ICECAST_LOG_DEBUG("Flight recorder request");
+
+    dump = flightrec_dump();
+    if (!dump) {
+        client_send_error_by_id(client, ICECAST_ERROR_CON_UNIMPLEMENTED);
+        return;
+    }
+
+    ret = util_http_build_header(client->refbuf->data,
+                                 PER_CLIENT_REFBUF_SIZE, 0,
+                                 0, 200, NULL,
+                                 "application/octet-stream", NULL,
+                                 "", NULL, client);
+
+    if (ret == -1 || ret >= PER_CLIENT_REFBUF_SIZE) {
+        ICECAST_LOG_ERROR("Dropping client as we can not build response headers.");
+        refbuf_release(dump);
+        client_send_error_by_id(client, ICECAST_ERROR_GEN_HEADER_GEN_FAILED);
+        return;
+    }
+
+    client->refbuf->len = strlen (client->refbuf->data);
+    client->respcode = 200;
+
+    client->refbuf->next = dump;
+    fserve_add_client (client, NULL);
+}
+
 static void command_queue_reload(client_t *client, source_t *source, admin_format_t response)
 {
     global_lock();
@@ -1323,23 +1787,13 @@ static void command_list_mounts(client_t *client, source_t *source, admin_format
     ICECAST_LOG_DEBUG("List mounts request");
 
     if (response == ADMIN_FORMAT_PLAINTEXT) {
-        ssize_t ret = util_http_build_header(client->refbuf->data,
-                                             PER_CLIENT_REFBUF_SIZE, 0,
-                                             0, 200, NULL,
-                                             "text/plain", "utf-8",
-                                             "", NULL, client);
-
-        if (ret == -1 || ret >= PER_CLIENT_REFBUF_SIZE) {
-            ICECAST_LOG_ERROR("Dropping client as we can not build response headers.");
-            client_send_error_by_id(client, ICECAST_ERROR_GEN_HEADER_GEN_FAILED);
-            return;
-        }
+        const char *since;
+        const char *wait;
 
-        client->refbuf->len = strlen (client->refbuf->data);
-        client->respcode = 200;
-
-        client->refbuf->next = stats_get_streams ();
-        fserve_add_client (client, NULL);
+        /* slaves pass the ETag of the list they have to get only changes */
+        COMMAND_OPTIONAL(client, "since", since);
+        COMMAND_OPTIONAL(client, "wait", wait);
+        stats_send_streams(client, since, wait ? atoi(wait) : 0);
     } else {
         xmlDocPtr doc;
         avl_tree_rlock(global.source_tree);
@@ -1352,6 +1806,55 @@ static void command_list_mounts(client_t *client, source_t *source, admin_format
     }
 }
 
+/* hands the relay connections of a slave over to the relay multiplexer once
+ * the response header is sent */
+static void command_relaymux_callback(client_t *client, void *arg)
+{
+    (void)arg;
+
+    if (client->con->error) {
+        client_destroy(client);
+        return;
+    }
+    client_set_queue(client, NULL);
+
+    relaymux_accept(client);
+}
+
+static void command_relaymux(client_t *client, source_t *source, admin_format_t response)
+{
+    ssize_t ret;
+
+    ICECAST_LOG_DEBUG("Relay multiplexer request");
+
+    /* no channel within a channel */
+    if (client->con->local) {
+        client_send_error_by_id(client, ICECAST_ERROR_CON_UNIMPLEMENTED);
+        return;
+    }
+
+    ret = util_http_build_header(client->refbuf->data, PER_CLIENT_REFBUF_SIZE, 0,
+                                 0, 200, NULL,
+                                 "application/x-icecast-relaymux", NULL,
+                                 "", NULL, client);
+    if (ret == -1 || ret >= PER_CLIENT_REFBUF_SIZE) {
+        ICECAST_LOG_ERROR("Dropping client as we can not build response headers.");
+        client_send_error_by_id(client, ICECAST_ERROR_GEN_HEADER_GEN_FAILED);
+        return;
+    }
+
+    client->respcode = 200;
+    client->refbuf->len = strlen(client->refbuf->data);
+    fserve_add_client_callback(client, command_relaymux_callback, NULL);
+}
+
+static void command_clusterload(client_t *client, source_t *source, admin_format_t response)
+{
+    ICECAST_LOG_DEBUG("Cluster load request");
+
+    cluster_send_loads(client);
+}
+
 static void command_list_listen_sockets(client_t *client, source_t *source, admin_format_t response)
 {
     reportxml_t *report = client_get_empty_reportxml();
@@ -1393,6 +1896,15 @@ static void command_list_listen_sockets(client_t *client, source_t *source, admi
             reportxml_helper_add_value(config, "int", "so_sndbuf", NULL);
         }
 
+        if (listener->so_rcvbuf) {
+            reportxml_helper_add_value_int(config, "so_rcvbuf", listener->so_rcvbuf);
+        } else {
+            reportxml_helper_add_value(config, "int", "so_rcvbuf", NULL);
+        }
+
+        reportxml_helper_add_value_int(config, "defer_accept", listener->defer_accept);
+        reportxml_helper_add_value_int(config, "tcp_fastopen", listener->tcp_fastopen);
+
         if (listener->listen_backlog > 0) {
             reportxml_helper_add_value_int(config, "listen_backlog", listener->listen_backlog);
         } else {
@@ -1641,6 +2153,42 @@ static admin_dashboard_status_t command_dashboard__getrlimit(ice_config_t *confi
 }
 #endif
 
+/* memory retained per mount as of the last sample of each source */
+static void command_dashboard__queue_memory(reportxml_node_t *parent)
+{
+    reportxml_node_t *list;
+    avl_node *node;
+
+    list = reportxml_node_new(REPORTXML_NODE_TYPE_VALUE, NULL, NULL, NULL);
+    reportxml_node_set_attribute(list, "type", "list");
+    reportxml_node_set_attribute(list, "member", "queue-memory");
+
+    avl_tree_rlock(global.source_tree);
+    for (node = avl_get_first(global.source_tree); node; node = avl_get_next(node)) {
+        source_t *source = node->key;
+        reportxml_node_t *mount;
+
+        if (!source->running)
+            continue;
+
+        mount = reportxml_node_new(REPORTXML_NODE_TYPE_VALUE, NULL, NULL, NULL);
+        reportxml_node_set_attribute(mount, "type", "structure");
+        reportxml_node_set_attribute(mount, "member", source->mount);
+        reportxml_helper_add_value_int(mount, "queue", source->queue_size);
+        reportxml_helper_add_value_int(mount, "burst", source->burst_offset);
+        reportxml_helper_add_value_int(mount, "intro", source->intro_bytes);
+        reportxml_helper_add_value_int(mount, "headers", source->header_bytes);
+        reportxml_helper_add_value_int(mount, "retained", source->retained_bytes);
+        reportxml_helper_add_value_int(mount, "arena", source->arena_bytes);
+        reportxml_node_add_child(list, mount);
+        refobject_unref(mount);
+    }
+    avl_tree_unlock(global.source_tree);
+
+    reportxml_node_add_child(parent, list);
+    refobject_unref(list);
+}
+
 static void command_dashboard           (client_t *client, source_t *source, admin_format_t response)
 {
     ice_config_t *config = config_get_config();
@@ -1655,6 +2203,11 @@ static void command_dashboard           (client_t *client, source_t *source, adm
     bool has_too_many_clients;
     bool has_legacy_sources;
     bool inet6_enabled;
+    bool has_full_queue_memory;
+    uint64_t queue_memory;
+    memgov_level_t memory_pressure;
+    uint64_t memory_used;
+    uint64_t memory_limit;
 
 
     resource = reportxml_node_new(REPORTXML_NODE_TYPE_RESOURCE, NULL, NULL, NULL);
@@ -1667,6 +2220,10 @@ static void command_dashboard           (client_t *client, source_t *source, adm
     reportxml_helper_add_value_string(node, "hostname", config->hostname);
     reportxml_helper_add_value_int(node, "clients", config->client_limit);
     reportxml_helper_add_value_int(node, "sources", config->source_limit);
+    reportxml_helper_add_value_int(node, "queue-memory", config->queue_memory_limit);
+    memgov_get_usage(&memory_used, &memory_limit);
+    if (memory_limit)
+        reportxml_helper_add_value_int(node, "memory", memory_limit);
     reportxml_node_add_child(resource, node);
     refobject_unref(node);
 
@@ -1682,12 +2239,22 @@ static void command_dashboard           (client_t *client, source_t *source, adm
     has_legacy_sources = global.sources_legacy > 0;
     inet6_enabled = listensocket_container_is_family_included(global.listensockets, SOCK_FAMILY_INET6);
     global_unlock();
+    queue_memory = source_get_queue_memory();
+    reportxml_helper_add_value_int(node, "queue-memory", queue_memory);
+    has_full_queue_memory = config->queue_memory_limit && queue_memory > ((90 * (uint64_t)config->queue_memory_limit) / 100);
+    memory_pressure = memgov_get_level();
+    if (memory_limit) {
+        reportxml_helper_add_value_int(node, "memory", memory_used);
+        reportxml_helper_add_value_string(node, "memory-pressure", memgov_level_to_string(memory_pressure));
+    }
     reportxml_node_add_child(resource, node);
     refobject_unref(node);
 
-    if (config->config_problems || has_too_many_clients) {
+    command_dashboard__queue_memory(resource);
+
+    if (config->config_problems || has_too_many_clients || memory_pressure == MEMGOV_LEVEL_REJECT) {
         status = command_dashboard__atbest(status, ADMIN_DASHBOARD_STATUS_ERROR);
-    } else if (!has_sources || has_many_clients || !inet6_enabled) {
+    } else if (!has_sources || has_many_clients || !inet6_enabled || has_full_queue_memory || memory_pressure == MEMGOV_LEVEL_SHED) {
         status = command_dashboard__atbest(status, ADMIN_DASHBOARD_STATUS_WARNING);
     }
 
@@ -1732,6 +2299,15 @@ static void command_dashboard           (client_t *client, source_t *source, adm
         __reportxml_add_maintenance(reportnode, config->reportxml_db, "417ae59c-de19-4ed1-ade1-429c689f1152", "info", "More than 75% of the server's configured maximum clients are connected", NULL);
     }
 
+    if (has_full_queue_memory)
+        __reportxml_add_maintenance(reportnode, config->reportxml_db, "95bb3da9-8d60-421e-a750-07375deff515", "warning", "Stream buffers use more than 90% of <queue-memory-limit>, queues of busy mounts are cut down.", NULL);
+
+    if (memory_pressure == MEMGOV_LEVEL_REJECT) {
+        __reportxml_add_maintenance(reportnode, config->reportxml_db, "c2e7a4d1-5f38-4b96-8e0a-71d3b9c6f254", "error", "Memory used is above <memory-reject-threshold>, new listeners are rejected and caches dropped.", NULL);
+    } else if (memory_pressure == MEMGOV_LEVEL_SHED) {
+        __reportxml_add_maintenance(reportnode, config->reportxml_db, "6a1f93b8-0d4e-4c27-a5b9-e82c47f1d30a", "warning", "Memory used is above <memory-shed-threshold>, caches are dropped and bursts cut down.", NULL);
+    }
+
 #if HAVE_GETRLIMIT && HAVE_SYS_RESOURCE_H
     status = command_dashboard__atbest(status, command_dashboard__getrlimit(config, reportnode, config->reportxml_db));
 #endif
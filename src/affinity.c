@@ -0,0 +1,217 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
+
+#include "affinity.h"
+#include "cfgfile.h"
+
+#include "logging.h"
+#define CATMODULE "affinity"
+
+/* also the names of the elements in <cpu-affinity> */
+static const char * const affinity_class_names[CPU_AFFINITY_MAX] = {
+    [CPU_AFFINITY_ACCEPT]       = "accept",
+    [CPU_AFFINITY_CONNECTION]   = "connection",
+    [CPU_AFFINITY_SOURCE]       = "source",
+    [CPU_AFFINITY_FSERVE]       = "fserve",
+    [CPU_AFFINITY_STATS]        = "stats"
+};
+
+#ifdef HAVE_SCHED_SETAFFINITY
+/* nodes looked for in sysfs */
+#define AFFINITY_MAX_NODES  64
+
+/* set up by affinity_initialize() before any thread is started and only
+ * read afterwards */
+static int affinity_pinned = 0;
+static int affinity_configured[CPU_AFFINITY_MAX];
+static cpu_set_t affinity_set[CPU_AFFINITY_MAX];
+static cpu_set_t affinity_original;
+static unsigned char affinity_cpu_node[CPU_SETSIZE];
+
+/* parses lists like "0-3,8" as used by taskset and sysfs */
+static int affinity_parse_list(const char *list, cpu_set_t *set)
+{
+    const char *p = list;
+
+    CPU_ZERO(set);
+
+    while (*p) {
+        char *end;
+        long first, last;
+
+        while (*p == ' ' || *p == '\t' || *p == '\n')
+            p++;
+        if (!*p)
+            break;
+
+        first = strtol(p, &end, 10);
+        if (end == p || first < 0)
+            return -1;
+        last = first;
+        p = end;
+
+        if (*p == '-') {
+            p++;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+                return -1;
+            p = end;
+        }
+
+        if (last >= CPU_SETSIZE)
+            return -1;
+
+        for (; first <= last; first++)
+            CPU_SET(first, set);
+
+        while (*p == ' ' || *p == '\t' || *p == '\n')
+            p++;
+        if (*p == ',') {
+            p++;
+        } else if (*p) {
+            return -1;
+        }
+    }
+
+    return CPU_COUNT(set) ? 0 : -1;
+}
+
+static void affinity_read_nodes(void)
+{
+    int node;
+    int cpu;
+
+    memset(affinity_cpu_node, 0, sizeof(affinity_cpu_node));
+
+    for (node = 0; node < AFFINITY_MAX_NODES; node++) {
+        char path[64];
+        char buffer[1024];
+        cpu_set_t set;
+        FILE *file;
+        size_t len;
+
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        file = fopen(path, "r");
+        if (!file)
+            continue;
+        len = fread(buffer, 1, sizeof(buffer) - 1, file);
+        fclose(file);
+        buffer[len] = 0;
+
+        if (affinity_parse_list(buffer, &set) != 0)
+            continue;
+
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &set))
+                affinity_cpu_node[cpu] = node;
+    }
+}
+#endif
+
+const char *affinity_class_name(cpu_affinity_class_t class)
+{
+    if (class < 0 || class >= CPU_AFFINITY_MAX)
+        return NULL;
+
+    return affinity_class_names[class];
+}
+
+void affinity_initialize(void)
+{
+    ice_config_t *config = config_get_config();
+#ifdef HAVE_SCHED_SETAFFINITY
+    size_t i;
+
+    if (sched_getaffinity(0, sizeof(affinity_original), &affinity_original) != 0) {
+        ICECAST_LOG_ERROR("Can not get the CPUs of the process: %s", strerror(errno));
+        config_release_config();
+        return;
+    }
+
+    for (i = 0; i < CPU_AFFINITY_MAX; i++) {
+        affinity_configured[i] = 0;
+        if (!config->cpu_affinity[i])
+            continue;
+
+        if (affinity_parse_list(config->cpu_affinity[i], &(affinity_set[i])) != 0) {
+            ICECAST_LOG_ERROR("Bad CPU list \"%s\" for %s threads, not pinning them", config->cpu_affinity[i], affinity_class_names[i]);
+            continue;
+        }
+
+        ICECAST_LOG_INFO("Pinning %s threads to CPUs %s", affinity_class_names[i], config->cpu_affinity[i]);
+        affinity_configured[i] = 1;
+        affinity_pinned = 1;
+    }
+
+    if (affinity_pinned)
+        affinity_read_nodes();
+#else
+    size_t i;
+
+    for (i = 0; i < CPU_AFFINITY_MAX; i++) {
+        if (config->cpu_affinity[i]) {
+            ICECAST_LOG_WARN("<cpu-affinity> is not supported on this system, ignoring it");
+            break;
+        }
+    }
+#endif
+    config_release_config();
+}
+
+void affinity_shutdown(void)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+    affinity_pinned = 0;
+#endif
+}
+
+void affinity_apply(cpu_affinity_class_t class)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+    const cpu_set_t *set;
+
+    if (!affinity_pinned || class >= CPU_AFFINITY_MAX)
+        return;
+
+    /* a thread of an unpinned class may have been started by a pinned one */
+    set = affinity_configured[class] ? &(affinity_set[class]) : &affinity_original;
+
+    if (sched_setaffinity(0, sizeof(*set), set) != 0)
+        ICECAST_LOG_ERROR("Can not pin %s thread: %s", affinity_class_names[class], strerror(errno));
+#else
+    (void)class;
+#endif
+}
+
+int affinity_current_node(void)
+{
+#if defined(HAVE_SCHED_SETAFFINITY) && defined(HAVE_SCHED_GETCPU)
+    int cpu;
+
+    if (!affinity_pinned)
+        return 0;
+
+    cpu = sched_getcpu();
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+        return 0;
+
+    return affinity_cpu_node[cpu];
+#else
+    return 0;
+#endif
+}
@@ -0,0 +1,38 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* affinity.h
+ *
+ * Pinning of the server's threads to the CPUs given by <cpu-affinity> in
+ * <limits>. Each thread class is pinned by its thread calling
+ * affinity_apply() when it starts. Threads a thread starts inherit its
+ * CPUs, so the listener workers of a source run where the source threads
+ * do. The lists are read once at startup, a reload does not change them.
+ *
+ * affinity_current_node() gives the NUMA node of the CPU the calling thread
+ * runs on, which refbuf.c uses to keep buffers on the node they were
+ * allocated on. It is 0 while no class is pinned, as unpinned threads move
+ * between nodes anyway.
+ */
+
+#ifndef __AFFINITY_H__
+#define __AFFINITY_H__
+
+#include "cfgfile.h"
+
+void affinity_initialize(void);
+void affinity_shutdown(void);
+
+/* name of the class as in <cpu-affinity>, NULL for none */
+const char *affinity_class_name(cpu_affinity_class_t class);
+
+/* pins the calling thread to the CPUs of the class. Threads of a class
+ * without a list are given all CPUs the server started with. */
+void affinity_apply(cpu_affinity_class_t class);
+
+int affinity_current_node(void);
+
+#endif  /* __AFFINITY_H__ */
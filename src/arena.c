@@ -0,0 +1,197 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+/* allocations are aligned to this, as by malloc() */
+#define ARENA_ALIGN         16
+#define ARENA_ROUND(x)      (((x) + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1))
+/* the data of a chunk starts this far into it */
+#define ARENA_HEADER        ARENA_ROUND(sizeof(arena_chunk_t))
+
+struct arena_chunk_tag {
+    struct arena_chunk_tag *next;
+    /* bytes of data and bytes of it handed out */
+    size_t size;
+    size_t used;
+};
+
+static arena_chunk_t *arena_chunk_new(size_t size)
+{
+    arena_chunk_t *chunk = malloc(ARENA_HEADER + size);
+
+    if (!chunk)
+        return NULL;
+
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+
+    return chunk;
+}
+
+void arena_initialize(arena_t *arena, size_t chunk_size)
+{
+    thread_spin_create(&arena->lock);
+    arena->chunk_size = ARENA_ROUND(chunk_size);
+    arena->chunks = NULL;
+    arena->size = 0;
+    arena->used = 0;
+}
+
+void arena_shutdown(arena_t *arena)
+{
+    while (arena->chunks) {
+        arena_chunk_t *chunk = arena->chunks;
+
+        arena->chunks = chunk->next;
+        free(chunk);
+    }
+    arena->size = 0;
+    arena->used = 0;
+    thread_spin_destroy(&arena->lock);
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    arena_chunk_t *chunk;
+    void *ret = NULL;
+
+    size = ARENA_ROUND(size ? size : 1);
+
+    thread_spin_lock(&arena->lock);
+    chunk = arena->chunks;
+    if (!chunk || (chunk->size - chunk->used) < size) {
+        /* a large allocation gets a chunk of its own behind the current
+         * one, which goes on being used for the small ones */
+        if (size > arena->chunk_size / 4 && chunk) {
+            arena_chunk_t *own = arena_chunk_new(size);
+
+            if (own) {
+                own->used = size;
+                own->next = chunk->next;
+                chunk->next = own;
+                arena->size += ARENA_HEADER + size;
+                arena->used += size;
+                ret = (char *)own + ARENA_HEADER;
+            }
+            thread_spin_unlock(&arena->lock);
+            if (ret)
+                memset(ret, 0, size);
+            return ret;
+        }
+
+        chunk = arena_chunk_new(size > arena->chunk_size ? size : arena->chunk_size);
+        if (!chunk) {
+            thread_spin_unlock(&arena->lock);
+            return NULL;
+        }
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        arena->size += ARENA_HEADER + chunk->size;
+    }
+
+    ret = (char *)chunk + ARENA_HEADER + chunk->used;
+    chunk->used += size;
+    arena->used += size;
+    thread_spin_unlock(&arena->lock);
+
+    memset(ret, 0, size);
+
+    return ret;
+}
+
+char *arena_strdup(arena_t *arena, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *ret = arena_alloc(arena, len);
+
+    if (ret)
+        memcpy(ret, str, len);
+
+    return ret;
+}
+
+void arena_free(arena_t *arena, void *ptr, size_t size)
+{
+    arena_chunk_t *chunk;
+
+    if (!ptr)
+        return;
+
+    size = ARENA_ROUND(size ? size : 1);
+
+    /* only the tail of the current chunk can be given back */
+    thread_spin_lock(&arena->lock);
+    chunk = arena->chunks;
+    if (chunk && chunk->used >= size && (char *)ptr == (char *)chunk + ARENA_HEADER + chunk->used - size) {
+        chunk->used -= size;
+        arena->used -= size;
+    }
+    thread_spin_unlock(&arena->lock);
+}
+
+void arena_reset(arena_t *arena)
+{
+    arena_chunk_t *chunk;
+    arena_chunk_t *keep;
+
+    /* the chunks are pushed to the front, so the last one is the oldest */
+    thread_spin_lock(&arena->lock);
+    chunk = arena->chunks;
+    keep = chunk;
+    while (keep && keep->next)
+        keep = keep->next;
+    if (keep && keep->size == arena->chunk_size) {
+        keep->used = 0;
+        arena->chunks = keep;
+        arena->size = ARENA_HEADER + keep->size;
+        arena->used = 0;
+    } else {
+        keep = NULL;
+        arena->chunks = NULL;
+        arena->size = 0;
+        arena->used = 0;
+    }
+    thread_spin_unlock(&arena->lock);
+
+    /* free() is done without the lock */
+    while (chunk && chunk != keep) {
+        arena_chunk_t *next = chunk->next;
+
+        free(chunk);
+        chunk = next;
+    }
+}
+
+size_t arena_get_size(arena_t *arena)
+{
+    size_t ret;
+
+    thread_spin_lock(&arena->lock);
+    ret = arena->size;
+    thread_spin_unlock(&arena->lock);
+
+    return ret;
+}
+
+size_t arena_get_used(arena_t *arena)
+{
+    size_t ret;
+
+    thread_spin_lock(&arena->lock);
+    ret = arena->used;
+    thread_spin_unlock(&arena->lock);
+
+    return ret;
+}
@@ -0,0 +1,58 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* arena.h
+ *
+ * Hands out memory that lives as long as its owner from larger chunks, all
+ * of which are released in one go. Sources keep their format state in one, so
+ * mounts that start and stop all the time, such as on-demand relays, do not
+ * churn the allocator with many small allocations, and the memory of a mount
+ * is known to the byte. Nothing that is replaced while its owner lives should
+ * go in one, as it would only grow.
+ */
+
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+#include "common/thread/thread.h"
+
+typedef struct arena_chunk_tag arena_chunk_t;
+
+/* The members are private to arena.c. */
+typedef struct {
+    spin_t lock;
+    size_t chunk_size;
+    /* the chunk allocated from first, others follow */
+    arena_chunk_t *chunks;
+    /* bytes of all chunks and bytes handed out of them */
+    size_t size;
+    size_t used;
+} arena_t;
+
+/* Sets up arena to allocate chunk_size bytes at a time */
+void    arena_initialize(arena_t *arena, size_t chunk_size);
+/* Frees all chunks, nothing of arena may be used afterwards */
+void    arena_shutdown(arena_t *arena);
+
+/* Returns size zeroed bytes or NULL if out of memory. They are only freed
+ * with all others by arena_reset() or arena_shutdown(). */
+void   *arena_alloc(arena_t *arena, size_t size);
+char   *arena_strdup(arena_t *arena, const char *str);
+/* Gives back the size bytes at ptr if they were the last handed out, so an
+ * allocation that turns out not to be needed can be undone. Otherwise they
+ * stay allocated until arena_reset(). */
+void    arena_free(arena_t *arena, void *ptr, size_t size);
+/* Releases everything allocated, the first chunk is kept for reuse */
+void    arena_reset(arena_t *arena);
+
+/* Bytes held by the arena */
+size_t  arena_get_size(arena_t *arena);
+/* Bytes handed out by the arena, what its owner actually uses */
+size_t  arena_get_used(arena_t *arena);
+
+#endif  /* __ARENA_H__ */
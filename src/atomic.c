@@ -0,0 +1,151 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "atomic.h"
+
+#ifndef HAVE_ATOMIC_BUILTINS
+#include "waitlock.h"
+
+/* used before any subsystem is initialised */
+static waitlock_t atomic_lock = WAITLOCK_INITIALIZER;
+
+unsigned int atomic_uint_load(volatile unsigned int *p)
+{
+    unsigned int ret;
+
+    waitlock_lock(&atomic_lock);
+    ret = *p;
+    waitlock_unlock(&atomic_lock);
+
+    return ret;
+}
+
+void atomic_uint_store(volatile unsigned int *p, unsigned int v)
+{
+    waitlock_lock(&atomic_lock);
+    *p = v;
+    waitlock_unlock(&atomic_lock);
+}
+
+unsigned int atomic_uint_add(volatile unsigned int *p, unsigned int v)
+{
+    unsigned int ret;
+
+    waitlock_lock(&atomic_lock);
+    ret = (*p += v);
+    waitlock_unlock(&atomic_lock);
+
+    return ret;
+}
+
+unsigned int atomic_uint_sub(volatile unsigned int *p, unsigned int v)
+{
+    unsigned int ret;
+
+    waitlock_lock(&atomic_lock);
+    ret = (*p -= v);
+    waitlock_unlock(&atomic_lock);
+
+    return ret;
+}
+
+int atomic_uint_cas(volatile unsigned int *p, unsigned int expected, unsigned int desired)
+{
+    int ret = 0;
+
+    waitlock_lock(&atomic_lock);
+    if (*p == expected) {
+        *p = desired;
+        ret = 1;
+    }
+    waitlock_unlock(&atomic_lock);
+
+    return ret;
+}
+
+uint64_t atomic_u64_load(volatile uint64_t *p)
+{
+    uint64_t ret;
+
+    waitlock_lock(&atomic_lock);
+    ret = *p;
+    waitlock_unlock(&atomic_lock);
+
+    return ret;
+}
+
+void atomic_u64_store(volatile uint64_t *p, uint64_t v)
+{
+    waitlock_lock(&atomic_lock);
+    *p = v;
+    waitlock_unlock(&atomic_lock);
+}
+
+uint64_t atomic_u64_add(volatile uint64_t *p, uint64_t v)
+{
+    uint64_t ret;
+
+    waitlock_lock(&atomic_lock);
+    ret = (*p += v);
+    waitlock_unlock(&atomic_lock);
+
+    return ret;
+}
+
+void *atomic_ptr_load(void * volatile *p)
+{
+    void *ret;
+
+    waitlock_lock(&atomic_lock);
+    ret = *p;
+    waitlock_unlock(&atomic_lock);
+
+    return ret;
+}
+
+void atomic_ptr_store(void * volatile *p, void *v)
+{
+    waitlock_lock(&atomic_lock);
+    *p = v;
+    waitlock_unlock(&atomic_lock);
+}
+
+void *atomic_ptr_exchange(void * volatile *p, void *v)
+{
+    void *ret;
+
+    waitlock_lock(&atomic_lock);
+    ret = *p;
+    *p = v;
+    waitlock_unlock(&atomic_lock);
+
+    return ret;
+}
+
+int atomic_ptr_cas(void * volatile *p, void *expected, void *desired)
+{
+    int ret = 0;
+
+    waitlock_lock(&atomic_lock);
+    if (*p == expected) {
+        *p = desired;
+        ret = 1;
+    }
+    waitlock_unlock(&atomic_lock);
+
+    return ret;
+}
+
+void atomic_fence_acquire(void)
+{
+    waitlock_lock(&atomic_lock);
+    waitlock_unlock(&atomic_lock);
+}
+#endif
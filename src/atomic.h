@@ -0,0 +1,113 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* atomic.h
+ *
+ * Minimal set of atomic operations. With a compiler that supports the
+ * __atomic builtins those are used directly, otherwise every operation is
+ * done under a global lock.
+ *
+ * Loads have acquire and stores have release semantics. The read-modify-write
+ * operations are full acquire-release operations. This is all the code using
+ * them relies on, so weaker orders are not exposed.
+ */
+
+#ifndef __ICECAST_ATOMIC_H__
+#define __ICECAST_ATOMIC_H__
+
+#include "compat.h"
+
+#ifdef HAVE_ATOMIC_BUILTINS
+/* All inline, see below for the fallback prototypes */
+static inline unsigned int atomic_uint_load(volatile unsigned int *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void atomic_uint_store(volatile unsigned int *p, unsigned int v)
+{
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+/* returns the new value */
+static inline unsigned int atomic_uint_add(volatile unsigned int *p, unsigned int v)
+{
+    return __atomic_add_fetch(p, v, __ATOMIC_ACQ_REL);
+}
+
+/* returns the new value */
+static inline unsigned int atomic_uint_sub(volatile unsigned int *p, unsigned int v)
+{
+    return __atomic_sub_fetch(p, v, __ATOMIC_ACQ_REL);
+}
+
+/* returns true if *p was expected and has been replaced by desired */
+static inline int atomic_uint_cas(volatile unsigned int *p, unsigned int expected, unsigned int desired)
+{
+    return __atomic_compare_exchange_n(p, &expected, desired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static inline uint64_t atomic_u64_load(volatile uint64_t *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void atomic_u64_store(volatile uint64_t *p, uint64_t v)
+{
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+/* returns the new value */
+static inline uint64_t atomic_u64_add(volatile uint64_t *p, uint64_t v)
+{
+    return __atomic_add_fetch(p, v, __ATOMIC_ACQ_REL);
+}
+
+static inline void *atomic_ptr_load(void * volatile *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void atomic_ptr_store(void * volatile *p, void *v)
+{
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+/* returns the old value */
+static inline void *atomic_ptr_exchange(void * volatile *p, void *v)
+{
+    return __atomic_exchange_n(p, v, __ATOMIC_ACQ_REL);
+}
+
+/* returns true if *p was expected and has been replaced by desired */
+static inline int atomic_ptr_cas(void * volatile *p, void *expected, void *desired)
+{
+    return __atomic_compare_exchange_n(p, &expected, desired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+/* keeps plain reads before it from being done after a following load, for
+ * checking that data copied without a lock was not changed meanwhile */
+static inline void atomic_fence_acquire(void)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+}
+#else
+unsigned int atomic_uint_load(volatile unsigned int *p);
+void         atomic_uint_store(volatile unsigned int *p, unsigned int v);
+unsigned int atomic_uint_add(volatile unsigned int *p, unsigned int v);
+unsigned int atomic_uint_sub(volatile unsigned int *p, unsigned int v);
+int          atomic_uint_cas(volatile unsigned int *p, unsigned int expected, unsigned int desired);
+uint64_t     atomic_u64_load(volatile uint64_t *p);
+void         atomic_u64_store(volatile uint64_t *p, uint64_t v);
+uint64_t     atomic_u64_add(volatile uint64_t *p, uint64_t v);
+void *       atomic_ptr_load(void * volatile *p);
+void         atomic_ptr_store(void * volatile *p, void *v);
+void *       atomic_ptr_exchange(void * volatile *p, void *v);
+int          atomic_ptr_cas(void * volatile *p, void *expected, void *desired);
+void         atomic_fence_acquire(void);
+#endif
+
+#endif  /* __ICECAST_ATOMIC_H__ */
@@ -34,6 +34,9 @@
 #include "fserve.h"
 #include "admin.h"
 #include "acl.h"
+#include "common/timing/timing.h"
+#include "fastevent.h"
+#include "global.h"
 
 #include "logging.h"
 #define CATMODULE "auth"
@@ -46,8 +49,20 @@ struct auth_stack_tag {
     auth_stack_t *next;
 };
 
+/* ms the auth thread waits for a backend with requests in flight */
+#define AUTH_RUN_TIMEOUT 20
+/* most threads=... may ask for */
+#define AUTH_MAX_THREADS 64
+
+typedef struct {
+    auth_t *auth;
+    /* the slot in auth->active */
+    size_t index;
+} auth_worker_t;
+
 /* code */
 static void __handle_auth_client(auth_t *auth, auth_client *auth_user);
+static void auth_start_threads(auth_t *auth);
 
 static mutex_t _auth_lock; /* protects _current_id */
 static volatile unsigned long _current_id = 0;
@@ -168,7 +183,12 @@ static void queue_auth_client (auth_client *auth_user)
     if (auth->immediate) {
         __handle_auth_client(auth, auth_user);
     } else {
+        auth_user->queued_at = timing_get_time();
+        stats_global_inc(STATS_GLOBAL_AUTH_QUEUED);
         thread_mutex_lock (&auth->lock);
+        /* started with the first client, not for every role at startup */
+        if (!auth->threads)
+            auth_start_threads(auth);
         *auth->tailp = auth_user;
         auth->tailp = &auth_user->next;
         auth->pending_count++;
@@ -196,13 +216,19 @@ void auth_release (auth_t *authenticator) {
         return;
     }
 
-    /* cleanup auth thread attached to this auth */
+    /* cleanup auth threads attached to this auth */
     if (authenticator->running) {
         authenticator->running = 0;
         thread_mutex_unlock(&authenticator->lock);
-        thread_join(authenticator->thread);
+        global_wake();
+        for (i = 0; i < authenticator->thread_count; i++) {
+            if (authenticator->threads[i])
+                thread_join(authenticator->threads[i]);
+        }
         thread_mutex_lock(&authenticator->lock);
     }
+    free(authenticator->threads);
+    free(authenticator->active);
 
     if (authenticator->free)
         authenticator->free(authenticator);
@@ -266,6 +292,20 @@ static int is_client_connected (client_t *client) {
     return 1;
 }
 
+static auth_result auth_new_client_finish(auth_t *auth, auth_client *auth_user, auth_result result)
+{
+    client_t *client = auth_user->client;
+
+    (void)auth;
+
+    if (result != AUTH_OK) {
+        auth_release (client->auth);
+        client->auth = NULL;
+    }
+
+    return result;
+}
+
 static auth_result auth_new_client (auth_t *auth, auth_client *auth_user) {
     client_t *client = auth_user->client;
     auth_result ret = AUTH_FAILED;
@@ -282,29 +322,20 @@ static auth_result auth_new_client (auth_t *auth, auth_client *auth_user) {
 
     if (auth->authenticate_client) {
         ret = auth->authenticate_client(auth_user);
-        if (ret != AUTH_OK)
-        {
-            auth_release (client->auth);
-            client->auth = NULL;
+        if (ret == AUTH_PENDING)
             return ret;
-        }
+        return auth_new_client_finish(auth, auth_user, ret);
     }
     return ret;
 }
 
 
-/* wrapper function for auth thread to drop client connections
- */
-static auth_result auth_remove_client(auth_t *auth, auth_client *auth_user)
+static auth_result auth_remove_client_finish(auth_t *auth, auth_client *auth_user, auth_result result)
 {
     client_t *client = auth_user->client;
-    auth_result ret = AUTH_RELEASED;
 
     (void)auth;
 
-    if (client->auth->release_client)
-        ret = client->auth->release_client(auth_user);
-
     auth_release(client->auth);
     client->auth = NULL;
 
@@ -312,7 +343,23 @@ static auth_result auth_remove_client(auth_t *auth, auth_client *auth_user)
     acl_release(client->acl);
     client->acl = NULL;
 
-    return ret;
+    return result;
+}
+
+/* wrapper function for auth thread to drop client connections
+ */
+static auth_result auth_remove_client(auth_t *auth, auth_client *auth_user)
+{
+    client_t *client = auth_user->client;
+    auth_result ret = AUTH_RELEASED;
+
+    if (client->auth->release_client)
+        ret = client->auth->release_client(auth_user);
+
+    if (ret == AUTH_PENDING)
+        return ret;
+
+    return auth_remove_client_finish(auth, auth_user, ret);
 }
 
 static inline int __handle_auth_client_alter(client_t *client, auth_alter_t action, const char *arg)
@@ -360,14 +407,14 @@ static inline int __handle_auth_client_alter(client_t *client, auth_alter_t acti
     return -1;
 }
 
-static void __handle_auth_client (auth_t *auth, auth_client *auth_user) {
-    auth_result result;
+static void __handle_auth_client_result(auth_t *auth, auth_client *auth_user, auth_result result)
+{
+    if (auth_user->queued_at) {
+        uint64_t elapsed = timing_get_time() - auth_user->queued_at;
 
-    if (auth_user->process) {
-        result = auth_user->process(auth, auth_user);
-    } else {
-        ICECAST_LOG_ERROR("client auth process not set");
-        result = AUTH_FAILED;
+        stats_global_inc(STATS_GLOBAL_AUTH_REQUESTS);
+        stats_global_add(STATS_GLOBAL_AUTH_REQUEST_MS, elapsed);
+        fastevent_emit(FASTEVENT_TYPE_CLIENT_AUTH_QUEUED, FASTEVENT_FLAG_NONE, FASTEVENT_DATATYPE_OT, auth_user->client, elapsed * 1000);
     }
 
     ICECAST_LOG_DEBUG("client %p on auth %p role %s processed: %s", auth_user->client, auth, auth->role, auth_result2str(result));
@@ -394,13 +441,80 @@ static void __handle_auth_client (auth_t *auth, auth_client *auth_user) {
     auth_client_free (auth_user);
 }
 
+static void __handle_auth_client (auth_t *auth, auth_client *auth_user) {
+    auth_result result;
+
+    if (auth_user->process) {
+        result = auth_user->process(auth, auth_user);
+    } else {
+        ICECAST_LOG_ERROR("client auth process not set");
+        result = AUTH_FAILED;
+    }
+
+    if (result == AUTH_PENDING) {
+        ICECAST_LOG_DDEBUG("client %p on auth %p role %s is pending", auth_user->client, auth, auth->role);
+        auth->in_flight++;
+        stats_global_inc(STATS_GLOBAL_AUTH_IN_FLIGHT);
+        return;
+    }
+
+    __handle_auth_client_result(auth, auth_user, result);
+}
+
+void auth_client_done(auth_t *auth, auth_client *auth_user, auth_result result)
+{
+    auth->in_flight--;
+    stats_global_dec(STATS_GLOBAL_AUTH_IN_FLIGHT);
+
+    if (auth_user->finish)
+        result = auth_user->finish(auth, auth_user, result);
+
+    __handle_auth_client_result(auth, auth_user, result);
+}
+
 /* The auth thread main loop. */
+/* takes the first client no other thread is working on, needs auth->lock */
+static auth_client *auth_take_client(auth_t *auth, size_t index)
+{
+    auth_client **prev = &auth->head;
+
+    while (*prev) {
+        auth_client *auth_user = *prev;
+        size_t i;
+
+        for (i = 0; i < auth->thread_count; i++) {
+            if (i != index && auth->active[i] == auth_user->client)
+                break;
+        }
+
+        if (i == auth->thread_count) {
+            *prev = auth_user->next;
+            if (*prev == NULL)
+                auth->tailp = prev;
+            auth->pending_count--;
+            auth->active[index] = auth_user->client;
+            auth_user->next = NULL;
+            return auth_user;
+        }
+
+        prev = &auth_user->next;
+    }
+
+    return NULL;
+}
+
 static void *auth_run_thread (void *arg)
 {
-    auth_t *auth = arg;
+    auth_worker_t *worker = arg;
+    auth_t *auth = worker->auth;
+    size_t index = worker->index;
+
+    free(worker);
 
     ICECAST_LOG_INFO("Authentication thread started");
     while (1) {
+        auth_client *auth_user = NULL;
+
         thread_mutex_lock(&auth->lock);
 
         if (!auth->running) {
@@ -408,36 +522,73 @@ static void *auth_run_thread (void *arg)
             break;
         }
 
-        if (auth->head) {
-            auth_client *auth_user;
-
-            /* may become NULL before lock taken */
-            auth_user = (auth_client*)auth->head;
-            if (auth_user == NULL)
-            {
-                thread_mutex_unlock (&auth->lock);
-                continue;
+        if (!auth->run || auth->in_flight < auth->max_in_flight) {
+            auth_user = auth_take_client(auth, index);
+            if (auth_user) {
+                ICECAST_LOG_DDEBUG("%d client(s) pending on %s (role %s)", auth->pending_count, auth->mount, auth->role);
             }
-            ICECAST_LOG_DDEBUG("%d client(s) pending on %s (role %s)", auth->pending_count, auth->mount, auth->role);
-            auth->head = auth_user->next;
-            if (auth->head == NULL)
-                auth->tailp = &auth->head;
-            auth->pending_count--;
-            thread_mutex_unlock(&auth->lock);
-            auth_user->next = NULL;
+        }
+        thread_mutex_unlock(&auth->lock);
+
+        if (auth_user) {
+            stats_global_dec(STATS_GLOBAL_AUTH_QUEUED);
 
             __handle_auth_client(auth, auth_user);
 
+            thread_mutex_lock(&auth->lock);
+            auth->active[index] = NULL;
+            thread_mutex_unlock(&auth->lock);
             continue;
+        }
+
+        if (auth->run && (auth->in_flight || auth->busy)) {
+            auth->run(auth, AUTH_RUN_TIMEOUT);
         } else {
-            thread_mutex_unlock(&auth->lock);
+            global_sleep (150);
         }
-        thread_sleep (150000);
     }
+
+    /* the clients still with the backend need their result */
+    while (auth->in_flight || auth->busy)
+        auth->run(auth, AUTH_RUN_TIMEOUT);
+
     ICECAST_LOG_INFO("Authentication thread shutting down");
     return NULL;
 }
 
+static void auth_start_threads(auth_t *auth)
+{
+    size_t i;
+
+    if (auth->run && auth->thread_count > 1) {
+        ICECAST_LOG_INFO("Role %H does its requests concurrently, using one thread instead of %zu", auth->role, auth->thread_count);
+        auth->thread_count = 1;
+    }
+
+    auth->threads = calloc(auth->thread_count, sizeof(*auth->threads));
+    auth->active = calloc(auth->thread_count, sizeof(*auth->active));
+    if (!auth->threads || !auth->active) {
+        ICECAST_LOG_ERROR("Can not allocate auth threads for role %H", auth->role);
+        auth->thread_count = 0;
+        return;
+    }
+
+    auth->running = 1;
+    for (i = 0; i < auth->thread_count; i++) {
+        auth_worker_t *worker = calloc(1, sizeof(*worker));
+
+        if (!worker)
+            break;
+        worker->auth = auth;
+        worker->index = i;
+        auth->threads[i] = thread_create("auth thread", auth_run_thread, worker, THREAD_ATTACHED);
+        if (!auth->threads[i]) {
+            free(worker);
+            break;
+        }
+    }
+}
+
 
 /* Add a client.
  */
@@ -522,9 +673,22 @@ static void auth_add_client(auth_t *auth, client_t *client, void (*on_no_match)(
     auth_addref(client->auth = auth);
     auth_user = auth_client_setup(client);
     auth_user->process = auth_new_client;
+    auth_user->finish = auth_new_client_finish;
     auth_user->on_no_match = on_no_match;
     auth_user->on_result = on_result;
     auth_user->userdata = userdata;
+
+    if (auth->lookup_client) {
+        auth_result result;
+
+        if (auth->lookup_client(auth_user, &result) == 0) {
+            ICECAST_LOG_DDEBUG("client %p on auth %p answered by lookup", client, auth);
+            stats_global_inc(STATS_GLOBAL_AUTH_CACHE_HITS);
+            __handle_auth_client_result(auth, auth_user, auth_new_client_finish(auth, auth_user, result));
+            return;
+        }
+    }
+
     ICECAST_LOG_DDEBUG("adding client %p for authentication on %p", client, auth);
     queue_auth_client(auth_user);
 }
@@ -543,9 +707,11 @@ int auth_release_client (client_t *client) {
     if (!client->acl)
         return 0;
 
-    if (client->auth && client->auth->release_client) {
+    /* the new process releases it when the listener leaves there */
+    if (client->auth && client->auth->release_client && !client->handed_over) {
         auth_client *auth_user = auth_client_setup(client);
         auth_user->process = auth_remove_client;
+        auth_user->finish = auth_remove_client_finish;
         auth_user->on_result = __auth_on_result_destroy_client;
         queue_auth_client(auth_user);
         return 1;
@@ -817,6 +983,7 @@ auth_t *auth_get_authenticator(ice_config_t *configuration, xmlNodePtr node)
     auth->management_url = (char*)xmlGetProp(node, XMLSTR("management-url"));
     auth->filter_web_policy = AUTH_MATCHTYPE_MATCH;
     auth->filter_admin_policy = AUTH_MATCHTYPE_MATCH;
+    auth->thread_count = 1;
     auth->failed_arg = AUTH_ALTER_NOOP;
     auth->deny_arg = AUTH_ALTER_NOOP;
 
@@ -906,6 +1073,18 @@ auth_t *auth_get_authenticator(ice_config_t *configuration, xmlNodePtr node)
     auth_get_authenticator__permission_alter(auth, node, "may-alter", AUTH_MATCHTYPE_MATCH);
     auth_get_authenticator__permission_alter(auth, node, "may-not-alter", AUTH_MATCHTYPE_NOMATCH);
 
+    tmp = (char*)xmlGetProp(node, XMLSTR("threads"));
+    if (tmp) {
+        long int value = strtol(tmp, NULL, 10);
+
+        if (value < 1 || value > AUTH_MAX_THREADS) {
+            ICECAST_LOG_WARN("Invalid threads=\"%H\" for role %H, using 1", tmp, auth->role);
+        } else {
+            auth->thread_count = value;
+        }
+        xmlFree(tmp);
+    }
+
     /* sub node parsing */
     child = node->xmlChildrenNode;
     do {
@@ -982,10 +1161,6 @@ auth_t *auth_get_authenticator(ice_config_t *configuration, xmlNodePtr node)
             auth = NULL;
         } else {
             auth->tailp = &auth->head;
-            if (!auth->immediate) {
-                auth->running = 1;
-                auth->thread = thread_create("auth thread", auth_run_thread, auth, THREAD_ATTACHED);
-            }
         }
     }
 
@@ -1217,6 +1392,30 @@ auth_t       *auth_stack_getbyid(auth_stack_t *stack, unsigned long id) {
 
 }
 
+auth_t       *auth_stack_getbyrole(auth_stack_t *stack, const char *role) {
+    auth_t *ret = NULL;
+
+    if (!stack || !role)
+        return NULL;
+
+    auth_stack_addref(stack);
+
+    while (!ret && stack) {
+        auth_t *auth = auth_stack_get(stack);
+        if (auth->role && strcmp(auth->role, role) == 0) {
+            ret = auth;
+            break;
+        }
+        auth_release(auth);
+        auth_stack_next(&stack);
+    }
+
+    if (stack)
+        auth_stack_release(stack);
+
+    return ret;
+}
+
 acl_t        *auth_stack_get_anonymous_acl(auth_stack_t *stack, httpp_request_type_e method) {
     acl_t *ret = NULL;
 
@@ -25,6 +25,8 @@
 #include "common/thread/thread.h"
 #include "common/httpp/httpp.h"
 
+#include <stdint.h>
+
 #include "icecasttypes.h"
 #include "cfgfile.h"
 
@@ -55,7 +57,10 @@ typedef enum
     /* status codes for database changes */
     AUTH_USERADDED,
     AUTH_USEREXISTS,
-    AUTH_USERDELETED
+    AUTH_USERDELETED,
+    /* the backend is still working on it and reports the result later
+     * with auth_client_done(), see auth_t.run */
+    AUTH_PENDING
 } auth_result;
 
 typedef enum {
@@ -90,8 +95,12 @@ struct auth_client_tag {
     auth_result (*process)(auth_t *auth, auth_client *auth_user);
     void        (*on_no_match)(client_t *client, void (*on_result)(client_t *client, void *userdata, auth_result result), void *userdata);
     void        (*on_result)(client_t *client, void *userdata, auth_result result);
+    /* called with the result of the backend before on_result */
+    auth_result (*finish)(auth_t *auth, auth_client *auth_user, auth_result result);
     void         *userdata;
     void         *authbackend_userdata;
+    /* when it was queued, in ms as by timing_get_time() */
+    uint64_t      queued_at;
     auth_alter_t  alter_client_action;
     char         *alter_client_arg;
     auth_client  *next;
@@ -144,6 +153,27 @@ struct auth_tag
     auth_result (*authenticate_client)(auth_client *aclient);
     auth_result (*release_client)(auth_client *auth_user);
 
+    /* For backends that work on several clients at once. If set,
+     * authenticate_client() and release_client() may return AUTH_PENDING.
+     * The auth thread then calls run() whenever it has nothing else to do,
+     * which waits up to timeout ms for the backend and reports the results
+     * with auth_client_done(). No more than max_in_flight clients are handed
+     * to the backend at a time.
+     */
+    void (*run)(auth_t *auth, unsigned int timeout);
+    size_t max_in_flight;
+    /* only used by the auth thread */
+    size_t in_flight;
+    /* set by the backend while it has work of its own, run() is called
+     * then as well */
+    int busy;
+
+    /* Optional, asked before a new client is queued. If it already knows
+     * the result, it sets *result and returns 0, the client is then
+     * handled right away by the calling thread.
+     */
+    int (*lookup_client)(auth_client *aclient, auth_result *result);
+
     /* auth state-specific free call */
     void (*free)(auth_t *self);
 
@@ -155,7 +185,13 @@ struct auth_tag
     int running;
     size_t refcount;
 
-    thread_type *thread;
+    /* threads working on the queue, from the threads attribute. Backends
+     * with run() get only one, as it is driven by a single thread. */
+    thread_type **threads;
+    size_t thread_count;
+    /* the client each thread works on, so no two threads work on the same
+     * client at once, protected by lock */
+    client_t **active;
 
     /* per-auth queue for clients */
     auth_client *head, **tailp;
@@ -191,6 +227,9 @@ void    auth_release(auth_t *authenticator);
 void    auth_addref(auth_t *authenticator);
 
 int auth_release_client(client_t *client);
+/* reports the result for a client a backend returned AUTH_PENDING for,
+ * must be called from within auth_t.run() */
+void auth_client_done(auth_t *auth, auth_client *auth_user, auth_result result);
 
 void auth_stack_add_client(auth_stack_t  *stack,
                            client_t      *client,
@@ -209,6 +248,8 @@ int           auth_stack_push(auth_stack_t **stack, auth_t *auth);
 int           auth_stack_append(auth_stack_t *stack, auth_stack_t *tail);
 auth_t       *auth_stack_get(auth_stack_t *stack);
 auth_t       *auth_stack_getbyid(auth_stack_t *stack, unsigned long id);
+/* the first auth of the stack with the role, NULL if there is none */
+auth_t       *auth_stack_getbyrole(auth_stack_t *stack, const char *role);
 acl_t        *auth_stack_get_anonymous_acl(auth_stack_t *stack, httpp_request_type_e method);
 
 /* Rejects a client based on auth results. */
@@ -25,13 +25,18 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <stdint.h>
 
 #include "auth.h"
 #include "source.h"
 #include "client.h"
 #include "cfgfile.h"
 #include "common/httpp/httpp.h"
+#include "common/thread/thread.h"
+#include "common/timing/timing.h"
 #include "md5.h"
+#include "atomic.h"
+#include "util.h"
 
 #include "logging.h"
 #define CATMODULE "auth_htpasswd"
@@ -43,27 +48,121 @@
 static auth_result htpasswd_adduser (auth_t *auth, const char *username, const char *password);
 static auth_result htpasswd_deleteuser(auth_t *auth, const char *username);
 static auth_result htpasswd_userlist(auth_t *auth, xmlNodePtr srcnode);
-static int _free_user (void *key);
 
-typedef struct {
+/* seconds between checks of the file for changes */
+#define HTPASSWD_CHECK_INTERVAL 2
+
+typedef struct htpasswd_user_tag {
+    struct htpasswd_user_tag *next;
     char *name;
     char *pass;
 } htpasswd_user;
 
+/* The users as read from the file. Never changed once built, a reload
+ * builds a new one and swaps it in. Users hold a reference.
+ */
+typedef struct {
+    volatile unsigned int refs;
+    time_t mtime;
+    size_t count;
+    /* hash table, buckets_count is a power of two */
+    htpasswd_user **buckets;
+    size_t buckets_count;
+    /* sorted by name, for listing */
+    htpasswd_user **sorted;
+} htpasswd_users;
+
 typedef struct {
     char *filename;
+    /* held for reading the file and for changing it */
     rwlock_t file_rwlock;
-    avl_tree *users;
-    time_t mtime;
+    /* protects users */
+    spin_t users_lock;
+    htpasswd_users *users;
+    /* ms as by timing_get_time() */
+    volatile uint64_t last_checked;
+    /* protects the below */
+    mutex_t reload_lock;
+    int reloading;
+    thread_type *reload_thread;
 } htpasswd_auth_state;
 
+static void htpasswd_users_release(htpasswd_users *users)
+{
+    size_t i;
+
+    if (!users)
+        return;
+
+    if (atomic_uint_sub(&users->refs, 1) != 0)
+        return;
+
+    for (i = 0; i < users->count; i++) {
+        free(users->sorted[i]->name); /* ->pass is part of same buffer */
+        free(users->sorted[i]);
+    }
+    free(users->sorted);
+    free(users->buckets);
+    free(users);
+}
+
+static htpasswd_users *htpasswd_users_get(htpasswd_auth_state *state)
+{
+    htpasswd_users *users;
+
+    thread_spin_lock(&state->users_lock);
+    users = state->users;
+    if (users)
+        atomic_uint_add(&users->refs, 1);
+    thread_spin_unlock(&state->users_lock);
+
+    return users;
+}
+
+static void htpasswd_users_swap(htpasswd_auth_state *state, htpasswd_users *users)
+{
+    htpasswd_users *old;
+
+    thread_spin_lock(&state->users_lock);
+    old = state->users;
+    state->users = users;
+    thread_spin_unlock(&state->users_lock);
+
+    htpasswd_users_release(old);
+}
+
+static htpasswd_user *htpasswd_users_find(htpasswd_users *users, const char *name)
+{
+    htpasswd_user *user;
+
+    if (!users->buckets_count)
+        return NULL;
+
+    for (user = users->buckets[util_hash_string(name) & (users->buckets_count - 1)]; user; user = user->next) {
+        if (strcmp(user->name, name) == 0)
+            return user;
+    }
+
+    return NULL;
+}
+
 static void htpasswd_clear(auth_t *self)
 {
     htpasswd_auth_state *state = self->state;
+    thread_type *thread;
+
+    thread_mutex_lock(&state->reload_lock);
+    thread = state->reload_thread;
+    state->reload_thread = NULL;
+    thread_mutex_unlock(&state->reload_lock);
+    if (thread)
+        thread_join(thread);
+
     free(state->filename);
-    if (state->users)
-        avl_tree_free (state->users, _free_user);
+    htpasswd_users_release(state->users);
     thread_rwlock_destroy(&state->file_rwlock);
+    thread_spin_destroy(&state->users_lock);
+    thread_mutex_destroy(&state->reload_lock);
     free(state);
 }
 
@@ -84,64 +183,41 @@ static char *get_hash(const char *data, int len)
 }
 
 
-static int compare_users(void *arg, void *a, void *b)
+static int compare_users(const void *a, const void *b)
 {
-    htpasswd_user *user1 = (htpasswd_user *)a;
-    htpasswd_user *user2 = (htpasswd_user *)b;
-
-    (void)arg;
+    const htpasswd_user *user1 = *(const htpasswd_user * const *)a;
+    const htpasswd_user *user2 = *(const htpasswd_user * const *)b;
 
     return strcmp (user1->name, user2->name);
 }
 
 
-static int _free_user(void *key)
-{
-    htpasswd_user *user = (htpasswd_user *)key;
-
-    free (user->name); /* ->pass is part of same buffer */
-    free (user);
-    return 1;
-}
-
-
-static void htpasswd_recheckfile(htpasswd_auth_state *htpasswd)
+/* builds the users from the file, NULL if it can not be read */
+static htpasswd_users *htpasswd_load(htpasswd_auth_state *htpasswd, time_t mtime)
 {
     FILE *passwdfile;
-    avl_tree *new_users;
+    htpasswd_users *users;
+    htpasswd_user *list = NULL;
     int num = 0;
-    struct stat file_stat;
+    size_t i;
     char *sep;
     char line [MAX_LINE_LEN];
 
-    if (htpasswd->filename == NULL)
-        return;
-    if (stat (htpasswd->filename, &file_stat) < 0) {
-        ICECAST_LOG_WARN("failed to check status of %s", htpasswd->filename);
+    users = calloc(1, sizeof(*users));
+    if (!users)
+        return NULL;
+    users->refs = 1;
+    users->mtime = mtime;
 
-        /* Create a dummy users tree for things to use later */
-        thread_rwlock_wlock (&htpasswd->file_rwlock);
-        if(!htpasswd->users)
-            htpasswd->users = avl_tree_new(compare_users, NULL);
-        thread_rwlock_unlock (&htpasswd->file_rwlock);
-
-        return;
-    }
-
-    if (file_stat.st_mtime == htpasswd->mtime) {
-        /* common case, no update to file */
-        return;
-    }
-    ICECAST_LOG_INFO("re-reading htpasswd file \"%s\"", htpasswd->filename);
+    thread_rwlock_rlock (&htpasswd->file_rwlock);
     passwdfile = fopen (htpasswd->filename, "rb");
     if (passwdfile == NULL) {
+        thread_rwlock_unlock (&htpasswd->file_rwlock);
         ICECAST_LOG_WARN("Failed to open authentication database \"%s\": %s",
                 htpasswd->filename, strerror(errno));
-        return;
+        free(users);
+        return NULL;
     }
-    htpasswd->mtime = file_stat.st_mtime;
-
-    new_users = avl_tree_new (compare_users, NULL);
 
     while (get_line(passwdfile, line, MAX_LINE_LEN)) {
         int len;
@@ -158,19 +234,151 @@ static void htpasswd_recheckfile(htpasswd_auth_state *htpasswd)
         }
         entry = calloc (1, sizeof (htpasswd_user));
         len = strlen (line) + 1;
-        entry->name = malloc (len);
+        if (entry)
+            entry->name = malloc (len);
+        if (!entry || !entry->name) {
+            free(entry);
+            continue;
+        }
         *sep = 0;
         memcpy (entry->name, line, len);
         entry->pass = entry->name + (sep-line) + 1;
-        avl_insert (new_users, entry);
+        entry->next = list;
+        list = entry;
+        users->count++;
     }
     fclose (passwdfile);
-
-    thread_rwlock_wlock (&htpasswd->file_rwlock);
-    if (htpasswd->users)
-        avl_tree_free (htpasswd->users, _free_user);
-    htpasswd->users = new_users;
     thread_rwlock_unlock (&htpasswd->file_rwlock);
+
+    users->buckets_count = 16;
+    while (users->buckets_count < users->count)
+        users->buckets_count *= 2;
+    users->buckets = calloc(users->buckets_count, sizeof(*users->buckets));
+    users->sorted = calloc(users->count ? users->count : 1, sizeof(*users->sorted));
+    if (!users->buckets || !users->sorted) {
+        while (list) {
+            htpasswd_user *entry = list;
+            list = entry->next;
+            free(entry->name);
+            free(entry);
+        }
+        free(users->buckets);
+        free(users->sorted);
+        free(users);
+        return NULL;
+    }
+
+    for (i = 0; list; i++) {
+        htpasswd_user *entry = list;
+        htpasswd_user **bucket = &(users->buckets[util_hash_string(entry->name) & (users->buckets_count - 1)]);
+
+        list = entry->next;
+        users->sorted[i] = entry;
+        /* the first line for a user wins */
+        entry->next = *bucket;
+        *bucket = entry;
+    }
+
+    qsort(users->sorted, users->count, sizeof(*users->sorted), compare_users);
+
+    return users;
+}
+
+/* reads the file now if it changed */
+static void htpasswd_reload(htpasswd_auth_state *htpasswd)
+{
+    struct stat file_stat;
+    htpasswd_users *users;
+    time_t mtime = 0;
+
+    if (htpasswd->filename == NULL)
+        return;
+
+    atomic_u64_store(&htpasswd->last_checked, timing_get_time());
+
+    if (stat (htpasswd->filename, &file_stat) < 0) {
+        ICECAST_LOG_WARN("failed to check status of %s", htpasswd->filename);
+
+        /* Create a dummy users list for things to use later */
+        users = htpasswd_users_get(htpasswd);
+        if (!users) {
+            users = calloc(1, sizeof(*users));
+            if (users) {
+                users->refs = 1;
+                htpasswd_users_swap(htpasswd, users);
+            }
+        } else {
+            htpasswd_users_release(users);
+        }
+
+        return;
+    }
+
+    users = htpasswd_users_get(htpasswd);
+    if (users) {
+        mtime = users->mtime;
+        htpasswd_users_release(users);
+        if (file_stat.st_mtime == mtime) {
+            /* common case, no update to file */
+            return;
+        }
+    }
+
+    ICECAST_LOG_INFO("re-reading htpasswd file \"%s\"", htpasswd->filename);
+    users = htpasswd_load(htpasswd, file_stat.st_mtime);
+    if (users)
+        htpasswd_users_swap(htpasswd, users);
+}
+
+static void *htpasswd_reload_thread(void *arg)
+{
+    htpasswd_auth_state *htpasswd = arg;
+
+    htpasswd_reload(htpasswd);
+
+    thread_mutex_lock(&htpasswd->reload_lock);
+    htpasswd->reloading = 0;
+    thread_mutex_unlock(&htpasswd->reload_lock);
+
+    return NULL;
+}
+
+/* Checks the file at most every HTPASSWD_CHECK_INTERVAL seconds. If it
+ * changed, it is read by a thread of its own while the old users are
+ * still in use.
+ */
+static void htpasswd_recheckfile(htpasswd_auth_state *htpasswd)
+{
+    struct stat file_stat;
+    htpasswd_users *users;
+    uint64_t now = timing_get_time();
+    int changed;
+
+    if (htpasswd->filename == NULL)
+        return;
+
+    if ((now - atomic_u64_load(&htpasswd->last_checked)) < (HTPASSWD_CHECK_INTERVAL * 1000))
+        return;
+    atomic_u64_store(&htpasswd->last_checked, now);
+
+    users = htpasswd_users_get(htpasswd);
+    /* a missing file is left for the reload to report */
+    changed = !users || stat(htpasswd->filename, &file_stat) < 0 || file_stat.st_mtime != users->mtime;
+    htpasswd_users_release(users);
+    if (!changed)
+        return;
+
+    thread_mutex_lock(&htpasswd->reload_lock);
+    if (!htpasswd->reloading) {
+        /* the one before is done, so this does not block */
+        if (htpasswd->reload_thread)
+            thread_join(htpasswd->reload_thread);
+        htpasswd->reloading = 1;
+        htpasswd->reload_thread = thread_create("htpasswd reload", htpasswd_reload_thread, htpasswd, THREAD_ATTACHED);
+        if (!htpasswd->reload_thread)
+            htpasswd->reloading = 0;
+    }
+    thread_mutex_unlock(&htpasswd->reload_lock);
 }
 
 
@@ -179,8 +387,8 @@ static auth_result htpasswd_auth (auth_client *auth_user)
     auth_t *auth = auth_user->client->auth;
     htpasswd_auth_state *htpasswd = auth->state;
     client_t *client = auth_user->client;
-    htpasswd_user entry;
-    void *result;
+    htpasswd_users *users;
+    htpasswd_user *found;
 
     if (!client->username || !client->password)
         return AUTH_NOMATCH;
@@ -191,29 +399,28 @@ static auth_result htpasswd_auth (auth_client *auth_user)
     }
     htpasswd_recheckfile (htpasswd);
 
-    if (htpasswd->users == NULL) {
+    users = htpasswd_users_get(htpasswd);
+    if (users == NULL) {
         ICECAST_LOG_ERROR("No user list.");
         return AUTH_NOMATCH;
     }
 
-    thread_rwlock_rlock (&htpasswd->file_rwlock);
-    entry.name = client->username;
-    if (avl_get_by_key (htpasswd->users, &entry, &result) == 0) {
-        htpasswd_user *found = result;
+    found = htpasswd_users_find(users, client->username);
+    if (found) {
         char *hashed_pw;
+        int match;
 
-        thread_rwlock_unlock (&htpasswd->file_rwlock);
         hashed_pw = get_hash (client->password, strlen (client->password));
-        if (strcmp (found->pass, hashed_pw) == 0) {
-            free (hashed_pw);
-            return AUTH_OK;
-        }
+        match = hashed_pw && strcmp (found->pass, hashed_pw) == 0;
         free (hashed_pw);
+        htpasswd_users_release(users);
+        if (match)
+            return AUTH_OK;
         ICECAST_LOG_DEBUG("incorrect password for client with username: %s", client->username);
         return AUTH_FAILED;
     }
+    htpasswd_users_release(users);
     ICECAST_LOG_DEBUG("no such username: %s", client->username);
-    thread_rwlock_unlock (&htpasswd->file_rwlock);
     return AUTH_NOMATCH;
 }
 
@@ -248,7 +455,9 @@ int  auth_get_htpasswd_auth (auth_t *authenticator, config_options_t *options)
     authenticator->state = state;
 
     thread_rwlock_create(&state->file_rwlock);
-    htpasswd_recheckfile(state);
+    thread_spin_create(&state->users_lock);
+    thread_mutex_create(&state->reload_lock);
+    htpasswd_reload(state);
 
     return 0;
 }
@@ -259,25 +468,27 @@ static auth_result htpasswd_adduser (auth_t *auth, const char *username, const c
     FILE *passwdfile;
     char *hashed_password = NULL;
     htpasswd_auth_state *state = auth->state;
-    htpasswd_user entry;
-    void *result;
+    htpasswd_users *users;
+    int exists;
 
     if (state->filename == NULL) {
         ICECAST_LOG_ERROR("No filename given in options for authenticator.");
         return AUTH_FAILED;
     }
 
-    htpasswd_recheckfile (state);
+    htpasswd_reload (state);
 
-    if (state->users == NULL) {
+    users = htpasswd_users_get(state);
+    if (users == NULL) {
         ICECAST_LOG_ERROR("No user list.");
         return AUTH_FAILED;
     }
 
     thread_rwlock_wlock (&state->file_rwlock);
 
-    entry.name = (char*)username;
-    if (avl_get_by_key (state->users, &entry, &result) == 0) {
+    exists = htpasswd_users_find(users, username) != NULL;
+    htpasswd_users_release(users);
+    if (exists) {
         thread_rwlock_unlock (&state->file_rwlock);
         return AUTH_USEREXISTS;
     }
@@ -299,6 +510,7 @@ static auth_result htpasswd_adduser (auth_t *auth, const char *username, const c
 
     fclose(passwdfile);
     thread_rwlock_unlock (&state->file_rwlock);
+    htpasswd_reload(state);
 
     return AUTH_USERADDED;
 }
@@ -322,11 +534,6 @@ static auth_result htpasswd_deleteuser(auth_t *auth, const char *username)
         return AUTH_FAILED;
     }
 
-    if (state->users == NULL) {
-        ICECAST_LOG_ERROR("No user list.");
-        return AUTH_FAILED;
-    }
-
     thread_rwlock_wlock (&state->file_rwlock);
     passwdfile = fopen(state->filename, "rb");
 
@@ -395,7 +602,7 @@ static auth_result htpasswd_deleteuser(auth_t *auth, const char *username)
     }
     free(tmpfile);
     thread_rwlock_unlock(&state->file_rwlock);
-    htpasswd_recheckfile(state);
+    htpasswd_reload(state);
 
     return AUTH_USERDELETED;
 }
@@ -404,8 +611,9 @@ static auth_result htpasswd_deleteuser(auth_t *auth, const char *username)
 static auth_result htpasswd_userlist(auth_t *auth, xmlNodePtr srcnode)
 {
     htpasswd_auth_state *state;
+    htpasswd_users *users;
     xmlNodePtr newnode;
-    avl_node *node;
+    size_t i;
 
     state = auth->state;
 
@@ -416,20 +624,18 @@ static auth_result htpasswd_userlist(auth_t *auth, xmlNodePtr srcnode)
 
     htpasswd_recheckfile(state);
 
-    if (state->users == NULL) {
+    users = htpasswd_users_get(state);
+    if (users == NULL) {
         ICECAST_LOG_ERROR("No user list.");
         return AUTH_FAILED;
     }
 
-    thread_rwlock_rlock(&state->file_rwlock);
-    node = avl_get_first(state->users);
-    while (node) {
-        htpasswd_user *user = (htpasswd_user *)node->key;
+    for (i = 0; i < users->count; i++) {
+        htpasswd_user *user = users->sorted[i];
         newnode = xmlNewChild(srcnode, NULL, XMLSTR("user"), NULL);
         xmlNewTextChild(newnode, NULL, XMLSTR("username"), XMLSTR(user->name));
-        node = avl_get_next(node);
     }
-    thread_rwlock_unlock(&state->file_rwlock);
+    htpasswd_users_release(users);
 
     return AUTH_OK;
 }
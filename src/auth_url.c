@@ -49,6 +49,22 @@
  * As admin requests can come in for a stream (eg metadata update) these requests
  * can be issued while stream is active. For these &admin=1 is added to the POST
  * details.
+ *
+ * The requests are run on a curl multi handle by the auth thread, up to
+ * max_requests at a time. The easy handles are kept around once done so
+ * connections to the auth server are kept alive.
+ *
+ * With cache_ttl or cache_negative_ttl set, the results of listener_add are
+ * kept for that many seconds, by user, pass, mount and ip. A listener
+ * reconnecting with the same details is then answered without a request.
+ * Replies with a timelimit or an alter action are not cached.
+ *
+ * With remove_batch set, listener_remove is sent for up to that many
+ * listeners at once, or whatever there is after remove_batch_ms. The POST
+ * then has action, server, port and count once, followed by the details of
+ * each listener with its index:
+ *
+ * action=listener_remove&server=host&port=8000&count=2&client[0]=1&mount[0]=/live&user[0]=&pass[0]=&duration[0]=3600&ip[0]=127.0.0.1&agent[0]=""&client[1]=...
  */
 
 #ifdef HAVE_CONFIG_H
@@ -74,7 +90,11 @@
 #include "client.h"
 #include "cfgfile.h"
 #include "connection.h"
+#include "memgov.h"
 #include "common/httpp/httpp.h"
+#include "common/avl/avl.h"
+#include "common/thread/thread.h"
+#include "common/timing/timing.h"
 
 #include "logging.h"
 #define CATMODULE "auth_url"
@@ -89,6 +109,20 @@
 #define DEFAULT_HEADER_NEW_ALTER_ACTION     "x-icecast-auth-alter-action"
 #define DEFAULT_HEADER_NEW_ALTER_ARGUMENT   "x-icecast-auth-alter-argument"
 
+#define DEFAULT_MAX_REQUESTS                8
+#define DEFAULT_TIMEOUT                     15
+#define DEFAULT_CACHE_SIZE                  1024
+#define DEFAULT_REMOVE_BATCH_MS             1000
+
+typedef struct auth_url_cache_tag {
+    char *key;
+    auth_result result;
+    uint64_t expires;
+    /* newest first */
+    struct auth_url_cache_tag *prev;
+    struct auth_url_cache_tag *next;
+} auth_url_cache_t;
+
 typedef struct {
     char       *pass_headers; // headers passed from client to addurl.
     char       *prefix_headers; // prefix for passed headers.
@@ -112,15 +146,48 @@ typedef struct {
     char       *header_alter_argument;
 
     char       *userpwd;
-    CURL       *handle;
-    char        errormsg[CURL_ERROR_SIZE];
-    auth_result result;
+
+    /* requests running at once and seconds each may take */
+    size_t      max_requests;
+    long        timeout;
+    CURLM      *multi;
+    /* handles of finished requests, up to max_requests */
+    CURL      **idle;
+    size_t      idle_count;
+
+    /* seconds results are cached for, 0 for not at all */
+    unsigned int cache_ttl;
+    unsigned int cache_negative_ttl;
+    size_t      cache_size;
+    /* all below are protected by cache_lock, cache is NULL if disabled */
+    mutex_t     cache_lock;
+    avl_tree   *cache;
+    auth_url_cache_t *cache_head;
+    auth_url_cache_t *cache_tail;
+    size_t      cache_count;
+
+    /* listeners sent per listener_remove, 0 for one request each */
+    unsigned int remove_batch;
+    unsigned int remove_batch_ms;
+    /* only used by the auth thread */
+    char       *batch;
+    size_t      batch_len;
+    size_t      batch_size;
+    unsigned int batch_count;
+    uint64_t    batch_started;
+    unsigned int batch_running;
 } auth_url;
 
 typedef struct {
     char *all_headers;
     size_t all_headers_len;
     http_parser_t *parser;
+    /* listener_remove rather than listener_add */
+    int remove;
+    /* key of the result in the cache, NULL if not to be cached */
+    char *cache_key;
+    auth_result result;
+    char errormsg[CURL_ERROR_SIZE];
 } auth_user_url_t;
 
 static inline const char * __str_or_default(const char *str, const char *def)
@@ -130,6 +197,160 @@ static inline const char * __str_or_default(const char *str, const char *def)
     return def;
 }
 
+static int url_cache_compare(void *arg, void *a, void *b)
+{
+    (void)arg;
+
+    return strcmp(((auth_url_cache_t*)a)->key, ((auth_url_cache_t*)b)->key);
+}
+
+static int url_cache_free_entry(void *key)
+{
+    auth_url_cache_t *entry = key;
+
+    free(entry->key);
+    free(entry);
+    return 1;
+}
+
+static void url_cache_unlink(auth_url *url, auth_url_cache_t *entry)
+{
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        url->cache_head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        url->cache_tail = entry->prev;
+    }
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+static void url_cache_push_front(auth_url *url, auth_url_cache_t *entry)
+{
+    entry->prev = NULL;
+    entry->next = url->cache_head;
+    if (url->cache_head) {
+        url->cache_head->prev = entry;
+    } else {
+        url->cache_tail = entry;
+    }
+    url->cache_head = entry;
+}
+
+static void url_cache_remove(auth_url *url, auth_url_cache_t *entry)
+{
+    url_cache_unlink(url, entry);
+    url->cache_count--;
+    avl_delete(url->cache, entry, url_cache_free_entry);
+}
+
+/* the parts are prefixed with their length, so a user containing the
+ * separator can not pass for another user */
+static char *url_cache_key(client_t *client)
+{
+    const char *username = client->username ? client->username : "";
+    const char *password = client->password ? client->password : "";
+    const char *mountreq;
+    size_t len;
+    char *key;
+
+    mountreq = httpp_getvar(client->parser, HTTPP_VAR_RAWURI);
+    if (mountreq == NULL)
+        mountreq = httpp_getvar(client->parser, HTTPP_VAR_URI);
+    if (mountreq == NULL)
+        mountreq = "";
+
+    len = strlen(username) + strlen(password) + strlen(mountreq) + strlen(client->con->ip) + 4*22;
+    key = malloc(len);
+    if (!key)
+        return NULL;
+
+    snprintf(key, len, "%zu:%s%zu:%s%zu:%s%zu:%s",
+             strlen(username), username, strlen(password), password,
+             strlen(mountreq), mountreq, strlen(client->con->ip), client->con->ip);
+
+    return key;
+}
+
+/* takes the key */
+static void url_cache_store(auth_url *url, char *key, auth_result result, unsigned int ttl)
+{
+    auth_url_cache_t search;
+    auth_url_cache_t *entry;
+    void *found;
+
+    thread_mutex_lock(&url->cache_lock);
+    search.key = key;
+    /* under memory pressure nothing is cached, a result kept before would
+     * be outdated now */
+    if (memgov_get_level() != MEMGOV_LEVEL_NORMAL) {
+        if (avl_get_by_key(url->cache, &search, &found) == 0)
+            url_cache_remove(url, found);
+        thread_mutex_unlock(&url->cache_lock);
+        free(key);
+        return;
+    }
+    if (avl_get_by_key(url->cache, &search, &found) == 0) {
+        entry = found;
+        free(key);
+        url_cache_unlink(url, entry);
+    } else {
+        entry = calloc(1, sizeof(*entry));
+        if (!entry) {
+            thread_mutex_unlock(&url->cache_lock);
+            free(key);
+            return;
+        }
+        if (url->cache_count >= url->cache_size)
+            url_cache_remove(url, url->cache_tail);
+        entry->key = key;
+        avl_insert(url->cache, entry);
+        url->cache_count++;
+    }
+    entry->result = result;
+    entry->expires = timing_get_time() + (uint64_t)ttl * 1000;
+    url_cache_push_front(url, entry);
+    thread_mutex_unlock(&url->cache_lock);
+}
+
+static int auth_url_lookup_client(auth_client *auth_user, auth_result *result)
+{
+    auth_url *url = auth_user->client->auth->state;
+    auth_url_cache_t search;
+    void *found;
+    int ret = -1;
+
+    if (!url->cache)
+        return -1;
+
+    search.key = url_cache_key(auth_user->client);
+    if (!search.key)
+        return -1;
+
+    thread_mutex_lock(&url->cache_lock);
+    if (avl_get_by_key(url->cache, &search, &found) == 0) {
+        auth_url_cache_t *entry = found;
+
+        if (entry->expires > timing_get_time()) {
+            *result = entry->result;
+            ret = 0;
+        } else {
+            url_cache_remove(url, entry);
+        }
+    }
+    thread_mutex_unlock(&url->cache_lock);
+    free(search.key);
+
+    if (ret == 0)
+        ICECAST_LOG_DEBUG("client %lu answered from cache", auth_user->client->con->id);
+
+    return ret;
+}
+
 static void auth_url_clear(auth_t *self)
 {
     auth_url *url;
@@ -137,7 +358,15 @@ static void auth_url_clear(auth_t *self)
     ICECAST_LOG_INFO("Doing auth URL cleanup");
     url = self->state;
     self->state = NULL;
-    icecast_curl_free(url->handle);
+    while (url->idle_count)
+        icecast_curl_free(url->idle[--url->idle_count]);
+    free(url->idle);
+    if (url->multi)
+        curl_multi_cleanup(url->multi);
+    if (url->cache) {
+        avl_tree_free(url->cache, url_cache_free_entry);
+        thread_mutex_destroy(&url->cache_lock);
+    }
     free(url->username);
     free(url->password);
     free(url->pass_headers);
@@ -154,6 +383,7 @@ static void auth_url_clear(auth_t *self)
     free(url->header_alter_action);
     free(url->header_alter_argument);
     free(url->userpwd);
+    free(url->batch);
     free(url);
 }
 
@@ -165,6 +395,7 @@ static void auth_user_url_clear(auth_client *auth_user)
         return;
 
     free(au_url->all_headers);
+    free(au_url->cache_key);
     if (au_url->parser)
         httpp_destroy(au_url->parser);
 
@@ -172,6 +403,13 @@ static void auth_user_url_clear(auth_client *auth_user)
     auth_user->authbackend_userdata = NULL;
 }
 
+/* the reply is only good for this client */
+static inline void url_cache_skip(auth_user_url_t *au_url)
+{
+    free(au_url->cache_key);
+    au_url->cache_key = NULL;
+}
+
 static void handle_returned_header__complete(auth_client *auth_user)
 {
     auth_user_url_t *au_url = auth_user->authbackend_userdata;
@@ -208,7 +446,7 @@ static void handle_returned_header__complete(auth_client *auth_user)
     if (url->header_auth) {
         tmp = httpp_getvar(au_url->parser, url->header_auth);
         if (tmp) {
-            url->result = auth_str2result(tmp);
+            au_url->result = auth_str2result(tmp);
         }
     }
 
@@ -222,6 +460,7 @@ static void handle_returned_header__complete(auth_client *auth_user)
             ret = strtoll(tmp, &endptr, 0);
             if (endptr != tmp && errno == 0) {
                 auth_user->client->con->discon_time = time(NULL) + (time_t)ret;
+                url_cache_skip(au_url);
             } else {
                 ICECAST_LOG_ERROR("Auth backend returned invalid new style timelimit header: % #H", tmp);
             }
@@ -231,6 +470,9 @@ static void handle_returned_header__complete(auth_client *auth_user)
     action   = httpp_getvar(au_url->parser, __str_or_default(url->header_alter_action, DEFAULT_HEADER_NEW_ALTER_ACTION));
     argument = httpp_getvar(au_url->parser, __str_or_default(url->header_alter_argument, DEFAULT_HEADER_NEW_ALTER_ARGUMENT));
 
+    if (action || argument)
+        url_cache_skip(au_url);
+
     if (action && argument) {
         if (auth_alter_client(auth_user->client->auth, auth_user, auth_str2alter(action), argument) != 0) {
             ICECAST_LOG_ERROR("Auth backend returned invalid alter action/argument.");
@@ -247,7 +489,7 @@ static void handle_returned_header__complete(auth_client *auth_user)
             tmp = httpp_getvar(au_url->parser, DEFAULT_HEADER_OLD_MESSAGE);
     }
     if (tmp) {
-        snprintf(url->errormsg, sizeof(url->errormsg), "%s", tmp);
+        snprintf(au_url->errormsg, sizeof(au_url->errormsg), "%s", tmp);
     }
 }
 
@@ -258,38 +500,37 @@ static size_t handle_returned_header(void      *ptr,
 {
     size_t len = size * nmemb;
     auth_client *auth_user = stream;
-    client_t *client = auth_user->client;
+    client_t *client;
+    auth_user_url_t *au_url;
     auth_t *auth;
     auth_url *url;
+    char *n;
+
+    /* batched requests have no client */
+    if (!auth_user)
+        return len;
 
-    if (!client)
+    client = auth_user->client;
+    au_url = auth_user->authbackend_userdata;
+    if (!client || !au_url)
         return len;
 
     auth = client->auth;
     url = auth->state;
 
-    if (!auth_user->authbackend_userdata) {
-        auth_user->authbackend_userdata = calloc(1, sizeof(auth_user_url_t));
-    }
-
-    if (auth_user->authbackend_userdata) {
-        auth_user_url_t *au_url = auth_user->authbackend_userdata;
-        char *n = realloc(au_url->all_headers, au_url->all_headers_len + len);
-        if (n) {
-            au_url->all_headers = n;
-            memcpy(n + au_url->all_headers_len, ptr, len);
-            au_url->all_headers_len += len;
-        } else {
-            ICECAST_LOG_ERROR("Can not allocate buffer for auth backend reply headers. BAD.");
-        }
+    n = realloc(au_url->all_headers, au_url->all_headers_len + len);
+    if (n) {
+        au_url->all_headers = n;
+        memcpy(n + au_url->all_headers_len, ptr, len);
+        au_url->all_headers_len += len;
     } else {
-        ICECAST_LOG_ERROR("Can not allocate authbackend_userdata. BAD.");
+        ICECAST_LOG_ERROR("Can not allocate buffer for auth backend reply headers. BAD.");
     }
 
     ICECAST_LOG_DEBUG("Got header: %* #H", (int)(size * nmemb + 2), ptr);
 
     if (url->auth_header && len >= url->auth_header_len && strncasecmp(ptr, url->auth_header, url->auth_header_len) == 0) {
-        url->result = AUTH_OK;
+        au_url->result = AUTH_OK;
     }
 
     if (url->timelimit_header && len > url->timelimit_header_len && strncasecmp(ptr, url->timelimit_header, url->timelimit_header_len) == 0) {
@@ -301,6 +542,7 @@ static size_t handle_returned_header(void      *ptr,
 
             if (sscanf(input, "%u\r\n", &limit) == 1) {
                 client->con->discon_time = time(NULL) + limit;
+                url_cache_skip(au_url);
             } else {
                 ICECAST_LOG_ERROR("Auth backend returned invalid timeline header: Can not parse limit");
             }
@@ -325,6 +567,286 @@ static size_t handle_returned_header(void      *ptr,
     return len;
 }
 
+static CURL *url_get_handle(auth_url *url)
+{
+    CURL *handle;
+
+    if (url->idle_count)
+        return url->idle[--url->idle_count];
+
+    handle = icecast_curl_new(NULL, NULL);
+    if (!handle)
+        return NULL;
+
+    curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, handle_returned_header);
+    curl_easy_setopt(handle, CURLOPT_TIMEOUT, url->timeout);
+
+    return handle;
+}
+
+static void url_put_handle(auth_url *url, CURL *handle)
+{
+    /* the error buffer belongs to the request just done */
+    curl_easy_setopt(handle, CURLOPT_ERRORBUFFER, NULL);
+
+    if (url->idle_count < url->max_requests) {
+        url->idle[url->idle_count++] = handle;
+    } else {
+        icecast_curl_free(handle);
+    }
+}
+
+/* starts the request on the multi handle, auth_url_run() reports the result */
+static int url_start_request(auth_client *auth_user, const char *requrl, const char *post, int remove)
+{
+    client_t        *client     = auth_user->client;
+    auth_url        *url        = client->auth->state;
+    auth_user_url_t *au_url;
+    CURL            *handle;
+
+    au_url = calloc(1, sizeof(auth_user_url_t));
+    if (!au_url) {
+        ICECAST_LOG_ERROR("Can not allocate authbackend_userdata. BAD.");
+        return -1;
+    }
+
+    handle = url_get_handle(url);
+    if (!handle) {
+        ICECAST_LOG_ERROR("Can not create a handle for auth to server %s.", requrl);
+        free(au_url);
+        return -1;
+    }
+
+    au_url->remove = remove;
+    au_url->result = AUTH_FAILED;
+    if (!remove && url->cache)
+        au_url->cache_key = url_cache_key(client);
+    auth_user->authbackend_userdata = au_url;
+
+    if (strchr(requrl, '@') == NULL) {
+        if (url->userpwd) {
+            curl_easy_setopt(handle, CURLOPT_USERPWD, url->userpwd);
+        } else {
+            /* auth'd requests may not have a user/pass, but may use query args */
+            if (client->username && client->password) {
+                size_t len = strlen(client->username) + strlen(client->password) + 2;
+                char *userpwd = malloc(len);
+
+                if (userpwd) {
+                    snprintf(userpwd, len, "%s:%s",
+                        client->username, client->password);
+                    curl_easy_setopt(handle, CURLOPT_USERPWD, userpwd);
+                    free(userpwd);
+                } else {
+                    curl_easy_setopt(handle, CURLOPT_USERPWD, "");
+                }
+            } else {
+                curl_easy_setopt(handle, CURLOPT_USERPWD, "");
+            }
+        }
+    } else {
+        /* url has user/pass but libcurl may need to clear any existing settings */
+        curl_easy_setopt(handle, CURLOPT_USERPWD, "");
+    }
+    curl_easy_setopt(handle, CURLOPT_URL, requrl);
+    curl_easy_setopt(handle, CURLOPT_COPYPOSTFIELDS, post);
+    curl_easy_setopt(handle, CURLOPT_WRITEHEADER, auth_user);
+    curl_easy_setopt(handle, CURLOPT_ERRORBUFFER, au_url->errormsg);
+    curl_easy_setopt(handle, CURLOPT_PRIVATE, auth_user);
+
+    if (curl_multi_add_handle(url->multi, handle) != CURLM_OK) {
+        ICECAST_LOG_ERROR("Can not start auth to server %s.", requrl);
+        url_put_handle(url, handle);
+        auth_user_url_clear(auth_user);
+        return -1;
+    }
+
+    return 0;
+}
+
+static auth_result url_finish_request(auth_client *auth_user, CURLcode res)
+{
+    auth_url        *url        = auth_user->client->auth->state;
+    auth_user_url_t *au_url     = auth_user->authbackend_userdata;
+    auth_result      result;
+
+    if (au_url->remove) {
+        if (res != CURLE_OK)
+            ICECAST_LOG_WARN("auth to server %s failed with %s",
+                url->removeurl, au_url->errormsg);
+        result = AUTH_OK;
+    } else if (res != CURLE_OK) {
+        ICECAST_LOG_WARN("auth to server %s failed with %s",
+            url->addurl, au_url->errormsg);
+        result = AUTH_FAILED;
+    } else {
+        /* we received a response, lets see what it is */
+        result = au_url->result;
+        if (result == AUTH_FAILED) {
+            ICECAST_LOG_INFO("client auth (%s) failed with \"%s\"",
+                url->addurl, au_url->errormsg);
+        }
+
+        if (au_url->cache_key) {
+            unsigned int ttl = result == AUTH_OK ? url->cache_ttl : url->cache_negative_ttl;
+
+            if (ttl) {
+                url_cache_store(url, au_url->cache_key, result, ttl);
+                au_url->cache_key = NULL;
+            }
+        }
+    }
+
+    auth_user_url_clear(auth_user);
+
+    return result;
+}
+
+static void url_flush_batch(auth_url *url)
+{
+    ice_config_t   *config;
+    char           *server;
+    int             port;
+    char            head[1024];
+    char           *post;
+    int             ret;
+    CURL           *handle;
+
+    if (!url->batch_count)
+        return;
+
+    config = config_get_config();
+    server = util_url_escape(config->hostname);
+    port = config->port;
+    config_release_config();
+
+    ret = snprintf(head, sizeof(head), "action=%s&server=%s&port=%d&count=%u",
+            url->removeaction, /* already escaped */
+            server, port, url->batch_count);
+    free(server);
+
+    if (ret <= 0 || ret >= (int)sizeof(head) || !(post = malloc(ret + url->batch_len + 1))) {
+        ICECAST_LOG_ERROR("Can not build listener_remove for %u clients.", url->batch_count);
+        url->batch_len = 0;
+        url->batch_count = 0;
+        return;
+    }
+
+    memcpy(post, head, ret);
+    memcpy(post + ret, url->batch, url->batch_len);
+    post[ret + url->batch_len] = 0;
+
+    ICECAST_LOG_DEBUG("Sending listener_remove for %u clients", url->batch_count);
+    url->batch_len = 0;
+    url->batch_count = 0;
+
+    handle = url_get_handle(url);
+    if (!handle) {
+        ICECAST_LOG_ERROR("Can not create a handle for auth to server %s.", url->removeurl);
+        free(post);
+        return;
+    }
+
+    curl_easy_setopt(handle, CURLOPT_USERPWD, url->userpwd && strchr(url->removeurl, '@') == NULL ? url->userpwd : "");
+    curl_easy_setopt(handle, CURLOPT_URL, url->removeurl);
+    curl_easy_setopt(handle, CURLOPT_COPYPOSTFIELDS, post);
+    curl_easy_setopt(handle, CURLOPT_WRITEHEADER, NULL);
+    curl_easy_setopt(handle, CURLOPT_PRIVATE, NULL);
+    free(post);
+
+    if (curl_multi_add_handle(url->multi, handle) != CURLM_OK) {
+        ICECAST_LOG_ERROR("Can not start auth to server %s.", url->removeurl);
+        url_put_handle(url, handle);
+        return;
+    }
+
+    url->batch_running++;
+}
+
+static void auth_url_run(auth_t *auth, unsigned int timeout)
+{
+    auth_url *url = auth->state;
+    CURLMsg  *msg;
+    int       running;
+    int       left;
+
+    if (url->batch_count && (timing_get_time() - url->batch_started) >= url->remove_batch_ms)
+        url_flush_batch(url);
+
+    curl_multi_perform(url->multi, &running);
+
+    while ((msg = curl_multi_info_read(url->multi, &left))) {
+        CURL         *handle;
+        CURLcode      res;
+        char         *private = NULL;
+        auth_client  *auth_user;
+
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+
+        /* msg is gone once the handle is removed */
+        handle = msg->easy_handle;
+        res = msg->data.result;
+
+        curl_easy_getinfo(handle, CURLINFO_PRIVATE, &private);
+        curl_multi_remove_handle(url->multi, handle);
+        url_put_handle(url, handle);
+
+        auth_user = (auth_client*)private;
+        if (!auth_user) {
+            url->batch_running--;
+            if (res != CURLE_OK)
+                ICECAST_LOG_WARN("auth to server %s failed with %s",
+                    url->removeurl, curl_easy_strerror(res));
+            continue;
+        }
+
+        auth_client_done(auth, auth_user, url_finish_request(auth_user, res));
+    }
+
+    auth->busy = url->batch_count || url->batch_running;
+
+    if (auth->in_flight || url->batch_running) {
+        curl_multi_wait(url->multi, NULL, 0, timeout, NULL);
+    } else if (auth->busy) {
+        /* only a batch waiting to be sent */
+        thread_sleep(timeout * 1000);
+    }
+}
+
+/* adds the listener to the batch, returns -1 if it can not be added */
+static int url_batch_add(auth_t *auth, const char *row, size_t len)
+{
+    auth_url *url = auth->state;
+
+    if ((url->batch_size - url->batch_len) < len) {
+        size_t size = url->batch_size ? url->batch_size : 4096;
+        char *n;
+
+        while ((size - url->batch_len) < len)
+            size *= 2;
+
+        n = realloc(url->batch, size);
+        if (!n)
+            return -1;
+        url->batch = n;
+        url->batch_size = size;
+    }
+
+    if (!url->batch_count)
+        url->batch_started = timing_get_time();
+
+    memcpy(url->batch + url->batch_len, row, len);
+    url->batch_len += len;
+    url->batch_count++;
+    auth->busy = 1;
+
+    if (url->batch_count >= url->remove_batch)
+        url_flush_batch(url);
+
+    return 0;
+}
+
 static auth_result url_remove_client(auth_client *auth_user)
 {
     client_t       *client      = auth_user->client;
@@ -338,8 +860,7 @@ static auth_result url_remove_client(auth_client *auth_user)
     const char     *mountreq;
     ice_config_t   *config;
     int             port;
-    char           *userpwd     = NULL,
-                    post[4096];
+    char            post[4096];
     const char     *agent;
     char           *user_agent,
                    *ipaddr;
@@ -379,12 +900,22 @@ static auth_result url_remove_client(auth_client *auth_user)
     mount = util_url_escape(mountreq);
     ipaddr = util_url_escape(client->con->ip);
 
-    ret = snprintf(post, sizeof(post),
-            "action=%s&server=%s&port=%d&client=%lu&mount=%s"
-            "&user=%s&pass=%s&duration=%lu&ip=%s&agent=%s",
-            url->removeaction, /* already escaped */
-            server, port, client->con->id, mount, username,
-            password, (long unsigned)duration, ipaddr, user_agent);
+    if (url->remove_batch) {
+        unsigned int i = url->batch_count;
+
+        ret = snprintf(post, sizeof(post),
+                "&client[%u]=%lu&mount[%u]=%s&user[%u]=%s&pass[%u]=%s"
+                "&duration[%u]=%lu&ip[%u]=%s&agent[%u]=%s",
+                i, client->con->id, i, mount, i, username, i, password,
+                i, (long unsigned)duration, i, ipaddr, i, user_agent);
+    } else {
+        ret = snprintf(post, sizeof(post),
+                "action=%s&server=%s&port=%d&client=%lu&mount=%s"
+                "&user=%s&pass=%s&duration=%lu&ip=%s&agent=%s",
+                url->removeaction, /* already escaped */
+                server, port, client->con->id, mount, username,
+                password, (long unsigned)duration, ipaddr, user_agent);
+    }
 
     free(server);
     free(mount);
@@ -399,38 +930,16 @@ static auth_result url_remove_client(auth_client *auth_user)
         return AUTH_FAILED;
     }
 
-    if (strchr (url->removeurl, '@') == NULL) {
-        if (url->userpwd) {
-            curl_easy_setopt(url->handle, CURLOPT_USERPWD, url->userpwd);
-        } else {
-            /* auth'd requests may not have a user/pass, but may use query args */
-            if (client->username && client->password) {
-                size_t len = strlen(client->username) +
-                    strlen(client->password) + 2;
-                userpwd = malloc(len);
-                snprintf(userpwd, len, "%s:%s",
-                    client->username, client->password);
-                curl_easy_setopt(url->handle, CURLOPT_USERPWD, userpwd);
-            } else {
-                curl_easy_setopt(url->handle, CURLOPT_USERPWD, "");
-            }
-        }
-    } else {
-        /* url has user/pass but libcurl may need to clear any existing settings */
-        curl_easy_setopt(url->handle, CURLOPT_USERPWD, "");
+    if (url->remove_batch) {
+        if (url_batch_add(auth, post, ret) != 0)
+            ICECAST_LOG_ERROR("Can not add client %p to listener_remove batch.", client);
+        return AUTH_OK;
     }
-    curl_easy_setopt(url->handle, CURLOPT_URL, url->removeurl);
-    curl_easy_setopt(url->handle, CURLOPT_POSTFIELDS, post);
-    curl_easy_setopt(url->handle, CURLOPT_WRITEHEADER, auth_user);
 
-    if (curl_easy_perform (url->handle))
-        ICECAST_LOG_WARN("auth to server %s failed with %s",
-            url->removeurl, url->errormsg);
-
-    free(userpwd);
-    auth_user_url_clear(auth_user);
+    if (url_start_request(auth_user, url->removeurl, post, 1) != 0)
+        return AUTH_OK;
 
-    return AUTH_OK;
+    return AUTH_PENDING;
 }
 
 
@@ -439,8 +948,7 @@ static auth_result url_add_client(auth_client *auth_user)
     client_t       *client      = auth_user->client;
     auth_t         *auth        = client->auth;
     auth_url       *url         = auth->state;
-    int             res         = 0,
-                    port;
+    int             port;
     const char     *agent;
     char           *user_agent,
                    *username,
@@ -450,7 +958,7 @@ static auth_result url_add_client(auth_client *auth_user)
                    *ipaddr,
                    *server;
     ice_config_t   *config;
-    char           *userpwd    = NULL, post [4096];
+    char            post [4096];
     ssize_t         post_offset;
     char           *pass_headers,
                    *cur_header,
@@ -553,47 +1061,10 @@ static auth_result url_add_client(auth_client *auth_user)
         free(pass_headers);
     }
 
-    if (strchr(url->addurl, '@') == NULL) {
-        if (url->userpwd) {
-            curl_easy_setopt(url->handle, CURLOPT_USERPWD, url->userpwd);
-        } else {
-            /* auth'd requests may not have a user/pass, but may use query args */
-            if (client->username && client->password) {
-                size_t len = strlen(client->username) + strlen(client->password) + 2;
-                userpwd = malloc (len);
-                snprintf(userpwd, len, "%s:%s",
-                    client->username, client->password);
-                curl_easy_setopt(url->handle, CURLOPT_USERPWD, userpwd);
-            } else {
-                curl_easy_setopt (url->handle, CURLOPT_USERPWD, "");
-            }
-        }
-    } else {
-        /* url has user/pass but libcurl may need to clear any existing settings */
-        curl_easy_setopt(url->handle, CURLOPT_USERPWD, "");
-    }
-    curl_easy_setopt(url->handle, CURLOPT_URL, url->addurl);
-    curl_easy_setopt(url->handle, CURLOPT_POSTFIELDS, post);
-    curl_easy_setopt(url->handle, CURLOPT_WRITEHEADER, auth_user);
-    url->errormsg[0] = '\0';
-
-    url->result = AUTH_FAILED;
-    res = curl_easy_perform(url->handle);
-
-    free(userpwd);
-    auth_user_url_clear(auth_user);
-
-    if (res) {
-        ICECAST_LOG_WARN("auth to server %s failed with %s",
-            url->addurl, url->errormsg);
+    if (url_start_request(auth_user, url->addurl, post, 0) != 0)
         return AUTH_FAILED;
-    }
-    /* we received a response, lets see what it is */
-    if (url->result == AUTH_FAILED) {
-        ICECAST_LOG_INFO("client auth (%s) failed with \"%s\"",
-            url->addurl, url->errormsg);
-    }
-    return url->result;
+
+    return AUTH_PENDING;
 }
 
 static auth_result auth_url_adduser(auth_t      *auth,
@@ -623,9 +1094,14 @@ int auth_get_url_auth(auth_t *authenticator, config_options_t *options)
     authenticator->adduser      = auth_url_adduser;
     authenticator->deleteuser   = auth_url_deleteuser;
     authenticator->listuser     = auth_url_listuser;
+    authenticator->run          = auth_url_run;
 
     url_info                    = calloc(1, sizeof(auth_url));
     authenticator->state        = url_info;
+    url_info->max_requests      = DEFAULT_MAX_REQUESTS;
+    url_info->timeout           = DEFAULT_TIMEOUT;
+    url_info->cache_size        = DEFAULT_CACHE_SIZE;
+    url_info->remove_batch_ms   = DEFAULT_REMOVE_BATCH_MS;
 
     /* force auth thread to call function. this makes sure the auth_t is attached to client */
     authenticator->authenticate_client = url_add_client;
@@ -667,6 +1143,35 @@ int auth_get_url_auth(auth_t *authenticator, config_options_t *options)
         } else if (strcmp(options->name, "header_alter_argument") == 0) {
             util_replace_string(&(url_info->header_alter_argument), options->value);
             util_strtolower(url_info->header_alter_argument);
+        } else if (strcmp(options->name, "max_requests") == 0) {
+            long int value = strtol(options->value, NULL, 10);
+            if (value < 1) {
+                ICECAST_LOG_ERROR("Invalid max_requests %s, using %d", options->value, DEFAULT_MAX_REQUESTS);
+            } else {
+                url_info->max_requests = value;
+            }
+        } else if (strcmp(options->name, "cache_ttl") == 0) {
+            url_info->cache_ttl = util_str_to_unsigned_int(options->value, 0);
+        } else if (strcmp(options->name, "cache_negative_ttl") == 0) {
+            url_info->cache_negative_ttl = util_str_to_unsigned_int(options->value, 0);
+        } else if (strcmp(options->name, "cache_size") == 0) {
+            long int value = strtol(options->value, NULL, 10);
+            if (value < 1) {
+                ICECAST_LOG_ERROR("Invalid cache_size %s, using %d", options->value, DEFAULT_CACHE_SIZE);
+            } else {
+                url_info->cache_size = value;
+            }
+        } else if (strcmp(options->name, "remove_batch") == 0) {
+            url_info->remove_batch = util_str_to_unsigned_int(options->value, 0);
+        } else if (strcmp(options->name, "remove_batch_ms") == 0) {
+            url_info->remove_batch_ms = util_str_to_unsigned_int(options->value, DEFAULT_REMOVE_BATCH_MS);
+        } else if (strcmp(options->name, "timeout") == 0) {
+            long int value = strtol(options->value, NULL, 10);
+            if (value < 1) {
+                ICECAST_LOG_ERROR("Invalid timeout %s, using %d", options->value, DEFAULT_TIMEOUT);
+            } else {
+                url_info->timeout = value;
+            }
         } else {
             ICECAST_LOG_ERROR("Unknown option: %s", options->name);
         }
@@ -676,11 +1181,21 @@ int auth_get_url_auth(auth_t *authenticator, config_options_t *options)
     url_info->addaction = util_url_escape(addaction);
     url_info->removeaction = util_url_escape(removeaction);
 
-    url_info->handle = icecast_curl_new(NULL, &url_info->errormsg[0]);
-    if (url_info->handle == NULL) {
+    authenticator->max_in_flight = url_info->max_requests;
+    url_info->idle = calloc(url_info->max_requests, sizeof(CURL*));
+    url_info->multi = curl_multi_init();
+    if (url_info->idle == NULL || url_info->multi == NULL) {
         auth_url_clear(authenticator);
         return -1;
     }
+    if (url_info->cache_ttl || url_info->cache_negative_ttl) {
+        thread_mutex_create(&url_info->cache_lock);
+        url_info->cache = avl_tree_new(url_cache_compare, NULL);
+        authenticator->lookup_client = auth_url_lookup_client;
+    }
+
+    /* keep a connection for each request that may run at once */
+    curl_multi_setopt(url_info->multi, CURLMOPT_MAXCONNECTS, (long)url_info->max_requests);
 
     /* default headers */
     if (url_info->auth_header) {
@@ -703,8 +1218,6 @@ int auth_get_url_auth(auth_t *authenticator, config_options_t *options)
     if (url_info->timelimit_header)
         url_info->timelimit_header_len = strlen (url_info->timelimit_header);
 
-    curl_easy_setopt(url_info->handle, CURLOPT_HEADERFUNCTION, handle_returned_header);
-
     if (url_info->username && url_info->password) {
         int len = strlen(url_info->username) + strlen(url_info->password) + 2;
         url_info->userpwd = malloc(len);
@@ -18,6 +18,9 @@
 #include "buffer.h"
 #include "refobject.h"
 
+/* Size of the storage within the object used for short contents */
+#define BUFFER_INLINE_SIZE  128
+
 struct buffer_tag {
     refobject_base_t __base;
     /* Buffer itself */
@@ -28,13 +31,16 @@ struct buffer_tag {
     size_t fill;
     /* Bytes of offset at the start of the buffer */
     size_t offset;
+    /* Used as buffer as long as the content fits */
+    char inline_buffer[BUFFER_INLINE_SIZE];
 };
 
 static void __free(refobject_t self, void **userdata)
 {
     buffer_t *buffer = REFOBJECT_TO_TYPE(self, buffer_t*);
 
-    free(buffer->buffer);
+    if (buffer->buffer != buffer->inline_buffer)
+        free(buffer->buffer);
 }
 
 REFOBJECT_DEFINE_TYPE(buffer_t,
@@ -86,10 +92,27 @@ void        buffer_preallocate(buffer_t *buffer, size_t request)
     if (buffer->length >= newlen)
         return;
 
+    /* Short contents do not need any allocation */
+    if (!buffer->buffer && newlen <= sizeof(buffer->inline_buffer)) {
+        buffer->buffer = buffer->inline_buffer;
+        buffer->length = sizeof(buffer->inline_buffer);
+        return;
+    }
+
+    /* Grow at least to twice the size, so many small pushes only need few reallocations */
+    if (newlen < (2*buffer->length))
+        newlen = 2*buffer->length;
+
     /* Make sure we at least add 64 bytes and are 64 byte aligned */
     newlen = newlen + 64 - (newlen % 64);
 
-    n = realloc(buffer->buffer, newlen);
+    if (buffer->buffer == buffer->inline_buffer) {
+        n = malloc(newlen);
+        if (n)
+            memcpy(n, buffer->buffer, buffer->fill);
+    } else {
+        n = realloc(buffer->buffer, newlen);
+    }
 
     /* Just return if this failed */
     if (!n)
@@ -222,7 +245,8 @@ int         buffer_push_vprintf(buffer_t *buffer, const char *format, va_list ap
 {
     void *buf;
     int ret;
-    size_t length = 1024;
+    size_t length;
+    va_list apx;
 
     if (!buffer || !format)
         return -1;
@@ -230,11 +254,19 @@ int         buffer_push_vprintf(buffer_t *buffer, const char *format, va_list ap
     if (!*format)
         return 0;
 
+    /* First try with the space we already have, so short strings need no allocation */
+    length = buffer->length - buffer->fill;
+    if (length < 64)
+        length = 64;
+
     ret = buffer_zerocopy_push_request(buffer, &buf, length);
     if (ret != 0)
         return ret;
 
-    ret = vsnprintf(buf, length, format, ap);
+    /* ap may be used a second time below */
+    va_copy(apx, ap);
+    ret = vsnprintf(buf, length, format, apx);
+    va_end(apx);
     if (ret >= 0 && (size_t)ret < length) {
         return buffer_zerocopy_push_complete(buffer, ret);
     } else if (ret < 0) {
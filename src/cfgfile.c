@@ -47,13 +47,20 @@
 #include "connection.h"
 #include "main.h"
 #include "slave.h"
+#include "source.h"
 #include "xslt.h"
 #include "prng.h"
+#include "egress.h"
+#include "affinity.h"
 
 #define CATMODULE                       "CONFIG"
 #define RANGE_PORT                      1, 65535
 #define RANGE_ICY_INTERVAL              -1, (64*1024)
 #define RANGE_SNDBUF                    1024, (64*1024)
+#define RANGE_RCVBUF                    1024, (16*1024*1024)
+#define RANGE_LISTEN_BACKLOG            1, 65535
+#define RANGE_DEFER_ACCEPT              0, 600
+#define RANGE_TCP_FASTOPEN              0, 65535
 #define CONFIG_DEFAULT_LOCATION         "Earth"
 #define CONFIG_DEFAULT_ADMIN            "icemaster@localhost"
 #define CONFIG_DEFAULT_CLIENT_LIMIT     256
@@ -63,10 +70,44 @@
 #define CONFIG_MAX_LISTENERS            (CONFIG_MAX_CLIENT_LIMIT/2)
 #define CONFIG_DEFAULT_QUEUE_SIZE_LIMIT (500*1024)
 #define CONFIG_MAX_QUEUE_SIZE_LIMIT     (16 *1024*1024)
+#define CONFIG_MAX_QUEUE_MEMORY_LIMIT   (UINT_MAX)
+#define CONFIG_MAX_MEMORY_LIMIT         (1024*1024)
+#define CONFIG_DEFAULT_MEMORY_SHED_THRESHOLD    80
+#define CONFIG_DEFAULT_MEMORY_REJECT_THRESHOLD  95
 #define CONFIG_DEFAULT_BODY_SIZE_LIMIT  (4*1024)
 #define CONFIG_MIN_BODY_SIZE_LIMIT      ( 1*1024)
 #define CONFIG_MAX_BODY_SIZE_LIMIT      (64*1024)
 #define CONFIG_DEFAULT_BURST_SIZE       (64*1024)
+#define CONFIG_MAX_LISTENER_WORKERS     64
+#define CONFIG_RANGE_INGEST_BUFFER_SIZE 128, (16*1024)
+#define CONFIG_MAX_INGEST_LATENCY       10000
+#define CONFIG_RANGE_LISTENER_SEND_BUFFER_TIME  100, 60000
+#define CONFIG_RANGE_LISTENER_NOTSENT_LOWAT     1024, (16*1024*1024)
+#define CONFIG_RANGE_LISTENER_PACING            100, 1000
+#define CONFIG_RANGE_MAX_LAG            1, 3600
+#define CONFIG_RANGE_TIMESHIFT_SIZE     (1024*1024), UINT_MAX
+#define CONFIG_RANGE_SHM_SIZE           (64*1024), UINT_MAX
+#define CONFIG_RANGE_HLS_SEGMENT_DURATION   1, 60
+#define CONFIG_RANGE_HLS_SEGMENTS           2, 100
+#define CONFIG_RANGE_MULTICAST_PORT     1, 65535
+#define CONFIG_RANGE_MULTICAST_TTL      1, 255
+#define CONFIG_DEFAULT_SOURCE_WORKERS   1
+#define CONFIG_MAX_SOURCE_WORKERS       64
+#define CONFIG_DEFAULT_FSERVE_WORKERS   1
+#define CONFIG_MAX_FSERVE_WORKERS       64
+#define CONFIG_DEFAULT_ACCEPT_THREADS   1
+#define CONFIG_MAX_ACCEPT_THREADS       64
+#define CONFIG_DEFAULT_TLS_HANDSHAKE_WORKERS   1
+#define CONFIG_MAX_TLS_HANDSHAKE_WORKERS       64
+#define CONFIG_DEFAULT_REQUEST_WORKERS  0
+#define CONFIG_MAX_REQUEST_WORKERS      64
+#define CONFIG_DEFAULT_EVENT_WORKERS    1
+#define CONFIG_MAX_EVENT_WORKERS        64
+#define CONFIG_DEFAULT_EVENT_QUEUE_SIZE 1024
+#define CONFIG_RANGE_EVENT_QUEUE_SIZE   16, 1048576
+#define CONFIG_DEFAULT_XSLT_CACHE_SIZE         3
+#define CONFIG_MAX_XSLT_CACHE_SIZE             1024
+#define CONFIG_MAX_XSLT_OUTPUT_CACHE_AGE       3600
 #define CONFIG_DEFAULT_THREADPOOL_SIZE  4
 #define CONFIG_DEFAULT_CLIENT_TIMEOUT   30
 #define CONFIG_RANGE_CLIENT_TIMEOUT     2, 600
@@ -77,6 +118,12 @@
 #define CONFIG_RANGE_SOURCE_TIMEOUT     CONFIG_RANGE_CLIENT_TIMEOUT
 #define CONFIG_DEFAULT_BODY_TIMEOUT     (10 + CONFIG_DEFAULT_HEADER_TIMEOUT)
 #define CONFIG_RANGE_BODY_TIMEOUT       CONFIG_RANGE_CLIENT_TIMEOUT
+#define CONFIG_DEFAULT_KEEPALIVE_TIMEOUT    5
+#define CONFIG_RANGE_KEEPALIVE_TIMEOUT  1, 600
+#define CONFIG_DEFAULT_KEEPALIVE_REQUESTS   1000
+#define CONFIG_RANGE_KEEPALIVE_REQUESTS 1, 1000000
+#define CONFIG_RANGE_SHUTDOWN_DRAIN     0, 300
+#define CONFIG_RANGE_SHUTDOWN_TIMEOUT   0, 3600
 #define CONFIG_DEFAULT_MASTER_USERNAME  "relay"
 #define CONFIG_DEFAULT_SHOUTCAST_MOUNT  "/stream"
 #define CONFIG_DEFAULT_SHOUTCAST_USER   "source"
@@ -88,6 +135,9 @@
 #define CONFIG_DEFAULT_LOG_LEVEL        ICECAST_LOGLEVEL_INFO
 #define CONFIG_DEFAULT_LOG_LINES_KEPT   64
 #define CONFIG_RANGE_LOG_LINES_KEPT     8, 1024
+#define CONFIG_DEFAULT_LOG_QUEUE_SIZE   1024
+#define CONFIG_RANGE_ACCESS_LOG_SAMPLE  1, 1000000
+#define CONFIG_RANGE_LOG_QUEUE_SIZE     0, 1048576
 #define CONFIG_DEFAULT_CHROOT           0
 #define CONFIG_DEFAULT_CHUID            0
 #define CONFIG_DEFAULT_USER             NULL
@@ -135,6 +185,12 @@
                                         "!EDH-DSS-DES-CBC3-SHA:" \
                                         "!EDH-RSA-DES-CBC3-SHA:" \
                                         "!KRB5-DES-CBC3-SHA"
+#define CONFIG_DEFAULT_TLS_SESSION_CACHE    20480
+#define CONFIG_MAX_TLS_SESSION_CACHE        (1024*1024)
+#define CONFIG_DEFAULT_TLS_SESSION_TIMEOUT  3600
+#define CONFIG_MAX_TLS_SESSION_TIMEOUT      (7*24*3600)
+#define CONFIG_DEFAULT_TLS_TICKET_LIFETIME  3600
+#define CONFIG_MAX_TLS_TICKET_LIFETIME      (7*24*3600)
 
 #ifndef _WIN32
 #define CONFIG_DEFAULT_BASE_DIR         "/usr/local/icecast"
@@ -169,7 +225,7 @@
 #define CONFIG_LEGACY_RELAY_NAME            "legacy-relay"
 #define CONFIG_LEGACY_RELAY_METHODS         CONFIG_LEGACY_ALL_METHODS
 #define CONFIG_LEGACY_RELAY_ALLOW_WEB       true
-#define CONFIG_LEGACY_RELAY_ALLOW_ADMIN     "streamlist.txt"
+#define CONFIG_LEGACY_RELAY_ALLOW_ADMIN     "streamlist.txt,relaymux,clusterload"
 
 #define CONFIG_LEGACY_ANONYMOUS_NAME        "anonymous"
 #define CONFIG_LEGACY_ANONYMOUS_METHODS     CONFIG_LEGACY_ALL_METHODS ",post,head"
@@ -185,17 +241,26 @@ enum bad_tag_reason {
 };
 
 static ice_config_t _current_configuration;
+static unsigned int _current_generation;
 static ice_config_locks _locks;
 
 static void __found_bad_tag(ice_config_t *configuration, xmlNodePtr node, enum bad_tag_reason reason, const char *extra);
 static void _set_defaults(ice_config_t *c);
 static void _parse_root(xmlDocPtr doc, xmlNodePtr node, ice_config_t *c);
 static void _parse_limits(xmlDocPtr doc, xmlNodePtr node, ice_config_t *c);
+static void _parse_cpu_affinity(xmlDocPtr doc, xmlNodePtr node, ice_config_t *c);
 static void _parse_oldstyle_directory(xmlDocPtr doc, xmlNodePtr node, ice_config_t *c);
 static void _parse_yp_directory(xmlDocPtr doc, xmlNodePtr node, ice_config_t *c);
 static void _parse_paths(xmlDocPtr doc, xmlNodePtr node, ice_config_t *c);
 static void _parse_logging(xmlDocPtr doc, xmlNodePtr node, ice_config_t *c);
 static void _parse_security(xmlDocPtr doc, xmlNodePtr node, ice_config_t *c);
+static uint64_t __fingerprint_node(uint64_t hash, xmlDocPtr doc, xmlNodePtr node);
+static struct config_mount_index_tag *config_build_mount_index(ice_config_t *c);
+static void config_clear_mount_index(struct config_mount_index_tag *index);
+
+/* FNV-1a offset basis and prime, see __fingerprint_node() */
+#define FINGERPRINT_INIT    14695981039346656037ULL
+#define FINGERPRINT_PRIME   1099511628211ULL
 
 static void _parse_authentication(xmlDocPtr                 doc,
                                   xmlNodePtr                node,
@@ -204,6 +269,8 @@ static void _parse_authentication(xmlDocPtr                 doc,
 
 static void _parse_relay(xmlDocPtr doc, xmlNodePtr node, ice_config_t *c, const char *mount);
 static void _parse_mount(xmlDocPtr doc, xmlNodePtr parentnode, ice_config_t *c);
+static void _parse_mount_multicast(xmlDocPtr doc, xmlNodePtr node, mount_proxy *mount, ice_config_t *c);
+static void _parse_mount_hls(xmlDocPtr doc, xmlNodePtr node, mount_proxy *mount, ice_config_t *c);
 
 static void _parse_listen_socket(xmlDocPtr                  doc,
                                  xmlNodePtr                 node,
@@ -267,6 +334,21 @@ static fallback_override_t config_str_to_fallback_override_t(ice_config_t *confi
     }
 }
 
+static lag_action_t config_str_to_lag_action_t(ice_config_t *configuration, xmlNodePtr node, const char *str)
+{
+    if (!str || !*str || strcasecmp(str, "drop") == 0) {
+        return LAG_ACTION_DROP;
+    } else if (strcasecmp(str, "skip") == 0) {
+        return LAG_ACTION_SKIP;
+    } else if (strcasecmp(str, "fallback") == 0) {
+        return LAG_ACTION_FALLBACK;
+    } else {
+        __found_bad_tag(configuration, node, BTR_INVALID, str);
+        ICECAST_LOG_ERROR("Unknown lag action \"%s\", falling back to drop.", str);
+        return LAG_ACTION_DROP;
+    }
+}
+
 char * config_href_to_id(ice_config_t *configuration, xmlNodePtr node, const char *href)
 {
     if (!href || !*href)
@@ -815,7 +897,12 @@ static void config_clear_mount(mount_proxy *mount)
 {
     if (mount->mountname)           xmlFree(mount->mountname);
     if (mount->dumpfile)            xmlFree(mount->dumpfile);
+    if (mount->capture_file)        xmlFree(mount->capture_file);
     if (mount->intro_filename)      xmlFree(mount->intro_filename);
+    if (mount->timeshift_filename)  xmlFree(mount->timeshift_filename);
+    if (mount->shm_filename)        xmlFree(mount->shm_filename);
+    if (mount->multicast_group)     xmlFree(mount->multicast_group);
+    if (mount->multicast_interface) xmlFree(mount->multicast_interface);
     if (mount->fallback_mount)      xmlFree(mount->fallback_mount);
     if (mount->stream_name)         xmlFree(mount->stream_name);
     if (mount->stream_description)  xmlFree(mount->stream_description);
@@ -919,10 +1006,15 @@ void config_clear(ice_config_t *c)
     if (c->master_server)   xmlFree(c->master_server);
     if (c->master_username) xmlFree(c->master_username);
     if (c->master_password) xmlFree(c->master_password);
+    if (c->cluster_url)     xmlFree(c->cluster_url);
     if (c->user)            xmlFree(c->user);
     if (c->group)           xmlFree(c->group);
     if (c->mimetypes_fn)    xmlFree(c->mimetypes_fn);
 
+    for (i = 0; i < CPU_AFFINITY_MAX; i++)
+        if (c->cpu_affinity[i])
+            xmlFree(c->cpu_affinity[i]);
+
     if (c->tls_context.cert_file)       xmlFree(c->tls_context.cert_file);
     if (c->tls_context.key_file)        xmlFree(c->tls_context.key_file);
     if (c->tls_context.cipher_list)     xmlFree(c->tls_context.cipher_list);
@@ -938,6 +1030,8 @@ void config_clear(ice_config_t *c)
     free(c->relay);
     thread_mutex_unlock(&(_locks.relay_lock));
 
+    config_clear_mount_index(c->mount_index);
+
     mount = c->mounts;
     while (mount) {
         nextmount = mount->next;
@@ -984,32 +1078,181 @@ void config_reread_config(void)
                 ICECAST_LOG_ERROR("Not an icecast2 config file: %s",
                         config->config_filename);
             break;
+            case CONFIG_EINVALID:
+                ICECAST_LOG_ERROR("Invalid settings in %s", config->config_filename);
+            break;
             default:
                 ICECAST_LOG_ERROR("Parse error in reading %s", config->config_filename);
             break;
         }
         config_release_config();
     } else {
+        config_diff_t diff;
+
+        config_diff(config, &new_config, &diff);
         config_clear(config);
         config_set_config(&new_config);
         config = config_get_config_unlocked();
+        source_fallback_changed();
+        /* these are cheap and also pick up changed files (log rotation,
+         * certificates), so they are always done */
         restart_logging(config);
         prng_configure(config);
+        egress_recheck_config(config);
         main_config_reload(config);
         connection_reread_config(config);
-        yp_recheck_config(config);
+        if (diff.global || diff.yp)
+            yp_recheck_config(config);
         fserve_recheck_mime_types(config);
         stats_global(config);
         config_release_config();
-        slave_update_all_mounts();
+        if (diff.global || diff.default_mounts) {
+            slave_update_all_mounts();
+        } else {
+            ICECAST_LOG_INFO("Configuration reloaded, %zu mount(s) changed%s%s",
+                    diff.mounts_length,
+                    diff.relays ? ", relays changed" : "",
+                    diff.yp ? ", YP directories changed" : "");
+            /* relays may also be defined within a <mount> */
+            slave_update_mounts(diff.mounts, diff.mounts_length, diff.relays || diff.mounts_length);
+            diff.mounts = NULL;
+            diff.mounts_length = 0;
+        }
         xslt_clear_cache();
+        config_diff_clear(&diff);
     }
 }
 
+static int __compare_mount_name(const void *a, const void *b)
+{
+    return strcmp((*(mount_proxy * const *)a)->mountname, (*(mount_proxy * const *)b)->mountname);
+}
+
+static mount_proxy **__sorted_normal_mounts(const ice_config_t *config, size_t *length, uint64_t *defaults)
+{
+    mount_proxy **list;
+    mount_proxy *mount;
+    size_t count = 0;
+
+    *length = 0;
+    *defaults = 0;
+
+    for (mount = config->mounts; mount; mount = mount->next)
+        count++;
+
+    list = calloc(count ? count : 1, sizeof(*list));
+    if (!list)
+        return NULL;
+
+    for (mount = config->mounts; mount; mount = mount->next) {
+        if (mount->mounttype == MOUNT_TYPE_NORMAL && mount->mountname) {
+            list[(*length)++] = mount;
+        } else {
+            *defaults = (*defaults * FINGERPRINT_PRIME) ^ mount->fingerprint;
+        }
+    }
+
+    qsort(list, *length, sizeof(*list), __compare_mount_name);
+
+    return list;
+}
+
+static void __diff_add_mount(config_diff_t *diff, const char *name)
+{
+    char **n;
+    char *copy;
+
+    /* grow in powers of two, starting with 4 */
+    if (diff->mounts_length == 0 || (diff->mounts_length >= 4 && (diff->mounts_length & (diff->mounts_length - 1)) == 0)) {
+        n = realloc(diff->mounts, sizeof(*n) * (diff->mounts_length ? diff->mounts_length * 2 : 4));
+        if (!n) {
+            diff->default_mounts = true;
+            return;
+        }
+        diff->mounts = n;
+    }
+
+    copy = strdup(name);
+    if (!copy) {
+        diff->default_mounts = true;
+        return;
+    }
+
+    diff->mounts[diff->mounts_length++] = copy;
+}
+
+/* Compares two parsed configurations using the fingerprints of their blocks.
+ * Changes that can not be tracked this way are reported as global.
+ */
+void config_diff(const ice_config_t *old_config, const ice_config_t *new_config, config_diff_t *diff)
+{
+    mount_proxy **old_mounts;
+    mount_proxy **new_mounts;
+    size_t old_length, new_length;
+    uint64_t old_defaults, new_defaults;
+    size_t i = 0, j = 0;
+
+    memset(diff, 0, sizeof(*diff));
+
+    diff->global = old_config->fingerprint_global != new_config->fingerprint_global;
+    diff->relays = old_config->fingerprint_relays != new_config->fingerprint_relays;
+    diff->yp = old_config->fingerprint_yp != new_config->fingerprint_yp;
+
+    old_mounts = __sorted_normal_mounts(old_config, &old_length, &old_defaults);
+    new_mounts = __sorted_normal_mounts(new_config, &new_length, &new_defaults);
+    if (!old_mounts || !new_mounts) {
+        diff->default_mounts = true;
+    } else {
+        diff->default_mounts = old_defaults != new_defaults;
+
+        while (i < old_length || j < new_length) {
+            int cmp;
+
+            if (i == old_length) {
+                cmp = 1;
+            } else if (j == new_length) {
+                cmp = -1;
+            } else {
+                cmp = strcmp(old_mounts[i]->mountname, new_mounts[j]->mountname);
+            }
+
+            if (cmp < 0) {
+                __diff_add_mount(diff, old_mounts[i++]->mountname);
+            } else if (cmp > 0) {
+                __diff_add_mount(diff, new_mounts[j++]->mountname);
+            } else {
+                if (old_mounts[i]->fingerprint != new_mounts[j]->fingerprint)
+                    __diff_add_mount(diff, new_mounts[j]->mountname);
+                i++;
+                j++;
+            }
+        }
+    }
+
+    free(old_mounts);
+    free(new_mounts);
+}
+
+void config_diff_clear(config_diff_t *diff)
+{
+    size_t i;
+
+    for (i = 0; i < diff->mounts_length; i++)
+        free(diff->mounts[i]);
+    free(diff->mounts);
+
+    memset(diff, 0, sizeof(*diff));
+}
+
 int config_initial_parse_file(const char *filename)
 {
+    int ret;
+
     /* Since we're already pointing at it, we don't need to copy it in place */
-    return config_parse_file(filename, &_current_configuration);
+    ret = config_parse_file(filename, &_current_configuration);
+    _current_configuration.generation = ++_current_generation;
+
+    return ret;
 }
 
 int config_parse_file(const char *filename, ice_config_t *configuration)
@@ -1038,6 +1281,7 @@ int config_parse_file(const char *filename, ice_config_t *configuration)
     configuration->config_filename = strdup(filename);
     _parse_root(doc, node->xmlChildrenNode, configuration);
     xmlFreeDoc(doc);
+    configuration->mount_index = config_build_mount_index(configuration);
     _merge_mounts_all(configuration);
 
     if (configuration->client_limit <= (configuration->source_limit*2)) {
@@ -1045,6 +1289,14 @@ int config_parse_file(const char *filename, ice_config_t *configuration)
         ICECAST_LOG_ERROR("Client limit (%i) is too small for given source limit (%i)", configuration->client_limit, configuration->source_limit);
     }
 
+    /* shedding could never start before listeners are turned away */
+    if (configuration->memory_shed_threshold > configuration->memory_reject_threshold) {
+        ICECAST_LOG_ERROR("Memory shed threshold (%u%%) is above the reject threshold (%u%%)",
+                configuration->memory_shed_threshold, configuration->memory_reject_threshold);
+        config_clear(configuration);
+        return CONFIG_EINVALID;
+    }
+
     return 0;
 }
 
@@ -1079,6 +1331,7 @@ ice_config_t *config_grab_config(void)
 void config_set_config(ice_config_t *config)
 {
     memcpy(&_current_configuration, config, sizeof(ice_config_t));
+    _current_configuration.generation = ++_current_generation;
 }
 
 ice_config_t *config_get_config_unlocked(void)
@@ -1102,6 +1355,26 @@ static void _set_defaults(ice_config_t *configuration)
         ->queue_size_limit = CONFIG_DEFAULT_QUEUE_SIZE_LIMIT;
     configuration
         ->body_size_limit = CONFIG_DEFAULT_BODY_SIZE_LIMIT;
+    configuration
+        ->source_workers = CONFIG_DEFAULT_SOURCE_WORKERS;
+    configuration
+        ->fserve_workers = CONFIG_DEFAULT_FSERVE_WORKERS;
+    configuration
+        ->accept_threads = CONFIG_DEFAULT_ACCEPT_THREADS;
+    configuration
+        ->tls_handshake_workers = CONFIG_DEFAULT_TLS_HANDSHAKE_WORKERS;
+    configuration
+        ->request_workers = CONFIG_DEFAULT_REQUEST_WORKERS;
+    configuration
+        ->event_workers = CONFIG_DEFAULT_EVENT_WORKERS;
+    configuration
+        ->memory_shed_threshold = CONFIG_DEFAULT_MEMORY_SHED_THRESHOLD;
+    configuration
+        ->memory_reject_threshold = CONFIG_DEFAULT_MEMORY_REJECT_THRESHOLD;
+    configuration
+        ->event_queue_size = CONFIG_DEFAULT_EVENT_QUEUE_SIZE;
+    configuration
+        ->xslt_cache_size = CONFIG_DEFAULT_XSLT_CACHE_SIZE;
     configuration
         ->client_timeout = CONFIG_DEFAULT_CLIENT_TIMEOUT;
     configuration
@@ -1110,6 +1383,10 @@ static void _set_defaults(ice_config_t *configuration)
         ->source_timeout = CONFIG_DEFAULT_SOURCE_TIMEOUT;
     configuration
         ->body_timeout = CONFIG_DEFAULT_BODY_TIMEOUT;
+    configuration
+        ->keepalive_timeout = CONFIG_DEFAULT_KEEPALIVE_TIMEOUT;
+    configuration
+        ->keepalive_requests = CONFIG_DEFAULT_KEEPALIVE_REQUESTS;
     configuration
         ->shoutcast_mount = (char *) xmlCharStrdup(CONFIG_DEFAULT_SHOUTCAST_MOUNT);
     configuration
@@ -1118,6 +1395,12 @@ static void _set_defaults(ice_config_t *configuration)
         ->fileserve  = CONFIG_DEFAULT_FILESERVE;
     configuration
         ->on_demand = 0;
+    configuration
+        ->latency_histograms = 0;
+    configuration
+        ->flight_recorder = 0;
+    configuration
+        ->huge_pages = 0;
     configuration
         ->hostname = (char *) xmlCharStrdup(CONFIG_DEFAULT_HOSTNAME);
     configuration
@@ -1156,6 +1439,14 @@ static void _set_defaults(ice_config_t *configuration)
         ->access_log_lines_kept = CONFIG_DEFAULT_LOG_LINES_KEPT;
     configuration
         ->error_log_lines_kept = CONFIG_DEFAULT_LOG_LINES_KEPT;
+    configuration
+        ->log_queue_size = CONFIG_DEFAULT_LOG_QUEUE_SIZE;
+    configuration
+        ->log_queue_drop = 0;
+    configuration
+        ->access_log_format = ACCESS_LOG_FORMAT_CLF;
+    configuration
+        ->access_log_sample = 1;
     configuration
         ->chroot = CONFIG_DEFAULT_CHROOT;
     configuration
@@ -1169,6 +1460,12 @@ static void _set_defaults(ice_config_t *configuration)
         ->burst_size = CONFIG_DEFAULT_BURST_SIZE;
     configuration->tls_context
         .cipher_list = (char *) xmlCharStrdup(CONFIG_DEFAULT_CIPHER_LIST);
+    configuration->tls_context
+        .session_cache = CONFIG_DEFAULT_TLS_SESSION_CACHE;
+    configuration->tls_context
+        .session_timeout = CONFIG_DEFAULT_TLS_SESSION_TIMEOUT;
+    configuration->tls_context
+        .ticket_key_lifetime = CONFIG_DEFAULT_TLS_TICKET_LIFETIME;
 }
 
 static inline void __check_hostname(ice_config_t *configuration)
@@ -1227,6 +1524,30 @@ static inline void __check_hostname(ice_config_t *configuration)
         configuration->config_problems |= CONFIG_PROBLEM_HOSTNAME;
 }
 
+/* FNV-1a over the serialised node */
+static uint64_t __fingerprint_node(uint64_t hash, xmlDocPtr doc, xmlNodePtr node)
+{
+    static uint64_t unknown = 0;
+    xmlBufferPtr buffer = xmlBufferCreate();
+    const xmlChar *p;
+
+    if (!buffer || xmlNodeDump(buffer, doc, node, 0, 0) < 0) {
+        /* make sure this never matches a previous configuration */
+        if (buffer)
+            xmlBufferFree(buffer);
+        return hash ^ ++unknown ^ 0x8000000000000000ULL;
+    }
+
+    for (p = xmlBufferContent(buffer); *p; p++) {
+        hash ^= *p;
+        hash *= FINGERPRINT_PRIME;
+    }
+
+    xmlBufferFree(buffer);
+
+    return hash;
+}
+
 static void _parse_root(xmlDocPtr       doc,
                         xmlNodePtr      node,
                         ice_config_t   *configuration)
@@ -1241,11 +1562,25 @@ static void _parse_root(xmlDocPtr       doc,
     configuration
         ->listen_sock_count = 1;
 
+    configuration->fingerprint_global = FINGERPRINT_INIT;
+    configuration->fingerprint_relays = FINGERPRINT_INIT;
+    configuration->fingerprint_yp = FINGERPRINT_INIT;
+
     do {
         if (node == NULL)
             break;
         if (xmlIsBlankNode(node))
             continue;
+
+        /* mounts are fingerprinted one by one in _parse_mount() */
+        if (xmlStrcmp(node->name, XMLSTR("relay")) == 0) {
+            configuration->fingerprint_relays = __fingerprint_node(configuration->fingerprint_relays, doc, node);
+        } else if (xmlStrcmp(node->name, XMLSTR("yp-directory")) == 0 || xmlStrcmp(node->name, XMLSTR("directory")) == 0) {
+            configuration->fingerprint_yp = __fingerprint_node(configuration->fingerprint_yp, doc, node);
+        } else if (xmlStrcmp(node->name, XMLSTR("mount")) != 0 && node->type != XML_COMMENT_NODE) {
+            configuration->fingerprint_global = __fingerprint_node(configuration->fingerprint_global, doc, node);
+        }
+
         if (xmlStrcmp(node->name, XMLSTR("location")) == 0) {
             if (configuration->location)
                 xmlFree(configuration->location);
@@ -1285,6 +1620,20 @@ static void _parse_root(xmlDocPtr       doc,
             configuration->on_demand = util_str_to_bool(tmp);
             if (tmp)
                 xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("relays-on-demand-linger")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &configuration->on_demand_linger, 0, 86400);
+        } else if (xmlStrcmp(node->name, XMLSTR("latency-histograms")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            configuration->latency_histograms = util_str_to_bool(tmp);
+            if (tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("flight-recorder")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &configuration->flight_recorder, 0, 1048576);
+        } else if (xmlStrcmp(node->name, XMLSTR("huge-pages")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            configuration->huge_pages = util_str_to_bool(tmp);
+            if (tmp)
+                xmlFree(tmp);
         } else if (xmlStrcmp(node->name, XMLSTR("hostname")) == 0) {
             if (configuration->hostname)
                 xmlFree(configuration->hostname);
@@ -1325,6 +1674,17 @@ static void _parse_root(xmlDocPtr       doc,
             __read_int(configuration, doc, node, &configuration->master_server_port, RANGE_PORT);
         } else if (xmlStrcmp(node->name, XMLSTR("master-update-interval")) == 0) {
             __read_int(configuration, doc, node, &configuration->master_update_interval, 15, 3600);
+        } else if (xmlStrcmp(node->name, XMLSTR("master-relay-mux")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            configuration->master_relay_mux = util_str_to_bool(tmp);
+            if (tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("cluster-url")) == 0) {
+            if (configuration->cluster_url)
+                xmlFree(configuration->cluster_url);
+            configuration->cluster_url = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+        } else if (xmlStrcmp(node->name, XMLSTR("cluster-redirect-load")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &configuration->cluster_redirect_load, 0, 100);
         } else if (xmlStrcmp(node->name, XMLSTR("shoutcast-mount")) == 0) {
             if (configuration->shoutcast_mount)
                 xmlFree(configuration->shoutcast_mount);
@@ -1467,6 +1827,14 @@ static void _parse_limits(xmlDocPtr     doc,
             __read_int(configuration, doc, node, &configuration->source_timeout, CONFIG_RANGE_SOURCE_TIMEOUT);
         } else if (xmlStrcmp(node->name, XMLSTR("body-timeout")) == 0) {
             __read_int(configuration, doc, node, &configuration->body_timeout, CONFIG_RANGE_BODY_TIMEOUT);
+        } else if (xmlStrcmp(node->name, XMLSTR("keepalive-timeout")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &configuration->keepalive_timeout, CONFIG_RANGE_KEEPALIVE_TIMEOUT);
+        } else if (xmlStrcmp(node->name, XMLSTR("keepalive-requests")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &configuration->keepalive_requests, CONFIG_RANGE_KEEPALIVE_REQUESTS);
+        } else if (xmlStrcmp(node->name, XMLSTR("shutdown-drain")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &configuration->shutdown_drain, CONFIG_RANGE_SHUTDOWN_DRAIN);
+        } else if (xmlStrcmp(node->name, XMLSTR("shutdown-timeout")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &configuration->shutdown_timeout, CONFIG_RANGE_SHUTDOWN_TIMEOUT);
         } else if (xmlStrcmp(node->name, XMLSTR("burst-on-connect")) == 0) {
             __found_bad_tag(configuration, node, BTR_OBSOLETE, "Use <burst-size>.");
             tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
@@ -1476,12 +1844,69 @@ static void _parse_limits(xmlDocPtr     doc,
                 xmlFree(tmp);
         } else if (xmlStrcmp(node->name, XMLSTR("burst-size")) == 0) {
             __read_unsigned_int(configuration, doc, node, &configuration->burst_size, 0, CONFIG_MAX_QUEUE_SIZE_LIMIT);
+        } else if (xmlStrcmp(node->name, XMLSTR("source-workers")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &configuration->source_workers, 1, CONFIG_MAX_SOURCE_WORKERS);
+        } else if (xmlStrcmp(node->name, XMLSTR("fserve-workers")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &configuration->fserve_workers, 1, CONFIG_MAX_FSERVE_WORKERS);
+        } else if (xmlStrcmp(node->name, XMLSTR("accept-threads")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &configuration->accept_threads, 1, CONFIG_MAX_ACCEPT_THREADS);
+        } else if (xmlStrcmp(node->name, XMLSTR("tls-handshake-workers")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &configuration->tls_handshake_workers, 0, CONFIG_MAX_TLS_HANDSHAKE_WORKERS);
+        } else if (xmlStrcmp(node->name, XMLSTR("request-workers")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &configuration->request_workers, 0, CONFIG_MAX_REQUEST_WORKERS);
+        } else if (xmlStrcmp(node->name, XMLSTR("event-workers")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &configuration->event_workers, 1, CONFIG_MAX_EVENT_WORKERS);
+        } else if (xmlStrcmp(node->name, XMLSTR("event-queue-size")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &configuration->event_queue_size, CONFIG_RANGE_EVENT_QUEUE_SIZE);
+        } else if (xmlStrcmp(node->name, XMLSTR("queue-memory-limit")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &configuration->queue_memory_limit, 0, CONFIG_MAX_QUEUE_MEMORY_LIMIT);
+        } else if (xmlStrcmp(node->name, XMLSTR("memory-limit")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &configuration->memory_limit, 0, CONFIG_MAX_MEMORY_LIMIT);
+        } else if (xmlStrcmp(node->name, XMLSTR("memory-shed-threshold")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &configuration->memory_shed_threshold, 1, 100);
+        } else if (xmlStrcmp(node->name, XMLSTR("memory-reject-threshold")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &configuration->memory_reject_threshold, 1, 100);
+        } else if (xmlStrcmp(node->name, XMLSTR("max-bandwidth")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &configuration->max_bandwidth, 0, UINT_MAX);
+        } else if (xmlStrcmp(node->name, XMLSTR("xslt-cache-size")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &configuration->xslt_cache_size, 1, CONFIG_MAX_XSLT_CACHE_SIZE);
+        } else if (xmlStrcmp(node->name, XMLSTR("xslt-output-cache-age")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &configuration->xslt_output_cache_age, 0, CONFIG_MAX_XSLT_OUTPUT_CACHE_AGE);
+        } else if (xmlStrcmp(node->name, XMLSTR("cpu-affinity")) == 0) {
+            _parse_cpu_affinity(doc, node->xmlChildrenNode, configuration);
         } else {
             __found_bad_tag(configuration, node, BTR_UNKNOWN, NULL);
         }
     } while ((node = node->next));
 }
 
+static void _parse_cpu_affinity(xmlDocPtr     doc,
+                                xmlNodePtr    node,
+                                ice_config_t *configuration)
+{
+    size_t i;
+
+    do {
+        if (node == NULL)
+            break;
+        if (xmlIsBlankNode(node))
+            continue;
+
+        for (i = 0; i < CPU_AFFINITY_MAX; i++)
+            if (xmlStrcmp(node->name, XMLSTR(affinity_class_name(i))) == 0)
+                break;
+
+        if (i == CPU_AFFINITY_MAX) {
+            __found_bad_tag(configuration, node, BTR_UNKNOWN, NULL);
+            continue;
+        }
+
+        if (configuration->cpu_affinity[i])
+            xmlFree(configuration->cpu_affinity[i]);
+        configuration->cpu_affinity[i] = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+    } while ((node = node->next));
+}
+
 static void _parse_authentication_node(ice_config_t *configuration, xmlNodePtr node, auth_stack_t  **authstack)
 {
     xmlChar *tmp;
@@ -1684,8 +2109,6 @@ static void _parse_mount(xmlDocPtr      doc,
 {
     char         *tmp;
     mount_proxy  *mount      = calloc(1, sizeof(mount_proxy));
-    mount_proxy  *current    = configuration->mounts;
-    mount_proxy  *last       = NULL;
     char         *username   = NULL;
     char         *password   = NULL;
     auth_stack_t *authstack  = NULL;
@@ -1700,6 +2123,7 @@ static void _parse_mount(xmlDocPtr      doc,
     mount->max_history          = -1;
     mount->allow_direct_access  = true;
     mount->next                 = NULL;
+    mount->fingerprint          = __fingerprint_node(FINGERPRINT_INIT, doc, parentnode);
 
     tmp = (char *)xmlGetProp(parentnode, XMLSTR("type"));
     if (tmp) {
@@ -1735,9 +2159,27 @@ static void _parse_mount(xmlDocPtr      doc,
         } else if (xmlStrcmp(node->name, XMLSTR("dump-file")) == 0) {
             mount->dumpfile = (char *)xmlNodeListGetString(doc,
                 node->xmlChildrenNode, 1);
+        } else if (xmlStrcmp(node->name, XMLSTR("capture-file")) == 0) {
+            mount->capture_file = (char *)xmlNodeListGetString(doc,
+                node->xmlChildrenNode, 1);
         } else if (xmlStrcmp(node->name, XMLSTR("intro")) == 0) {
             mount->intro_filename = (char *)xmlNodeListGetString(doc,
                 node->xmlChildrenNode, 1);
+        } else if (xmlStrcmp(node->name, XMLSTR("timeshift-file")) == 0) {
+            mount->timeshift_filename = (char *)xmlNodeListGetString(doc,
+                node->xmlChildrenNode, 1);
+        } else if (xmlStrcmp(node->name, XMLSTR("timeshift-size")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &mount->timeshift_size, CONFIG_RANGE_TIMESHIFT_SIZE);
+        } else if (xmlStrcmp(node->name, XMLSTR("shm-file")) == 0) {
+            mount->shm_filename = (char *)xmlNodeListGetString(doc,
+                node->xmlChildrenNode, 1);
+        } else if (xmlStrcmp(node->name, XMLSTR("shm-size")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &mount->shm_size, CONFIG_RANGE_SHM_SIZE);
+        } else if (xmlStrcmp(node->name, XMLSTR("hls")) == 0) {
+            mount->hls = 1;
+            _parse_mount_hls(doc, node->xmlChildrenNode, mount, configuration);
+        } else if (xmlStrcmp(node->name, XMLSTR("multicast")) == 0) {
+            _parse_mount_multicast(doc, node->xmlChildrenNode, mount, configuration);
         } else if (xmlStrcmp(node->name, XMLSTR("fallback-mount")) == 0) {
             mount->fallback_mount = (char *)xmlNodeListGetString(doc,
                 node->xmlChildrenNode, 1);
@@ -1822,6 +2264,34 @@ static void _parse_mount(xmlDocPtr      doc,
             __read_unsigned_int(configuration, doc, node, &mount->source_timeout, CONFIG_RANGE_SOURCE_TIMEOUT);
         } else if (xmlStrcmp(node->name, XMLSTR("burst-size")) == 0) {
             __read_int(configuration, doc, node, &mount->burst_size, 0, CONFIG_MAX_QUEUE_SIZE_LIMIT);
+        } else if (xmlStrcmp(node->name, XMLSTR("burst-size-max")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &mount->burst_size_max, 0, CONFIG_MAX_QUEUE_SIZE_LIMIT);
+        } else if (xmlStrcmp(node->name, XMLSTR("listener-workers")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &mount->listener_workers, 1, CONFIG_MAX_LISTENER_WORKERS);
+        } else if (xmlStrcmp(node->name, XMLSTR("listener-send-buffer-time")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &mount->listener_send_buffer_time, CONFIG_RANGE_LISTENER_SEND_BUFFER_TIME);
+        } else if (xmlStrcmp(node->name, XMLSTR("listener-notsent-lowat")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &mount->listener_notsent_lowat, CONFIG_RANGE_LISTENER_NOTSENT_LOWAT);
+        } else if (xmlStrcmp(node->name, XMLSTR("listener-pacing")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &mount->listener_pacing, CONFIG_RANGE_LISTENER_PACING);
+        } else if (xmlStrcmp(node->name, XMLSTR("listener-zerocopy")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            mount->listener_zerocopy = util_str_to_bool(tmp);
+            if(tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("max-lag")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &mount->max_lag, CONFIG_RANGE_MAX_LAG);
+        } else if (xmlStrcmp(node->name, XMLSTR("lag-action")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            mount->lag_action = config_str_to_lag_action_t(configuration, node, tmp);
+            if(tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("max-bandwidth")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &mount->max_bandwidth, 0, UINT_MAX);
+        } else if (xmlStrcmp(node->name, XMLSTR("ingest-buffer-size")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &mount->ingest_buffer_size, CONFIG_RANGE_INGEST_BUFFER_SIZE);
+        } else if (xmlStrcmp(node->name, XMLSTR("ingest-latency")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &mount->ingest_latency, 1, CONFIG_MAX_INGEST_LATENCY);
         } else if (xmlStrcmp(node->name, XMLSTR("cluster-password")) == 0) {
             mount->cluster_password = (char *)xmlNodeListGetString(doc,
                 node->xmlChildrenNode, 1);
@@ -1927,21 +2397,80 @@ static void _parse_mount(xmlDocPtr      doc,
         auth_stack_next(&authstack);
     }
 
-    while(current) {
-        last = current;
-        current = current->next;
-    }
-
     if (!mount->fallback_mount && (mount->fallback_when_full || mount->fallback_override != FALLBACK_OVERRIDE_NONE)) {
         ICECAST_LOG_WARN("Config for mount %s contains fallback options "
             "but no fallback mount.", mount->mountname);
     }
 
-    if(last) {
-        last->next = mount;
+    if (configuration->mounts_last) {
+        configuration->mounts_last->next = mount;
     } else {
         configuration->mounts = mount;
     }
+    configuration->mounts_last = mount;
+}
+
+static void _parse_mount_hls(xmlDocPtr      doc,
+                             xmlNodePtr     node,
+                             mount_proxy   *mount,
+                             ice_config_t  *configuration)
+{
+    do {
+        if (node == NULL)
+            break;
+        if (xmlIsBlankNode(node))
+            continue;
+
+        if (xmlStrcmp(node->name, XMLSTR("segment-duration")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &mount->hls_segment_duration, CONFIG_RANGE_HLS_SEGMENT_DURATION);
+        } else if (xmlStrcmp(node->name, XMLSTR("segments")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &mount->hls_segments, CONFIG_RANGE_HLS_SEGMENTS);
+        } else {
+            __found_bad_tag(configuration, node, BTR_UNKNOWN, NULL);
+        }
+    } while ((node = node->next));
+}
+
+static void _parse_mount_multicast(xmlDocPtr      doc,
+                                   xmlNodePtr     node,
+                                   mount_proxy   *mount,
+                                   ice_config_t  *configuration)
+{
+    char *tmp;
+
+    do {
+        if (node == NULL)
+            break;
+        if (xmlIsBlankNode(node))
+            continue;
+
+        if (xmlStrcmp(node->name, XMLSTR("group")) == 0) {
+            if (mount->multicast_group)
+                xmlFree(mount->multicast_group);
+            mount->multicast_group = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+        } else if (xmlStrcmp(node->name, XMLSTR("port")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &mount->multicast_port, CONFIG_RANGE_MULTICAST_PORT);
+        } else if (xmlStrcmp(node->name, XMLSTR("ttl")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &mount->multicast_ttl, CONFIG_RANGE_MULTICAST_TTL);
+        } else if (xmlStrcmp(node->name, XMLSTR("interface")) == 0) {
+            if (mount->multicast_interface)
+                xmlFree(mount->multicast_interface);
+            mount->multicast_interface = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+        } else if (xmlStrcmp(node->name, XMLSTR("framing")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            if (tmp && strcasecmp(tmp, "raw") == 0) {
+                mount->multicast_raw = 1;
+            } else if (tmp && strcasecmp(tmp, "rtp") == 0) {
+                mount->multicast_raw = 0;
+            } else {
+                __found_bad_tag(configuration, node, BTR_INVALID, tmp);
+            }
+            if (tmp)
+                xmlFree(tmp);
+        } else {
+            __found_bad_tag(configuration, node, BTR_UNKNOWN, NULL);
+        }
+    } while ((node = node->next));
 }
 
 void config_parse_http_headers(xmlNodePtr                  node,
@@ -2131,19 +2660,26 @@ static void _parse_relay(xmlDocPtr      doc,
 {
     char         *tmp;
     relay_config_t *relay       = calloc(1, sizeof(relay_config_t));
-    relay_config_t **n          = realloc(configuration->relay, sizeof(*configuration->relay)*(configuration->relay_length + 1));
+    size_t length               = configuration->relay_length;
 
-    if (!n) {
-        free(relay);
-        ICECAST_LOG_ERROR("Can not allocate memory for additional relay.");
-        return;
+    /* the array grows in powers of two */
+    if ((length & (length - 1)) == 0) {
+        relay_config_t **n = realloc(configuration->relay, sizeof(*configuration->relay)*(length ? length * 2 : 1));
+
+        if (!n) {
+            free(relay);
+            ICECAST_LOG_ERROR("Can not allocate memory for additional relay.");
+            return;
+        }
+
+        configuration->relay = n;
     }
 
-    configuration->relay = n;
     configuration->relay[configuration->relay_length++] = relay;
 
     relay->upstream_default.mp3metadata     = 1;
     relay->on_demand                        = configuration->on_demand;
+    relay->on_demand_linger                 = configuration->on_demand_linger;
 
     _parse_relay_upstream(doc, node, &(relay->upstream_default), configuration);
 
@@ -2167,6 +2703,13 @@ static void _parse_relay(xmlDocPtr      doc,
             relay->on_demand = util_str_to_bool(tmp);
             if (tmp)
                 xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("on-demand-linger")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &relay->on_demand_linger, 0, 86400);
+        } else if (xmlStrcmp(node->name, XMLSTR("standby")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            relay->standby = util_str_to_bool(tmp);
+            if (tmp)
+                xmlFree(tmp);
         } else if (xmlStrcmp(node->name, XMLSTR("upstream")) == 0) {
             tmp = (char *)xmlGetProp(node, XMLSTR("type"));
 
@@ -2259,6 +2802,11 @@ static void _parse_listen_socket(xmlDocPtr      doc,
             listener->shoutcast_compat = util_str_to_bool(tmp);
             if(tmp)
                 xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("dedicated-thread")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            listener->dedicated_thread = util_str_to_bool(tmp);
+            if(tmp)
+                xmlFree(tmp);
         } else if (xmlStrcmp(node->name, XMLSTR("shoutcast-mount")) == 0) {
             if (listener->shoutcast_mount)
                 xmlFree(listener->shoutcast_mount);
@@ -2271,8 +2819,20 @@ static void _parse_listen_socket(xmlDocPtr      doc,
                 node->xmlChildrenNode, 1);
         } else if (xmlStrcmp(node->name, XMLSTR("so-sndbuf")) == 0) {
             __read_int(configuration, doc, node, &listener->so_sndbuf, RANGE_SNDBUF);
+        } else if (xmlStrcmp(node->name, XMLSTR("so-rcvbuf")) == 0) {
+            __read_int(configuration, doc, node, &listener->so_rcvbuf, RANGE_RCVBUF);
         } else if (xmlStrcmp(node->name, XMLSTR("listen-backlog")) == 0) {
-            __read_int(configuration, doc, node, &listener->listen_backlog, 1, 128);
+            __read_int(configuration, doc, node, &listener->listen_backlog, RANGE_LISTEN_BACKLOG);
+        } else if (xmlStrcmp(node->name, XMLSTR("defer-accept")) == 0) {
+            __read_int(configuration, doc, node, &listener->defer_accept, RANGE_DEFER_ACCEPT);
+        } else if (xmlStrcmp(node->name, XMLSTR("tcp-fastopen")) == 0) {
+            __read_int(configuration, doc, node, &listener->tcp_fastopen, RANGE_TCP_FASTOPEN);
+        } else if (xmlStrcmp(node->name, XMLSTR("max-connections-per-ip")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &listener->max_connections_per_ip, 0, UINT_MAX);
+        } else if (xmlStrcmp(node->name, XMLSTR("connection-rate-per-ip")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &listener->connection_rate_per_ip, 0, 1000000);
+        } else if (xmlStrcmp(node->name, XMLSTR("connection-burst-per-ip")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &listener->connection_burst_per_ip, 0, 1000000);
         } else if (xmlStrcmp(node->name, XMLSTR("authentication")) == 0) {
             _parse_authentication_node(configuration, node, &(listener->authstack));
         } else if (xmlStrcmp(node->name, XMLSTR("http-headers")) == 0) {
@@ -2507,9 +3067,7 @@ static void _parse_resource(xmlDocPtr      doc,
                             ice_config_t  *configuration)
 {
     char *temp;
-    resource_t  *resource,
-                *current,
-                *last;
+    resource_t  *resource;
 
     resource = calloc(1, sizeof(resource_t));
     if (resource == NULL) {
@@ -2569,17 +3127,12 @@ static void _parse_resource(xmlDocPtr      doc,
     }
 
     /* Attach new <resource> as last entry into the global list. */
-    current = configuration->resources;
-    last = NULL;
-    while (current) {
-        last = current;
-        current = current->next;
-    }
-    if (last) {
-        last->next = resource;
+    if (configuration->resources_last) {
+        configuration->resources_last->next = resource;
     } else {
         configuration->resources = resource;
     }
+    configuration->resources_last = resource;
 }
 
 static void _parse_paths(xmlDocPtr      doc,
@@ -2752,6 +3305,32 @@ static void _parse_logging(xmlDocPtr        doc,
             } else {
                 ICECAST_LOG_WARN("<logarchive> must not be empty.");
             }
+        } else if (xmlStrcmp(node->name, XMLSTR("accesslog-format")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            if (tmp && strcmp(tmp, "clf") == 0) {
+                configuration->access_log_format = ACCESS_LOG_FORMAT_CLF;
+            } else if (tmp && strcmp(tmp, "json") == 0) {
+                configuration->access_log_format = ACCESS_LOG_FORMAT_JSON;
+            } else {
+                ICECAST_LOG_WARN("Invalid <accesslog-format>, must be \"clf\" or \"json\".");
+            }
+            if (tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("accesslog-sample")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &configuration->access_log_sample, CONFIG_RANGE_ACCESS_LOG_SAMPLE);
+        } else if (xmlStrcmp(node->name, XMLSTR("log-queue-size")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &configuration->log_queue_size, CONFIG_RANGE_LOG_QUEUE_SIZE);
+        } else if (xmlStrcmp(node->name, XMLSTR("log-queue-full")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            if (tmp && strcmp(tmp, "block") == 0) {
+                configuration->log_queue_drop = 0;
+            } else if (tmp && strcmp(tmp, "drop") == 0) {
+                configuration->log_queue_drop = 1;
+            } else {
+                ICECAST_LOG_WARN("Invalid <log-queue-full>, must be \"block\" or \"drop\".");
+            }
+            if (tmp)
+                xmlFree(tmp);
         } else if (xmlStrcmp(node->name, XMLSTR("memorybacklog")) == 0) {
             int val = CONFIG_DEFAULT_LOG_LINES_KEPT;
             char *logfile = (char *)xmlGetProp(node, XMLSTR("logfile"));
@@ -2824,6 +3403,12 @@ static void _parse_tls_context(xmlDocPtr       doc,
             if (context->cipher_list)
                 xmlFree(context->cipher_list);
             context->cipher_list = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+        } else if (xmlStrcmp(node->name, XMLSTR("tls-session-cache")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &context->session_cache, 0, CONFIG_MAX_TLS_SESSION_CACHE);
+        } else if (xmlStrcmp(node->name, XMLSTR("tls-session-timeout")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &context->session_timeout, 1, CONFIG_MAX_TLS_SESSION_TIMEOUT);
+        } else if (xmlStrcmp(node->name, XMLSTR("tls-ticket-key-lifetime")) == 0) {
+            __read_unsigned_int(configuration, doc, node, &context->ticket_key_lifetime, 0, CONFIG_MAX_TLS_TICKET_LIFETIME);
         } else {
             __found_bad_tag(configuration, node, BTR_UNKNOWN, NULL);
         }
@@ -2987,8 +3572,31 @@ static void merge_mounts(mount_proxy * dst, mount_proxy * src)
 
     if (!dst->dumpfile)
         dst->dumpfile = (char*)xmlStrdup((xmlChar*)src->dumpfile);
+    if (!dst->capture_file)
+        dst->capture_file = (char*)xmlStrdup((xmlChar*)src->capture_file);
     if (!dst->intro_filename)
         dst->intro_filename = (char*)xmlStrdup((xmlChar*)src->intro_filename);
+    if (!dst->timeshift_filename)
+        dst->timeshift_filename = (char*)xmlStrdup((xmlChar*)src->timeshift_filename);
+    if (!dst->timeshift_size)
+        dst->timeshift_size = src->timeshift_size;
+    if (!dst->shm_filename)
+        dst->shm_filename = (char*)xmlStrdup((xmlChar*)src->shm_filename);
+    if (!dst->shm_size)
+        dst->shm_size = src->shm_size;
+    if (!dst->hls && src->hls) {
+        dst->hls = src->hls;
+        dst->hls_segment_duration = src->hls_segment_duration;
+        dst->hls_segments = src->hls_segments;
+    }
+    if (!dst->multicast_group && src->multicast_group) {
+        dst->multicast_group = (char*)xmlStrdup((xmlChar*)src->multicast_group);
+        dst->multicast_port = src->multicast_port;
+        dst->multicast_ttl = src->multicast_ttl;
+        if (src->multicast_interface)
+            dst->multicast_interface = (char*)xmlStrdup((xmlChar*)src->multicast_interface);
+        dst->multicast_raw = src->multicast_raw;
+    }
     if (!dst->fallback_when_full)
         dst->fallback_when_full = src->fallback_when_full;
     if (dst->max_listeners == -1)
@@ -3001,8 +3609,30 @@ static void merge_mounts(mount_proxy * dst, mount_proxy * src)
         dst->allow_direct_access = src->allow_direct_access;
     if (dst->burst_size == -1)
         dst->burst_size = src->burst_size;
+    if (!dst->burst_size_max)
+        dst->burst_size_max = src->burst_size_max;
     if (!dst->queue_size_limit)
         dst->queue_size_limit = src->queue_size_limit;
+    if (!dst->listener_workers)
+        dst->listener_workers = src->listener_workers;
+    if (!dst->listener_send_buffer_time)
+        dst->listener_send_buffer_time = src->listener_send_buffer_time;
+    if (!dst->listener_notsent_lowat)
+        dst->listener_notsent_lowat = src->listener_notsent_lowat;
+    if (!dst->listener_pacing)
+        dst->listener_pacing = src->listener_pacing;
+    if (!dst->listener_zerocopy)
+        dst->listener_zerocopy = src->listener_zerocopy;
+    if (!dst->max_lag) {
+        dst->max_lag = src->max_lag;
+        dst->lag_action = src->lag_action;
+    }
+    if (!dst->max_bandwidth)
+        dst->max_bandwidth = src->max_bandwidth;
+    if (!dst->ingest_buffer_size)
+        dst->ingest_buffer_size = src->ingest_buffer_size;
+    if (!dst->ingest_latency)
+        dst->ingest_latency = src->ingest_latency;
     if (!dst->hidden)
         dst->hidden = src->hidden;
     if (!dst->source_timeout)
@@ -3056,6 +3686,122 @@ static inline void _merge_mounts_all(ice_config_t *c) {
     }
 }
 
+/* A default mount can only match mounts starting with the part of its
+ * pattern before the first wildcard, so that is compared before fnmatch().
+ */
+typedef struct {
+    mount_proxy *mount;
+    size_t prefix_length;
+    bool literal;
+} config_mount_pattern_t;
+
+struct config_mount_index_tag {
+    /* open addressing, first normal mount of a name wins */
+    mount_proxy **normal;
+    size_t mask;
+    /* default mounts in config order */
+    config_mount_pattern_t *defaults;
+    size_t defaults_length;
+};
+
+static void config_clear_mount_index(struct config_mount_index_tag *index)
+{
+    if (!index)
+        return;
+
+    free(index->normal);
+    free(index->defaults);
+    free(index);
+}
+
+static struct config_mount_index_tag *config_build_mount_index(ice_config_t *c)
+{
+    struct config_mount_index_tag *index;
+    mount_proxy *mountinfo;
+    size_t normal = 0;
+    size_t defaults = 0;
+    size_t size = 16;
+    size_t i;
+
+    for (mountinfo = c->mounts; mountinfo; mountinfo = mountinfo->next) {
+        if (mountinfo->mounttype == MOUNT_TYPE_NORMAL) {
+            normal++;
+        } else if (mountinfo->mounttype == MOUNT_TYPE_DEFAULT) {
+            defaults++;
+        }
+    }
+
+    /* keep the table at most half full */
+    while (size < normal * 2)
+        size *= 2;
+
+    index = calloc(1, sizeof(*index));
+    if (!index)
+        return NULL;
+
+    index->normal = calloc(size, sizeof(*index->normal));
+    index->defaults = calloc(defaults ? defaults : 1, sizeof(*index->defaults));
+    if (!index->normal || !index->defaults) {
+        config_clear_mount_index(index);
+        return NULL;
+    }
+    index->mask = size - 1;
+
+    for (mountinfo = c->mounts; mountinfo; mountinfo = mountinfo->next) {
+        if (mountinfo->mounttype == MOUNT_TYPE_NORMAL) {
+            if (!mountinfo->mountname)
+                continue;
+
+            for (i = util_hash_string(mountinfo->mountname) & index->mask; index->normal[i]; i = (i + 1) & index->mask)
+                if (strcmp(index->normal[i]->mountname, mountinfo->mountname) == 0)
+                    break;
+
+            if (!index->normal[i])
+                index->normal[i] = mountinfo;
+        } else if (mountinfo->mounttype == MOUNT_TYPE_DEFAULT) {
+            config_mount_pattern_t *pattern = &(index->defaults[index->defaults_length++]);
+
+            pattern->mount = mountinfo;
+            if (mountinfo->mountname) {
+#ifndef _WIN32
+                pattern->prefix_length = strcspn(mountinfo->mountname, "*?[\\");
+                pattern->literal = mountinfo->mountname[pattern->prefix_length] == 0;
+#else
+                pattern->prefix_length = strlen(mountinfo->mountname);
+                pattern->literal = true;
+#endif
+            }
+        }
+    }
+
+    return index;
+}
+
+static mount_proxy *config_find_default_mount_indexed(const struct config_mount_index_tag *index, const char *mount)
+{
+    size_t i;
+
+    for (i = 0; i < index->defaults_length; i++) {
+        const config_mount_pattern_t *pattern = &(index->defaults[i]);
+
+        if (!mount || !pattern->mount->mountname)
+            return pattern->mount;
+        if (strncmp(pattern->mount->mountname, mount, pattern->prefix_length) != 0)
+            continue;
+        if (pattern->literal) {
+            if (mount[pattern->prefix_length] == 0)
+                return pattern->mount;
+            continue;
+        }
+#ifndef _WIN32
+        if (fnmatch(pattern->mount->mountname, mount, FNM_PATHNAME) == 0)
+            return pattern->mount;
+#endif
+    }
+
+    return NULL;
+}
+
 /* return the mount details that match the supplied mountpoint */
 mount_proxy *config_find_mount (ice_config_t        *config,
                                 const char          *mount,
@@ -3067,6 +3813,21 @@ mount_proxy *config_find_mount (ice_config_t        *config,
     if (!mount && type != MOUNT_TYPE_DEFAULT)
         return NULL;
 
+    if (config->mount_index) {
+        const struct config_mount_index_tag *index = config->mount_index;
+        size_t i;
+
+        if (type == MOUNT_TYPE_DEFAULT)
+            return config_find_default_mount_indexed(index, mount);
+
+        for (i = util_hash_string(mount) & index->mask; index->normal[i]; i = (i + 1) & index->mask)
+            if (strcmp(index->normal[i]->mountname, mount) == 0)
+                return index->normal[i];
+
+        return config_find_default_mount_indexed(index, mount);
+    }
+
+    /* while parsing, before the index is built */
     for (; mountinfo; mountinfo = mountinfo->next) {
         if (mountinfo->mounttype != type)
             continue;
@@ -3108,7 +3869,13 @@ listener_t *config_copy_listener_one(const listener_t *listener) {
     n->next = NULL;
     n->port = listener->port;
     n->so_sndbuf = listener->so_sndbuf;
+    n->so_rcvbuf = listener->so_rcvbuf;
     n->listen_backlog = listener->listen_backlog;
+    n->defer_accept = listener->defer_accept;
+    n->tcp_fastopen = listener->tcp_fastopen;
+    n->max_connections_per_ip = listener->max_connections_per_ip;
+    n->connection_rate_per_ip = listener->connection_rate_per_ip;
+    n->connection_burst_per_ip = listener->connection_burst_per_ip;
     n->type = listener->type;
     n->id = (char*)xmlStrdup(XMLSTR(listener->id));
     if (listener->on_behalf_of) {
@@ -3118,6 +3885,7 @@ listener_t *config_copy_listener_one(const listener_t *listener) {
     n->shoutcast_compat = listener->shoutcast_compat;
     n->shoutcast_mount = (char*)xmlStrdup(XMLSTR(listener->shoutcast_mount));
     n->tls = listener->tls;
+    n->dedicated_thread = listener->dedicated_thread;
 
     if (listener->authstack) {
         auth_stack_addref(n->authstack = listener->authstack);
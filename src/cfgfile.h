@@ -19,6 +19,7 @@
 #define CONFIG_ENOROOT  -2
 #define CONFIG_EBADROOT -3
 #define CONFIG_EPARSE   -4
+#define CONFIG_EINVALID -5
 
 #include <stdbool.h>
 
@@ -73,12 +74,35 @@ typedef enum _mount_type {
  MOUNT_TYPE_DEFAULT
 } mount_type;
 
+typedef enum {
+    /* the combined log format */
+    ACCESS_LOG_FORMAT_CLF = 0,
+    /* one JSON object per line */
+    ACCESS_LOG_FORMAT_JSON
+} access_log_format_t;
+
+/* classes of threads that can be pinned to CPUs, see affinity.h */
+typedef enum {
+    CPU_AFFINITY_ACCEPT = 0,
+    CPU_AFFINITY_CONNECTION,
+    CPU_AFFINITY_SOURCE,
+    CPU_AFFINITY_FSERVE,
+    CPU_AFFINITY_STATS,
+    CPU_AFFINITY_MAX
+} cpu_affinity_class_t;
+
 typedef enum {
     FALLBACK_OVERRIDE_NONE = 0,
     FALLBACK_OVERRIDE_ALL,
     FALLBACK_OVERRIDE_OWN
 } fallback_override_t;
 
+typedef enum {
+    LAG_ACTION_DROP = 0,
+    LAG_ACTION_SKIP,
+    LAG_ACTION_FALLBACK
+} lag_action_t;
+
 typedef struct _mount_proxy {
     /* The mountpoint this proxy is used for */
     char *mountname;
@@ -88,8 +112,33 @@ typedef struct _mount_proxy {
      * NULL to not dump.
      */
     char *dumpfile;
+    /* File the reads of the source are recorded to with their timing for
+     * replaying them, NULL for none */
+    char *capture_file;
     /* Send contents of file to client before the stream */
     char *intro_filename;
+    /* File the last timeshift_size bytes of the stream are kept in for
+     * listeners joining in the past, NULL for none */
+    char *timeshift_filename;
+    unsigned int timeshift_size;
+    /* shared memory file the stream is handed to local consumers in,
+     * NULL for none, see shmring.h */
+    char *shm_filename;
+    unsigned int shm_size;
+    /* segment the stream for HLS, see hls.h. Duration and segments of 0
+     * select the defaults. */
+    int hls;
+    unsigned int hls_segment_duration;
+    unsigned int hls_segments;
+    /* UDP multicast group the stream is sent to, NULL for none. A port or
+     * TTL of 0 selects the default. */
+    char *multicast_group;
+    unsigned int multicast_port;
+    unsigned int multicast_ttl;
+    /* local address or interface name to send from, NULL for the default */
+    char *multicast_interface;
+    /* send the plain stream instead of RTP */
+    int multicast_raw;
     /* Switch new listener to fallback source when max listeners reached */
     int fallback_when_full;
     /* Max listeners for this mountpoint only.
@@ -110,7 +159,33 @@ typedef struct _mount_proxy {
      * from global setting
      */
     int burst_size;
+    /* with a larger burst than burst_size, new listeners that keep up get
+     * up to this many bytes, 0 for a fixed burst */
+    unsigned int burst_size_max;
     unsigned int queue_size_limit;
+    /* number of threads sending to the listeners of this mount,
+     * 0 means take the default of one */
+    unsigned int listener_workers;
+    /* socket send buffer of listeners in milliseconds of the stream at its
+     * bitrate, and the TCP_NOTSENT_LOWAT of their sockets in bytes. 0 leaves
+     * the system defaults */
+    unsigned int listener_send_buffer_time;
+    unsigned int listener_notsent_lowat;
+    /* pace listeners to this percentage of the bitrate after their burst,
+     * 0 to not pace them */
+    unsigned int listener_pacing;
+    /* seconds a listener may fall behind the newest data before lag_action
+     * is taken, 0 to only drop it once the queue is cut off under it */
+    unsigned int max_lag;
+    lag_action_t lag_action;
+    /* send to the listeners with MSG_ZEROCOPY */
+    int listener_zerocopy;
+    /* kbit/s sent to the listeners of the mount, 0 for no limit */
+    unsigned int max_bandwidth;
+    /* size of the buffers mp3 and aac input is collected into and how long
+     * (in ms) to wait for them to fill, 0 means take the defaults */
+    unsigned int ingest_buffer_size;
+    unsigned int ingest_latency;
     /* Do we list this on the xsl pages */
     int hidden;
     /* source timeout in seconds */
@@ -140,6 +215,9 @@ typedef struct _mount_proxy {
     char *subtype;
     int yp_public;
 
+    /* hash of the <mount> block, used to find changed mounts on reload */
+    uint64_t fingerprint;
+
     struct _mount_proxy *next;
 } mount_proxy;
 
@@ -180,11 +258,23 @@ typedef struct _listener_t {
     listener_type_t type;
     int port;
     int so_sndbuf;
+    int so_rcvbuf;
     int listen_backlog;
+    /* seconds to wait for data before accept() returns, 0 for off */
+    int defer_accept;
+    /* length of the TCP Fast Open queue, 0 for off */
+    int tcp_fastopen;
+    /* per client address, 0 for no limit, see iplimit.h */
+    unsigned int max_connections_per_ip;
+    unsigned int connection_rate_per_ip;
+    unsigned int connection_burst_per_ip;
     char *bind_address;
     int shoutcast_compat;
     char *shoutcast_mount;
     tlsmode_t tls;
+    /* requests on this socket are accepted, read and handled by a thread
+     * of their own, see <dedicated-thread> */
+    int dedicated_thread;
     auth_stack_t *authstack;
     /* additional HTTP headers */
     ice_config_http_header_t *http_headers;
@@ -194,6 +284,9 @@ typedef struct _config_tls_context {
     char *cert_file;
     char *key_file;
     char *cipher_list;
+    unsigned int session_cache;
+    unsigned int session_timeout;
+    unsigned int ticket_key_lifetime;
 } config_tls_context_t;
 
 typedef struct {
@@ -209,6 +302,13 @@ typedef struct {
 typedef struct {
     char *localmount;
     int on_demand;
+    /* seconds an on-demand relay keeps running after the last listener left */
+    unsigned int on_demand_linger;
+    /* keep a connection to another upstream ready to switch to */
+    int standby;
+    /* a relay of the master connecting over the one connection to it, see
+     * <master-relay-mux> */
+    int mux;
     size_t upstreams;
     relay_config_upstream_t *upstream;
     relay_config_upstream_t upstream_default;
@@ -243,12 +343,52 @@ struct ice_config_tag {
     int body_size_limit;
     unsigned int queue_size_limit;
     unsigned int burst_size;
+    unsigned int source_workers;
+    unsigned int fserve_workers;
+    unsigned int accept_threads;
+    unsigned int tls_handshake_workers;
+    /* threads handling the requests read, 0 for the main thread */
+    unsigned int request_workers;
+    /* threads running the event backends and events they may have queued */
+    unsigned int event_workers;
+    unsigned int event_queue_size;
+    unsigned int queue_memory_limit;
+    /* MB the process may use, 0 for the limit of its cgroup, and the percent
+     * of it caches are shed and new listeners rejected at, see memgov.h */
+    unsigned int memory_limit;
+    unsigned int memory_shed_threshold;
+    unsigned int memory_reject_threshold;
+    /* CPU lists like "0-3,8" per cpu_affinity_class_t, NULL if not pinned */
+    char *cpu_affinity[CPU_AFFINITY_MAX];
+    /* kbit/s sent to all listeners together, 0 for no limit */
+    unsigned int max_bandwidth;
+    /* number of parsed XSLT stylesheets kept */
+    unsigned int xslt_cache_size;
+    /* seconds public XSLT pages are kept for, 0 for off */
+    unsigned int xslt_output_cache_age;
     int client_timeout;
     int header_timeout;
     int source_timeout;
     int body_timeout;
+    /* seconds a kept alive connection may wait for its next request */
+    unsigned int keepalive_timeout;
+    /* requests handled on one connection, 1 for no keep alive */
+    unsigned int keepalive_requests;
+    /* seconds given to requests and downloads in progress on shutdown */
+    unsigned int shutdown_drain;
+    /* seconds the whole shutdown may take, 0 for no limit */
+    unsigned int shutdown_timeout;
     int fileserve;
     int on_demand; /* global setting for all relays */
+    unsigned int on_demand_linger; /* global setting for all relays */
+    /* record the latency histograms, see histogram.h. Read at startup only */
+    int latency_histograms;
+    /* events each thread keeps in the flight recorder, 0 to not record
+     * them, see flightrec.h. Read at startup only */
+    unsigned int flight_recorder;
+    /* allocate stream buffers from huge pages, see refbuf.c. Read at
+     * startup only */
+    int huge_pages;
 
     char *shoutcast_mount;
     char *shoutcast_user;
@@ -268,6 +408,13 @@ struct ice_config_tag {
     int master_update_interval;
     char *master_username;
     char *master_password;
+    /* relays of the master share one connection to it, see relaymux.h */
+    int master_relay_mux;
+    /* URL listeners are sent to for this server by the others of the
+     * cluster, NULL if it takes none, and the load in percent from which on
+     * it sends new listeners to the least loaded of them, 0 for never */
+    char *cluster_url;
+    unsigned int cluster_redirect_load;
 
     ice_config_http_header_t *http_headers;
 
@@ -275,6 +422,11 @@ struct ice_config_tag {
     relay_config_t **relay;
 
     mount_proxy *mounts;
+    /* lookup index of mounts, built once parsing is done */
+    struct config_mount_index_tag *mount_index;
+    /* last entries of the lists, so parsing appends in constant time */
+    mount_proxy *mounts_last;
+    resource_t *resources_last;
 
     char *server_id;
     char *base_dir;
@@ -298,6 +450,14 @@ struct ice_config_tag {
     size_t access_log_lines_kept;
     size_t error_log_lines_kept;
     size_t playlist_log_lines_kept;
+    access_log_format_t access_log_format;
+    /* one in this many requests is written to the access log, errors always */
+    unsigned int access_log_sample;
+    /* access and playlist log records waiting for the writer thread, 0
+     * to write them synchronously, and if they are dropped or wait for
+     * space when it is full. Read at startup only */
+    unsigned int log_queue_size;
+    int log_queue_drop;
 
     config_tls_context_t tls_context;
 
@@ -307,8 +467,29 @@ struct ice_config_tag {
     char *group;
 
     yp_directory_t *yp_directories;
+
+    /* hashes of the parsed blocks, see config_diff() */
+    uint64_t fingerprint_global;
+    uint64_t fingerprint_relays;
+    uint64_t fingerprint_yp;
+
+    /* changes each time a configuration is made current, so state derived
+     * from it can tell it is stale */
+    unsigned int generation;
 };
 
+/* What changed between two configurations, the result of config_diff() */
+typedef struct {
+    /* anything not covered by the fields below, all mounts need updating */
+    bool global;
+    bool default_mounts;
+    bool relays;
+    bool yp;
+    /* names of the normal mounts that were added, changed or removed */
+    char **mounts;
+    size_t mounts_length;
+} config_diff_t;
+
 typedef struct {
     rwlock_t config_lock;
     mutex_t relay_lock;
@@ -326,6 +507,8 @@ int config_parse_cmdline(int arg, char **argv);
 void config_set_config(ice_config_t *config);
 listener_t *config_clear_listener (listener_t *listener);
 void config_clear(ice_config_t *config);
+void config_diff(const ice_config_t *old_config, const ice_config_t *new_config, config_diff_t *diff);
+void config_diff_clear(config_diff_t *diff);
 mount_proxy *config_find_mount(ice_config_t *config, const char *mount, mount_type type);
 
 listener_t *config_copy_listener_one(const listener_t *listener);
@@ -0,0 +1,173 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "chunked.h"
+
+/* chunk sizes are limited to 15 hex digits so they can not overflow */
+#define CHUNKED_MAX_SIZE_DIGITS 15
+
+typedef enum {
+    CHUNKED_STATE_SIZE,
+    CHUNKED_STATE_EXTENSION,
+    CHUNKED_STATE_SIZE_LF,
+    CHUNKED_STATE_DATA,
+    CHUNKED_STATE_DATA_CR,
+    CHUNKED_STATE_DATA_LF,
+    CHUNKED_STATE_TRAILER,
+    CHUNKED_STATE_TRAILER_LINE,
+    CHUNKED_STATE_TRAILER_LF,
+    CHUNKED_STATE_END,
+    CHUNKED_STATE_ERROR
+} chunked_state_t;
+
+struct chunked_tag {
+    chunked_state_t state;
+    uint64_t left;
+    unsigned int digits;
+    /* the trailer line being skipped is not empty */
+    int line;
+};
+
+chunked_t *chunked_new(void)
+{
+    return calloc(1, sizeof(chunked_t));
+}
+
+void chunked_free(chunked_t *self)
+{
+    free(self);
+}
+
+static int chunked_hex(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+ssize_t chunked_decode(chunked_t *self, char *buf, size_t len)
+{
+    size_t in = 0;
+    size_t out = 0;
+
+    if (self->state == CHUNKED_STATE_ERROR)
+        return -1;
+
+    while (in < len) {
+        char c;
+        int value;
+
+        if (self->state == CHUNKED_STATE_DATA) {
+            /* the payload is the bulk, move it as a whole */
+            size_t span = len - in;
+
+            if (span > self->left)
+                span = self->left;
+            if (out != in)
+                memmove(buf + out, buf + in, span);
+            in += span;
+            out += span;
+            self->left -= span;
+            if (!self->left)
+                self->state = CHUNKED_STATE_DATA_CR;
+            continue;
+        }
+
+        c = buf[in++];
+        switch (self->state) {
+            case CHUNKED_STATE_SIZE:
+                value = chunked_hex(c);
+                if (value >= 0 && self->digits < CHUNKED_MAX_SIZE_DIGITS) {
+                    self->left = (self->left << 4) | value;
+                    self->digits++;
+                } else if (self->digits && (c == ';' || c == ' ' || c == '\t')) {
+                    self->state = CHUNKED_STATE_EXTENSION;
+                } else if (self->digits && c == '\r') {
+                    self->state = CHUNKED_STATE_SIZE_LF;
+                } else {
+                    self->state = CHUNKED_STATE_ERROR;
+                }
+                break;
+            case CHUNKED_STATE_EXTENSION:
+                /* extensions are ignored */
+                if (c == '\r')
+                    self->state = CHUNKED_STATE_SIZE_LF;
+                break;
+            case CHUNKED_STATE_SIZE_LF:
+                if (c != '\n') {
+                    self->state = CHUNKED_STATE_ERROR;
+                } else if (self->left) {
+                    self->state = CHUNKED_STATE_DATA;
+                } else {
+                    self->state = CHUNKED_STATE_TRAILER;
+                }
+                break;
+            case CHUNKED_STATE_DATA_CR:
+                self->state = c == '\r' ? CHUNKED_STATE_DATA_LF : CHUNKED_STATE_ERROR;
+                break;
+            case CHUNKED_STATE_DATA_LF:
+                if (c == '\n') {
+                    self->state = CHUNKED_STATE_SIZE;
+                    self->digits = 0;
+                } else {
+                    self->state = CHUNKED_STATE_ERROR;
+                }
+                break;
+            case CHUNKED_STATE_TRAILER:
+                /* header lines after the last chunk, up to an empty one */
+                if (c == '\r') {
+                    self->state = CHUNKED_STATE_TRAILER_LF;
+                    self->line = 0;
+                } else {
+                    self->state = CHUNKED_STATE_TRAILER_LINE;
+                }
+                break;
+            case CHUNKED_STATE_TRAILER_LINE:
+                if (c == '\r') {
+                    self->state = CHUNKED_STATE_TRAILER_LF;
+                    self->line = 1;
+                }
+                break;
+            case CHUNKED_STATE_TRAILER_LF:
+                if (c != '\n') {
+                    self->state = CHUNKED_STATE_ERROR;
+                } else if (self->line) {
+                    self->state = CHUNKED_STATE_TRAILER;
+                } else {
+                    self->state = CHUNKED_STATE_END;
+                }
+                break;
+            case CHUNKED_STATE_END:
+                /* nothing may follow the body */
+                self->state = CHUNKED_STATE_ERROR;
+                break;
+            default:
+                break;
+        }
+
+        if (self->state == CHUNKED_STATE_ERROR)
+            return -1;
+    }
+
+    return out;
+}
+
+int chunked_eof(chunked_t *self)
+{
+    return self->state == CHUNKED_STATE_END;
+}
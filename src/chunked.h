@@ -0,0 +1,34 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* chunked.h
+ *
+ * Decoder for request bodies sent with Transfer-Encoding: chunked, as
+ * browser and WebRTC bridges do for their PUT. The stream is read straight
+ * into the buffer of the format plugin and the chunk framing is taken out
+ * there, so the payload is not copied through another buffer as with the
+ * generic encoding layer.
+ */
+
+#ifndef __CHUNKED_H__
+#define __CHUNKED_H__
+
+#include <sys/types.h>
+
+typedef struct chunked_tag chunked_t;
+
+chunked_t *chunked_new(void);
+void       chunked_free(chunked_t *self);
+
+/* Takes len bytes of the encoded stream in buf and moves the payload in
+ * them to the start of buf. Returns the number of payload bytes, which may
+ * be 0 if buf only held framing, or -1 if the stream is not validly
+ * chunked. */
+ssize_t    chunked_decode(chunked_t *self, char *buf, size_t len);
+/* Whether the last chunk and the trailer have been seen */
+int        chunked_eof(chunked_t *self);
+
+#endif  /* __CHUNKED_H__ */
@@ -54,6 +54,9 @@
 #include "acl.h"
 #include "listensocket.h"
 #include "fastevent.h"
+#include "objpool.h"
+#include "chunked.h"
+#include "coarsetime.h"
 
 /* for ADMIN_COMMAND_ERROR, and ADMIN_ICESTATS_LEGACY_EXTENSION_APPLICATION */
 #include "admin.h"
@@ -65,7 +68,35 @@
 #undef CATMODULE
 #define CATMODULE "client"
 
-avl_tree *global_client_list;
+/* All clients, partitioned by connection ID so that clients coming and
+ * going on different threads rarely wait for the same lock. */
+#define CLIENT_LIST_SHARDS  16
+static avl_tree *client_list[CLIENT_LIST_SHARDS];
+
+static inline avl_tree *client_list_shard(const client_t *client)
+{
+    return client_list[client->con->id % CLIENT_LIST_SHARDS];
+}
+
+/* client_t are recycled, they come and go with every request */
+static objpool_t client_pool;
+
+/* Error reports only depend on the configuration (the report database), so
+ * they are built once per error and configuration generation. For the raw
+ * and JSON formats the rendered body is kept as well.
+ */
+typedef struct {
+    unsigned int generation;
+    reportxml_t *report;
+    refbuf_t *body_raw;
+    refbuf_t *body_json;
+} client_error_report_t;
+
+static mutex_t error_reports_lock;
+/* ICECAST_ERROR_RECURSIVE_ERROR is the last error ID */
+static client_error_report_t error_reports[ICECAST_ERROR_RECURSIVE_ERROR + 1];
+
+static const char client_json_warning[] = "Warning: 299 - \"JSON rendering is experimental\"\r\n";
 
 static inline void client_send_500(client_t *client, const char *message);
 
@@ -119,14 +150,64 @@ int client_compare(void *compare_arg, void *a, void *b)
     return 0;
 }
 
+/* Calls callback for the clients in one partition after another, holding the
+ * read lock of the partition. The order is by connection ID within each
+ * partition only. Stops early if callback returns non-zero. */
+void client_walk(client_walk_callback_t callback, void *userdata)
+{
+    size_t i;
+
+    for (i = 0; i < CLIENT_LIST_SHARDS; i++) {
+        avl_node *node;
+        int stop = 0;
+
+        avl_tree_rlock(client_list[i]);
+        for (node = avl_get_first(client_list[i]); node && !stop; node = avl_get_next(node))
+            stop = callback((client_t *)node->key, userdata);
+        avl_tree_unlock(client_list[i]);
+
+        if (stop)
+            break;
+    }
+}
+
+static void client_error_report_clear(client_error_report_t *entry, unsigned int generation)
+{
+    refobject_unref(entry->report);
+    if (entry->body_raw)
+        refbuf_release(entry->body_raw);
+    if (entry->body_json)
+        refbuf_release(entry->body_json);
+
+    entry->report = NULL;
+    entry->body_raw = NULL;
+    entry->body_json = NULL;
+    entry->generation = generation;
+}
+
 void client_initialize(void)
 {
-    global_client_list = avl_tree_new(client_compare, NULL);
+    size_t i;
+
+    for (i = 0; i < CLIENT_LIST_SHARDS; i++)
+        client_list[i] = avl_tree_new(client_compare, NULL);
+    objpool_initialize(&client_pool, sizeof(client_t));
+    thread_mutex_create(&error_reports_lock);
 }
 
 void client_shutdown(void)
 {
-    avl_tree_free(global_client_list, NULL);
+    size_t i;
+
+    for (i = 0; i < (sizeof(error_reports)/sizeof(*error_reports)); i++)
+        client_error_report_clear(&(error_reports[i]), 0);
+    thread_mutex_destroy(&error_reports_lock);
+
+    for (i = 0; i < CLIENT_LIST_SHARDS; i++) {
+        avl_tree_free(client_list[i], NULL);
+        client_list[i] = NULL;
+    }
+    objpool_shutdown(&client_pool);
 }
 
 /* create a client_t with the provided connection and parser details. Return
@@ -137,7 +218,7 @@ void client_shutdown(void)
 int client_create(client_t **c_ptr, connection_t *con, http_parser_t *parser)
 {
     ice_config_t    *config;
-    client_t        *client = (client_t *) calloc(1, sizeof(client_t));
+    client_t        *client = objpool_alloc(&client_pool);
     const listener_t *listener_real, *listener_effective;
     int              ret    = -1;
 
@@ -155,7 +236,7 @@ int client_create(client_t **c_ptr, connection_t *con, http_parser_t *parser)
 
     config_release_config ();
 
-    stats_event_args (NULL, "clients", "%d", global.clients);
+    stats_global_inc(STATS_GLOBAL_CLIENTS);
     client->con = con;
     client->parser = parser;
     client->protocol = ICECAST_PROTOCOL_HTTP;
@@ -169,9 +250,9 @@ int client_create(client_t **c_ptr, connection_t *con, http_parser_t *parser)
     navigation_history_init(&(client->history));
     *c_ptr = client;
 
-    avl_tree_wlock(global_client_list);
-    avl_insert(global_client_list, client);
-    avl_tree_unlock(global_client_list);
+    avl_tree_wlock(client_list_shard(client));
+    avl_insert(client_list_shard(client), client);
+    avl_tree_unlock(client_list_shard(client));
 
     listener_real = listensocket_get_listener(con->listensocket_real);
     listener_effective = listensocket_get_listener(con->listensocket_effective);
@@ -232,6 +313,140 @@ void client_complete(client_t *client)
     ICECAST_LOG_DEBUG("Client %p has request_body_length=%zi", client, client->request_body_length);
 }
 
+/* Request headers still used once a listener streams: by the access log,
+ * the listener list of the admin interface, events and auth when the
+ * listener leaves, and the format plugins when the listener is moved.
+ */
+const char * const client_streaming_headers[] = {
+    HTTPP_VAR_PROTOCOL, HTTPP_VAR_VERSION, HTTPP_VAR_REQ_TYPE,
+    HTTPP_VAR_URI, HTTPP_VAR_RAWURI,
+    "host", "referer", "user-agent", "icy-metadata", "x-flash-version",
+    NULL
+};
+
+/* estimated cost of a header in the parser besides its name and value */
+#define CLIENT_HEADER_OVERHEAD  64
+
+static inline size_t client_string_memory(const char *str)
+{
+    return str ? strlen(str) + 1 : 0;
+}
+
+/* Drops what a listener only needed to get its request handled, once it
+ * streams. The parser is replaced with one holding the headers above and
+ * the handler is released. The memory left is estimated and added to the
+ * listener_memory statistic. Must be called by the thread owning the client
+ * with no one else looking at its parser, e.g. the source holding the write
+ * lock of its listeners.
+ */
+void client_trim_request(client_t *client)
+{
+    size_t memory;
+    size_t i;
+
+    if (client->memory)
+        return;
+
+    memory = sizeof(client_t) + sizeof(connection_t);
+    memory += client_string_memory(client->con->ip);
+    memory += client_string_memory(client->uri);
+    memory += client_string_memory(client->username);
+    memory += client_string_memory(client->password);
+    memory += client_string_memory(client->role);
+
+    if (client->parser) {
+        http_parser_t *parser = httpp_create_parser();
+
+        httpp_initialize(parser, NULL);
+        parser->req_type = client->parser->req_type;
+        for (i = 0; client_streaming_headers[i]; i++) {
+            const char *value = httpp_getvar(client->parser, client_streaming_headers[i]);
+
+            if (!value)
+                continue;
+            httpp_setvar(parser, client_streaming_headers[i], value);
+            memory += client_string_memory(client_streaming_headers[i]) + client_string_memory(value) + CLIENT_HEADER_OVERHEAD;
+        }
+        httpp_destroy(client->parser);
+        client->parser = parser;
+        memory += sizeof(*parser);
+    }
+
+    refobject_unref(client->handler_module);
+    client->handler_module = NULL;
+    free(client->handler_function);
+    client->handler_function = NULL;
+
+    client->memory = memory;
+    stats_global_add(STATS_GLOBAL_LISTENER_MEMORY, memory);
+}
+
+/* frees what a client holds for its request, everything but the connection,
+ * its buffer and its place in the client list */
+static void client_free_request(client_t *client)
+{
+    if (client->parser)
+        httpp_destroy(client->parser);
+    if (client->encoding)
+        httpp_encoding_release(client->encoding);
+    chunked_free(client->chunked);
+    zerocopy_free(client->zerocopy);
+
+    /* we need to free client specific format data (if any) */
+    if (client->free_client_data)
+        client->free_client_data(client);
+
+    refobject_unref(client->handler_module);
+    free(client->handler_function);
+    free(client->uri);
+    free(client->username);
+    free(client->password);
+    free(client->role);
+    acl_release(client->acl);
+    navigation_history_clear(&(client->history));
+
+    if (client->memory)
+        stats_global_add(STATS_GLOBAL_LISTENER_MEMORY, -(int64_t)client->memory);
+}
+
+/* Readies a client that got its response for the next request on the same
+ * connection, as client_create() leaves a new one. The connection keeps
+ * what was read past the request, i.e. the next requests if they were
+ * pipelined.
+ */
+static void client_reset(client_t *client)
+{
+    connection_t *con = client->con;
+
+    client_set_queue(client, NULL);
+
+    if (client->auth) {
+        auth_release(client->auth);
+        client->auth = NULL;
+    }
+
+    if (client->respcode && client->parser && !client->handed_over)
+        logging_access(client);
+
+    client_free_request(client);
+
+    memset(client, 0, sizeof(*client));
+    client->con = con;
+    client->protocol = ICECAST_PROTOCOL_HTTP;
+    client->admin_command = ADMIN_COMMAND_ERROR;
+    client->refbuf = refbuf_new(PER_CLIENT_REFBUF_SIZE);
+    client->refbuf->len = 0; /* force reader code to ignore buffer contents */
+    client->write_to_client = format_generic_write_to_client;
+    navigation_history_init(&(client->history));
+
+    /* times and counts of the access log are per request */
+    con->con_time = coarsetime_get();
+    con->discon_time = 0;
+    con->discon_reason = NULL;
+    con->sent_bytes = 0;
+    con->requests++;
+}
+
 static inline void client_reuseconnection(client_t *client) {
     connection_t *con;
     reuse_t reuse;
@@ -261,9 +476,25 @@ static inline void client_reuseconnection(client_t *client) {
         return;
     }
 
+    /* auth backends that are told about the client leaving do so on their
+     * own threads, so the client can not be kept */
+    if (!(client->acl && client->auth && client->auth->release_client)) {
+        ICECAST_LOG_DEBUG("Reusing client %p in place on connection %p (connection ID: %llu, sock=%R)", client, con, (long long unsigned int)con->id, con->sock);
+        client_reset(client);
+        connection_queue_keepalive(client);
+        return;
+    }
+
     ICECAST_LOG_DEBUG("Reusing connection %p (connection ID: %llu, sock=%R) of old client %p", con, (long long unsigned int)con->id, con->sock, client);
     con = connection_create(con->sock, con->listensocket_real, con->listensocket_effective, strdup(con->ip));
     client->con->sock = SOCK_ERROR;
+    /* the socket stays open, so does its place in the per address limits */
+    if (con) {
+        con->iplimited = client->con->iplimited;
+        con->requests = client->con->requests + 1;
+        con->local = client->con->local;
+        client->con->iplimited = 0;
+    }
 
     /* handle to keep the TLS connection */
     if (client->con->tls) {
@@ -273,6 +504,9 @@ static inline void client_reuseconnection(client_t *client) {
         con->tls  = client->con->tls;
         con->read = client->con->read;
         con->send = client->con->send;
+        /* not set for TLS, unless the kernel does the encryption */
+        con->sendv = client->con->sendv;
+        con->sendfile = client->con->sendfile;
         client->con->tls  = NULL;
         client->con->read = NULL;
         client->con->send = NULL;
@@ -303,12 +537,7 @@ void client_destroy(client_t *client)
 
     ICECAST_LOG_DEBUG("Called to destroy client %p on connection %p (connection ID: %llu, sock=%R)", client, client->con, (long long unsigned int)client->con->id, client->con->sock);
 
-    fastevent_emit(FASTEVENT_TYPE_CLIENT_DESTROY, FASTEVENT_FLAG_MODIFICATION_ALLOWED, FASTEVENT_DATATYPE_CLIENT, client);
-
-    avl_tree_wlock(global_client_list);
-    avl_delete(global_client_list, client, NULL);
-    avl_tree_unlock(global_client_list);
-
+    /* a client kept for the next request stays in the client list */
     if (client->reuse != ICECAST_REUSE_CLOSE && !client->con->error) {
         /* only reuse the client if we reached the body's EOF. */
         if (client_body_eof(client) == 1) {
@@ -317,6 +546,12 @@ void client_destroy(client_t *client)
         }
     }
 
+    fastevent_emit(FASTEVENT_TYPE_CLIENT_DESTROY, FASTEVENT_FLAG_MODIFICATION_ALLOWED, FASTEVENT_DATATYPE_CLIENT, client);
+
+    avl_tree_wlock(client_list_shard(client));
+    avl_delete(client_list_shard(client), client, NULL);
+    avl_tree_unlock(client_list_shard(client));
+
     /* release the buffer now, as the buffer could be on the source queue
      * and may of disappeared after auth completes */
     client_set_queue(client, NULL);
@@ -331,30 +566,14 @@ void client_destroy(client_t *client)
         logging_access(client);
     if (client->con)
         connection_close(client->con);
-    if (client->parser)
-        httpp_destroy(client->parser);
-    if (client->encoding)
-        httpp_encoding_release(client->encoding);
-
     global_lock();
     global.clients--;
-    stats_event_args(NULL, "clients", "%d", global.clients);
+    stats_global_dec(STATS_GLOBAL_CLIENTS);
     global_unlock();
 
-    /* we need to free client specific format data (if any) */
-    if (client->free_client_data)
-        client->free_client_data(client);
+    client_free_request(client);
 
-    refobject_unref(client->handler_module);
-    free(client->handler_function);
-    free(client->uri);
-    free(client->username);
-    free(client->password);
-    free(client->role);
-    acl_release(client->acl);
-    navigation_history_clear(&(client->history));
-
-    free(client);
+    objpool_release(&client_pool, client);
 }
 
 /* helper function for reading data from a client */
@@ -383,7 +602,25 @@ int client_read_bytes(client_t *client, void *buf, unsigned len)
         userdata = client->con;
     }
 
-    if (client->encoding) {
+    if (client->chunked) {
+        /* read into buf and take the framing out there, a read that
+         * only brought framing is followed by another one */
+        ssize_t raw;
+
+        do {
+            if (client->refbuf && client->refbuf->len) {
+                raw = __client_read_bytes_real(client, buf, len);
+            } else {
+                raw = connection_read_bytes(client->con, buf, len);
+            }
+            bytes = raw > 0 ? chunked_decode(client->chunked, buf, raw) : raw;
+        } while (raw > 0 && bytes == 0 && !chunked_eof(client->chunked));
+
+        if (raw > 0 && bytes < 0) {
+            ICECAST_LOG_WARN("Invalid chunked body from client %p", client);
+            client->con->error = 1;
+        }
+    } else if (client->encoding) {
         bytes = httpp_encoding_read(client->encoding, buf, len, reader, userdata);
     } else {
         bytes = reader(userdata, buf, len);
@@ -397,7 +634,110 @@ int client_read_bytes(client_t *client, void *buf, unsigned len)
     return bytes;
 }
 
-static inline void _client_send_report(client_t *client, const char *uuid, const char *message, int http_status, const char *location)
+static unsigned int client_config_generation(void)
+{
+    ice_config_t *config = config_get_config();
+    unsigned int generation = config->generation;
+
+    config_release_config();
+
+    return generation;
+}
+
+static reportxml_t *client_get_error_report(const icecast_error_t *error, unsigned int generation)
+{
+    client_error_report_t *entry = &(error_reports[error->id]);
+    reportxml_t *report;
+
+    thread_mutex_lock(&error_reports_lock);
+    if (entry->report && entry->generation == generation && refobject_ref(entry->report) == 0) {
+        report = entry->report;
+        thread_mutex_unlock(&error_reports_lock);
+        return report;
+    }
+    thread_mutex_unlock(&error_reports_lock);
+
+    report = client_get_reportxml(error->uuid, NULL, error->message);
+    if (!report)
+        return NULL;
+
+    thread_mutex_lock(&error_reports_lock);
+    if (entry->generation != generation)
+        client_error_report_clear(entry, generation);
+    if (!entry->report && refobject_ref(report) == 0)
+        entry->report = report;
+    thread_mutex_unlock(&error_reports_lock);
+
+    return report;
+}
+
+/* Returns the rendered body of the error report for ADMIN_FORMAT_RAW or ADMIN_FORMAT_JSON */
+static refbuf_t *client_get_error_body(const icecast_error_t *error, admin_format_t admin_format)
+{
+    client_error_report_t *entry = &(error_reports[error->id]);
+    unsigned int generation = client_config_generation();
+    refbuf_t **slot = admin_format == ADMIN_FORMAT_RAW ? &(entry->body_raw) : &(entry->body_json);
+    refbuf_t *body = NULL;
+    reportxml_t *report;
+    xmlDocPtr doc;
+
+    thread_mutex_lock(&error_reports_lock);
+    if (*slot && entry->generation == generation) {
+        body = *slot;
+        refbuf_addref(body);
+    }
+    thread_mutex_unlock(&error_reports_lock);
+
+    if (body)
+        return body;
+
+    report = client_get_error_report(error, generation);
+    if (!report)
+        return NULL;
+
+    doc = reportxml_render_xmldoc(report, 1);
+    refobject_unref(report);
+    if (!doc)
+        return NULL;
+
+    if (admin_format == ADMIN_FORMAT_RAW) {
+        xmlChar *buff = NULL;
+        int len = 0;
+
+        xmlDocDumpMemory(doc, &buff, &len);
+        if (buff && len > 0) {
+            body = refbuf_new(len);
+            memcpy(body->data, buff, len);
+        }
+        xmlFree(buff);
+    } else {
+        char *json = xml2json_render_doc_simple(doc, NULL);
+
+        if (json) {
+            size_t len = strlen(json);
+
+            body = refbuf_new(len);
+            memcpy(body->data, json, len);
+            free(json);
+        }
+    }
+
+    xmlFreeDoc(doc);
+
+    if (!body)
+        return NULL;
+
+    thread_mutex_lock(&error_reports_lock);
+    if (!*slot && entry->generation == generation) {
+        refbuf_addref(body);
+        *slot = body;
+    }
+    thread_mutex_unlock(&error_reports_lock);
+
+    return body;
+}
+
+static inline void _client_send_report(client_t *client, const char *uuid, const char *message, int http_status, const char *location, const icecast_error_t *error)
 {
     reportxml_t *report;
     admin_format_t admin_format;
@@ -405,6 +745,20 @@ static inline void _client_send_report(client_t *client, const char *uuid, const
 
     admin_format = client_get_admin_format_by_content_negotiation(client);
 
+    if (error && (admin_format == ADMIN_FORMAT_RAW || admin_format == ADMIN_FORMAT_JSON)) {
+        refbuf_t *body = client_get_error_body(error, admin_format);
+
+        if (body) {
+            if (admin_format == ADMIN_FORMAT_RAW) {
+                client_send_buffer(client, http_status, "text/xml", "utf-8", body->data, body->len, NULL);
+            } else {
+                client_send_buffer(client, http_status, "application/json", "utf-8", body->data, body->len, client_json_warning);
+            }
+            refbuf_release(body);
+            return;
+        }
+    }
+
     switch (admin_format) {
         case ADMIN_FORMAT_RAW:
         case ADMIN_FORMAT_JSON:
@@ -421,7 +775,11 @@ static inline void _client_send_report(client_t *client, const char *uuid, const
         break;
     }
 
-    report = client_get_reportxml(uuid, NULL, message);
+    if (error) {
+        report = client_get_error_report(error, client_config_generation());
+    } else {
+        report = client_get_reportxml(uuid, NULL, message);
+    }
 
     client_send_reportxml(client, report, DOCUMENT_DOMAIN_ADMIN, xslt, admin_format, http_status, location);
 
@@ -441,7 +799,7 @@ void client_send_error_by_error(client_t *client, const icecast_error_t *error)
         return;
     }
 
-    _client_send_report(client, error->uuid, error->message, error->http_status, NULL);
+    _client_send_report(client, error->uuid, error->message, error->http_status, NULL, error);
 }
 void client_send_error_by_uuid(client_t *client, const char *uuid)
 {
@@ -579,7 +937,7 @@ void client_send_buffer(client_t *client, int status, const char *mediatype, con
 
     client_set_queue(client, NULL);
     client->refbuf = refbuf_new(buf_len);
-    client->reuse = ICECAST_REUSE_KEEPALIVE;
+    client->reuse = connection_keepalive_allowed(client->con) ? ICECAST_REUSE_KEEPALIVE : ICECAST_REUSE_CLOSE;
 
     avl_tree_rlock(global.source_tree);
     source = source_find_mount_raw(client->uri);
@@ -595,13 +953,9 @@ void client_send_buffer(client_t *client, int status, const char *mediatype, con
         client_send_error_by_id(client, ICECAST_ERROR_GEN_HEADER_GEN_FAILED);
         return;
     } else if (buf_len < (ret + buf_len_ours)) {
-        void *new_data;
         buf_len = buf_len_ours + ret + 64;
-        new_data = realloc(client->refbuf->data, buf_len);
-        if (new_data) {
+        if (refbuf_resize(client->refbuf, buf_len) == 0) {
             ICECAST_LOG_DEBUG("Client buffer reallocation succeeded.");
-            client->refbuf->data = new_data;
-            client->refbuf->len = buf_len;
             ret = util_http_build_header(client->refbuf->data, buf_len, 0,
                     0, status, NULL,
                     mediatype, charset,
@@ -645,7 +999,7 @@ void client_send_buffer(client_t *client, int status, const char *mediatype, con
 
 void client_send_redirect(client_t *client, const char *uuid, int status, const char *location)
 {
-    _client_send_report(client, uuid, "Redirecting", status, location);
+    _client_send_report(client, uuid, "Redirecting", status, location, NULL);
 }
 
 /* this function sends a reportxml file to the client in the prefered format. */
@@ -704,18 +1058,17 @@ void client_send_reportxml(client_t *client, reportxml_t *report, document_domai
     }
 
     if (admin_format == ADMIN_FORMAT_RAW || admin_format == ADMIN_FORMAT_JSON) {
-        static const char json_warning[] = "Warning: 299 - \"JSON rendering is experimental\"\r\n";
         char extra_header_buffer[512] = "";
         const char *extra_header = extra_header_buffer;
 
         if (location) {
-            int res = snprintf(extra_header_buffer, sizeof(extra_header_buffer), "Location: %s\r\n%s", location, admin_format == ADMIN_FORMAT_JSON ? json_warning : "");
+            int res = snprintf(extra_header_buffer, sizeof(extra_header_buffer), "Location: %s\r\n%s", location, admin_format == ADMIN_FORMAT_JSON ? client_json_warning : "");
             if (res < 0 || res >= (ssize_t)sizeof(extra_header_buffer)) {
                 client_send_error_by_id(client, ICECAST_ERROR_GEN_HEADER_GEN_FAILED);
                 return;
             }
         } else if (admin_format == ADMIN_FORMAT_JSON) {
-            extra_header = json_warning;
+            extra_header = client_json_warning;
         }
 
         if (admin_format == ADMIN_FORMAT_RAW) {
@@ -877,6 +1230,32 @@ int client_send_bytes(client_t *client, const void *buf, unsigned len)
     return ret;
 }
 
+/* as client_send_bytes() but for several buffers in one go */
+int client_send_vector(client_t *client, const struct iovec *iov, size_t count)
+{
+    int ret = connection_send_vector(client->con, iov, count);
+    int left = ret;
+    size_t i;
+
+    if (client->con->error)
+        ICECAST_LOG_DEBUG("Client connection died");
+
+    for (i = 0; i < count; i++) {
+        int part = left;
+
+        if (left >= 0 && (size_t)left > iov[i].iov_len)
+            part = iov[i].iov_len;
+
+        fastevent_emit(FASTEVENT_TYPE_CLIENT_WRITE, FASTEVENT_FLAG_NONE, FASTEVENT_DATATYPE_OBRD, client, iov[i].iov_base, iov[i].iov_len, (ssize_t)part);
+
+        if (part < (int)iov[i].iov_len)
+            break;
+        left -= part;
+    }
+
+    return ret;
+}
+
 void client_set_queue(client_t *client, refbuf_t *refbuf)
 {
     refbuf_t *to_release = client->refbuf;
@@ -907,6 +1286,8 @@ ssize_t client_body_read(client_t *client, void *buf, size_t len)
 
     if (ret > 0) {
         client->request_body_read += ret;
+        if (client->capture && dumpfile_capture(client->capture, buf, ret) < 0)
+            client->capture = NULL;
     }
 
     fastevent_emit(FASTEVENT_TYPE_CLIENT_READ_BODY, FASTEVENT_FLAG_MODIFICATION_ALLOWED, FASTEVENT_DATATYPE_OBRD, client, buf, len, ret);
@@ -942,6 +1323,9 @@ int client_body_eof(client_t *client)
     if (client->request_body_length != -1 && client->request_body_read == (size_t)client->request_body_length) {
         ICECAST_LOG_DDEBUG("Reached given body length (client=%p)", client);
         ret = 1;
+    } else if (client->chunked && chunked_eof(client->chunked)) {
+        ICECAST_LOG_DDEBUG("Reached end of chunked body (client=%p)", client);
+        ret = 1;
     } else if (client->encoding) {
         ICECAST_LOG_DDEBUG("Looking for body EOF with encoding (client=%p)", client);
         ret = httpp_encoding_eof(client->encoding, (int(*)(void*))client_eof, client);
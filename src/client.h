@@ -20,13 +20,18 @@
 #define __CLIENT_H__
 
 #include "common/httpp/httpp.h"
+#include "common/net/sock.h"
 #include "common/httpp/encoding.h"
 
 #include "icecasttypes.h"
 #include "navigation.h"
 #include "errors.h"
 #include "refbuf.h"
+#include "zerocopy.h"
+#include "dumpfile.h"
 #include "module.h"
+#include "chunked.h"
+#include "timerwheel.h"
 
 #define CLIENT_DEFAULT_REPORT_XSL_HTML                  "report-html.xsl"
 #define CLIENT_DEFAULT_REPORT_XSL_PLAINTEXT             "report-plaintext.xsl"
@@ -64,21 +69,27 @@ struct _client_tag {
     /* mode of operation for this client */
     operation_mode mode;
 
-    /* the client's connection */
-    connection_t *con;
-
     /* Reuse this connection ... */
     reuse_t reuse;
 
-    /* the client's http headers */
+    /* the client's connection */
+    connection_t *con;
+
+    /* the client's http headers, trimmed to those still used once a
+     * listener streams, see client_trim_request() */
     http_parser_t *parser;
 
     /* Transfer Encoding if any */
     httpp_encoding_t *encoding;
+    /* decoder of a chunked body, used instead of encoding */
+    chunked_t *chunked;
 
     /* protocol client uses */
     protocol_t protocol;
 
+    /* http response code for this client */
+    int respcode;
+
     /* http request body length
      * -1 for streaming (e.g. chunked), 0 for no body, >0 for NNN bytes
      */
@@ -87,9 +98,6 @@ struct _client_tag {
     /* http request body length read so far */
     size_t request_body_read;
 
-    /* http response code for this client */
-    int respcode;
-
     /* admin command if any. ADMIN_COMMAND_ERROR if not an admin command. */
     admin_command_id_t admin_command;
 
@@ -120,6 +128,8 @@ struct _client_tag {
 
     /* is client getting intro data */
     long intro_offset;
+    /* stream offset of the next data for a client joining in the past */
+    uint64_t timeshift_position;
 
     /* where in the queue the client is */
     refbuf_t *refbuf;
@@ -127,9 +137,56 @@ struct _client_tag {
     /* position in first buffer */
     unsigned int pos;
 
+    /* set while the source waits for the socket to become writable */
+    int write_blocked;
+    /* bytes the cohort send of the source gave it in this pass, which
+     * send_to_listener() counts against the per pass cap */
+    unsigned int pass_sent;
+
+    /* the kernel paces the socket to the stream bitrate once con->sent_bytes
+     * reaches pace_after, 0 if not to be paced. paced is set once it is. */
+    uint64_t pace_after;
+    int paced;
+
+    /* with an adaptive burst, coarsetime_get_ms() and con->sent_bytes when
+     * the listener joined, burst_start is 0 once its burst is decided */
+    uint64_t burst_start;
+    uint64_t burst_sent;
+
+    /* bytes behind the end of the queue at the last sample, and set once
+     * the listener lagged too far with <lag-action> fallback */
+    uint64_t lag;
+    int lag_fallback;
+
+    /* set if stream data is sent to the socket with MSG_ZEROCOPY */
+    zerocopy_t *zerocopy;
+
+    /* set for a source client while its reads are recorded, owned by the
+     * source */
+    dumpfile_t *capture;
+
+    /* bytes counted for this client in the listener_memory statistic, set
+     * by client_trim_request() */
+    size_t memory;
+
+    /* next listener queued on the same source, see source_add_pending() */
+    client_t *pending_next;
+
+    /* neighbours in the listener list of the source and next client in the
+     * same bucket of its id index, see source_t.client_list */
+    client_t *listener_prev;
+    client_t *listener_next;
+    client_t *index_next;
+    /* entry in source_t.listener_timers while con->discon_time is set */
+    timerwheel_entry_t discon_timer;
+
     /* auth used for this client */
     auth_t *auth;
 
+    /* set once the listener was handed over to a new process on upgrade,
+     * it leaves here without being released from its auth or logged */
+    int handed_over;
+
     /* Format-handler-specific data for this client */
     void *format_data;
 
@@ -143,7 +200,11 @@ struct _client_tag {
     int (*check_buffer)(source_t *source, client_t *client);
 };
 
-extern avl_tree *global_client_list;
+/* the request headers kept by client_trim_request(), NULL terminated */
+extern const char * const client_streaming_headers[];
+
+/* see client_walk(), return non-zero to stop */
+typedef int (*client_walk_callback_t)(client_t *client, void *userdata);
 
 protocol_t client_protocol_from_string(const char *str);
 const char * client_protocol_to_string(protocol_t protocol);
@@ -152,9 +213,11 @@ void client_initialize(void);
 void client_shutdown(void);
 
 int client_compare(void *compare_arg, void *a, void *b); // for avl.
+void client_walk(client_walk_callback_t callback, void *userdata);
 
 int client_create (client_t **c_ptr, connection_t *con, http_parser_t *parser);
 void client_complete(client_t *client);
+void client_trim_request(client_t *client);
 void client_destroy(client_t *client);
 void client_send_error_by_id(client_t *client, icecast_error_id_t id);
 void client_send_error_by_uuid(client_t *client, const char *uuid);
@@ -169,6 +232,7 @@ reportxml_t *client_get_empty_reportxml(void);
 reportxml_node_t *client_add_empty_incident(reportxml_t *report, const char *state_definition, const char *state_akindof, const char *state_text);
 admin_format_t client_get_admin_format_by_content_negotiation(client_t *client);
 int client_send_bytes (client_t *client, const void *buf, unsigned len);
+int client_send_vector (client_t *client, const struct iovec *iov, size_t count);
 int client_read_bytes (client_t *client, void *buf, unsigned len);
 void client_set_queue (client_t *client, refbuf_t *refbuf);
 ssize_t client_body_read(client_t *client, void *buf, size_t len);
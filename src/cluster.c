@@ -0,0 +1,498 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if defined(HAVE_GETRUSAGE) && defined(HAVE_SYS_RESOURCE_H)
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+
+#include "common/thread/thread.h"
+#include "common/timing/timing.h"
+#include "common/httpp/httpp.h"
+#include "common/net/sock.h"
+#include "common/avl/avl.h"
+
+#include "cluster.h"
+#include "global.h"
+#include "cfgfile.h"
+#include "client.h"
+#include "source.h"
+#include "stats.h"
+#include "egress.h"
+#include "fserve.h"
+#include "refbuf.h"
+#include "util.h"
+#include "errors.h"
+
+#include "logging.h"
+#define CATMODULE "cluster"
+
+/* seconds between the reports of a slave, a server not heard of for
+ * CLUSTER_EXPIRE seconds is no longer sent listeners */
+#define CLUSTER_INTERVAL        5
+#define CLUSTER_EXPIRE          (3*CLUSTER_INTERVAL)
+#define CLUSTER_MAX_URL         256
+#define CLUSTER_MAX_NODES       64
+/* listeners only go to a server loaded at least this many percent less,
+ * so two servers with about the same load do not send them back and forth */
+#define CLUSTER_LOAD_MARGIN     10
+/* seconds the master may pause while answering a report */
+#define CLUSTER_READ_TIMEOUT    10
+
+typedef struct {
+    char url[CLUSTER_MAX_URL];
+    /* percent */
+    unsigned int load;
+    unsigned int cpu;
+    uint64_t listeners;
+    /* bytes per second */
+    uint64_t egress;
+    time_t seen;
+    /* reported to this server, so it relays the mounts this one lists,
+     * otherwise the server is from the list of the master */
+    int slave;
+} cluster_node_t;
+
+static int __inited = 0;
+static volatile int _running = 0;
+static thread_type *_thread;
+/* protects all below */
+static mutex_t _lock;
+static cluster_node_t _self;
+static cluster_node_t _nodes[CLUSTER_MAX_NODES];
+static size_t _nodes_count;
+static unsigned int _redirect_load;
+/* the stream list of the master, NULL until the slave thread got one */
+static avl_tree *_master_mounts;
+
+/* used by the cluster thread only */
+static uint64_t _cpu_used;
+static uint64_t _cpu_at;
+
+/* CPU time used since the last call, in percent of all CPUs */
+static unsigned int cluster_cpu(void)
+{
+#if defined(HAVE_GETRUSAGE) && defined(HAVE_SYS_RESOURCE_H)
+    struct rusage usage;
+    uint64_t now = timing_get_time();
+    uint64_t used;
+    uint64_t ret = 0;
+    long cpus = 1;
+
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+
+    used = (uint64_t)usage.ru_utime.tv_sec * 1000 + usage.ru_utime.tv_usec / 1000 +
+        (uint64_t)usage.ru_stime.tv_sec * 1000 + usage.ru_stime.tv_usec / 1000;
+#ifdef _SC_NPROCESSORS_ONLN
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+        cpus = 1;
+#endif
+
+    if (_cpu_at && now > _cpu_at)
+        ret = (used - _cpu_used) * 100 / ((now - _cpu_at) * cpus);
+    _cpu_used = used;
+    _cpu_at = now;
+
+    return ret > 100 ? 100 : ret;
+#else
+    return 0;
+#endif
+}
+
+static void cluster_measure(cluster_node_t *self, int client_limit)
+{
+    int64_t listeners = stats_counter_get(&(stats_global_counters[STATS_GLOBAL_LISTENERS]));
+    uint64_t rate = atomic_u64_load(&egress_global.rate);
+    uint64_t load;
+
+    self->listeners = listeners > 0 ? listeners : 0;
+    self->egress = egress_get_rate(&egress_global);
+    self->cpu = cluster_cpu();
+
+    load = self->cpu;
+    if (client_limit > 0 && self->listeners * 100 / client_limit > load)
+        load = self->listeners * 100 / client_limit;
+    if (rate && self->egress * 100 / rate > load)
+        load = self->egress * 100 / rate;
+    self->load = load > 100 ? 100 : load;
+}
+
+/* drops the servers not heard of for too long. You must have _lock locked. */
+static void cluster_expire(time_t now)
+{
+    size_t i = 0;
+
+    while (i < _nodes_count) {
+        if (_nodes[i].seen + CLUSTER_EXPIRE < now) {
+            _nodes[i] = _nodes[--_nodes_count];
+        } else {
+            i++;
+        }
+    }
+}
+
+/* You must have _lock locked. */
+static cluster_node_t *cluster_find(const char *url)
+{
+    size_t i;
+
+    for (i = 0; i < _nodes_count; i++)
+        if (strcmp(_nodes[i].url, url) == 0)
+            return &(_nodes[i]);
+
+    return NULL;
+}
+
+static int cluster_parse_node(cluster_node_t *node, const char *line)
+{
+    unsigned long long listeners, egress;
+
+    memset(node, 0, sizeof(*node));
+    if (sscanf(line, "%255s %u %llu %llu %u", node->url, &node->load, &listeners, &egress, &node->cpu) != 5)
+        return -1;
+    node->listeners = listeners;
+    node->egress = egress;
+
+    return 0;
+}
+
+/* reports the load of this server to the master and takes the loads of the
+ * others it answers with */
+static void cluster_report(const cluster_node_t *self, const char *master, int port, const char *username, const char *password)
+{
+    cluster_node_t nodes[CLUSTER_MAX_NODES];
+    size_t count = 0;
+    char buf[CLUSTER_MAX_URL + 128];
+    char *authheader, *data, *url;
+    time_t now;
+    sock_t sock;
+    size_t len;
+    size_t i;
+
+    sock = sock_connect_wto(master, port, 10);
+    if (sock == SOCK_ERROR) {
+        ICECAST_LOG_DEBUG("Can not contact the master to report the load");
+        return;
+    }
+
+    len = strlen(username) + strlen(password) + 2;
+    authheader = malloc(len);
+    snprintf(authheader, len, "%s:%s", username, password);
+    data = util_base64_encode(authheader, strlen(authheader));
+    url = util_url_escape(self->url);
+    sock_write(sock,
+            "GET /admin/clusterload?url=%s&load=%u&listeners=%llu&egress=%llu&cpu=%u HTTP/1.0\r\n"
+            "Authorization: Basic %s\r\n"
+            "\r\n",
+            url ? url : "", self->load, (unsigned long long)self->listeners,
+            (unsigned long long)self->egress, self->cpu, data);
+    free(url);
+    free(authheader);
+    free(data);
+
+    util_set_read_timeout(sock, CLUSTER_READ_TIMEOUT);
+    if (sock_read_line(sock, buf, sizeof(buf)) == 0 ||
+            ((strncmp(buf, "HTTP/1.0 200", 12) != 0) && (strncmp(buf, "HTTP/1.1 200", 12) != 0))) {
+        ICECAST_LOG_WARN("Master rejected the load report");
+        sock_close(sock);
+        return;
+    }
+
+    while (sock_read_line(sock, buf, sizeof(buf)) && buf[0]);
+
+    now = time(NULL);
+    while (count < CLUSTER_MAX_NODES && sock_read_line(sock, buf, sizeof(buf))) {
+        if (cluster_parse_node(&(nodes[count]), buf) != 0)
+            continue;
+        if (strcmp(nodes[count].url, self->url) == 0)
+            continue;
+        nodes[count].seen = now;
+        count++;
+    }
+    sock_close(sock);
+
+    thread_mutex_lock(&_lock);
+    /* the list of the master replaces the one it sent before */
+    i = 0;
+    while (i < _nodes_count) {
+        if (!_nodes[i].slave) {
+            _nodes[i] = _nodes[--_nodes_count];
+        } else {
+            i++;
+        }
+    }
+    for (i = 0; i < count && _nodes_count < CLUSTER_MAX_NODES; i++) {
+        if (!cluster_find(nodes[i].url))
+            _nodes[_nodes_count++] = nodes[i];
+    }
+    thread_mutex_unlock(&_lock);
+
+    ICECAST_LOG_DEBUG("Reported load %u%% to the master, got %zu other servers", self->load, count);
+}
+
+static void *cluster_thread(void *arg)
+{
+    (void)arg;
+
+    while (_running) {
+        ice_config_t *config;
+        cluster_node_t self;
+        char *master = NULL, *username = NULL, *password = NULL;
+        int port;
+        int client_limit;
+        unsigned int redirect_load;
+
+        memset(&self, 0, sizeof(self));
+
+        config = config_get_config();
+        if (config->cluster_url)
+            snprintf(self.url, sizeof(self.url), "%s", config->cluster_url);
+        redirect_load = config->cluster_redirect_load;
+        client_limit = config->client_limit;
+        if (config->master_server && config->master_password && config->master_server_port) {
+            master = strdup(config->master_server);
+            username = strdup(config->master_username);
+            password = strdup(config->master_password);
+        }
+        port = config->master_server_port;
+        config_release_config();
+
+        cluster_measure(&self, client_limit);
+        self.seen = time(NULL);
+
+        thread_mutex_lock(&_lock);
+        _self = self;
+        _redirect_load = redirect_load;
+        cluster_expire(self.seen);
+        thread_mutex_unlock(&_lock);
+
+        /* the master only needs to hear of slaves that take or send listeners */
+        if (master && (self.url[0] || redirect_load))
+            cluster_report(&self, master, port, username, password);
+
+        free(master);
+        free(username);
+        free(password);
+
+        global_sleep(CLUSTER_INTERVAL * 1000);
+    }
+
+    return NULL;
+}
+
+static int cluster_mount_free(void *key)
+{
+    free(key);
+    return 1;
+}
+
+void cluster_initialize(void)
+{
+    if (__inited)
+        return;
+
+    thread_mutex_create(&_lock);
+    _nodes_count = 0;
+    memset(&_self, 0, sizeof(_self));
+    _redirect_load = 0;
+    _master_mounts = NULL;
+    __inited = 1;
+
+    _running = 1;
+    _thread = thread_create("Cluster Thread", cluster_thread, NULL, THREAD_ATTACHED);
+    if (!_thread) {
+        _running = 0;
+        ICECAST_LOG_ERROR("Can not start the cluster thread");
+    }
+}
+
+void cluster_shutdown(void)
+{
+    if (!__inited)
+        return;
+
+    if (_running) {
+        _running = 0;
+        global_wake();
+        thread_join(_thread);
+    }
+
+    if (_master_mounts)
+        avl_tree_free(_master_mounts, cluster_mount_free);
+    _master_mounts = NULL;
+    thread_mutex_destroy(&_lock);
+    __inited = 0;
+}
+
+int cluster_redirect(source_t *source, client_t *client)
+{
+    const cluster_node_t *best = NULL;
+    const char *rawuri;
+    const char *query;
+    char location[CLUSTER_MAX_URL + 1024];
+    size_t url_len;
+    int from_master;
+    void *found;
+    time_t now;
+    size_t i;
+    int ret;
+
+    if (!__inited)
+        return -1;
+
+    /* relays of other servers stay, whatever they fetch is fetched from here */
+    if (httpp_getvar(client->parser, "icecast-relay"))
+        return -1;
+
+    thread_mutex_lock(&_lock);
+    ret = !_redirect_load || _self.load < _redirect_load;
+    thread_mutex_unlock(&_lock);
+    if (ret)
+        return -1;
+
+    now = time(NULL);
+
+    thread_mutex_lock(&_lock);
+    from_master = _master_mounts && avl_get_by_key(_master_mounts, (void *)source->mount, &found) == 0;
+    for (i = 0; i < _nodes_count; i++) {
+        const cluster_node_t *node = &(_nodes[i]);
+
+        if (node->seen + CLUSTER_EXPIRE < now || node->load >= _redirect_load ||
+                node->load + CLUSTER_LOAD_MARGIN > _self.load)
+            continue;
+        if (node->slave ? source->hidden : !from_master)
+            continue;
+        if (!best || node->load < best->load)
+            best = node;
+    }
+
+    ret = -1;
+    if (best) {
+        rawuri = httpp_getvar(client->parser, HTTPP_VAR_RAWURI);
+        query = rawuri ? strchr(rawuri, '?') : NULL;
+        url_len = strlen(best->url);
+        if (url_len && best->url[url_len - 1] == '/')
+            url_len--;
+        ret = snprintf(location, sizeof(location), "%.*s%s%s", (int)url_len, best->url, source->mount, query ? query : "");
+        ret = (ret < 0 || (size_t)ret >= sizeof(location)) ? -1 : 0;
+        if (ret == 0)
+            ICECAST_LOG_DEBUG("Load %u%%, sending listener of %s to %s at %u%%", _self.load, source->mount, best->url, best->load);
+    }
+    thread_mutex_unlock(&_lock);
+
+    if (ret != 0)
+        return -1;
+
+    stats_global_inc(STATS_GLOBAL_LISTENERS_REDIRECTED_CLUSTER);
+    client_send_redirect(client, "c28a52f8-3cb2-45a4-a1d2-714898bd6dc6", 302, location);
+
+    return 0;
+}
+
+void cluster_set_master_mounts(avl_tree *mounts)
+{
+    avl_tree *old;
+
+    if (!__inited) {
+        if (mounts)
+            avl_tree_free(mounts, cluster_mount_free);
+        return;
+    }
+
+    thread_mutex_lock(&_lock);
+    old = _master_mounts;
+    _master_mounts = mounts;
+    thread_mutex_unlock(&_lock);
+
+    if (old)
+        avl_tree_free(old, cluster_mount_free);
+}
+
+void cluster_send_loads(client_t *client)
+{
+    const char *url = httpp_get_param(client->parser, "url");
+    const char *load = httpp_get_param(client->parser, "load");
+    const char *listeners = httpp_get_param(client->parser, "listeners");
+    const char *egress = httpp_get_param(client->parser, "egress");
+    const char *cpu = httpp_get_param(client->parser, "cpu");
+    time_t now = time(NULL);
+    refbuf_t *body;
+    size_t size;
+    ssize_t ret;
+    size_t i;
+
+    thread_mutex_lock(&_lock);
+    if (url && *url && strlen(url) < CLUSTER_MAX_URL && !strpbrk(url, " \t\r\n") && load) {
+        cluster_node_t *node = cluster_find(url);
+
+        if (!node && _nodes_count < CLUSTER_MAX_NODES) {
+            node = &(_nodes[_nodes_count++]);
+            memset(node, 0, sizeof(*node));
+            snprintf(node->url, sizeof(node->url), "%s", url);
+            ICECAST_LOG_INFO("Server %s joined the cluster", url);
+        }
+        if (node) {
+            node->load = atoi(load);
+            node->listeners = listeners ? strtoull(listeners, NULL, 10) : 0;
+            node->egress = egress ? strtoull(egress, NULL, 10) : 0;
+            node->cpu = cpu ? atoi(cpu) : 0;
+            node->seen = now;
+            node->slave = 1;
+        }
+    }
+    cluster_expire(now);
+
+    size = (_nodes_count + 1) * (CLUSTER_MAX_URL + 80);
+    body = refbuf_new(size);
+    body->len = 0;
+    if (_self.url[0]) {
+        body->len += snprintf(body->data + body->len, size - body->len, "%s %u %llu %llu %u\r\n",
+                _self.url, _self.load, (unsigned long long)_self.listeners,
+                (unsigned long long)_self.egress, _self.cpu);
+    }
+    for (i = 0; i < _nodes_count; i++) {
+        const cluster_node_t *node = &(_nodes[i]);
+
+        if (url && strcmp(node->url, url) == 0)
+            continue;
+        body->len += snprintf(body->data + body->len, size - body->len, "%s %u %llu %llu %u\r\n",
+                node->url, node->load, (unsigned long long)node->listeners,
+                (unsigned long long)node->egress, node->cpu);
+    }
+    thread_mutex_unlock(&_lock);
+
+    ret = util_http_build_header(client->refbuf->data, PER_CLIENT_REFBUF_SIZE, 0,
+                                 0, 200, NULL,
+                                 "text/plain", "utf-8",
+                                 "", NULL, client);
+    if (ret == -1 || ret >= PER_CLIENT_REFBUF_SIZE) {
+        ICECAST_LOG_ERROR("Dropping client as we can not build response headers.");
+        refbuf_release(body);
+        client_send_error_by_id(client, ICECAST_ERROR_GEN_HEADER_GEN_FAILED);
+        return;
+    }
+
+    client->refbuf->len = strlen(client->refbuf->data);
+    client->respcode = 200;
+
+    client->refbuf->next = body;
+    fserve_add_client(client, NULL);
+}
@@ -0,0 +1,42 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* cluster.h
+ *
+ * Sends new listeners to the least loaded server of the cluster once this
+ * one is loaded above <cluster-redirect-load>. Every few seconds each slave
+ * reports its load to its master at /admin/clusterload, along with the URL
+ * listeners reach it at, see <cluster-url>, and gets the loads of the master
+ * and the other slaves back. The load of a server is the largest share of
+ * its limits it uses: listeners of <clients>, bandwidth of <max-bandwidth>
+ * and CPU time of all CPUs. The slaves relay all mounts the master lists, so
+ * only listeners of those are sent on.
+ */
+
+#ifndef __CLUSTER_H__
+#define __CLUSTER_H__
+
+#include "common/avl/avl.h"
+
+#include "icecasttypes.h"
+
+void    cluster_initialize(void);
+void    cluster_shutdown(void);
+
+/* Sends client on to another server carrying source if this one is loaded
+ * too much. Returns 0 if it did so, the client is done with then. */
+int     cluster_redirect(source_t *source, client_t *client);
+
+/* Takes the load a slave reported with the parameters of the request of
+ * client and answers with the loads of all servers of the cluster. */
+void    cluster_send_loads(client_t *client);
+
+/* Replaces the mounts of the stream list of the master, which all slaves
+ * relay, with mounts, a tree of malloc()ed strings which is taken over.
+ * Called by the slave thread as the list changes. */
+void    cluster_set_master_mounts(avl_tree *mounts);
+
+#endif  /* __CLUSTER_H__ */
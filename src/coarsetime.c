@@ -0,0 +1,61 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "common/thread/thread.h"
+
+#include "coarsetime.h"
+
+#include "logging.h"
+#define CATMODULE "coarsetime"
+
+volatile uint64_t coarsetime_now_ms = 0;
+
+static volatile unsigned int coarsetime_running = 0;
+static thread_type *coarsetime_thread = NULL;
+
+/* sleeps instead of waiting for a deadline, so the clock keeps going when
+ * the system time is set back */
+static void *coarsetime_run(void *arg)
+{
+    (void)arg;
+
+    while (atomic_uint_load(&coarsetime_running)) {
+        atomic_u64_store(&coarsetime_now_ms, timing_get_time());
+        thread_sleep(COARSETIME_RESOLUTION * 1000);
+    }
+
+    return NULL;
+}
+
+void coarsetime_initialize(void)
+{
+    if (coarsetime_thread)
+        return;
+
+    atomic_uint_store(&coarsetime_running, 1);
+
+    coarsetime_thread = thread_create("Coarse Time Thread", coarsetime_run, NULL, THREAD_ATTACHED);
+    if (!coarsetime_thread) {
+        ICECAST_LOG_ERROR("Can not start the coarse time thread, the clock is read directly.");
+        atomic_uint_store(&coarsetime_running, 0);
+    }
+}
+
+void coarsetime_shutdown(void)
+{
+    if (!coarsetime_thread)
+        return;
+
+    atomic_uint_store(&coarsetime_running, 0);
+    thread_join(coarsetime_thread);
+    coarsetime_thread = NULL;
+
+    atomic_u64_store(&coarsetime_now_ms, 0);
+}
@@ -0,0 +1,50 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* coarsetime.h
+ *
+ * The current time as kept by a thread that updates it every
+ * COARSETIME_RESOLUTION ms, for paths that look at the clock for every
+ * client or buffer and are fine with it being a few ms behind. Reading it
+ * is a single load. Before coarsetime_initialize() and after
+ * coarsetime_shutdown() the clock is read directly. Timers that need the
+ * exact time, such as the ones of the source loop, keep using
+ * timing_get_time().
+ */
+
+#ifndef __COARSETIME_H__
+#define __COARSETIME_H__
+
+#include <stdint.h>
+#include <time.h>
+
+#include "common/timing/timing.h"
+#include "atomic.h"
+
+#define COARSETIME_RESOLUTION   10
+
+/* ms as by timing_get_time(), 0 while the thread is not running */
+extern volatile uint64_t coarsetime_now_ms;
+
+void coarsetime_initialize(void);
+void coarsetime_shutdown(void);
+
+static inline uint64_t coarsetime_get_ms(void)
+{
+    uint64_t now = atomic_u64_load(&coarsetime_now_ms);
+
+    return now ? now : timing_get_time();
+}
+
+/* seconds as by time(NULL) */
+static inline time_t coarsetime_get(void)
+{
+    uint64_t now = atomic_u64_load(&coarsetime_now_ms);
+
+    return now ? (time_t)(now / 1000) : time(NULL);
+}
+
+#endif  /* __COARSETIME_H__ */
@@ -20,11 +20,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <errno.h>
 #include <string.h>
 #ifdef HAVE_POLL
 #include <poll.h>
 #endif
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 #include <sys/types.h>
 
 #ifndef _WIN32
@@ -38,9 +42,11 @@
 #include "common/avl/avl.h"
 #include "common/net/sock.h"
 #include "common/httpp/httpp.h"
+#include "common/timing/timing.h"
 
 #include "compat.h"
 #include "connection.h"
+#include "waitlock.h"
 #include "cfgfile.h"
 #include "global.h"
 #include "util.h"
@@ -63,9 +69,24 @@
 #include "listensocket.h"
 #include "fastevent.h"
 #include "navigation.h"
+#include "atomic.h"
+#include "fdpoll.h"
+#include "timerwheel.h"
+#include "tlshandshake.h"
+#include "objpool.h"
+#include "iplimit.h"
+#include "histogram.h"
+#include "coarsetime.h"
+#include "affinity.h"
+#include "cluster.h"
+#include "hls.h"
+#include "memgov.h"
 
 #define CATMODULE "connection"
 
+/* most clients woken up by readable sockets per round */
+#define CONNECTION_WAIT_EVENTS  256
+
 /* Two different major types of source authentication.
    Shoutcast style is used only by the Shoutcast DSP
    and is a crazy version of HTTP.  It looks like :
@@ -84,21 +105,74 @@
 typedef struct client_queue_tag {
     client_t *client;
     int offset;
+    /* how much of the buffer was already searched for the end of the
+     * headers, so slow clients do not make every read scan all of it */
+    int scanned;
     int shoutcast;
     char *shoutcast_mount;
     char *bodybuffer;
     size_t bodybufferlen;
     int tried_body;
+    /* set while in or waiting for the body queue */
+    int body;
+    /* set once the TLS handshake was handed to the handshake workers, or
+     * left to the reads if none is running */
+    int handshake;
+    /* Clients that got no data are taken out of the request and body
+     * queues until their socket becomes readable or their deadline passes,
+     * so they cost nothing while idle, see _wait_for_data() */
+    int armed;
+    timerwheel_entry_t timer;
+    /* histogram_time() when the client was accepted, 0 if not timed */
+    uint64_t queued;
+    /* the lane the client is in, see request_lane_t */
+    struct request_lane_tag *lane;
     struct client_queue_tag *next;
 } client_queue_t;
 
-static spin_t _connection_lock; // protects _current_id, _con_queue, _con_queue_tail
-static volatile connection_id_t _current_id = 0;
+#define NODE_OF_TIMER(entry) ((client_queue_t *)((char *)(entry) - offsetof(client_queue_t, timer)))
+
+/* The queues a request goes through until it is handled. The main thread
+ * works the main lane, with the request workers taking its connection queue
+ * if there are any. Listen sockets with <dedicated-thread> have a lane of
+ * their own and a thread that does all of it, so admin and health check
+ * requests on them are not held up by a storm of listeners connecting.
+ */
+typedef struct request_lane_tag {
+    spin_t con_queue_lock; // protects con_queue, con_queue_tail
+    spin_t accept_queue_lock; // protects accept_queue, accept_queue_tail
+    spin_t body_queue_lock; // protects body_queue, body_queue_tail
+    volatile client_queue_t *req_queue, **req_queue_tail;
+    volatile client_queue_t *accept_queue, **accept_queue_tail;
+    volatile client_queue_t *con_queue, **con_queue_tail;
+    volatile client_queue_t *body_queue, **body_queue_tail;
+    /* clients waiting for data, only used by the thread of the lane */
+    fdpoll_t *wait_poll;
+    timerwheel_t *wait_timers;
+    fdpoll_result_t wait_results[CONNECTION_WAIT_EVENTS];
+} request_lane_t;
+
+static request_lane_t _main_lane;
+static request_lane_t _dedicated_lane;
+static thread_type *_dedicated_thread = NULL;
+static volatile uint64_t _current_id = 0;
+static objpool_t _connection_pool;
 static int _initialized = 0;
 
-static volatile client_queue_t *_req_queue = NULL, **_req_queue_tail = &_req_queue;
-static volatile client_queue_t *_con_queue = NULL, **_con_queue_tail = &_con_queue;
-static volatile client_queue_t *_body_queue = NULL, **_body_queue_tail = &_body_queue;
+/* number of threads accepting connections, including the main one */
+static size_t _accept_threads = 1;
+/* the <request-workers> handling the connection queue, if there are none
+ * the main thread does. _request_workers_running is protected by
+ * _request_workers_lock, they are woken up through _request_workers_cond
+ * as clients are added to the queue. */
+static waitlock_t _request_workers_lock = WAITLOCK_INITIALIZER;
+static waitcond_t _request_workers_cond = WAITCOND_INITIALIZER;
+static int _request_workers_running = 0;
+static thread_type **_request_workers = NULL;
+static unsigned int _request_workers_count = 0;
+/* <keepalive-requests>, read by the threads sending responses */
+static volatile unsigned int _keepalive_requests = 1;
+
 static bool tls_ok = false;
 static tls_ctx_t *tls_ctx;
 
@@ -108,24 +182,54 @@ static matchfile_t *banned_ip, *allowed_ip;
 rwlock_t _source_shutdown_rwlock;
 
 static int  _update_admin_command(client_t *client);
-static void _handle_connection(void);
+static void _handle_connection(request_lane_t *lane);
 static void get_tls_certificate(ice_config_t *config);
 
+static void _lane_initialize(request_lane_t *lane)
+{
+    thread_spin_create (&lane->con_queue_lock);
+    thread_spin_create (&lane->accept_queue_lock);
+    thread_spin_create (&lane->body_queue_lock);
+    lane->req_queue = NULL;
+    lane->req_queue_tail = &lane->req_queue;
+    lane->accept_queue = NULL;
+    lane->accept_queue_tail = &lane->accept_queue;
+    lane->con_queue = NULL;
+    lane->con_queue_tail = &lane->con_queue;
+    lane->body_queue = NULL;
+    lane->body_queue_tail = &lane->body_queue;
+
+    lane->wait_timers = timerwheel_new(time(NULL));
+    lane->wait_poll = lane->wait_timers ? fdpoll_new() : NULL;
+}
+
+static void _lane_shutdown(request_lane_t *lane)
+{
+    thread_spin_destroy (&lane->con_queue_lock);
+    thread_spin_destroy (&lane->accept_queue_lock);
+    thread_spin_destroy (&lane->body_queue_lock);
+
+    fdpoll_free(lane->wait_poll);
+    lane->wait_poll = NULL;
+    timerwheel_free(lane->wait_timers);
+    lane->wait_timers = NULL;
+}
+
 void connection_initialize(void)
 {
     if (_initialized)
         return;
 
-    thread_spin_create (&_connection_lock);
+    _lane_initialize(&_main_lane);
+    _lane_initialize(&_dedicated_lane);
+    objpool_initialize(&_connection_pool, sizeof(connection_t));
     thread_mutex_create(&move_clients_mutex);
+    source_fallback_initialize();
     thread_rwlock_create(&_source_shutdown_rwlock);
     thread_cond_create(&global.shutdown_cond);
-    _req_queue = NULL;
-    _req_queue_tail = &_req_queue;
-    _con_queue = NULL;
-    _con_queue_tail = &_con_queue;
-    _body_queue = NULL;
-    _body_queue_tail = &_body_queue;
+
+    if (!_main_lane.wait_poll)
+        ICECAST_LOG_INFO("Can not wait for data of new clients, checking all of them every time.");
 
     _initialized = 1;
 }
@@ -141,27 +245,25 @@ void connection_shutdown(void)
  
     thread_cond_destroy(&global.shutdown_cond);
     thread_rwlock_destroy(&_source_shutdown_rwlock);
-    thread_spin_destroy (&_connection_lock);
+    _lane_shutdown(&_main_lane);
+    _lane_shutdown(&_dedicated_lane);
+    objpool_shutdown(&_connection_pool);
     thread_mutex_destroy(&move_clients_mutex);
+    source_fallback_shutdown();
 
     _initialized = 0;
 }
 
 void connection_reread_config(ice_config_t *config)
 {
+    atomic_uint_store(&_keepalive_requests, config->keepalive_requests);
     get_tls_certificate(config);
     listensocket_container_configure_and_setup(global.listensockets, config);
 }
 
 static connection_id_t _next_connection_id(void)
 {
-    connection_id_t id;
-
-    thread_spin_lock(&_connection_lock);
-    id = _current_id++;
-    thread_spin_unlock(&_connection_lock);
-
-    return id;
+    return (connection_id_t)(atomic_u64_add(&_current_id, 1) - 1);
 }
 
 
@@ -183,10 +285,14 @@ static void get_tls_certificate(ice_config_t *config)
         return;
     }
 
+    tls_ctx_set_sessions(tls_ctx, config->tls_context.session_cache, config->tls_context.session_timeout, config->tls_context.ticket_key_lifetime);
+
     tls_ok = true;
 }
 
 
+static void connection_check_ktls(connection_t *con);
+
 /* handlers for reading and writing a connection_t when there is TLS
  * configured on the listening port
  */
@@ -198,6 +304,8 @@ static int connection_read_tls(connection_t *con, void *buf, size_t len)
         if (tls_want_io(con->tls) > 0)
             return -1;
         con->error = 1;
+    } else {
+        connection_check_ktls(con);
     }
     return bytes;
 }
@@ -210,6 +318,7 @@ static int connection_send_tls(connection_t *con, const void *buf, size_t len)
         con->error = 1;
     } else {
         con->sent_bytes += bytes;
+        connection_check_ktls(con);
     }
 
     return bytes;
@@ -252,6 +361,55 @@ static int connection_send(connection_t *con, const void *buf, size_t len)
     return bytes;
 }
 
+static ssize_t connection_sendv(connection_t *con, const struct iovec *iov, size_t count)
+{
+    ssize_t bytes = sock_writev(con->sock, iov, count);
+    if (bytes < 0) {
+        if (!sock_recoverable(sock_error()))
+            con->error = 1;
+    } else {
+        con->sent_bytes += bytes;
+    }
+
+    return bytes;
+}
+
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+static ssize_t connection_sendfile(connection_t *con, int fd, off_t *offset, size_t len)
+{
+    ssize_t bytes = sendfile(con->sock, fd, offset, len);
+    if (bytes < 0) {
+        /* EINVAL and ENOSYS mean the file can not be sent this way, the
+         * caller falls back to reading it */
+        if (errno != EINVAL && errno != ENOSYS && !sock_recoverable(sock_error()))
+            con->error = 1;
+    } else {
+        con->sent_bytes += bytes;
+    }
+
+    return bytes;
+}
+#endif
+
+#ifdef ICECAST_CAP_TLS
+/* Once the kernel encrypts what is sent on the socket, data is written to
+ * it directly like on plain connections, including with sendfile(). The
+ * handshake and reading stay with the TLS library. */
+static void connection_check_ktls(connection_t *con)
+{
+    if (con->send != connection_send_tls || tls_ktls_send_active(con->tls) != 1)
+        return;
+
+    ICECAST_LOG_DEBUG("Connection %llu uses kernel TLS for sending", (long long unsigned int)con->id);
+
+    con->send = connection_send;
+    con->sendv = connection_sendv;
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+    con->sendfile = connection_sendfile;
+#endif
+}
+#endif
+
 connection_t *connection_create(sock_t sock, listensocket_t *listensocket_real, listensocket_t* listensocket_effective, char *ip)
 {
     connection_t *con;
@@ -259,7 +417,7 @@ connection_t *connection_create(sock_t sock, listensocket_t *listensocket_real,
     if (!matchfile_match_allow_deny(allowed_ip, banned_ip, ip))
         return NULL;
 
-    con = (connection_t *)calloc(1, sizeof(connection_t));
+    con = objpool_alloc(&_connection_pool);
     if (con) {
         refobject_ref(listensocket_real);
         refobject_ref(listensocket_effective);
@@ -267,12 +425,16 @@ connection_t *connection_create(sock_t sock, listensocket_t *listensocket_real,
         con->sock       = sock;
         con->listensocket_real = listensocket_real;
         con->listensocket_effective = listensocket_effective;
-        con->con_time   = time(NULL);
+        con->con_time   = coarsetime_get();
         con->id         = _next_connection_id();
         con->ip         = ip;
         con->tlsmode    = ICECAST_TLSMODE_AUTO;
         con->read       = connection_read;
         con->send       = connection_send;
+        con->sendv      = connection_sendv;
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+        con->sendfile   = connection_sendfile;
+#endif
     }
 
     fastevent_emit(FASTEVENT_TYPE_CONNECTION_CREATE, FASTEVENT_FLAG_MODIFICATION_ALLOWED, FASTEVENT_DATATYPE_CONNECTION, con);
@@ -297,6 +459,8 @@ void connection_uses_tls(connection_t *con)
     con->tlsmode = ICECAST_TLSMODE_RFC2818;
     con->read = connection_read_tls;
     con->send = connection_send_tls;
+    con->sendv = NULL;
+    con->sendfile = NULL;
     con->tls = tls_new(tls_ctx);
     tls_set_incoming(con->tls);
     tls_set_socket(con->tls, con->sock);
@@ -305,13 +469,97 @@ void connection_uses_tls(connection_t *con)
 
 ssize_t connection_send_bytes(connection_t *con, const void *buf, size_t len)
 {
+    uint64_t start = fastevent_active(FASTEVENT_TYPE_CONNECTION_WRITE_TIME) ? histogram_time() : 0;
     ssize_t ret = con->send(con, buf, len);
 
     fastevent_emit(FASTEVENT_TYPE_CONNECTION_WRITE, FASTEVENT_FLAG_MODIFICATION_ALLOWED, FASTEVENT_DATATYPE_OBRD, con, buf, len, ret);
+    if (start)
+        fastevent_emit(FASTEVENT_TYPE_CONNECTION_WRITE_TIME, FASTEVENT_FLAG_NONE, FASTEVENT_DATATYPE_ORDT, con, len, ret, histogram_time() - start);
 
     return ret;
 }
 
+sock_t connection_get_plain_socket(connection_t *con)
+{
+    if (con->sendv != connection_sendv)
+        return SOCK_ERROR;
+
+    return con->sock;
+}
+
+void connection_sent_on_socket(connection_t *con, ssize_t ret)
+{
+    if (ret < 0) {
+        if (!sock_recoverable(-ret))
+            con->error = 1;
+    } else {
+        con->sent_bytes += ret;
+    }
+}
+
+/* Sends the given buffers in order, like writev(2). Returns the number of
+ * bytes written in total, which may end in the middle of any buffer, or the
+ * result of the failed write if nothing was written.
+ */
+ssize_t connection_send_vector(connection_t *con, const struct iovec *iov, size_t count)
+{
+    ssize_t done = 0;
+    ssize_t ret;
+    size_t i;
+
+    if (count == 1)
+        return connection_send_bytes(con, iov[0].iov_base, iov[0].iov_len);
+
+    if (con->sendv) {
+        uint64_t start = fastevent_active(FASTEVENT_TYPE_CONNECTION_WRITE_TIME) ? histogram_time() : 0;
+
+        ret = con->sendv(con, iov, count);
+
+        /* timed as the single write it is */
+        if (start) {
+            size_t len = 0;
+
+            for (i = 0; i < count; i++)
+                len += iov[i].iov_len;
+            fastevent_emit(FASTEVENT_TYPE_CONNECTION_WRITE_TIME, FASTEVENT_FLAG_NONE, FASTEVENT_DATATYPE_ORDT, con, len, ret, histogram_time() - start);
+        }
+
+        /* report the write per buffer as the events only carry one each */
+        for (i = 0; i < count; i++) {
+            ssize_t part;
+
+            if (ret < 0) {
+                part = ret;
+            } else if ((size_t)(ret - done) >= iov[i].iov_len) {
+                part = iov[i].iov_len;
+            } else {
+                part = ret - done;
+            }
+
+            fastevent_emit(FASTEVENT_TYPE_CONNECTION_WRITE, FASTEVENT_FLAG_MODIFICATION_ALLOWED, FASTEVENT_DATATYPE_OBRD, con, iov[i].iov_base, iov[i].iov_len, part);
+
+            if (part < (ssize_t)iov[i].iov_len)
+                break;
+            done += part;
+        }
+
+        return ret;
+    }
+
+    /* no gather write, send one by one until the socket is full */
+    for (i = 0; i < count; i++) {
+        ret = connection_send_bytes(con, iov[i].iov_base, iov[i].iov_len);
+        if (ret <= 0)
+            return done ? done : ret;
+
+        done += ret;
+        if ((size_t)ret < iov[i].iov_len)
+            break;
+    }
+
+    return done;
+}
+
 static inline ssize_t connection_read_bytes_real(connection_t *con, void *buf, size_t len)
 {
     ssize_t done = 0;
@@ -354,6 +602,34 @@ static inline ssize_t connection_read_bytes_real(connection_t *con, void *buf, s
     return done + ret;
 }
 
+/* Sends up to len bytes of the file fd from *offset, which is advanced,
+ * without copying them through user space. Returns the number of bytes
+ * sent, 0 at the end of the file or -1 on error. errno is ENOSYS if the
+ * connection can not do this, EINVAL if the file can not be sent so.
+ */
+ssize_t connection_send_file(connection_t *con, int fd, off_t *offset, size_t len)
+{
+    uint64_t start;
+    ssize_t ret;
+
+    if (!con->sendfile) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    start = fastevent_active(FASTEVENT_TYPE_CONNECTION_WRITE_TIME) ? histogram_time() : 0;
+    ret = con->sendfile(con, fd, offset, len);
+    if (start) {
+        /* callers look at errno */
+        int error = errno;
+
+        fastevent_emit(FASTEVENT_TYPE_CONNECTION_WRITE_TIME, FASTEVENT_FLAG_NONE, FASTEVENT_DATATYPE_ORDT, con, len, ret, histogram_time() - start);
+        errno = error;
+    }
+
+    return ret;
+}
+
 ssize_t connection_read_bytes(connection_t *con, void *buf, size_t len)
 {
     ssize_t ret = connection_read_bytes_real(con, buf, len);
@@ -399,56 +675,143 @@ int connection_read_put_back(connection_t *con, const void *buf, size_t len)
  */
 static void _add_connection(client_queue_t *node)
 {
-    thread_spin_lock(&_connection_lock);
-    *_con_queue_tail = node;
-    _con_queue_tail = (volatile client_queue_t **) &node->next;
-    thread_spin_unlock(&_connection_lock);
+    request_lane_t *lane = node->lane;
+
+    thread_spin_lock(&lane->con_queue_lock);
+    *lane->con_queue_tail = node;
+    lane->con_queue_tail = (volatile client_queue_t **) &node->next;
+    thread_spin_unlock(&lane->con_queue_lock);
+
+    if (lane == &_main_lane && _request_workers_count) {
+        waitlock_lock(&_request_workers_lock);
+        waitcond_signal(&_request_workers_cond);
+        waitlock_unlock(&_request_workers_lock);
+    }
 }
 
 
 /* this returns queued clients for the connection thread. headers are
  * already provided, but need to be parsed.
  */
-static client_queue_t *_get_connection(void)
+static client_queue_t *_get_connection(request_lane_t *lane)
 {
     client_queue_t *node = NULL;
 
-    thread_spin_lock(&_connection_lock);
+    thread_spin_lock(&lane->con_queue_lock);
 
-    if (_con_queue){
-        node = (client_queue_t *)_con_queue;
-        _con_queue = node->next;
-        if (_con_queue == NULL)
-            _con_queue_tail = &_con_queue;
+    if (lane->con_queue){
+        node = (client_queue_t *)lane->con_queue;
+        lane->con_queue = node->next;
+        if (lane->con_queue == NULL)
+            lane->con_queue_tail = &lane->con_queue;
         node->next = NULL;
     }
 
-    thread_spin_unlock(&_connection_lock);
+    thread_spin_unlock(&lane->con_queue_lock);
     return node;
 }
 
 
+/* queue a client from any thread, they are picked up by the one of its lane */
+static void _add_accept_queue(client_queue_t *node)
+{
+    request_lane_t *lane = node->lane;
+
+    thread_spin_lock(&lane->accept_queue_lock);
+    *lane->accept_queue_tail = node;
+    lane->accept_queue_tail = (volatile client_queue_t **)&node->next;
+    thread_spin_unlock(&lane->accept_queue_lock);
+}
+
+/* move clients queued by other threads to the end of the request queue */
+static void _take_accepted(request_lane_t *lane)
+{
+    thread_spin_lock(&lane->accept_queue_lock);
+    if (lane->accept_queue) {
+        *lane->req_queue_tail = lane->accept_queue;
+        lane->req_queue_tail = lane->accept_queue_tail;
+        lane->accept_queue = NULL;
+        lane->accept_queue_tail = &lane->accept_queue;
+    }
+    thread_spin_unlock(&lane->accept_queue_lock);
+}
+
+/* Takes a client that got no new data out of its queue until its socket is
+ * readable or deadline has passed. Returns -1 if it must stay in the queue.
+ */
+static int _wait_for_data(client_queue_t *node, time_t deadline)
+{
+    request_lane_t *lane = node->lane;
+
+    if (!lane->wait_poll)
+        return -1;
+
+    if (!node->armed) {
+        if (fdpoll_arm(lane->wait_poll, node->client->con->sock, FDPOLL_EVENT_READ, node) != 0)
+            return -1;
+        node->armed = 1;
+    }
+
+    timerwheel_add(lane->wait_timers, &(node->timer), deadline);
+
+    return 0;
+}
+
+/* called before a client leaves the request and body queues */
+static void _stop_waiting(client_queue_t *node)
+{
+    if (node->armed) {
+        fdpoll_disarm(node->lane->wait_poll, node->client->con->sock);
+        node->armed = 0;
+    }
+    timerwheel_remove(node->lane->wait_timers, &(node->timer));
+}
+
+/* called by the handshake workers, the client comes back to the request queue */
+static void _handshake_done(void *userdata, int ok)
+{
+    client_queue_t *node = userdata;
+
+    if (ok) {
+        _add_accept_queue(node);
+        return;
+    }
+
+    ICECAST_LOG_DEBUG("TLS handshake of client %p failed", node->client);
+    client_destroy(node->client);
+    free(node->shoutcast_mount);
+    free(node);
+}
+
 /* run along queue checking for any data that has come in or a timeout */
-static void process_request_queue (void)
+static void process_request_queue (request_lane_t *lane)
 {
-    client_queue_t **node_ref = (client_queue_t **)&_req_queue;
+    client_queue_t **node_ref = (client_queue_t **)&lane->req_queue;
     ice_config_t *config;
-    int timeout;
+    int header_timeout;
+    int keepalive_timeout;
+    time_t now;
     char peak;
 
+    _take_accepted(lane);
+
     config = config_get_config();
-    timeout = config->header_timeout;
+    header_timeout = config->header_timeout;
+    keepalive_timeout = config->keepalive_timeout;
     config_release_config();
+    now = coarsetime_get();
 
     while (*node_ref) {
         client_queue_t *node = *node_ref;
         client_t *client = node->client;
         int len = PER_CLIENT_REFBUF_SIZE - 1 - node->offset;
         char *buf = client->refbuf->data + node->offset;
+        /* a kept alive connection is idle until its next request starts */
+        int timeout = client->con->requests && !node->offset ? keepalive_timeout : header_timeout;
 
         ICECAST_LOG_DDEBUG("Checking on client %p", client);
 
-        if (client->con->tlsmode == ICECAST_TLSMODE_AUTO || client->con->tlsmode == ICECAST_TLSMODE_AUTO_NO_PLAIN) {
+        if (!client->con->requests && (client->con->tlsmode == ICECAST_TLSMODE_AUTO || client->con->tlsmode == ICECAST_TLSMODE_AUTO_NO_PLAIN)) {
             if (recv(client->con->sock, &peak, 1, MSG_PEEK) == 1) {
                 if (peak == 0x16) { /* TLS Record Protocol Content type 0x16 == Handshake */
                     connection_uses_tls(client->con);
@@ -456,8 +819,24 @@ static void process_request_queue (void)
             }
         }
 
+        /* the main thread is not held up by the handshake, which is done by
+         * the workers unless none is running */
+        if (client->con->tls && !node->handshake) {
+            time_t left = client->con->con_time + timeout - now;
+
+            if ((client_queue_t **)lane->req_queue_tail == &(node->next))
+                lane->req_queue_tail = (volatile client_queue_t **)node_ref;
+            *node_ref = node->next;
+            node->next = NULL;
+            node->handshake = 1;
+            _stop_waiting(node);
+            if (tlshandshake_add(client->con->tls, client->con->sock, coarsetime_get_ms() + (left > 0 ? (uint64_t)left * 1000 : 0), _handshake_done, node) != 0)
+                _add_accept_queue(node);
+            continue;
+        }
+
         if (len > 0) {
-            if (client->con->con_time + timeout <= time(NULL)) {
+            if (client->con->con_time + timeout <= now) {
                 len = 0;
             } else {
                 len = client_read_bytes(client, buf, len);
@@ -467,6 +846,7 @@ static void process_request_queue (void)
         if (len > 0 || node->shoutcast > 1) {
             ssize_t stream_offset = -1;
             int pass_it = 1;
+            char *scan;
             char *ptr;
 
             if (len < 0 && node->shoutcast > 1)
@@ -476,34 +856,40 @@ static void process_request_queue (void)
              * EOL as \r\r\n */
             node->offset += len;
             client->refbuf->data[node->offset] = '\000';
+
+            /* None of the terminators was in what was searched before, so
+             * only the new data and the 5 bytes before it are searched, as
+             * a terminator may have been split over two reads */
+            scan = client->refbuf->data + (node->scanned > 5 ? node->scanned - 5 : 0);
             do {
                 if (node->shoutcast == 1) {
                     /* password line */
-                    if (strstr (client->refbuf->data, "\r\r\n") != NULL)
+                    if (strstr (scan, "\r\r\n") != NULL)
                         break;
-                    if (strstr (client->refbuf->data, "\r\n") != NULL)
+                    if (strstr (scan, "\r\n") != NULL)
                         break;
-                    if (strstr (client->refbuf->data, "\n") != NULL)
+                    if (strstr (scan, "\n") != NULL)
                         break;
                 }
                 /* stream_offset refers to the start of any data sent after the
                  * http style headers, we don't want to lose those */
-                ptr = strstr(client->refbuf->data, "\r\r\n\r\r\n");
+                ptr = strstr(scan, "\r\r\n\r\r\n");
                 if (ptr) {
                     stream_offset = (ptr+6) - client->refbuf->data;
                     break;
                 }
-                ptr = strstr(client->refbuf->data, "\r\n\r\n");
+                ptr = strstr(scan, "\r\n\r\n");
                 if (ptr) {
                     stream_offset = (ptr+4) - client->refbuf->data;
                     break;
                 }
-                ptr = strstr(client->refbuf->data, "\n\n");
+                ptr = strstr(scan, "\n\n");
                 if (ptr) {
                     stream_offset = (ptr+2) - client->refbuf->data;
                     break;
                 }
                 pass_it = 0;
+                node->scanned = node->offset;
             } while (0);
 
             ICECAST_LOG_DDEBUG("pass_it=%i, len=%i", pass_it, (int)len);
@@ -514,38 +900,56 @@ static void process_request_queue (void)
                     connection_read_put_back(client->con, client->refbuf->data + stream_offset, node->offset - stream_offset);
                     node->offset = stream_offset;
                 }
-                if ((client_queue_t **)_req_queue_tail == &(node->next))
-                    _req_queue_tail = (volatile client_queue_t **)node_ref;
+                if (node->queued) {
+                    fastevent_emit(FASTEVENT_TYPE_CLIENT_REQUEST_QUEUED, FASTEVENT_FLAG_NONE, FASTEVENT_DATATYPE_OT, client, histogram_time() - node->queued);
+                    node->queued = 0;
+                }
+                if ((client_queue_t **)lane->req_queue_tail == &(node->next))
+                    lane->req_queue_tail = (volatile client_queue_t **)node_ref;
                 *node_ref = node->next;
                 node->next = NULL;
+                _stop_waiting(node);
                 _add_connection(node);
                 continue;
             }
         } else {
             if (len == 0 || client->con->error) {
-                if ((client_queue_t **)_req_queue_tail == &node->next)
-                    _req_queue_tail = (volatile client_queue_t **)node_ref;
+                if ((client_queue_t **)lane->req_queue_tail == &node->next)
+                    lane->req_queue_tail = (volatile client_queue_t **)node_ref;
                 *node_ref = node->next;
+                _stop_waiting(node);
                 client_destroy(client);
                 free(node);
                 continue;
             }
+            /* nothing to read, clients that got data are tried again */
+            if (_wait_for_data(node, client->con->con_time + timeout) == 0) {
+                if ((client_queue_t **)lane->req_queue_tail == &node->next)
+                    lane->req_queue_tail = (volatile client_queue_t **)node_ref;
+                *node_ref = node->next;
+                node->next = NULL;
+                continue;
+            }
         }
         node_ref = &node->next;
     }
-    _handle_connection();
+    if (lane != &_main_lane || !_request_workers_count)
+        _handle_connection(lane);
 }
 
 /* add client to body queue.
  */
 static void _add_body_client(client_queue_t *node)
 {
+    request_lane_t *lane = node->lane;
+
     ICECAST_LOG_DEBUG("Putting client %p in body queue.", node->client);
 
-    thread_spin_lock(&_connection_lock);
-    *_body_queue_tail = node;
-    _body_queue_tail = (volatile client_queue_t **) &node->next;
-    thread_spin_unlock(&_connection_lock);
+    node->body = 1;
+    thread_spin_lock(&lane->body_queue_lock);
+    *lane->body_queue_tail = node;
+    lane->body_queue_tail = (volatile client_queue_t **) &node->next;
+    thread_spin_unlock(&lane->body_queue_lock);
 }
 
 static client_slurp_result_t process_request_body_queue_one(client_queue_t *node, time_t timeout, size_t body_size_limit)
@@ -585,20 +989,33 @@ static client_slurp_result_t process_request_body_queue_one(client_queue_t *node
         return res;
 }
 
-/* This queue reads data from the body of clients. */
-static void process_request_body_queue (void)
+/* This queue reads data from the body of clients. The request workers add
+ * to it as well, so the queue is taken as a whole and what is left of it is
+ * put back in front of the clients added in the meantime.
+ */
+static void process_request_body_queue (request_lane_t *lane)
 {
-    client_queue_t **node_ref = (client_queue_t **)&_body_queue;
+    client_queue_t *queue;
+    client_queue_t **node_ref = &queue;
     ice_config_t *config;
     time_t timeout;
+    int body_timeout;
     size_t body_size_limit;
 
     ICECAST_LOG_DDEBUG("Processing body queue.");
 
-    ICECAST_LOG_DDEBUG("_body_queue=%p, &_body_queue=%p, _body_queue_tail=%p", _body_queue, &_body_queue, _body_queue_tail);
+    thread_spin_lock(&lane->body_queue_lock);
+    queue = (client_queue_t *)lane->body_queue;
+    lane->body_queue = NULL;
+    lane->body_queue_tail = &lane->body_queue;
+    thread_spin_unlock(&lane->body_queue_lock);
+
+    if (!queue)
+        return;
 
     config = config_get_config();
-    timeout = time(NULL) - config->body_timeout;
+    body_timeout = config->body_timeout;
+    timeout = coarsetime_get() - body_timeout;
     body_size_limit = config->body_size_limit;
     config_release_config();
 
@@ -606,6 +1023,7 @@ static void process_request_body_queue (void)
         client_queue_t *node = *node_ref;
         client_t *client = node->client;
         client_slurp_result_t res;
+        size_t body_read = client->request_body_read;
 
         node->tried_body = 1;
 
@@ -616,24 +1034,95 @@ static void process_request_body_queue (void)
         if (res != CLIENT_SLURP_NEEDS_MORE_DATA) {
             ICECAST_LOG_DEBUG("Putting client %p back in connection queue.", client);
 
-            if ((client_queue_t **)_body_queue_tail == &(node->next))
-                _body_queue_tail = (volatile client_queue_t **)node_ref;
             *node_ref = node->next;
             node->next = NULL;
+            node->body = 0;
+            _stop_waiting(node);
             _add_connection(node);
             continue;
         }
+
+        if (client->request_body_read == body_read && _wait_for_data(node, client->con->con_time + body_timeout) == 0) {
+            *node_ref = node->next;
+            node->next = NULL;
+            continue;
+        }
         node_ref = &node->next;
     }
+
+    if (queue) {
+        thread_spin_lock(&lane->body_queue_lock);
+        *node_ref = (client_queue_t *)lane->body_queue;
+        if (lane->body_queue == NULL)
+            lane->body_queue_tail = (volatile client_queue_t **)node_ref;
+        lane->body_queue = queue;
+        thread_spin_unlock(&lane->body_queue_lock);
+    }
 }
 
 /* add node to the queue of requests. This is where the clients are when
- * initial http details are read.
+ * initial http details are read. Only the thread of the lane adds to it,
+ * the request workers and other threads go through _add_accept_queue().
  */
 static void _add_request_queue(client_queue_t *node)
 {
-    *_req_queue_tail = node;
-    _req_queue_tail = (volatile client_queue_t **)&node->next;
+    request_lane_t *lane = node->lane;
+
+    *lane->req_queue_tail = node;
+    lane->req_queue_tail = (volatile client_queue_t **)&node->next;
+}
+
+/* put clients back in their queue that have data or have timed out */
+static void _wake_clients(request_lane_t *lane)
+{
+    timerwheel_entry_t *entry;
+    ssize_t ret, i;
+
+    if (!lane->wait_poll)
+        return;
+
+    ret = fdpoll_wait(lane->wait_poll, 0, lane->wait_results, CONNECTION_WAIT_EVENTS);
+    for (i = 0; i < ret; i++) {
+        client_queue_t *node = lane->wait_results[i].userdata;
+
+        /* still in a queue, it is tried anyway */
+        if (!timerwheel_is_added(&(node->timer)))
+            continue;
+
+        timerwheel_remove(lane->wait_timers, &(node->timer));
+        if (node->body) {
+            _add_body_client(node);
+        } else {
+            _add_request_queue(node);
+        }
+    }
+
+    while ((entry = timerwheel_expire(lane->wait_timers, coarsetime_get()))) {
+        client_queue_t *node = NODE_OF_TIMER(entry);
+
+        if (node->body) {
+            _add_body_client(node);
+        } else {
+            _add_request_queue(node);
+        }
+    }
+}
+
+/* the lane of the listen socket con was accepted on */
+static request_lane_t *_lane_of(connection_t *con)
+{
+    const listener_t *listener;
+    request_lane_t *lane = &_main_lane;
+
+    if (!con->listensocket_real)
+        return lane;
+
+    listener = listensocket_get_listener(con->listensocket_real);
+    if (listener && listener->dedicated_thread)
+        lane = &_dedicated_lane;
+    listensocket_release_listener(con->listensocket_real);
+
+    return lane;
 }
 
 static client_queue_t *create_client_node(client_t *client)
@@ -645,10 +1134,15 @@ static client_queue_t *create_client_node(client_t *client)
         return NULL;
 
     node->client = client;
+    node->lane = _lane_of(client->con);
+    if (fastevent_active(FASTEVENT_TYPE_CLIENT_REQUEST_QUEUED))
+        node->queued = histogram_time();
 
     listener = listensocket_get_listener(client->con->listensocket_effective);
 
-    if (listener) {
+    if (client->con->local) {
+        client->con->tlsmode = ICECAST_TLSMODE_DISABLED;
+    } else if (listener) {
         if (listener->shoutcast_compat)
             node->shoutcast = 1;
         client->con->tlsmode = listener->tls;
@@ -680,7 +1174,7 @@ void connection_queue(connection_t *con)
     /* setup client for reading incoming http */
     client->refbuf->data[PER_CLIENT_REFBUF_SIZE-1] = '\000';
 
-    if (sock_set_blocking(client->con->sock, 0) || sock_set_nodelay(client->con->sock)) {
+    if (sock_set_blocking(client->con->sock, 0) || (!con->local && sock_set_nodelay(client->con->sock))) {
         global_unlock();
         ICECAST_LOG_WARN("Failed to set tcp options on client connection, dropping");
         client_destroy(client);
@@ -694,36 +1188,240 @@ void connection_queue(connection_t *con)
         return;
     }
 
-    _add_request_queue(node);
-    stats_event_inc(NULL, "connections");
+    _add_accept_queue(node);
+    stats_global_inc(STATS_GLOBAL_CONNECTIONS);
+}
+
+/* the accept threads besides the main one, each on their own sockets */
+static void *_accept_thread(void *arg)
+{
+    size_t shard = (size_t)(uintptr_t)arg;
+    connection_t *con;
+
+    affinity_apply(CPU_AFFINITY_ACCEPT);
+
+    ICECAST_LOG_DEBUG("Accept thread %zu started", shard);
+
+    while (global.running == ICECAST_RUNNING) {
+        con = listensocket_container_accept_shard(global.listensockets, shard, 300);
+        if (con)
+            connection_queue(con);
+    }
+
+    ICECAST_LOG_DEBUG("Accept thread %zu stopped", shard);
+
+    return NULL;
+}
+
+/* A request worker, it handles clients from the connection queue as they
+ * are added. Each client is in one queue at a time, so its requests are
+ * still handled in order.
+ */
+static void *_request_worker(void *arg)
+{
+    (void)arg;
+
+    affinity_apply(CPU_AFFINITY_CONNECTION);
+
+    waitlock_lock(&_request_workers_lock);
+    while (_request_workers_running) {
+        if (!_main_lane.con_queue) {
+            waitcond_wait(&_request_workers_cond, &_request_workers_lock);
+            continue;
+        }
+        waitlock_unlock(&_request_workers_lock);
+        _handle_connection(&_main_lane);
+        waitlock_lock(&_request_workers_lock);
+    }
+    waitlock_unlock(&_request_workers_lock);
+
+    return NULL;
+}
+
+static void _request_workers_start(void)
+{
+    ice_config_t *config;
+    unsigned int workers;
+    unsigned int i;
+
+    config = config_get_config();
+    workers = config->request_workers;
+    config_release_config();
+
+    if (!workers)
+        return;
+
+    _request_workers = calloc(workers, sizeof(*_request_workers));
+    if (!_request_workers) {
+        ICECAST_LOG_ERROR("Can not allocate request workers, handling requests on the main thread");
+        return;
+    }
+
+    waitlock_lock(&_request_workers_lock);
+    _request_workers_running = 1;
+    waitlock_unlock(&_request_workers_lock);
+
+    for (i = 0; i < workers; i++) {
+        _request_workers[i] = thread_create("Request Worker", _request_worker, NULL, THREAD_ATTACHED);
+        if (!_request_workers[i]) {
+            ICECAST_LOG_ERROR("Can not start request worker %u", i);
+            break;
+        }
+        _request_workers_count++;
+    }
+
+    stats_event_args(NULL, "request_workers", "%u", _request_workers_count);
+    ICECAST_LOG_INFO("%u request workers started", _request_workers_count);
+}
+
+static void _request_workers_stop(void)
+{
+    unsigned int count = _request_workers_count;
+
+    if (!_request_workers)
+        return;
+
+    waitlock_lock(&_request_workers_lock);
+    _request_workers_running = 0;
+    waitcond_broadcast(&_request_workers_cond);
+    waitlock_unlock(&_request_workers_lock);
+
+    while (count)
+        thread_join(_request_workers[--count]);
+    free(_request_workers);
+    _request_workers = NULL;
+    _request_workers_count = 0;
+    stats_event(NULL, "request_workers", NULL);
+
+    /* clients queued while the workers stopped */
+    _handle_connection(&_main_lane);
+}
+
+/* if nothing is queued or waiting for data in lane */
+static inline int _lane_idle(request_lane_t *lane)
+{
+    return lane->req_queue == NULL && lane->accept_queue == NULL && lane->body_queue == NULL &&
+        (!lane->wait_timers || timerwheel_count(lane->wait_timers) == 0);
+}
+
+static void _process_lane(request_lane_t *lane)
+{
+    _wake_clients(lane);
+    process_request_queue(lane);
+    process_request_body_queue(lane);
+}
+
+/* The thread of the dedicated lane. It accepts on the listen sockets with
+ * <dedicated-thread> and does everything for their requests that the main
+ * thread and the request workers do for the others.
+ */
+static void *_dedicated_lane_thread(void *arg)
+{
+    request_lane_t *lane = arg;
+    connection_t *con;
+    int duration = 100;
+
+    affinity_apply(CPU_AFFINITY_CONNECTION);
+
+    ICECAST_LOG_DEBUG("Dedicated request thread started");
+
+    while (global.running == ICECAST_RUNNING) {
+        con = listensocket_container_accept_dedicated(global.listensockets, duration);
+        if (con)
+            connection_queue(con);
+
+        /* clients waiting for data are only checked between accepts */
+        duration = _lane_idle(lane) ? 100 : 10;
+        _process_lane(lane);
+    }
+
+    ICECAST_LOG_DEBUG("Dedicated request thread stopped");
+
+    return NULL;
+}
+
+/* Nothing new is accepted any more, give the requests and file downloads
+ * in progress up to <shutdown-drain> to complete while the sources stop. */
+static void connection_drain(void)
+{
+    ice_config_t *config;
+    uint64_t deadline;
+
+    config = config_get_config();
+    deadline = timing_get_time() + (uint64_t)config->shutdown_drain * 1000;
+    config_release_config();
+
+    while (timing_get_time() < deadline)
+    {
+        if (_main_lane.req_queue == NULL && _main_lane.body_queue == NULL &&
+                _dedicated_lane.req_queue == NULL && _dedicated_lane.body_queue == NULL && !fserve_busy())
+            break;
+        _process_lane(&_main_lane);
+        _process_lane(&_dedicated_lane);
+        global_sleep(50);
+    }
 }
 
 void connection_accept_loop(void)
 {
     connection_t *con;
     ice_config_t *config;
+    thread_type **threads = NULL;
+    size_t i;
     int duration = 300;
 
+    /* the accept threads started below pin themselves again */
+    affinity_apply(CPU_AFFINITY_CONNECTION);
+
     config = config_get_config();
     get_tls_certificate(config);
     config_release_config();
 
+    if (_accept_threads > 1)
+        threads = calloc(_accept_threads - 1, sizeof(*threads));
+    for (i = 1; threads && i < _accept_threads; i++)
+        threads[i - 1] = thread_create("Accept Thread", _accept_thread, (void *)(uintptr_t)i, THREAD_ATTACHED);
+
+    _request_workers_start();
+    _dedicated_thread = thread_create("Dedicated Request Thread", _dedicated_lane_thread, &_dedicated_lane, THREAD_ATTACHED);
+
     while (global.running == ICECAST_RUNNING) {
+        /* the other accept threads, the request workers, and the threads
+         * done with the response on a kept alive connection, queue clients
+         * for us to read */
+        if ((threads || _request_workers_count || atomic_uint_load(&_keepalive_requests) > 1) && duration > 50)
+            duration = 50;
+
         con = listensocket_container_accept(global.listensockets, duration);
 
         if (con) {
             connection_queue(con);
             duration = 5;
         } else {
-            if (_req_queue == NULL)
+            if (_lane_idle(&_main_lane) && tlshandshake_count() == 0)
                 duration = 300; /* use longer timeouts when nothing waiting */
         }
-        process_request_queue();
-        process_request_body_queue();
+        _process_lane(&_main_lane);
+    }
+
+    for (i = 1; threads && i < _accept_threads; i++) {
+        if (threads[i - 1])
+            thread_join(threads[i - 1]);
+    }
+    free(threads);
+
+    /* its clients are drained by this thread along with the others */
+    if (_dedicated_thread) {
+        thread_join(_dedicated_thread);
+        _dedicated_thread = NULL;
     }
 
     /* Give all the other threads notification to shut down */
     thread_cond_broadcast(&global.shutdown_cond);
+    global_wake();
+
+    connection_drain();
+    _request_workers_stop();
 
     /* wait for all the sources to shutdown */
     thread_rwlock_wlock(&_source_shutdown_rwlock);
@@ -794,6 +1492,7 @@ int connection_complete_source(source_t *source, int response)
         global_unlock();
 
         source->running = 1;
+        source_fallback_changed();
         mountinfo = config_find_mount(config, source->mount, MOUNT_TYPE_NORMAL);
         source_update_settings(config, source, mountinfo);
         config_release_config();
@@ -848,7 +1547,14 @@ static inline void source_startup(client_t *client)
             ssize_t ret;
 
             transfer_encoding = httpp_getvar(source->parser, "transfer-encoding");
-            if (transfer_encoding && strcasecmp(transfer_encoding, HTTPP_ENCODING_IDENTITY) != 0) {
+            if (transfer_encoding && strcasecmp(transfer_encoding, "chunked") == 0) {
+                /* the common case gets decoded in place */
+                client->chunked = chunked_new();
+                if (!client->chunked) {
+                    client_send_error_by_id(client, ICECAST_ERROR_GEN_MEMORY_EXHAUSTED);
+                    return;
+                }
+            } else if (transfer_encoding && strcasecmp(transfer_encoding, HTTPP_ENCODING_IDENTITY) != 0) {
                 client->encoding = httpp_encoding_new(transfer_encoding);
                 if (!client->encoding) {
                     client_send_error_by_id(client, ICECAST_ERROR_CON_UNIMPLEMENTED);
@@ -919,7 +1625,7 @@ static void _handle_source_request(client_t *client)
 
 static void _handle_stats_request(client_t *client)
 {
-    stats_event_inc(NULL, "stats_connections");
+    stats_global_inc(STATS_GLOBAL_STATS_CONNECTIONS);
 
     client->respcode = 200;
     snprintf (client->refbuf->data, PER_CLIENT_REFBUF_SIZE,
@@ -935,20 +1641,38 @@ static void __add_listener_to_source(source_t *source, client_t *client)
 {
     size_t loop = 10;
 
+    /* a server of the cluster with less load takes the listener instead */
+    if (cluster_redirect(source, client) == 0)
+        return;
+
+    /* a fallback would not take less memory */
+    if (memgov_admit() != 0) {
+        client_send_error_by_id(client, ICECAST_ERROR_SOURCE_LOW_MEMORY);
+        return;
+    }
+
     do {
+        /* listeners queued but not yet added count against the limit as well,
+         * the source does the final check when it adds them */
+        unsigned long listeners = source->listeners + atomic_uint_load(&source->pending_count);
+        icecast_error_id_t error;
+
         ICECAST_LOG_DEBUG("max on %s is %ld (cur %lu)", source->mount,
-            source->max_listeners, source->listeners);
-        if (source->max_listeners == -1)
-            break;
-        if (source->listeners < (unsigned long)source->max_listeners)
+            source->max_listeners, listeners);
+        if (source->max_listeners != -1 && listeners >= (unsigned long)source->max_listeners) {
+            error = ICECAST_ERROR_SOURCE_MAX_LISTENERS;
+        } else if (source_egress_admit(source) != 0) {
+            error = ICECAST_ERROR_SOURCE_MAX_BANDWIDTH;
+        } else {
             break;
+        }
 
         if (loop && source->fallback_when_full && source->fallback_mount) {
             source_t *next = source_find_mount (source->fallback_mount);
             if (!next) {
                 ICECAST_LOG_ERROR("Fallback '%s' for full source '%s' not found",
                     source->mount, source->fallback_mount);
-                client_send_error_by_id(client, ICECAST_ERROR_SOURCE_MAX_LISTENERS);
+                client_send_error_by_id(client, error);
                 return;
             }
             ICECAST_LOG_INFO("stream full, trying %s", next->mount);
@@ -958,7 +1682,7 @@ static void __add_listener_to_source(source_t *source, client_t *client)
             continue;
         }
         /* now we fail the client */
-        client_send_error_by_id(client, ICECAST_ERROR_SOURCE_MAX_LISTENERS);
+        client_send_error_by_id(client, error);
         return;
     } while (1);
 
@@ -968,9 +1692,7 @@ static void __add_listener_to_source(source_t *source, client_t *client)
     memset(client->refbuf->data, 0, PER_CLIENT_REFBUF_SIZE);
 
     /* lets add the client to the active list */
-    avl_tree_wlock(source->pending_tree);
-    avl_insert(source->pending_tree, client);
-    avl_tree_unlock(source->pending_tree);
+    source_add_pending(source, client);
 
     if (source->running == 0 && source->on_demand) {
         /* enable on-demand relay to start, wake up the slave thread */
@@ -980,39 +1702,10 @@ static void __add_listener_to_source(source_t *source, client_t *client)
     ICECAST_LOG_DEBUG("Added client to %s", source->mount);
 }
 
-/* count the number of clients on a mount with same username and same role as the given one */
+/* count the number of clients on a mount with same username and same role as the given one.
+ * Listeners queued for the source are not seen until the source added them. */
 static inline ssize_t __count_user_role_on_mount (source_t *source, client_t *client) {
-    ssize_t ret = 0;
-    avl_node *node;
-
-    avl_tree_rlock(source->client_tree);
-    node = avl_get_first(source->client_tree);
-    while (node) {
-        client_t *existing_client = (client_t *)node->key;
-        if (existing_client->username && client->username &&
-            strcmp(existing_client->username, client->username) == 0 &&
-            existing_client->role && client->role &&
-            strcmp(existing_client->role, client->role) == 0) {
-            ret++;
-        }
-        node = avl_get_next(node);
-    }
-    avl_tree_unlock(source->client_tree);
-
-    avl_tree_rlock(source->pending_tree);
-    node = avl_get_first(source->pending_tree);
-    while (node) {
-        client_t *existing_client = (client_t *)node->key;
-        if (existing_client->username && client->username &&
-            strcmp(existing_client->username, client->username) == 0 &&
-            existing_client->role && client->role &&
-            strcmp(existing_client->role, client->role) == 0){
-            ret++;
-        }
-        node = avl_get_next(node);
-    }
-    avl_tree_unlock(source->pending_tree);
-    return ret;
+    return source_count_user(source, client->username, client->role);
 }
 
 static void _handle_get_request(client_t *client) {
@@ -1026,7 +1719,7 @@ static void _handle_get_request(client_t *client) {
      * fserve clients, which are looking for static files.
      */
 
-    stats_event_inc(NULL, "client_connections");
+    stats_global_inc(STATS_GLOBAL_CLIENT_CONNECTIONS);
 
     /* this is a web/ request. let's check if we are allowed to do that. */
     if (acl_test_web(client->acl) != ACL_POLICY_ALLOW) {
@@ -1086,8 +1779,36 @@ static void _handle_get_request(client_t *client) {
         } while (0);
         avl_tree_unlock(global.source_tree);
     } else {
-        /* file */
+        char *hls_mount;
+
         avl_tree_unlock(global.source_tree);
+
+        /* the playlist and segments of a mount are subject to its limits */
+        if ((hls_mount = hls_get_mount(client->uri))) {
+            icecast_error_id_t error = ICECAST_ERROR_FSERV_FILE_NOT_FOUND;
+            int allowed = 0;
+
+            avl_tree_rlock(global.source_tree);
+            source = source_find_mount_raw(hls_mount);
+            if (source) {
+                if (!source->allow_direct_access) {
+                    error = ICECAST_ERROR_CON_MOUNT_NO_FOR_DIRECT_ACCESS;
+                } else if (source->max_listeners != -1 && source->listeners >= (unsigned long)source->max_listeners) {
+                    error = ICECAST_ERROR_SOURCE_MAX_LISTENERS;
+                } else {
+                    allowed = 1;
+                }
+            }
+            avl_tree_unlock(global.source_tree);
+            free(hls_mount);
+
+            if (!allowed) {
+                client_send_error_by_id(client, error);
+                return;
+            }
+        }
+
+        /* file */
         fserve_client_create(client);
     }
 }
@@ -1153,9 +1874,11 @@ static void _handle_shoutcast_compatible(client_queue_t *node)
         config_release_config();
         node->offset -= (headers - client->refbuf->data);
         memmove(client->refbuf->data, headers, node->offset+1);
+        node->scanned = 0;
         node->shoutcast = 2;
-        /* we've checked the password, now send it back for reading headers */
-        _add_request_queue(node);
+        /* we've checked the password, now send it back for reading headers,
+         * this may run on a request worker */
+        _add_accept_queue(node);
         ICECAST_LOG_DDEBUG("Client %p re-added to request queue", client);
         return;
     }
@@ -1312,7 +2035,7 @@ static void _handle_admin_request(client_t *client, char *adminuri)
 {
     ICECAST_LOG_DEBUG("Client %p requesting admin interface.", client);
 
-    stats_event_inc(NULL, "client_connections");
+    stats_global_inc(STATS_GLOBAL_CLIENT_CONNECTIONS);
 
     admin_handle_request(client, adminuri);
 }
@@ -1424,9 +2147,12 @@ static void _handle_authentication_mount_generic(client_t *client, void *userdat
     ice_config_t *config;
     mount_proxy *mountproxy;
     auth_stack_t *stack = NULL;
+    /* the playlist and segments of a mount are authed as the mount */
+    char *hls_mount = hls_get_mount(client->uri);
 
     config = config_get_config();
-    mountproxy = __find_non_admin_mount(config, client->uri, type);
+    mountproxy = __find_non_admin_mount(config, hls_mount ? hls_mount : client->uri, type);
+    free(hls_mount);
     if (!mountproxy) {
         int command_type = admin_get_command_type(client->admin_command);
         if (command_type == ADMINTYPE_MOUNT || command_type == ADMINTYPE_HYBRID) {
@@ -1586,14 +2312,14 @@ static int _update_admin_command(client_t *client)
  * the contents provided. We set up the parser then hand off to the specific
  * request handler.
  */
-static void _handle_connection(void)
+static void _handle_connection(request_lane_t *lane)
 {
     http_parser_t *parser;
     const char *rawuri;
     client_queue_t *node;
 
     while (1) {
-        node = _get_connection();
+        node = _get_connection(lane);
         if (node) {
             client_t *client = node->client;
             int already_parsed = 0;
@@ -1731,6 +2457,8 @@ static void __on_sock_count(size_t count, void *userdata)
 /* called when listening thread is not checking for incoming connections */
 void connection_setup_sockets (ice_config_t *config)
 {
+    ssize_t ret;
+
     global_lock();
     refobject_unref(global.listensockets);
 
@@ -1757,7 +2485,11 @@ void connection_setup_sockets (ice_config_t *config)
 
     global_unlock();
 
+    atomic_uint_store(&_keepalive_requests, config->keepalive_requests);
+
     listensocket_container_set_sockcount_cb(global.listensockets, __on_sock_count, NULL);
+    ret = listensocket_container_set_accept_threads(global.listensockets, config->accept_threads);
+    _accept_threads = ret > 0 ? (size_t)ret : 1;
     listensocket_container_setup(global.listensockets);;
 }
 
@@ -1774,13 +2506,15 @@ void connection_close(connection_t *con)
     tls_unref(con->tls);
     if (con->sock != SOCK_ERROR)
         sock_close(con->sock);
+    if (con->iplimited)
+        iplimit_release(con->listensocket_real, con->ip);
     if (con->ip)
         free(con->ip);
     if (con->readbuffer)
         free(con->readbuffer);
     refobject_unref(con->listensocket_real);
     refobject_unref(con->listensocket_effective);
-    free(con);
+    objpool_release(&_connection_pool, con);
 }
 
 void connection_queue_client(client_t *client)
@@ -1788,3 +2522,29 @@ void connection_queue_client(client_t *client)
     client_queue_t *node = create_client_node(client);
     _add_connection(node);
 }
+
+void connection_queue_keepalive(client_t *client)
+{
+    client_queue_t *node = calloc(1, sizeof(client_queue_t));
+
+    if (!node) {
+        client->reuse = ICECAST_REUSE_CLOSE;
+        client_destroy(client);
+        return;
+    }
+
+    /* the listen socket settings were applied to the connection with its
+     * first request, the TLS session is kept */
+    node->client = client;
+    node->lane = _lane_of(client->con);
+    node->handshake = client->con->tls != NULL;
+    if (fastevent_active(FASTEVENT_TYPE_CLIENT_REQUEST_QUEUED))
+        node->queued = histogram_time();
+
+    _add_accept_queue(node);
+}
+
+bool connection_keepalive_allowed(connection_t *con)
+{
+    return con->requests + 1 < atomic_uint_load(&_keepalive_requests);
+}
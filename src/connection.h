@@ -16,6 +16,7 @@
 
 #include <sys/types.h>
 #include <time.h>
+#include <stdbool.h>
 
 #include "tls.h"
 
@@ -36,17 +37,27 @@ struct connection_tag {
     time_t con_time;
     /* Timestamp of when the client must be disconnected (reached listentime limit) OR 0 for no limit. */
     time_t discon_time;
+    /* Static string naming why the server disconnected the client for the access log, NULL if it did not. */
+    const char *discon_reason;
     /* Bytes sent on this connection */
     uint64_t sent_bytes;
+    /* requests handled on this connection before the current one */
+    unsigned int requests;
 
     /* Physical socket the client is connected on */
     sock_t sock;
+    /* set if the connection is counted for ip by iplimit_acquire() */
+    int iplimited;
     /* real and effective listen socket the connect used to connect. */
     listensocket_t *listensocket_real;
     listensocket_t *listensocket_effective;
 
     /* Is the connection in an error condition? */
     int error;
+    /* the socket is one end of a socket pair carrying a channel of a
+     * multiplexed relay connection, see relaymux.h. It takes no TCP options
+     * and no TLS, that is done on the connection carrying it. */
+    bool local;
 
     /* Current TLS mode and state of the client. */
     tlsmode_t tlsmode;
@@ -57,6 +68,10 @@ struct connection_tag {
      */
     int (*send)(connection_t *handle, const void *buf, size_t len);
     int (*read)(connection_t *handle, void *buf, size_t len);
+    /* Gather write, NULL if the transport can not do it (e.g. TLS) */
+    ssize_t (*sendv)(connection_t *handle, const struct iovec *iov, size_t count);
+    /* Sends straight from a file, NULL if the transport can not do it */
+    ssize_t (*sendfile)(connection_t *handle, int fd, off_t *offset, size_t len);
 
     /* Buffers for putback of data into the connection's read queue. */
     void *readbuffer;
@@ -76,9 +91,23 @@ connection_t *connection_create(sock_t sock, listensocket_t *listensocket_real,
 int connection_complete_source(source_t *source, int response);
 void connection_queue(connection_t *con);
 void connection_queue_client(client_t *client);
+/* Queues a client that was reset for the next request on its connection,
+ * it waits for it up to <keepalive-timeout> seconds. */
+void connection_queue_keepalive(client_t *client);
+/* whether the response to the current request may keep the connection open,
+ * see <keepalive-requests> */
+bool connection_keepalive_allowed(connection_t *con);
 void connection_uses_tls(connection_t *con);
 
 ssize_t connection_send_bytes(connection_t *con, const void *buf, size_t len);
+ssize_t connection_send_vector(connection_t *con, const struct iovec *iov, size_t count);
+/* The socket to send to for sends made outside of the connection, like
+ * with io_uring, SOCK_ERROR if they have to go through it (e.g. TLS). The
+ * result of such a send, bytes or -errno, is passed to
+ * connection_sent_on_socket(). */
+sock_t connection_get_plain_socket(connection_t *con);
+void connection_sent_on_socket(connection_t *con, ssize_t ret);
+ssize_t connection_send_file(connection_t *con, int fd, off_t *offset, size_t len);
 ssize_t connection_read_bytes(connection_t *con, void *buf, size_t len);
 int connection_read_put_back(connection_t *con, const void *buf, size_t len);
 
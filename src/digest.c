@@ -16,6 +16,15 @@
 #include <string.h>
 #include <stdlib.h>
 
+#ifdef HAVE_OPENSSL
+#include <openssl/opensslv.h>
+/* SHA3 is available since 1.1.1 */
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+#include <openssl/evp.h>
+#define DIGEST_USE_EVP
+#endif
+#endif
+
 #include "digest.h"
 #include "md5.h"
 
@@ -31,6 +40,11 @@ struct digest_tag {
 
     /* state */
     int done;
+#ifdef DIGEST_USE_EVP
+    /* If set the state is kept by OpenSSL which picks the best implementation
+     * for the CPU at runtime, and the union below is unused. */
+    EVP_MD_CTX *evp;
+#endif
     union {
         struct MD5Context md5;
         struct {
@@ -64,7 +78,21 @@ static void __hmac_free(refobject_t self, void **userdata)
     refobject_unref(hmac->inner);
 }
 
-REFOBJECT_DEFINE_TYPE(digest_t);
+static void __digest_free(refobject_t self, void **userdata)
+{
+#ifdef DIGEST_USE_EVP
+    digest_t *digest = REFOBJECT_TO_TYPE(self, digest_t *);
+
+    if (digest->evp)
+        EVP_MD_CTX_free(digest->evp);
+#else
+    (void)self;
+#endif
+}
+
+REFOBJECT_DEFINE_TYPE(digest_t,
+        REFOBJECT_DEFINE_TYPE_FREE(__digest_free)
+        );
 REFOBJECT_DEFINE_TYPE(hmac_t,
         REFOBJECT_DEFINE_TYPE_FREE(__hmac_free)
         );
@@ -323,6 +351,53 @@ static inline size_t sha3_read(digest_t *digest, void *buf, size_t len)
     return len;
 }
 
+#ifdef DIGEST_USE_EVP
+static EVP_MD_CTX *digest_evp_new(digest_algo_t algo)
+{
+    const EVP_MD *md = NULL;
+    EVP_MD_CTX *ctx;
+
+    switch (algo) {
+        case DIGEST_ALGO_MD5: md = EVP_md5(); break;
+        case DIGEST_ALGO_SHA3_224: md = EVP_sha3_224(); break;
+        case DIGEST_ALGO_SHA3_256: md = EVP_sha3_256(); break;
+        case DIGEST_ALGO_SHA3_384: md = EVP_sha3_384(); break;
+        case DIGEST_ALGO_SHA3_512: md = EVP_sha3_512(); break;
+    }
+
+    if (!md)
+        return NULL;
+
+    ctx = EVP_MD_CTX_new();
+    if (!ctx)
+        return NULL;
+
+    /* This fails e.g. for MD5 when OpenSSL is restricted to FIPS algorithms,
+     * in that case our own implementation is used. */
+    if (EVP_DigestInit_ex(ctx, md, NULL) != 1) {
+        EVP_MD_CTX_free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+static ssize_t digest_evp_read(digest_t *digest, void *buf, size_t len)
+{
+    unsigned char buffer[EVP_MAX_MD_SIZE];
+    unsigned int buffer_len = 0;
+
+    if (EVP_DigestFinal_ex(digest->evp, buffer, &buffer_len) != 1)
+        return -1;
+
+    if (len > buffer_len)
+        len = buffer_len;
+
+    memcpy(buf, buffer, len);
+
+    return len;
+}
+#endif
 
 const char *digest_algo_id2str(digest_algo_t algo)
 {
@@ -378,6 +453,13 @@ digest_t * digest_new(digest_algo_t algo)
         return NULL;
 
     digest->algo = algo;
+
+#ifdef DIGEST_USE_EVP
+    digest->evp = digest_evp_new(algo);
+    if (digest->evp)
+        return digest;
+#endif
+
     switch (algo) {
         case DIGEST_ALGO_MD5:
             MD5Init(&(digest->state.md5));
@@ -411,8 +493,23 @@ digest_t *  digest_copy(digest_t *digest)
         return NULL;
 
     n = refobject_new__new(digest_t, NULL, NULL, NULL);
+    if (!n)
+        return NULL;
+
     n->algo = digest->algo;
     n->done = digest->done;
+
+#ifdef DIGEST_USE_EVP
+    if (digest->evp) {
+        n->evp = EVP_MD_CTX_new();
+        if (!n->evp || EVP_MD_CTX_copy_ex(n->evp, digest->evp) != 1) {
+            refobject_unref(n);
+            return NULL;
+        }
+        return n;
+    }
+#endif
+
     n->state = digest->state;
 
     return n;
@@ -426,6 +523,14 @@ ssize_t digest_write(digest_t *digest, const void *data, size_t len)
     if (digest->done)
         return -1;
 
+#ifdef DIGEST_USE_EVP
+    if (digest->evp) {
+        if (EVP_DigestUpdate(digest->evp, data, len) != 1)
+            return -1;
+        return len;
+    }
+#endif
+
     switch (digest->algo) {
         case DIGEST_ALGO_MD5:
             MD5Update(&(digest->state.md5), (const unsigned char *)data, len);
@@ -454,6 +559,11 @@ ssize_t digest_read(digest_t *digest, void *buf, size_t len)
 
     digest->done = 1;
 
+#ifdef DIGEST_USE_EVP
+    if (digest->evp)
+        return digest_evp_read(digest, buf, len);
+#endif
+
     switch (digest->algo) {
         case DIGEST_ALGO_MD5:
             if (len < HASH_LEN) {
@@ -487,6 +597,9 @@ ssize_t digest_length_bytes(digest_t *digest)
 }
 
 
+/* largest value returned by __digest_algo_blocklength() */
+#define DIGEST_MAX_BLOCKLENGTH  144
+
 static size_t __digest_algo_blocklength(digest_algo_t algo)
 {
     switch (algo) {
@@ -505,6 +618,7 @@ hmac_t *    hmac_new(digest_algo_t algo, const void *key, size_t keylen)
     hmac_t *hmac;
     size_t blocklen = __digest_algo_blocklength(algo);
     char *keycopy = calloc(1, blocklen);
+    char pad[DIGEST_MAX_BLOCKLENGTH];
     size_t i;
 
     if (!blocklen)
@@ -547,12 +661,12 @@ hmac_t *    hmac_new(digest_algo_t algo, const void *key, size_t keylen)
         return NULL;
     }
 
-    for (i = 0; i < blocklen; i++) {
-        char x = keycopy[i] ^ 0x36;
-        if (digest_write(hmac->inner, &x, 1) != 1) {
-            refobject_unref(hmac);
-            return NULL;
-        }
+    for (i = 0; i < blocklen; i++)
+        pad[i] = keycopy[i] ^ 0x36;
+
+    if (digest_write(hmac->inner, pad, blocklen) != (ssize_t)blocklen) {
+        refobject_unref(hmac);
+        return NULL;
     }
 
     return hmac;
@@ -567,7 +681,7 @@ hmac_t *    hmac_copy(hmac_t *hmac)
 
     n = refobject_new__new(hmac_t, NULL, NULL, NULL);
     n->algo = hmac->algo;
-    n->key = malloc(n->key_len);
+    n->key = malloc(hmac->key_len);
     if (!n->key) {
         refobject_unref(n);
         return NULL;
@@ -595,6 +709,7 @@ ssize_t     hmac_read(hmac_t *hmac, void *buf, size_t len)
 {
     size_t digestlen;
     digest_t *digest;
+    char pad[DIGEST_MAX_BLOCKLENGTH];
     char *res;
     size_t i;
     ssize_t ret;
@@ -614,13 +729,13 @@ ssize_t     hmac_read(hmac_t *hmac, void *buf, size_t len)
         return -1;
     }
 
-    for (i = 0; i < hmac->key_len; i++) {
-        char x = hmac->key[i] ^ 0x5C;
-        if (digest_write(digest, &x, 1) != 1) {
-            free(res);
-            refobject_unref(digest);
-            return -1;
-        }
+    for (i = 0; i < hmac->key_len; i++)
+        pad[i] = hmac->key[i] ^ 0x5C;
+
+    if (digest_write(digest, pad, hmac->key_len) != (ssize_t)hmac->key_len) {
+        free(res);
+        refobject_unref(digest);
+        return -1;
     }
 
     if (digest_read(hmac->inner, res, digestlen) != (ssize_t)digestlen) {
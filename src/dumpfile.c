@@ -0,0 +1,276 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "common/thread/thread.h"
+
+#include "dumpfile.h"
+#include "waitlock.h"
+
+#include "logging.h"
+#define CATMODULE "dumpfile"
+
+/* most buffers and bytes waiting for the disk before new ones are dropped */
+#define DUMPFILE_QUEUE_LEN      1024
+#define DUMPFILE_QUEUE_BYTES    (4*1024*1024)
+/* the writer waits until this much is queued, but no longer than
+ * DUMPFILE_FLUSH_DELAY seconds, so the disk sees few large writes */
+#define DUMPFILE_BATCH_BYTES    (64*1024)
+#define DUMPFILE_FLUSH_DELAY    1
+/* stdio buffer, a batch is usually written with a single write(2) */
+#define DUMPFILE_BUFFER_SIZE    (256*1024)
+
+/* the time and length before the data of each read in a capture */
+#define DUMPFILE_RECORD_HEADER  12
+
+struct dumpfile_tag {
+    char *filename;
+    /* when the capture was opened, reads are timed from there */
+    struct timespec start;
+    FILE *file;
+    char *buffer;
+
+    waitlock_t lock;
+    waitcond_t wakeup;
+
+    /* all below are protected by lock. The source appends buffers at
+     * (head + count) % DUMPFILE_QUEUE_LEN, only the writer removes them. */
+    refbuf_t *queue[DUMPFILE_QUEUE_LEN];
+    size_t head;
+    size_t count;
+    size_t bytes;
+    int closing;
+    int failed;
+    int dropping;
+    uint64_t dropped;
+};
+
+static void dumpfile_free(dumpfile_t *self)
+{
+    if (self->file)
+        fclose(self->file);
+    waitcond_destroy(&self->wakeup);
+    waitlock_destroy(&self->lock);
+    free(self->buffer);
+    free(self->filename);
+    free(self);
+}
+
+static void *dumpfile_writer(void *arg)
+{
+    dumpfile_t *self = arg;
+    int failed = 0;
+    int err = 0;
+
+    waitlock_lock(&self->lock);
+    while (1) {
+        size_t head;
+        size_t count;
+        size_t bytes = 0;
+        size_t i;
+
+        if (!self->closing && self->bytes < DUMPFILE_BATCH_BYTES) {
+            struct timespec deadline;
+
+            waitcond_deadline(&deadline, DUMPFILE_FLUSH_DELAY * 1000);
+            waitcond_wait_until(&self->wakeup, &self->lock, &deadline);
+        }
+
+        if (!self->count) {
+            if (self->closing)
+                break;
+            continue;
+        }
+
+        head = self->head;
+        count = self->count;
+        waitlock_unlock(&self->lock);
+
+        for (i = 0; i < count; i++) {
+            refbuf_t *refbuf = self->queue[(head + i) % DUMPFILE_QUEUE_LEN];
+
+            if (!failed && fwrite(refbuf->data, 1, refbuf->len, self->file) != refbuf->len) {
+                failed = 1;
+                err = errno;
+            }
+            bytes += refbuf->len;
+            refbuf_release(refbuf);
+        }
+        if (!failed && fflush(self->file) != 0) {
+            failed = 1;
+            err = errno;
+        }
+
+        waitlock_lock(&self->lock);
+        if (failed && !self->failed)
+            ICECAST_LOG_WARN("Write to dump file \"%s\" failed: %s", self->filename, strerror(err));
+        self->failed = failed;
+        self->head = (head + count) % DUMPFILE_QUEUE_LEN;
+        self->count -= count;
+        self->bytes -= bytes;
+    }
+    waitlock_unlock(&self->lock);
+
+    ICECAST_LOG_DEBUG("Closing dump file \"%s\"", self->filename);
+    dumpfile_free(self);
+
+    return NULL;
+}
+
+static dumpfile_t *dumpfile_open_mode(const char *filename, const char *mode)
+{
+    dumpfile_t *self = calloc(1, sizeof(*self));
+
+    if (!self) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    waitlock_create(&self->lock);
+    waitcond_create(&self->wakeup);
+
+    self->filename = strdup(filename);
+    self->buffer = malloc(DUMPFILE_BUFFER_SIZE);
+    if (!self->filename || !self->buffer) {
+        dumpfile_free(self);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    self->file = fopen(filename, mode);
+    if (!self->file) {
+        int err = errno;
+
+        dumpfile_free(self);
+        errno = err;
+        return NULL;
+    }
+    setvbuf(self->file, self->buffer, _IOFBF, DUMPFILE_BUFFER_SIZE);
+
+    if (!thread_create("Dump File Writer", dumpfile_writer, self, THREAD_DETACHED)) {
+        dumpfile_free(self);
+        errno = EAGAIN;
+        return NULL;
+    }
+
+    return self;
+}
+
+dumpfile_t *dumpfile_open(const char *filename)
+{
+    return dumpfile_open_mode(filename, "ab");
+}
+
+int dumpfile_write(dumpfile_t *self, refbuf_t *refbuf)
+{
+    int ret = 0;
+
+    if (!refbuf->len)
+        return 0;
+
+    waitlock_lock(&self->lock);
+    if (self->failed) {
+        ret = -1;
+    } else if (self->count == DUMPFILE_QUEUE_LEN || self->bytes + refbuf->len > DUMPFILE_QUEUE_BYTES) {
+        /* the disk can not keep up, rather lose data in the file than
+         * hold up the stream */
+        if (!self->dropping)
+            ICECAST_LOG_WARN("Dump file \"%s\" is falling behind, dropping data", self->filename);
+        self->dropping = 1;
+        self->dropped++;
+    } else {
+        refbuf_addref(refbuf);
+        self->queue[(self->head + self->count) % DUMPFILE_QUEUE_LEN] = refbuf;
+        self->count++;
+        self->bytes += refbuf->len;
+        self->dropping = 0;
+        if (self->bytes >= DUMPFILE_BATCH_BYTES)
+            waitcond_signal(&self->wakeup);
+    }
+    waitlock_unlock(&self->lock);
+
+    return ret;
+}
+
+dumpfile_t *dumpfile_open_capture(const char *filename, const char *header)
+{
+    dumpfile_t *self = dumpfile_open_mode(filename, "wb");
+    size_t len = strlen(DUMPFILE_CAPTURE_MAGIC) + strlen(header) + 2;
+    refbuf_t *refbuf;
+
+    if (!self)
+        return NULL;
+
+    clock_gettime(CLOCK_MONOTONIC, &self->start);
+
+    refbuf = refbuf_new(len + 1);
+    snprintf(refbuf->data, len + 1, "%s%s\r\n", DUMPFILE_CAPTURE_MAGIC, header);
+    refbuf->len = len;
+    dumpfile_write(self, refbuf);
+    refbuf_release(refbuf);
+
+    return self;
+}
+
+int dumpfile_capture(dumpfile_t *self, const void *data, size_t len)
+{
+    struct timespec now;
+    uint64_t offset;
+    unsigned char *header;
+    refbuf_t *refbuf;
+    int ret;
+    int i;
+
+    if (!len)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    offset = (uint64_t)(now.tv_sec - self->start.tv_sec) * 1000000 + (now.tv_nsec - self->start.tv_nsec) / 1000;
+
+    refbuf = refbuf_new(DUMPFILE_RECORD_HEADER + len);
+    header = (unsigned char *)refbuf->data;
+    for (i = 0; i < 8; i++)
+        header[i] = offset >> (56 - i * 8);
+    for (i = 0; i < 4; i++)
+        header[8 + i] = (uint32_t)len >> (24 - i * 8);
+    memcpy(refbuf->data + DUMPFILE_RECORD_HEADER, data, len);
+
+    ret = dumpfile_write(self, refbuf);
+    refbuf_release(refbuf);
+
+    return ret;
+}
+
+uint64_t dumpfile_get_dropped(dumpfile_t *self)
+{
+    uint64_t ret;
+
+    waitlock_lock(&self->lock);
+    ret = self->dropped;
+    waitlock_unlock(&self->lock);
+
+    return ret;
+}
+
+void dumpfile_close(dumpfile_t *self)
+{
+    if (!self)
+        return;
+
+    waitlock_lock(&self->lock);
+    self->closing = 1;
+    waitcond_signal(&self->wakeup);
+    waitlock_unlock(&self->lock);
+}
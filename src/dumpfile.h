@@ -0,0 +1,54 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* dumpfile.h
+ *
+ * Writes the stream of a source to its <dump-file> on a thread of its own,
+ * so a slow disk can not hold up the source and its listeners. The source
+ * queues references to its buffers, the writer collects them into large
+ * writes. If the disk falls too far behind new buffers are dropped and
+ * counted instead of being queued.
+ *
+ * A capture, see <capture-file>, records the reads of a source instead, so
+ * they can be fed to a server again with the timing they came in with, see
+ * tests/loadgen.c. It starts with DUMPFILE_CAPTURE_MAGIC and the request
+ * headers describing the stream, each ending in CRLF, followed by an empty
+ * line. Each read follows as the microseconds since the capture was opened
+ * (8 bytes) and the length of the data (4 bytes), both big endian, and the
+ * data itself.
+ */
+
+#ifndef __DUMPFILE_H__
+#define __DUMPFILE_H__
+
+#include <stdint.h>
+
+#include "refbuf.h"
+
+typedef struct dumpfile_tag dumpfile_t;
+
+/* Opens filename for appending and starts the writer. Returns NULL on error
+ * with errno set. */
+dumpfile_t *dumpfile_open(const char *filename);
+#define DUMPFILE_CAPTURE_MAGIC  "ICECAST-CAPTURE/1\r\n"
+
+/* Queues refbuf, which must not change anymore, to be written. Only one
+ * thread may write to a dumpfile. Returns -1 once writing failed, the
+ * dumpfile should be closed then. */
+int         dumpfile_write(dumpfile_t *self, refbuf_t *refbuf);
+/* Creates or truncates filename for a capture, header are the request headers
+ * to record, each ending in CRLF. Returns NULL on error with errno set. */
+dumpfile_t *dumpfile_open_capture(const char *filename, const char *header);
+/* Records a read of len bytes of data. Returns -1 once writing failed, like
+ * dumpfile_write(). */
+int         dumpfile_capture(dumpfile_t *self, const void *data, size_t len);
+/* number of buffers dropped as the disk fell behind */
+uint64_t    dumpfile_get_dropped(dumpfile_t *self);
+/* Stops accepting data. The writer finishes what was queued, closes the file
+ * and frees self in the background. */
+void        dumpfile_close(dumpfile_t *self);
+
+#endif  /* __DUMPFILE_H__ */
@@ -0,0 +1,155 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "common/thread/thread.h"
+#include "common/timing/timing.h"
+
+#include "egress.h"
+#include "cfgfile.h"
+#include "stats.h"
+
+#include "logging.h"
+#define CATMODULE "egress"
+
+/* how much of a second of the limit can be sent at once after a pause */
+#define EGRESS_DEPTH_MS         250
+/* how often the rate in use is measured */
+#define EGRESS_MEASURE_MS       1000
+
+egress_t egress_global;
+static int __inited = 0;
+/* the global stats last published, protected by the lock of egress_global */
+static uint64_t published_kbitrate = UINT64_MAX;
+static uint64_t published_utilization = UINT64_MAX;
+
+void egress_initialize(void)
+{
+    ice_config_t *config;
+
+    if (__inited)
+        return;
+
+    egress_init(&egress_global);
+    __inited = 1;
+
+    config = config_get_config();
+    egress_recheck_config(config);
+    config_release_config();
+}
+
+void egress_shutdown(void)
+{
+    if (!__inited)
+        return;
+
+    __inited = 0;
+    egress_destroy(&egress_global);
+}
+
+void egress_recheck_config(ice_config_t *config)
+{
+    if (!__inited)
+        return;
+
+    egress_set_rate(&egress_global, (uint64_t)config->max_bandwidth * 1000 / 8);
+}
+
+void egress_update_global_stats(void)
+{
+    uint64_t rate = egress_get_rate(&egress_global);
+    uint64_t limit = atomic_u64_load(&egress_global.rate);
+    uint64_t kbitrate = rate * 8 / 1000;
+    /* UINT64_MAX - 1 stands for no limit */
+    uint64_t utilization = limit ? rate * 100 / limit : UINT64_MAX - 1;
+    int kbitrate_changed;
+    int utilization_changed;
+
+    thread_spin_lock(&egress_global.lock);
+    kbitrate_changed = kbitrate != published_kbitrate;
+    utilization_changed = utilization != published_utilization;
+    published_kbitrate = kbitrate;
+    published_utilization = utilization;
+    thread_spin_unlock(&egress_global.lock);
+
+    if (kbitrate_changed)
+        stats_event_args(NULL, "outgoing_kbitrate", "%" PRIu64, kbitrate);
+    if (utilization_changed) {
+        if (limit) {
+            stats_event_args(NULL, "bandwidth_utilization", "%" PRIu64, utilization);
+        } else {
+            stats_event(NULL, "bandwidth_utilization", NULL);
+        }
+    }
+}
+
+void egress_init(egress_t *egress)
+{
+    memset(egress, 0, sizeof(*egress));
+    thread_spin_create(&egress->lock);
+    egress->refilled = egress->measured_at = timing_get_time();
+}
+
+void egress_destroy(egress_t *egress)
+{
+    thread_spin_destroy(&egress->lock);
+}
+
+void egress_set_rate(egress_t *egress, uint64_t rate)
+{
+    thread_spin_lock(&egress->lock);
+    if (rate != atomic_u64_load(&egress->rate)) {
+        /* start with a full bucket */
+        atomic_u64_store(&egress->allowance, atomic_u64_load(&egress->sent) + rate * EGRESS_DEPTH_MS / 1000);
+        atomic_u64_store(&egress->rate, rate);
+        egress->refilled = timing_get_time();
+    }
+    thread_spin_unlock(&egress->lock);
+}
+
+void egress_refill(egress_t *egress, uint64_t now)
+{
+    uint64_t rate;
+    uint64_t sent;
+
+    thread_spin_lock(&egress->lock);
+    if (now <= egress->refilled) {
+        thread_spin_unlock(&egress->lock);
+        return;
+    }
+
+    rate = atomic_u64_load(&egress->rate);
+    sent = atomic_u64_load(&egress->sent);
+
+    if (rate) {
+        uint64_t allowance = atomic_u64_load(&egress->allowance) + (now - egress->refilled) * rate / 1000;
+        uint64_t depth = sent + rate * EGRESS_DEPTH_MS / 1000;
+
+        /* a pause does not save up more than the depth */
+        atomic_u64_store(&egress->allowance, allowance > depth ? depth : allowance);
+    }
+    egress->refilled = now;
+
+    if ((now - egress->measured_at) >= EGRESS_MEASURE_MS) {
+        /* a refund may take it below what was counted at the last measurement */
+        atomic_u64_store(&egress->measured_rate, sent > egress->measured_sent ? (sent - egress->measured_sent) * 1000 / (now - egress->measured_at) : 0);
+        egress->measured_at = now;
+        egress->measured_sent = sent;
+    }
+    thread_spin_unlock(&egress->lock);
+}
+
+uint64_t egress_get_rate(egress_t *egress)
+{
+    return atomic_u64_load(&egress->measured_rate);
+}
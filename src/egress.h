@@ -0,0 +1,84 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* egress.h
+ *
+ * Token buckets limiting the bytes per second sent to listeners, one for
+ * each mount with <max-bandwidth> and egress_global for the whole server.
+ * Writers check egress_allowed() before they write and count what they
+ * wrote with egress_count(), both without a lock. Writes whose result only
+ * comes later are counted in full up front and the rest given back with
+ * egress_refund(). Only egress_refill(),
+ * called by the source threads on every pass, takes the lock of a bucket.
+ * Each bucket also measures the rate it is used at, which is what the
+ * admission of new listeners and the outgoing_kbitrate statistics go by.
+ */
+
+#ifndef __EGRESS_H__
+#define __EGRESS_H__
+
+#include <stdint.h>
+
+#include "common/thread/thread.h"
+
+#include "icecasttypes.h"
+#include "atomic.h"
+
+typedef struct {
+    spin_t lock;
+    /* bytes per second, 0 for no limit */
+    volatile uint64_t rate;
+    /* bytes counted in total and bytes allowed to be sent in total, the
+     * writers may send as long as sent is below allowance */
+    volatile uint64_t sent;
+    volatile uint64_t allowance;
+    /* all below are protected by lock */
+    uint64_t refilled;
+    uint64_t measured_at;
+    uint64_t measured_sent;
+    /* bytes per second over the last measurement */
+    volatile uint64_t measured_rate;
+} egress_t;
+
+/* limits all listeners of the server, from <max-bandwidth> in <limits> */
+extern egress_t egress_global;
+
+void    egress_initialize(void);
+void    egress_shutdown(void);
+/* applies <max-bandwidth> of the server, on start and on reload */
+void    egress_recheck_config(ice_config_t *config);
+/* publishes the global outgoing_kbitrate and bandwidth_utilization, only
+ * those that changed since the last call */
+void    egress_update_global_stats(void);
+
+void    egress_init(egress_t *egress);
+void    egress_destroy(egress_t *egress);
+
+/* sets the limit in bytes per second, 0 lifts it */
+void    egress_set_rate(egress_t *egress, uint64_t rate);
+/* adds the allowance for the time passed up to now, in ms as by timing_get_time() */
+void    egress_refill(egress_t *egress, uint64_t now);
+/* measured bytes per second */
+uint64_t egress_get_rate(egress_t *egress);
+
+static inline int egress_allowed(egress_t *egress)
+{
+    return !atomic_u64_load(&egress->rate) ||
+        atomic_u64_load(&egress->sent) < atomic_u64_load(&egress->allowance);
+}
+
+static inline void egress_count(egress_t *egress, uint64_t bytes)
+{
+    atomic_u64_add(&egress->sent, bytes);
+}
+
+/* gives back what was counted before a write that then sent less */
+static inline void egress_refund(egress_t *egress, uint64_t bytes)
+{
+    atomic_u64_add(&egress->sent, (uint64_t)0 - bytes);
+}
+
+#endif  /* __EGRESS_H__ */
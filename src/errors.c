@@ -135,6 +135,12 @@ static const icecast_error_t __errors[] = {
     {.id = ICECAST_ERROR_SOURCE_MAX_LISTENERS,                          .http_status = 503,
      .uuid = "df147168-baaa-4959-82a4-746a1232927d",
      .message = "Maximum listeners reached for this source"},
+    {.id = ICECAST_ERROR_SOURCE_MAX_BANDWIDTH,                          .http_status = 503,
+     .uuid = "ba801432-7ade-4c35-b7a8-374178174ded",
+     .message = "Maximum bandwidth reached for this source"},
+    {.id = ICECAST_ERROR_SOURCE_LOW_MEMORY,                             .http_status = 503,
+     .uuid = "3f0c5a8e-6b1d-4e2a-9c47-d85a1e6b0f93",
+     .message = "Server is short of memory"},
     {.id = ICECAST_ERROR_XSLT_PARSE,                                    .http_status = 404 /* XXX */,
      .uuid = "f86b5b28-c1f8-49f6-a4cd-a18e2a6a44fd",
      .message = "Could not parse XSLT file"},
@@ -49,6 +49,8 @@ typedef enum {
     ICECAST_ERROR_SOURCE_MOUNT_UNAVAILABLE,
     ICECAST_ERROR_SOURCE_STREAM_PREPARATION_ERROR,
     ICECAST_ERROR_SOURCE_MAX_LISTENERS,
+    ICECAST_ERROR_SOURCE_MAX_BANDWIDTH,
+    ICECAST_ERROR_SOURCE_LOW_MEMORY,
     ICECAST_ERROR_XSLT_PARSE,
     ICECAST_ERROR_XSLT_problem,
     ICECAST_ERROR_RECURSIVE_ERROR
@@ -15,6 +15,7 @@
 #include <stdlib.h>
 
 #include "event.h"
+#include "waitlock.h"
 #include "event_log.h"
 #include "event_exec.h"
 #include "event_url.h"
@@ -24,13 +25,23 @@
 #include "connection.h"
 #include "client.h"
 #include "cfgfile.h"
+#include "stats.h"
 
 #define CATMODULE "event"
 
 static mutex_t event_lock;
+
+/* the queue and event_running are protected by event_queue_lock, queued
+ * events are linked through their next */
+static waitlock_t event_queue_lock = WAITLOCK_INITIALIZER;
+static waitcond_t event_queue_cond = WAITCOND_INITIALIZER;
 static event_t *event_queue = NULL;
+static event_t **event_queue_tail = &event_queue;
+static size_t event_queue_length = 0;
+static size_t event_queue_limit = 0;
 static int event_running = 0;
-static thread_type *event_thread = NULL;
+static thread_type **event_threads = NULL;
+static unsigned int event_threads_count = 0;
 
 /* work with event_t* */
 static void event_addref(event_t *event) {
@@ -72,23 +83,18 @@ static void event_release(event_t *event) {
         event_release(to_free);
 }
 
-static void event_push(event_t **event, event_t *next) {
-    size_t i = 0;
-
-    if (!event || !next)
-        return;
+/* appends the event to the queue, event_queue_lock is held */
+static int event_push(event_t *event) {
+    if (!event_running || event_queue_length >= event_queue_limit)
+        return -1;
 
-    while (*event && i < 128) {
-        event = &(*event)->next;
-        i++;
-    }
+    event->next = NULL;
+    *event_queue_tail = event;
+    event_queue_tail = &(event->next);
+    event_queue_length++;
+    stats_global_inc(STATS_GLOBAL_EVENTS_QUEUED);
 
-    if (i == 128) {
-        ICECAST_LOG_ERROR("Can not push event %p into queue. Queue is full.", event);
-        return;
-    }
-
-    *event = next;
+    return 0;
 }
 
 static void event_push_reglist(event_t *event, event_registration_t *reglist) {
@@ -164,74 +170,107 @@ static inline void _try_registrations(event_registration_t *er, event_t *event)
 }
 
 static void *event_run_thread (void *arg) {
-    int running = 0;
-
     (void)arg;
 
-    do {
+    waitlock_lock(&event_queue_lock);
+    while (1) {
         event_t *event;
         size_t i;
 
-        thread_mutex_lock(&event_lock);
-        running = event_running;
-        if (event_queue) {
-            event = event_queue;
-            event_queue = event_queue->next;
-            event->next = NULL;
-        } else {
-            event = NULL;
-        }
-        thread_mutex_unlock(&event_lock);
+        while (event_running && !event_queue)
+            waitcond_wait(&event_queue_cond, &event_queue_lock);
 
-        /* sleep if nothing todo and then try again */
-        if (!event) {
-            thread_sleep(150000);
-            continue;
-        }
+        /* events left are released by event_shutdown() */
+        if (!event_running)
+            break;
+
+        event = event_queue;
+        event_queue = event->next;
+        if (!event_queue)
+            event_queue_tail = &event_queue;
+        event_queue_length--;
+        event->next = NULL;
+        stats_global_dec(STATS_GLOBAL_EVENTS_QUEUED);
+        waitlock_unlock(&event_queue_lock);
 
         for (i = 0; i < (sizeof(event->reglist)/sizeof(*event->reglist)); i++)
             _try_registrations(event->reglist[i], event);
 
         event_release(event);
-    } while (running);
+
+        waitlock_lock(&event_queue_lock);
+    }
+    waitlock_unlock(&event_queue_lock);
 
     return NULL;
 }
 
 void event_initialise(void) {
+    ice_config_t *config;
+    unsigned int workers;
+    unsigned int i;
+
+    config = config_get_config();
+    workers = config->event_workers;
+    event_queue_limit = config->event_queue_size;
+    config_release_config();
+
     /* create mutex */
     thread_mutex_create(&event_lock);
 
     /* initialise everything */
-    thread_mutex_lock(&event_lock);
+    waitlock_lock(&event_queue_lock);
     event_running = 1;
-    thread_mutex_unlock(&event_lock);
+    waitlock_unlock(&event_queue_lock);
 
-    /* start thread */
-    event_thread = thread_create("events thread", event_run_thread, NULL, THREAD_ATTACHED);
+    /* start threads */
+    event_threads = calloc(workers, sizeof(*event_threads));
+    if (!event_threads) {
+        ICECAST_LOG_ERROR("Can not allocate event threads.");
+        return;
+    }
+    for (i = 0; i < workers; i++) {
+        event_threads[i] = thread_create("events thread", event_run_thread, NULL, THREAD_ATTACHED);
+        if (!event_threads[i]) {
+            ICECAST_LOG_ERROR("Can not start event thread %u.", i);
+            break;
+        }
+        event_threads_count++;
+    }
+    ICECAST_LOG_DEBUG("%u event threads started, queue holds %zu events", event_threads_count, event_queue_limit);
 }
 
 void event_shutdown(void) {
     event_t *event_queue_to_free = NULL;
+    size_t left;
 
-    /* stop thread */
-    if (!event_running)
+    /* stop threads */
+    waitlock_lock(&event_queue_lock);
+    if (!event_running) {
+        waitlock_unlock(&event_queue_lock);
         return;
-
-    thread_mutex_lock(&event_lock);
+    }
     event_running = 0;
-    thread_mutex_unlock(&event_lock);
+    waitcond_broadcast(&event_queue_cond);
+    waitlock_unlock(&event_queue_lock);
 
-    /* join thread as soon as it stopped */
-    thread_join(event_thread);
+    /* join threads as soon as they stopped */
+    while (event_threads_count)
+        thread_join(event_threads[--event_threads_count]);
+    free(event_threads);
+    event_threads = NULL;
 
     /* shutdown everything */
-    thread_mutex_lock(&event_lock);
-    event_thread = NULL;
+    waitlock_lock(&event_queue_lock);
     event_queue_to_free = event_queue;
+    left = event_queue_length;
     event_queue = NULL;
-    thread_mutex_unlock(&event_lock);
+    event_queue_tail = &event_queue;
+    event_queue_length = 0;
+    waitlock_unlock(&event_queue_lock);
 
+    while (left--)
+        stats_global_dec(STATS_GLOBAL_EVENTS_QUEUED);
     event_release(event_queue_to_free);
 
     /* destry mutex */
@@ -351,9 +390,17 @@ void event_registration_push(event_registration_t **er, event_registration_t *ta
 void event_emit(event_t *event) {
     fastevent_emit(FASTEVENT_TYPE_SLOWEVENT, FASTEVENT_FLAG_NONE, FASTEVENT_DATATYPE_EVENT, event);
     event_addref(event);
-    thread_mutex_lock(&event_lock);
-    event_push(&event_queue, event);
-    thread_mutex_unlock(&event_lock);
+    waitlock_lock(&event_queue_lock);
+    if (event_push(event) == 0) {
+        waitcond_signal(&event_queue_cond);
+        waitlock_unlock(&event_queue_lock);
+        return;
+    }
+    waitlock_unlock(&event_queue_lock);
+
+    ICECAST_LOG_ERROR("Can not push event %p into queue. Queue is full.", event);
+    stats_global_inc(STATS_GLOBAL_EVENTS_DROPPED);
+    event_release(event);
 }
 
 /* this function needs to extract all the info from the client, source and mount object
@@ -388,13 +435,11 @@ void event_emit_clientevent(const char *trigger, client_t *client, const char *u
      * We do this before inserting all the data into the object to avoid
      * all the strdups() and stuff in case they aren't needed.
      */
-#ifndef FASTEVENT_ENABLED
-    if (event->reglist[0] == NULL) {
+    if (event->reglist[0] == NULL && !fastevent_active(FASTEVENT_TYPE_SLOWEVENT)) {
         /* we have no registrations, drop this event. */
         event_release(event);
         return;
     }
-#endif
 
     if (client) {
         const char *tmp;
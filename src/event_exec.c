@@ -18,14 +18,24 @@
 /* for __setup_empty_script_environment() */
 #include <sys/stat.h>
 #include <fcntl.h>
+#ifdef HAVE_POSIX_SPAWN
+#include <spawn.h>
+#endif
 #endif
 
 #include "event.h"
+#include "waitlock.h"
 #include "global.h"
 #include "source.h"
+#include "stats.h"
 #include "logging.h"
 #define CATMODULE "event_exec"
 
+#if !defined(_WIN32) && defined(HAVE_POSIX_SPAWN)
+#define EVENT_EXEC_SPAWN
+extern char **environ;
+#endif
+
 typedef enum event_exec_argvtype_tag {
     ARGVTYPE_NO_DEFAULTS = 0,
     ARGVTYPE_ONLY_URI,
@@ -44,8 +54,36 @@ typedef struct event_exec {
 
     /* actual argv[] */
     char **argv;
+
+    /* scripts allowed to run at once, 0 for no limit, and scripts running
+     * right now, protected by event_exec_lock */
+    unsigned int max_running;
+    unsigned int running;
 } event_exec_t;
 
+#ifdef EVENT_EXEC_SPAWN
+/* a script that has not been waited for yet */
+typedef struct event_exec_child_tag {
+    struct event_exec_child_tag *next;
+    pid_t pid;
+    /* NULL once the registration is gone */
+    event_exec_t *exec;
+} event_exec_child_t;
+
+/* the environment of a script, as passed to posix_spawn() */
+typedef struct {
+    char **vars;
+    size_t len;
+    size_t size;
+} event_exec_env_t;
+
+static waitlock_t event_exec_lock = WAITLOCK_INITIALIZER;
+static event_exec_child_t *event_exec_children = NULL;
+static int event_exec_reaper_running = 0;
+#else
+typedef void event_exec_env_t;
+#endif
+
 /* OS independed code: */
 static inline size_t __argvtype2offset(event_exec_argvtype_t argvtype) {
     switch (argvtype) {
@@ -111,18 +149,52 @@ static inline char **__setup_argv(event_exec_t *self, event_t *event) {
 #ifdef _WIN32
 /* TODO #2101: Implement script executing on win* */
 #else
-/* this sets up the new environment for script execution.
+/* this sets up the new environment for script execution, in env or with
+ * env being NULL in our own environment after fork().
  * We ignore most failtures as we can not handle them anyway.
  */
-#ifdef HAVE_SETENV
-static inline void __update_environ(const char *name, const char *value) {
+#ifdef EVENT_EXEC_SPAWN
+/* takes over var */
+static void __push_environ(event_exec_env_t *env, char *var) {
+    if (!var)
+        return;
+
+    if (env->len + 1 >= env->size) {
+        size_t size = env->size ? env->size * 2 : 32;
+        char **vars = realloc(env->vars, size * sizeof(*vars));
+        if (!vars) {
+            free(var);
+            return;
+        }
+        env->vars = vars;
+        env->size = size;
+    }
+
+    env->vars[env->len++] = var;
+    env->vars[env->len] = NULL;
+}
+#endif
+
+static inline void __update_environ_env(event_exec_env_t *env, const char *name, const char *value) {
     if (!name || !value) return;
+#ifdef EVENT_EXEC_SPAWN
+    if (env) {
+        size_t len = strlen(name) + strlen(value) + 2;
+        char *var = malloc(len);
+
+        if (var)
+            snprintf(var, len, "%s=%s", name, value);
+        __push_environ(env, var);
+        return;
+    }
+#endif
+#ifdef HAVE_SETENV
     setenv(name, value, 1);
-}
-#else
-#define __update_environ(x,y)
 #endif
-static inline void __setup_environ(ice_config_t *config, event_exec_t *self, event_t *event) {
+}
+#define __update_environ(x,y) __update_environ_env(env, (x), (y))
+
+static inline void __setup_environ(ice_config_t *config, event_exec_t *self, event_t *event, event_exec_env_t *env) {
     mount_proxy *mountinfo;
     source_t *source;
     char buf[80];
@@ -193,11 +265,187 @@ static inline void __setup_empty_script_environment(event_exec_t *self, event_t
     ice_config_t *config = config_get_config();
 
     __setup_file_descriptors(config);
-    __setup_environ(config, self, event);
+    __setup_environ(config, self, event, NULL);
 
     config_release_config();
 }
 
+#ifdef EVENT_EXEC_SPAWN
+static void __free_environ(event_exec_env_t *env) {
+    size_t i;
+
+    for (i = 0; i < env->len; i++)
+        free(env->vars[i]);
+    free(env->vars);
+}
+
+/* our environment with the variables for the event on top */
+static int __setup_spawn_environ(event_exec_env_t *env, event_exec_t *self, event_t *event) {
+    ice_config_t *config = config_get_config();
+    size_t own, i, j;
+
+    __setup_environ(config, self, event, env);
+    config_release_config();
+
+    own = env->len;
+    for (i = 0; environ && environ[i]; i++) {
+        const char *eq = strchr(environ[i], '=');
+        int overridden = 0;
+
+        if (!eq)
+            continue;
+        for (j = 0; j < own; j++) {
+            if (strncmp(env->vars[j], environ[i], eq - environ[i] + 1) == 0) {
+                overridden = 1;
+                break;
+            }
+        }
+        if (!overridden)
+            __push_environ(env, strdup(environ[i]));
+    }
+
+    return env->vars ? 0 : -1;
+}
+
+/* stdin, stdout and stderr on the null device, everything else closed */
+static int __setup_spawn_file_actions(posix_spawn_file_actions_t *actions) {
+    ice_config_t *config;
+    int ret;
+
+    if (posix_spawn_file_actions_init(actions) != 0)
+        return -1;
+
+    config = config_get_config();
+    ret = posix_spawn_file_actions_addopen(actions, 0, config->null_device, O_RDWR, 0);
+    config_release_config();
+
+    if (ret == 0)
+        ret = posix_spawn_file_actions_adddup2(actions, 0, 1);
+    if (ret == 0)
+        ret = posix_spawn_file_actions_adddup2(actions, 0, 2);
+#ifdef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP
+    if (ret == 0)
+        ret = posix_spawn_file_actions_addclosefrom_np(actions, 3);
+#else
+    if (ret == 0) {
+        int i;
+
+        /* close at least the first 1024 handles that are open */
+        for (i = 3; i < 1024 && ret == 0; i++)
+            if (fcntl(i, F_GETFD) != -1)
+                ret = posix_spawn_file_actions_addclose(actions, i);
+    }
+#endif
+
+    if (ret != 0) {
+        posix_spawn_file_actions_destroy(actions);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* waits for the scripts that were started, until none is left */
+static void *event_exec_reaper (void *arg) {
+    (void)arg;
+
+    while (1) {
+        event_exec_child_t **prev;
+
+        waitlock_lock(&event_exec_lock);
+        prev = &event_exec_children;
+        while (*prev) {
+            event_exec_child_t *child = *prev;
+            pid_t ret = waitpid(child->pid, NULL, WNOHANG);
+
+            if (ret == 0 || (ret < 0 && errno == EINTR)) {
+                prev = &(child->next);
+                continue;
+            }
+
+            *prev = child->next;
+            if (child->exec)
+                child->exec->running--;
+            free(child);
+        }
+
+        if (!event_exec_children) {
+            event_exec_reaper_running = 0;
+            waitlock_unlock(&event_exec_lock);
+            break;
+        }
+        waitlock_unlock(&event_exec_lock);
+
+        thread_sleep(100000);
+    }
+
+    return NULL;
+}
+
+/* Starts the script without forking the whole server. The event thread
+ * does not wait for it, the reaper does.
+ */
+static void _run_script (event_exec_t *self, event_t *event) {
+    event_exec_env_t env;
+    posix_spawn_file_actions_t actions;
+    event_exec_child_t *child;
+    pid_t pid;
+    int ret;
+
+    if (access(self->executable, R_OK|X_OK) != 0) {
+        ICECAST_LOG_ERROR("Unable to run command %s (%s)", self->executable, strerror(errno));
+        return;
+    }
+
+    child = calloc(1, sizeof(*child));
+    if (!child)
+        return;
+
+    waitlock_lock(&event_exec_lock);
+    if (self->max_running && self->running >= self->max_running) {
+        waitlock_unlock(&event_exec_lock);
+        ICECAST_LOG_WARN("Not running command %s for %s, %u are still running", self->executable, event->trigger, self->running);
+        stats_global_inc(STATS_GLOBAL_EVENTS_DROPPED);
+        free(child);
+        return;
+    }
+    self->running++;
+    waitlock_unlock(&event_exec_lock);
+
+    memset(&env, 0, sizeof(env));
+    ret = -1;
+    if (__setup_spawn_environ(&env, self, event) == 0 && __setup_spawn_file_actions(&actions) == 0) {
+        ICECAST_LOG_DEBUG("Starting command %s", self->executable);
+        ret = posix_spawn(&pid, self->executable, &actions, NULL, __setup_argv(self, event), env.vars);
+        posix_spawn_file_actions_destroy(&actions);
+        if (ret != 0)
+            ICECAST_LOG_ERROR("Unable to run command %s (%s)", self->executable, strerror(ret));
+    } else {
+        ICECAST_LOG_ERROR("Can not set up running command %s", self->executable);
+    }
+    __free_environ(&env);
+
+    waitlock_lock(&event_exec_lock);
+    if (ret != 0) {
+        self->running--;
+        waitlock_unlock(&event_exec_lock);
+        free(child);
+        return;
+    }
+
+    child->pid = pid;
+    child->exec = self;
+    child->next = event_exec_children;
+    event_exec_children = child;
+    if (!event_exec_reaper_running) {
+        if (thread_create("Event Exec Reaper", event_exec_reaper, NULL, THREAD_DETACHED))
+            event_exec_reaper_running = 1;
+        else
+            ICECAST_LOG_ERROR("Can not start reaper, command %s is not waited for", self->executable);
+    }
+    waitlock_unlock(&event_exec_lock);
+}
+#else
 static void _run_script (event_exec_t *self, event_t *event) {
     pid_t pid, external_pid;
 
@@ -233,6 +481,7 @@ static void _run_script (event_exec_t *self, event_t *event) {
     }
 }
 #endif
+#endif
 
 static int event_exec_emit(void *state, event_t *event) {
     event_exec_t *self = state;
@@ -249,6 +498,17 @@ static void event_exec_free(void *state) {
     event_exec_t *self = state;
     size_t i;
 
+#ifdef EVENT_EXEC_SPAWN
+    event_exec_child_t *child;
+
+    /* scripts still running are waited for without us */
+    waitlock_lock(&event_exec_lock);
+    for (child = event_exec_children; child; child = child->next)
+        if (child->exec == self)
+            child->exec = NULL;
+    waitlock_unlock(&event_exec_lock);
+#endif
+
     for (i = __argvtype2offset(self->argvtype); self->argv[i]; i++)
         free(self->argv[i]);
 
@@ -273,11 +533,14 @@ int event_get_exec(event_registration_t *er, config_options_t *options) {
                 /* BEFORE RELEASE 2.5.0 DOCUMENT: Document supported options:
                  * <option name="executable" value="..." />
                  * <option name="default_arguments" value="..." /> (for values see near top of documment)
+                 * <option name="max_running" value="..." />
                  */
                 if (strcmp(cur->name, "executable") == 0) {
                     util_replace_string(&(self->executable), cur->value);
                 } else if (strcmp(cur->name, "default_arguments") == 0) {
                     self->argvtype = __str2argvtype(cur->value);
+                } else if (strcmp(cur->name, "max_running") == 0) {
+                    self->max_running = cur->value ? atoi(cur->value) : 0;
                 } else {
                     ICECAST_LOG_ERROR("Unknown <option> tag with name %s.", cur->name);
                 }
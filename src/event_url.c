@@ -11,14 +11,33 @@
 #endif
 
 #include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "common/thread/thread.h"
+#include "common/timing/timing.h"
 
 #include "curl.h"
+#include "waitlock.h"
 #include "event.h"
 #include "cfgfile.h"
 #include "util.h"
+#include "json.h"
+#include "stats.h"
 #include "logging.h"
 #define CATMODULE "event_url"
 
+#define EVENT_URL_DEFAULT_BATCH_INTERVAL    1000
+#define EVENT_URL_DEFAULT_BATCH_LIMIT       10000
+/* longest wait before a failed batch is sent again, in ms */
+#define EVENT_URL_MAX_BACKOFF               60000
+
+typedef struct event_url_item_tag {
+    struct event_url_item_tag *next;
+    uint64_t queued;
+    char *json;
+} event_url_item_t;
 
 typedef struct event_url {
     char *url;
@@ -26,6 +45,23 @@ typedef struct event_url {
     char *userpwd;
     CURL *handle;
     char errormsg[CURL_ERROR_SIZE];
+
+    /* With batch_size set events are collected and sent as a JSON array by
+     * the batch thread, once batch_size of them are there or the oldest
+     * waited batch_interval ms. Failed batches are sent again with a
+     * growing delay, while up to batch_limit events are kept.
+     * All below are protected by lock. */
+    unsigned int batch_size;
+    unsigned int batch_interval;
+    unsigned int batch_limit;
+    waitlock_t lock;
+    waitcond_t cond;
+    int running;
+    thread_type *thread;
+    event_url_item_t *head;
+    event_url_item_t **tail;
+    size_t pending;
+    struct curl_slist *headers;
 } event_url_t;
 
 static size_t handle_returned (void *ptr, size_t size, size_t nmemb, void *stream) {
@@ -40,6 +76,273 @@ static inline char *__escape(const char *src, const char *default_value) {
     return strdup(default_value);
 }
 
+/* renders the event as a JSON object with the same fields as the form */
+static char *event_url_render(event_url_t *self, event_t *event) {
+    json_renderer_t *renderer = json_renderer_create(JSON_RENDERER_FLAGS_NONE);
+    ice_config_t *config;
+
+    if (!renderer)
+        return NULL;
+
+    json_renderer_begin(renderer, JSON_ELEMENT_TYPE_OBJECT);
+    json_renderer_write_key(renderer, "action", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_string(renderer, self->action ? self->action : event->trigger, JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_key(renderer, "mount", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_string(renderer, event->uri ? event->uri : "", JSON_RENDERER_FLAGS_NONE);
+
+    config = config_get_config();
+    json_renderer_write_key(renderer, "server", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_string(renderer, config->hostname ? config->hostname : "", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_key(renderer, "port", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_int(renderer, config->port);
+    config_release_config();
+
+    json_renderer_write_key(renderer, "client", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_uint(renderer, event->connection_id);
+    json_renderer_write_key(renderer, "role", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_string(renderer, event->client_role ? event->client_role : "", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_key(renderer, "username", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_string(renderer, event->client_username ? event->client_username : "", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_key(renderer, "ip", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_string(renderer, event->connection_ip ? event->connection_ip : "", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_key(renderer, "agent", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_string(renderer, event->client_useragent ? event->client_useragent : "-", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_key(renderer, "duration", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_int(renderer, event->connection_time ? (intmax_t)(time(NULL) - event->connection_time) : 0);
+    json_renderer_write_key(renderer, "admin", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_int(renderer, event->client_admin_command);
+    json_renderer_end(renderer);
+
+    return json_renderer_finish(&renderer);
+}
+
+/* queues the event for the batch thread */
+static int event_url_queue(event_url_t *self, event_t *event) {
+    event_url_item_t *item = calloc(1, sizeof(*item));
+    event_url_item_t *dropped = NULL;
+
+    if (!item)
+        return -1;
+
+    item->json = event_url_render(self, event);
+    if (!item->json) {
+        free(item);
+        return -1;
+    }
+    item->queued = timing_get_time();
+
+    waitlock_lock(&self->lock);
+    *(self->tail) = item;
+    self->tail = &(item->next);
+    self->pending++;
+
+    /* the server is gone for a while, the oldest events go */
+    if (self->pending > self->batch_limit) {
+        dropped = self->head;
+        self->head = dropped->next;
+        if (!self->head)
+            self->tail = &(self->head);
+        self->pending--;
+    }
+
+    if (self->pending >= self->batch_size)
+        waitcond_signal(&self->cond);
+    waitlock_unlock(&self->lock);
+
+    if (dropped) {
+        ICECAST_LOG_DEBUG("Dropping event for %s, %u events are waiting", self->url, self->batch_limit);
+        stats_global_inc(STATS_GLOBAL_EVENTS_DROPPED);
+        free(dropped->json);
+        free(dropped);
+    }
+
+    return 0;
+}
+
+static void event_url_free_items(event_url_item_t *item) {
+    while (item) {
+        event_url_item_t *next = item->next;
+        free(item->json);
+        free(item);
+        item = next;
+    }
+}
+
+/* Sends the events as one JSON array. Returns 0 if they are done with,
+ * -1 if they are to be sent again later.
+ */
+static int event_url_send_batch(event_url_t *self, event_url_item_t *batch) {
+    event_url_item_t *item;
+    size_t len = 3;
+    char *body, *p;
+    long status = 0;
+
+    for (item = batch; item; item = item->next)
+        len += strlen(item->json) + 1;
+
+    body = malloc(len);
+    if (!body)
+        return -1;
+
+    p = body;
+    *(p++) = '[';
+    for (item = batch; item; item = item->next) {
+        size_t item_len = strlen(item->json);
+
+        if (item != batch)
+            *(p++) = ',';
+        memcpy(p, item->json, item_len);
+        p += item_len;
+    }
+    *(p++) = ']';
+    *p = 0;
+
+    curl_easy_setopt(self->handle, CURLOPT_POSTFIELDS, body);
+    curl_easy_setopt(self->handle, CURLOPT_POSTFIELDSIZE, (long)(p - body));
+
+    if (curl_easy_perform(self->handle)) {
+        ICECAST_LOG_WARN("event to server %s failed with %s", self->url, self->errormsg);
+        free(body);
+        return -1;
+    }
+    free(body);
+
+    curl_easy_getinfo(self->handle, CURLINFO_RESPONSE_CODE, &status);
+    if (status >= 200 && status < 300)
+        return 0;
+
+    ICECAST_LOG_WARN("event to server %s failed with status %li", self->url, status);
+    /* there is no point in sending what was rejected again */
+    if (status >= 400 && status < 500)
+        return 0;
+
+    return -1;
+}
+
+static void event_url_wait(event_url_t *self, uint64_t ms) {
+    struct timespec ts;
+
+    waitcond_deadline(&ts, ms);
+    waitcond_wait_until(&self->cond, &self->lock, &ts);
+}
+
+/* takes up to batch_size events off the queue, lock is held */
+static event_url_item_t *event_url_take_batch(event_url_t *self) {
+    event_url_item_t *batch = self->head;
+    event_url_item_t **next = &(self->head);
+    unsigned int count = 0;
+
+    while (*next && count < self->batch_size) {
+        next = &((*next)->next);
+        count++;
+    }
+
+    self->head = *next;
+    *next = NULL;
+    if (!self->head)
+        self->tail = &(self->head);
+    self->pending -= count;
+
+    return batch;
+}
+
+/* puts a batch that failed back in front of the queue, lock is held. As
+ * events were queued meanwhile, the oldest of the batch are dropped to stay
+ * within batch_limit. */
+static void event_url_return_batch(event_url_t *self, event_url_item_t *batch) {
+    event_url_item_t *last;
+    size_t count = 1;
+    size_t dropped = 0;
+
+    for (last = batch; last->next; last = last->next)
+        count++;
+
+    while (batch && (self->pending + count) > self->batch_limit) {
+        event_url_item_t *item = batch;
+
+        batch = item->next;
+        free(item->json);
+        free(item);
+        count--;
+        dropped++;
+    }
+
+    if (dropped) {
+        ICECAST_LOG_DEBUG("Dropping %zu events for %s, %u events are waiting", dropped, self->url, self->batch_limit);
+        stats_global_add(STATS_GLOBAL_EVENTS_DROPPED, dropped);
+    }
+
+    if (!batch)
+        return;
+
+    last->next = self->head;
+    if (!self->head)
+        self->tail = &(last->next);
+    self->head = batch;
+    self->pending += count;
+}
+
+static void *event_url_batch_thread(void *arg) {
+    event_url_t *self = arg;
+    uint64_t backoff = 0;
+    uint64_t retry_at = 0;
+
+    waitlock_lock(&self->lock);
+    while (self->running) {
+        event_url_item_t *batch;
+        uint64_t now = timing_get_time();
+        uint64_t due;
+
+        if (!self->head) {
+            waitcond_wait(&self->cond, &self->lock);
+            continue;
+        }
+
+        due = self->head->queued + self->batch_interval;
+        if (self->pending >= self->batch_size)
+            due = now;
+        if (retry_at > due)
+            due = retry_at;
+        if (now < due) {
+            event_url_wait(self, due - now);
+            continue;
+        }
+
+        batch = event_url_take_batch(self);
+        waitlock_unlock(&self->lock);
+
+        if (event_url_send_batch(self, batch) == 0) {
+            event_url_free_items(batch);
+            backoff = 0;
+            retry_at = 0;
+            waitlock_lock(&self->lock);
+            continue;
+        }
+
+        backoff = backoff ? backoff * 2 : 1000;
+        if (backoff > EVENT_URL_MAX_BACKOFF)
+            backoff = EVENT_URL_MAX_BACKOFF;
+        retry_at = timing_get_time() + backoff;
+
+        waitlock_lock(&self->lock);
+        event_url_return_batch(self, batch);
+    }
+
+    /* one last try for what is left, unless the server is failing already */
+    while (self->head && !retry_at) {
+        event_url_item_t *batch = event_url_take_batch(self);
+
+        waitlock_unlock(&self->lock);
+        if (event_url_send_batch(self, batch) != 0)
+            retry_at = 1;
+        event_url_free_items(batch);
+        waitlock_lock(&self->lock);
+    }
+    waitlock_unlock(&self->lock);
+
+    return NULL;
+}
+
 static int event_url_emit(void *state, event_t *event) {
     event_url_t *self = state;
     ice_config_t *config;
@@ -47,6 +350,9 @@ static int event_url_emit(void *state, event_t *event) {
     time_t duration;
     char post[4096];
 
+    if (self->thread)
+        return event_url_queue(self, event);
+
     action   = util_url_escape(self->action ? self->action : event->trigger);
     mount    = __escape(event->uri, "");
     role     = __escape(event->client_role, "");
@@ -94,6 +400,19 @@ static int event_url_emit(void *state, event_t *event) {
 
 static void event_url_free(void *state) {
     event_url_t *self = state;
+
+    if (self->thread) {
+        waitlock_lock(&self->lock);
+        self->running = 0;
+        waitcond_signal(&self->cond);
+        waitlock_unlock(&self->lock);
+        thread_join(self->thread);
+        event_url_free_items(self->head);
+        waitcond_destroy(&self->cond);
+        waitlock_destroy(&self->lock);
+    }
+    if (self->headers)
+        curl_slist_free_all(self->headers);
     icecast_curl_free(self->handle);
     free(self->url);
     free(self->action);
@@ -109,6 +428,9 @@ int event_get_url(event_registration_t *er, config_options_t *options) {
     if (!self)
         return -1;
 
+    self->batch_interval = EVENT_URL_DEFAULT_BATCH_INTERVAL;
+    self->batch_limit = EVENT_URL_DEFAULT_BATCH_LIMIT;
+
     if (options) {
         do {
             if (options->type)
@@ -120,6 +442,9 @@ int event_get_url(event_registration_t *er, config_options_t *options) {
              * <option name="username" value="..." />
              * <option name="password" value="..." />
              * <option name="action" value="..." />
+             * <option name="batch_size" value="..." />
+             * <option name="batch_interval" value="..." />
+             * <option name="batch_limit" value="..." />
              */
             if (strcmp(options->name, "url") == 0) {
                 util_replace_string(&(self->url), options->value);
@@ -129,6 +454,12 @@ int event_get_url(event_registration_t *er, config_options_t *options) {
                 password = options->value;
             } else if (strcmp(options->name, "action") == 0) {
                 util_replace_string(&(self->action), options->value);
+            } else if (strcmp(options->name, "batch_size") == 0) {
+                self->batch_size = options->value ? atoi(options->value) : 0;
+            } else if (strcmp(options->name, "batch_interval") == 0) {
+                self->batch_interval = options->value ? atoi(options->value) : 0;
+            } else if (strcmp(options->name, "batch_limit") == 0) {
+                self->batch_limit = options->value ? atoi(options->value) : 0;
             } else {
                 ICECAST_LOG_ERROR("Unknown <option> tag with name %s.", options->name);
             }
@@ -156,6 +487,33 @@ int event_get_url(event_registration_t *er, config_options_t *options) {
         snprintf(self->userpwd, len, "%s:%s", username, password);
     }
 
+    if (self->batch_size) {
+        if (self->batch_limit < self->batch_size)
+            self->batch_limit = self->batch_size;
+
+        /* the batch thread is the only user of the handle, so it is set up
+         * once and the connection to the server is kept */
+        self->headers = curl_slist_append(NULL, "Content-Type: application/json");
+        curl_easy_setopt(self->handle, CURLOPT_HTTPHEADER, self->headers);
+        curl_easy_setopt(self->handle, CURLOPT_URL, self->url);
+        if (strchr(self->url, '@') == NULL && self->userpwd)
+            curl_easy_setopt(self->handle, CURLOPT_USERPWD, self->userpwd);
+
+        waitlock_create(&self->lock);
+        waitcond_create(&self->cond);
+        self->tail = &(self->head);
+        self->running = 1;
+        self->thread = thread_create("Event URL Batch Thread", event_url_batch_thread, self, THREAD_ATTACHED);
+        if (!self->thread) {
+            ICECAST_LOG_ERROR("Can not start batch thread for %s, sending events one by one.", self->url);
+            waitcond_destroy(&self->cond);
+            waitlock_destroy(&self->lock);
+            curl_easy_setopt(self->handle, CURLOPT_HTTPHEADER, NULL);
+            curl_slist_free_all(self->headers);
+            self->headers = NULL;
+        }
+    }
+
     er->state = self;
     er->emit = event_url_emit;
     er->free = event_url_free;
@@ -44,6 +44,9 @@ struct eventrow {
 static struct eventrow fastevent_registrations[FASTEVENT_TYPE__END];
 static rwlock_t fastevent_lock;
 
+/* the used of each row, updated while fastevent_lock is held for writing */
+volatile unsigned int fastevent_registered[FASTEVENT_TYPE__END];
+
 static inline struct eventrow * __get_row(fastevent_type_t type)
 {
     size_t idx = type;
@@ -74,6 +77,7 @@ static int __add_to_row(struct eventrow * row, fastevent_registration_t *registr
     }
 
     row->registrations[row->used++] = registration;
+    atomic_uint_store(&(fastevent_registered[registration->type]), row->used);
     return 0;
 }
 
@@ -88,6 +92,7 @@ static int __remove_from_row(struct eventrow * row, fastevent_registration_t *re
         if (row->registrations[i] == registration) {
             memmove(&(row->registrations[i]), &(row->registrations[i+1]), sizeof(*(row->registrations))*(row->used - i - 1));
             row->used--;
+            atomic_uint_store(&(fastevent_registered[registration->type]), row->used);
             return 0;
         }
     }
@@ -185,7 +190,9 @@ refobject_t fastevent_register(fastevent_type_t type, fastevent_cb_t cb, fasteve
     return REFOBJECT_FROM_TYPE(registration);
 }
 
-void fastevent_emit(fastevent_type_t type, fastevent_flag_t flags, fastevent_datatype_t datatype, ...)
+/* called by fastevent_emit() once something is registered for the type.
+ * Emitting threads only share the read side of the lock. */
+void fastevent_emit_registered(fastevent_type_t type, fastevent_flag_t flags, fastevent_datatype_t datatype, ...)
 {
     struct eventrow * row;
     va_list ap, apx;
@@ -32,6 +32,12 @@ typedef enum {
     FASTEVENT_TYPE_CLIENT_READY_FOR_AUTH,
     FASTEVENT_TYPE_CLIENT_AUTHED,
     FASTEVENT_TYPE_CLIENT_SEND_RESPONSE,
+    /* timing of the hot paths, the time is only taken while something is
+     * registered for them, see histogram.h */
+    FASTEVENT_TYPE_CONNECTION_WRITE_TIME,
+    FASTEVENT_TYPE_CLIENT_REQUEST_QUEUED,
+    FASTEVENT_TYPE_CLIENT_AUTH_QUEUED,
+    FASTEVENT_TYPE_SOURCE_ITERATION,
     FASTEVENT_TYPE__END /* must be last element */
 } fastevent_type_t;
 
@@ -41,7 +47,9 @@ typedef enum {
     FASTEVENT_DATATYPE_CLIENT,
     FASTEVENT_DATATYPE_CONNECTION,
     FASTEVENT_DATATYPE_OBR,             /* Object, const void *Buffer, size_t Request_length */
-    FASTEVENT_DATATYPE_OBRD             /* Object, const void *Buffer, size_t Request_length, ssize_t Done_length */
+    FASTEVENT_DATATYPE_OBRD,            /* Object, const void *Buffer, size_t Request_length, ssize_t Done_length */
+    FASTEVENT_DATATYPE_OT,              /* Object, uint64_t Time in µs */
+    FASTEVENT_DATATYPE_ORDT             /* Object, size_t Request_length, ssize_t Done_length, uint64_t Time in µs */
 } fastevent_datatype_t;
 
 typedef int fastevent_flag_t;
@@ -52,15 +60,34 @@ typedef void (*fastevent_cb_t)(const void *userdata, fastevent_type_t type, fast
 typedef void (*fastevent_freecb_t)(void **userdata);
 
 #ifdef FASTEVENT_ENABLED
+#include "atomic.h"
+
+/* Number of registrations of each type. Emitting checks this first, so an
+ * event with nothing registered costs a single load and the arguments are
+ * not even evaluated. */
+extern volatile unsigned int fastevent_registered[FASTEVENT_TYPE__END];
+
 int fastevent_initialize(void);
 int fastevent_shutdown(void);
 refobject_t fastevent_register(fastevent_type_t type, fastevent_cb_t cb, fastevent_freecb_t freecb, void *userdata);
-void fastevent_emit(fastevent_type_t type, fastevent_flag_t flags, fastevent_datatype_t datatype, ...);
+void fastevent_emit_registered(fastevent_type_t type, fastevent_flag_t flags, fastevent_datatype_t datatype, ...);
+
+static inline int fastevent_active(fastevent_type_t type)
+{
+    return atomic_uint_load(&(fastevent_registered[type])) != 0;
+}
+
+#define fastevent_emit(type,flags,datatype,...) \
+    do { \
+        if (fastevent_active((type))) \
+            fastevent_emit_registered((type), (flags), (datatype), __VA_ARGS__); \
+    } while (0)
 #else
 #define fastevent_initialize() 0
 #define fastevent_shutdown() 0
 #define fastevent_register(type,cb,freecb,userdata) REFOBJECT_NULL
 #define fastevent_emit(type,flags,datatype,...)
+#define fastevent_active(type) 0
 #endif
 
 #endif
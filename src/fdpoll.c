@@ -0,0 +1,325 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#include <unistd.h>
+#elif defined(HAVE_POLL)
+#include <poll.h>
+#endif
+
+#include "common/thread/thread.h"
+
+#include "fdpoll.h"
+
+#include "logging.h"
+#define CATMODULE "fdpoll"
+
+/* max number of events fetched from the kernel in one go */
+#define FDPOLL_MAX_EVENTS   256
+
+struct fdpoll_tag {
+    /* protects count and the poll(2) arrays against concurrent arm/disarm */
+    spin_t lock;
+    size_t count;
+#ifdef HAVE_SYS_EPOLL_H
+    int epfd;
+    struct epoll_event events[FDPOLL_MAX_EVENTS];
+#elif defined(HAVE_POLL)
+    size_t fill;
+    struct pollfd *ufds;
+    void **userdata;
+#endif
+};
+
+#ifdef HAVE_SYS_EPOLL_H
+fdpoll_t *fdpoll_new(void)
+{
+    fdpoll_t *self = calloc(1, sizeof(*self));
+
+    if (!self)
+        return NULL;
+
+    self->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (self->epfd < 0) {
+        ICECAST_LOG_ERROR("Can not create epoll instance: %s", strerror(errno));
+        free(self);
+        return NULL;
+    }
+
+    thread_spin_create(&self->lock);
+
+    return self;
+}
+
+void fdpoll_free(fdpoll_t *self)
+{
+    if (!self)
+        return;
+
+    close(self->epfd);
+    thread_spin_destroy(&self->lock);
+    free(self);
+}
+
+int fdpoll_arm(fdpoll_t *self, sock_t sock, unsigned int events, void *userdata)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    if (events & FDPOLL_EVENT_READ)
+        ev.events |= EPOLLIN;
+    if (events & FDPOLL_EVENT_WRITE)
+        ev.events |= EPOLLOUT;
+    ev.data.ptr = userdata;
+
+    if (epoll_ctl(self->epfd, EPOLL_CTL_MOD, sock, &ev) == 0)
+        return 0;
+
+    if (errno != ENOENT)
+        return -1;
+
+    if (epoll_ctl(self->epfd, EPOLL_CTL_ADD, sock, &ev) != 0)
+        return -1;
+
+    thread_spin_lock(&self->lock);
+    self->count++;
+    thread_spin_unlock(&self->lock);
+    return 0;
+}
+
+int fdpoll_disarm(fdpoll_t *self, sock_t sock)
+{
+    struct epoll_event ev;
+
+    /* pre 2.6.9 kernels require a non-NULL event for EPOLL_CTL_DEL */
+    memset(&ev, 0, sizeof(ev));
+    if (epoll_ctl(self->epfd, EPOLL_CTL_DEL, sock, &ev) != 0)
+        return -1;
+
+    thread_spin_lock(&self->lock);
+    self->count--;
+    thread_spin_unlock(&self->lock);
+    return 0;
+}
+
+ssize_t fdpoll_wait(fdpoll_t *self, int timeout, fdpoll_result_t *results, size_t len)
+{
+    int ret;
+    int i;
+
+    if (len > FDPOLL_MAX_EVENTS)
+        len = FDPOLL_MAX_EVENTS;
+
+    ret = epoll_wait(self->epfd, self->events, len, timeout);
+    if (ret < 0)
+        return errno == EINTR ? 0 : -1;
+
+    for (i = 0; i < ret; i++) {
+        results[i].userdata = self->events[i].data.ptr;
+        results[i].events = FDPOLL_EVENT_NONE;
+        if (self->events[i].events & EPOLLIN)
+            results[i].events |= FDPOLL_EVENT_READ;
+        if (self->events[i].events & EPOLLOUT)
+            results[i].events |= FDPOLL_EVENT_WRITE;
+        if (self->events[i].events & (EPOLLERR|EPOLLHUP))
+            results[i].events |= FDPOLL_EVENT_ERROR;
+    }
+
+    return ret;
+}
+
+sock_t fdpoll_get_sock(fdpoll_t *self)
+{
+    return self->epfd;
+}
+#elif defined(HAVE_POLL)
+fdpoll_t *fdpoll_new(void)
+{
+    fdpoll_t *self = calloc(1, sizeof(*self));
+
+    if (!self)
+        return NULL;
+
+    thread_spin_create(&self->lock);
+
+    return self;
+}
+
+void fdpoll_free(fdpoll_t *self)
+{
+    if (!self)
+        return;
+
+    thread_spin_destroy(&self->lock);
+    free(self->ufds);
+    free(self->userdata);
+    free(self);
+}
+
+static ssize_t fdpoll_find(fdpoll_t *self, sock_t sock)
+{
+    size_t i;
+
+    for (i = 0; i < self->count; i++)
+        if (self->ufds[i].fd == sock)
+            return i;
+
+    return -1;
+}
+
+int fdpoll_arm(fdpoll_t *self, sock_t sock, unsigned int events, void *userdata)
+{
+    ssize_t idx;
+
+    thread_spin_lock(&self->lock);
+    idx = fdpoll_find(self, sock);
+    if (idx < 0) {
+        if (self->count == self->fill) {
+            size_t fill = self->fill ? self->fill * 2 : 16;
+            struct pollfd *ufds = realloc(self->ufds, sizeof(*ufds) * fill);
+            void **userdata_new;
+
+            if (!ufds) {
+                thread_spin_unlock(&self->lock);
+                return -1;
+            }
+            self->ufds = ufds;
+
+            userdata_new = realloc(self->userdata, sizeof(*userdata_new) * fill);
+            if (!userdata_new) {
+                thread_spin_unlock(&self->lock);
+                return -1;
+            }
+            self->userdata = userdata_new;
+
+            self->fill = fill;
+        }
+        idx = self->count++;
+        self->ufds[idx].fd = sock;
+    }
+
+    self->ufds[idx].events = 0;
+    self->ufds[idx].revents = 0;
+    if (events & FDPOLL_EVENT_READ)
+        self->ufds[idx].events |= POLLIN;
+    if (events & FDPOLL_EVENT_WRITE)
+        self->ufds[idx].events |= POLLOUT;
+    self->userdata[idx] = userdata;
+    thread_spin_unlock(&self->lock);
+
+    return 0;
+}
+
+int fdpoll_disarm(fdpoll_t *self, sock_t sock)
+{
+    ssize_t idx;
+
+    thread_spin_lock(&self->lock);
+    idx = fdpoll_find(self, sock);
+    if (idx < 0) {
+        thread_spin_unlock(&self->lock);
+        return -1;
+    }
+
+    /* move the last entry into the free slot */
+    self->count--;
+    self->ufds[idx] = self->ufds[self->count];
+    self->userdata[idx] = self->userdata[self->count];
+    thread_spin_unlock(&self->lock);
+
+    return 0;
+}
+
+ssize_t fdpoll_wait(fdpoll_t *self, int timeout, fdpoll_result_t *results, size_t len)
+{
+    ssize_t found = 0;
+    size_t i;
+    int ret;
+
+    ret = poll(self->ufds, self->count, timeout);
+    if (ret < 0)
+        return errno == EINTR ? 0 : -1;
+
+    for (i = 0; i < self->count && ret > 0 && (size_t)found < len; i++) {
+        short revents = self->ufds[i].revents;
+
+        if (!revents)
+            continue;
+
+        ret--;
+        results[found].userdata = self->userdata[i];
+        results[found].events = FDPOLL_EVENT_NONE;
+        if (revents & POLLIN)
+            results[found].events |= FDPOLL_EVENT_READ;
+        if (revents & POLLOUT)
+            results[found].events |= FDPOLL_EVENT_WRITE;
+        if (revents & (POLLERR|POLLHUP|POLLNVAL))
+            results[found].events |= FDPOLL_EVENT_ERROR;
+        found++;
+    }
+
+    return found;
+}
+
+sock_t fdpoll_get_sock(fdpoll_t *self)
+{
+    (void)self;
+    return SOCK_ERROR;
+}
+#else
+fdpoll_t *fdpoll_new(void)
+{
+    return NULL;
+}
+
+void fdpoll_free(fdpoll_t *self)
+{
+    (void)self;
+}
+
+int fdpoll_arm(fdpoll_t *self, sock_t sock, unsigned int events, void *userdata)
+{
+    return -1;
+}
+
+int fdpoll_disarm(fdpoll_t *self, sock_t sock)
+{
+    return -1;
+}
+
+ssize_t fdpoll_wait(fdpoll_t *self, int timeout, fdpoll_result_t *results, size_t len)
+{
+    return -1;
+}
+
+sock_t fdpoll_get_sock(fdpoll_t *self)
+{
+    return SOCK_ERROR;
+}
+#endif
+
+size_t fdpoll_count(fdpoll_t *self)
+{
+    size_t ret;
+
+    if (!self)
+        return 0;
+
+    thread_spin_lock(&self->lock);
+    ret = self->count;
+    thread_spin_unlock(&self->lock);
+
+    return ret;
+}
@@ -0,0 +1,69 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* fdpoll.h
+ *
+ * A small readiness notification interface for sockets. It uses epoll(7)
+ * where available and falls back to poll(2) elsewhere.
+ *
+ * A descriptor is only watched while it is armed. This is optimised for the
+ * case where most of the descriptors are usually writable and only the ones
+ * that returned EAGAIN need to be waited on.
+ *
+ * fdpoll_arm() and fdpoll_disarm() may be called from several threads at
+ * once, but not while another thread is in fdpoll_wait().
+ */
+
+#ifndef __FDPOLL_H__
+#define __FDPOLL_H__
+
+#include <sys/types.h>
+
+#include "common/net/sock.h"
+
+#include "icecasttypes.h"
+
+#define FDPOLL_EVENT_NONE   0x0000U
+#define FDPOLL_EVENT_READ   0x0001U
+#define FDPOLL_EVENT_WRITE  0x0002U
+/* only returned by fdpoll_wait() */
+#define FDPOLL_EVENT_ERROR  0x0004U
+
+typedef struct fdpoll_tag fdpoll_t;
+
+typedef struct {
+    void *userdata;
+    unsigned int events;
+} fdpoll_result_t;
+
+/* Returns NULL if no backend is available on this platform. */
+fdpoll_t *  fdpoll_new(void);
+void        fdpoll_free(fdpoll_t *self);
+
+/* Arms sock for the given events. Calling it again for an already armed
+ * socket replaces the events and userdata.
+ * Returns 0 on success and -1 on error.
+ */
+int         fdpoll_arm(fdpoll_t *self, sock_t sock, unsigned int events, void *userdata);
+/* Removes sock from the set. This must be called before sock is closed. */
+int         fdpoll_disarm(fdpoll_t *self, sock_t sock);
+/* Number of sockets currently armed. */
+size_t      fdpoll_count(fdpoll_t *self);
+/* Returns a descriptor that becomes readable whenever fdpoll_wait() would
+ * report an event, so the set can itself be armed in another fdpoll.
+ * Returns SOCK_ERROR if the backend does not support this.
+ */
+sock_t      fdpoll_get_sock(fdpoll_t *self);
+
+/* Waits up to timeout milliseconds (-1 for infinite) for any armed socket
+ * to become ready. Up to len results are stored in results.
+ * Sockets that are returned stay armed, the caller is expected to disarm them
+ * once they are handled.
+ * Returns the number of results, 0 on timeout, or -1 on error.
+ */
+ssize_t     fdpoll_wait(fdpoll_t *self, int timeout, fdpoll_result_t *results, size_t len);
+
+#endif  /* __FDPOLL_H__ */
@@ -0,0 +1,240 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "common/thread/thread.h"
+#include "common/avl/avl.h"
+#include "common/timing/timing.h"
+
+#include "filecache.h"
+
+#include "logging.h"
+#define CATMODULE "filecache"
+
+/* larger files are always served from disk */
+#define FILECACHE_MAX_FILE_SIZE     (256*1024)
+/* most bytes held for all files together */
+#define FILECACHE_MAX_BYTES         (16*1024*1024)
+/* how often (in ms) a file is checked for changes */
+#define FILECACHE_CHECK_INTERVAL    2000
+
+typedef struct filecache_entry_tag {
+    char *path;
+    time_t mtime;
+    off_t size;
+    uint64_t next_check;
+    /* the cache holds one reference */
+    refbuf_t *data;
+
+    /* most recently used first */
+    struct filecache_entry_tag *prev;
+    struct filecache_entry_tag *next;
+} filecache_entry_t;
+
+/* protects everything below */
+static mutex_t filecache_lock;
+static int filecache_running = 0;
+static avl_tree *filecache_entries;
+static filecache_entry_t *filecache_head;
+static filecache_entry_t *filecache_tail;
+static size_t filecache_bytes;
+
+static int filecache_compare(void *arg, void *a, void *b)
+{
+    (void)arg;
+    return strcmp(((filecache_entry_t *)a)->path, ((filecache_entry_t *)b)->path);
+}
+
+static int filecache_free_entry(void *key)
+{
+    filecache_entry_t *entry = key;
+
+    refbuf_release(entry->data);
+    free(entry->path);
+    free(entry);
+
+    return 1;
+}
+
+static void filecache_unlink(filecache_entry_t *entry)
+{
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        filecache_head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        filecache_tail = entry->prev;
+    }
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+static void filecache_push_front(filecache_entry_t *entry)
+{
+    entry->prev = NULL;
+    entry->next = filecache_head;
+    if (filecache_head) {
+        filecache_head->prev = entry;
+    } else {
+        filecache_tail = entry;
+    }
+    filecache_head = entry;
+}
+
+/* clients still sending the file keep its buffer */
+static void filecache_remove(filecache_entry_t *entry)
+{
+    filecache_unlink(entry);
+    filecache_bytes -= entry->data->len;
+    avl_delete(filecache_entries, entry, filecache_free_entry);
+}
+
+static filecache_entry_t *filecache_load(const char *path)
+{
+    filecache_entry_t *entry;
+    struct stat st;
+    refbuf_t *data;
+    FILE *file;
+    size_t bytes;
+
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 || st.st_size > FILECACHE_MAX_FILE_SIZE)
+        return NULL;
+
+    file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+
+    data = refbuf_new((unsigned int)st.st_size);
+    bytes = fread(data->data, 1, data->len, file);
+    fclose(file);
+
+    /* the file changed while it was read, leave it for the next time */
+    if (bytes != data->len) {
+        refbuf_release(data);
+        return NULL;
+    }
+
+    entry = calloc(1, sizeof(*entry));
+    if (entry)
+        entry->path = strdup(path);
+    if (!entry || !entry->path) {
+        free(entry);
+        refbuf_release(data);
+        return NULL;
+    }
+
+    entry->mtime = st.st_mtime;
+    entry->size = st.st_size;
+    entry->next_check = timing_get_time() + FILECACHE_CHECK_INTERVAL;
+    entry->data = data;
+
+    ICECAST_LOG_DEBUG("Cached %u bytes of \"%H\"", data->len, path);
+
+    return entry;
+}
+
+void filecache_initialize(void)
+{
+    thread_mutex_create(&filecache_lock);
+    filecache_entries = avl_tree_new(filecache_compare, NULL);
+    filecache_head = NULL;
+    filecache_tail = NULL;
+    filecache_bytes = 0;
+    filecache_running = 1;
+}
+
+void filecache_shutdown(void)
+{
+    thread_mutex_lock(&filecache_lock);
+    filecache_running = 0;
+    avl_tree_free(filecache_entries, filecache_free_entry);
+    filecache_entries = NULL;
+    filecache_head = NULL;
+    filecache_tail = NULL;
+    filecache_bytes = 0;
+    thread_mutex_unlock(&filecache_lock);
+    thread_mutex_destroy(&filecache_lock);
+}
+
+size_t filecache_clear(void)
+{
+    size_t ret;
+
+    thread_mutex_lock(&filecache_lock);
+    ret = filecache_bytes;
+    if (filecache_running) {
+        while (filecache_tail)
+            filecache_remove(filecache_tail);
+    }
+    thread_mutex_unlock(&filecache_lock);
+
+    return ret;
+}
+
+refbuf_t *filecache_get(const char *path, time_t *mtime)
+{
+    filecache_entry_t search;
+    filecache_entry_t *entry = NULL;
+    refbuf_t *ret = NULL;
+    void *result;
+
+    thread_mutex_lock(&filecache_lock);
+    if (!filecache_running) {
+        thread_mutex_unlock(&filecache_lock);
+        return NULL;
+    }
+
+    search.path = (char *)path;
+    if (avl_get_by_key(filecache_entries, &search, &result) == 0) {
+        uint64_t now = timing_get_time();
+
+        entry = result;
+        if (now >= entry->next_check) {
+            struct stat st;
+
+            if (stat(path, &st) != 0 || st.st_mtime != entry->mtime || st.st_size != entry->size) {
+                ICECAST_LOG_DEBUG("File \"%H\" changed, dropping it from the cache", path);
+                filecache_remove(entry);
+                entry = NULL;
+            } else {
+                entry->next_check = now + FILECACHE_CHECK_INTERVAL;
+            }
+        }
+        if (entry)
+            filecache_unlink(entry);
+    }
+
+    if (!entry && (entry = filecache_load(path))) {
+        avl_insert(filecache_entries, entry);
+        filecache_bytes += entry->data->len;
+    }
+
+    if (entry) {
+        filecache_push_front(entry);
+        while (filecache_bytes > FILECACHE_MAX_BYTES && filecache_tail != entry)
+            filecache_remove(filecache_tail);
+
+        ret = entry->data;
+        refbuf_addref(ret);
+        *mtime = entry->mtime;
+    }
+    thread_mutex_unlock(&filecache_lock);
+
+    return ret;
+}
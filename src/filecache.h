@@ -0,0 +1,39 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* filecache.h
+ *
+ * Keeps the contents of small files served from webroot in memory, so the
+ * same stylesheets, images and playlists are not opened and read again for
+ * every request. Each file is held in a single refbuf that is handed to all
+ * clients requesting it. A file is checked for changes on disk at most once
+ * in a while, and the least recently used ones are dropped once the cache
+ * is full.
+ */
+
+#ifndef __FILECACHE_H__
+#define __FILECACHE_H__
+
+#include <stddef.h>
+#include <time.h>
+
+#include "refbuf.h"
+
+void        filecache_initialize(void);
+void        filecache_shutdown(void);
+
+/* Returns the contents of the regular file at path with a reference added,
+ * reading it if it is not cached yet, and sets *mtime to the modification
+ * time they are from. Returns NULL if the file does not exist, is not a
+ * regular file or is too large to be cached, in which case it is to be
+ * served from disk.
+ */
+refbuf_t *  filecache_get(const char *path, time_t *mtime);
+
+/* Drops all files from the cache, returns the bytes they took */
+size_t      filecache_clear(void);
+
+#endif  /* __FILECACHE_H__ */
@@ -0,0 +1,356 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "common/thread/thread.h"
+
+#include "flightrec.h"
+#include "atomic.h"
+#include "fastevent.h"
+#include "histogram.h"
+#include "cfgfile.h"
+#include "connection.h"
+#include "client.h"
+#include "source.h"
+#include "compat.h"
+
+#include "logging.h"
+#define CATMODULE "flightrec"
+
+typedef struct flightrec_ring_tag {
+    /* all rings, and those of threads that ended for the next ones */
+    struct flightrec_ring_tag *next;
+    struct flightrec_ring_tag *next_free;
+    uint16_t thread;
+    /* records written so far, only the owning thread changes it */
+    volatile uint64_t written;
+    flightrec_record_t records[];
+} flightrec_ring_t;
+
+/* the events recorded, the others are left out of the dump names */
+static const struct {
+    fastevent_type_t type;
+    const char *name;
+} flightrec_events[] = {
+    {FASTEVENT_TYPE_CONNECTION_CREATE,      "connection_create"},
+    {FASTEVENT_TYPE_CONNECTION_DESTROY,     "connection_destroy"},
+    {FASTEVENT_TYPE_CONNECTION_READ,        "connection_read"},
+    {FASTEVENT_TYPE_CONNECTION_WRITE_TIME,  "connection_write"},
+    {FASTEVENT_TYPE_CLIENT_CREATE,          "client_create"},
+    {FASTEVENT_TYPE_CLIENT_DESTROY,         "client_destroy"},
+    {FASTEVENT_TYPE_CLIENT_REQUEST_QUEUED,  "client_request"},
+    {FASTEVENT_TYPE_CLIENT_READY_FOR_AUTH,  "client_ready_for_auth"},
+    {FASTEVENT_TYPE_CLIENT_AUTH_QUEUED,     "client_auth"},
+    {FASTEVENT_TYPE_CLIENT_AUTHED,          "client_authed"},
+    {FASTEVENT_TYPE_CLIENT_SEND_RESPONSE,   "client_send_response"},
+    {FASTEVENT_TYPE_SOURCE_ITERATION,       "source_iteration"}
+};
+
+#define FLIGHTREC_EVENTS    (sizeof(flightrec_events)/sizeof(*flightrec_events))
+
+static refobject_t flightrec_registrations[FLIGHTREC_EVENTS];
+static int flightrec_running = 0;
+/* records per ring, a power of two */
+static size_t flightrec_size;
+
+static mutex_t flightrec_lock;
+static pthread_key_t flightrec_key;
+/* protected by flightrec_lock */
+static flightrec_ring_t *flightrec_rings;
+static flightrec_ring_t *flightrec_free;
+static unsigned int flightrec_threads;
+
+/* called as a thread ends, its records are kept until the ring is reused */
+static void flightrec_ring_release(void *arg)
+{
+    flightrec_ring_t *ring = arg;
+
+    thread_mutex_lock(&flightrec_lock);
+    ring->next_free = flightrec_free;
+    flightrec_free = ring;
+    thread_mutex_unlock(&flightrec_lock);
+}
+
+static flightrec_ring_t *flightrec_get_ring(void)
+{
+    flightrec_ring_t *ring = pthread_getspecific(flightrec_key);
+
+    if (ring)
+        return ring;
+
+    thread_mutex_lock(&flightrec_lock);
+    if (flightrec_free) {
+        ring = flightrec_free;
+        flightrec_free = ring->next_free;
+    } else {
+        ring = calloc(1, sizeof(*ring) + flightrec_size * sizeof(flightrec_record_t));
+        if (ring) {
+            ring->next = flightrec_rings;
+            flightrec_rings = ring;
+        }
+    }
+    if (ring)
+        ring->thread = flightrec_threads++;
+    thread_mutex_unlock(&flightrec_lock);
+
+    if (ring && pthread_setspecific(flightrec_key, ring) != 0) {
+        flightrec_ring_release(ring);
+        ring = NULL;
+    }
+
+    return ring;
+}
+
+static uint64_t flightrec_object_id(fastevent_type_t type, void *object)
+{
+    if (!object)
+        return 0;
+
+    switch (type) {
+        case FASTEVENT_TYPE_CONNECTION_CREATE:
+        case FASTEVENT_TYPE_CONNECTION_DESTROY:
+        case FASTEVENT_TYPE_CONNECTION_READ:
+        case FASTEVENT_TYPE_CONNECTION_WRITE_TIME:
+            return ((connection_t *)object)->id;
+        case FASTEVENT_TYPE_SOURCE_ITERATION:
+            object = ((source_t *)object)->client;
+            if (!object)
+                return 0;
+        /* fall through */
+        default:
+            return ((client_t *)object)->con ? ((client_t *)object)->con->id : 0;
+    }
+}
+
+static void flightrec_cb(const void *userdata, fastevent_type_t type, fastevent_flag_t flags, fastevent_datatype_t datatype, va_list ap)
+{
+    flightrec_ring_t *ring = flightrec_get_ring();
+    flightrec_record_t *record;
+    uint64_t now = histogram_time();
+    uint64_t duration = 0;
+    int64_t value = 0;
+    void *object;
+
+    (void)userdata, (void)flags;
+
+    if (!ring)
+        return;
+
+    object = va_arg(ap, void *);
+    switch (datatype) {
+        case FASTEVENT_DATATYPE_OBRD:
+            (void)va_arg(ap, const void *);
+            (void)va_arg(ap, size_t);
+            value = va_arg(ap, ssize_t);
+        break;
+        case FASTEVENT_DATATYPE_OT:
+            duration = va_arg(ap, uint64_t);
+        break;
+        case FASTEVENT_DATATYPE_ORDT:
+            (void)va_arg(ap, size_t);
+            value = va_arg(ap, ssize_t);
+            duration = va_arg(ap, uint64_t);
+        break;
+        default:
+        break;
+    }
+
+    record = &(ring->records[ring->written & (flightrec_size - 1)]);
+    record->time = now - duration;
+    record->id = flightrec_object_id(type, object);
+    record->value = value;
+    record->duration = duration > UINT32_MAX ? UINT32_MAX : duration;
+    record->type = type;
+    record->thread = ring->thread;
+    /* the dump only reads the records this covers */
+    atomic_u64_store(&(ring->written), ring->written + 1);
+}
+
+void flightrec_initialize(void)
+{
+    ice_config_t *config;
+    unsigned int size;
+    size_t i;
+
+    if (flightrec_running)
+        return;
+
+    config = config_get_config();
+    size = config->flight_recorder;
+    config_release_config();
+
+    if (!size)
+        return;
+
+    for (flightrec_size = 1; flightrec_size < size; flightrec_size <<= 1);
+
+    if (pthread_key_create(&flightrec_key, flightrec_ring_release) != 0) {
+        ICECAST_LOG_ERROR("Can not create the key for the flight recorder rings");
+        return;
+    }
+    thread_mutex_create(&flightrec_lock);
+
+    for (i = 0; i < FLIGHTREC_EVENTS; i++) {
+        flightrec_registrations[i] = fastevent_register(flightrec_events[i].type, flightrec_cb, NULL, NULL);
+        if (REFOBJECT_IS_NULL(flightrec_registrations[i]))
+            ICECAST_LOG_ERROR("Can not register for the %s events", flightrec_events[i].name);
+    }
+
+    flightrec_running = 1;
+    ICECAST_LOG_INFO("Flight recorder keeps %zu events per thread", flightrec_size);
+}
+
+void flightrec_shutdown(void)
+{
+    size_t i;
+
+    if (!flightrec_running)
+        return;
+
+    flightrec_running = 0;
+    /* once unregistered no thread records anymore */
+    for (i = 0; i < FLIGHTREC_EVENTS; i++) {
+        refobject_unref(flightrec_registrations[i]);
+        flightrec_registrations[i] = REFOBJECT_NULL;
+    }
+
+    /* the rings of threads still running are freed too, so they must not be
+     * handed back as those end */
+    pthread_key_delete(flightrec_key);
+    while (flightrec_rings) {
+        flightrec_ring_t *ring = flightrec_rings;
+
+        flightrec_rings = ring->next;
+        free(ring);
+    }
+    flightrec_free = NULL;
+    thread_mutex_destroy(&flightrec_lock);
+}
+
+int flightrec_enabled(void)
+{
+    return flightrec_running;
+}
+
+refbuf_t *flightrec_dump(void)
+{
+    const char *names[FASTEVENT_TYPE__END] = {NULL};
+    flightrec_ring_t *ring;
+    refbuf_t *refbuf;
+    uint32_t header[4];
+    size_t rings = 0;
+    size_t size;
+    size_t pos;
+    size_t i;
+
+    if (!flightrec_running)
+        return NULL;
+
+    for (i = 0; i < FLIGHTREC_EVENTS; i++)
+        names[flightrec_events[i].type] = flightrec_events[i].name;
+
+    thread_mutex_lock(&flightrec_lock);
+    for (ring = flightrec_rings; ring; ring = ring->next)
+        rings++;
+
+    size = strlen(FLIGHTREC_MAGIC) + sizeof(header) + rings * flightrec_size * sizeof(flightrec_record_t);
+    for (i = 0; i < FASTEVENT_TYPE__END; i++)
+        size += (names[i] ? strlen(names[i]) : 0) + 1;
+
+    refbuf = refbuf_new(size);
+    pos = strlen(FLIGHTREC_MAGIC);
+    memcpy(refbuf->data, FLIGHTREC_MAGIC, pos);
+    pos += sizeof(header);
+    for (i = 0; i < FASTEVENT_TYPE__END; i++) {
+        size_t len = (names[i] ? strlen(names[i]) : 0) + 1;
+
+        memcpy(refbuf->data + pos, names[i] ? names[i] : "", len);
+        pos += len;
+    }
+
+    header[0] = 0x01020304;
+    header[1] = sizeof(flightrec_record_t);
+    header[2] = FASTEVENT_TYPE__END;
+    header[3] = 0;
+
+    for (ring = flightrec_rings; ring; ring = ring->next) {
+        uint64_t end = atomic_u64_load(&(ring->written));
+        uint64_t start = end > flightrec_size ? end - flightrec_size : 0;
+        uint64_t overwritten;
+        uint64_t n;
+
+        for (n = start; n < end; n++)
+            memcpy(refbuf->data + pos + (n - start) * sizeof(flightrec_record_t),
+                    &(ring->records[n & (flightrec_size - 1)]), sizeof(flightrec_record_t));
+
+        /* the thread goes on recording, those it got to meanwhile may be
+         * torn, as may be the one it is writing, which is the one after
+         * those written */
+        atomic_fence_acquire();
+        overwritten = atomic_u64_load(&(ring->written)) + 1;
+        overwritten = overwritten > flightrec_size ? overwritten - flightrec_size : 0;
+        if (overwritten > start) {
+            if (overwritten > end)
+                overwritten = end;
+            memmove(refbuf->data + pos, refbuf->data + pos + (overwritten - start) * sizeof(flightrec_record_t),
+                    (end - overwritten) * sizeof(flightrec_record_t));
+            start = overwritten;
+        }
+
+        pos += (end - start) * sizeof(flightrec_record_t);
+        header[3] += end - start;
+    }
+    thread_mutex_unlock(&flightrec_lock);
+
+    memcpy(refbuf->data + strlen(FLIGHTREC_MAGIC), header, sizeof(header));
+    refbuf->len = pos;
+
+    return refbuf;
+}
+
+void flightrec_dump_to_file(void)
+{
+    ice_config_t *config;
+    refbuf_t *refbuf;
+    char name[64];
+    char filename[FILENAME_MAX];
+    time_t now = time(NULL);
+    FILE *file;
+
+    refbuf = flightrec_dump();
+    if (!refbuf) {
+        ICECAST_LOG_WARN("Flight recorder dump requested, but it is not enabled");
+        return;
+    }
+
+    strftime(name, sizeof(name), "flightrec-%Y%m%d-%H%M%S.bin", gmtime(&now));
+    config = config_get_config();
+    snprintf(filename, sizeof(filename), "%s%s%s", config->log_dir, PATH_SEPARATOR, name);
+    config_release_config();
+
+    file = fopen(filename, "wb");
+    if (!file || fwrite(refbuf->data, 1, refbuf->len, file) != refbuf->len) {
+        ICECAST_LOG_ERROR("Can not write flight recorder dump to \"%s\": %s", filename, strerror(errno));
+    } else {
+        ICECAST_LOG_INFO("Wrote flight recorder dump to \"%s\"", filename);
+    }
+    if (file)
+        fclose(file);
+
+    refbuf_release(refbuf);
+}
@@ -0,0 +1,61 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* flightrec.h
+ *
+ * Flight recorder of the fast events, enabled by <flight-recorder>. Each
+ * thread that emits an event records it to a ring of its own, so recording
+ * takes no lock, and the last events of every thread are at hand when a
+ * stall or glitch is reported. They are dumped by /admin/flightrecorder or
+ * on SIGUSR1 to the log directory, and icecast-flightrec in tests/ turns a
+ * dump into the trace event JSON read by chrome://tracing and Perfetto.
+ *
+ * A dump is written in the byte order of the host:
+ *   FLIGHTREC_MAGIC
+ *   uint32_t    0x01020304, to tell the byte order
+ *   uint32_t    size of a record
+ *   uint32_t    number of event types
+ *   uint32_t    number of records
+ *   the names of the event types, each ending in a NUL byte, an empty name
+ *   for those not recorded
+ *   the records, see flightrec_record_t, those of each thread oldest first
+ */
+
+#ifndef __FLIGHTREC_H__
+#define __FLIGHTREC_H__
+
+#include <stdint.h>
+
+#include "refbuf.h"
+
+#define FLIGHTREC_MAGIC     "ICEFLTR1"
+
+typedef struct {
+    /* monotonic time in µs the event started at */
+    uint64_t time;
+    /* id of the connection the event is about, 0 if none */
+    uint64_t id;
+    /* bytes read or written, -1 on errors */
+    int64_t value;
+    /* µs the event took, 0 for those that have no duration */
+    uint32_t duration;
+    /* the fastevent_type_t */
+    uint16_t type;
+    /* number of the thread, in the order they first recorded */
+    uint16_t thread;
+} flightrec_record_t;
+
+void        flightrec_initialize(void);
+void        flightrec_shutdown(void);
+/* if <flight-recorder> was set when the server was started */
+int         flightrec_enabled(void);
+
+/* the recorded events of all threads as a dump, NULL if not enabled */
+refbuf_t   *flightrec_dump(void);
+/* writes a dump to a new file in the log directory */
+void        flightrec_dump_to_file(void);
+
+#endif  /* __FLIGHTREC_H__ */
@@ -39,6 +39,7 @@
 #include "source.h"
 #include "format.h"
 #include "global.h"
+#include "coarsetime.h"
 
 #include "format_ogg.h"
 #include "format_mp3.h"
@@ -116,6 +117,27 @@ int format_get_plugin(format_type_t type, source_t *source)
 }
 
 
+/* The client goes on from its position on the stream queue. The write
+ * routine is picked here for the rest of its time on the queue, the plain
+ * ones are swapped for those gathering the following buffers.
+ */
+static void format_start_queue(source_t *source, client_t *client)
+{
+    format_write_func_t write = NULL;
+
+    client->check_buffer = format_advance_queue;
+    client->intro_offset = -1;
+
+    if (source->format->get_queue_writer)
+        write = source->format->get_queue_writer(client);
+    if (write == NULL)
+        write = source->format->write_buf_to_client;
+    if (write == format_generic_write_to_client)
+        write = format_get_queue_writer(client);
+    client->write_to_client = write;
+}
+
+
 /* clients need to be start from somewhere in the queue so we will look for
  * a refbuf which has been previously marked as a sync point.
  */
@@ -129,14 +151,19 @@ static void find_client_start(source_t *source, client_t *client)
     if (client->intro_offset == -1 && source->stream_data_tail
             && source->stream_data_tail->sync_point)
         refbuf = source->stream_data_tail;
+    else if (source->format->sparse_sync)
+    {
+        /* the burst point is kept on the newest usable sync point */
+        refbuf = source->burst_point;
+    }
     else
     {
         size_t size = client->intro_offset;
         refbuf = source->burst_point;
-        while (size > 0 && refbuf && refbuf->next)
+        while (size > 0 && refbuf && refbuf_get_next(refbuf))
         {
             size -= refbuf->len;
-            refbuf = refbuf->next;
+            refbuf = refbuf_get_next(refbuf);
         }
     }
 
@@ -145,16 +172,39 @@ static void find_client_start(source_t *source, client_t *client)
         if (refbuf->sync_point)
         {
             client_set_queue (client, refbuf);
-            client->check_buffer = format_advance_queue;
-            client->write_to_client = source->format->write_buf_to_client;
-            client->intro_offset = -1;
+            client->pos = refbuf->sync_offset;
+            format_start_queue (source, client);
             break;
         }
-        refbuf = refbuf->next;
+        refbuf = refbuf_get_next(refbuf);
     }
 }
 
 
+/* Position the client on the next buffer of the cached intro, starting with
+ * the first one if it has not played any of it yet. */
+static int get_intro_data(source_t *source, client_t *client)
+{
+    refbuf_t *refbuf;
+
+    if (client->intro_offset == 0) {
+        refbuf = introcache_get(&source->intro);
+        if (refbuf == NULL)
+            return 0;
+        client_set_queue(client, refbuf);
+        refbuf_release(refbuf);
+    } else {
+        refbuf = refbuf_get_next(client->refbuf);
+        if (refbuf == NULL)
+            return 0;
+        client_set_queue(client, refbuf);
+    }
+
+    return 1;
+}
+
+
+/* file fallback, read the next block of the file into the client's buffer */
 static int get_file_data(FILE *intro, client_t *client)
 {
     refbuf_t *refbuf = client->refbuf;
@@ -195,10 +245,17 @@ int format_check_file_buffer (source_t *source, client_t *client)
     }
     if (client->pos == refbuf->len)
     {
-        if (get_file_data (source->intro_file, client))
+        int ret;
+
+        if (source->intro_file)
+            ret = get_file_data (source->intro_file, client);
+        else
+            ret = get_intro_data (source, client);
+
+        if (ret)
         {
             client->pos = 0;
-            client->intro_offset += refbuf->len;
+            client->intro_offset += client->refbuf->len;
         }
         else
         {
@@ -217,6 +274,112 @@ int format_check_file_buffer (source_t *source, client_t *client)
 }
 
 
+/* A client moved from another source first finishes the buffer of the old
+ * queue it was in the middle of, so its stream is not cut within a page or
+ * frame, and then joins this source at the live end like any moved client.
+ */
+int format_check_handoff_buffer (source_t *source, client_t *client)
+{
+    refbuf_t *refbuf = client->refbuf;
+
+    (void)source;
+
+    if (refbuf && client->pos < refbuf->len)
+        return 0;
+
+    client_set_queue (client, NULL);
+    client->check_buffer = format_check_file_buffer;
+    client->intro_offset = -1;
+    return -1;
+}
+
+
+/* Start the client on the stream queue exactly at its timeshift position,
+ * which it has caught up with. Returns 0 if the position is not on the
+ * queue. */
+static int timeshift_join_queue(source_t *source, client_t *client)
+{
+    refbuf_t *refbuf = source->burst_point;
+    uint64_t position = client->timeshift_position;
+
+    if (refbuf == NULL || position < refbuf->stream_offset)
+        return 0;
+
+    while (refbuf && position >= refbuf->stream_offset + refbuf->len)
+        refbuf = refbuf_get_next(refbuf);
+    if (refbuf == NULL)
+        return 0;
+
+    client_set_queue (client, refbuf);
+    client->pos = position - refbuf->stream_offset;
+    format_start_queue (source, client);
+    return 1;
+}
+
+
+/* Send a client that joined in the past the stream from the timeshift ring,
+ * until it reaches the data new listeners are sent from the queue.
+ */
+int format_check_timeshift_buffer (source_t *source, client_t *client)
+{
+    refbuf_t *refbuf = client->refbuf;
+    ssize_t ret;
+
+    if (refbuf == NULL || source->timeshift == NULL)
+    {
+        /* moved or the ring is gone, continue like other listeners */
+        client_set_queue (client, NULL);
+        client->check_buffer = format_check_file_buffer;
+        client->intro_offset = -1;
+        return -1;
+    }
+    if (client->pos < refbuf->len)
+        return 0;
+
+    if (timeshift_join_queue (source, client))
+        return -1;
+
+    ret = timeshift_read (source->timeshift, &client->timeshift_position,
+            refbuf->data, PER_CLIENT_REFBUF_SIZE);
+    if (ret < 0)
+    {
+        /* overwritten before it was sent, it goes on from the oldest data */
+        ICECAST_LOG_DEBUG("client %lu fell behind the timeshift ring", client->con->id);
+        return -1;
+    }
+    if (ret == 0)
+        return -1;
+
+    refbuf->len = ret;
+    client->pos = 0;
+    return 0;
+}
+
+
+/* Position a new client the requested number of seconds in the past, if
+ * the source keeps a timeshift ring. Returns 1 if it is sent from there. */
+static int timeshift_start(source_t *source, client_t *client)
+{
+    const char *offset;
+    long seconds;
+
+    if (source->timeshift == NULL)
+        return 0;
+    offset = httpp_get_query_param (client->parser, "offset");
+    if (offset == NULL)
+        return 0;
+
+    /* offsets are given back from now, either sign will do */
+    seconds = labs (atol (offset));
+    if (seconds == 0 || timeshift_seek (source->timeshift, seconds, &client->timeshift_position) < 0)
+        return 0;
+
+    ICECAST_LOG_DEBUG("client %lu joins %s %ld seconds in the past", client->con->id, source->mount, seconds);
+    client->check_buffer = format_check_timeshift_buffer;
+    return 1;
+}
+
+
 /* call this to verify that the HTTP data has been sent and if so setup
  * callbacks to the appropriate format functions
  */
@@ -238,9 +401,9 @@ int format_check_http_buffer(source_t *source, client_t *client)
             return -1;
         }
         client->respcode = 200;
-        stats_event_inc(NULL, "listeners");
-        stats_event_inc(NULL, "listener_connections");
-        stats_event_inc(source->mount, "listener_connections");
+        stats_global_inc(STATS_GLOBAL_LISTENERS);
+        stats_global_inc(STATS_GLOBAL_LISTENER_CONNECTIONS);
+        stats_counter_inc(source->stats_listener_connections);
     }
 
     if (client->pos == refbuf->len)
@@ -249,27 +412,111 @@ int format_check_http_buffer(source_t *source, client_t *client)
         client->check_buffer = format_check_file_buffer;
         client->intro_offset = 0;
         client->pos = refbuf->len = 4096;
+        timeshift_start (source, client);
         return -1;
     }
     return 0;
 }
 
 
+/* Write as much of the client's buffer as possible. Other users than the
+ * stream queue, like file serving, chain buffers that are not filled yet,
+ * so only this one is sent.
+ */
 int format_generic_write_to_client(client_t *client)
 {
     refbuf_t *refbuf = client->refbuf;
     int ret;
-    const char *buf = refbuf->data + client->pos;
-    unsigned int len = refbuf->len - client->pos;
-
-    ret = client_send_bytes(client, buf, len);
 
+    ret = client_send_bytes(client, refbuf->data + client->pos, refbuf->len - client->pos);
     if (ret > 0)
         client->pos += ret;
 
     return ret;
 }
 
+/* the iovec for the client's buffer and those following it on the queue,
+ * returns the number of entries */
+static inline size_t format_gather_queue(client_t *client, struct iovec *iov)
+{
+    refbuf_t *refbuf = client->refbuf;
+    refbuf_t *next;
+    size_t count;
+    size_t total;
+
+    iov[0].iov_base = refbuf->data + client->pos;
+    iov[0].iov_len = refbuf->len - client->pos;
+    total = iov[0].iov_len;
+    count = 1;
+
+    for (next = refbuf_get_next(refbuf); next && count < FORMAT_MAX_IOV && total < FORMAT_MAX_IOV_BYTES; next = refbuf_get_next(next)) {
+        iov[count].iov_base = next->data;
+        iov[count].iov_len = next->len;
+        total += next->len;
+        count++;
+    }
+
+    return count;
+}
+
+/* Write as much of the stream queue from the client's position as possible
+ * and move the client along the queue as far as it was written. */
+int format_queue_write_to_client(client_t *client)
+{
+    struct iovec iov[FORMAT_MAX_IOV];
+    size_t count = format_gather_queue(client, iov);
+    int ret;
+
+    ret = client_send_vector(client, iov, count);
+    if (ret > 0)
+        format_move_client(client, ret);
+
+    return ret;
+}
+
+/* as format_queue_write_to_client() with MSG_ZEROCOPY, the socket is plain */
+static int format_queue_zerocopy_write_to_client(client_t *client)
+{
+    struct iovec iov[FORMAT_MAX_IOV];
+    size_t count = format_gather_queue(client, iov);
+    ssize_t sent;
+
+    sent = zerocopy_send(client->zerocopy, client->con->sock, iov, count, client->refbuf);
+    connection_sent_on_socket(client->con, sent);
+    if (sent > 0)
+        format_move_client(client, sent);
+
+    return sent < 0 ? -1 : sent;
+}
+
+format_write_func_t format_get_queue_writer(client_t *client)
+{
+    /* TLS encrypts into its own buffers, so it is written the usual way */
+    if (client->zerocopy && connection_get_plain_socket(client->con) != SOCK_ERROR)
+        return format_queue_zerocopy_write_to_client;
+
+    return format_queue_write_to_client;
+}
+
+void format_move_client(client_t *client, unsigned int written)
+{
+    refbuf_t *refbuf = client->refbuf;
+
+    /* move past what was written, at most to the end of the last buffer */
+    while (1) {
+        unsigned int avail = refbuf->len - client->pos;
+
+        if (written <= avail) {
+            client->pos += written;
+            break;
+        }
+
+        written -= avail;
+        client_set_queue(client, refbuf_get_next(refbuf));
+        refbuf = client->refbuf;
+    }
+}
+
 
 /* This is the commonly used for source streams, here we just progress to
  * the next buffer in the queue if there is no more left to be written from
@@ -282,14 +529,15 @@ int format_advance_queue(source_t *source, client_t *client)
     if (refbuf == NULL)
         return -1;
 
-    if (refbuf->next == NULL && client->pos == refbuf->len)
-        return -1;
-
-    /* move to the next buffer if we have finished with the current one */
-    if (refbuf->next && client->pos == refbuf->len)
+    if (client->pos == refbuf->len)
     {
-        client_set_queue (client, refbuf->next);
-        refbuf = client->refbuf;
+        refbuf_t *next = refbuf_get_next(refbuf);
+
+        if (next == NULL)
+            return -1;
+
+        /* move to the next buffer as we have finished with the current one */
+        client_set_queue (client, next);
     }
     return 0;
 }
@@ -352,11 +600,10 @@ static int format_prepare_headers (source_t *source, client_t *client)
         client->respcode = 500;
         return -1;
     } else if (((size_t)bytes + (size_t)1024U) >= remaining) { /* we don't know yet how much to follow but want at least 1kB free space */
-        void *new_ptr = realloc(ptr, bytes + 1024);
-        if (new_ptr) {
+        if (refbuf_resize(client->refbuf, bytes + 1024) == 0) {
             ICECAST_LOG_DEBUG("Client buffer reallocation succeeded.");
-            client->refbuf->data = ptr = new_ptr;
-            client->refbuf->len = remaining = bytes + 1024;
+            ptr = client->refbuf->data;
+            remaining = client->refbuf->len;
             bytes = util_http_build_header(ptr, remaining, 0, 0, 200, NULL, source->format->contenttype, NULL, NULL, source, client);
             if (bytes <= 0 || (size_t)bytes >= remaining) {
                 ICECAST_LOG_ERROR("Dropping client as we can not build response headers.");
@@ -476,6 +723,35 @@ static int format_prepare_headers (source_t *source, client_t *client)
     return 0;
 }
 
+/* How many bytes the plugin should ask for in its next read, at least min.
+ * Reads never wait, so asking for more than there is costs nothing but
+ * buffer space, while asking for too little costs a read per few KB on
+ * high bitrate streams. The size follows the input rate, so a FLAC or
+ * video stream gets fewer and larger reads than a talk stream.
+ */
+size_t format_read_size(format_plugin_t *format, size_t min)
+{
+    uint64_t now = coarsetime_get_ms();
+
+    if (!format->read_rate_start) {
+        format->read_rate_start = now;
+        format->read_rate_bytes = format->read_bytes;
+    } else if (now - format->read_rate_start >= FORMAT_READ_RATE_PERIOD) {
+        uint64_t wanted = (format->read_bytes - format->read_rate_bytes) * FORMAT_READ_INTERVAL / (now - format->read_rate_start);
+        size_t size = 4096;
+
+        while (size < wanted && size < FORMAT_MAX_READ_SIZE)
+            size *= 2;
+        if (size != format->read_size)
+            ICECAST_LOG_DEBUG("Reading %zu bytes at a time from source", size);
+        format->read_size = size;
+        format->read_rate_start = now;
+        format->read_rate_bytes = format->read_bytes;
+    }
+
+    return format->read_size > min ? format->read_size : min;
+}
+
 void format_set_vorbiscomment(format_plugin_t *plugin, const char *tag, const char *value) {
     if (vorbis_comment_query_count(&plugin->vc, tag) != 0) {
         /* delete key */
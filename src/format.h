@@ -36,6 +36,8 @@ typedef enum _format_type_tag
     FORMAT_TYPE_GENERIC
 } format_type_t;
 
+typedef int (*format_write_func_t)(client_t *client);
+
 typedef struct _format_plugin_tag
 {
     format_type_t type;
@@ -44,14 +46,41 @@ typedef struct _format_plugin_tag
     char        *charset;
     uint64_t    read_bytes;
     uint64_t    sent_bytes;
+    /* sync points are far apart, such as the keyframes of video, so the
+     * burst is kept starting on one */
+    int         sparse_sync;
+
+    /* input rate seen by format_read_size() */
+    uint64_t    read_rate_start;
+    uint64_t    read_rate_bytes;
+    size_t      read_size;
 
     refbuf_t *(*get_buffer)(source_t *);
     int (*write_buf_to_client)(client_t *client);
+    /* optional, the write routine for client once it is sent from the
+     * stream queue, picked when it starts on it so the routine does not
+     * need to check the state of the client on every call. NULL to use
+     * write_buf_to_client. */
+    format_write_func_t (*get_queue_writer)(client_t *client);
     void (*write_buf_to_file)(source_t *source, refbuf_t *refbuf);
     int (*create_client_data)(source_t *source, client_t *client);
     void (*set_tag)(struct _format_plugin_tag *plugin, const char *tag, const char *value, const char *charset);
+    /* the plugin and its _state are in the arena of the source, this only
+     * releases what they refer to */
     void (*free_plugin)(struct _format_plugin_tag *self);
     void (*apply_settings)(client_t *client, struct _format_plugin_tag *format, mount_proxy *mount);
+    /* optional, number of bytes of stream headers kept for new listeners */
+    size_t (*get_header_bytes)(struct _format_plugin_tag *self);
+    /* optional, number of bytes used by arenas of the plugin's own */
+    size_t (*get_arena_bytes)(struct _format_plugin_tag *self);
+    /* optional, prepares for reading the stream from a new connection with
+     * the response headers in parser. Returns 0 if it can go on from there. */
+    int (*reset_input)(struct _format_plugin_tag *self, http_parser_t *parser);
+    /* optional, where a listener is in the framing the plugin adds to the
+     * stream, so another process can go on sending to it. Returns -1 if it
+     * can not be stopped at this point. */
+    int (*get_client_position)(client_t *client, unsigned int *position);
+    void (*set_client_position)(client_t *client, unsigned int position);
 
     /* meta data */
     vorbis_comment vc;
@@ -60,19 +89,44 @@ typedef struct _format_plugin_tag
     void *_state;
 } format_plugin_t;
 
+/* limits for gathering queued buffers into a single write. These are sized
+ * so that a listener joining at the burst point gets the default burst-size
+ * worth of small MP3 buffers in one write. */
+#define FORMAT_MAX_IOV          64
+#define FORMAT_MAX_IOV_BYTES    (256*1024)
+
+/* limits for the size of reads from the source. A read asks for about
+ * FORMAT_READ_INTERVAL ms of input at the rate seen over the last
+ * FORMAT_READ_RATE_PERIOD ms. */
+#define FORMAT_MAX_READ_SIZE    (64*1024)
+#define FORMAT_READ_INTERVAL    100
+#define FORMAT_READ_RATE_PERIOD 2000
+
 format_type_t format_get_type(const char *contenttype);
 char *format_get_mimetype(format_type_t type);
 int format_get_plugin(format_type_t type, source_t *source);
 
 int format_generic_write_to_client (client_t *client);
+/* like format_generic_write_to_client() for a client on the stream queue,
+ * gathering the following buffers of the queue into the same write */
+int format_queue_write_to_client (client_t *client);
+/* the queue write routine for client, with MSG_ZEROCOPY if it is set up
+ * for it */
+format_write_func_t format_get_queue_writer(client_t *client);
+/* moves a client on the stream queue past written bytes sent from its position */
+void format_move_client(client_t *client, unsigned int written);
 int format_advance_queue (source_t *source, client_t *client);
 int format_check_http_buffer (source_t *source, client_t *client);
 int format_check_file_buffer (source_t *source, client_t *client);
+int format_check_timeshift_buffer (source_t *source, client_t *client);
+int format_check_handoff_buffer (source_t *source, client_t *client);
 
 
 void format_send_general_headers(format_plugin_t *format, 
         source_t *source, client_t *client);
 
+size_t format_read_size(format_plugin_t *format, size_t min);
+
 void format_set_vorbiscomment(format_plugin_t *plugin, const char *tag, const char *value);
 
 #endif  /* __FORMAT_H__ */
@@ -51,6 +51,11 @@
  */
 #define EBML_SLICE_SIZE 4096
 
+/* The size of the buffer the stream is read into, reads are sized by
+ * format_read_size() within it.
+ */
+#define EBML_INPUT_SIZE FORMAT_MAX_READ_SIZE
+
 /* A value that no EBML var-int is allowed to take. */
 #define EBML_UNKNOWN ((uint_least64_t) -1)
 
@@ -137,11 +142,15 @@ typedef struct ebml_st {
     ebml_keyframe_status cluster_starts_with_keyframe;
     bool flush_cluster;
 
+    /* the cluster data is collected straight into the buffer that is
+     * queued, position bytes of it are used */
     size_t position;
-    unsigned char *buffer;
+    refbuf_t *slice;
 
     size_t input_position;
     unsigned char *input_buffer;
+    /* the parser stopped on a full slice, not for want of input */
+    bool input_blocked;
 
     size_t header_size;
     size_t header_position;
@@ -174,11 +183,12 @@ static int ebml_write_buf_to_client(client_t *client);
 static void ebml_write_buf_to_file(source_t *source, refbuf_t *refbuf);
 static int ebml_create_client_data(source_t *source, client_t *client);
 static void ebml_free_client_data(client_t *client);
+static size_t ebml_get_header_bytes(format_plugin_t *plugin);
 
 static ebml_t *ebml_create();
 static void ebml_destroy(ebml_t *ebml);
 static size_t ebml_read_space(ebml_t *ebml);
-static size_t ebml_read(ebml_t *ebml, char *buffer, size_t len, ebml_chunk_type *chunk_type);
+static refbuf_t *ebml_read(ebml_t *ebml, ebml_chunk_type *chunk_type);
 static unsigned char *ebml_get_write_buffer(ebml_t *ebml, size_t *bytes);
 static ssize_t ebml_wrote(ebml_t *ebml, size_t len);
 static ssize_t ebml_parse_tag(unsigned char      *buffer,
@@ -198,18 +208,24 @@ static inline void ebml_check_track(ebml_t *ebml);
 int format_ebml_get_plugin(source_t *source)
 {
 
-    ebml_source_state_t *ebml_source_state = calloc(1, sizeof(ebml_source_state_t));
-    format_plugin_t *plugin = calloc(1, sizeof(format_plugin_t));
+    ebml_source_state_t *ebml_source_state = arena_alloc(&source->arena, sizeof(ebml_source_state_t));
+    format_plugin_t *plugin = arena_alloc(&source->arena, sizeof(format_plugin_t));
+
+    if (!plugin || !ebml_source_state)
+        return -1;
 
     plugin->get_buffer = ebml_get_buffer;
     plugin->write_buf_to_client = ebml_write_buf_to_client;
     plugin->create_client_data = ebml_create_client_data;
     plugin->free_plugin = ebml_free_plugin;
+    plugin->get_header_bytes = ebml_get_header_bytes;
     plugin->write_buf_to_file = ebml_write_buf_to_file;
     plugin->set_tag = NULL;
     plugin->apply_settings = NULL;
 
     plugin->contenttype = httpp_getvar(source->parser, "content-type");
+    /* sync points are the starts of clusters, seconds apart */
+    plugin->sparse_sync = 1;
 
     plugin->_state = ebml_source_state;
     vorbis_comment_init(&plugin->vc);
@@ -227,9 +243,14 @@ static void ebml_free_plugin(format_plugin_t *plugin)
 
     refbuf_release(ebml_source_state->header);
     ebml_destroy(ebml_source_state->ebml);
-    free(ebml_source_state);
     vorbis_comment_clear(&plugin->vc);
-    free(plugin);
+}
+
+static size_t ebml_get_header_bytes(format_plugin_t *plugin)
+{
+    ebml_source_state_t *ebml_source_state = plugin->_state;
+
+    return ebml_source_state->header ? ebml_source_state->header->len : 0;
 }
 
 /* Write to a client from the header buffer.
@@ -273,7 +294,8 @@ static int ebml_write_buf_to_client (client_t *client)
     {
         /* Now that the header's sent, short-circuit to the generic
          * write-refbufs function. */
-        client->write_to_client = format_generic_write_to_client;
+        client->write_to_client = client->check_buffer == format_advance_queue ?
+            format_get_queue_writer(client) : format_generic_write_to_client;
         return client->write_to_client(client);
     }
 
@@ -298,8 +320,7 @@ static refbuf_t *ebml_get_buffer(source_t *source)
         read_bytes = ebml_read_space(ebml_source_state->ebml);
         if (read_bytes > 0) {
             /* A chunk is available for reading */
-            refbuf = refbuf_new(read_bytes);
-            ebml_read(ebml_source_state->ebml, refbuf->data, read_bytes, &chunk_type);
+            refbuf = ebml_read(ebml_source_state->ebml, &chunk_type);
 
             if (ebml_source_state->header == NULL)
             {
@@ -315,8 +336,20 @@ static refbuf_t *ebml_get_buffer(source_t *source)
             return refbuf;
 
         } else if(read_bytes == 0) {
+            if (ebml_source_state->ebml->input_blocked) {
+                /* Go on with the input that had to wait for the last
+                 * slice, there may be several slices in one read */
+                size_t pending = ebml_source_state->ebml->input_position;
+
+                ebml_wrote(ebml_source_state->ebml, 0);
+                if (ebml_source_state->ebml->input_position != pending)
+                    continue;
+            }
+
             /* Feed more bytes into the parser */
             write_buffer = ebml_get_write_buffer(ebml_source_state->ebml, &write_bytes);
+            if (write_bytes > format_read_size(format, EBML_SLICE_SIZE))
+                write_bytes = format_read_size(format, EBML_SLICE_SIZE);
             read_bytes = client_body_read(source->client, write_buffer, write_bytes);
             if (read_bytes <= 0) {
                 ebml_wrote (ebml_source_state->ebml, 0);
@@ -371,7 +404,7 @@ static void ebml_free_client_data (client_t *client)
 static void ebml_write_buf_to_file_fail (source_t *source)
 {
     ICECAST_LOG_WARN("Write to dump file failed, disabling");
-    fclose (source->dumpfile);
+    dumpfile_close (source->dumpfile);
     source->dumpfile = NULL;
 }
 
@@ -382,15 +415,15 @@ static void ebml_write_buf_to_file (source_t *source, refbuf_t *refbuf)
 
     if ( ! ebml_source_state->file_headers_written)
     {
-        if (fwrite (ebml_source_state->header->data, 1,
-                    ebml_source_state->header->len,
-                    source->dumpfile) != ebml_source_state->header->len)
+        if (dumpfile_write (source->dumpfile, ebml_source_state->header) < 0)
+        {
             ebml_write_buf_to_file_fail(source);
-        else
-            ebml_source_state->file_headers_written = true;
+            return;
+        }
+        ebml_source_state->file_headers_written = true;
     }
 
-    if (fwrite (refbuf->data, 1, refbuf->len, source->dumpfile) != refbuf->len)
+    if (dumpfile_write (source->dumpfile, refbuf) < 0)
     {
         ebml_write_buf_to_file_fail(source);
     }
@@ -404,7 +437,7 @@ static void ebml_destroy(ebml_t *ebml)
 
     free(ebml->header);
     free(ebml->input_buffer);
-    free(ebml->buffer);
+    refbuf_release(ebml->slice);
     free(ebml);
 
 }
@@ -417,8 +450,8 @@ static ebml_t *ebml_create()
     ebml->output_state = EBML_STATE_READING_HEADER;
 
     ebml->header = calloc(1, EBML_HEADER_MAX_SIZE);
-    ebml->buffer = calloc(1, EBML_SLICE_SIZE);
-    ebml->input_buffer = calloc(1, EBML_SLICE_SIZE);
+    ebml->slice = refbuf_new(EBML_SLICE_SIZE);
+    ebml->input_buffer = calloc(1, EBML_INPUT_SIZE);
 
     ebml->cluster_start = -1;
 
@@ -483,53 +516,35 @@ static size_t ebml_read_space(ebml_t *ebml)
     return 0;
 }
 
-/* Return a chunk of the EBML/MKV/WebM stream.
+/* Return a chunk of the EBML/MKV/WebM stream, of the size given by
+ * ebml_read_space, which must not be 0.
  * The header will be buffered until it can be returned as one chunk.
  * A cluster element's opening tag will always start a new chunk.
- * 
+ * Cluster data is not copied again, the buffer it was collected in
+ * is returned.
+ *
  * chunk_type will be set to indicate if the chunk is the header,
  * the start of a cluster, or continuing the current cluster.
  */
-static size_t ebml_read(ebml_t *ebml, char *buffer, size_t len, ebml_chunk_type *chunk_type)
+static refbuf_t *ebml_read(ebml_t *ebml, ebml_chunk_type *chunk_type)
 {
 
     size_t read_space;
-    size_t to_read;
+    refbuf_t *refbuf;
+    refbuf_t *next_slice;
 
     *chunk_type = EBML_CHUNK_HEADER;
 
-    if (len < 1) {
-        return 0;
-    }
-
     switch (ebml->output_state) {
         case EBML_STATE_READING_HEADER:
 
-            if (ebml->header_size != 0)
-            {
-                /* Can read a chunk of the header */
-                read_space = ebml->header_size - ebml->header_read_position;
-
-                if (read_space >= len) {
-                    to_read = len;
-                } else {
-                    to_read = read_space;
-                }
-
-                memcpy(buffer, ebml->header, to_read);
-                ebml->header_read_position += to_read;
-
-                *chunk_type = EBML_CHUNK_HEADER;
-
-                if (ebml->header_read_position == ebml->header_size) {
-                    ebml->output_state = EBML_STATE_READING_CLUSTERS;
-                }
-            } else {
-                /* The header's not ready yet */
-                return 0;
-            }
+            /* The header is read as one chunk */
+            refbuf = refbuf_new(ebml->header_size);
+            memcpy(refbuf->data, ebml->header, ebml->header_size);
+            ebml->header_read_position = ebml->header_size;
+            ebml->output_state = EBML_STATE_READING_CLUSTERS;
 
-            break;
+            return refbuf;
 
         case EBML_STATE_READING_CLUSTERS:
 
@@ -556,30 +571,25 @@ static size_t ebml_read(ebml_t *ebml, char *buffer, size_t len, ebml_chunk_type
                 read_space = ebml->cluster_start;
             }
 
-            if (read_space < 1) {
-                return 0;
-            }
-
-            if (read_space >= len ) {
-                to_read = len;
-            } else {
-                to_read = read_space;
-            }
-
-            memcpy(buffer, ebml->buffer, to_read);
+            /* Hand out the slice, anything past the returned chunk
+             * starts the next one */
+            next_slice = refbuf_new(EBML_SLICE_SIZE);
+            memcpy(next_slice->data, ebml->slice->data + read_space, ebml->position - read_space);
+            ebml->position -= read_space;
 
-            /* Shift unread data down to the start of the buffer */
-            memmove(ebml->buffer, ebml->buffer + to_read, ebml->position - to_read);
-            ebml->position -= to_read;
+            refbuf = ebml->slice;
+            refbuf->len = read_space;
+            ebml->slice = next_slice;
 
             if (ebml->cluster_start > 0) {
-                ebml->cluster_start -= to_read;
+                ebml->cluster_start -= read_space;
             }
 
-            break;
+            return refbuf;
     }
 
-    return to_read;
+    ICECAST_LOG_ERROR("EBML: Invalid parser read state");
+    return NULL;
 
 }
 
@@ -590,7 +600,7 @@ static size_t ebml_read(ebml_t *ebml, char *buffer, size_t len, ebml_chunk_type
  */
 static unsigned char *ebml_get_write_buffer(ebml_t *ebml, size_t *bytes)
 {
-    *bytes = EBML_SLICE_SIZE - ebml->input_position;
+    *bytes = EBML_INPUT_SIZE - ebml->input_position;
     return ebml->input_buffer + ebml->input_position;
 }
 
@@ -615,6 +625,7 @@ static ssize_t ebml_wrote(ebml_t *ebml, size_t len)
 
     ebml->input_position += len;
     end_of_buffer = ebml->input_buffer + ebml->input_position;
+    ebml->input_blocked = false;
 
     while (processing) {
 
@@ -759,6 +770,7 @@ static ssize_t ebml_wrote(ebml_t *ebml, size_t len)
                 if (ebml->cluster_start >= 0) {
                     /* Allow the cluster in the read buffer to flush. */
                     ebml->flush_cluster = true;
+                    ebml->input_blocked = true;
                     processing = false;
                 } else {
 
@@ -800,9 +812,11 @@ static ssize_t ebml_wrote(ebml_t *ebml, size_t len)
                 } else if (ebml->parse_state == EBML_STATE_COPYING_TO_DATA) {
                     if ((ebml->position + to_copy) > EBML_SLICE_SIZE) {
                         to_copy = EBML_SLICE_SIZE - ebml->position;
+                        /* the rest goes on once the slice was read */
+                        ebml->input_blocked = true;
                     }
 
-                    memcpy(ebml->buffer + ebml->position, ebml->input_buffer + cursor, to_copy);
+                    memcpy(ebml->slice->data + ebml->position, ebml->input_buffer + cursor, to_copy);
                     ebml->position += to_copy;
                 }
 
@@ -889,6 +903,24 @@ static ssize_t ebml_parse_tag(unsigned char *buffer,
     return type_length + size_length;
 }
 
+/* Length in bytes of a var-int starting with the given (nonzero) byte,
+ * that is one plus the number of leading zero bits.
+ */
+static inline ssize_t ebml_var_int_size(unsigned char first)
+{
+#if defined(__GNUC__)
+    return __builtin_clz((unsigned int) first) - (int) (8 * (sizeof(unsigned int) - 1)) + 1;
+#else
+    ssize_t size = 1;
+
+    while (!(first & 0x80)) {
+        first <<= 1;
+        size++;
+    }
+    return size;
+#endif
+}
+
 /* Try to parse an EBML variable-length integer.
  * Returns 0 if there's not enough space to read the number;
  * Returns -1 if the number is malformed.
@@ -899,9 +931,8 @@ static ssize_t ebml_parse_var_int(unsigned char *buffer,
                                  unsigned char *buffer_end,
                                  uint_least64_t *out_value)
 {
-    ssize_t size = 1;
+    ssize_t size;
     ssize_t i;
-    unsigned char mask = 0x80;
     uint_least64_t value;
     uint_least64_t unknown_marker;
 
@@ -909,37 +940,30 @@ static ssize_t ebml_parse_var_int(unsigned char *buffer,
         return 0;
     }
 
-    /* find the length marker bit in the first byte */
-    value = buffer[0];
-
-    while (mask) {
-        if (value & mask) {
-            value = value & ~mask;
-            unknown_marker = mask - 1;
-            break;
-        }
-        size++;
-        mask = mask >> 1;
-    }
-
     /* catch malformed number (no prefix) */
-    if (mask == 0) {
+    if (buffer[0] == 0) {
         ICECAST_LOG_DEBUG("Corrupt var-int");
         return -1;
     }
 
+    /* the position of the length marker bit in the first byte gives the
+     * size, this is called for every element so avoid testing the bits
+     * one by one */
+    size = ebml_var_int_size(buffer[0]);
+
     /* catch number bigger than parsing buffer */
     if (buffer + size - 1 >= buffer_end) {
         return 0;
     }
 
     /* read remaining bytes of (big-endian) number */
+    value = buffer[0] & (0x7F >> (size - 1));
     for (i = 1; i < size; i++) {
         value = (value << 8) + buffer[i];
-        unknown_marker = (unknown_marker << 8) + 0xFF;
     }
 
-    /* catch special "unknown" length */
+    /* catch special "unknown" length, all value bits set */
+    unknown_marker = (((uint_least64_t) 1) << (7 * size)) - 1;
 
     if (value == unknown_marker) {
         *out_value = EBML_UNKNOWN;
@@ -948,7 +972,7 @@ static ssize_t ebml_parse_var_int(unsigned char *buffer,
     }
 
 /*
-    ICECAST_LOG_DEBUG("Varint: value %lli, unknown %llu, mask %hhu, size %i", value, unknown_marker, mask, size);
+    ICECAST_LOG_DEBUG("Varint: value %lli, unknown %llu, size %i", value, unknown_marker, size);
 */
 
     return size;
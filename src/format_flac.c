@@ -36,7 +36,6 @@ static void flac_codec_free (ogg_state_t *ogg_info, ogg_codec_t *codec)
     ICECAST_LOG_DEBUG("freeing FLAC codec");
     stats_event (ogg_info->mount, "FLAC_version", NULL);
     ogg_stream_clear (&codec->os);
-    free (codec);
 }
 
 
@@ -84,7 +83,7 @@ static refbuf_t *process_flac_page (ogg_state_t *ogg_info, ogg_codec_t *codec, o
 ogg_codec_t *initial_flac_page (format_plugin_t *plugin, ogg_page *page)
 {
     ogg_state_t *ogg_info = plugin->_state;
-    ogg_codec_t *codec = calloc (1, sizeof (ogg_codec_t));
+    ogg_codec_t *codec = arena_alloc(&ogg_info->codec_arena, sizeof (ogg_codec_t));
     ogg_packet packet;
 
     ogg_stream_init (&codec->os, ogg_page_serialno (page));
@@ -119,7 +118,7 @@ ogg_codec_t *initial_flac_page (format_plugin_t *plugin, ogg_page *page)
     } while (0);
 
     ogg_stream_clear(&codec->os);
-    free(codec);
+    arena_free(&ogg_info->codec_arena, codec, sizeof(ogg_codec_t));
     return NULL;
 }
 
@@ -44,8 +44,6 @@ typedef struct _kate_codec_tag
 
 static void kate_codec_free (ogg_state_t *ogg_info, ogg_codec_t *codec)
 {
-    kate_codec_t *kate = codec->specific;
-
     ICECAST_LOG_DEBUG("freeing kate codec");
     /* TODO: should i replace with something or just remove
     stats_event (ogg_info->mount, "video_bitrate", NULL);
@@ -54,8 +52,6 @@ static void kate_codec_free (ogg_state_t *ogg_info, ogg_codec_t *codec)
     stats_event (ogg_info->mount, "frame_size", NULL);
     */
     ogg_stream_clear (&codec->os);
-    free (kate);
-    free (codec);
 }
 
 
@@ -139,10 +135,10 @@ static refbuf_t *process_kate_page (ogg_state_t *ogg_info, ogg_codec_t *codec, o
 ogg_codec_t *initial_kate_page(format_plugin_t *plugin, ogg_page *page)
 {
     ogg_state_t *ogg_info = plugin->_state;
-    ogg_codec_t *codec = calloc(1, sizeof(ogg_codec_t));
+    ogg_codec_t *codec = arena_alloc(&ogg_info->codec_arena, sizeof(ogg_codec_t));
     ogg_packet packet;
 
-    kate_codec_t *kate_codec = calloc(1, sizeof(kate_codec_t));
+    kate_codec_t *kate_codec = arena_alloc(&ogg_info->codec_arena, sizeof(kate_codec_t));
 
     ogg_stream_init(&codec->os, ogg_page_serialno(page));
     ogg_stream_pagein(&codec->os, page);
@@ -154,8 +150,8 @@ ogg_codec_t *initial_kate_page(format_plugin_t *plugin, ogg_page *page)
     if ((packet.bytes<9) || memcmp(packet.packet, "\x80kate\0\0\0\0", 9))
     {
         ogg_stream_clear (&codec->os);
-        free (kate_codec);
-        free (codec);
+        arena_free (&ogg_info->codec_arena, kate_codec, sizeof (kate_codec_t));
+        arena_free (&ogg_info->codec_arena, codec, sizeof (ogg_codec_t));
         return NULL;
     }
 
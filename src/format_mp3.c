@@ -39,6 +39,8 @@
 #include "stats.h"
 #include "format.h"
 #include "common/httpp/httpp.h"
+#include "common/timing/timing.h"
+#include "coarsetime.h"
 
 #include "logging.h"
 
@@ -51,17 +53,38 @@
  */
 #define ICY_METADATA_INTERVAL 16000
 
+/* default size of the buffers the input is read into, and the default limit
+ * (in ms) on filling them when a larger size is configured */
+#define MP3_INGEST_SIZE     1400
+#define MP3_INGEST_LATENCY  100
+
+/* kinds of frames looked for to find starting points for listeners */
+#define MP3_FRAMES_NONE     0
+#define MP3_FRAMES_MPEG     1
+#define MP3_FRAMES_ADTS     2
+/* bytes needed to work out the length of a frame */
+#define MP3_FRAME_HEADER    6
+
 static void format_mp3_free_plugin(format_plugin_t *self);
 static refbuf_t *mp3_get_filter_meta (source_t *source);
 static refbuf_t *mp3_get_no_meta (source_t *source);
 
 static int  format_mp3_create_client_data (source_t *source, client_t *client);
+static int  format_mp3_get_client_position (client_t *client, unsigned int *position);
+static void format_mp3_set_client_position (client_t *client, unsigned int position);
 static void free_mp3_client_data (client_t *client);
 static int format_mp3_write_buf_to_client(client_t *client);
+static format_write_func_t format_mp3_get_queue_writer(client_t *client);
 static void write_mp3_to_file (source_t *source, refbuf_t *refbuf);
 static void mp3_set_tag (format_plugin_t *plugin, const char *tag, const char *in_value, const char *charset);
 static void format_mp3_apply_settings(client_t *client, format_plugin_t *format, mount_proxy *mount);
+static int format_mp3_reset_input(format_plugin_t *plugin, http_parser_t *parser);
 
+/* The metadata block built last. Mounts that carry the same song, like
+ * mirrors updated together, reference it instead of each having a copy.
+ */
+static mutex_t mp3_shared_metadata_lock;
+static refbuf_t *mp3_shared_metadata;
 
 typedef struct {
     unsigned int interval;
@@ -71,23 +94,80 @@ typedef struct {
     refbuf_t *associated;
 } mp3_client_data;
 
+/* Queue refbufs get a variant holding the mp3 data followed by the metadata
+ * block if one is due at its end, as it is sent to listeners with ICY
+ * metadata. This header is at the start of the variant's data and gives
+ * the listener state the variant was rendered for. The metadata sent last
+ * before it is the variant's associated refbuf. Only listeners in exactly
+ * that state can be sent the variant.
+ */
+typedef struct {
+    unsigned int interval;
+    /* since_meta_block at the start of the refbuf */
+    unsigned int phase;
+} mp3_variant_t;
+
+#define MP3_VARIANT_DATA(v)     ((v)->data + sizeof(mp3_variant_t))
+#define MP3_VARIANT_LEN(v)      ((v)->len - sizeof(mp3_variant_t))
+
+void format_mp3_initialize(void)
+{
+    thread_mutex_create(&mp3_shared_metadata_lock);
+}
+
+void format_mp3_shutdown(void)
+{
+    thread_mutex_lock(&mp3_shared_metadata_lock);
+    refbuf_release(mp3_shared_metadata);
+    mp3_shared_metadata = NULL;
+    thread_mutex_unlock(&mp3_shared_metadata_lock);
+    thread_mutex_destroy(&mp3_shared_metadata_lock);
+}
+
+/* returns a reference to a refbuf holding the given metadata block */
+static refbuf_t *mp3_share_metadata(const char *block, size_t size)
+{
+    refbuf_t *p;
+
+    thread_mutex_lock(&mp3_shared_metadata_lock);
+    p = mp3_shared_metadata;
+    if (p && p->len == size && memcmp(p->data, block, size) == 0) {
+        refbuf_addref(p);
+    } else {
+        p = refbuf_new(size);
+        memcpy(p->data, block, size);
+        refbuf_release(mp3_shared_metadata);
+        refbuf_addref(p);
+        mp3_shared_metadata = p;
+    }
+    thread_mutex_unlock(&mp3_shared_metadata_lock);
+
+    return p;
+}
+
 int format_mp3_get_plugin(source_t *source)
 {
     const char *metadata;
     format_plugin_t *plugin;
-    mp3_state *state = calloc(1, sizeof(mp3_state));
+    mp3_state *state = arena_alloc(&source->arena, sizeof(mp3_state));
     refbuf_t *meta;
 
-    plugin = (format_plugin_t *) calloc(1, sizeof(format_plugin_t));
+    plugin = arena_alloc(&source->arena, sizeof(format_plugin_t));
+    if (!plugin || !state)
+        return -1;
 
     plugin->type = FORMAT_TYPE_GENERIC;
     plugin->get_buffer = mp3_get_no_meta;
     plugin->write_buf_to_client = format_mp3_write_buf_to_client;
+    plugin->get_queue_writer = format_mp3_get_queue_writer;
     plugin->write_buf_to_file = write_mp3_to_file;
     plugin->create_client_data = format_mp3_create_client_data;
     plugin->free_plugin = format_mp3_free_plugin;
     plugin->set_tag = mp3_set_tag;
     plugin->apply_settings = format_mp3_apply_settings;
+    plugin->reset_input = format_mp3_reset_input;
+    plugin->get_client_position = format_mp3_get_client_position;
+    plugin->set_client_position = format_mp3_set_client_position;
 
     plugin->contenttype = httpp_getvar(source->parser, "content-type");
     if (plugin->contenttype == NULL) {
@@ -103,6 +183,14 @@ int format_mp3_get_plugin(source_t *source)
     memcpy (meta->data, "\001StreamTitle='';", 17);
     state->metadata = meta;
     state->interval = -1;
+    state->ingest_size = MP3_INGEST_SIZE;
+
+    if (strcasecmp (plugin->contenttype, "audio/mpeg") == 0)
+        state->frame_type = MP3_FRAMES_MPEG;
+    else if (strcasecmp (plugin->contenttype, "audio/aac") == 0 ||
+            strcasecmp (plugin->contenttype, "audio/aacp") == 0 ||
+            strcasecmp (plugin->contenttype, "audio/x-aac") == 0)
+        state->frame_type = MP3_FRAMES_ADTS;
 
     metadata = httpp_getvar (source->parser, "icy-metaint");
     if (metadata)
@@ -207,6 +295,8 @@ static void format_mp3_apply_settings (client_t *client, format_plugin_t *format
     mp3_state *source_mp3 = format->_state;
 
     source_mp3->interval = -1;
+    source_mp3->ingest_size = MP3_INGEST_SIZE;
+    source_mp3->ingest_latency = 0;
     free (format->charset);
     format->charset = NULL;
 
@@ -216,6 +306,15 @@ static void format_mp3_apply_settings (client_t *client, format_plugin_t *format
             source_mp3->interval = mount->mp3_meta_interval;
         if (mount->charset)
             format->charset = strdup (mount->charset);
+        if (mount->ingest_buffer_size)
+        {
+            source_mp3->ingest_size = mount->ingest_buffer_size;
+            /* larger buffers take longer to fill, do not hold them forever */
+            if (mount->ingest_buffer_size > MP3_INGEST_SIZE)
+                source_mp3->ingest_latency = MP3_INGEST_LATENCY;
+        }
+        if (mount->ingest_latency)
+            source_mp3->ingest_latency = mount->ingest_latency;
     }
     if (source_mp3->interval < 0)
     {
@@ -235,10 +334,13 @@ static void format_mp3_apply_settings (client_t *client, format_plugin_t *format
     }
 
     ICECAST_LOG_DEBUG("sending metadata interval %d", source_mp3->interval);
+    ICECAST_LOG_DEBUG("ingest buffer size %d, latency %u ms", source_mp3->ingest_size, source_mp3->ingest_latency);
     ICECAST_LOG_DEBUG("charset %s", format->charset);
 }
 
 
+#define MAX_META_LEN 255*16
+
 /* called from the source thread when the metadata has been updated.
  * The artist title are checked and made ready for clients to send
  */
@@ -254,7 +356,8 @@ static void mp3_set_title(source_t *source)
     char *url = NULL;
     size_t size;
     unsigned char len_byte;
-    refbuf_t *p;
+    char block[MAX_META_LEN + 1];
+    int r;
     unsigned int len = sizeof(streamtitle) + 2; /* the StreamTitle, quotes, ; and null */
     mp3_state *source_mp3 = source->format->_state;
     const char *charset = source->format->charset;
@@ -288,7 +391,6 @@ static void mp3_set_title(source_t *source)
             len += strlen(url) + strlen(streamurl) + 2;
     }
 
-#define MAX_META_LEN 255*16
     if (len > MAX_META_LEN)
     {
         thread_mutex_unlock (&source_mp3->url_lock);
@@ -304,42 +406,37 @@ static void mp3_set_title(source_t *source)
     /* now we know how much space to allocate, +1 for the len byte */
     size = len_byte * 16 + 1;
 
-    p = refbuf_new (size);
-    if (p)
-    {
-        mp3_state *source_mp3 = source->format->_state;
-        int r;
-
-        memset (p->data, '\0', size);
-        if (url_artist && url_title) {
-            r = snprintf (p->data, size, "%c%s%s - %s';", len_byte, streamtitle,
-                    url_artist, url_title);
-        } else if (url_title) {
-            r = snprintf (p->data, size, "%c%s%s';", len_byte, streamtitle,
-                    url_title);
-        } else {
-            r = snprintf (p->data, size, "%c%s';", len_byte, streamtitle);
-        }
+    memset (block, '\0', size);
+    if (url_artist && url_title) {
+        r = snprintf (block, size, "%c%s%s - %s';", len_byte, streamtitle,
+                url_artist, url_title);
+    } else if (url_title) {
+        r = snprintf (block, size, "%c%s%s';", len_byte, streamtitle,
+                url_title);
+    } else {
+        r = snprintf (block, size, "%c%s';", len_byte, streamtitle);
+    }
 
-        if (r > 0)
+    if (r > 0)
+    {
+        if (source_mp3->inline_url)
         {
-            if (source_mp3->inline_url)
-            {
-                char *end = strstr (source_mp3->inline_url, "';");
-                ssize_t urllen = size;
-                if (end) urllen = end - source_mp3->inline_url + 2;
-                if ((ssize_t)(size-r) > urllen)
-                    snprintf (p->data+r, size-r, "StreamUrl='%s';", source_mp3->inline_url+11);
-            }
-            else if (url)
-                snprintf (p->data+r, size-r, "StreamUrl='%s';", url);
+            char *end = strstr (source_mp3->inline_url, "';");
+            ssize_t urllen = size;
+            if (end) urllen = end - source_mp3->inline_url + 2;
+            if ((ssize_t)(size-r) > urllen)
+                snprintf (block+r, size-r, "StreamUrl='%s';", source_mp3->inline_url+11);
         }
-        ICECAST_LOG_DEBUG("shoutcast metadata block setup with %s", p->data+1);
-        filter_shoutcast_metadata (source, p->data, size, false);
-
-        refbuf_release (source_mp3->metadata);
-        source_mp3->metadata = p;
+        else if (url)
+            snprintf (block+r, size-r, "StreamUrl='%s';", url);
     }
+    ICECAST_LOG_DEBUG("shoutcast metadata block setup with %s", block+1);
+    filter_shoutcast_metadata (source, block, size, false);
+
+    /* the block is built on the stack so an identical one of another
+     * mount can be used instead of allocating a new one */
+    refbuf_release (source_mp3->metadata);
+    source_mp3->metadata = mp3_share_metadata (block, size);
     thread_mutex_unlock (&source_mp3->url_lock);
 
     free(url_artist);
@@ -348,136 +445,274 @@ static void mp3_set_title(source_t *source)
 }
 
 
-/* send the appropriate metadata, and return the number of bytes written
- * which is 0 or greater.  Check the client in_metadata value afterwards
- * to see if all metadata has been sent
+/* return the metadata block to send after the data of a refbuf with the
+ * given associated metadata. last is the metadata the client got last time
+ * and offset how much of the block has been sent already.
  */
-static int send_stream_metadata (client_t *client, refbuf_t *associated)
+static const char *get_stream_metadata (refbuf_t *associated, refbuf_t *last, int offset, unsigned int *len)
 {
-    int ret = 0;
-    char *metadata;
-    int meta_len;
-    mp3_client_data *client_mp3 = client->format_data;
-
     /* If there is a change in metadata then send it else
      * send a single zero value byte in its place
      */
-    if (associated && associated != client_mp3->associated)
+    if (associated && associated != last)
     {
-        metadata = associated->data + client_mp3->metadata_offset;
-        meta_len = associated->len - client_mp3->metadata_offset;
+        *len = associated->len - offset;
+        return associated->data + offset;
     }
-    else
+    if (associated)
     {
-        if (associated)
-        {
-            metadata = "\0";
-            meta_len = 1;
-        }
-        else
-        {
-            char *meta = "\001StreamTitle='';";
-            metadata = meta + client_mp3->metadata_offset;
-            meta_len = 17 - client_mp3->metadata_offset;
-        }
+        *len = 1;
+        return "\0";
     }
-    ret = client_send_bytes(client, metadata, meta_len);
+    *len = 17 - offset;
+    return "\001StreamTitle='';" + offset;
+}
 
-    if (ret == meta_len)
-    {
-        client_mp3->associated = associated;
-        client_mp3->metadata_offset = 0;
-        client_mp3->in_metadata = 0;
-        client_mp3->since_meta_block = 0;
-        return ret;
-    }
-    if (ret > 0)
-        client_mp3->metadata_offset += ret;
-    else
-        ret = 0;
-    client_mp3->in_metadata = 1;
 
-    return ret;
-}
+typedef enum {
+    MP3_PIECE_DATA,
+    MP3_PIECE_METADATA,
+    MP3_PIECE_VARIANT
+} mp3_piece_type_t;
 
+/* one entry of a gathered write, either mp3 data from refbuf starting at
+ * pos, the metadata block following it, or the refbuf's variant from
+ * offset pos */
+typedef struct {
+    refbuf_t *refbuf;
+    unsigned int pos;
+    mp3_piece_type_t type;
+} mp3_write_piece_t;
+
+/* return the variant of refbuf if it has been rendered for a listener in
+ * the given state, NULL otherwise */
+static refbuf_t *get_variant (mp3_client_data *client_mp3, refbuf_t *refbuf,
+        unsigned int pos, unsigned int since_meta_block, refbuf_t *associated)
+{
+    refbuf_t *variant = refbuf->variant;
+    const mp3_variant_t *header;
+
+    if (variant == NULL || client_mp3->interval == 0)
+        return NULL;
 
-/* Handler for writing mp3 data to a client, taking into account whether
- * client has requested shoutcast style metadata updates
+    header = (const mp3_variant_t *)variant->data;
+    if (header->interval != client_mp3->interval || variant->associated != associated)
+        return NULL;
+    if (since_meta_block < pos || since_meta_block - pos != header->phase)
+        return NULL;
+
+    return variant;
+}
+
+/* Writes mp3 data to a client that requested shoutcast style metadata
+ * updates. With gather set the client is reading from the stream queue and
+ * several refbufs are sent in one write, with the metadata blocks put in
+ * between where needed. Where possible the variant the source has prepared
+ * is sent instead, so that the metadata does not need to be handled per
+ * client. Inlined into a routine for each, so neither checks which it is.
  */
-static int format_mp3_write_buf_to_client(client_t *client)
+static inline int mp3_write_to_client(client_t *client, const int gather)
 {
-    int ret, written = 0;
     mp3_client_data *client_mp3 = client->format_data;
+    struct iovec iov[FORMAT_MAX_IOV];
+    mp3_write_piece_t piece[FORMAT_MAX_IOV];
     refbuf_t *refbuf = client->refbuf;
-    char *buf = refbuf->data + client->pos;
-    unsigned int len = refbuf->len - client->pos;
-
-    do
+    unsigned int pos = client->pos;
+    unsigned int since_meta_block = client_mp3->since_meta_block;
+    int metadata_offset = client_mp3->metadata_offset;
+    int in_metadata = client_mp3->in_metadata;
+    refbuf_t *associated = client_mp3->associated;
+    size_t count = 0;
+    size_t total = 0;
+    size_t i;
+    int ret, left;
+
+    /* work out what to send, without changing the client */
+    while (count < FORMAT_MAX_IOV && total < FORMAT_MAX_IOV_BYTES)
     {
-        /* send any unwritten metadata to the client */
-        if (client_mp3->in_metadata)
+        refbuf_t *variant;
+        unsigned int len;
+
+        if (pos == refbuf->len && !in_metadata)
         {
-            refbuf_t *associated = refbuf->associated;
-            ret = send_stream_metadata(client, associated);
+            refbuf_t *next = gather ? refbuf_get_next (refbuf) : NULL;
 
-            if (client_mp3->in_metadata)
+            if (next == NULL)
                 break;
-            written += ret;
+            refbuf = next;
+            pos = 0;
+            continue;
         }
-        /* see if we need to send the current metadata to the client */
-        if (client_mp3->interval)
-        {
-            unsigned int remaining = client_mp3->interval -
-                client_mp3->since_meta_block;
 
-            /* leading up to sending the metadata block */
-            if (remaining <= len)
+        variant = gather ? get_variant (client_mp3, refbuf, pos, since_meta_block, associated) : NULL;
+        if (variant)
+        {
+            const mp3_variant_t *header = (const mp3_variant_t *)variant->data;
+            unsigned int start = in_metadata ? refbuf->len + metadata_offset : pos;
+
+            piece[count].refbuf = refbuf;
+            piece[count].pos = start;
+            piece[count].type = MP3_PIECE_VARIANT;
+            iov[count].iov_base = MP3_VARIANT_DATA(variant) + start;
+            iov[count].iov_len = MP3_VARIANT_LEN(variant) - start;
+            total += iov[count].iov_len;
+            count++;
+
+            if (MP3_VARIANT_LEN(variant) > refbuf->len)
             {
-                /* send any mp3 before the metadata block */
-                if (remaining)
-                {
-                    ret = client_send_bytes (client, buf, remaining);
-
-                    if (ret > 0)
-                    {
-                        client_mp3->since_meta_block += ret;
-                        client->pos += ret;
-                    }
-                    if (ret < (int)remaining)
-                        break;
-                    written += ret;
-                }
-                ret = send_stream_metadata (client, refbuf->associated);
-                if (client_mp3->in_metadata)
-                    break;
-                written += ret;
-                buf += remaining;
-                len -= remaining;
-                /* limit how much mp3 we send if using small intervals */
-                if (len > client_mp3->interval)
-                    len = client_mp3->interval;
+                associated = refbuf->associated;
+                since_meta_block = 0;
             }
+            else
+                since_meta_block = header->phase + refbuf->len;
+            pos = refbuf->len;
+            metadata_offset = 0;
+            in_metadata = 0;
+            continue;
+        }
+
+        if (in_metadata)
+        {
+            const char *metadata = get_stream_metadata (refbuf->associated, associated, metadata_offset, &len);
+
+            piece[count].refbuf = refbuf;
+            piece[count].pos = pos;
+            piece[count].type = MP3_PIECE_METADATA;
+            iov[count].iov_base = (void *)metadata;
+            iov[count].iov_len = len;
+            total += len;
+            count++;
+
+            associated = refbuf->associated;
+            metadata_offset = 0;
+            since_meta_block = 0;
+            in_metadata = 0;
+            continue;
+        }
+
+        /* stop at the metadata block if it is due within this refbuf */
+        len = refbuf->len - pos;
+        if (client_mp3->interval && client_mp3->interval - since_meta_block <= len)
+        {
+            len = client_mp3->interval - since_meta_block;
+            in_metadata = 1;
         }
-        /* write any mp3, maybe after the metadata block */
+
         if (len)
         {
-            ret = client_send_bytes (client, buf, len);
+            piece[count].refbuf = refbuf;
+            piece[count].pos = pos;
+            piece[count].type = MP3_PIECE_DATA;
+            iov[count].iov_base = refbuf->data + pos;
+            iov[count].iov_len = len;
+            total += len;
+            count++;
+
+            pos += len;
+            since_meta_block += len;
+        }
+    }
 
-            if (ret > 0)
-            {
-                client_mp3->since_meta_block += ret;
-                client->pos += ret;
-            }
-            if (ret < (int)len)
+    if (count == 0)
+        return 0;
+
+    ret = client_send_vector (client, iov, count);
+    if (ret <= 0)
+        return ret;
+
+    /* now move the client along as far as the data has been written */
+    left = ret;
+    for (i = 0; i < count; i++)
+    {
+        unsigned int part = iov[i].iov_len;
+
+        if ((unsigned int)left < part)
+            part = left;
+        left -= part;
+
+        if (piece[i].refbuf != client->refbuf)
+            client_set_queue (client, piece[i].refbuf);
+
+        switch (piece[i].type)
+        {
+            case MP3_PIECE_DATA:
+                client->pos = piece[i].pos + part;
+                client_mp3->since_meta_block += part;
+                break;
+            case MP3_PIECE_METADATA:
+                if (part == iov[i].iov_len)
+                {
+                    client_mp3->associated = piece[i].refbuf->associated;
+                    client_mp3->metadata_offset = 0;
+                    client_mp3->in_metadata = 0;
+                    client_mp3->since_meta_block = 0;
+                }
+                else
+                {
+                    client_mp3->metadata_offset += part;
+                    client_mp3->in_metadata = 1;
+                }
+                break;
+            case MP3_PIECE_VARIANT:
+                {
+                    refbuf_t *variant = piece[i].refbuf->variant;
+                    const mp3_variant_t *header = (const mp3_variant_t *)variant->data;
+                    unsigned int len = piece[i].refbuf->len;
+                    unsigned int end = piece[i].pos + part;
+
+                    if (MP3_VARIANT_LEN(variant) == len || end < len)
+                    {
+                        /* still in the mp3 data */
+                        client->pos = end;
+                        client_mp3->since_meta_block = header->phase + end;
+                    }
+                    else if (end == MP3_VARIANT_LEN(variant))
+                    {
+                        client->pos = len;
+                        client_mp3->associated = piece[i].refbuf->associated;
+                        client_mp3->metadata_offset = 0;
+                        client_mp3->in_metadata = 0;
+                        client_mp3->since_meta_block = 0;
+                    }
+                    else
+                    {
+                        /* stopped at or within the metadata block */
+                        client->pos = len;
+                        client_mp3->metadata_offset = end - len;
+                        client_mp3->in_metadata = 1;
+                        client_mp3->since_meta_block = header->phase + len;
+                    }
+                }
                 break;
-            written += ret;
         }
-        ret = 0;
-    } while (0);
 
-    if (ret > 0)
-        written += ret;
-    return written;
+        if (part < iov[i].iov_len)
+            break;
+    }
+
+    return ret;
+}
+
+/* before the client is on the stream queue, like while sending the intro */
+static int format_mp3_write_buf_to_client(client_t *client)
+{
+    return mp3_write_to_client(client, 0);
+}
+
+static int format_mp3_write_queue_to_client(client_t *client)
+{
+    return mp3_write_to_client(client, 1);
+}
+
+/* without metadata the stream queue is sent as it is */
+static format_write_func_t format_mp3_get_queue_writer(client_t *client)
+{
+    mp3_client_data *client_mp3 = client->format_data;
+
+    if (client_mp3->interval == 0)
+        return format_generic_write_to_client;
+
+    return format_mp3_write_queue_to_client;
 }
 
 static void format_mp3_free_plugin(format_plugin_t *self)
@@ -489,9 +724,9 @@ static void format_mp3_free_plugin(format_plugin_t *self)
     free(self->charset);
     refbuf_release(state->metadata);
     refbuf_release(state->read_data);
-    free(state);
+    refbuf_release(state->filter_data);
+    refbuf_release(state->render_associated);
     vorbis_comment_clear(&self->vc);
-    free(self);
 
     global_lock();
     global.sources_legacy--;
@@ -499,10 +734,199 @@ static void format_mp3_free_plugin(format_plugin_t *self)
 }
 
 
+/* The stream goes on from a new connection. The inline metadata of the
+ * input has to come at the same interval, what listeners get is left as it
+ * is. A partly filled read is dropped, it is from the old connection. */
+static int format_mp3_reset_input(format_plugin_t *plugin, http_parser_t *parser)
+{
+    mp3_state *state = plugin->_state;
+    const char *metadata = httpp_getvar (parser, "icy-metaint");
+    int interval = metadata ? atoi (metadata) : 0;
+
+    if ((interval > 0 ? interval : 0) != (state->inline_metadata_interval > 0 ? state->inline_metadata_interval : 0))
+    {
+        ICECAST_LOG_WARN("New input has a different metadata interval (%d, was %d)", interval, state->inline_metadata_interval);
+        return -1;
+    }
+
+    refbuf_release (state->read_data);
+    state->read_data = NULL;
+    state->read_count = 0;
+    refbuf_release (state->filter_data);
+    state->filter_data = NULL;
+    state->offset = 0;
+    state->build_metadata_len = 0;
+    state->build_metadata_offset = 0;
+    state->frame_synced = 0;
+    state->frame_remaining = 0;
+
+    return 0;
+}
+
+
+/* number of bytes to read for the next refbuf. Reads never go past the next
+ * metadata block of the shared rendering, so the mp3 data ends up in the
+ * refbuf before it and the block always goes at the end of a refbuf.
+ */
+static int read_target (mp3_state *source_mp3, int size)
+{
+    if (source_mp3->interval > 0 && (unsigned int)source_mp3->interval == source_mp3->render_interval)
+    {
+        unsigned int remaining = source_mp3->render_interval - source_mp3->render_phase;
+
+        if (remaining < (unsigned int)size)
+            size = remaining;
+        /* an earlier read may have been larger if the interval changed */
+        if (size < source_mp3->read_count)
+            size = source_mp3->read_count;
+    }
+    return size;
+}
+
+
+/* length of the MPEG audio frame with the header at p, 0 if there is no
+ * valid header there */
+static unsigned int mpeg_frame_len (const unsigned char *p)
+{
+    static const unsigned short bitrates[5][15] = {
+        { 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },
+        { 0, 32, 48, 56,  64,  80,  96, 112, 128, 160, 192, 224, 256, 320, 384 },
+        { 0, 32, 40, 48,  56,  64,  80,  96, 112, 128, 160, 192, 224, 256, 320 },
+        { 0, 32, 48, 56,  64,  80,  96, 112, 128, 144, 160, 176, 192, 224, 256 },
+        { 0,  8, 16, 24,  32,  40,  48,  56,  64,  80,  96, 112, 128, 144, 160 }
+    };
+    static const unsigned int samplerates[3] = { 44100, 48000, 32000 };
+    unsigned int version = (p[1] >> 3) & 3;   /* 0 = 2.5, 2 = 2, 3 = 1 */
+    unsigned int layer = 4 - ((p[1] >> 1) & 3); /* 4 is reserved */
+    unsigned int bitrate_index = p[2] >> 4;
+    unsigned int rate_index = (p[2] >> 2) & 3;
+    unsigned int padding = (p[2] >> 1) & 1;
+    unsigned int bitrate, samplerate;
+
+    if (p[0] != 0xFF || (p[1] & 0xE0) != 0xE0 || version == 1 || layer == 4 ||
+            bitrate_index == 0 || bitrate_index == 15 || rate_index == 3)
+        return 0;
+
+    samplerate = samplerates[rate_index] >> (version == 3 ? 0 : version == 2 ? 1 : 2);
+    if (version == 3)
+        bitrate = bitrates[layer - 1][bitrate_index] * 1000;
+    else
+        bitrate = bitrates[layer == 1 ? 3 : 4][bitrate_index] * 1000;
+
+    if (layer == 1)
+        return (12 * bitrate / samplerate + padding) * 4;
+    if (layer == 3 && version != 3)
+        return 72 * bitrate / samplerate + padding;
+    return 144 * bitrate / samplerate + padding;
+}
+
+
+/* length of the ADTS (AAC) frame with the header at p, 0 if there is no
+ * valid header there */
+static unsigned int adts_frame_len (const unsigned char *p)
+{
+    unsigned int len;
+
+    if (p[0] != 0xFF || (p[1] & 0xF6) != 0xF0 || ((p[2] >> 2) & 0xF) > 12)
+        return 0;
+    len = ((p[3] & 3) << 11) | (p[4] << 3) | (p[5] >> 5);
+    return len < 7 ? 0 : len;
+}
+
+
+static unsigned int mp3_frame_len (mp3_state *source_mp3, const unsigned char *p)
+{
+    if (source_mp3->frame_type == MP3_FRAMES_ADTS)
+        return adts_frame_len (p);
+    return mpeg_frame_len (p);
+}
+
+
+/* Mark where in refbuf listeners can start, which is the first frame header
+ * in it. Frames are followed from buffer to buffer, if that fails the next
+ * header is searched for and only taken if the frame after it starts with a
+ * header as well (or is beyond the buffer). Without any frame to be found
+ * the buffer is used as is, like for streams of other types, so listeners
+ * are never held up.
+ */
+static void mp3_mark_sync (mp3_state *source_mp3, refbuf_t *refbuf)
+{
+    const unsigned char *data = (const unsigned char *)refbuf->data;
+    unsigned int len = refbuf->len;
+    unsigned int pos = 0;
+    int first = -1;
+
+    refbuf->sync_point = 1;
+    refbuf->sync_offset = 0;
+    if (source_mp3->frame_type == MP3_FRAMES_NONE)
+        return;
+
+    if (source_mp3->frame_synced)
+    {
+        if (source_mp3->frame_remaining >= len)
+        {
+            /* all of it is the middle of a frame */
+            source_mp3->frame_remaining -= len;
+            refbuf->sync_point = 0;
+            return;
+        }
+        pos = source_mp3->frame_remaining;
+    }
+
+    while (pos < len)
+    {
+        const unsigned char *header;
+        unsigned int frame_len;
+
+        if (source_mp3->frame_synced)
+        {
+            if (len - pos < MP3_FRAME_HEADER)
+            {
+                /* header split over two buffers, search the next one */
+                source_mp3->frame_synced = 0;
+                break;
+            }
+            frame_len = mp3_frame_len (source_mp3, data + pos);
+            if (frame_len == 0)
+            {
+                source_mp3->frame_synced = 0;
+                continue;
+            }
+            if (first < 0)
+                first = pos;
+            pos += frame_len;
+            continue;
+        }
+
+        header = memchr (data + pos, 0xFF, len - pos);
+        if (header == NULL || (unsigned int)(data + len - header) < MP3_FRAME_HEADER)
+            break;
+        pos = header - data;
+        frame_len = mp3_frame_len (source_mp3, header);
+        if (frame_len == 0 || (pos + frame_len + MP3_FRAME_HEADER <= len &&
+                    mp3_frame_len (source_mp3, header + frame_len) == 0))
+        {
+            pos++;
+            continue;
+        }
+        source_mp3->frame_synced = 1;
+    }
+
+    if (source_mp3->frame_synced)
+        source_mp3->frame_remaining = pos - len;
+    if (first >= 0)
+        refbuf->sync_offset = first;
+    else if (source_mp3->frame_synced)
+        refbuf->sync_point = 0;
+}
+
+
 /* This does the actual reading, making sure the read data is packaged in
- * blocks of 1400 bytes (near the common MTU size). This is because many
- * incoming streams come in small packets which could waste a lot of
- * bandwidth with many listeners due to headers and such like.
+ * blocks of ingest_size bytes, by default 1400 (near the common MTU size).
+ * This is because many incoming streams come in small packets which could
+ * waste a lot of bandwidth with many listeners due to headers and such like.
+ * Larger blocks mean fewer buffers on the queue for each listener to go
+ * through, at the cost of latency, which ingest_latency limits.
  */
 static int complete_read(source_t *source)
 {
@@ -511,17 +935,19 @@ static int complete_read(source_t *source)
     mp3_state *source_mp3 = format->_state;
     char *buf;
     refbuf_t *refbuf;
-
-#define REFBUF_SIZE 1400
+    int target;
 
     if (source_mp3->read_data == NULL)
     {
-        source_mp3->read_data = refbuf_new (REFBUF_SIZE);
+        /* the size is kept in case the settings change while it fills */
+        source_mp3->read_size = source_mp3->ingest_size;
+        source_mp3->read_data = refbuf_new (source_mp3->read_size);
         source_mp3->read_count = 0;
     }
     buf = source_mp3->read_data->data + source_mp3->read_count;
+    target = read_target (source_mp3, source_mp3->read_size);
 
-    bytes = client_body_read(source->client, buf, REFBUF_SIZE-source_mp3->read_count);
+    bytes = client_body_read(source->client, buf, target-source_mp3->read_count);
     if (bytes < 0)
     {
         /* Why do we do this here (not source.c)? -- ph3-der-loewe, 2018-04-17 */
@@ -532,24 +958,92 @@ static int complete_read(source_t *source)
         }
         return 0;
     }
+    if (source_mp3->read_count == 0 && bytes > 0)
+        source_mp3->read_start = coarsetime_get_ms();
     source_mp3->read_count += bytes;
     refbuf = source_mp3->read_data;
     refbuf->len = source_mp3->read_count;
     format->read_bytes += bytes;
 
-    if (source_mp3->read_count < REFBUF_SIZE)
+    if (source_mp3->read_count < target)
     {
         if (source_mp3->read_count == 0)
         {
             refbuf_release (source_mp3->read_data);
             source_mp3->read_data = NULL;
+            return 0;
         }
-        return 0;
+        if (source_mp3->ingest_latency == 0 ||
+                coarsetime_get_ms() - source_mp3->read_start < source_mp3->ingest_latency)
+            return 0;
     }
     return 1;
 }
 
 
+/* Prepare the variant of a new queue refbuf for listeners with ICY metadata,
+ * so they do not need to be handled one by one. Called by the source thread
+ * once the refbuf has its metadata associated.
+ */
+static void mp3_render_variant (mp3_state *source_mp3, refbuf_t *refbuf)
+{
+    unsigned int interval = source_mp3->interval > 0 ? source_mp3->interval : 0;
+    unsigned int phase, meta_len = 0;
+    const char *metadata = NULL;
+    mp3_variant_t *header;
+    refbuf_t *variant;
+
+    if (interval != source_mp3->render_interval)
+    {
+        /* start over, the old variants will no longer match listeners */
+        source_mp3->render_interval = interval;
+        source_mp3->render_phase = 0;
+        refbuf_release (source_mp3->render_associated);
+        source_mp3->render_associated = NULL;
+    }
+    if (interval == 0)
+        return;
+
+    phase = source_mp3->render_phase;
+    if (phase + refbuf->len > interval)
+    {
+        /* only after an interval change, follow what a listener would get */
+        source_mp3->render_phase = (phase + refbuf->len) % interval;
+        if (refbuf->associated)
+            refbuf_addref (refbuf->associated);
+        refbuf_release (source_mp3->render_associated);
+        source_mp3->render_associated = refbuf->associated;
+        return;
+    }
+
+    if (phase + refbuf->len == interval)
+        metadata = get_stream_metadata (refbuf->associated, source_mp3->render_associated, 0, &meta_len);
+
+    variant = refbuf_new (sizeof(mp3_variant_t) + refbuf->len + meta_len);
+    header = (mp3_variant_t *)variant->data;
+    header->interval = interval;
+    header->phase = phase;
+    memcpy (MP3_VARIANT_DATA(variant), refbuf->data, refbuf->len);
+    if (metadata)
+        memcpy (MP3_VARIANT_DATA(variant) + refbuf->len, metadata, meta_len);
+    variant->associated = source_mp3->render_associated;
+    if (variant->associated)
+        refbuf_addref (variant->associated);
+    refbuf->variant = variant;
+
+    if (metadata)
+    {
+        if (refbuf->associated)
+            refbuf_addref (refbuf->associated);
+        refbuf_release (source_mp3->render_associated);
+        source_mp3->render_associated = refbuf->associated;
+        source_mp3->render_phase = 0;
+    }
+    else
+        source_mp3->render_phase += refbuf->len;
+}
+
+
 /* read an mp3 stream which does not have shoutcast style metadata */
 static refbuf_t *mp3_get_no_meta (source_t *source)
 {
@@ -569,61 +1063,68 @@ static refbuf_t *mp3_get_no_meta (source_t *source)
     }
     refbuf->associated = source_mp3->metadata;
     refbuf_addref (source_mp3->metadata);
-    refbuf->sync_point = 1;
+    mp3_mark_sync (source_mp3, refbuf);
+    mp3_render_variant (source_mp3, refbuf);
     return refbuf;
 }
 
 
 /* read mp3 data with inlined metadata from the source. Filter out the
  * metadata so that the mp3 data itself is store on the queue and the
- * metadata is is associated with it
+ * metadata is is associated with it. The mp3 data around a metadata block
+ * is handed out as slices of the read buffer, one per call, so it is not
+ * copied again; only the metadata itself is.
  */
 static refbuf_t *mp3_get_filter_meta(source_t *source)
 {
-    refbuf_t *refbuf;
+    refbuf_t *buf, *refbuf = NULL;
     format_plugin_t *plugin = source->format;
     mp3_state *source_mp3 = plugin->_state;
     unsigned char *src;
     unsigned int bytes, mp3_block;
 
-    if (complete_read (source) == 0)
-        return NULL;
+    if (source_mp3->filter_data == NULL)
+    {
+        if (complete_read (source) == 0)
+            return NULL;
 
-    refbuf = source_mp3->read_data;
-    source_mp3->read_data = NULL;
-    src = (unsigned char *)refbuf->data;
+        source_mp3->filter_data = source_mp3->read_data;
+        source_mp3->filter_pos = 0;
+        source_mp3->read_data = NULL;
 
-    if (source_mp3->update_metadata)
-    {
-        mp3_set_title (source);
-        source_mp3->update_metadata = 0;
+        if (source_mp3->update_metadata)
+        {
+            mp3_set_title (source);
+            source_mp3->update_metadata = 0;
+        }
     }
-    /* fill the buffer with the read data */
-    bytes = source_mp3->read_count;
-    refbuf->len = 0;
-    while (bytes > 0)
+    buf = source_mp3->filter_data;
+
+    while (source_mp3->filter_pos < buf->len)
     {
         unsigned int metadata_remaining;
 
+        src = (unsigned char *)buf->data + source_mp3->filter_pos;
+        bytes = buf->len - source_mp3->filter_pos;
         mp3_block = source_mp3->inline_metadata_interval - source_mp3->offset;
 
-        /* is there only enough to account for mp3 data */
-        if (bytes <= mp3_block)
+        /* mp3 data up to the metadata block or the end of the buffer */
+        if (mp3_block)
         {
-            refbuf->len += bytes;
+            if (bytes > mp3_block)
+                bytes = mp3_block;
+            if (bytes == buf->len)
+            {
+                /* no metadata in it, the buffer goes on the queue as it is */
+                refbuf = buf;
+                refbuf_addref (refbuf);
+            }
+            else
+                refbuf = refbuf_slice (buf, source_mp3->filter_pos, bytes);
+            source_mp3->filter_pos += bytes;
             source_mp3->offset += bytes;
             break;
         }
-        /* we have enough data to get to the metadata
-         * block, but only transfer upto it */
-        if (mp3_block)
-        {
-            src += mp3_block;
-            bytes -= mp3_block;
-            refbuf->len += mp3_block;
-            source_mp3->offset += mp3_block;
-            continue;
-        }
 
         /* process the inline metadata, len == 0 indicates not seen any yet */
         if (source_mp3->build_metadata_len == 0)
@@ -642,16 +1143,14 @@ static refbuf_t *mp3_get_filter_meta(source_t *source)
             memcpy (source_mp3->build_metadata +
                     source_mp3->build_metadata_offset, src, bytes);
             source_mp3->build_metadata_offset += bytes;
+            source_mp3->filter_pos += bytes;
             break;
         }
         /* copy all bytes except the last one, that way we
          * know a null byte terminates the message */
         memcpy (source_mp3->build_metadata + source_mp3->build_metadata_offset,
                 src, metadata_remaining-1);
-
-        /* overwrite metadata in the buffer */
-        bytes -= metadata_remaining;
-        memmove (src, src+metadata_remaining, bytes);
+        source_mp3->filter_pos += metadata_remaining;
 
         /* assign metadata if it's greater than 1 byte, and the text has changed */
         if (source_mp3->build_metadata_len > 1 &&
@@ -674,7 +1173,8 @@ static refbuf_t *mp3_get_filter_meta(source_t *source)
             {
                 ICECAST_LOG_ERROR("Incorrect metadata format, ending stream");
                 source->running = 0;
-                refbuf_release (refbuf);
+                refbuf_release (source_mp3->filter_data);
+                source_mp3->filter_data = NULL;
                 refbuf_release (meta);
                 return NULL;
             }
@@ -682,15 +1182,20 @@ static refbuf_t *mp3_get_filter_meta(source_t *source)
         source_mp3->offset = 0;
         source_mp3->build_metadata_len = 0;
     }
-    /* the data we have just read may of just been metadata */
-    if (refbuf->len == 0)
+    /* the slices hold the read buffer as long as they need it */
+    if (source_mp3->filter_pos >= buf->len)
     {
-        refbuf_release (refbuf);
-        return NULL;
+        refbuf_release (buf);
+        source_mp3->filter_data = NULL;
     }
+    /* the data we have just read may of just been metadata */
+    if (refbuf == NULL)
+        return NULL;
+
     refbuf->associated = source_mp3->metadata;
     refbuf_addref (source_mp3->metadata);
-    refbuf->sync_point = 1;
+    mp3_mark_sync (source_mp3, refbuf);
+    mp3_render_variant (source_mp3, refbuf);
 
     return refbuf;
 }
@@ -751,6 +1256,34 @@ static int format_mp3_create_client_data(source_t *source, client_t *client)
 }
 
 
+/* The position of a listener is how far it is since the last metadata
+ * block. One in the middle of a block can not be handed on as the rest of
+ * the block is not known to whoever goes on.
+ */
+static int format_mp3_get_client_position (client_t *client, unsigned int *position)
+{
+    mp3_client_data *client_mp3 = client->format_data;
+
+    *position = 0;
+    if (client_mp3 == NULL)
+        return 0;
+    if (client_mp3->in_metadata)
+        return -1;
+    *position = client_mp3->since_meta_block;
+    return 0;
+}
+
+
+static void format_mp3_set_client_position (client_t *client, unsigned int position)
+{
+    mp3_client_data *client_mp3 = client->format_data;
+
+    if (client_mp3 == NULL || client_mp3->interval == 0)
+        return;
+    client_mp3->since_meta_block = position < client_mp3->interval ? position : 0;
+}
+
+
 static void free_mp3_client_data (client_t *client)
 {
     free (client->format_data);
@@ -762,10 +1295,10 @@ static void write_mp3_to_file (source_t *source, refbuf_t *refbuf)
 {
     if (refbuf->len == 0)
         return;
-    if (fwrite (refbuf->data, 1, refbuf->len, source->dumpfile) < (size_t)refbuf->len)
+    if (dumpfile_write (source->dumpfile, refbuf) < 0)
     {
         ICECAST_LOG_WARN("Write to dump file failed, disabling");
-        fclose (source->dumpfile);
+        dumpfile_close (source->dumpfile);
         source->dumpfile = NULL;
     }
 }
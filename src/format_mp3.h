@@ -34,13 +34,40 @@ typedef struct {
     refbuf_t *metadata;
     refbuf_t *read_data;
     int read_count;
+    /* read buffer with inline metadata being handed out, as slices of the
+     * mp3 data around the metadata, up to filter_pos */
+    refbuf_t *filter_data;
+    unsigned int filter_pos;
+    /* reads are collected into buffers of ingest_size bytes, a partly
+     * filled one is let go once ingest_latency ms passed since its first
+     * byte came in (0 for no limit) */
+    int ingest_size;
+    unsigned int ingest_latency;
+    int read_size;
+    uint64_t read_start;
+
+    /* frame headers looked for to start listeners on, MP3_FRAMES_NONE if
+     * every buffer is a start point. When in sync frame_remaining is the
+     * number of bytes of the current frame still to come. */
+    int frame_type;
+    int frame_synced;
+    unsigned int frame_remaining;
     mutex_t url_lock;
 
     unsigned build_metadata_len;
     unsigned build_metadata_offset;
     char build_metadata[4081];
+
+    /* state of the shared rendering of the stream with ICY metadata, as
+     * seen by a listener that got all of it. render_interval is 0 when
+     * nothing is rendered. */
+    unsigned int render_interval;
+    unsigned int render_phase;
+    refbuf_t *render_associated;
 } mp3_state;
 
+void format_mp3_initialize(void);
+void format_mp3_shutdown(void);
 int format_mp3_get_plugin(struct source_tag *src);
 
 #endif  /* __FORMAT_MP3_H__ */
@@ -55,6 +55,9 @@
 #define CATMODULE "format-ogg"
 #include "logging.h"
 
+/* enough for the codecs of a usual chain in one chunk */
+#define OGG_CODEC_ARENA_SIZE    4096
+
 struct _ogg_state_tag;
 
 static void format_ogg_free_plugin(format_plugin_t *plugin);
@@ -64,12 +67,15 @@ static void free_ogg_client_data(client_t *client);
 static void write_ogg_to_file(source_t *source, refbuf_t *refbuf);
 static refbuf_t *ogg_get_buffer(source_t *source);
 static int write_buf_to_client(client_t *client);
+static size_t ogg_get_header_bytes(format_plugin_t *plugin);
+static size_t ogg_get_arena_bytes(format_plugin_t *plugin);
+static int ogg_reset_input(format_plugin_t *plugin, http_parser_t *parser);
 
 
 struct ogg_client
 {
     refbuf_t *headers;
-    refbuf_t *header_page;
+    refbuf_t *header_chain;
     unsigned pos;
     int headers_sent;
 };
@@ -92,6 +98,10 @@ void format_ogg_attach_header (ogg_state_t *ogg_info, ogg_page *page)
 {
     refbuf_t *refbuf = make_refbuf_with_page (page);
 
+    /* buffers already queued keep the chain they were given */
+    refbuf_release (ogg_info->header_chain);
+    ogg_info->header_chain = NULL;
+
     if (ogg_page_bos (page))
     {
         ICECAST_LOG_DEBUG("attaching BOS page");
@@ -128,6 +138,198 @@ void format_ogg_free_headers(ogg_state_t *ogg_info)
     ogg_info->header_pages = NULL;
     ogg_info->header_pages_tail = NULL;
     ogg_info->bos_end = &ogg_info->header_pages;
+    refbuf_release (ogg_info->header_chain);
+    ogg_info->header_chain = NULL;
+}
+
+
+/* the CRC-32 of Ogg pages, polynomial 0x04c11db7, no reflection */
+static const uint32_t ogg_crc_table[256] = {
+    0x00000000, 0x04c11db7, 0x09823b6e, 0x0d4326d9, 0x130476dc, 0x17c56b6b,
+    0x1a864db2, 0x1e475005, 0x2608edb8, 0x22c9f00f, 0x2f8ad6d6, 0x2b4bcb61,
+    0x350c9b64, 0x31cd86d3, 0x3c8ea00a, 0x384fbdbd, 0x4c11db70, 0x48d0c6c7,
+    0x4593e01e, 0x4152fda9, 0x5f15adac, 0x5bd4b01b, 0x569796c2, 0x52568b75,
+    0x6a1936c8, 0x6ed82b7f, 0x639b0da6, 0x675a1011, 0x791d4014, 0x7ddc5da3,
+    0x709f7b7a, 0x745e66cd, 0x9823b6e0, 0x9ce2ab57, 0x91a18d8e, 0x95609039,
+    0x8b27c03c, 0x8fe6dd8b, 0x82a5fb52, 0x8664e6e5, 0xbe2b5b58, 0xbaea46ef,
+    0xb7a96036, 0xb3687d81, 0xad2f2d84, 0xa9ee3033, 0xa4ad16ea, 0xa06c0b5d,
+    0xd4326d90, 0xd0f37027, 0xddb056fe, 0xd9714b49, 0xc7361b4c, 0xc3f706fb,
+    0xceb42022, 0xca753d95, 0xf23a8028, 0xf6fb9d9f, 0xfbb8bb46, 0xff79a6f1,
+    0xe13ef6f4, 0xe5ffeb43, 0xe8bccd9a, 0xec7dd02d, 0x34867077, 0x30476dc0,
+    0x3d044b19, 0x39c556ae, 0x278206ab, 0x23431b1c, 0x2e003dc5, 0x2ac12072,
+    0x128e9dcf, 0x164f8078, 0x1b0ca6a1, 0x1fcdbb16, 0x018aeb13, 0x054bf6a4,
+    0x0808d07d, 0x0cc9cdca, 0x7897ab07, 0x7c56b6b0, 0x71159069, 0x75d48dde,
+    0x6b93dddb, 0x6f52c06c, 0x6211e6b5, 0x66d0fb02, 0x5e9f46bf, 0x5a5e5b08,
+    0x571d7dd1, 0x53dc6066, 0x4d9b3063, 0x495a2dd4, 0x44190b0d, 0x40d816ba,
+    0xaca5c697, 0xa864db20, 0xa527fdf9, 0xa1e6e04e, 0xbfa1b04b, 0xbb60adfc,
+    0xb6238b25, 0xb2e29692, 0x8aad2b2f, 0x8e6c3698, 0x832f1041, 0x87ee0df6,
+    0x99a95df3, 0x9d684044, 0x902b669d, 0x94ea7b2a, 0xe0b41de7, 0xe4750050,
+    0xe9362689, 0xedf73b3e, 0xf3b06b3b, 0xf771768c, 0xfa325055, 0xfef34de2,
+    0xc6bcf05f, 0xc27dede8, 0xcf3ecb31, 0xcbffd686, 0xd5b88683, 0xd1799b34,
+    0xdc3abded, 0xd8fba05a, 0x690ce0ee, 0x6dcdfd59, 0x608edb80, 0x644fc637,
+    0x7a089632, 0x7ec98b85, 0x738aad5c, 0x774bb0eb, 0x4f040d56, 0x4bc510e1,
+    0x46863638, 0x42472b8f, 0x5c007b8a, 0x58c1663d, 0x558240e4, 0x51435d53,
+    0x251d3b9e, 0x21dc2629, 0x2c9f00f0, 0x285e1d47, 0x36194d42, 0x32d850f5,
+    0x3f9b762c, 0x3b5a6b9b, 0x0315d626, 0x07d4cb91, 0x0a97ed48, 0x0e56f0ff,
+    0x1011a0fa, 0x14d0bd4d, 0x19939b94, 0x1d528623, 0xf12f560e, 0xf5ee4bb9,
+    0xf8ad6d60, 0xfc6c70d7, 0xe22b20d2, 0xe6ea3d65, 0xeba91bbc, 0xef68060b,
+    0xd727bbb6, 0xd3e6a601, 0xdea580d8, 0xda649d6f, 0xc423cd6a, 0xc0e2d0dd,
+    0xcda1f604, 0xc960ebb3, 0xbd3e8d7e, 0xb9ff90c9, 0xb4bcb610, 0xb07daba7,
+    0xae3afba2, 0xaafbe615, 0xa7b8c0cc, 0xa379dd7b, 0x9b3660c6, 0x9ff77d71,
+    0x92b45ba8, 0x9675461f, 0x8832161a, 0x8cf30bad, 0x81b02d74, 0x857130c3,
+    0x5d8a9099, 0x594b8d2e, 0x5408abf7, 0x50c9b640, 0x4e8ee645, 0x4a4ffbf2,
+    0x470cdd2b, 0x43cdc09c, 0x7b827d21, 0x7f436096, 0x7200464f, 0x76c15bf8,
+    0x68860bfd, 0x6c47164a, 0x61043093, 0x65c52d24, 0x119b4be9, 0x155a565e,
+    0x18197087, 0x1cd86d30, 0x029f3d35, 0x065e2082, 0x0b1d065b, 0x0fdc1bec,
+    0x3793a651, 0x3352bbe6, 0x3e119d3f, 0x3ad08088, 0x2497d08d, 0x2056cd3a,
+    0x2d15ebe3, 0x29d4f654, 0xc5a92679, 0xc1683bce, 0xcc2b1d17, 0xc8ea00a0,
+    0xd6ad50a5, 0xd26c4d12, 0xdf2f6bcb, 0xdbee767c, 0xe3a1cbc1, 0xe760d676,
+    0xea23f0af, 0xeee2ed18, 0xf0a5bd1d, 0xf464a0aa, 0xf9278673, 0xfde69bc4,
+    0x89b8fd09, 0x8d79e0be, 0x803ac667, 0x84fbdbd0, 0x9abc8bd5, 0x9e7d9662,
+    0x933eb0bb, 0x97ffad0c, 0xafb010b1, 0xab710d06, 0xa6322bdf, 0xa2f33668,
+    0xbcb4666d, 0xb8757bda, 0xb5365d03, 0xb1f740b4
+};
+
+static uint32_t ogg_crc (const unsigned char *data, size_t len)
+{
+    uint32_t crc = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        crc = (crc << 8) ^ ogg_crc_table[(crc >> 24) ^ data[i]];
+    return crc;
+}
+
+static uint32_t ogg_read_u32le (const unsigned char *data)
+{
+    return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static void ogg_write_u32le (unsigned char *data, uint32_t value)
+{
+    data[0] = value;
+    data[1] = value >> 8;
+    data[2] = value >> 16;
+    data[3] = value >> 24;
+}
+
+
+/* Replace the packet filling the non-BOS header pages of the logical stream
+ * serialno, such as the comment packet of Opus, with the given one. The
+ * pages are written here rather than run through libogg again, keeping
+ * their sequence numbers so the pages after them still follow on. Only the
+ * header chain for new listeners changes, it is built again once when the
+ * next buffer is queued. Returns -1 if the new packet does not take as many
+ * pages as the old one.
+ */
+int format_ogg_replace_header_packet (ogg_state_t *ogg_info, uint32_t serialno, const unsigned char *packet, size_t len)
+{
+    refbuf_t **first = NULL;
+    refbuf_t *last = NULL;
+    refbuf_t **link;
+    refbuf_t *pages = NULL;
+    refbuf_t **pages_tail = &pages;
+    refbuf_t *header = NULL;
+    size_t lacing = len / 255 + 1;
+    unsigned int old_count = 0;
+    unsigned int count = (lacing + 254) / 255;
+    uint32_t sequence = 0;
+    unsigned int i;
+
+    for (link = &ogg_info->header_pages; *link; link = &(*link)->next)
+    {
+        const unsigned char *data = (const unsigned char *)(*link)->data;
+
+        if ((*link)->len >= 27 && ogg_read_u32le (data + 14) == serialno && !(data[5] & 0x02))
+        {
+            if (first == NULL)
+            {
+                first = link;
+                sequence = ogg_read_u32le (data + 18);
+            }
+            last = *link;
+            old_count++;
+        }
+        else if (first)
+            break;
+    }
+    if (first == NULL || old_count != count)
+        return -1;
+
+    for (i = 0; i < count; i++)
+    {
+        size_t segments = lacing > 255 ? 255 : lacing;
+        size_t body = lacing > 255 ? 255 * 255 : len;
+        unsigned char *data;
+        size_t j;
+
+        header = refbuf_new (27 + segments + body);
+        data = (unsigned char *)header->data;
+        memcpy (data, "OggS", 4);
+        data[4] = 0;
+        data[5] = i ? 0x01 : 0;
+        /* header pages have a granule position of 0 */
+        memset (data + 6, 0, 8);
+        ogg_write_u32le (data + 14, serialno);
+        ogg_write_u32le (data + 18, sequence + i);
+        ogg_write_u32le (data + 22, 0);
+        data[26] = segments;
+        for (j = 0; j < segments; j++)
+            data[27 + j] = (j == segments - 1 && lacing == segments) ? len % 255 : 255;
+        memcpy (data + 27 + segments, packet, body);
+        ogg_write_u32le (data + 22, ogg_crc (data, header->len));
+
+        packet += body;
+        len -= body;
+        lacing -= segments;
+        *pages_tail = header;
+        pages_tail = &header->next;
+    }
+
+    /* header is the last new page now */
+    header->next = last->next;
+    if (ogg_info->header_pages_tail == last)
+        ogg_info->header_pages_tail = header;
+    last->next = NULL;
+    header = *first;
+    *first = pages;
+    while (header)
+    {
+        refbuf_t *to_release = header;
+        header = header->next;
+        refbuf_release (to_release);
+    }
+
+    /* buffers already queued keep the chain they were given */
+    refbuf_release (ogg_info->header_chain);
+    ogg_info->header_chain = NULL;
+    return 0;
+}
+
+
+/* copy the header pages into a single buffer, in stream order, so a new
+ * listener gets all of them with one write */
+static refbuf_t *get_header_chain (ogg_state_t *ogg_info)
+{
+    refbuf_t *header;
+    size_t len = 0;
+    char *data;
+
+    if (ogg_info->header_chain || ogg_info->header_pages == NULL)
+        return ogg_info->header_chain;
+
+    for (header = ogg_info->header_pages; header; header = header->next)
+        len += header->len;
+
+    ogg_info->header_chain = refbuf_new (len);
+    data = ogg_info->header_chain->data;
+    for (header = ogg_info->header_pages; header; header = header->next)
+    {
+        memcpy (data, header->data, header->len);
+        data += header->len;
+    }
+    ICECAST_LOG_DEBUG("%zu bytes of header pages for new listeners", len);
+    return ogg_info->header_chain;
 }
 
 
@@ -152,6 +354,7 @@ static void free_ogg_codecs(ogg_state_t *ogg_info)
         codec->codec_free(ogg_info, codec);
         codec = next;
     }
+    arena_reset(&ogg_info->codec_arena);
     ogg_info->codecs = NULL;
     ogg_info->current = NULL;
     ogg_info->bos_completed = 0;
@@ -162,9 +365,11 @@ static void free_ogg_codecs(ogg_state_t *ogg_info)
 int format_ogg_get_plugin(source_t *source)
 {
     format_plugin_t *plugin;
-    ogg_state_t *state = calloc(1, sizeof(ogg_state_t));
+    ogg_state_t *state = arena_alloc(&source->arena, sizeof(ogg_state_t));
 
-    plugin = (format_plugin_t *) calloc(1, sizeof(format_plugin_t));
+    plugin = arena_alloc(&source->arena, sizeof(format_plugin_t));
+    if (!plugin || !state)
+        return -1;
 
     plugin->type = FORMAT_TYPE_OGG;
     plugin->get_buffer = ogg_get_buffer;
@@ -172,6 +377,9 @@ int format_ogg_get_plugin(source_t *source)
     plugin->write_buf_to_file = write_ogg_to_file;
     plugin->create_client_data = create_ogg_client_data;
     plugin->free_plugin = format_ogg_free_plugin;
+    plugin->get_header_bytes = ogg_get_header_bytes;
+    plugin->get_arena_bytes = ogg_get_arena_bytes;
+    plugin->reset_input = ogg_reset_input;
     plugin->set_tag = NULL;
     if (strcmp (httpp_getvar (source->parser, "content-type"), "application/x-ogg") == 0)
         httpp_setvar (source->parser, "content-type", "application/ogg");
@@ -179,6 +387,7 @@ int format_ogg_get_plugin(source_t *source)
 
     ogg_sync_init (&state->oy);
     vorbis_comment_init(&plugin->vc);
+    arena_initialize(&state->codec_arena, OGG_CODEC_ARENA_SIZE);
 
     plugin->_state = state;
     source->format = plugin;
@@ -197,12 +406,51 @@ static void format_ogg_free_plugin (format_plugin_t *plugin)
     free_ogg_codecs (state);
 
     ogg_sync_clear (&state->oy);
-
-    free (state);
+    arena_shutdown(&state->codec_arena);
 
     vorbis_comment_clear(&plugin->vc);
+}
+
+
+/* header pages of the current stream, older ones are released once no
+ * queued buffer refers to them anymore */
+static size_t ogg_get_header_bytes(format_plugin_t *plugin)
+{
+    ogg_state_t *ogg_info = plugin->_state;
+    refbuf_t *header;
+    size_t bytes = 0;
+
+    for (header = ogg_info->header_pages; header; header = header->next)
+        bytes += header->len;
+    if (ogg_info->header_chain)
+        bytes += ogg_info->header_chain->len;
+
+    return bytes;
+}
 
-    free (plugin);
+
+/* codecs of the current chain */
+static size_t ogg_get_arena_bytes(format_plugin_t *plugin)
+{
+    ogg_state_t *ogg_info = plugin->_state;
+
+    return arena_get_used(&ogg_info->codec_arena);
+}
+
+
+/* The stream goes on from a new connection, which starts with BOS pages of
+ * its own. Those replace the codecs as for a new chain of the stream. */
+static int ogg_reset_input(format_plugin_t *plugin, http_parser_t *parser)
+{
+    ogg_state_t *ogg_info = plugin->_state;
+
+    (void)parser;
+
+    ogg_sync_reset (&ogg_info->oy);
+    ogg_info->current = NULL;
+    ogg_info->bos_completed = 1;
+
+    return 0;
 }
 
 
@@ -349,14 +597,11 @@ static void update_comments(source_t *source)
 static refbuf_t *complete_buffer (source_t *source, refbuf_t *refbuf)
 {
     ogg_state_t *ogg_info = source->format->_state;
-    refbuf_t *header = ogg_info->header_pages;
+    refbuf_t *header = get_header_chain (ogg_info);
 
-    while (header)
-    {
+    if (header)
         refbuf_addref (header);
-        header = header->next;
-    }
-    refbuf->associated = ogg_info->header_pages;
+    refbuf->associated = header;
 
     if (ogg_info->log_metadata)
     {
@@ -364,9 +609,10 @@ static refbuf_t *complete_buffer (source_t *source, refbuf_t *refbuf)
         ogg_info->log_metadata = 0;
     }
     /* listeners can start anywhere unless the codecs themselves are
-     * marking starting points */
+     * marking starting points, such as the keyframes of theora */
     if (ogg_info->codec_sync == NULL)
         refbuf->sync_point = 1;
+    source->format->sparse_sync = ogg_info->codec_sync != NULL;
     return refbuf;
 }
 
@@ -405,6 +651,7 @@ static refbuf_t *ogg_get_buffer(source_t *source)
     format_plugin_t *format = source->format;
     char *data = NULL;
     ssize_t bytes = 0;
+    size_t size;
 
     while (1)
     {
@@ -449,9 +696,10 @@ static refbuf_t *ogg_get_buffer(source_t *source)
             break;
         }
         /* we need more data to continue getting pages */
-        data = ogg_sync_buffer (&ogg_info->oy, 4096);
+        size = format_read_size (format, 4096);
+        data = ogg_sync_buffer (&ogg_info->oy, size);
 
-        bytes = client_body_read(source->client, data, 4096);
+        bytes = client_body_read(source->client, data, size);
         if (bytes <= 0)
         {
             ogg_sync_wrote (&ogg_info->oy, 0);
@@ -487,40 +735,37 @@ static void free_ogg_client_data (client_t *client)
 
 
 /* send out the header pages. These are for all codecs but are
- * in the order for the stream, ie BOS pages first
+ * in the order for the stream, ie BOS pages first, in a single buffer
  */
 static int send_ogg_headers (client_t *client, refbuf_t *headers)
 {
     struct ogg_client *client_data = client->format_data;
-    refbuf_t *refbuf;
     int written = 0;
 
     if (client_data->headers_sent)
     {
-        client_data->header_page = headers;
+        client_data->header_chain = headers;
         client_data->pos = 0;
         client_data->headers_sent = 0;
     }
-    refbuf = client_data->header_page;
-    while (refbuf)
+    if (client_data->header_chain)
     {
-        char *data = refbuf->data + client_data->pos;
+        refbuf_t *refbuf = client_data->header_chain;
         unsigned len = refbuf->len - client_data->pos;
         int ret;
 
-        ret = client_send_bytes(client, data, len);
+        ret = client_send_bytes(client, refbuf->data + client_data->pos, len);
         if (ret > 0)
             written += ret;
         if (ret < (int) len)
-            return written ? written : -1;
-        client_data->pos += ret;
-        if (client_data->pos == refbuf->len)
         {
-            refbuf = refbuf->next;
-            client_data->header_page = refbuf;
-            client_data->pos = 0;
+            if (ret > 0)
+                client_data->pos += ret;
+            return written ? written : -1;
         }
     }
+    client_data->header_chain = NULL;
+    client_data->pos = 0;
     client_data->headers_sent = 1;
     client_data->headers = headers;
     return written;
@@ -569,10 +814,10 @@ static int write_ogg_data (source_t *source, refbuf_t *refbuf)
 {
     int ret = 1;
 
-    if (fwrite (refbuf->data, 1, refbuf->len, source->dumpfile) != refbuf->len)
+    if (dumpfile_write (source->dumpfile, refbuf) < 0)
     {
         ICECAST_LOG_WARN("Write to dump file failed, disabling");
-        fclose (source->dumpfile);
+        dumpfile_close (source->dumpfile);
         source->dumpfile = NULL;
         ret = 0;
     }
@@ -22,6 +22,7 @@
 #include <ogg/ogg.h>
 #include "refbuf.h"
 #include "format.h"
+#include "arena.h"
 
 typedef struct ogg_state_tag
 {
@@ -31,10 +32,15 @@ typedef struct ogg_state_tag
 
     int codec_count;
     struct ogg_codec_tag *codecs;
+    /* the codecs of the current chain and their state, reset with them */
+    arena_t codec_arena;
     int log_metadata;
     refbuf_t *file_headers;
     refbuf_t *header_pages;
     refbuf_t *header_pages_tail;
+    /* copy of all header pages in a single buffer, this is what queued
+     * buffers refer to. NULL until needed after the headers change */
+    refbuf_t *header_chain;
     refbuf_t **bos_end;
     int bos_completed;
     long bitrate;
@@ -64,6 +70,7 @@ typedef struct ogg_codec_tag
 refbuf_t *make_refbuf_with_page (ogg_page *page);
 void format_ogg_attach_header (ogg_state_t *ogg_info, ogg_page *page);
 void format_ogg_free_headers (ogg_state_t *ogg_info);
+int format_ogg_replace_header_packet (ogg_state_t *ogg_info, uint32_t serialno, const unsigned char *packet, size_t len);
 int format_ogg_get_plugin (source_t *source);
 
 #endif  /* __FORMAT_OGG_H__ */
@@ -25,16 +25,37 @@
 #include "stats.h"
 #include "refbuf.h"
 #include "client.h"
+#include "util.h"
 
 #define CATMODULE "format-opus"
 #include "logging.h"
 
+typedef struct {
+    uint32_t serialno;
+    /* vendor string of the OpusTags packet */
+    char *vendor;
+    /* set by the admin interface, the source thread writes the new tags */
+    int rebuild_comment;
+} opus_codec_t;
+
+static void opus_set_tag(format_plugin_t *plugin, const char *tag, const char *in_value, const char *charset);
+
 static void opus_codec_free (ogg_state_t *ogg_info, ogg_codec_t *codec)
 {
+    opus_codec_t *opus = codec->specific;
+
     stats_event(ogg_info->mount, "audio_channels", NULL);
     stats_event(ogg_info->mount, "audio_samplerate", NULL);
     ogg_stream_clear(&codec->os);
-    free(codec);
+    free(opus->vendor);
+}
+
+static void __write_header_u32le(unsigned char *out, uint32_t value)
+{
+    out[0] = value;
+    out[1] = value >> 8;
+    out[2] = value >> 16;
+    out[3] = value >> 24;
 }
 
 static uint32_t __read_header_u32be_unaligned(const unsigned char *in)
@@ -66,8 +87,9 @@ static void __handle_header_opushead(ogg_state_t *ogg_info, ogg_packet *packet)
     stats_event_args(ogg_info->mount, "audio_samplerate", "%ld", (long int)__read_header_u32be_unaligned(packet->packet+12));
 }
 
-static void __handle_header_opustags(ogg_state_t *ogg_info, ogg_packet *packet, format_plugin_t *plugin) 
+static void __handle_header_opustags(ogg_state_t *ogg_info, ogg_codec_t *codec, ogg_packet *packet, format_plugin_t *plugin) 
 {
+    opus_codec_t *opus = codec->specific;
     size_t comments;
     size_t next;
     size_t left = packet->bytes;
@@ -85,7 +107,7 @@ static void __handle_header_opustags(ogg_state_t *ogg_info, ogg_packet *packet,
     p += 8;
     left -= 8;
 
-    /* Now the vendor string follows. We just skip it. */
+    /* Now the vendor string follows. It is kept for rewriting the tags. */
     next = __read_header_u32be_unaligned(p);
     p += 4;
     left -= 4;
@@ -94,6 +116,12 @@ static void __handle_header_opustags(ogg_state_t *ogg_info, ogg_packet *packet,
         ICECAST_LOG_WARN("Bad Opus header: corrupted OpusTags header.");
         return;
     }
+    free(opus->vendor);
+    opus->vendor = malloc(next + 1);
+    if (opus->vendor) {
+        memcpy(opus->vendor, p, next);
+        opus->vendor[next] = 0;
+    }
     p += next;
     left -= next;
 
@@ -173,18 +201,67 @@ static void __handle_header(ogg_state_t *ogg_info,
         __handle_header_opushead(ogg_info, packet);
     } else if (strncmp((const char*)packet->packet, "OpusTags", 8) == 0) {
         ICECAST_LOG_DEBUG("Got Opus header: OpusTags");
-        __handle_header_opustags(ogg_info, packet, plugin);
+        __handle_header_opustags(ogg_info, codec, packet, plugin);
     } else {
         ICECAST_LOG_DEBUG("Unknown header or data.");
         return; /* Unknown header or data */
     }
 }
 
+/* Writes the tags set through the admin interface into the OpusTags
+ * packet of the header pages new listeners get. Listeners already
+ * connected keep the tags they got, as Opus can not change them
+ * mid-stream. */
+static void opus_rebuild_comment(ogg_state_t *ogg_info, ogg_codec_t *codec, format_plugin_t *plugin)
+{
+    opus_codec_t *opus = codec->specific;
+    const char *vendor = opus->vendor ? opus->vendor : "";
+    size_t vendor_len = strlen(vendor);
+    size_t len = 8 + 4 + vendor_len + 4;
+    unsigned char *packet;
+    unsigned char *p;
+    int i;
+
+    for (i = 0; i < plugin->vc.comments; i++)
+        len += 4 + plugin->vc.comment_lengths[i];
+
+    packet = malloc(len);
+    if (!packet)
+        return;
+
+    p = packet;
+    memcpy(p, "OpusTags", 8);
+    p += 8;
+    __write_header_u32le(p, vendor_len);
+    memcpy(p + 4, vendor, vendor_len);
+    p += 4 + vendor_len;
+    __write_header_u32le(p, plugin->vc.comments);
+    p += 4;
+    for (i = 0; i < plugin->vc.comments; i++) {
+        __write_header_u32le(p, plugin->vc.comment_lengths[i]);
+        memcpy(p + 4, plugin->vc.user_comments[i], plugin->vc.comment_lengths[i]);
+        p += 4 + plugin->vc.comment_lengths[i];
+    }
+
+    if (format_ogg_replace_header_packet(ogg_info, opus->serialno, packet, len) < 0)
+        ICECAST_LOG_DEBUG("New tags do not fit the OpusTags pages, only updating stats");
+    free(packet);
+
+    ogg_info->log_metadata = 1;
+}
+
 static refbuf_t *process_opus_page (ogg_state_t *ogg_info,
         ogg_codec_t *codec, ogg_page *page, format_plugin_t *plugin)
 {
+    opus_codec_t *opus = codec->specific;
     refbuf_t *refbuf;
 
+    if (codec->headers >= 2 && opus->rebuild_comment)
+    {
+        opus->rebuild_comment = 0;
+        opus_rebuild_comment(ogg_info, codec, plugin);
+    }
+
     if (codec->headers < 2)
     {
         ogg_packet packet;
@@ -208,7 +285,8 @@ static refbuf_t *process_opus_page (ogg_state_t *ogg_info,
 ogg_codec_t *initial_opus_page (format_plugin_t *plugin, ogg_page *page)
 {
     ogg_state_t *ogg_info = plugin->_state;
-    ogg_codec_t *codec = calloc(1, sizeof (ogg_codec_t));
+    ogg_codec_t *codec = arena_alloc(&ogg_info->codec_arena, sizeof (ogg_codec_t));
+    opus_codec_t *opus = arena_alloc(&ogg_info->codec_arena, sizeof (opus_codec_t));
     ogg_packet packet;
 
     ogg_stream_init(&codec->os, ogg_page_serialno (page));
@@ -220,16 +298,54 @@ ogg_codec_t *initial_opus_page (format_plugin_t *plugin, ogg_page *page)
     if (packet.bytes < 8 || strncmp((char *)packet.packet, "OpusHead", 8) != 0)
     {
         ogg_stream_clear(&codec->os);
-        free(codec);
+        arena_free(&ogg_info->codec_arena, opus, sizeof (opus_codec_t));
+        arena_free(&ogg_info->codec_arena, codec, sizeof (ogg_codec_t));
         return NULL;
     }
+    opus->serialno = ogg_page_serialno (page);
+    codec->specific = opus;
     __handle_header(ogg_info, codec, &packet, plugin);
     ICECAST_LOG_INFO("seen initial opus header");
     codec->process_page = process_opus_page;
     codec->codec_free = opus_codec_free;
     codec->name = "Opus";
     codec->headers = 1;
+    plugin->set_tag = opus_set_tag;
     format_ogg_attach_header (ogg_info, page);
     return codec;
 }
 
+
+/* called from the admin interface, here we update the artist/title info
+ * and have the source thread write new tags
+ */
+static void opus_set_tag(format_plugin_t *plugin, const char *tag, const char *in_value, const char *charset)
+{
+    ogg_state_t *ogg_info = plugin->_state;
+    ogg_codec_t *codec = ogg_info->codecs;
+    opus_codec_t *opus;
+    char *value;
+
+    /* avoid updating if multiple codecs in use */
+    if (codec && codec->next == NULL && codec->codec_free == opus_codec_free)
+        opus = codec->specific;
+    else
+        return;
+
+    if (tag == NULL)
+    {
+        opus->rebuild_comment = 1;
+        return;
+    }
+
+    value = util_conv_string(in_value, charset, "UTF-8");
+    if (value == NULL)
+        value = strdup(in_value);
+
+    if (strcmp(tag, "song") == 0)
+        tag = "title";
+
+    format_set_vorbiscomment(plugin, tag, value);
+    free(value);
+}
+
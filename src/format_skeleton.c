@@ -36,7 +36,6 @@ static void skeleton_codec_free (ogg_state_t *ogg_info, ogg_codec_t *codec)
 {
     ICECAST_LOG_DEBUG("freeing skeleton codec");
     ogg_stream_clear (&codec->os);
-    free (codec);
 }
 
 
@@ -70,7 +69,7 @@ static refbuf_t *process_skeleton_page (ogg_state_t *ogg_info, ogg_codec_t *code
 ogg_codec_t *initial_skeleton_page (format_plugin_t *plugin, ogg_page *page)
 {
     ogg_state_t *ogg_info = plugin->_state;
-    ogg_codec_t *codec = calloc (1, sizeof (ogg_codec_t));
+    ogg_codec_t *codec = arena_alloc(&ogg_info->codec_arena, sizeof (ogg_codec_t));
     ogg_packet packet;
 
     ogg_stream_init (&codec->os, ogg_page_serialno (page));
@@ -83,7 +82,7 @@ ogg_codec_t *initial_skeleton_page (format_plugin_t *plugin, ogg_page *page)
     if ((packet.bytes<8) || memcmp(packet.packet, "fishead\0", 8))
     {
         ogg_stream_clear (&codec->os);
-        free (codec);
+        arena_free (&ogg_info->codec_arena, codec, sizeof (ogg_codec_t));
         return NULL;
     }
 
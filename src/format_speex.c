@@ -32,7 +32,6 @@
 static void speex_codec_free (ogg_state_t *ogg_info, ogg_codec_t *codec)
 {
     ogg_stream_clear (&codec->os);
-    free (codec);
 }
 
 
@@ -63,7 +62,7 @@ static refbuf_t *process_speex_page (ogg_state_t *ogg_info,
 ogg_codec_t *initial_speex_page (format_plugin_t *plugin, ogg_page *page)
 {
     ogg_state_t *ogg_info = plugin->_state;
-    ogg_codec_t *codec = calloc (1, sizeof (ogg_codec_t));
+    ogg_codec_t *codec = arena_alloc(&ogg_info->codec_arena, sizeof (ogg_codec_t));
     ogg_packet packet;
     SpeexHeader *header;
 
@@ -84,7 +83,7 @@ ogg_codec_t *initial_speex_page (format_plugin_t *plugin, ogg_page *page)
     if (packet.bytes < 80) {
         ICECAST_LOG_DDEBUG("Header too small for Speex, so skipping Speex test.");
         ogg_stream_clear (&codec->os);
-        free (codec);
+        arena_free (&ogg_info->codec_arena, codec, sizeof (ogg_codec_t));
         return NULL;
     }
 
@@ -94,7 +93,7 @@ ogg_codec_t *initial_speex_page (format_plugin_t *plugin, ogg_page *page)
     {
         ogg_stream_clear (&codec->os);
         free (header);
-        free (codec);
+        arena_free (&ogg_info->codec_arena, codec, sizeof (ogg_codec_t));
         return NULL;
     }
     ICECAST_LOG_INFO("seen initial speex header");
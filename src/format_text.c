@@ -30,8 +30,8 @@ typedef struct {
 
 static void text_free_plugin(format_plugin_t *plugin)
 {
-    free(plugin->_state);
-    free(plugin);
+    /* plugin and state are released with the arena of the source */
+    (void)plugin;
 }
 
 static size_t skipchar(char *text, char skip, size_t len)
@@ -87,10 +87,13 @@ static refbuf_t *text_get_buffer(source_t *source)
 
 int format_text_get_plugin(source_t *source)
 {
-    format_plugin_t *plugin = calloc(1, sizeof(format_plugin_t));
-    text_state_t *state = calloc(1, sizeof(text_state_t));
+    format_plugin_t *plugin = arena_alloc(&source->arena, sizeof(format_plugin_t));
+    text_state_t *state = arena_alloc(&source->arena, sizeof(text_state_t));
     const char *skip;
 
+    if (!plugin || !state)
+        return -1;
+
     ICECAST_LOG_DEBUG("Opening text format for source %p", source);
 
     plugin->get_buffer = text_get_buffer;
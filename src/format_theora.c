@@ -54,8 +54,6 @@ static void theora_codec_free (ogg_state_t *ogg_info, ogg_codec_t *codec)
     theora_info_clear (&theora->ti);
     theora_comment_clear (&theora->tc);
     ogg_stream_clear (&codec->os);
-    free (theora);
-    free (codec);
 }
 
 
@@ -148,10 +146,10 @@ static refbuf_t *process_theora_page (ogg_state_t *ogg_info, ogg_codec_t *codec,
 ogg_codec_t *initial_theora_page (format_plugin_t *plugin, ogg_page *page)
 {
     ogg_state_t *ogg_info = plugin->_state;
-    ogg_codec_t *codec = calloc (1, sizeof (ogg_codec_t));
+    ogg_codec_t *codec = arena_alloc(&ogg_info->codec_arena, sizeof (ogg_codec_t));
     ogg_packet packet;
 
-    theora_codec_t *theora_codec = calloc (1, sizeof (theora_codec_t));
+    theora_codec_t *theora_codec = arena_alloc(&ogg_info->codec_arena, sizeof (theora_codec_t));
 
     ogg_stream_init (&codec->os, ogg_page_serialno (page));
     ogg_stream_pagein (&codec->os, page);
@@ -167,8 +165,8 @@ ogg_codec_t *initial_theora_page (format_plugin_t *plugin, ogg_page *page)
         theora_info_clear (&theora_codec->ti);
         theora_comment_clear (&theora_codec->tc);
         ogg_stream_clear (&codec->os);
-        free (theora_codec);
-        free (codec);
+        arena_free (&ogg_info->codec_arena, theora_codec, sizeof (theora_codec_t));
+        arena_free (&ogg_info->codec_arena, codec, sizeof (ogg_codec_t));
         return NULL;
     }
     ICECAST_LOG_INFO("seen initial theora header");
@@ -96,8 +96,6 @@ static void vorbis_codec_free (ogg_state_t *ogg_info, ogg_codec_t *codec)
     free_ogg_packet (vorbis->header[2]);
     free_ogg_packet (vorbis->prev_packet);
     free (vorbis->bos_page.header);
-    free (vorbis);
-    free (codec);
 }
 
 
@@ -352,10 +350,11 @@ static int process_vorbis_headers (ogg_state_t *ogg_info, ogg_codec_t *codec, fo
  */
 ogg_codec_t *initial_vorbis_page (format_plugin_t *plugin, ogg_page *page)
 {
-    ogg_codec_t *codec = calloc (1, sizeof (ogg_codec_t));
+    ogg_state_t *ogg_info = plugin->_state;
+    ogg_codec_t *codec = arena_alloc(&ogg_info->codec_arena, sizeof (ogg_codec_t));
     ogg_packet packet;
 
-    vorbis_codec_t *vorbis = calloc (1, sizeof (vorbis_codec_t));
+    vorbis_codec_t *vorbis = arena_alloc(&ogg_info->codec_arena, sizeof (vorbis_codec_t));
 
     ogg_stream_init (&codec->os, ogg_page_serialno (page));
     ogg_stream_pagein (&codec->os, page);
@@ -373,8 +372,8 @@ ogg_codec_t *initial_vorbis_page (format_plugin_t *plugin, ogg_page *page)
         ogg_stream_clear (&codec->os);
         vorbis_info_clear (&vorbis->vi);
         vorbis_comment_clear (&plugin->vc);
-        free (vorbis);
-        free (codec);
+        arena_free (&ogg_info->codec_arena, vorbis, sizeof (vorbis_codec_t));
+        arena_free (&ogg_info->codec_arena, codec, sizeof (ogg_codec_t));
         return NULL;
     }
     ICECAST_LOG_INFO("seen initial vorbis header");
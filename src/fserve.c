@@ -30,12 +30,10 @@
 #include <unistd.h>
 #include <sys/time.h>
 #include <sys/socket.h>
-#define SCN_OFF_T SCNdMAX
 #define PRI_OFF_T PRIdMAX
 #else
 #include <winsock2.h>
 #include <windows.h>
-#define SCN_OFF_T "ld"
 #define PRI_OFF_T "ld"
 #ifndef S_ISREG
 #define S_ISREG(mode)  ((mode) & _S_IFREG)
@@ -43,7 +41,6 @@
 #endif
 
 #include "common/thread/thread.h"
-#include "common/avl/avl.h"
 #include "common/httpp/httpp.h"
 #include "common/net/sock.h"
 
@@ -60,123 +57,267 @@
 #include "cfgfile.h"
 #include "util.h"
 #include "admin.h"
+#include "fdpoll.h"
+#include "atomic.h"
+#include "filecache.h"
+#include "affinity.h"
+#include "hls.h"
 
 #undef CATMODULE
 #define CATMODULE "fserve"
 
 #define BUFSIZE 4096
+/* file data is read in blocks of one TLS record, the largest pooled size */
+#define FSERVE_BLOCK_SIZE       16384
+/* most bytes handed to sendfile at once, so one client can not hold up
+ * the others for long */
+#define FSERVE_SENDFILE_SIZE    (256*1024)
+/* most ready clients handled per wakeup, the others are reported next time */
+#define FSERVE_MAX_EVENTS       256
 
 static volatile int __inited = 0;
 
-static fserve_t *active_list = NULL;
-static fserve_t *pending_list = NULL;
-
-static spin_t pending_lock;
-static avl_tree *mimetypes = NULL;
-
-static volatile int run_fserv = 0;
-static unsigned int fserve_clients;
-static int client_tree_changed = 0;
+/* Clients are spread over the workers when they are added and stay on the
+ * same one until they are done. Each worker runs its own thread, started
+ * when it gets a client and ending once it has none left. */
+typedef struct {
+    unsigned int index;
+
+    /* protects pending_list, running and thread */
+    spin_t pending_lock;
+    fserve_t *pending_list;
+    volatile int running;
+    /* the last thread started, joined before the next one is started */
+    thread_type *thread;
+
+    /* only used by the thread of the worker */
+    fserve_t *active_list;
+    unsigned int clients;
+    int tree_changed;
+
+    /* Clients stay armed in poll for as long as they are active, so only
+     * the ones that are ready are reported. Without it the fd set below is
+     * rebuilt whenever the list changes. */
+    fdpoll_t *poll;
+    fdpoll_result_t results[FSERVE_MAX_EVENTS];
+    ssize_t ready;
 
 #ifdef HAVE_POLL
-static struct pollfd *ufds = NULL;
+    struct pollfd *ufds;
 #else
-static fd_set fds;
-static sock_t fd_max = SOCK_ERROR;
+    fd_set fds;
+    sock_t fd_max;
 #endif
+} fserve_worker_t;
+
+static fserve_worker_t *workers = NULL;
+static unsigned int workers_count;
+static unsigned int workers_next;
 
 typedef struct {
     char *ext;
     char *type;
 } mime_type;
 
+/* open addressing, an entry with ext NULL is free */
+typedef struct {
+    size_t mask;
+    size_t count;
+    mime_type *entries;
+} mime_table_t;
+
+/* A reload builds a new table without the lock and only takes it for
+ * writing to swap it in, lookups take it for reading.
+ */
+static rwlock_t mimetypes_lock;
+static mime_table_t *mimetypes = NULL;
+
 static void fserve_client_destroy(fserve_t *fclient);
-static int _delete_mapping(void *mapping);
+static void mime_table_free(mime_table_t *table);
+static void mime_table_swap(mime_table_t *table);
 static void *fserv_thread_function(void *arg);
+static int fserve_add_file(client_t *client, FILE *file, off_t length);
 
-void fserve_initialize(void)
+int fserve_initialize(void)
 {
     ice_config_t *config = config_get_config();
+    unsigned int count = config->fserve_workers;
+    unsigned int i;
+
+    workers = calloc (count, sizeof(*workers));
+    if (workers == NULL)
+    {
+        ICECAST_LOG_ERROR("Can not allocate %u file serving workers, using one", count);
+        count = 1;
+        workers = calloc (count, sizeof(*workers));
+        if (workers == NULL)
+        {
+            config_release_config();
+            ICECAST_LOG_ERROR("Can not allocate a file serving worker");
+            return -1;
+        }
+    }
+    workers_count = count;
 
     mimetypes = NULL;
-    active_list = NULL;
-    pending_list = NULL;
-    thread_spin_create (&pending_lock);
+    thread_rwlock_create (&mimetypes_lock);
+
+    workers_next = 0;
+
+    for (i = 0; i < workers_count; i++)
+    {
+        fserve_worker_t *worker = &workers[i];
+
+        worker->index = i;
+        thread_spin_create (&worker->pending_lock);
+#ifndef HAVE_POLL
+        worker->fd_max = SOCK_ERROR;
+#endif
+        worker->poll = fdpoll_new();
+        if (!worker->poll && i == 0)
+            ICECAST_LOG_INFO("No event notification available, file serving polls all clients");
+    }
 
     fserve_recheck_mime_types (config);
     config_release_config();
 
     __inited = 1;
 
-    stats_event (NULL, "file_connections", "0");
-    ICECAST_LOG_INFO("file serving started");
+    stats_event_args (NULL, "fserve_workers", "%u", workers_count);
+    ICECAST_LOG_INFO("file serving started with %u workers", workers_count);
+
+    return 0;
 }
 
 void fserve_shutdown(void)
 {
+    unsigned int i;
+
     if (!__inited)
         return;
 
-    thread_spin_lock (&pending_lock);
-    run_fserv = 0;
-    while (pending_list)
+    /* the threads notice within a poll timeout and leave the lists alone
+     * from then on */
+    for (i = 0; i < workers_count; i++)
     {
-        fserve_t *to_go = (fserve_t *)pending_list;
-        pending_list = to_go->next;
+        fserve_worker_t *worker = &workers[i];
+        thread_type *thread;
+
+        thread_spin_lock (&worker->pending_lock);
+        worker->running = 0;
+        thread = worker->thread;
+        worker->thread = NULL;
+        thread_spin_unlock (&worker->pending_lock);
 
-        fserve_client_destroy (to_go);
+        if (thread)
+            thread_join (thread);
     }
-    while (active_list)
+
+    for (i = 0; i < workers_count; i++)
     {
-        fserve_t *to_go = active_list;
-        active_list = to_go->next;
-        fserve_client_destroy (to_go);
+        fserve_worker_t *worker = &workers[i];
+
+        while (worker->pending_list)
+        {
+            fserve_t *to_go = worker->pending_list;
+            worker->pending_list = to_go->next;
+
+            fserve_client_destroy (to_go);
+        }
+        while (worker->active_list)
+        {
+            fserve_t *to_go = worker->active_list;
+            worker->active_list = to_go->next;
+            fserve_client_destroy (to_go);
+        }
+        thread_spin_destroy (&worker->pending_lock);
+        fdpoll_free (worker->poll);
+#ifdef HAVE_POLL
+        free (worker->ufds);
+#endif
     }
+    free (workers);
+    workers = NULL;
+    workers_count = 0;
 
-    if (mimetypes)
-        avl_tree_free (mimetypes, _delete_mapping);
+    mime_table_swap (NULL);
+    thread_rwlock_destroy (&mimetypes_lock);
 
-    thread_spin_unlock (&pending_lock);
-    thread_spin_destroy (&pending_lock);
+    stats_event (NULL, "fserve_workers", NULL);
     ICECAST_LOG_INFO("file serving stopped");
 }
 
+int fserve_busy(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < workers_count; i++)
+        if (workers[i].running)
+            return 1;
+    return 0;
+}
+
+static int fserve_client_wait_events (fserve_worker_t *worker)
+{
+    if (fdpoll_count (worker->poll) == 0) {
+        int ret = 0;
+
+        /* nothing left to do, unless a client was just added */
+        thread_spin_lock (&worker->pending_lock);
+        if (worker->pending_list == NULL) {
+            worker->running = 0;
+            ret = -1;
+        }
+        thread_spin_unlock (&worker->pending_lock);
+        return ret;
+    }
+
+    worker->ready = fdpoll_wait (worker->poll, 200, worker->results, FSERVE_MAX_EVENTS);
+    if (worker->ready < 0) {
+        ICECAST_LOG_ERROR("Waiting for file serving clients failed: %s", strerror(errno));
+        worker->ready = 0;
+        return 0;
+    }
+
+    return worker->ready > 0;
+}
+
 #ifdef HAVE_POLL
-int fserve_client_waiting (void)
+static int fserve_client_waiting (fserve_worker_t *worker)
 {
     fserve_t *fclient;
     unsigned int i = 0;
 
     /* only rebuild ufds if there are clients added/removed */
-    if (client_tree_changed) {
-        struct pollfd *ufds_new = realloc(ufds, fserve_clients * sizeof(struct pollfd));
+    if (worker->tree_changed) {
+        struct pollfd *ufds_new = realloc(worker->ufds, worker->clients * sizeof(struct pollfd));
         /* REVIEW: If we can not allocate new ufds, keep old ones for now. */
-        if (ufds_new || fserve_clients == 0) {
-            ufds = ufds_new;
-            client_tree_changed = 0;
-            fclient = active_list;
+        if (ufds_new || worker->clients == 0) {
+            worker->ufds = ufds_new;
+            worker->tree_changed = 0;
+            fclient = worker->active_list;
             while (fclient)
             {
-                ufds[i].fd = fclient->client->con->sock;
-                ufds[i].events = POLLOUT;
-                ufds[i].revents = 0;
+                worker->ufds[i].fd = fclient->client->con->sock;
+                worker->ufds[i].events = POLLOUT;
+                worker->ufds[i].revents = 0;
                 fclient = fclient->next;
                 i++;
             }
         }
     }
 
-    if (!ufds) {
-        thread_spin_lock (&pending_lock);
-        run_fserv = 0;
-        thread_spin_unlock (&pending_lock);
+    if (!worker->ufds) {
+        thread_spin_lock (&worker->pending_lock);
+        worker->running = 0;
+        thread_spin_unlock (&worker->pending_lock);
         return -1;
-    } else if (poll(ufds, fserve_clients, 200) > 0) {
+    } else if (poll(worker->ufds, worker->clients, 200) > 0) {
         /* mark any clients that are ready */
-        fclient = active_list;
-        for (i=0; i<fserve_clients; i++)
+        fclient = worker->active_list;
+        for (i=0; i<worker->clients; i++)
         {
-            if (ufds[i].revents & (POLLOUT|POLLHUP|POLLERR))
+            if (worker->ufds[i].revents & (POLLOUT|POLLHUP|POLLERR))
             fclient->ready = 1;
             fclient = fclient->next;
         }
@@ -186,30 +327,30 @@ int fserve_client_waiting (void)
     return 0;
 }
 #else
-int fserve_client_waiting(void)
+static int fserve_client_waiting (fserve_worker_t *worker)
 {
     fserve_t *fclient;
     fd_set realfds;
 
     /* only rebuild fds if there are clients added/removed */
-    if (client_tree_changed) {
-        client_tree_changed = 0;
-        FD_ZERO(&fds);
-        fd_max = SOCK_ERROR;
-        fclient = active_list;
+    if (worker->tree_changed) {
+        worker->tree_changed = 0;
+        FD_ZERO(&worker->fds);
+        worker->fd_max = SOCK_ERROR;
+        fclient = worker->active_list;
         while (fclient) {
-            FD_SET(fclient->client->con->sock, &fds);
-            if (fclient->client->con->sock > fd_max || fd_max == SOCK_ERROR)
-                fd_max = fclient->client->con->sock;
+            FD_SET(fclient->client->con->sock, &worker->fds);
+            if (fclient->client->con->sock > worker->fd_max || worker->fd_max == SOCK_ERROR)
+                worker->fd_max = fclient->client->con->sock;
             fclient = fclient->next;
         }
     }
     /* hack for windows, select needs at least 1 descriptor */
-    if (fd_max == SOCK_ERROR)
+    if (worker->fd_max == SOCK_ERROR)
     {
-        thread_spin_lock (&pending_lock);
-        run_fserv = 0;
-        thread_spin_unlock (&pending_lock);
+        thread_spin_lock (&worker->pending_lock);
+        worker->running = 0;
+        thread_spin_unlock (&worker->pending_lock);
         return -1;
     }
     else
@@ -219,11 +360,11 @@ int fserve_client_waiting(void)
         tv.tv_usec = 200000;
         /* make a duplicate of the set so we do not have to rebuild it
          * each time around */
-        memcpy(&realfds, &fds, sizeof(fd_set));
-        if(select(fd_max+1, NULL, &realfds, NULL, &tv) > 0)
+        memcpy(&realfds, &worker->fds, sizeof(fd_set));
+        if(select(worker->fd_max+1, NULL, &realfds, NULL, &tv) > 0)
         {
             /* mark any clients that are ready */
-            fclient = active_list;
+            fclient = worker->active_list;
             while (fclient)
             {
                 if (FD_ISSET (fclient->client->con->sock, &realfds))
@@ -237,110 +378,237 @@ int fserve_client_waiting(void)
 }
 #endif
 
-static int wait_for_fds(void)
+/* Unlinks a client from the active list and destroys it */
+static void fserve_remove(fserve_worker_t *worker, fserve_t *fclient)
 {
-    fserve_t *fclient;
+    if (worker->poll)
+        fdpoll_disarm (worker->poll, fclient->client->con->sock);
+
+    if (fclient->prev)
+        fclient->prev->next = fclient->next;
+    else
+        worker->active_list = fclient->next;
+    if (fclient->next)
+        fclient->next->prev = fclient->prev;
+
+    worker->clients--;
+    worker->tree_changed = 1;
+    fserve_client_destroy (fclient);
+}
+
+static int wait_for_fds(fserve_worker_t *worker)
+{
+    fserve_t *fclient, *failed = NULL;
     int ret;
 
-    while (run_fserv)
+    while (worker->running)
     {
         /* add any new clients here */
-        if (pending_list)
+        if (worker->pending_list)
         {
-            thread_spin_lock (&pending_lock);
+            thread_spin_lock (&worker->pending_lock);
 
-            fclient = (fserve_t*)pending_list;
+            fclient = worker->pending_list;
             while (fclient)
             {
                 fserve_t *to_move = fclient;
                 fclient = fclient->next;
-                to_move->next = active_list;
-                active_list = to_move;
-                client_tree_changed = 1;
-                fserve_clients++;
+                if (worker->poll && fdpoll_arm (worker->poll, to_move->client->con->sock, FDPOLL_EVENT_WRITE, to_move) != 0)
+                {
+                    /* it would never be reported ready */
+                    ICECAST_LOG_ERROR("Can not watch file serving client %p: %s", to_move->client, strerror(errno));
+                    to_move->next = failed;
+                    failed = to_move;
+                    continue;
+                }
+                to_move->prev = NULL;
+                to_move->next = worker->active_list;
+                if (worker->active_list)
+                    worker->active_list->prev = to_move;
+                worker->active_list = to_move;
+                worker->tree_changed = 1;
+                worker->clients++;
+            }
+            worker->pending_list = NULL;
+            thread_spin_unlock(&worker->pending_lock);
+
+            while (failed)
+            {
+                fserve_t *to_go = failed;
+                failed = to_go->next;
+                fserve_client_destroy (to_go);
             }
-            pending_list = NULL;
-            thread_spin_unlock(&pending_lock);
         }
         /* drop out of here if someone is ready */
-        ret = fserve_client_waiting();
+        if (worker->poll)
+            ret = fserve_client_wait_events(worker);
+        else
+            ret = fserve_client_waiting(worker);
         if (ret)
             return ret;
     }
     return -1;
 }
 
-static void *fserv_thread_function(void *arg)
+/* how much of the file to read or send next, at most len */
+static size_t fserve_want(fserve_t *fclient, size_t len)
+{
+    if (fclient->remaining >= 0 && (uintmax_t)fclient->remaining < len)
+        return (size_t)fclient->remaining;
+    return len;
+}
+
+/* notes that bytes of the file were read or sent */
+static ssize_t fserve_limit(fserve_t *fclient, ssize_t bytes)
+{
+    if (fclient->remaining >= 0 && bytes > 0)
+        fclient->remaining -= bytes;
+    return bytes;
+}
+
+/* Reads the next block of the file into client->refbuf. The buffer the
+ * header was built in is swapped for a larger one first. */
+static size_t fserve_read_block(fserve_t *fclient)
+{
+    client_t *client = fclient->client;
+    refbuf_t *refbuf = client->refbuf;
+
+    if (!fclient->block) {
+        refbuf_t *block = refbuf_new(FSERVE_BLOCK_SIZE);
+
+        block->next = refbuf->next;
+        refbuf->next = NULL;
+        refbuf_release(refbuf);
+        client->refbuf = block;
+        refbuf = block;
+        fclient->block = 1;
+    }
+
+    return fserve_limit(fclient, fread(refbuf->data, 1, fserve_want(fclient, FSERVE_BLOCK_SIZE), fclient->file));
+}
+
+/* Sends the next part of the file with sendfile. Returns 1 if something was
+ * sent or the socket is full, 0 at the end of the file or if the file has
+ * to be read instead. */
+static int fserve_send_file(fserve_t *fclient)
 {
-    fserve_t *fclient, **trail;
+    client_t *client = fclient->client;
+    ssize_t ret;
+
+    if (fclient->remaining == 0)
+        return 0;
+
+    ret = fserve_limit(fclient, connection_send_file(client->con, fileno(fclient->file), &fclient->offset, fserve_want(fclient, FSERVE_SENDFILE_SIZE)));
+    if (ret < 0 && (errno == EINVAL || errno == ENOSYS)) {
+        ICECAST_LOG_DEBUG("Can not use sendfile for client %p, reading the file", client);
+        fclient->sendfile = 0;
+        if (fseeko(fclient->file, fclient->offset, SEEK_SET) != 0)
+            client->con->error = 1;
+        return 0;
+    }
+
+    return ret != 0;
+}
+
+/* Sends the next part of the file or buffers to a client that is ready.
+ * Returns -1 once the client is done or failed, 0 otherwise. */
+static int fserve_send(fserve_t *fclient)
+{
+    client_t *client = fclient->client;
+    refbuf_t *refbuf = client->refbuf;
     size_t bytes;
+    int sent = 0;
+
+    if (client->pos == refbuf->len)
+    {
+        /* Grab a new chunk, or send it straight from the file */
+        bytes = 0;
+        if (fclient->file && fclient->sendfile)
+            sent = fserve_send_file (fclient);
+        if (fclient->file && !fclient->sendfile && !client->con->error)
+        {
+            bytes = fserve_read_block (fclient);
+            refbuf = client->refbuf;
+        }
+        if (client->con->error)
+            sent = 1;
+        else if (bytes == 0 && !sent)
+        {
+            if (refbuf->next == NULL)
+                return -1;
+            refbuf = refbuf->next;
+            client->refbuf->next = NULL;
+            refbuf_release (client->refbuf);
+            client->refbuf = refbuf;
+            fclient->block = 0;
+            bytes = refbuf->len;
+        }
+        if (!sent)
+        {
+            refbuf->len = (unsigned int)bytes;
+            client->pos = 0;
+        }
+    }
+
+    /* Now try and send current chunk. */
+    if (!sent)
+        format_generic_write_to_client (client);
 
-    (void)arg;
+    return client->con->error ? -1 : 0;
+}
+
+static void *fserv_thread_function(void *arg)
+{
+    fserve_worker_t *worker = arg;
+    fserve_t *fclient;
+    ssize_t i;
+
+    affinity_apply(CPU_AFFINITY_FSERVE);
 
     while (1)
     {
-        if (wait_for_fds() < 0)
+        if (wait_for_fds(worker) < 0)
             break;
 
-        fclient = active_list;
-        trail = &active_list;
+        if (worker->poll)
+        {
+            /* only the clients reported ready are looked at */
+            for (i = 0; i < worker->ready; i++)
+            {
+                fclient = worker->results[i].userdata;
+                if (fserve_send (fclient) < 0)
+                    fserve_remove (worker, fclient);
+            }
+            continue;
+        }
 
+        fclient = worker->active_list;
         while (fclient)
         {
+            fserve_t *next = fclient->next;
+
             /* process this client, if it is ready */
             if (fclient->ready)
             {
-                client_t *client = fclient->client;
-                refbuf_t *refbuf = client->refbuf;
                 fclient->ready = 0;
-                if (client->pos == refbuf->len)
-                {
-                    /* Grab a new chunk */
-                    if (fclient->file)
-                        bytes = fread (refbuf->data, 1, BUFSIZE, fclient->file);
-                    else
-                        bytes = 0;
-                    if (bytes == 0)
-                    {
-                        if (refbuf->next == NULL)
-                        {
-                            fserve_t *to_go = fclient;
-                            fclient = fclient->next;
-                            *trail = fclient;
-                            fserve_client_destroy (to_go);
-                            fserve_clients--;
-                            client_tree_changed = 1;
-                            continue;
-                        }
-                        refbuf = refbuf->next;
-                        client->refbuf->next = NULL;
-                        refbuf_release (client->refbuf);
-                        client->refbuf = refbuf;
-                        bytes = refbuf->len;
-                    }
-                    refbuf->len = (unsigned int)bytes;
-                    client->pos = 0;
-                }
-
-                /* Now try and send current chunk. */
-                format_generic_write_to_client (client);
-
-                if (client->con->error)
-                {
-                    fserve_t *to_go = fclient;
-                    fclient = fclient->next;
-                    *trail = fclient;
-                    fserve_clients--;
-                    fserve_client_destroy (to_go);
-                    client_tree_changed = 1;
-                    continue;
-                }
+                if (fserve_send (fclient) < 0)
+                    fserve_remove (worker, fclient);
             }
-            trail = &fclient->next;
-            fclient = fclient->next;
+            fclient = next;
         }
     }
-    ICECAST_LOG_DEBUG("fserve handler exit");
+    ICECAST_LOG_DEBUG("fserve worker %u exit", worker->index);
+    return NULL;
+}
+
+static mime_type *mime_table_find(mime_table_t *table, const char *ext)
+{
+    size_t i;
+
+    for (i = util_hash_string(ext) & table->mask; table->entries[i].ext; i = (i + 1) & table->mask)
+        if (strcmp (table->entries[i].ext, ext) == 0)
+            return &table->entries[i];
+
     return NULL;
 }
 
@@ -348,14 +616,16 @@ static void *fserv_thread_function(void *arg)
 char *fserve_content_type(const char *path)
 {
     char *ext = util_get_extension(path);
-    mime_type exttype = {ext, NULL};
-    void *result;
+    mime_table_t *table;
+    mime_type *mime = NULL;
     char *type;
 
-    thread_spin_lock (&pending_lock);
-    if (mimetypes && !avl_get_by_key (mimetypes, &exttype, &result))
+    thread_rwlock_rlock (&mimetypes_lock);
+    table = mimetypes;
+    if (table)
+        mime = mime_table_find (table, ext);
+    if (mime)
     {
-        mime_type *mime = result;
         type = strdup (mime->type);
     }
     else {
@@ -381,7 +651,7 @@ char *fserve_content_type(const char *path)
         else
             type = strdup ("application/octet-stream");
     }
-    thread_spin_unlock (&pending_lock);
+    thread_rwlock_unlock (&mimetypes_lock);
     return type;
 }
 
@@ -405,21 +675,438 @@ static void fserve_client_destroy(fserve_t *fclient)
 /* client has requested a file, so check for it and send the file.  Do not
  * refer to the client_t afterwards.  return 0 for success, -1 on error.
  */
-int fserve_client_create (client_t *httpclient)
+/* precompressed siblings of a file, in order of preference */
+static const struct {
+    const char *encoding;
+    const char *suffix;
+} fserve_encodings[] = {
+    {"br",      ".br"},
+    {"gzip",    ".gz"}
+};
+
+/* whether coding is acceptable by the Accept-Encoding header */
+static int fserve_accepts_encoding (const char *header, const char *coding)
+{
+    size_t len = strlen (coding);
+    int wildcard = 0;
+
+    while (*header)
+    {
+        const char *token;
+        size_t token_len;
+        const char *q;
+        int accepted = 1;
+
+        while (*header == ' ' || *header == '\t' || *header == ',')
+            header++;
+        token = header;
+        while (*header && *header != ',' && *header != ';' && *header != ' ' && *header != '\t')
+            header++;
+        token_len = header - token;
+
+        /* only q=0 turns a coding down */
+        q = header;
+        while (*header && *header != ',')
+            header++;
+        while ((q = strchr (q, ';')) && q < header)
+        {
+            q++;
+            while (*q == ' ' || *q == '\t')
+                q++;
+            if ((*q == 'q' || *q == 'Q') && q[1] == '=')
+                accepted = strtod (q + 2, NULL) > 0;
+        }
+
+        if (token_len == len && strncasecmp (token, coding, len) == 0)
+            return accepted;
+        if (token_len == 1 && *token == '*')
+            wildcard = accepted;
+    }
+
+    return wildcard;
+}
+
+/* Looks for a precompressed sibling of fullpath the client accepts. If
+ * there is one *fullpath is replaced by its path and its encoding is
+ * returned, otherwise NULL. */
+static const char *fserve_pick_encoding (client_t *httpclient, char **fullpath)
+{
+    const char *header = httpp_getvar (httpclient->parser, "accept-encoding");
+    size_t len = strlen (*fullpath);
+    size_t i;
+
+    if (header == NULL)
+        return NULL;
+
+    for (i = 0; i < (sizeof(fserve_encodings)/sizeof(*fserve_encodings)); i++)
+    {
+        struct stat st;
+        char *path;
+
+        if (!fserve_accepts_encoding (header, fserve_encodings[i].encoding))
+            continue;
+        path = malloc (len + strlen (fserve_encodings[i].suffix) + 1);
+        if (path == NULL)
+            return NULL;
+        memcpy (path, *fullpath, len);
+        strcpy (path + len, fserve_encodings[i].suffix);
+        if (stat (path, &st) == 0 && S_ISREG (st.st_mode))
+        {
+            free (*fullpath);
+            *fullpath = path;
+            return fserve_encodings[i].encoding;
+        }
+        free (path);
+    }
+
+    return NULL;
+}
+
+/* ETag and Last-Modified of a file of the given size and mtime. The tag
+ * changes whenever the file is replaced or written to, and differs for
+ * each encoding. */
+static void fserve_validators (time_t mtime, off_t size, const char *encoding, char *etag, size_t etag_len, char *lastmod, size_t lastmod_len)
+{
+    struct tm result;
+    struct tm *gmtime_result;
+
+    snprintf (etag, etag_len, "\"%llx-%llx%s%s\"", (unsigned long long)size, (unsigned long long)mtime,
+        encoding ? "-" : "", encoding ? encoding : "");
+
+#ifndef _WIN32
+    gmtime_result = gmtime_r (&mtime, &result);
+#else
+    gmtime_result = gmtime (&mtime);
+    if (gmtime_result)
+        memcpy (&result, gmtime_result, sizeof (result));
+#endif
+    if (gmtime_result == NULL || strftime (lastmod, lastmod_len, "%a, %d %b %Y %H:%M:%S GMT", &result) == 0)
+        lastmod[0] = '\0';
+}
+
+/* Parses an IMF-fixdate as sent in If-Modified-Since, the obsolete formats
+ * are not understood. Returns 0 on success. */
+static int fserve_parse_http_date (const char *str, time_t *when)
+{
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char month[4];
+    const char *found;
+    int day, year, hour, min, sec, mon;
+    long long days;
+
+    if (sscanf (str, "%*3s, %d %3s %d %d:%d:%d GMT", &day, month, &year, &hour, &min, &sec) != 6)
+        return -1;
+    found = strstr (months, month);
+    if (strlen (month) != 3 || found == NULL || (found - months) % 3)
+        return -1;
+    mon = (found - months) / 3 + 1;
+    if (day < 1 || day > 31 || year < 1970 || hour > 23 || min > 59 || sec > 60)
+        return -1;
+
+    /* days since the epoch of the civil date */
+    if (mon <= 2)
+        year--;
+    days = (long long)year * 365 + year / 4 - year / 100 + year / 400
+         + (153 * (mon > 2 ? mon - 3 : mon + 9) + 2) / 5 + day - 1 - 719468;
+
+    *when = (time_t)(days * 86400 + hour * 3600 + min * 60 + sec);
+    return 0;
+}
+
+/* whether the entity tag is in the If-None-Match list, weakly compared */
+static int fserve_etag_match (const char *list, const char *etag)
+{
+    size_t len = strlen (etag);
+
+    while (*list)
+    {
+        while (*list == ' ' || *list == '\t' || *list == ',')
+            list++;
+        if (*list == '*')
+            return 1;
+        if (strncmp (list, "W/", 2) == 0)
+            list += 2;
+        if (strncmp (list, etag, len) == 0 && (list[len] == '\0' || list[len] == ',' || list[len] == ' ' || list[len] == '\t'))
+            return 1;
+        while (*list && *list != ',')
+            list++;
+    }
+
+    return 0;
+}
+
+/* Returns 1 if the copy the client already has is still current */
+static int fserve_not_modified (client_t *client, const char *etag, time_t mtime)
+{
+    const char *header;
+    time_t since;
+
+    /* If-Modified-Since is ignored when If-None-Match is given */
+    header = httpp_getvar (client->parser, "if-none-match");
+    if (header)
+        return fserve_etag_match (header, etag);
+
+    header = httpp_getvar (client->parser, "if-modified-since");
+    if (header && fserve_parse_http_date (header, &since) == 0)
+        return mtime <= since;
+
+    return 0;
+}
+
+/* Parses the Range header for a file of the given size. Returns 1 and sets
+ * the first and last byte for a single satisfiable range, -1 if it can not
+ * be satisfied and 0 if the whole file is to be sent instead. Sets of
+ * several ranges are answered with the whole file, as RFC 7233 allows.
+ */
+static int fserve_parse_range (const char *range, off_t size, off_t *first, off_t *last)
+{
+    intmax_t start, end;
+    char *tail;
+
+    if (strncasecmp (range, "bytes=", 6) != 0 || strchr (range, ','))
+        return 0;
+    range += 6;
+    while (*range == ' ')
+        range++;
+
+    if (*range == '-') {
+        /* the last bytes of the file */
+        end = strtoimax (range + 1, &tail, 10);
+        if (tail == range + 1 || end < 0)
+            return 0;
+        if (end == 0 || size == 0)
+            return -1;
+        *first = end < size ? size - end : 0;
+        *last = size - 1;
+        return 1;
+    }
+
+    start = strtoimax (range, &tail, 10);
+    if (tail == range || start < 0 || *tail != '-')
+        return 0;
+    range = tail + 1;
+    if (*range >= '0' && *range <= '9') {
+        end = strtoimax (range, &tail, 10);
+        if (end < start)
+            return 0;
+    } else {
+        end = size - 1;
+    }
+
+    if (start >= size)
+        return -1;
+    *first = start;
+    *last = end < size ? end : size - 1;
+    return 1;
+}
+
+/* Refuses a range of a file of the given size, the Content-Range tells the
+ * client what it could have asked for instead.
+ */
+static void fserve_send_416 (client_t *httpclient, off_t size)
+{
+    const icecast_error_t *error = error_get_by_id (ICECAST_ERROR_FSERV_REQUEST_RANGE_NOT_SATISFIABLE);
+    char content_range[64];
+
+    snprintf (content_range, sizeof (content_range), "Content-Range: bytes */%" PRI_OFF_T "\r\n", size);
+    client_send_buffer (httpclient, 416, "text/plain", "utf-8", error->message, -1, content_range);
+}
+
+/* Builds the response headers for a file of the given size and mtime into
+ * the client's buffer. encoding is the Content-Encoding of the file or NULL.
+ * Ranges are only looked at if allowed. Returns the
+ * HTTP status, with *first and *length set to the part of the file to send
+ * for 200 and 206. For 304 only the headers are to be sent. Returns 416 if
+ * the range can not be satisfied and -1 if the headers could not be built,
+ * in both cases nothing was built.
+ */
+static int fserve_build_response (client_t *httpclient, time_t mtime, off_t size, const char *encoding, int allow_range, off_t *first, off_t *length)
 {
+    char etag[48];
+    char lastmod[64];
+    char validators[224];
+    char content_range[96] = "";
+    const char *range = NULL;
+    const char *if_range;
+    char *type = NULL;
+    off_t last = size - 1;
+    int status = 200;
     int bytes;
+
+    /* the response depends on Accept-Encoding even without a sibling, as
+     * one may be added later */
+    fserve_validators (mtime, size, encoding, etag, sizeof (etag), lastmod, sizeof (lastmod));
+    snprintf (validators, sizeof (validators), "Vary: Accept-Encoding\r\nETag: %s\r\n%s%s%s",
+        etag, lastmod[0] ? "Last-Modified: " : "", lastmod, lastmod[0] ? "\r\n" : "");
+
+    *first = 0;
+    if (fserve_not_modified (httpclient, etag, mtime))
+    {
+        status = 304;
+    }
+    else if (allow_range && (range = httpp_getvar (httpclient->parser, "range")))
+    {
+        /* a range of an older version is no use, send it all */
+        if_range = httpp_getvar (httpclient->parser, "if-range");
+        if (if_range == NULL || strcmp (if_range, etag) == 0 || (lastmod[0] && strcmp (if_range, lastmod) == 0))
+        {
+            switch (fserve_parse_range (range, size, first, &last))
+            {
+                case -1:
+                    return 416;
+                case 1:
+                    status = 206;
+                    snprintf (content_range, sizeof (content_range),
+                        "Content-Range: bytes %" PRI_OFF_T "-%" PRI_OFF_T "/%" PRI_OFF_T "\r\n",
+                        *first, last, size);
+                break;
+            }
+        }
+    }
+    *length = last - *first + 1;
+
+    httpclient->respcode = status;
+    httpclient->refbuf->len = PER_CLIENT_REFBUF_SIZE;
+    if (status != 304)
+        type = fserve_content_type (httpclient->uri);
+    bytes = util_http_build_header (httpclient->refbuf->data, BUFSIZE, 0,
+                                    1, status, NULL,
+                                    type, NULL,
+                                    NULL, NULL, httpclient);
+    free (type);
+    if (bytes == -1 || bytes >= (BUFSIZE - 512)) { /* we want at least 512 bytes left */
+        ICECAST_LOG_ERROR("Dropping client as we can not build response headers.");
+        client_send_error_by_id(httpclient, ICECAST_ERROR_GEN_HEADER_GEN_FAILED);
+        return -1;
+    }
+
+    if (status == 304)
+    {
+        bytes += snprintf (httpclient->refbuf->data + bytes, BUFSIZE - bytes,
+            "%s\r\n", validators);
+    }
+    else
+    {
+        bytes += snprintf (httpclient->refbuf->data + bytes, BUFSIZE - bytes,
+            "Accept-Ranges: bytes\r\n"
+            "%s%s%s"
+            "%s"
+            "Content-Length: %" PRI_OFF_T "\r\n"
+            "%s\r\n",
+            encoding ? "Content-Encoding: " : "", encoding ? encoding : "", encoding ? "\r\n" : "",
+            validators,
+            *length,
+            content_range);
+    }
+    httpclient->refbuf->len = bytes;
+    httpclient->pos = 0;
+
+    return status;
+}
+
+/* Sends a file held by the file cache. The buffer is put after the header
+ * and shared with all other clients getting the same file. */
+static int fserve_client_cached (client_t *httpclient, refbuf_t *cached, time_t mtime, const char *encoding)
+{
+    ice_config_t *config;
+    off_t first, length;
+    int status;
+
+    config = config_get_config();
+    if (config->fileserve == 0)
+    {
+        ICECAST_LOG_DEBUG("on demand file \"%H\" refused. Serving static files has been disabled in the config", httpclient->uri);
+        client_send_error_by_id(httpclient, ICECAST_ERROR_FSERV_FILE_NOT_FOUND);
+        config_release_config();
+        refbuf_release (cached);
+        return -1;
+    }
+    config_release_config();
+
+    status = fserve_build_response (httpclient, mtime, cached->len, encoding, 0, &first, &length);
+    if (status < 0)
+    {
+        refbuf_release (cached);
+        return -1;
+    }
+    if (status == 304)
+        refbuf_release (cached);
+    else
+        httpclient->refbuf->next = cached;
+
+    stats_global_inc(STATS_GLOBAL_FILE_CONNECTIONS);
+    fserve_add_client (httpclient, NULL);
+
+    return 0;
+}
+
+/* Sends a HLS playlist or segment. They are only kept for a while, so
+ * there are no ranges, but caches may keep them for max_age seconds. */
+static int fserve_client_hls (client_t *httpclient, refbuf_t *data, const char *type, time_t mtime, unsigned int max_age)
+{
+    char etag[48];
+    char lastmod[64];
+    int status = 200;
+    int bytes;
+
+    fserve_validators (mtime, data->len, NULL, etag, sizeof (etag), lastmod, sizeof (lastmod));
+    if (fserve_not_modified (httpclient, etag, mtime))
+        status = 304;
+
+    httpclient->respcode = status;
+    httpclient->refbuf->len = PER_CLIENT_REFBUF_SIZE;
+    bytes = util_http_build_header (httpclient->refbuf->data, BUFSIZE, 0,
+                                    1, status, NULL,
+                                    status == 304 ? NULL : type, NULL,
+                                    NULL, NULL, httpclient);
+    if (bytes == -1 || bytes >= (BUFSIZE - 512)) {
+        ICECAST_LOG_ERROR("Dropping client as we can not build response headers.");
+        client_send_error_by_id(httpclient, ICECAST_ERROR_GEN_HEADER_GEN_FAILED);
+        refbuf_release (data);
+        return -1;
+    }
+
+    bytes += snprintf (httpclient->refbuf->data + bytes, BUFSIZE - bytes,
+        "Cache-Control: public, max-age=%u\r\nETag: %s\r\n%s%s%s",
+        max_age, etag, lastmod[0] ? "Last-Modified: " : "", lastmod, lastmod[0] ? "\r\n" : "");
+    if (status == 304) {
+        bytes += snprintf (httpclient->refbuf->data + bytes, BUFSIZE - bytes, "\r\n");
+        refbuf_release (data);
+    } else {
+        bytes += snprintf (httpclient->refbuf->data + bytes, BUFSIZE - bytes,
+            "Content-Length: %u\r\n\r\n", data->len);
+        httpclient->refbuf->next = data;
+    }
+    httpclient->refbuf->len = bytes;
+    httpclient->pos = 0;
+
+    stats_global_inc(STATS_GLOBAL_FILE_CONNECTIONS);
+    fserve_add_client (httpclient, NULL);
+
+    return 0;
+}
+
+int fserve_client_create (client_t *httpclient)
+{
     struct stat file_buf;
-    const char *range = NULL;
-    off_t new_content_len = 0;
-    off_t rangenumber = 0, content_length;
-    int rangeproblem = 0;
+    off_t first, length;
+    time_t mtime;
+    int status;
     int ret = 0;
     char *fullpath;
     int m3u_requested = 0, m3u_file_available = 1;
     const char * xslt_playlist_requested = NULL;
     int xslt_playlist_file_available = 1;
     ice_config_t *config;
+    const char *encoding;
+    refbuf_t *cached;
     FILE *file;
+    const char *type;
+    unsigned int max_age;
+
+    /* segments of a running source, not files */
+    if ((cached = hls_get (httpclient->uri, &type, &mtime, &max_age)))
+        return fserve_client_hls (httpclient, cached, type, mtime, max_age);
 
     fullpath = util_get_path_from_normalised_uri(httpclient->uri);
     ICECAST_LOG_INFO("checking for file %H (%H)", httpclient->uri, fullpath);
@@ -433,6 +1120,16 @@ int fserve_client_create (client_t *httpclient)
     if (strcmp (util_get_extension (fullpath), "vclt") == 0)
         xslt_playlist_requested = "vclt.xsl";
 
+    /* send file.br or file.gz instead if there is one the client takes */
+    encoding = fserve_pick_encoding (httpclient, &fullpath);
+
+    /* small files are served from memory, ranges always from disk */
+    if (httpp_getvar (httpclient->parser, "range") == NULL && (cached = filecache_get (fullpath, &mtime)))
+    {
+        free (fullpath);
+        return fserve_client_cached (httpclient, cached, mtime, encoding);
+    }
+
     /* check for the actual file */
     if (stat (fullpath, &file_buf) != 0)
     {
@@ -508,130 +1205,72 @@ int fserve_client_create (client_t *httpclient)
         return -1;
     }
 
+    status = fserve_build_response (httpclient, file_buf.st_mtime, file_buf.st_size, encoding, 1, &first, &length);
+    if (status == 416)
+    {
+        fserve_send_416 (httpclient, file_buf.st_size);
+        free (fullpath);
+        return -1;
+    }
+    if (status < 0)
+    {
+        free (fullpath);
+        return -1;
+    }
+
+    if (status == 304)
+    {
+        free (fullpath);
+        stats_global_inc(STATS_GLOBAL_FILE_CONNECTIONS);
+        fserve_add_client (httpclient, NULL);
+        return 0;
+    }
+
     file = fopen (fullpath, "rb");
-    if (file == NULL)
+    if (file == NULL || (first && fseeko (file, first, SEEK_SET) != 0))
     {
         ICECAST_LOG_WARN("Problem accessing file \"%H\"", fullpath);
         client_send_error_by_id(httpclient, ICECAST_ERROR_FSERV_FILE_NOT_READABLE);
+        if (file)
+            fclose (file);
         free (fullpath);
         return -1;
     }
     free (fullpath);
 
-    content_length = file_buf.st_size;
-    range = httpp_getvar (httpclient->parser, "range");
-
-    /* full http range handling is currently not done but we deal with the common case */
-    if (range != NULL) {
-        ret = 0;
-        if (strncasecmp (range, "bytes=", 6) == 0)
-            ret = sscanf (range+6, "%" SCN_OFF_T "-", &rangenumber);
-
-        if (ret != 1) {
-            /* format not correct, so lets just assume
-               we start from the beginning */
-            rangeproblem = 1;
-        }
-        if (rangenumber < 0) {
-            rangeproblem = 1;
-        }
-        if (!rangeproblem) {
-            ret = fseeko (file, rangenumber, SEEK_SET);
-            if (ret != -1) {
-                new_content_len = content_length - rangenumber;
-                if (new_content_len < 0) {
-                    rangeproblem = 1;
-                }
-            }
-            else {
-                rangeproblem = 1;
-            }
-            if (!rangeproblem) {
-                off_t endpos = rangenumber+new_content_len-1;
-                char *type;
-
-                if (endpos < 0) {
-                    endpos = 0;
-                }
-                httpclient->respcode = 206;
-                type = fserve_content_type(httpclient->uri);
-                bytes = util_http_build_header (httpclient->refbuf->data, BUFSIZE, 0,
-                                                0, 206, NULL,
-                                                type, NULL,
-                                                NULL, NULL, httpclient);
-                if (bytes == -1 || bytes >= (BUFSIZE - 512)) { /* we want at least 512 bytes left */
-                    ICECAST_LOG_ERROR("Dropping client as we can not build response headers.");
-                    client_send_error_by_id(httpclient, ICECAST_ERROR_GEN_HEADER_GEN_FAILED);
-                    return -1;
-                }
-                bytes += snprintf (httpclient->refbuf->data + bytes, BUFSIZE - bytes,
-                    "Accept-Ranges: bytes\r\n"
-                    "Content-Length: %" PRI_OFF_T "\r\n"
-                    "Content-Range: bytes %" PRI_OFF_T \
-                    "-%" PRI_OFF_T "/%" PRI_OFF_T "\r\n\r\n",
-                    new_content_len,
-                    rangenumber,
-                    endpos,
-                    content_length);
-                free (type);
-            }
-            else {
-                goto fail;
-            }
-        }
-        else {
-            goto fail;
-        }
-    }
-    else {
-        char *type = fserve_content_type(httpclient->uri);
-        httpclient->respcode = 200;
-        bytes = util_http_build_header (httpclient->refbuf->data, BUFSIZE, 0,
-                                        0, 200, NULL,
-                                        type, NULL,
-                                        NULL, NULL, httpclient);
-        if (bytes == -1 || bytes >= (BUFSIZE - 512)) { /* we want at least 512 bytes left */
-            ICECAST_LOG_ERROR("Dropping client as we can not build response headers.");
-            client_send_error_by_id(httpclient, ICECAST_ERROR_GEN_HEADER_GEN_FAILED);
-            fclose(file);
-            return -1;
-        }
-        bytes += snprintf (httpclient->refbuf->data + bytes, BUFSIZE - bytes,
-            "Accept-Ranges: bytes\r\n"
-            "Content-Length: %" PRI_OFF_T "\r\n\r\n",
-            content_length);
-        free (type);
-    }
-    httpclient->refbuf->len = bytes;
-    httpclient->pos = 0;
-
-    stats_event_inc (NULL, "file_connections");
-    fserve_add_client (httpclient, file);
+    stats_global_inc(STATS_GLOBAL_FILE_CONNECTIONS);
+    fserve_add_file (httpclient, file, length);
 
     return 0;
-
-fail:
-    fclose (file);
-    client_send_error_by_id(httpclient, ICECAST_ERROR_FSERV_REQUEST_RANGE_NOT_SATISFIABLE);
-    return -1;
 }
 
 
-/* Routine to actually add pre-configured client structure to pending list and
- * then to start off the file serving thread if it is not already running
+/* Routine to actually add pre-configured client structure to the pending
+ * list of the next worker and then to start off its thread if it is not
+ * already running
  */
 static void fserve_add_pending (fserve_t *fclient)
 {
-    thread_spin_lock (&pending_lock);
-    fclient->next = (fserve_t *)pending_list;
-    pending_list = fclient;
-    if (run_fserv == 0)
+    fserve_worker_t *worker = &workers[atomic_uint_add(&workers_next, 1) % workers_count];
+    thread_type *finished = NULL;
+
+    thread_spin_lock (&worker->pending_lock);
+    fclient->next = worker->pending_list;
+    worker->pending_list = fclient;
+    if (worker->running == 0)
     {
-        run_fserv = 1;
-        ICECAST_LOG_DEBUG("fserve handler waking up");
-        thread_create("File Serving Thread", fserv_thread_function, NULL, THREAD_DETACHED);
+        /* the previous thread stopped looking at the worker already */
+        finished = worker->thread;
+        worker->running = 1;
+        ICECAST_LOG_DEBUG("fserve worker %u waking up", worker->index);
+        worker->thread = thread_create("File Serving Thread", fserv_thread_function, worker, THREAD_ATTACHED);
+        if (worker->thread == NULL)
+            worker->running = 0;
     }
-    thread_spin_unlock (&pending_lock);
+    thread_spin_unlock (&worker->pending_lock);
+
+    if (finished)
+        thread_join (finished);
 }
 
 
@@ -639,6 +1278,15 @@ static void fserve_add_pending (fserve_t *fclient)
  * but may provide a NULL file if no data needs to be read
  */
 int fserve_add_client (client_t *client, FILE *file)
+{
+    return fserve_add_file (client, file, -1);
+}
+
+
+/* Like fserve_add_client(), but only length bytes of the file are sent, or
+ * all up to its end if length is negative
+ */
+static int fserve_add_file (client_t *client, FILE *file, off_t length)
 {
     fserve_t *fclient = calloc (1, sizeof(fserve_t));
 
@@ -651,6 +1299,13 @@ int fserve_add_client (client_t *client, FILE *file)
     fclient->file = file;
     fclient->client = client;
     fclient->ready = 0;
+    fclient->remaining = length;
+    /* plain connections get the file straight from the page cache, TLS
+     * has no sendfile and reads it in large blocks instead */
+    if (file && client->con->sendfile) {
+        fclient->offset = ftello(file);
+        fclient->sendfile = fclient->offset >= 0;
+    }
     fserve_add_pending (fclient);
 
     return 0;
@@ -680,21 +1335,106 @@ void fserve_add_client_callback (client_t *client, fserve_callback_t callback, v
 }
 
 
-static int _delete_mapping(void *mapping) {
-    mime_type *map = mapping;
-    free(map->ext);
-    free(map->type);
-    free(map);
+static void mime_table_free(mime_table_t *table)
+{
+    size_t i;
+
+    if (!table)
+        return;
 
-    return 1;
+    for (i = 0; i <= table->mask; i++)
+    {
+        free (table->entries[i].ext);
+        free (table->entries[i].type);
+    }
+    free (table->entries);
+    free (table);
+}
+
+static mime_table_t *mime_table_new(size_t slots)
+{
+    mime_table_t *table = calloc (1, sizeof(*table));
+
+    if (!table)
+        return NULL;
+
+    table->mask = slots - 1;
+    table->entries = calloc (slots, sizeof(*table->entries));
+    if (!table->entries)
+    {
+        free (table);
+        return NULL;
+    }
+
+    return table;
+}
+
+/* Adds or replaces the mapping, doubling the table when half full.
+ * Returns -1 if out of memory. Only used while the table is built. */
+static int mime_table_add(mime_table_t **tablep, const char *ext, const char *type)
+{
+    mime_table_t *table = *tablep;
+    mime_type *mime;
+    char *type_copy;
+    size_t i;
+
+    if ((table->count + 1) * 2 > table->mask + 1)
+    {
+        mime_table_t *bigger = mime_table_new ((table->mask + 1) * 2);
+
+        if (!bigger)
+            return -1;
+        for (i = 0; i <= table->mask; i++)
+        {
+            size_t j;
+
+            if (!table->entries[i].ext)
+                continue;
+            for (j = util_hash_string(table->entries[i].ext) & bigger->mask; bigger->entries[j].ext; j = (j + 1) & bigger->mask);
+            bigger->entries[j] = table->entries[i];
+            bigger->count++;
+        }
+        free (table->entries);
+        free (table);
+        *tablep = table = bigger;
+    }
+
+    type_copy = strdup (type);
+    if (!type_copy)
+        return -1;
+
+    mime = mime_table_find (table, ext);
+    if (mime)
+    {
+        free (mime->type);
+        mime->type = type_copy;
+        return 0;
+    }
+
+    for (i = util_hash_string(ext) & table->mask; table->entries[i].ext; i = (i + 1) & table->mask);
+    table->entries[i].ext = strdup (ext);
+    if (!table->entries[i].ext)
+    {
+        free (type_copy);
+        return -1;
+    }
+    table->entries[i].type = type_copy;
+    table->count++;
+
+    return 0;
 }
 
-static int _compare_mappings(void *arg, void *a, void *b)
+/* Makes table the one used for lookups and frees the previous one */
+static void mime_table_swap(mime_table_t *table)
 {
-    (void)arg;
-    return strcmp(
-            ((mime_type *)a)->ext,
-            ((mime_type *)b)->ext);
+    mime_table_t *old;
+
+    thread_rwlock_wlock (&mimetypes_lock);
+    old = mimetypes;
+    mimetypes = table;
+    thread_rwlock_unlock (&mimetypes_lock);
+
+    mime_table_free (old);
 }
 
 void fserve_recheck_mime_types(ice_config_t *config)
@@ -702,8 +1442,7 @@ void fserve_recheck_mime_types(ice_config_t *config)
     FILE *mimefile;
     char line[4096];
     char *type, *ext, *cur;
-    mime_type *mapping;
-    avl_tree *new_mimetypes;
+    mime_table_t *new_mimetypes;
 
     if (config->mimetypes_fn == NULL)
         return;
@@ -714,7 +1453,12 @@ void fserve_recheck_mime_types(ice_config_t *config)
         return;
     }
 
-    new_mimetypes = avl_tree_new(_compare_mappings, NULL);
+    new_mimetypes = mime_table_new(64);
+    if (!new_mimetypes)
+    {
+        fclose (mimefile);
+        return;
+    }
 
     while(fgets(line, 4096, mimefile))
     {
@@ -746,23 +1490,19 @@ void fserve_recheck_mime_types(ice_config_t *config)
             *cur++ = 0;
             if(*ext)
             {
-                void *tmp;
                 /* Add a new extension->type mapping */
-                mapping = malloc(sizeof(mime_type));
-                mapping->ext = strdup(ext);
-                mapping->type = strdup(type);
-                if (!avl_get_by_key (new_mimetypes, mapping, &tmp))
-                    avl_delete (new_mimetypes, mapping, _delete_mapping);
-                avl_insert (new_mimetypes, mapping);
+                if (mime_table_add (&new_mimetypes, ext, type) != 0)
+                {
+                    ICECAST_LOG_ERROR("Out of memory reading mime types file %s", config->mimetypes_fn);
+                    fclose (mimefile);
+                    mime_table_free (new_mimetypes);
+                    return;
+                }
             }
         }
     }
     fclose(mimefile);
 
-    thread_spin_lock (&pending_lock);
-    if (mimetypes)
-        avl_tree_free (mimetypes, _delete_mapping);
-    mimetypes = new_mimetypes;
-    thread_spin_unlock (&pending_lock);
+    mime_table_swap (new_mimetypes);
 }
 
@@ -25,14 +25,26 @@ typedef struct _fserve_t
     client_t *client;
 
     FILE *file;
+    /* position in file when it is sent with sendfile */
+    off_t offset;
+    int sendfile;
+    /* bytes of file still to be sent, negative to send all up to its end */
+    off_t remaining;
+    /* client->refbuf was swapped for a FSERVE_BLOCK_SIZE buffer */
+    int block;
     int ready;
     void (*callback)(client_t *, void *);
     void *arg;
     struct _fserve_t *next;
+    /* only used while on the active list */
+    struct _fserve_t *prev;
 } fserve_t;
 
-void fserve_initialize(void);
+/* Returns 0 on success, -1 if file serving could not be set up */
+int fserve_initialize(void);
 void fserve_shutdown(void);
+/* whether any files are still being sent */
+int fserve_busy(void);
 int fserve_client_create(client_t *httpclient);
 int fserve_add_client (client_t *client, FILE *file);
 void fserve_add_client_callback (client_t *client, fserve_callback_t callback, void *arg);
@@ -18,10 +18,13 @@
 
 #include <string.h>
 
+#include <time.h>
+
 #include "common/thread/thread.h"
 #include "common/avl/avl.h"
 
 #include "global.h"
+#include "waitlock.h"
 #include "refobject.h"
 #include "module.h"
 #include "source.h"
@@ -30,6 +33,10 @@ ice_global_t global;
 
 static mutex_t _global_mutex;
 
+static waitlock_t _sleep_mutex = WAITLOCK_INITIALIZER;
+static waitcond_t _sleep_cond = WAITCOND_INITIALIZER;
+static unsigned int _sleep_generation;
+
 void global_initialize(void)
 {
     global.listensockets = NULL;
@@ -60,3 +67,27 @@ void global_unlock(void)
 {
     thread_mutex_unlock(&_global_mutex);
 }
+
+void global_sleep(unsigned int ms)
+{
+    struct timespec until;
+    unsigned int generation;
+
+    waitcond_deadline(&until, ms);
+
+    waitlock_lock(&_sleep_mutex);
+    generation = _sleep_generation;
+    while (generation == _sleep_generation) {
+        if (waitcond_wait_until(&_sleep_cond, &_sleep_mutex, &until) != 0)
+            break;
+    }
+    waitlock_unlock(&_sleep_mutex);
+}
+
+void global_wake(void)
+{
+    waitlock_lock(&_sleep_mutex);
+    _sleep_generation++;
+    waitcond_broadcast(&_sleep_cond);
+    waitlock_unlock(&_sleep_mutex);
+}
@@ -35,6 +35,10 @@ typedef struct ice_global_tag
     int sources_legacy;
     int clients;
     int schedule_config_reread;
+    /* hand over to a new process of the binary, see upgrade.c */
+    int schedule_upgrade;
+    /* write the flight recorder to the log directory, see flightrec.h */
+    int schedule_flightrec_dump;
 
     avl_tree *source_tree;
     /* for locally defined relays */
@@ -54,4 +58,10 @@ void global_shutdown(void);
 void global_lock(void);
 void global_unlock(void);
 
+/* Sleeps for up to ms milliseconds, less if global_wake() is called
+ * meanwhile. Threads that poll in a loop use it so they see a shutdown at
+ * once rather than at the end of their interval. */
+void global_sleep(unsigned int ms);
+void global_wake(void);
+
 #endif  /* __GLOBAL_H__ */
@@ -0,0 +1,225 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "histogram.h"
+#include "atomic.h"
+#include "fastevent.h"
+#include "cfgfile.h"
+#include "stats.h"
+
+#include "logging.h"
+#define CATMODULE "histogram"
+
+typedef struct {
+    const char *name;
+    fastevent_type_t type;
+    volatile uint64_t sum;
+    volatile uint64_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+static histogram_t histograms[HISTOGRAM_MAX] = {
+    [HISTOGRAM_CONNECTION_WRITE]    = {.name = "connection_write",  .type = FASTEVENT_TYPE_CONNECTION_WRITE_TIME},
+    [HISTOGRAM_REQUEST_QUEUE]       = {.name = "request_queue",     .type = FASTEVENT_TYPE_CLIENT_REQUEST_QUEUED},
+    [HISTOGRAM_AUTH_QUEUE]          = {.name = "auth_queue",        .type = FASTEVENT_TYPE_CLIENT_AUTH_QUEUED},
+    [HISTOGRAM_SOURCE_ITERATION]    = {.name = "source_iteration",  .type = FASTEVENT_TYPE_SOURCE_ITERATION}
+};
+
+static refobject_t histogram_registrations[HISTOGRAM_MAX];
+static int histogram_running = 0;
+
+static inline size_t histogram_bucket(uint64_t value)
+{
+    unsigned int shift;
+
+    if (value < HISTOGRAM_SUB)
+        return value;
+
+    if (value >= ((uint64_t)1 << HISTOGRAM_MAX_BITS))
+        return HISTOGRAM_BUCKETS - 1;
+
+    /* the bits below the highest HISTOGRAM_SUB_BITS + 1 are dropped */
+#if defined(__GNUC__)
+    shift = (63 - __builtin_clzll(value)) - HISTOGRAM_SUB_BITS;
+#else
+    shift = 0;
+    while ((value >> shift) >= (2 * HISTOGRAM_SUB))
+        shift++;
+#endif
+    return (size_t)(shift + 1) * HISTOGRAM_SUB + ((value >> shift) & (HISTOGRAM_SUB - 1));
+}
+
+uint64_t histogram_bucket_end(size_t idx)
+{
+    unsigned int shift;
+
+    if (idx < HISTOGRAM_SUB)
+        return idx + 1;
+
+    shift = idx / HISTOGRAM_SUB - 1;
+    return ((uint64_t)(HISTOGRAM_SUB + idx % HISTOGRAM_SUB) + 1) << shift;
+}
+
+static void histogram_cb(const void *userdata, fastevent_type_t type, fastevent_flag_t flags, fastevent_datatype_t datatype, va_list ap)
+{
+    (void)userdata, (void)flags;
+
+    if (datatype == FASTEVENT_DATATYPE_ORDT) {
+        size_t len;
+        ssize_t done;
+
+        (void)va_arg(ap, void *);
+        len = va_arg(ap, size_t);
+        done = va_arg(ap, ssize_t);
+
+        stats_global_inc(STATS_GLOBAL_CONNECTION_WRITES);
+        if (done < 0 || (size_t)done < len)
+            stats_global_inc(STATS_GLOBAL_CONNECTION_PARTIAL_WRITES);
+    } else if (datatype == FASTEVENT_DATATYPE_OT) {
+        (void)va_arg(ap, void *);
+    } else {
+        return;
+    }
+
+    switch (type) {
+        case FASTEVENT_TYPE_CONNECTION_WRITE_TIME:
+            histogram_record(HISTOGRAM_CONNECTION_WRITE, va_arg(ap, uint64_t));
+        break;
+        case FASTEVENT_TYPE_CLIENT_REQUEST_QUEUED:
+            histogram_record(HISTOGRAM_REQUEST_QUEUE, va_arg(ap, uint64_t));
+        break;
+        case FASTEVENT_TYPE_CLIENT_AUTH_QUEUED:
+            histogram_record(HISTOGRAM_AUTH_QUEUE, va_arg(ap, uint64_t));
+        break;
+        case FASTEVENT_TYPE_SOURCE_ITERATION:
+            histogram_record(HISTOGRAM_SOURCE_ITERATION, va_arg(ap, uint64_t));
+        break;
+        default:
+        break;
+    }
+}
+
+void histogram_initialize(void)
+{
+    ice_config_t *config;
+    int enabled;
+    size_t i;
+
+    if (histogram_running)
+        return;
+
+    config = config_get_config();
+    enabled = config->latency_histograms;
+    config_release_config();
+
+    if (!enabled)
+        return;
+
+    for (i = 0; i < HISTOGRAM_MAX; i++) {
+        histogram_registrations[i] = fastevent_register(histograms[i].type, histogram_cb, NULL, NULL);
+        if (REFOBJECT_IS_NULL(histogram_registrations[i]))
+            ICECAST_LOG_ERROR("Can not register for the events of the %s histogram", histograms[i].name);
+    }
+
+    histogram_running = 1;
+    ICECAST_LOG_INFO("Latency histograms enabled");
+}
+
+void histogram_shutdown(void)
+{
+    size_t i;
+
+    if (!histogram_running)
+        return;
+
+    histogram_running = 0;
+    for (i = 0; i < HISTOGRAM_MAX; i++) {
+        refobject_unref(histogram_registrations[i]);
+        histogram_registrations[i] = REFOBJECT_NULL;
+    }
+}
+
+int histogram_enabled(void)
+{
+    return histogram_running;
+}
+
+void histogram_record(histogram_id_t id, uint64_t value)
+{
+    histogram_t *histogram;
+
+    if (id >= HISTOGRAM_MAX)
+        return;
+
+    histogram = &(histograms[id]);
+    atomic_u64_add(&(histogram->buckets[histogram_bucket(value)]), 1);
+    atomic_u64_add(&(histogram->sum), value);
+}
+
+const char *histogram_get_name(histogram_id_t id)
+{
+    if (id >= HISTOGRAM_MAX)
+        return NULL;
+
+    return histograms[id].name;
+}
+
+void histogram_get(histogram_id_t id, histogram_snapshot_t *snapshot)
+{
+    histogram_t *histogram;
+    size_t i;
+
+    memset(snapshot, 0, sizeof(*snapshot));
+
+    if (id >= HISTOGRAM_MAX)
+        return;
+
+    histogram = &(histograms[id]);
+    snapshot->sum = atomic_u64_load(&(histogram->sum));
+
+    /* the count is the sum of the buckets so it matches them, even with
+     * values recorded while we copy */
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        snapshot->buckets[i] = atomic_u64_load(&(histogram->buckets[i]));
+        snapshot->count += snapshot->buckets[i];
+        if (snapshot->buckets[i])
+            snapshot->max = histogram_bucket_end(i);
+    }
+}
+
+uint64_t histogram_percentile(const histogram_snapshot_t *snapshot, double fraction)
+{
+    uint64_t want;
+    uint64_t seen = 0;
+    size_t i;
+
+    if (!snapshot->count)
+        return 0;
+
+    if (fraction < 0.)
+        fraction = 0.;
+    if (fraction > 1.)
+        fraction = 1.;
+
+    want = (uint64_t)(fraction * snapshot->count);
+    if (!want)
+        want = 1;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += snapshot->buckets[i];
+        if (seen >= want)
+            return histogram_bucket_end(i);
+    }
+
+    return snapshot->max;
+}
@@ -0,0 +1,79 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* histogram.h
+ *
+ * Latency histograms of the hot paths, enabled by <latency-histograms>.
+ * The module registers for the timing fast events, which are only emitted
+ * and only take the time while something is registered for them, so the
+ * paths cost nothing extra with the histograms off. Values are kept in µs
+ * in buckets like HDR histograms use: the first HISTOGRAM_SUB values have a
+ * bucket each, after that every power of two is split into HISTOGRAM_SUB
+ * buckets, so each value is within 1/HISTOGRAM_SUB of its bucket. A bucket
+ * is a counter that is added to without a lock. The stats thread publishes
+ * percentiles of them and /admin/metrics renders them as histograms.
+ */
+
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#define HISTOGRAM_SUB_BITS  3
+#define HISTOGRAM_SUB       (1U << HISTOGRAM_SUB_BITS)
+/* values from 2^HISTOGRAM_MAX_BITS µs on, about 12 days, are counted in the last bucket */
+#define HISTOGRAM_MAX_BITS  40
+#define HISTOGRAM_BUCKETS   ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB)
+
+typedef enum {
+    /* a single write to a connection, the partial ones are counted in connection_partial_writes */
+    HISTOGRAM_CONNECTION_WRITE = 0,
+    /* from accepting a client to having its request headers */
+    HISTOGRAM_REQUEST_QUEUE,
+    /* from queueing a client for authentication to the result */
+    HISTOGRAM_AUTH_QUEUE,
+    /* a single source_process() of a source */
+    HISTOGRAM_SOURCE_ITERATION,
+    HISTOGRAM_MAX
+} histogram_id_t;
+
+typedef struct {
+    uint64_t count;
+    /* sum of the values in µs */
+    uint64_t sum;
+    /* the end of the highest bucket in use, so at most 1/HISTOGRAM_SUB
+     * above the largest value */
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+} histogram_snapshot_t;
+
+void        histogram_initialize(void);
+void        histogram_shutdown(void);
+/* if <latency-histograms> was on when the server was started */
+int         histogram_enabled(void);
+
+void        histogram_record(histogram_id_t id, uint64_t value);
+/* the name the histogram is published with, such as "connection_write" */
+const char *histogram_get_name(histogram_id_t id);
+/* copies the counts, which may still be changed while this runs */
+void        histogram_get(histogram_id_t id, histogram_snapshot_t *snapshot);
+/* the value below which the given part of the values are, fraction is 0 to 1 */
+uint64_t    histogram_percentile(const histogram_snapshot_t *snapshot, double fraction);
+/* the first value not counted in the bucket anymore */
+uint64_t    histogram_bucket_end(size_t idx);
+
+/* monotonic time in µs, for the timing fast events */
+static inline uint64_t histogram_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+#endif  /* __HISTOGRAM_H__ */
@@ -0,0 +1,380 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#include "common/thread/thread.h"
+#include "common/timing/timing.h"
+
+#include "hls.h"
+
+#include "logging.h"
+#define CATMODULE "hls"
+
+#define HLS_PLAYLIST_NAME       "index.m3u8"
+#define HLS_PLAYLIST_TYPE       "application/vnd.apple.mpegurl"
+/* segments kept beyond the playlist for clients with an older one */
+#define HLS_EXTRA_SEGMENTS      3
+/* a segment is cut here even without a sync point */
+#define HLS_MAX_SEGMENT_BYTES   (8*1024*1024)
+/* segments never change, so they can be cached for long */
+#define HLS_SEGMENT_MAX_AGE     3600
+/* ID3v2.4 tag with the PRIV frame packed audio segments start with */
+#define HLS_ID3_OWNER           "com.apple.streaming.transportStreamTimestamp"
+#define HLS_ID3_SIZE            (10 + 10 + sizeof(HLS_ID3_OWNER) + 8)
+
+typedef struct {
+    refbuf_t *data;
+    uint64_t sequence;
+    uint64_t duration;
+    time_t made;
+} hls_segment_t;
+
+struct hls_tag {
+    char *mount;
+    const char *type;
+    const char *extension;
+    unsigned int duration;
+    unsigned int segments;
+
+    /* protects the segments and the playlist */
+    mutex_t lock;
+    hls_segment_t *ring;
+    size_t ring_size;
+    size_t head;
+    size_t count;
+    refbuf_t *playlist;
+    time_t playlist_made;
+
+    /* the segment being built, only used by the source thread */
+    int started;
+    char *building;
+    size_t building_len;
+    size_t building_size;
+    uint64_t building_start;
+    uint64_t stream_start;
+    uint64_t sequence;
+
+    struct hls_tag *next;
+};
+
+static rwlock_t hls_lock;
+static hls_t *hls_list = NULL;
+
+void hls_initialize(void)
+{
+    thread_rwlock_create(&hls_lock);
+}
+
+void hls_shutdown(void)
+{
+    thread_rwlock_destroy(&hls_lock);
+}
+
+static int hls_append(hls_t *self, const char *data, size_t len)
+{
+    if (self->building_len + len > self->building_size) {
+        size_t size = self->building_size ? self->building_size : 64*1024;
+        char *building;
+
+        while (size < self->building_len + len)
+            size *= 2;
+        building = realloc(self->building, size);
+        if (!building)
+            return -1;
+        self->building = building;
+        self->building_size = size;
+    }
+
+    memcpy(self->building + self->building_len, data, len);
+    self->building_len += len;
+
+    return 0;
+}
+
+static void hls_begin_segment(hls_t *self, uint64_t now)
+{
+    unsigned char tag[HLS_ID3_SIZE];
+    /* 33 bit MPEG timestamp in 90 kHz */
+    uint64_t pts = ((now - self->stream_start) * 90) & ((UINT64_C(1) << 33) - 1);
+    size_t frame = sizeof(HLS_ID3_OWNER) + 8;
+    size_t i;
+
+    memset(tag, 0, sizeof(tag));
+    memcpy(tag, "ID3\x04\x00\x00", 6);
+    /* sizes are syncsafe, 7 bits per byte */
+    tag[9] = HLS_ID3_SIZE - 10;
+    memcpy(tag + 10, "PRIV", 4);
+    tag[17] = frame;
+    memcpy(tag + 20, HLS_ID3_OWNER, sizeof(HLS_ID3_OWNER));
+    for (i = 0; i < 8; i++)
+        tag[20 + sizeof(HLS_ID3_OWNER) + i] = pts >> (56 - 8 * i);
+
+    self->building_len = 0;
+    self->building_start = now;
+    hls_append(self, (const char *)tag, sizeof(tag));
+}
+
+/* builds the playlist of the last segments, called with the lock held */
+static void hls_update_playlist(hls_t *self, time_t now)
+{
+    size_t listed = self->count < self->segments ? self->count : self->segments;
+    size_t first = self->count - listed;
+    uint64_t target = self->duration;
+    size_t len = 256 + listed * 64;
+    refbuf_t *playlist;
+    size_t i;
+    int ret;
+
+    for (i = first; i < self->count; i++) {
+        hls_segment_t *segment = &(self->ring[(self->head + i) % self->ring_size]);
+
+        if ((segment->duration + 999) / 1000 > target)
+            target = (segment->duration + 999) / 1000;
+    }
+
+    playlist = refbuf_new(len);
+    ret = snprintf(playlist->data, len,
+            "#EXTM3U\n#EXT-X-VERSION:3\n#EXT-X-TARGETDURATION:%" PRIu64 "\n#EXT-X-MEDIA-SEQUENCE:%" PRIu64 "\n",
+            target, self->ring[(self->head + first) % self->ring_size].sequence);
+    for (i = first; i < self->count; i++) {
+        hls_segment_t *segment = &(self->ring[(self->head + i) % self->ring_size]);
+
+        ret += snprintf(playlist->data + ret, len - ret, "#EXTINF:%" PRIu64 ".%03u,\n%" PRIu64 ".%s\n",
+                segment->duration / 1000, (unsigned int)(segment->duration % 1000),
+                segment->sequence, self->extension);
+    }
+    playlist->len = ret;
+
+    refbuf_release(self->playlist);
+    self->playlist = playlist;
+    self->playlist_made = now;
+}
+
+static void hls_finish_segment(hls_t *self, uint64_t now)
+{
+    hls_segment_t *segment;
+    refbuf_t *data;
+
+    if (!self->building)
+        return;
+
+    /* the data was malloc()ed on its own, so it is freed with the refbuf */
+    data = refbuf_new(0);
+    data->data = self->building;
+    data->len = self->building_len;
+    self->building = NULL;
+    self->building_len = 0;
+    self->building_size = 0;
+
+    thread_mutex_lock(&self->lock);
+    if (self->count == self->ring_size) {
+        refbuf_release(self->ring[self->head].data);
+        self->head = (self->head + 1) % self->ring_size;
+        self->count--;
+    }
+    segment = &(self->ring[(self->head + self->count) % self->ring_size]);
+    segment->data = data;
+    segment->sequence = self->sequence++;
+    segment->duration = now - self->building_start;
+    segment->made = time(NULL);
+    self->count++;
+    hls_update_playlist(self, segment->made);
+    thread_mutex_unlock(&self->lock);
+}
+
+hls_t *hls_open(const char *mount, const char *content_type, unsigned int duration, unsigned int segments)
+{
+    hls_t *self;
+    const char *type;
+    const char *extension;
+
+    if (!content_type) {
+        errno = EINVAL;
+        return NULL;
+    } else if (strcasecmp(content_type, "audio/mpeg") == 0) {
+        type = "audio/mpeg";
+        extension = "mp3";
+    } else if (strcasecmp(content_type, "audio/aac") == 0 ||
+               strcasecmp(content_type, "audio/aacp") == 0 ||
+               strcasecmp(content_type, "audio/x-aac") == 0) {
+        type = "audio/aac";
+        extension = "aac";
+    } else {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    self = calloc(1, sizeof(*self));
+    if (!self) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    self->mount = strdup(mount);
+    self->ring_size = segments + HLS_EXTRA_SEGMENTS;
+    self->ring = calloc(self->ring_size, sizeof(*self->ring));
+    if (!self->mount || !self->ring) {
+        free(self->mount);
+        free(self->ring);
+        free(self);
+        errno = ENOMEM;
+        return NULL;
+    }
+    self->type = type;
+    self->extension = extension;
+    self->duration = duration;
+    self->segments = segments;
+    /* each segment lasts at least a second, so numbers of a later source
+     * are always higher */
+    self->sequence = time(NULL);
+    thread_mutex_create(&self->lock);
+
+    thread_rwlock_wlock(&hls_lock);
+    self->next = hls_list;
+    hls_list = self;
+    thread_rwlock_unlock(&hls_lock);
+
+    ICECAST_LOG_DEBUG("Segmenting %s into %u s segments", mount, duration);
+
+    return self;
+}
+
+void hls_write(hls_t *self, refbuf_t *refbuf)
+{
+    uint64_t now = timing_get_time();
+    size_t split = 0;
+
+    if (!self->started) {
+        /* the first segment starts on a sync point */
+        if (!refbuf->sync_point)
+            return;
+        self->started = 1;
+        self->stream_start = now;
+        hls_begin_segment(self, now);
+        split = refbuf->sync_offset;
+    } else if ((refbuf->sync_point && now - self->building_start >= (uint64_t)self->duration * 1000) ||
+            self->building_len >= HLS_MAX_SEGMENT_BYTES) {
+        if (refbuf->sync_point) {
+            split = refbuf->sync_offset;
+            hls_append(self, refbuf->data, split);
+        }
+        hls_finish_segment(self, now);
+        hls_begin_segment(self, now);
+    }
+
+    if (split < refbuf->len && hls_append(self, refbuf->data + split, refbuf->len - split) != 0)
+        ICECAST_LOG_ERROR("Can not grow segment of %s", self->mount);
+}
+
+void hls_close(hls_t *self)
+{
+    hls_t **prev;
+    size_t i;
+
+    if (!self)
+        return;
+
+    thread_rwlock_wlock(&hls_lock);
+    for (prev = &hls_list; *prev; prev = &((*prev)->next)) {
+        if (*prev == self) {
+            *prev = self->next;
+            break;
+        }
+    }
+    thread_rwlock_unlock(&hls_lock);
+
+    for (i = 0; i < self->count; i++)
+        refbuf_release(self->ring[(self->head + i) % self->ring_size].data);
+    refbuf_release(self->playlist);
+    thread_mutex_destroy(&self->lock);
+    free(self->building);
+    free(self->ring);
+    free(self->mount);
+    free(self);
+}
+
+char *hls_get_mount(const char *uri)
+{
+    const char *name = strrchr(uri, '/');
+    char *ret = NULL;
+    hls_t *self;
+
+    if (!name || name == uri)
+        return NULL;
+
+    thread_rwlock_rlock(&hls_lock);
+    for (self = hls_list; self; self = self->next) {
+        if (strncmp(self->mount, uri, name - uri) == 0 && self->mount[name - uri] == 0) {
+            ret = strdup(self->mount);
+            break;
+        }
+    }
+    thread_rwlock_unlock(&hls_lock);
+
+    return ret;
+}
+
+refbuf_t *hls_get(const char *uri, const char **type, time_t *mtime, unsigned int *max_age)
+{
+    const char *name = strrchr(uri, '/');
+    refbuf_t *ret = NULL;
+    hls_t *self;
+
+    if (!name || name == uri)
+        return NULL;
+
+    thread_rwlock_rlock(&hls_lock);
+    for (self = hls_list; self; self = self->next)
+        if (strncmp(self->mount, uri, name - uri) == 0 && self->mount[name - uri] == 0)
+            break;
+
+    name++;
+    if (self) {
+        thread_mutex_lock(&self->lock);
+        if (strcmp(name, HLS_PLAYLIST_NAME) == 0) {
+            if (self->playlist) {
+                ret = self->playlist;
+                refbuf_addref(ret);
+                *type = HLS_PLAYLIST_TYPE;
+                *mtime = self->playlist_made;
+                /* the playlist changes with every segment */
+                *max_age = self->duration > 1 ? self->duration / 2 : 1;
+            }
+        } else {
+            char *end;
+            uint64_t sequence = strtoull(name, &end, 10);
+            size_t i;
+
+            if (end != name && *end == '.' && strcmp(end + 1, self->extension) == 0) {
+                for (i = 0; i < self->count; i++) {
+                    hls_segment_t *segment = &(self->ring[(self->head + i) % self->ring_size]);
+
+                    if (segment->sequence == sequence) {
+                        ret = segment->data;
+                        refbuf_addref(ret);
+                        *type = self->type;
+                        *mtime = segment->made;
+                        *max_age = HLS_SEGMENT_MAX_AGE;
+                        break;
+                    }
+                }
+            }
+        }
+        thread_mutex_unlock(&self->lock);
+    }
+    thread_rwlock_unlock(&hls_lock);
+
+    return ret;
+}
@@ -0,0 +1,46 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* hls.h
+ *
+ * Cuts the stream of a source into segments of a few seconds and keeps a
+ * HLS playlist of the last ones in memory, so a CDN can take the listeners
+ * while the server only sends it each segment once. Segments are cut at
+ * sync points and are packed audio, the stream data with an ID3 tag giving
+ * its timestamp in front. The playlist of mount /live.mp3 is served as
+ * /live.mp3/index.m3u8, the segments next to it. Segment numbers start at
+ * the time the source connected, so they are never reused and can be
+ * cached for long.
+ */
+
+#ifndef __HLS_H__
+#define __HLS_H__
+
+#include <time.h>
+
+#include "refbuf.h"
+
+typedef struct hls_tag hls_t;
+
+void   hls_initialize(void);
+void   hls_shutdown(void);
+
+/* Starts segmenting a stream of the given type for mount. Returns NULL on
+ * error with errno set, EINVAL if the type can not be segmented. */
+hls_t *hls_open(const char *mount, const char *content_type, unsigned int duration, unsigned int segments);
+/* Adds a queued buffer. Only called by the source thread. */
+void   hls_write(hls_t *self, refbuf_t *refbuf);
+void   hls_close(hls_t *self);
+
+/* Looks for the playlist or segment at uri. Returns a reference to its
+ * data and sets its type, when it was made and how many seconds it may be
+ * cached for, or NULL if there is none. */
+refbuf_t *hls_get(const char *uri, const char **type, time_t *mtime, unsigned int *max_age);
+/* Returns a copy of the mount that is segmented under uri, so its requests
+ * can be checked as those of the mount, or NULL if there is none. */
+char *hls_get_mount(const char *uri);
+
+#endif  /* __HLS_H__ */
@@ -0,0 +1,272 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "common/thread/thread.h"
+#include "common/timing/timing.h"
+
+#include "introcache.h"
+
+#include "logging.h"
+#define CATMODULE "introcache"
+
+/* size of the buffers the file is read into, the largest pooled size */
+#define INTROCACHE_BLOCK_SIZE       16384
+/* intro files are meant to be short, anything past this is left out */
+#define INTROCACHE_MAX_SIZE         (16*1024*1024)
+/* how often (in ms) a file is checked for changes */
+#define INTROCACHE_CHECK_INTERVAL   2000
+
+struct introcache_tag {
+    introcache_t *next;
+    char *path;
+    /* number of slots pointing at this entry */
+    unsigned int refcount;
+
+    time_t mtime;
+    off_t size;
+    uint64_t next_check;
+
+    /* the cache holds a reference to every buffer of the chain */
+    refbuf_t *head;
+    size_t bytes;
+};
+
+/* chain of a file that changed or is no longer used. It is released from
+ * the front like the stream queue, a buffer only referenced by the chain
+ * has no listener on it or behind it anymore */
+typedef struct introcache_retired_tag {
+    struct introcache_retired_tag *next;
+    refbuf_t *head;
+} introcache_retired_t;
+
+/* protects everything below and all slots */
+static mutex_t introcache_lock;
+static introcache_t *introcache_entries;
+static introcache_retired_t *introcache_retired;
+
+static void introcache_collect(void)
+{
+    introcache_retired_t **link = &introcache_retired;
+
+    while (*link) {
+        introcache_retired_t *retired = *link;
+
+        while (retired->head && refbuf_get_count(retired->head) == 1) {
+            refbuf_t *to_go = retired->head;
+
+            retired->head = refbuf_get_next(to_go);
+            to_go->next = NULL;
+            refbuf_release(to_go);
+        }
+
+        if (retired->head) {
+            link = &(retired->next);
+        } else {
+            *link = retired->next;
+            free(retired);
+        }
+    }
+}
+
+static void introcache_retire(refbuf_t *head)
+{
+    introcache_retired_t *retired;
+
+    if (!head)
+        return;
+
+    retired = calloc(1, sizeof(*retired));
+    if (!retired) {
+        /* better leak the chain than free it under a listener */
+        ICECAST_LOG_ERROR("Can not release intro buffers, out of memory");
+        return;
+    }
+
+    retired->head = head;
+    retired->next = introcache_retired;
+    introcache_retired = retired;
+}
+
+static void introcache_load(introcache_t *self)
+{
+    refbuf_t *tail = NULL;
+    struct stat st;
+    FILE *file;
+
+    introcache_retire(self->head);
+    self->head = NULL;
+    self->bytes = 0;
+    self->next_check = timing_get_time() + INTROCACHE_CHECK_INTERVAL;
+
+    file = fopen(self->path, "rb");
+    if (!file) {
+        ICECAST_LOG_WARN("Cannot open intro file \"%s\": %s", self->path, strerror(errno));
+        self->mtime = 0;
+        self->size = 0;
+        return;
+    }
+
+    if (fstat(fileno(file), &st) == 0) {
+        self->mtime = st.st_mtime;
+        self->size = st.st_size;
+    }
+
+    while (self->bytes < INTROCACHE_MAX_SIZE) {
+        refbuf_t *refbuf = refbuf_new(INTROCACHE_BLOCK_SIZE);
+        size_t bytes = fread(refbuf->data, 1, INTROCACHE_BLOCK_SIZE, file);
+
+        if (bytes == 0) {
+            refbuf_release(refbuf);
+            break;
+        }
+
+        refbuf->len = (unsigned int)bytes;
+        if (tail) {
+            refbuf_set_next(tail, refbuf);
+        } else {
+            self->head = refbuf;
+        }
+        tail = refbuf;
+        self->bytes += bytes;
+    }
+
+    if (ferror(file))
+        ICECAST_LOG_WARN("Error reading intro file \"%s\"", self->path);
+    if (self->bytes >= INTROCACHE_MAX_SIZE)
+        ICECAST_LOG_WARN("Intro file \"%s\" is too large, only the first %d bytes are used", self->path, INTROCACHE_MAX_SIZE);
+    fclose(file);
+
+    ICECAST_LOG_DEBUG("Read %zu bytes of intro file \"%s\"", self->bytes, self->path);
+}
+
+/* reload the file if it changed since it was read */
+static void introcache_check(introcache_t *self)
+{
+    uint64_t now = timing_get_time();
+    struct stat st;
+
+    if (now < self->next_check)
+        return;
+
+    self->next_check = now + INTROCACHE_CHECK_INTERVAL;
+    if (stat(self->path, &st) != 0)
+        return;
+
+    if (st.st_mtime != self->mtime || st.st_size != self->size) {
+        ICECAST_LOG_INFO("Intro file \"%s\" changed, reading it again", self->path);
+        introcache_load(self);
+    }
+}
+
+static void introcache_unref(introcache_t *self)
+{
+    introcache_t **link;
+
+    if (!self || --self->refcount)
+        return;
+
+    for (link = &introcache_entries; *link; link = &((*link)->next)) {
+        if (*link == self) {
+            *link = self->next;
+            break;
+        }
+    }
+
+    introcache_retire(self->head);
+    free(self->path);
+    free(self);
+}
+
+void introcache_initialize(void)
+{
+    thread_mutex_create(&introcache_lock);
+    introcache_entries = NULL;
+    introcache_retired = NULL;
+}
+
+void introcache_shutdown(void)
+{
+    thread_mutex_lock(&introcache_lock);
+    while (introcache_entries) {
+        introcache_entries->refcount = 1;
+        introcache_unref(introcache_entries);
+    }
+    introcache_collect();
+    thread_mutex_unlock(&introcache_lock);
+    thread_mutex_destroy(&introcache_lock);
+}
+
+void introcache_set(introcache_t **slot, const char *path)
+{
+    introcache_t *entry = NULL;
+
+    thread_mutex_lock(&introcache_lock);
+    if (path) {
+        for (entry = introcache_entries; entry; entry = entry->next)
+            if (strcmp(entry->path, path) == 0)
+                break;
+
+        if (entry) {
+            entry->refcount++;
+        } else if ((entry = calloc(1, sizeof(*entry)))) {
+            entry->path = strdup(path);
+            if (entry->path) {
+                entry->refcount = 1;
+                entry->next = introcache_entries;
+                introcache_entries = entry;
+                introcache_load(entry);
+            } else {
+                free(entry);
+                entry = NULL;
+            }
+        }
+    }
+
+    introcache_unref(*slot);
+    *slot = entry;
+    introcache_collect();
+    thread_mutex_unlock(&introcache_lock);
+}
+
+refbuf_t *introcache_get(introcache_t **slot)
+{
+    refbuf_t *ret = NULL;
+
+    thread_mutex_lock(&introcache_lock);
+    if (*slot) {
+        introcache_check(*slot);
+        ret = (*slot)->head;
+        if (ret)
+            refbuf_addref(ret);
+    }
+    introcache_collect();
+    thread_mutex_unlock(&introcache_lock);
+
+    return ret;
+}
+
+size_t introcache_get_size(introcache_t **slot)
+{
+    size_t ret = 0;
+
+    thread_mutex_lock(&introcache_lock);
+    if (*slot)
+        ret = (*slot)->bytes;
+    thread_mutex_unlock(&introcache_lock);
+
+    return ret;
+}
@@ -0,0 +1,40 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* introcache.h
+ *
+ * Intro files are read once into a chain of refbufs shared by all listeners
+ * of all mounts using the same file. Listeners walk the chain just like the
+ * stream queue, holding a reference to the buffer they are on. If the file
+ * changes on disk it is read again, listeners still playing the old chain
+ * finish it and its buffers are released from the front once no listener
+ * is on them anymore.
+ */
+
+#ifndef __INTROCACHE_H__
+#define __INTROCACHE_H__
+
+#include <stddef.h>
+
+#include "refbuf.h"
+
+typedef struct introcache_tag introcache_t;
+
+void introcache_initialize(void);
+void introcache_shutdown(void);
+
+/* Points *slot at the cached intro file path, or at nothing if path is NULL,
+ * and drops what *slot referred to before. The file is read now if it isn't
+ * cached yet. A slot must only be used through these functions.
+ */
+void        introcache_set(introcache_t **slot, const char *path);
+/* Returns the first buffer of the intro with a reference added, or NULL if
+ * there is no intro. Reads the file again if it changed. */
+refbuf_t *  introcache_get(introcache_t **slot);
+/* number of bytes held for the intro */
+size_t      introcache_get_size(introcache_t **slot);
+
+#endif  /* __INTROCACHE_H__ */
@@ -0,0 +1,204 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "common/thread/thread.h"
+#include "common/timing/timing.h"
+#include "common/avl/avl.h"
+
+#include "iplimit.h"
+#include "stats.h"
+#include "util.h"
+
+#include "logging.h"
+#define CATMODULE "iplimit"
+
+#define IPLIMIT_SHARDS      64
+#define IPLIMIT_BUCKETS     256
+
+/* a bucket holds this many tokens per connection, so slow rates still
+ * refill a little with every millisecond */
+#define IPLIMIT_TOKEN       1000
+
+typedef struct iplimit_entry_tag {
+    struct iplimit_entry_tag *next;
+    const void *listensocket;
+    /* connections open right now */
+    unsigned int connections;
+    uint64_t tokens;
+    uint64_t refilled;
+    /* when the bucket is full again, the entry is dropped once it is idle
+     * and this has passed */
+    uint64_t full_at;
+    char ip[];
+} iplimit_entry_t;
+
+typedef struct {
+    spin_t lock;
+    iplimit_entry_t *buckets[IPLIMIT_BUCKETS];
+} iplimit_shard_t;
+
+static iplimit_shard_t iplimit_shards[IPLIMIT_SHARDS];
+static int iplimit_running = 0;
+
+static inline uint32_t iplimit_hash(const void *listensocket, const char *ip)
+{
+    return util_hash_string(ip) ^ (uint32_t)(((uintptr_t)listensocket >> 4) * 2654435761U);
+}
+
+/* returns the entry for ip on the listen socket with prev pointing to the
+ * link to it. Idle entries with a full bucket are dropped on the way. */
+static iplimit_entry_t *iplimit_find(iplimit_entry_t **prev, const void *listensocket, const char *ip, uint64_t now)
+{
+    while (*prev) {
+        iplimit_entry_t *entry = *prev;
+
+        if (entry->listensocket == listensocket && strcmp(entry->ip, ip) == 0)
+            return entry;
+
+        if (!entry->connections && now >= entry->full_at) {
+            *prev = entry->next;
+            free(entry);
+            continue;
+        }
+
+        prev = &(entry->next);
+    }
+
+    return NULL;
+}
+
+void iplimit_initialize(void)
+{
+    size_t i;
+
+    memset(iplimit_shards, 0, sizeof(iplimit_shards));
+    for (i = 0; i < IPLIMIT_SHARDS; i++)
+        thread_spin_create(&(iplimit_shards[i].lock));
+    iplimit_running = 1;
+}
+
+void iplimit_shutdown(void)
+{
+    size_t i, j;
+
+    if (!iplimit_running)
+        return;
+
+    iplimit_running = 0;
+    for (i = 0; i < IPLIMIT_SHARDS; i++) {
+        for (j = 0; j < IPLIMIT_BUCKETS; j++) {
+            while (iplimit_shards[i].buckets[j]) {
+                iplimit_entry_t *entry = iplimit_shards[i].buckets[j];
+                iplimit_shards[i].buckets[j] = entry->next;
+                free(entry);
+            }
+        }
+        thread_spin_destroy(&(iplimit_shards[i].lock));
+    }
+}
+
+int iplimit_acquire(const void *listensocket, const char *ip, unsigned int max_connections, unsigned int rate, unsigned int burst)
+{
+    uint32_t hash;
+    iplimit_shard_t *shard;
+    iplimit_entry_t **head;
+    iplimit_entry_t *entry;
+    uint64_t now;
+    uint64_t capacity;
+    stats_global_t rejected = STATS_GLOBAL_MAX;
+
+    if (!iplimit_running || !ip || (!max_connections && !rate))
+        return 0;
+
+    if (!burst)
+        burst = rate;
+    capacity = (uint64_t)burst * IPLIMIT_TOKEN;
+
+    hash = iplimit_hash(listensocket, ip);
+    shard = &(iplimit_shards[hash % IPLIMIT_SHARDS]);
+    head = &(shard->buckets[(hash / IPLIMIT_SHARDS) % IPLIMIT_BUCKETS]);
+    now = timing_get_time();
+
+    thread_spin_lock(&shard->lock);
+    entry = iplimit_find(head, listensocket, ip, now);
+    if (!entry) {
+        size_t len = strlen(ip);
+
+        entry = malloc(sizeof(*entry) + len + 1);
+        if (!entry) {
+            thread_spin_unlock(&shard->lock);
+            return 0;
+        }
+        memcpy(entry->ip, ip, len + 1);
+        entry->listensocket = listensocket;
+        entry->connections = 0;
+        entry->tokens = capacity;
+        entry->refilled = now;
+        entry->full_at = now;
+        entry->next = *head;
+        *head = entry;
+    }
+
+    if (rate) {
+        /* rate tokens per second are IPLIMIT_TOKEN * rate / 1000 per ms */
+        entry->tokens += (now - entry->refilled) * rate;
+        if (entry->tokens > capacity)
+            entry->tokens = capacity;
+        entry->refilled = now;
+    }
+
+    if (max_connections && entry->connections >= max_connections) {
+        rejected = STATS_GLOBAL_CONNECTIONS_REJECTED_IP_LIMIT;
+    } else if (rate && entry->tokens < IPLIMIT_TOKEN) {
+        rejected = STATS_GLOBAL_CONNECTIONS_REJECTED_IP_RATE;
+    } else {
+        entry->connections++;
+        if (rate) {
+            entry->tokens -= IPLIMIT_TOKEN;
+            entry->full_at = now + (capacity - entry->tokens) / rate;
+        }
+    }
+    thread_spin_unlock(&shard->lock);
+
+    if (rejected == STATS_GLOBAL_CONNECTIONS_REJECTED_IP_LIMIT) {
+        ICECAST_LOG_DEBUG("Rejecting connection from %s, it has %u connections open already", ip, max_connections);
+    } else if (rejected == STATS_GLOBAL_CONNECTIONS_REJECTED_IP_RATE) {
+        ICECAST_LOG_DEBUG("Rejecting connection from %s, it opens more than %u connections per second", ip, rate);
+    }
+    if (rejected != STATS_GLOBAL_MAX) {
+        stats_global_inc(rejected);
+        return -1;
+    }
+
+    return 1;
+}
+
+void iplimit_release(const void *listensocket, const char *ip)
+{
+    uint32_t hash;
+    iplimit_shard_t *shard;
+    iplimit_entry_t *entry;
+
+    if (!iplimit_running || !ip)
+        return;
+
+    hash = iplimit_hash(listensocket, ip);
+    shard = &(iplimit_shards[hash % IPLIMIT_SHARDS]);
+
+    thread_spin_lock(&shard->lock);
+    entry = iplimit_find(&(shard->buckets[(hash / IPLIMIT_SHARDS) % IPLIMIT_BUCKETS]), listensocket, ip, timing_get_time());
+    if (entry && entry->connections)
+        entry->connections--;
+    thread_spin_unlock(&shard->lock);
+}
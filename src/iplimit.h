@@ -0,0 +1,35 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* iplimit.h
+ *
+ * Limits the connections a single client address may have open at once and
+ * how fast it may open new ones, see <max-connections-per-ip> and
+ * <connection-rate-per-ip> of <listen-socket>. This is checked right after
+ * accept(), before anything is set up for the connection. Each listen
+ * socket has limits of its own, so an address is counted separately on
+ * each. Addresses are kept in a hash table split into shards with a lock each, so the accept
+ * threads rarely wait for each other. The rate is a token bucket that
+ * refills by the given number of connections per second up to the burst size.
+ */
+
+#ifndef __IPLIMIT_H__
+#define __IPLIMIT_H__
+
+void    iplimit_initialize(void);
+void    iplimit_shutdown(void);
+
+/* Counts a new connection from ip on the listen socket, which only serves
+ * to tell the sockets apart and must stay valid while the connection is
+ * open. 0 for any of the limits disables it, a burst of 0 is the same as
+ * rate. Returns 1 if the connection was counted and iplimit_release() must
+ * be called once it is closed, 0 if no limit is set and -1 if the
+ * connection is to be rejected.
+ */
+int     iplimit_acquire(const void *listensocket, const char *ip, unsigned int max_connections, unsigned int rate, unsigned int burst);
+void    iplimit_release(const void *listensocket, const char *ip);
+
+#endif  /* __IPLIMIT_H__ */
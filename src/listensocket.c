@@ -20,8 +20,17 @@
 #include <sys/select.h>
 #endif
 
+#include <stdio.h>
 #include <string.h>
 
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#endif
+
 #include "common/net/sock.h"
 #include "common/thread/thread.h"
 
@@ -29,10 +38,23 @@
 #include "global.h"
 #include "connection.h"
 #include "refobject.h"
+#include "iplimit.h"
+#include "atomic.h"
+#include "upgrade.h"
 
 #include "logging.h"
 #define CATMODULE "listensocket"
 
+/* Several accept threads need every listen socket to be opened more than
+ * once with SO_REUSEPORT so the kernel spreads new connections over them.
+ */
+#if defined(HAVE_POLL) && defined(SO_REUSEPORT)
+#define LISTENSOCKET_SHARDING
+#endif
+
+/* the shard the dedicated thread accepts on, it takes only the sockets with
+ * <dedicated-thread> and those only on their first socket */
+#define LISTENSOCKET_SHARD_DEDICATED    ((size_t)-1)
 
 struct listensocket_container_tag {
     refobject_base_t __base;
@@ -41,6 +63,8 @@ struct listensocket_container_tag {
     listensocket_t **sock;
     int *sockref;
     size_t sock_len;
+    /* number of accept threads, and of sockets opened per listen socket */
+    size_t shards;
     void (*sockcount_cb)(size_t count, void *userdata);
     void *sockcount_userdata;
 };
@@ -51,7 +75,16 @@ struct listensocket_tag {
     rwlock_t listener_rwlock;
     listener_t *listener;
     listener_t *listener_update;
+    /* taken for writing when sockets are opened or closed, accepting only
+     * needs it for reading so accept threads do not wait for each other */
+    rwlock_t sock_rwlock;
     sock_t sock;
+    /* the sockets for accept threads 1 and up, see shards above */
+    sock_t *shard_sock;
+    size_t shard_len;
+    /* counted without a lock */
+    volatile uint64_t accepted;
+    volatile uint64_t rejected;
 };
 
 static int listensocket_container_configure__unlocked(listensocket_container_t *self, const ice_config_t *config);
@@ -61,10 +94,11 @@ static listensocket_t * listensocket_new(const listener_t *listener);
 static int              listensocket_apply_config(listensocket_t *self);
 static int              listensocket_apply_config__unlocked(listensocket_t *self);
 static int              listensocket_set_update(listensocket_t *self, const listener_t *listener);
-static int              listensocket_refsock(listensocket_t *self, bool prefer_inet6);
+static int              listensocket_refsock(listensocket_t *self, bool prefer_inet6, size_t shards);
 static int              listensocket_unrefsock(listensocket_t *self);
+static connection_t *   listensocket_accept__shard(listensocket_t *self, listensocket_container_t *container, size_t shard);
 #ifdef HAVE_POLL
-static inline int listensocket__poll_fill(listensocket_t *self, struct pollfd *p);
+static inline int listensocket__poll_fill(listensocket_t *self, struct pollfd *p, size_t shard);
 #else
 static inline int listensocket__select_set(listensocket_t *self, fd_set *set, int *max);
 static inline int listensocket__select_isset(listensocket_t *self, fd_set *set);
@@ -75,20 +109,93 @@ static inline const char * __string_default(const char *str, const char *def)
     return str != NULL ? str : def;
 }
 
+/* the kernel silently caps it further, see net.core.somaxconn on Linux */
+#define LISTENSOCKET_MAX_BACKLOG    65535
+
 static inline int __socket_listen(sock_t serversock, const listener_t *listener)
 {
     int listen_backlog = listener->listen_backlog;
 
     if (listen_backlog < 1)
         listen_backlog = ICECAST_LISTEN_QUEUE;
-    if (listen_backlog > 128) {
-        listen_backlog = 128;
+    if (listen_backlog > LISTENSOCKET_MAX_BACKLOG) {
+        listen_backlog = LISTENSOCKET_MAX_BACKLOG;
         ICECAST_LOG_WARN("Listen backlog for listen socket on %s port %i is set insanely high. Limiting to sane range.", __string_default(listener->bind_address, "<ANY>"), listener->port);
     }
 
     return sock_listen(serversock, listen_backlog);
 }
 
+static inline void __socket_configure(sock_t serversock, const listener_t *listener)
+{
+    if (listener->so_sndbuf)
+        sock_set_send_buffer(serversock, listener->so_sndbuf);
+    /* accepted sockets inherit it, it must be set before the handshake so
+     * the window scale matches */
+    if (listener->so_rcvbuf)
+        setsockopt(serversock, SOL_SOCKET, SO_RCVBUF, (const char *)&(listener->so_rcvbuf), sizeof(listener->so_rcvbuf));
+
+    /* both are set even if 0 so they are turned off again on reload */
+#ifdef TCP_DEFER_ACCEPT
+    setsockopt(serversock, IPPROTO_TCP, TCP_DEFER_ACCEPT, (const char *)&(listener->defer_accept), sizeof(listener->defer_accept));
+#else
+    if (listener->defer_accept)
+        ICECAST_LOG_WARN("<defer-accept> is not supported on this system, ignoring it for port %i.", listener->port);
+#endif
+#ifdef TCP_FASTOPEN
+    setsockopt(serversock, IPPROTO_TCP, TCP_FASTOPEN, (const char *)&(listener->tcp_fastopen), sizeof(listener->tcp_fastopen));
+#else
+    if (listener->tcp_fastopen)
+        ICECAST_LOG_WARN("<tcp-fastopen> is not supported on this system, ignoring it for port %i.", listener->port);
+#endif
+
+    sock_set_blocking(serversock, 0);
+
+    __socket_listen(serversock, listener);
+}
+
+#ifdef LISTENSOCKET_SHARDING
+/* like sock_get_server_socket() but with SO_REUSEPORT set before binding */
+static sock_t __socket_reuseport(const listener_t *listener, bool prefer_inet6)
+{
+    struct addrinfo hints, *res, *ai;
+    char service[16];
+    sock_t sock = SOCK_ERROR;
+    int on = 1;
+    int off = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = prefer_inet6 && !listener->bind_address ? AF_INET6 : AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+    snprintf(service, sizeof(service), "%i", listener->port);
+
+    if (getaddrinfo(listener->bind_address, service, &hints, &res) != 0)
+        return SOCK_ERROR;
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sock == SOCK_ERROR)
+            continue;
+
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (ai->ai_family == AF_INET6 && prefer_inet6)
+            setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == 0 &&
+            bind(sock, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+
+        sock_close(sock);
+        sock = SOCK_ERROR;
+    }
+
+    freeaddrinfo(res);
+
+    return sock;
+}
+#endif
+
 static inline int __listener_cmp(const listener_t *a, const listener_t *b)
 {
     if (a == b)
@@ -105,9 +212,28 @@ static inline int __listener_cmp(const listener_t *a, const listener_t *b)
     if (a->bind_address != NULL && b->bind_address != NULL && strcmp(a->bind_address, b->bind_address) != 0)
         return 0;
 
+    /* dedicated sockets are not shared between the accept threads */
+    if (!a->dedicated_thread != !b->dedicated_thread)
+        return 0;
+
     return 1;
 }
 
+/* if the socket is left to the dedicated thread */
+static inline bool __is_dedicated(listensocket_t *self)
+{
+    bool ret;
+
+    if (!self)
+        return false;
+
+    thread_rwlock_rlock(&self->listener_rwlock);
+    ret = self->listener && self->listener->dedicated_thread;
+    thread_rwlock_unlock(&self->listener_rwlock);
+
+    return ret;
+}
+
 static inline void __call_sockcount_cb(listensocket_container_t *self)
 {
     if (self->sockcount_cb == NULL)
@@ -158,6 +284,7 @@ int __listensocket_container_new(refobject_t self, const refobject_type_t *type,
 
     ret->sock = NULL;
     ret->sock_len = 0;
+    ret->shards = 1;
     ret->sockcount_cb = NULL;
     ret->sockcount_userdata = NULL;
 
@@ -331,7 +458,7 @@ static int listensocket_container_setup__unlocked(listensocket_container_t *self
                 self->sockref[i] = 0;
             }
         } else if (!self->sockref[i] && type != LISTENER_TYPE_VIRTUAL) {
-            if (listensocket_refsock(self->sock[i], self->prefer_inet6) == 0) {
+            if (listensocket_refsock(self->sock[i], self->prefer_inet6, self->shards) == 0) {
                 self->sockref[i] = 1;
             } else {
                 ICECAST_LOG_DEBUG("Can not ref socket.");
@@ -345,46 +472,79 @@ static int listensocket_container_setup__unlocked(listensocket_container_t *self
     return ret;
 }
 
-static listensocket_t *       listensocket_container_accept__inner(listensocket_container_t *self, int timeout)
+/* Called with self->lock held. While waiting the lock is released, so
+ * several accept threads can wait at the same time. The returned socket
+ * has a reference added.
+ */
+static listensocket_t *       listensocket_container_accept__inner(listensocket_container_t *self, size_t shard, int timeout)
 {
 #ifdef HAVE_POLL
     struct pollfd ufds[self->sock_len];
     listensocket_t *socks[self->sock_len];
+    listensocket_t *ready = NULL;
+    struct pollfd check;
+    bool dedicated = shard == LISTENSOCKET_SHARD_DEDICATED;
     size_t i, found, p;
+    size_t skipped = 0;
     int ok;
     int ret;
 
+    if (dedicated)
+        shard = 0;
+
     for (i = 0, found = 0; i < self->sock_len; i++) {
         ok = self->sockref[i];
 
-        if (ok && listensocket__poll_fill(self->sock[i], &(ufds[found])) == -1) {
-            ICECAST_LOG_WARN("Can not poll on closed socket.");
+        if (ok && __is_dedicated(self->sock[i]) != dedicated) {
+            skipped++;
+            ok = 0;
+        }
+
+        if (ok && listensocket__poll_fill(self->sock[i], &(ufds[found]), shard) == -1) {
+            /* a socket may have less shards if opening them failed */
+            if (shard == 0)
+                ICECAST_LOG_WARN("Can not poll on closed socket.");
             ok = 0;
         }
 
         if (ok) {
             socks[found] = self->sock[i];
+            refobject_ref(socks[found]);
             found++;
         }
     }
 
     if (!found) {
-        ICECAST_LOG_ERROR("No sockets found to poll on.");
+        if (shard == 0 && !skipped) {
+            ICECAST_LOG_ERROR("No sockets found to poll on.");
+        } else {
+            /* nothing for this thread to do, do not spin */
+            thread_mutex_unlock(&self->lock);
+            thread_sleep(timeout * 1000);
+            thread_mutex_lock(&self->lock);
+        }
         return NULL;
     }
 
+    /* Sockets closed meanwhile only wake us up, listensocket_accept()
+     * checks again under the lock of the socket. */
+    thread_mutex_unlock(&self->lock);
     ret = poll(ufds, found, timeout);
-    if (ret <= 0)
-        return NULL;
+    thread_mutex_lock(&self->lock);
 
-    for (i = 0; i < found; i++) {
-        if (ufds[i].revents & POLLIN) {
-            return socks[i];
+    for (i = 0; i < found && ret > 0; i++) {
+        if (!ready && (ufds[i].revents & POLLIN)) {
+            ready = socks[i];
+            continue;
         }
 
         if (!(ufds[i].revents & (POLLHUP|POLLERR|POLLNVAL)))
             continue;
 
+        /* the descriptor may have been closed and reused while waiting */
+        if (listensocket__poll_fill(socks[i], &check, shard) == -1 || check.fd != ufds[i].fd)
+            continue;
+
         for (p = 0; p < self->sock_len; p++) {
             if (self->sock[p] == socks[i]) {
                 if (self->sockref[p]) {
@@ -397,7 +557,12 @@ static listensocket_t *       listensocket_container_accept__inner(listensocket_
         }
     }
 
-    return NULL;
+    for (i = 0; i < found; i++) {
+        if (socks[i] != ready)
+            refobject_unref(socks[i]);
+    }
+
+    return ready;
 #else
     fd_set rfds;
     size_t i;
@@ -414,18 +579,26 @@ static listensocket_t *       listensocket_container_accept__inner(listensocket_
     }
 
     for (i = 0; i < self->sock_len; i++) {
-        if (self->sockref[i]) {
+        if (self->sockref[i] && __is_dedicated(self->sock[i]) == (shard == LISTENSOCKET_SHARD_DEDICATED)) {
             listensocket__select_set(self->sock[i], &rfds, &max);
         }
     }
 
+    if (max == -1) {
+        thread_mutex_unlock(&self->lock);
+        thread_sleep(timeout * 1000);
+        thread_mutex_lock(&self->lock);
+        return NULL;
+    }
+
     ret = select(max+1, &rfds, NULL, NULL, p);
     if (ret <= 0)
         return NULL;
 
     for (i = 0; i < self->sock_len; i++) {
-        if (self->sockref[i]) {
+        if (self->sockref[i] && __is_dedicated(self->sock[i]) == (shard == LISTENSOCKET_SHARD_DEDICATED)) {
             if (listensocket__select_isset(self->sock[i], &rfds)) {
+                refobject_ref(self->sock[i]);
                 return self->sock[i];
             }
         }
@@ -435,6 +608,11 @@ static listensocket_t *       listensocket_container_accept__inner(listensocket_
 #endif
 }
 connection_t *              listensocket_container_accept(listensocket_container_t *self, int timeout)
+{
+    return listensocket_container_accept_shard(self, 0, timeout);
+}
+
+connection_t *              listensocket_container_accept_shard(listensocket_container_t *self, size_t shard, int timeout)
 {
     listensocket_t *ls;
     connection_t *ret;
@@ -443,16 +621,42 @@ connection_t *              listensocket_container_accept(listensocket_container
         return NULL;
 
     thread_mutex_lock(&self->lock);
-    ls = listensocket_container_accept__inner(self, timeout);
-    refobject_ref(ls);
+    ls = listensocket_container_accept__inner(self, shard, timeout);
     thread_mutex_unlock(&self->lock);
 
-    ret = listensocket_accept(ls, self);
+    ret = listensocket_accept__shard(ls, self, shard == LISTENSOCKET_SHARD_DEDICATED ? 0 : shard);
     refobject_unref(ls);
 
     return ret;
 }
 
+connection_t *              listensocket_container_accept_dedicated(listensocket_container_t *self, int timeout)
+{
+    return listensocket_container_accept_shard(self, LISTENSOCKET_SHARD_DEDICATED, timeout);
+}
+
+ssize_t                     listensocket_container_set_accept_threads(listensocket_container_t *self, size_t count)
+{
+    ssize_t ret;
+
+    if (!self || count < 1)
+        return -1;
+
+#ifndef LISTENSOCKET_SHARDING
+    if (count > 1) {
+        ICECAST_LOG_WARN("Sockets can not be shared between accept threads on this system, using a single accept thread.");
+        count = 1;
+    }
+#endif
+
+    thread_mutex_lock(&self->lock);
+    self->shards = count;
+    ret = count;
+    thread_mutex_unlock(&self->lock);
+
+    return ret;
+}
+
 int                         listensocket_container_set_sockcount_cb(listensocket_container_t *self, void (*cb)(size_t count, void *userdata), void *userdata)
 {
     if (!self)
@@ -578,6 +782,7 @@ static void __listensocket_free(refobject_t self, void **userdata)
     while ((listensocket->listener = config_clear_listener(listensocket->listener)));
     thread_rwlock_unlock(&listensocket->listener_rwlock);
     thread_rwlock_destroy(&listensocket->listener_rwlock);
+    thread_rwlock_destroy(&listensocket->sock_rwlock);
     thread_mutex_unlock(&listensocket->lock);
     thread_mutex_destroy(&listensocket->lock);
 }
@@ -597,9 +802,12 @@ static listensocket_t * listensocket_new(const listener_t *listener) {
         return NULL;
 
     self->sock = SOCK_ERROR;
+    self->shard_sock = NULL;
+    self->shard_len = 0;
 
     thread_mutex_create(&self->lock);
     thread_rwlock_create(&self->listener_rwlock);
+    thread_rwlock_create(&self->sock_rwlock);
 
     self->listener = config_copy_listener_one(listener);
     if (self->listener == NULL) {
@@ -650,12 +858,11 @@ static int              listensocket_apply_config__unlocked(listensocket_t *self
     }
 
     if (self->sock != SOCK_ERROR) {
-        if (listener->so_sndbuf)
-            sock_set_send_buffer(self->sock, listener->so_sndbuf);
-
-        sock_set_blocking(self->sock, 0);
+        size_t i;
 
-        __socket_listen(self->sock, listener);
+        __socket_configure(self->sock, listener);
+        for (i = 0; i < self->shard_len; i++)
+            __socket_configure(self->shard_sock[i], listener);
     }
 
     if (self->listener_update) {
@@ -687,7 +894,41 @@ static int              listensocket_set_update(listensocket_t *self, const list
     return 0;
 }
 
-static int listensocket_refsock(listensocket_t *self, bool prefer_inet6)
+#ifdef LISTENSOCKET_SHARDING
+/* Opens the sockets for the further accept threads. If that fails fewer
+ * threads accept on this socket, as connections the kernel hands to a
+ * socket nobody accepts on would be stuck. */
+static void listensocket__open_shards(listensocket_t *self, bool prefer_inet6, size_t shards)
+{
+    const listener_t *listener = self->listener;
+
+    self->shard_sock = calloc(shards - 1, sizeof(sock_t));
+    if (!self->shard_sock)
+        return;
+
+    while (self->shard_len < shards - 1) {
+        sock_t sock = upgrade_take_listen_socket(listener, self->shard_len + 1);
+
+        if (sock == SOCK_ERROR)
+            sock = __socket_reuseport(listener, prefer_inet6);
+
+        if (sock != SOCK_ERROR && __socket_listen(sock, listener) == 0) {
+            sock_close(sock);
+            sock = SOCK_ERROR;
+        }
+
+        if (sock == SOCK_ERROR) {
+            ICECAST_LOG_WARN("Can not open more than %zu sockets on %s port %i, only as many threads accept on it.",
+                             self->shard_len + 1, __string_default(listener->bind_address, "<ANY>"), listener->port);
+            break;
+        }
+
+        self->shard_sock[self->shard_len++] = sock;
+    }
+}
+#endif
+
+static int listensocket_refsock(listensocket_t *self, bool prefer_inet6, size_t shards)
 {
     if (!self)
         return -1;
@@ -699,10 +940,24 @@ static int listensocket_refsock(listensocket_t *self, bool prefer_inet6)
         return 0;
     }
 
+    thread_rwlock_wlock(&self->sock_rwlock);
     thread_rwlock_rlock(&self->listener_rwlock);
-    self->sock = sock_get_server_socket(self->listener->port, self->listener->bind_address, self->listener->bind_address ? false : prefer_inet6);
+    prefer_inet6 = self->listener->bind_address ? false : prefer_inet6;
+    if (self->listener->dedicated_thread)
+        shards = 1;
+    /* handed over by the process we replace, see upgrade.c */
+    self->sock = upgrade_take_listen_socket(self->listener, 0);
+#ifdef LISTENSOCKET_SHARDING
+    if (shards > 1 && self->sock == SOCK_ERROR)
+        self->sock = __socket_reuseport(self->listener, prefer_inet6);
+#endif
+    if (self->sock == SOCK_ERROR) {
+        shards = 1;
+        self->sock = sock_get_server_socket(self->listener->port, self->listener->bind_address, prefer_inet6);
+    }
     thread_rwlock_unlock(&self->listener_rwlock);
     if (self->sock == SOCK_ERROR) {
+        thread_rwlock_unlock(&self->sock_rwlock);
         thread_mutex_unlock(&self->lock);
         return -1;
     }
@@ -710,6 +965,7 @@ static int listensocket_refsock(listensocket_t *self, bool prefer_inet6)
     if (__socket_listen(self->sock, self->listener) == 0) {
         sock_close(self->sock);
         self->sock = SOCK_ERROR;
+        thread_rwlock_unlock(&self->sock_rwlock);
         thread_rwlock_rlock(&self->listener_rwlock);
         ICECAST_LOG_ERROR("Can not listen on socket: %s port %i", __string_default(self->listener->bind_address, "<ANY>"), self->listener->port);
         thread_rwlock_unlock(&self->listener_rwlock);
@@ -717,6 +973,12 @@ static int listensocket_refsock(listensocket_t *self, bool prefer_inet6)
         return -1;
     }
 
+#ifdef LISTENSOCKET_SHARDING
+    if (shards > 1)
+        listensocket__open_shards(self, prefer_inet6, shards);
+#endif
+    thread_rwlock_unlock(&self->sock_rwlock);
+
     if (listensocket_apply_config__unlocked(self) == -1) {
         thread_mutex_unlock(&self->lock);
         return -1;
@@ -745,19 +1007,56 @@ static int listensocket_unrefsock(listensocket_t *self)
         return 0;
     }
 
+    thread_rwlock_wlock(&self->sock_rwlock);
+    while (self->shard_len)
+        sock_close(self->shard_sock[--self->shard_len]);
+    free(self->shard_sock);
+    self->shard_sock = NULL;
     sock_close(self->sock);
     self->sock = SOCK_ERROR;
+    thread_rwlock_unlock(&self->sock_rwlock);
     thread_mutex_unlock(&self->lock);
 
     return 0;
 }
 
+/* the socket accept thread number shard accepts on */
+static inline sock_t __shard_sock(listensocket_t *self, size_t shard)
+{
+    if (shard == 0)
+        return self->sock;
+    if (shard <= self->shard_len)
+        return self->shard_sock[shard - 1];
+    return SOCK_ERROR;
+}
+
+sock_t                      listensocket_get_sock(listensocket_t *self, size_t shard)
+{
+    sock_t sock;
+
+    if (!self)
+        return SOCK_ERROR;
+
+    thread_rwlock_rlock(&self->sock_rwlock);
+    sock = __shard_sock(self, shard);
+    thread_rwlock_unlock(&self->sock_rwlock);
+
+    return sock;
+}
+
 connection_t *              listensocket_accept(listensocket_t *self, listensocket_container_t *container)
+{
+    return listensocket_accept__shard(self, container, 0);
+}
+
+static connection_t *   listensocket_accept__shard(listensocket_t *self, listensocket_container_t *container, size_t shard)
 {
     connection_t *con;
     listensocket_t *effective = NULL;
+    sock_t serversock;
     sock_t sock;
     char *ip;
+    int iplimited;
 
     if (!self)
         return NULL;
@@ -766,9 +1065,10 @@ connection_t *              listensocket_accept(listensocket_t *self, listensock
     if (!ip)
         return NULL;
 
-    thread_mutex_lock(&self->lock);
-    sock = sock_accept(self->sock, ip, MAX_ADDR_LEN);
-    thread_mutex_unlock(&self->lock);
+    thread_rwlock_rlock(&self->sock_rwlock);
+    serversock = __shard_sock(self, shard);
+    sock = serversock == SOCK_ERROR ? SOCK_ERROR : sock_accept(serversock, ip, MAX_ADDR_LEN);
+    thread_rwlock_unlock(&self->sock_rwlock);
     if (sock == SOCK_ERROR) {
         free(ip);
         return NULL;
@@ -780,6 +1080,14 @@ connection_t *              listensocket_accept(listensocket_t *self, listensock
         memmove(ip, ip+7, strlen(ip+7)+1);
     }
 
+    iplimited = iplimit_acquire(self, ip, self->listener->max_connections_per_ip, self->listener->connection_rate_per_ip, self->listener->connection_burst_per_ip);
+    if (iplimited < 0) {
+        atomic_u64_add(&self->rejected, 1);
+        sock_close(sock);
+        free(ip);
+        return NULL;
+    }
+
     if (self->listener->on_behalf_of) {
         ICECAST_LOG_DEBUG("This socket is acting on behalf of %#H", self->listener->on_behalf_of);
         effective = listensocket_container_get_by_id(container, self->listener->on_behalf_of);
@@ -798,11 +1106,16 @@ connection_t *              listensocket_accept(listensocket_t *self, listensock
     refobject_unref(effective);
 
     if (con == NULL) {
+        if (iplimited > 0)
+            iplimit_release(self, ip);
         sock_close(sock);
         free(ip);
         return NULL;
     }
 
+    con->iplimited = iplimited > 0;
+    atomic_u64_add(&self->accepted, 1);
+
     return con;
 }
 
@@ -866,20 +1179,39 @@ sock_family_t               listensocket_get_family(listensocket_t *self)
     return ret;
 }
 
+uint64_t                    listensocket_get_accepted(listensocket_t *self)
+{
+    if (!self)
+        return 0;
+
+    return atomic_u64_load(&self->accepted);
+}
+
+uint64_t                    listensocket_get_rejected(listensocket_t *self)
+{
+    if (!self)
+        return 0;
+
+    return atomic_u64_load(&self->rejected);
+}
+
 #ifdef HAVE_POLL
-static inline int listensocket__poll_fill(listensocket_t *self, struct pollfd *p)
+static inline int listensocket__poll_fill(listensocket_t *self, struct pollfd *p, size_t shard)
 {
+    sock_t sock;
+
     if (!self)
         return -1;
 
     thread_mutex_lock(&self->lock);
-    if (self->sock == SOCK_ERROR) {
+    sock = __shard_sock(self, shard);
+    if (sock == SOCK_ERROR) {
         thread_mutex_unlock(&self->lock);
         return -1;
     }
 
     memset(p, 0, sizeof(*p));
-    p->fd = self->sock;
+    p->fd = sock;
     p->events = POLLIN;
     p->revents = 0;
 
@@ -10,6 +10,7 @@
 #define __LISTENSOCKET_H__
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "common/net/sock.h"
 
@@ -24,6 +25,10 @@ int                         listensocket_container_configure(listensocket_contai
 int                         listensocket_container_configure_and_setup(listensocket_container_t *self, const ice_config_t *config);
 int                         listensocket_container_setup(listensocket_container_t *self);
 connection_t *              listensocket_container_accept(listensocket_container_t *self, int timeout);
+connection_t *              listensocket_container_accept_shard(listensocket_container_t *self, size_t shard, int timeout);
+/* accepts on the sockets with <dedicated-thread>, which the others leave out */
+connection_t *              listensocket_container_accept_dedicated(listensocket_container_t *self, int timeout);
+ssize_t                     listensocket_container_set_accept_threads(listensocket_container_t *self, size_t count);
 int                         listensocket_container_set_sockcount_cb(listensocket_container_t *self, void (*cb)(size_t count, void *userdata), void *userdata);
 ssize_t                     listensocket_container_sockcount(listensocket_container_t *self);
 listensocket_t *            listensocket_container_get_by_id(listensocket_container_t *self, const char *id);
@@ -37,6 +42,11 @@ const listener_t *          listensocket_get_listener(listensocket_t *self);
 int                         listensocket_release_listener(listensocket_t *self);
 listener_type_t             listensocket_get_type(listensocket_t *self);
 sock_family_t               listensocket_get_family(listensocket_t *self);
+/* the socket accept thread number shard accepts on, SOCK_ERROR if none */
+sock_t                      listensocket_get_sock(listensocket_t *self, size_t shard);
+/* connections accepted and rejected by the per address limits so far */
+uint64_t                    listensocket_get_accepted(listensocket_t *self);
+uint64_t                    listensocket_get_rejected(listensocket_t *self);
 
 const char *                listensocket_type_to_string(listener_type_t type);
 const char *                listensocket_tlsmode_to_string(tlsmode_t mode);
@@ -16,13 +16,17 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include "common/thread/thread.h"
 #include "common/httpp/httpp.h"
 
 #include "logging.h"
+#include "waitlock.h"
 #include "connection.h"
 #include "refbuf.h"
 #include "client.h"
@@ -30,6 +34,11 @@
 #include "compat.h"
 #include "cfgfile.h"
 #include "util.h"
+#include "stats.h"
+#include "json.h"
+#include "atomic.h"
+#include "listensocket.h"
+#include "coarsetime.h"
 
 #define CATMODULE "logging"
 
@@ -43,6 +52,84 @@ int errorlog = 0;
 int accesslog = 0;
 int playlistlog = 0;
 
+/* Access and playlist log lines are put into a ring of records taken by
+ * a writer thread, so the disk is not waited for by the threads serving
+ * clients and sources. The records keep the values, not the line, as
+ * the line is formatted by the log library. */
+#define LOGGING_RECORD_DATA     2048
+#define LOGGING_FIELD_NULL      UINT16_MAX
+
+typedef enum {
+    LOGGING_RECORD_ACCESS,
+    LOGGING_RECORD_ACCESS_JSON,
+    LOGGING_RECORD_PLAYLIST
+} logging_record_type_t;
+
+typedef enum {
+    LOGGING_FIELD_IP = 0,
+    LOGGING_FIELD_USERNAME,
+    LOGGING_FIELD_METHOD,
+    LOGGING_FIELD_URI,
+    LOGGING_FIELD_PROTOCOL,
+    LOGGING_FIELD_VERSION,
+    LOGGING_FIELD_REFERRER,
+    LOGGING_FIELD_USER_AGENT,
+    LOGGING_FIELD_MOUNT,
+    LOGGING_FIELD_LISTENSOCKET,
+    LOGGING_FIELD_METADATA,
+    LOGGING_FIELD_MAX
+} logging_field_t;
+
+typedef struct {
+    logging_record_type_t type;
+    time_t time;
+    int respcode;
+    uint64_t sent_bytes;
+    uint64_t stayed;
+    int tls;
+    /* static string, see connection_t */
+    const char *discon_reason;
+    unsigned int sample;
+    long listeners;
+    /* offsets of the strings in data, LOGGING_FIELD_NULL for none */
+    uint16_t fields[LOGGING_FIELD_MAX];
+    size_t used;
+    /* must be last, only the used part is copied */
+    char data[LOGGING_RECORD_DATA];
+} logging_record_t;
+
+/* the records from logging_queue_tail to logging_queue_head are being
+ * written, they are counters that are taken modulo logging_queue_size */
+static waitlock_t logging_queue_lock = WAITLOCK_INITIALIZER;
+static waitcond_t logging_queue_cond = WAITCOND_INITIALIZER;
+static waitcond_t logging_queue_space_cond = WAITCOND_INITIALIZER;
+static logging_record_t *logging_queue = NULL;
+static size_t logging_queue_size = 0;
+static size_t logging_queue_head = 0;
+static size_t logging_queue_tail = 0;
+static int logging_queue_drop = 0;
+static int logging_queue_running = 0;
+static thread_type *logging_queue_thread = NULL;
+
+/* format and sampling of the access log, see logging_configure() */
+static volatile unsigned int logging_access_format = ACCESS_LOG_FORMAT_CLF;
+static volatile unsigned int logging_access_sample = 1;
+static volatile unsigned int logging_access_count = 0;
+
+/* many lines are logged in the same second, so the last string of each
+ * format is kept */
+typedef enum {
+    LOGGING_TIME_CLF = 0,
+    LOGGING_TIME_ISO8601,
+    LOGGING_TIME_MAX
+} logging_time_format_t;
+
+static waitlock_t logging_time_lock = WAITLOCK_INITIALIZER;
+static struct {
+    time_t time;
+    char str[128];
+} logging_time_cache[LOGGING_TIME_MAX];
+
 int logging_str2logid(const char *str)
 {
     if (!str)
@@ -125,6 +212,295 @@ int get_clf_time (char *buffer, unsigned len, struct tm *t)
     return 1;
 }
 #endif
+static void logging_record_init(logging_record_t *record, logging_record_type_t type)
+{
+    size_t i;
+
+    record->type = type;
+    record->time = coarsetime_get();
+    record->respcode = 0;
+    record->sent_bytes = 0;
+    record->stayed = 0;
+    record->tls = 0;
+    record->discon_reason = NULL;
+    record->sample = 1;
+    record->listeners = 0;
+    record->used = 0;
+    for (i = 0; i < LOGGING_FIELD_MAX; i++)
+        record->fields[i] = LOGGING_FIELD_NULL;
+}
+
+/* copies the string into the record, cutting it to the space left */
+static void logging_record_set(logging_record_t *record, logging_field_t field, const char *str)
+{
+    size_t len;
+
+    if (!str || record->used >= (sizeof(record->data) - 1))
+        return;
+
+    len = strlen(str);
+    if (len > (sizeof(record->data) - 1 - record->used))
+        len = sizeof(record->data) - 1 - record->used;
+
+    memcpy(record->data + record->used, str, len);
+    record->data[record->used + len] = 0;
+    record->fields[field] = record->used;
+    record->used += len + 1;
+}
+
+static inline const char *logging_record_get(const logging_record_t *record, logging_field_t field)
+{
+    if (record->fields[field] == LOGGING_FIELD_NULL)
+        return NULL;
+
+    return record->data + record->fields[field];
+}
+
+static inline const char *logging_record_get_default(const logging_record_t *record, logging_field_t field, const char *def)
+{
+    const char *ret = logging_record_get(record, field);
+
+    return ret ? ret : def;
+}
+
+static void logging_format_time(time_t t, logging_time_format_t format, char *buf, size_t len)
+{
+    waitlock_lock(&logging_time_lock);
+    if (logging_time_cache[format].time != t || !logging_time_cache[format].str[0]) {
+        struct tm thetime;
+
+        localtime_r(&t, &thetime);
+        if (format == LOGGING_TIME_CLF) {
+#ifdef _WIN32
+            memset(logging_time_cache[format].str, '\000', sizeof(logging_time_cache[format].str));
+            get_clf_time(logging_time_cache[format].str, sizeof(logging_time_cache[format].str)-1, &thetime);
+#else
+            strftime(logging_time_cache[format].str, sizeof(logging_time_cache[format].str), LOGGING_FORMAT_CLF, &thetime);
+#endif
+        } else {
+            strftime(logging_time_cache[format].str, sizeof(logging_time_cache[format].str), LOGGING_FORMAT_ISO8601, &thetime);
+        }
+        logging_time_cache[format].time = t;
+    }
+    snprintf(buf, len, "%s", logging_time_cache[format].str);
+    waitlock_unlock(&logging_time_lock);
+}
+
+static void logging_json_field(json_renderer_t *renderer, const char *key, const char *value)
+{
+    json_renderer_write_key(renderer, key, JSON_RENDERER_FLAGS_NONE);
+    if (value) {
+        json_renderer_write_string(renderer, value, JSON_RENDERER_FLAGS_NONE);
+    } else {
+        json_renderer_write_null(renderer);
+    }
+}
+
+static void logging_write_access_json(const logging_record_t *record)
+{
+    json_renderer_t *renderer = json_renderer_create(JSON_RENDERER_FLAGS_NONE);
+    char datebuf[128];
+    char *line;
+
+    if (!renderer)
+        return;
+
+    logging_format_time(record->time, LOGGING_TIME_ISO8601, datebuf, sizeof(datebuf));
+
+    json_renderer_begin(renderer, JSON_ELEMENT_TYPE_OBJECT);
+    logging_json_field(renderer, "time", datebuf);
+    logging_json_field(renderer, "ip", logging_record_get(record, LOGGING_FIELD_IP));
+    logging_json_field(renderer, "username", logging_record_get(record, LOGGING_FIELD_USERNAME));
+    logging_json_field(renderer, "method", logging_record_get(record, LOGGING_FIELD_METHOD));
+    logging_json_field(renderer, "uri", logging_record_get(record, LOGGING_FIELD_URI));
+    logging_json_field(renderer, "protocol", logging_record_get(record, LOGGING_FIELD_PROTOCOL));
+    logging_json_field(renderer, "version", logging_record_get(record, LOGGING_FIELD_VERSION));
+    json_renderer_write_key(renderer, "status", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_int(renderer, record->respcode);
+    json_renderer_write_key(renderer, "bytes", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_uint(renderer, record->sent_bytes);
+    json_renderer_write_key(renderer, "duration", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_uint(renderer, record->stayed);
+    logging_json_field(renderer, "referrer", logging_record_get(record, LOGGING_FIELD_REFERRER));
+    logging_json_field(renderer, "user_agent", logging_record_get(record, LOGGING_FIELD_USER_AGENT));
+    logging_json_field(renderer, "mount", logging_record_get(record, LOGGING_FIELD_MOUNT));
+    logging_json_field(renderer, "listen_socket", logging_record_get(record, LOGGING_FIELD_LISTENSOCKET));
+    json_renderer_write_key(renderer, "tls", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_boolean(renderer, record->tls);
+    logging_json_field(renderer, "disconnect_reason", record->discon_reason);
+    json_renderer_write_key(renderer, "sample", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_uint(renderer, record->sample);
+    json_renderer_end(renderer);
+
+    line = json_renderer_finish(&renderer);
+    if (!line)
+        return;
+
+    log_write_direct(accesslog, "%s", line);
+    free(line);
+}
+
+static void logging_record_write(const logging_record_t *record)
+{
+    char datebuf[128];
+
+    switch (record->type) {
+        case LOGGING_RECORD_ACCESS:
+            logging_format_time(record->time, LOGGING_TIME_CLF, datebuf, sizeof(datebuf));
+            log_write_direct (accesslog,
+                    "%s - %H [%s] \"%H %H %H/%H\" %d %llu \"% H\" \"% H\" %llu",
+                    logging_record_get(record, LOGGING_FIELD_IP),
+                    logging_record_get_default(record, LOGGING_FIELD_USERNAME, "-"),
+                    datebuf,
+                    logging_record_get(record, LOGGING_FIELD_METHOD),
+                    logging_record_get(record, LOGGING_FIELD_URI),
+                    logging_record_get(record, LOGGING_FIELD_PROTOCOL),
+                    logging_record_get(record, LOGGING_FIELD_VERSION),
+                    record->respcode,
+                    (long long unsigned int)record->sent_bytes,
+                    logging_record_get_default(record, LOGGING_FIELD_REFERRER, "-"),
+                    logging_record_get_default(record, LOGGING_FIELD_USER_AGENT, "-"),
+                    (long long unsigned int)record->stayed);
+        break;
+        case LOGGING_RECORD_ACCESS_JSON:
+            logging_write_access_json(record);
+        break;
+        case LOGGING_RECORD_PLAYLIST:
+            logging_format_time(record->time, LOGGING_TIME_CLF, datebuf, sizeof(datebuf));
+            /* This format MAY CHANGE OVER TIME.  We are looking into finding a good
+               standard format for this, if you have any ideas, please let us know */
+            log_write_direct (playlistlog, "%s|%s|%ld|%s",
+                    datebuf,
+                    logging_record_get(record, LOGGING_FIELD_MOUNT),
+                    record->listeners,
+                    logging_record_get(record, LOGGING_FIELD_METADATA));
+        break;
+    }
+}
+
+/* hands the record to the writer thread, or writes it right away if
+ * there is none */
+static void logging_record_submit(const logging_record_t *record)
+{
+    waitlock_lock(&logging_queue_lock);
+    if (logging_queue_running && !logging_queue_drop) {
+        while (logging_queue_running && (logging_queue_head - logging_queue_tail) >= logging_queue_size)
+            waitcond_wait(&logging_queue_space_cond, &logging_queue_lock);
+    }
+
+    if (!logging_queue_running) {
+        waitlock_unlock(&logging_queue_lock);
+        logging_record_write(record);
+        return;
+    }
+
+    if ((logging_queue_head - logging_queue_tail) >= logging_queue_size) {
+        waitlock_unlock(&logging_queue_lock);
+        stats_global_inc(STATS_GLOBAL_LOG_RECORDS_DROPPED);
+        return;
+    }
+
+    memcpy(&(logging_queue[logging_queue_head % logging_queue_size]), record, offsetof(logging_record_t, data) + record->used);
+    logging_queue_head++;
+    stats_global_inc(STATS_GLOBAL_LOG_RECORDS_QUEUED);
+    waitcond_signal(&logging_queue_cond);
+    waitlock_unlock(&logging_queue_lock);
+}
+
+/* writes everything queued at once and only then makes the space free
+ * again, leaves once stopped and the queue is empty */
+static void *logging_queue_run(void *arg)
+{
+    (void)arg;
+
+    waitlock_lock(&logging_queue_lock);
+    while (1) {
+        size_t head, tail, i;
+
+        while (logging_queue_running && logging_queue_head == logging_queue_tail)
+            waitcond_wait(&logging_queue_cond, &logging_queue_lock);
+
+        if (logging_queue_head == logging_queue_tail)
+            break;
+
+        head = logging_queue_head;
+        tail = logging_queue_tail;
+        waitlock_unlock(&logging_queue_lock);
+
+        for (i = tail; i != head; i++)
+            logging_record_write(&(logging_queue[i % logging_queue_size]));
+        stats_global_add(STATS_GLOBAL_LOG_RECORDS_QUEUED, -(int64_t)(head - tail));
+
+        waitlock_lock(&logging_queue_lock);
+        logging_queue_tail = head;
+        waitcond_broadcast(&logging_queue_space_cond);
+    }
+    waitlock_unlock(&logging_queue_lock);
+
+    return NULL;
+}
+
+void logging_queue_initialize(void)
+{
+    ice_config_t *config;
+    size_t size;
+    int drop;
+
+    config = config_get_config();
+    size = config->log_queue_size;
+    drop = config->log_queue_drop;
+    config_release_config();
+
+    if (!size || logging_queue_running)
+        return;
+
+    logging_queue = malloc(size * sizeof(*logging_queue));
+    if (!logging_queue) {
+        ICECAST_LOG_ERROR("Can not allocate the log queue, logs are written synchronously.");
+        return;
+    }
+
+    waitlock_lock(&logging_queue_lock);
+    logging_queue_size = size;
+    logging_queue_head = logging_queue_tail = 0;
+    logging_queue_drop = drop;
+    logging_queue_running = 1;
+    waitlock_unlock(&logging_queue_lock);
+
+    logging_queue_thread = thread_create("Log Writer Thread", logging_queue_run, NULL, THREAD_ATTACHED);
+    if (!logging_queue_thread) {
+        ICECAST_LOG_ERROR("Can not start the log writer thread, logs are written synchronously.");
+        waitlock_lock(&logging_queue_lock);
+        logging_queue_running = 0;
+        waitlock_unlock(&logging_queue_lock);
+        free(logging_queue);
+        logging_queue = NULL;
+        return;
+    }
+
+    ICECAST_LOG_DEBUG("Log writer thread started, queue holds %zu records", size);
+}
+
+/* the records still queued are written before this returns */
+void logging_queue_shutdown(void)
+{
+    waitlock_lock(&logging_queue_lock);
+    if (!logging_queue_running) {
+        waitlock_unlock(&logging_queue_lock);
+        return;
+    }
+    logging_queue_running = 0;
+    waitcond_signal(&logging_queue_cond);
+    waitcond_broadcast(&logging_queue_space_cond);
+    waitlock_unlock(&logging_queue_lock);
+
+    thread_join(logging_queue_thread);
+    logging_queue_thread = NULL;
+
+    free(logging_queue);
+    logging_queue = NULL;
+}
+
 /*
  ** ADDR IDENT USER DATE REQUEST CODE BYTES REFERER AGENT [TIME]
  **
@@ -141,83 +517,62 @@ int get_clf_time (char *buffer, unsigned len, struct tm *t)
  */
 void logging_access(client_t *client)
 {
-    char datebuf[128];
-    struct tm thetime;
-    time_t now;
-    time_t stayed;
-    const char *referrer, *user_agent, *username;
+    logging_record_t record;
+    unsigned int sample = atomic_uint_load(&logging_access_sample);
+    int json = atomic_uint_load(&logging_access_format) == ACCESS_LOG_FORMAT_JSON;
 
-    now = time(NULL);
+    /* errors are always logged */
+    if (sample > 1 && client->respcode < 400 && (atomic_uint_add(&logging_access_count, 1) % sample) != 0)
+        return;
 
-    localtime_r (&now, &thetime);
-    /* build the data */
-#ifdef _WIN32
-    memset(datebuf, '\000', sizeof(datebuf));
-    get_clf_time(datebuf, sizeof(datebuf)-1, &thetime);
-#else
-    strftime (datebuf, sizeof(datebuf), LOGGING_FORMAT_CLF, &thetime);
-#endif
+    logging_record_init(&record, json ? LOGGING_RECORD_ACCESS_JSON : LOGGING_RECORD_ACCESS);
+
+    record.respcode = client->respcode;
+    record.sent_bytes = client->con->sent_bytes;
+    record.stayed = record.time - client->con->con_time;
+    record.tls = client->con->tls != NULL;
+    record.discon_reason = client->con->discon_reason;
+    record.sample = sample > 1 && client->respcode < 400 ? sample : 1;
+
+    /* the ones most needed first, in case the space runs out */
+    logging_record_set(&record, LOGGING_FIELD_IP, client->con->ip);
+    logging_record_set(&record, LOGGING_FIELD_USERNAME, client->username);
+    logging_record_set(&record, LOGGING_FIELD_METHOD, httpp_getvar (client->parser, HTTPP_VAR_REQ_TYPE));
+    logging_record_set(&record, LOGGING_FIELD_PROTOCOL, httpp_getvar (client->parser, HTTPP_VAR_PROTOCOL));
+    logging_record_set(&record, LOGGING_FIELD_VERSION, httpp_getvar (client->parser, HTTPP_VAR_VERSION));
+    if (json) {
+        const listener_t *listener = listensocket_get_listener(client->con->listensocket_effective);
+
+        if (client->history.fill)
+            logging_record_set(&record, LOGGING_FIELD_MOUNT, mount_identifier_get_mount(client->history.history[client->history.fill - 1]));
+        if (listener) {
+            logging_record_set(&record, LOGGING_FIELD_LISTENSOCKET, listener->id);
+            listensocket_release_listener(client->con->listensocket_effective);
+        }
+    }
+    logging_record_set(&record, LOGGING_FIELD_URI, httpp_getvar (client->parser, HTTPP_VAR_URI));
+    logging_record_set(&record, LOGGING_FIELD_REFERRER, httpp_getvar (client->parser, "referer"));
+    logging_record_set(&record, LOGGING_FIELD_USER_AGENT, httpp_getvar (client->parser, "user-agent"));
 
-    stayed = now - client->con->con_time;
-
-    if (client->username == NULL)
-        username = "-";
-    else
-        username = client->username;
-
-    referrer = httpp_getvar (client->parser, "referer");
-    if (referrer == NULL)
-        referrer = "-";
-
-    user_agent = httpp_getvar (client->parser, "user-agent");
-    if (user_agent == NULL)
-        user_agent = "-";
-
-    log_write_direct (accesslog,
-            "%s - %H [%s] \"%H %H %H/%H\" %d %llu \"% H\" \"% H\" %llu",
-            client->con->ip,
-            username,
-            datebuf,
-            httpp_getvar (client->parser, HTTPP_VAR_REQ_TYPE),
-            httpp_getvar (client->parser, HTTPP_VAR_URI),
-            httpp_getvar (client->parser, HTTPP_VAR_PROTOCOL),
-            httpp_getvar (client->parser, HTTPP_VAR_VERSION),
-            client->respcode,
-            (long long unsigned int)client->con->sent_bytes,
-            referrer,
-            user_agent,
-            (long long unsigned int)stayed);
+    logging_record_submit(&record);
 }
 /* This function will provide a log of metadata for each
    mountpoint.  The metadata *must* be in UTF-8, and thus
    you can assume that the log itself is UTF-8 encoded */
 void logging_playlist(const char *mount, const char *metadata, long listeners)
 {
-    char datebuf[128];
-    struct tm thetime;
-    time_t now;
+    logging_record_t record;
 
     if (playlistlog == -1) {
         return;
     }
 
-    now = time(NULL);
+    logging_record_init(&record, LOGGING_RECORD_PLAYLIST);
+    record.listeners = listeners;
+    logging_record_set(&record, LOGGING_FIELD_MOUNT, mount);
+    logging_record_set(&record, LOGGING_FIELD_METADATA, metadata);
 
-    localtime_r (&now, &thetime);
-    /* build the data */
-#ifdef _WIN32
-    memset(datebuf, '\000', sizeof(datebuf));
-    get_clf_time(datebuf, sizeof(datebuf)-1, &thetime);
-#else
-    strftime (datebuf, sizeof(datebuf), LOGGING_FORMAT_CLF, &thetime);
-#endif
-    /* This format MAY CHANGE OVER TIME.  We are looking into finding a good
-       standard format for this, if you have any ideas, please let us know */
-    log_write_direct (playlistlog, "%s|%s|%ld|%s",
-             datebuf,
-             mount,
-             listeners,
-             metadata);
+    logging_record_submit(&record);
 }
 
 void logging_mark(const char *username, const char *role)
@@ -241,8 +596,16 @@ void log_parse_failure (void *ctx, const char *fmt, ...)
 }
 
 
+void logging_configure(ice_config_t *config)
+{
+    atomic_uint_store(&logging_access_format, config->access_log_format);
+    atomic_uint_store(&logging_access_sample, config->access_log_sample ? config->access_log_sample : 1);
+}
+
 void restart_logging (ice_config_t *config)
 {
+    logging_configure(config);
+
     if (strcmp (config->error_log, "-"))
     {
         char fn_error[FILENAME_MAX];
@@ -95,6 +95,8 @@ extern int playlistlog;
 */
 
 #define LOGGING_FORMAT_CLF "%d/%b/%Y:%H:%M:%S %z"
+/* time of the lines of the JSON access log */
+#define LOGGING_FORMAT_ISO8601 "%Y-%m-%dT%H:%M:%S%z"
 
 int logging_str2logid(const char *str);
 
@@ -102,6 +104,11 @@ void logging_access(client_t *client);
 void logging_playlist(const char *mount, const char *metadata, long listeners);
 void logging_mark(const char *username, const char *role);
 void restart_logging (ice_config_t *config);
+/* applies the format and sampling of the access log */
+void logging_configure(ice_config_t *config);
+/* starts and stops the thread writing the access and playlist logs */
+void logging_queue_initialize(void);
+void logging_queue_shutdown(void);
 void log_parse_failure (void *ctx, const char *fmt, ...);
 
 #endif  /* __LOGGING_H__ */
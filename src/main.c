@@ -45,6 +45,12 @@
 #include <sys/utsname.h>
 #endif
 
+#ifndef _WIN32
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#endif
+
 #include "common/thread/thread.h"
 #include "common/net/sock.h"
 #include "common/net/resolver.h"
@@ -69,8 +75,17 @@
 #include "compat.h"
 #include "connection.h"
 #include "refbuf.h"
+#include "format_mp3.h"
 #include "client.h"
 #include "slave.h"
+#include "sourceloop.h"
+#include "tlshandshake.h"
+#include "relaymux.h"
+#include "cluster.h"
+#include "iplimit.h"
+#include "egress.h"
+#include "introcache.h"
+#include "filecache.h"
 #include "stats.h"
 #include "logging.h"
 #include "xslt.h"
@@ -80,8 +95,15 @@
 #include "event.h"
 #include "listensocket.h"
 #include "fastevent.h"
+#include "histogram.h"
+#include "flightrec.h"
+#include "memgov.h"
+#include "coarsetime.h"
 #include "prng.h"
 #include "navigation.h"
+#include "upgrade.h"
+#include "affinity.h"
+#include "hls.h"
 
 #include <libxml/xmlmemory.h>
 
@@ -147,20 +169,26 @@ static void initialize_subsystems(void)
 {
     log_initialize();
     thread_initialize();
+    coarsetime_initialize();
     prng_initialize();
     navigation_initialize();
     global_initialize();
-#ifndef FASTEVENT_ENABLED
     fastevent_initialize();
+#ifndef FASTEVENT_ENABLED
     fastevent_reg = fastevent_register(FASTEVENT_TYPE_SLOWEVENT, __fastevent_cb, NULL, NULL);
 #endif
     sock_initialize();
     resolver_initialize();
     config_initialize();
+    util_initialize();
     tls_initialize();
     client_initialize();
     connection_initialize();
+    iplimit_initialize();
     refbuf_initialize();
+    format_mp3_initialize();
+    upgrade_initialize();
+    hls_initialize();
 
     xslt_initialize();
 #ifdef HAVE_CURL
@@ -168,30 +196,80 @@ static void initialize_subsystems(void)
 #endif
 }
 
+#ifndef _WIN32
+/* ends the process if the shutdown takes longer than <shutdown-timeout>,
+ * such as a thread stuck in a slow backend call */
+static void *_shutdown_watchdog(void *arg)
+{
+    unsigned int timeout = (uintptr_t)arg;
+
+    sleep(timeout);
+    /* the loggers may be gone by now */
+    fprintf(stderr, "Shutdown took longer than %u seconds, exiting\n", timeout);
+    _exit(EXIT_FAILURE);
+    return NULL;
+}
+
+static void _start_shutdown_watchdog(void)
+{
+    ice_config_t *config = config_get_config();
+    unsigned int timeout = config->shutdown_timeout;
+    pthread_t thread;
+
+    config_release_config();
+    if (!timeout)
+        return;
+
+    if (pthread_create(&thread, NULL, _shutdown_watchdog, (void *)(uintptr_t)timeout) == 0) {
+        pthread_detach(thread);
+    } else {
+        ICECAST_LOG_WARN("Can not start shutdown watchdog, shutdown is not limited in time");
+    }
+}
+#endif
+
 static void shutdown_subsystems(void)
 {
     event_shutdown();
+    upgrade_shutdown();
     fserve_shutdown();
+    filecache_shutdown();
     refbuf_shutdown();
     slave_shutdown();
+    cluster_shutdown();
+    relaymux_shutdown();
+    sourceloop_shutdown();
+    hls_shutdown();
+    format_mp3_shutdown();
+    egress_shutdown();
+    tlshandshake_shutdown();
+    introcache_shutdown();
     auth_shutdown();
     yp_shutdown();
+    flightrec_shutdown();
+    memgov_shutdown();
+    histogram_shutdown();
     stats_shutdown();
+    affinity_shutdown();
 
     connection_shutdown();
+    iplimit_shutdown();
     client_shutdown();
     tls_shutdown();
     prng_deconfigure();
+    util_shutdown();
     config_shutdown();
     resolver_shutdown();
     sock_shutdown();
 #ifndef FASTEVENT_ENABLED
     refobject_unref(fastevent_reg);
-    fastevent_shutdown();
 #endif
+    fastevent_shutdown();
     navigation_shutdown();
     prng_shutdown();
     global_shutdown();
+    logging_queue_shutdown();
+    coarsetime_shutdown();
     thread_shutdown();
 
 #ifdef HAVE_CURL
@@ -354,6 +432,8 @@ static int _start_logging(void)
     log_set_lines_kept(accesslog, config->access_log_lines_kept);
     log_set_lines_kept(playlistlog, config->playlist_log_lines_kept);
 
+    logging_configure(config);
+
     if (errorlog >= 0 && accesslog >= 0) return 1;
 
     return 0;
@@ -416,7 +496,10 @@ static int _server_proc_init(void)
 {
     ice_config_t *config = config_get_config_unlocked();
 
+    /* if we replace a running process we take over its sockets */
+    upgrade_receive_listen_sockets();
     connection_setup_sockets(config);
+    upgrade_release_listen_sockets();
 
     if (listensocket_container_sockcount(global.listensockets) < 1) {
         ICECAST_LOG_ERROR("Can not listen on any sockets.");
@@ -619,6 +702,9 @@ int main(int argc, char **argv)
             case CONFIG_EBADROOT:
                 _fatal_error("root element is not <icecast>");
                 break;
+            case CONFIG_EINVALID:
+                _fatal_error("invalid settings, such as a memory-shed-threshold above the memory-reject-threshold");
+                break;
             default:
                 _fatal_error("XML config parsing error");
                 break;
@@ -635,6 +721,7 @@ int main(int argc, char **argv)
 
     /* override config file options with commandline options */
     config_parse_cmdline(argc, argv);
+    upgrade_set_command(argv);
 
     /* Bind socket, before we change userid */
     if(!_server_proc_init()) {
@@ -655,10 +742,27 @@ int main(int argc, char **argv)
 
     config = config_get_config();
     prng_configure(config);
+    refbuf_set_huge_pages(config->huge_pages);
     config_release_config();
 
+    logging_queue_initialize();
+    affinity_initialize();
+
     stats_initialize(); /* We have to do this later on because of threading */
-    fserve_initialize(); /* This too */
+    histogram_initialize();
+    flightrec_initialize();
+    if (fserve_initialize() != 0) { /* This too */
+        _fatal_error("FATAL: Could not start file serving");
+        shutdown_subsystems();
+        return 1;
+    }
+    filecache_initialize();
+    memgov_initialize();
+    egress_initialize();
+    sourceloop_initialize();
+    tlshandshake_initialize();
+    relaymux_initialize();
+    introcache_initialize();
 
 #ifdef HAVE_SETUID
     /* We'll only have getuid() if we also have setuid(), it's reasonable to
@@ -688,21 +792,30 @@ int main(int argc, char **argv)
     yp_initialize();
 
     /* Do this after logging init */
+    cluster_initialize();
     slave_initialize();
     auth_initialise ();
     event_initialise();
 
+    /* let the process we replace know, if any */
+    upgrade_complete_startup();
+
     event_emit_global("icecast-start");
     _server_proc();
     event_emit_global("icecast-stop");
 
     ICECAST_LOG_INFO("Shutting down");
+#ifndef _WIN32
+    _start_shutdown_watchdog();
+#endif
 #if !defined(_WIN32) || defined(_CONSOLE) || defined(__MINGW32__) || defined(__MINGW64__)
     shutdown_subsystems();
 #endif
     if (pidfile)
     {
-        remove (pidfile);
+        /* the process that took over wrote its own */
+        if (!upgrade_is_done())
+            remove (pidfile);
         free (pidfile);
     }
 
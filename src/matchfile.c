@@ -18,14 +18,51 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <stdint.h>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#else
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#endif
 
 #include "common/avl/avl.h"
+#include "common/thread/thread.h"
 
 #include "matchfile.h"
 #include "logging.h"
 #include "util.h" /* for MAX_LINE_LEN and get_line() */
 #define CATMODULE "matchfile"
 
+/* Lines that are an IPv4 or IPv6 address, optionally followed by /prefix
+ * length, go into a path compressed binary trie over 128 bit keys. IPv4
+ * is kept as IPv4-mapped IPv6 so v4 clients on dual stack sockets match
+ * as well. A lookup walks at most one node per distinct branch point of
+ * the prefixes on the path and stops at the first prefix that covers the
+ * key. All other lines are matched as exact strings.
+ */
+typedef struct {
+    uint64_t key[2];
+    /* indices into the node array, 0 for none */
+    uint32_t child[2];
+    /* number of leading bits of key that are valid */
+    unsigned char len;
+    /* set if the prefix itself is in the file */
+    unsigned char terminal;
+} matchfile_node_t;
+
+#define MATCHFILE_ROOT  1
+
+typedef struct {
+    avl_tree *strings;
+    /* node 0 is unused, MATCHFILE_ROOT is the empty prefix */
+    matchfile_node_t *nodes;
+    size_t nodes_len;
+    size_t nodes_alloc;
+    size_t prefixes;
+} matchfile_db_t;
+
 struct matchfile_tag {
     /* reference counter */
     size_t refcount;
@@ -33,9 +70,15 @@ struct matchfile_tag {
     /* filename of input file */
     char *filename;
 
-    time_t file_recheck;
+    /* protects file_recheck and file_mtime while reloading */
+    mutex_t recheck_lock;
+    volatile time_t file_recheck;
     time_t file_mtime;
-    avl_tree *contents;
+
+    /* readers hold it while looking up, a reload swaps contents under
+     * the write lock once the new database is complete */
+    rwlock_t contents_lock;
+    matchfile_db_t *contents;
 };
 
 static int __func_free(void *x) {
@@ -48,50 +91,314 @@ static int __func_compare (void *arg, void *a, void *b) {
     return strcmp(b, a);
 }
 
+static inline unsigned int __key_bit(const uint64_t key[2], unsigned int bit) {
+    if (bit < 64)
+        return (key[0] >> (63 - bit)) & 1;
+    return (key[1] >> (127 - bit)) & 1;
+}
+
+static inline void __key_mask(uint64_t key[2], unsigned int len) {
+    if (len == 0) {
+        key[0] = 0;
+        key[1] = 0;
+    } else if (len < 64) {
+        key[0] &= ~UINT64_C(0) << (64 - len);
+        key[1] = 0;
+    } else if (len == 64) {
+        key[1] = 0;
+    } else if (len < 128) {
+        key[1] &= ~UINT64_C(0) << (128 - len);
+    }
+}
+
+/* returns true if the first len bits of a and b are the same */
+static inline int __key_match(const uint64_t a[2], const uint64_t b[2], unsigned int len) {
+    uint64_t tmp[2];
+
+    tmp[0] = a[0] ^ b[0];
+    tmp[1] = a[1] ^ b[1];
+    __key_mask(tmp, len);
+
+    return !tmp[0] && !tmp[1];
+}
+
+/* number of leading bits a and b have in common, at most max */
+static unsigned int __key_common(const uint64_t a[2], const uint64_t b[2], unsigned int max) {
+    unsigned int bit;
+
+    for (bit = 0; bit < max; bit++)
+        if (__key_bit(a, bit) != __key_bit(b, bit))
+            break;
+
+    return bit;
+}
+
+/* parses an address with an optional /prefix length into key and len */
+static int __parse_prefix(const char *str, uint64_t key[2], unsigned int *len) {
+    char addr[INET6_ADDRSTRLEN];
+    const char *slash = strchr(str, '/');
+    size_t addrlen = slash ? (size_t)(slash - str) : strlen(str);
+    unsigned char buf[16];
+    unsigned int max;
+    size_t i;
+
+    if (addrlen == 0 || addrlen >= sizeof(addr))
+        return -1;
+    memcpy(addr, str, addrlen);
+    addr[addrlen] = 0;
+
+    if (inet_pton(AF_INET, addr, buf) == 1) {
+        /* ::ffff:0:0/96 */
+        key[0] = 0;
+        key[1] = UINT64_C(0xffff) << 32;
+        for (i = 0; i < 4; i++)
+            key[1] |= (uint64_t)buf[i] << (24 - i * 8);
+        max = 32;
+    } else if (inet_pton(AF_INET6, addr, buf) == 1) {
+        key[0] = 0;
+        key[1] = 0;
+        for (i = 0; i < 8; i++) {
+            key[0] = (key[0] << 8) | buf[i];
+            key[1] = (key[1] << 8) | buf[i + 8];
+        }
+        max = 128;
+    } else {
+        return -1;
+    }
+
+    *len = max;
+    if (slash) {
+        char *end;
+        long val;
+
+        if (!slash[1])
+            return -1;
+        val = strtol(slash + 1, &end, 10);
+        if (*end || val < 0 || val > (long)max)
+            return -1;
+        *len = val;
+    }
+
+    if (max == 32)
+        *len += 96;
+
+    __key_mask(key, *len);
+
+    return 0;
+}
+
+static void __db_free(matchfile_db_t *db) {
+    if (!db)
+        return;
+
+    if (db->strings)
+        avl_tree_free(db->strings, __func_free);
+    free(db->nodes);
+    free(db);
+}
+
+/* returns the index of a new node or 0 if out of memory */
+static uint32_t __db_new_node(matchfile_db_t *db, const uint64_t key[2], unsigned int len, int terminal) {
+    matchfile_node_t *node;
+
+    if (db->nodes_len == db->nodes_alloc) {
+        size_t alloc = db->nodes_alloc ? db->nodes_alloc * 2 : 64;
+        matchfile_node_t *nodes;
+
+        if (alloc > UINT32_MAX)
+            return 0;
+        nodes = realloc(db->nodes, alloc * sizeof(*nodes));
+        if (!nodes)
+            return 0;
+        db->nodes = nodes;
+        db->nodes_alloc = alloc;
+    }
+
+    node = &(db->nodes[db->nodes_len]);
+    memset(node, 0, sizeof(*node));
+    node->key[0] = key[0];
+    node->key[1] = key[1];
+    node->len = len;
+    node->terminal = terminal;
+
+    return db->nodes_len++;
+}
+
+/* adds the prefix, nodes may move so they are only referred to by index */
+static int __db_insert(matchfile_db_t *db, const uint64_t key[2], unsigned int len) {
+    uint32_t idx = MATCHFILE_ROOT;
+
+    while (1) {
+        unsigned int nodelen = db->nodes[idx].len;
+        unsigned int branch, common;
+        uint32_t child, leaf, split;
+
+        /* a shorter prefix already covers it */
+        if (db->nodes[idx].terminal)
+            return 0;
+
+        if (len == nodelen) {
+            db->nodes[idx].terminal = 1;
+            /* anything below is covered now, but left as it is */
+            return 0;
+        }
+
+        branch = __key_bit(key, nodelen);
+        child = db->nodes[idx].child[branch];
+        if (!child) {
+            leaf = __db_new_node(db, key, len, 1);
+            if (!leaf)
+                return -1;
+            db->nodes[idx].child[branch] = leaf;
+            return 0;
+        }
+
+        common = __key_common(key, db->nodes[child].key, len < db->nodes[child].len ? len : db->nodes[child].len);
+        if (common == db->nodes[child].len) {
+            idx = child;
+            continue;
+        }
+
+        /* the new prefix or a new branch point goes between idx and child */
+        if (common == len) {
+            split = __db_new_node(db, key, len, 1);
+            if (!split)
+                return -1;
+        } else {
+            uint64_t splitkey[2];
+
+            splitkey[0] = key[0];
+            splitkey[1] = key[1];
+            __key_mask(splitkey, common);
+            split = __db_new_node(db, splitkey, common, 0);
+            if (!split)
+                return -1;
+            leaf = __db_new_node(db, key, len, 1);
+            if (!leaf)
+                return -1;
+            db->nodes[split].child[__key_bit(key, common)] = leaf;
+        }
+        db->nodes[split].child[__key_bit(db->nodes[child].key, common)] = child;
+        db->nodes[idx].child[branch] = split;
+        return 0;
+    }
+}
+
+static int __db_lookup(const matchfile_db_t *db, const uint64_t key[2]) {
+    uint32_t idx = MATCHFILE_ROOT;
+
+    while (idx) {
+        const matchfile_node_t *node = &(db->nodes[idx]);
+
+        if (!__key_match(key, node->key, node->len))
+            return 0;
+        if (node->terminal)
+            return 1;
+        if (node->len == 128)
+            return 0;
+        idx = node->child[__key_bit(key, node->len)];
+    }
+
+    return 0;
+}
+
+static matchfile_db_t *__db_load(FILE *input) {
+    static const uint64_t empty[2] = {0, 0};
+    matchfile_db_t *db = calloc(1, sizeof(*db));
+    char line[MAX_LINE_LEN];
+
+    if (!db)
+        return NULL;
+
+    db->strings = avl_tree_new(__func_compare, NULL);
+    /* the unused node 0 and the root */
+    if (!db->strings || __db_new_node(db, empty, 0, 0) != 0 || __db_new_node(db, empty, 0, 0) != MATCHFILE_ROOT) {
+        __db_free(db);
+        return NULL;
+    }
+
+    while (get_line(input, line, MAX_LINE_LEN)) {
+        uint64_t key[2];
+        unsigned int len;
+        char *str;
+
+        if(!line[0] || line[0] == '#')
+            continue;
+
+        if (__parse_prefix(line, key, &len) == 0) {
+            if (__db_insert(db, key, len) != 0) {
+                __db_free(db);
+                return NULL;
+            }
+            db->prefixes++;
+            continue;
+        }
+
+        str = strdup(line);
+        if (str)
+            avl_insert(db->strings, str);
+    }
+
+    return db;
+}
+
 static void __func_recheck(matchfile_t *file) {
     time_t now = time(NULL);
     struct stat file_stat;
     FILE *input = NULL;
-    avl_tree *new_contents;
-    char line[MAX_LINE_LEN];
+    matchfile_db_t *new_contents;
+    matchfile_db_t *old_contents;
 
     if (now < file->file_recheck)
         return;
 
+    thread_mutex_lock(&file->recheck_lock);
+    /* someone else was faster */
+    if (now < file->file_recheck) {
+        thread_mutex_unlock(&file->recheck_lock);
+        return;
+    }
+
     file->file_recheck = now + 10;
 
     if (stat(file->filename, &file_stat) < 0) {
         ICECAST_LOG_WARN("failed to check status of \"%s\": %s", file->filename, strerror(errno));
+        thread_mutex_unlock(&file->recheck_lock);
         return;
     }
 
-    if (file_stat.st_mtime == file->file_mtime)
+    if (file_stat.st_mtime == file->file_mtime) {
+        thread_mutex_unlock(&file->recheck_lock);
         return; /* common case, no update to file */
+    }
 
     file->file_mtime = file_stat.st_mtime;
 
     input = fopen(file->filename, "r");
     if (!input) {
         ICECAST_LOG_WARN("Failed to open file \"%s\": %s", file->filename, strerror(errno));
+        thread_mutex_unlock(&file->recheck_lock);
         return;
     }
 
-    new_contents = avl_tree_new(__func_compare, NULL);
-
-    while (get_line(input, line, MAX_LINE_LEN)) {
-        char *str;
+    new_contents = __db_load(input);
+    fclose(input);
 
-        if(!line[0] || line[0] == '#')
-            continue;
-        str = strdup(line);
-        if (str)
-            avl_insert(new_contents, str);
+    if (!new_contents) {
+        ICECAST_LOG_ERROR("Out of memory loading \"%s\", keeping the old entries", file->filename);
+        thread_mutex_unlock(&file->recheck_lock);
+        return;
     }
 
-    fclose(input);
+    ICECAST_LOG_DEBUG("Loaded %zu addresses and networks (%zu nodes) from \"%s\"", new_contents->prefixes, new_contents->nodes_len - MATCHFILE_ROOT, file->filename);
 
-    if (file->contents) avl_tree_free(file->contents, __func_free);
+    thread_rwlock_wlock(&file->contents_lock);
+    old_contents = file->contents;
     file->contents = new_contents;
+    thread_rwlock_unlock(&file->contents_lock);
+    thread_mutex_unlock(&file->recheck_lock);
+
+    __db_free(old_contents);
 }
 
 matchfile_t *matchfile_new(const char *filename) {
@@ -108,6 +415,8 @@ matchfile_t *matchfile_new(const char *filename) {
     ret->filename     = strdup(filename);
     ret->file_mtime   = 0;
     ret->file_recheck = 0;
+    thread_mutex_create(&ret->recheck_lock);
+    thread_rwlock_create(&ret->contents_lock);
 
     if (!ret->filename) {
         matchfile_release(ret);
@@ -138,8 +447,9 @@ int          matchfile_release(matchfile_t *file) {
     if (file->refcount)
         return 0;
 
-    if (file->contents)
-        avl_tree_free(file->contents, __func_free);
+    __db_free(file->contents);
+    thread_rwlock_destroy(&file->contents_lock);
+    thread_mutex_destroy(&file->recheck_lock);
     free(file->filename);
     free(file);
 
@@ -148,7 +458,10 @@ int          matchfile_release(matchfile_t *file) {
 
 /* we are not const char *key because of avl_get_by_key()... */
 int          matchfile_match(matchfile_t *file, const char *key) {
+    uint64_t addr[2];
+    unsigned int len;
     void *result;
+    int ret = 0;
 
     if (!file)
         return -1;
@@ -156,10 +469,36 @@ int          matchfile_match(matchfile_t *file, const char *key) {
     /* reload database if needed */
     __func_recheck(file);
 
-    if (!file->contents)
+    thread_rwlock_rlock(&file->contents_lock);
+    if (file->contents) {
+        if (file->contents->prefixes && __parse_prefix(key, addr, &len) == 0 && len == 128)
+            ret = __db_lookup(file->contents, addr);
+        if (!ret)
+            ret = avl_get_by_key(file->contents->strings, (void*)key, &result) == 0 ? 1 : 0;
+    }
+    thread_rwlock_unlock(&file->contents_lock);
+
+    return ret;
+}
+
+int          matchfile_prefix_parse(matchfile_prefix_t *prefix, const char *str) {
+    if (!prefix || !str)
+        return -1;
+
+    return __parse_prefix(str, prefix->key, &(prefix->len));
+}
+
+int          matchfile_prefix_match(const matchfile_prefix_t *prefix, const char *address) {
+    uint64_t addr[2];
+    unsigned int len;
+
+    if (!prefix || !address)
+        return 0;
+
+    if (__parse_prefix(address, addr, &len) != 0 || len != 128)
         return 0;
 
-    return avl_get_by_key(file->contents, (void*)key, &result) == 0 ? 1 : 0;
+    return __key_match(addr, prefix->key, prefix->len);
 }
 
 int          matchfile_match_allow_deny(matchfile_t *allow, matchfile_t *deny, const char *key) {
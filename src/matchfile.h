@@ -9,6 +9,8 @@
 #ifndef __MATCHFILE_H__
 #define __MATCHFILE_H__
 
+#include <stdint.h>
+
 struct matchfile_tag;
 typedef struct matchfile_tag matchfile_t;
 
@@ -20,4 +22,16 @@ int          matchfile_match(matchfile_t *file, const char *key);
 /* returns 1 for allow or pass and 0 for deny */
 int          matchfile_match_allow_deny(matchfile_t *allow, matchfile_t *deny, const char *key);
 
+/* An IPv4 or IPv6 address with a prefix length, IPv4 is kept as
+ * IPv4-mapped IPv6 so it also matches clients on dual stack sockets */
+typedef struct {
+    uint64_t key[2];
+    unsigned int len;
+} matchfile_prefix_t;
+
+/* parses an address with an optional /prefix length, returns 0 on success */
+int          matchfile_prefix_parse(matchfile_prefix_t *prefix, const char *str);
+/* returns 1 if address is within prefix and 0 if not or not an address */
+int          matchfile_prefix_match(const matchfile_prefix_t *prefix, const char *address);
+
 #endif  /* __MATCHFILE_H__ */
@@ -0,0 +1,318 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "memgov.h"
+#include "atomic.h"
+#include "cfgfile.h"
+#include "stats.h"
+#include "refbuf.h"
+#include "filecache.h"
+#include "xslt.h"
+
+#include "logging.h"
+#define CATMODULE "memgov"
+
+#define MEMGOV_CGROUP_ROOT  "/sys/fs/cgroup"
+/* percent below its threshold the usage must fall to leave a level */
+#define MEMGOV_HYSTERESIS   5
+/* caches shed in this order, one per check */
+#define MEMGOV_SHED_STEPS   4
+
+static int memgov_running = 0;
+/* directory of the cgroup v2 of the process, NULL if there is none */
+static char *memgov_cgroup;
+/* only the slave thread changes these */
+static volatile unsigned int memgov_level = MEMGOV_LEVEL_NORMAL;
+static volatile uint64_t memgov_used;
+static volatile uint64_t memgov_limit;
+static uint64_t memgov_reported_used;
+static unsigned int memgov_next_shed;
+
+static const char *memgov_level_names[] = {"normal", "shed", "reject"};
+
+/* reads a single number from a file, "max" and missing files count as none */
+static int memgov_read_u64(const char *dir, const char *name, uint64_t *value)
+{
+    char path[1024];
+    char buf[64];
+    FILE *file;
+    char *end;
+    int ret = -1;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    file = fopen(path, "r");
+    if (!file)
+        return -1;
+
+    if (fgets(buf, sizeof(buf), file) && strncmp(buf, "max", 3) != 0) {
+        *value = strtoull(buf, &end, 10);
+        if (end != buf)
+            ret = 0;
+    }
+    fclose(file);
+
+    return ret;
+}
+
+/* reads a field of a file like memory.stat, "name value" per line */
+static int memgov_read_stat(const char *dir, const char *file, const char *name, uint64_t *value)
+{
+    char path[1024];
+    char line[256];
+    size_t len = strlen(name);
+    FILE *stat;
+    int ret = -1;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    stat = fopen(path, "r");
+    if (!stat)
+        return -1;
+
+    while (ret != 0 && fgets(line, sizeof(line), stat)) {
+        char *end;
+
+        if (strncmp(line, name, len) != 0 || line[len] != ' ')
+            continue;
+        *value = strtoull(line + len + 1, &end, 10);
+        if (end != line + len + 1)
+            ret = 0;
+    }
+    fclose(stat);
+
+    return ret;
+}
+
+/* the unified hierarchy is listed as "0::/path" in /proc/self/cgroup */
+static char *memgov_find_cgroup(void)
+{
+    FILE *file = fopen("/proc/self/cgroup", "r");
+    char line[1024];
+    char *ret = NULL;
+
+    if (!file)
+        return NULL;
+
+    while (!ret && fgets(line, sizeof(line), file)) {
+        size_t len;
+
+        if (strncmp(line, "0::", 3) != 0)
+            continue;
+
+        len = strcspn(line + 3, "\r\n");
+        line[3 + len] = 0;
+        ret = malloc(strlen(MEMGOV_CGROUP_ROOT) + len + 1);
+        if (ret) {
+            strcpy(ret, MEMGOV_CGROUP_ROOT);
+            if (len > 1)
+                strcat(ret, line + 3);
+        }
+    }
+    fclose(file);
+
+    return ret;
+}
+
+static uint64_t memgov_get_rss(void)
+{
+    unsigned long long pages;
+    long pagesize;
+    FILE *file = fopen("/proc/self/statm", "r");
+    uint64_t ret = 0;
+
+    if (!file)
+        return 0;
+
+    pagesize = sysconf(_SC_PAGESIZE);
+    if (pagesize > 0 && fscanf(file, "%*u %llu", &pages) == 1)
+        ret = (uint64_t)pages * pagesize;
+    fclose(file);
+
+    return ret;
+}
+
+static memgov_level_t memgov_level_for(uint64_t used, uint64_t limit, memgov_level_t level, unsigned int shed, unsigned int reject)
+{
+    uint64_t percent = (used * 100) / limit;
+
+    if (percent >= reject || (level == MEMGOV_LEVEL_REJECT && percent + MEMGOV_HYSTERESIS >= reject))
+        return MEMGOV_LEVEL_REJECT;
+    if (percent >= shed || (level != MEMGOV_LEVEL_NORMAL && percent + MEMGOV_HYSTERESIS >= shed))
+        return MEMGOV_LEVEL_SHED;
+
+    return MEMGOV_LEVEL_NORMAL;
+}
+
+/* drops the next cache, the cheapest to rebuild first */
+static void memgov_shed_next(void)
+{
+    size_t count;
+
+    switch (memgov_next_shed) {
+        case 0:
+            xslt_clear_cache();
+            ICECAST_LOG_DEBUG("Dropped the XSLT caches");
+        break;
+        case 1:
+            count = filecache_clear();
+            ICECAST_LOG_DEBUG("Dropped %zu bytes of cached files", count);
+        break;
+        case 2:
+            count = stats_clear_snapshots();
+            ICECAST_LOG_DEBUG("Dropped %zu rendered stats", count);
+        break;
+        default:
+            count = refbuf_trim_pool();
+            ICECAST_LOG_DEBUG("Freed %zu bytes of pooled buffers", count);
+        break;
+    }
+
+    memgov_next_shed = (memgov_next_shed + 1) % MEMGOV_SHED_STEPS;
+    stats_global_inc(STATS_GLOBAL_MEMORY_SHEDS);
+}
+
+void memgov_initialize(void)
+{
+    if (memgov_running)
+        return;
+
+    memgov_cgroup = memgov_find_cgroup();
+    memgov_level = MEMGOV_LEVEL_NORMAL;
+    memgov_used = 0;
+    memgov_limit = 0;
+    memgov_reported_used = 0;
+    memgov_next_shed = 0;
+    memgov_running = 1;
+}
+
+void memgov_shutdown(void)
+{
+    if (!memgov_running)
+        return;
+
+    memgov_running = 0;
+    free(memgov_cgroup);
+    memgov_cgroup = NULL;
+    atomic_uint_store(&memgov_level, MEMGOV_LEVEL_NORMAL);
+}
+
+void memgov_check(void)
+{
+    ice_config_t *config;
+    uint64_t limit;
+    uint64_t used = 0;
+    unsigned int shed;
+    unsigned int reject;
+    memgov_level_t level;
+    memgov_level_t old = memgov_level;
+
+    if (!memgov_running)
+        return;
+
+    config = config_get_config();
+    limit = (uint64_t)config->memory_limit * 1024 * 1024;
+    shed = config->memory_shed_threshold;
+    reject = config->memory_reject_threshold;
+    config_release_config();
+
+    if (limit) {
+        used = memgov_get_rss();
+    } else if (memgov_cgroup &&
+            (memgov_read_u64(memgov_cgroup, "memory.high", &limit) == 0 ||
+             memgov_read_u64(memgov_cgroup, "memory.max", &limit) == 0)) {
+        uint64_t inactive;
+
+        if (memgov_read_u64(memgov_cgroup, "memory.current", &used) != 0) {
+            limit = 0;
+        } else if (memgov_read_stat(memgov_cgroup, "memory.stat", "inactive_file", &inactive) == 0) {
+            /* page cache the kernel takes back first, such as that of the
+             * logs, is no reason to shed anything */
+            used = inactive < used ? used - inactive : 0;
+        }
+    }
+
+    if (!limit || !used) {
+        if (memgov_limit) {
+            ICECAST_LOG_INFO("No memory limit to work against anymore");
+            atomic_u64_store(&memgov_limit, 0);
+            atomic_u64_store(&memgov_used, 0);
+            atomic_uint_store(&memgov_level, MEMGOV_LEVEL_NORMAL);
+            memgov_next_shed = 0;
+            memgov_reported_used = 0;
+            stats_event(NULL, "memory_limit", NULL);
+            stats_event(NULL, "memory_used", NULL);
+            stats_event(NULL, "memory_pressure", NULL);
+        }
+        return;
+    }
+
+    level = memgov_level_for(used, limit, old, shed, reject);
+    atomic_u64_store(&memgov_used, used);
+    atomic_uint_store(&memgov_level, level);
+
+    if (limit != memgov_limit) {
+        /* the pressure is published along with the first limit */
+        if (!memgov_limit && level == old)
+            stats_event(NULL, "memory_pressure", memgov_level_names[level]);
+        atomic_u64_store(&memgov_limit, limit);
+        stats_event_args(NULL, "memory_limit", "%" PRIu64, limit);
+    }
+    /* the stats are only touched on changes worth noting, every event
+     * outdates the rendered stats */
+    if (!memgov_reported_used || used > memgov_reported_used + limit / 100 || used + limit / 100 < memgov_reported_used) {
+        memgov_reported_used = used;
+        stats_event_args(NULL, "memory_used", "%" PRIu64, used);
+    }
+
+    if (level != old) {
+        ICECAST_LOG_INFO("Memory used is %" PRIu64 " of %" PRIu64 " bytes, pressure is %s now",
+                used, limit, memgov_level_names[level]);
+        stats_event(NULL, "memory_pressure", memgov_level_names[level]);
+        if (level == MEMGOV_LEVEL_NORMAL)
+            memgov_next_shed = 0;
+    }
+
+    if (level != MEMGOV_LEVEL_NORMAL)
+        memgov_shed_next();
+}
+
+memgov_level_t memgov_get_level(void)
+{
+    return atomic_uint_load(&memgov_level);
+}
+
+const char *memgov_level_to_string(memgov_level_t level)
+{
+    return memgov_level_names[level];
+}
+
+void memgov_get_usage(uint64_t *used, uint64_t *limit)
+{
+    *used = atomic_u64_load(&memgov_used);
+    *limit = atomic_u64_load(&memgov_limit);
+}
+
+int memgov_admit(void)
+{
+    if (memgov_get_level() != MEMGOV_LEVEL_REJECT)
+        return 0;
+
+    ICECAST_LOG_INFO("Memory is short, not adding another listener");
+    stats_global_inc(STATS_GLOBAL_LISTENERS_REJECTED_MEMORY);
+    return -1;
+}
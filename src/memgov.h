@@ -0,0 +1,49 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* memgov.h
+ *
+ * Keeps the memory the server uses below <memory-limit>, or the memory.high
+ * or memory.max of its cgroup if that is not set. Once every second the
+ * usage, the memory.current of the cgroup less its inactive page cache or
+ * else the resident set size, is checked against the limit. Above <memory-shed-threshold> percent one cache
+ * is dropped per check, the XSLT caches first, then the file cache, the
+ * rendered stats and the free buffers of the refbuf pool, authentication
+ * results are no longer cached and the bursts are cut down to burst-size.
+ * Above <memory-reject-threshold> percent the bursts are halved and new
+ * listeners are turned away as well. A level is left once the usage is 5
+ * percent below its threshold again.
+ */
+
+#ifndef __MEMGOV_H__
+#define __MEMGOV_H__
+
+#include <stdint.h>
+
+typedef enum {
+    MEMGOV_LEVEL_NORMAL = 0,
+    MEMGOV_LEVEL_SHED,
+    MEMGOV_LEVEL_REJECT
+} memgov_level_t;
+
+void            memgov_initialize(void);
+void            memgov_shutdown(void);
+
+/* Checks the usage and sheds the next cache if needed, called by the slave
+ * thread every second */
+void            memgov_check(void);
+
+/* The level of the last check, NORMAL if there is no limit */
+memgov_level_t  memgov_get_level(void);
+const char *    memgov_level_to_string(memgov_level_t level);
+/* The usage and limit in bytes of the last check, limit is 0 if there is
+ * none */
+void            memgov_get_usage(uint64_t *used, uint64_t *limit);
+
+/* Returns 0 if a new listener may be added, -1 if memory is too short */
+int             memgov_admit(void);
+
+#endif  /* __MEMGOV_H__ */
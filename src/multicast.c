@@ -0,0 +1,306 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <net/if.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+#include "common/timing/timing.h"
+
+#include "multicast.h"
+#include "atomic.h"
+#include "prng.h"
+
+#include "logging.h"
+#define CATMODULE "multicast"
+
+/* stream bytes per packet, 7 MPEG-TS packets, leaves room for the IP, UDP
+ * and RTP headers in an Ethernet frame */
+#define MULTICAST_PAYLOAD       1316
+/* packets sent in one go, enough for the largest pooled buffer */
+#define MULTICAST_BATCH         16
+#define MULTICAST_RTP_HEADER    12
+/* dynamic payload type, the receivers are told what the stream is by SDP
+ * or their configuration */
+#define MULTICAST_RTP_TYPE      96
+/* RTP clock of the timestamps */
+#define MULTICAST_RTP_CLOCK     90000
+
+struct multicast_tag {
+#ifndef _WIN32
+    int fd;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+#endif
+    int rtp;
+
+    uint16_t sequence;
+    uint32_t ssrc;
+    uint64_t start;
+
+    unsigned char header[MULTICAST_BATCH][MULTICAST_RTP_HEADER];
+#ifndef _WIN32
+    struct iovec iov[MULTICAST_BATCH][2];
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr msg[MULTICAST_BATCH];
+#else
+    struct msghdr msg[MULTICAST_BATCH];
+#endif
+#endif
+
+    volatile uint64_t sent;
+    volatile uint64_t dropped;
+};
+
+#ifndef _WIN32
+static int multicast_set_interface(multicast_t *self, const char *iface)
+{
+    if (self->addr.ss_family == AF_INET) {
+        struct in_addr local;
+
+        if (inet_pton(AF_INET, iface, &local) != 1) {
+            errno = EINVAL;
+            return -1;
+        }
+        return setsockopt(self->fd, IPPROTO_IP, IP_MULTICAST_IF, &local, sizeof(local));
+    } else {
+        unsigned int index = if_nametoindex(iface);
+
+        if (!index) {
+            errno = EINVAL;
+            return -1;
+        }
+        return setsockopt(self->fd, IPPROTO_IPV6, IPV6_MULTICAST_IF, &index, sizeof(index));
+    }
+}
+
+multicast_t *multicast_open(const char *group, unsigned int port, unsigned int ttl, const char *iface, int rtp)
+{
+    multicast_t *self;
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+    char service[16];
+    int hops = ttl;
+    int err;
+    int flags;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_NUMERICHOST|AI_NUMERICSERV;
+    snprintf(service, sizeof(service), "%u", port);
+    if (getaddrinfo(group, service, &hints, &res) != 0 || !res) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    self = calloc(1, sizeof(*self));
+    if (!self) {
+        freeaddrinfo(res);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    memcpy(&self->addr, res->ai_addr, res->ai_addrlen);
+    self->addr_len = res->ai_addrlen;
+    self->rtp = rtp;
+    self->fd = socket(res->ai_family, SOCK_DGRAM, 0);
+    freeaddrinfo(res);
+    if (self->fd < 0) {
+        err = errno;
+        goto fail;
+    }
+
+    if (self->addr.ss_family == AF_INET) {
+        unsigned char value = ttl;
+
+        if (setsockopt(self->fd, IPPROTO_IP, IP_MULTICAST_TTL, &value, sizeof(value)) != 0) {
+            err = errno;
+            goto fail;
+        }
+    } else if (setsockopt(self->fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &hops, sizeof(hops)) != 0) {
+        err = errno;
+        goto fail;
+    }
+
+    if (iface && multicast_set_interface(self, iface) != 0) {
+        err = errno;
+        goto fail;
+    }
+
+    flags = fcntl(self->fd, F_GETFL);
+    if (flags < 0 || fcntl(self->fd, F_SETFL, flags|O_NONBLOCK) != 0) {
+        err = errno;
+        goto fail;
+    }
+
+    if (prng_read(&self->ssrc, sizeof(self->ssrc)) != sizeof(self->ssrc))
+        self->ssrc = (uint32_t)timing_get_time() ^ (uint32_t)getpid();
+    self->sequence = self->ssrc >> 16;
+    self->start = timing_get_time();
+
+    ICECAST_LOG_DEBUG("Sending stream to %s port %u", group, port);
+
+    return self;
+
+fail:
+    if (self->fd >= 0)
+        close(self->fd);
+    free(self);
+    errno = err;
+    return NULL;
+}
+
+static inline void multicast_put_u16(unsigned char *p, uint16_t value)
+{
+    p[0] = value >> 8;
+    p[1] = value;
+}
+
+static inline void multicast_put_u32(unsigned char *p, uint32_t value)
+{
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+void multicast_write(multicast_t *self, refbuf_t *refbuf)
+{
+    uint32_t timestamp;
+    size_t offset = 0;
+    size_t count = 0;
+    size_t sent = 0;
+
+    if (!self || !refbuf->len)
+        return;
+
+    /* all packets of a buffer have the time it was queued at */
+    timestamp = (timing_get_time() - self->start) * (MULTICAST_RTP_CLOCK / 1000);
+
+    while (offset < refbuf->len) {
+        size_t len = refbuf->len - offset;
+        struct msghdr *msg;
+        struct iovec *iov = self->iov[count];
+        int parts = 0;
+
+        if (len > MULTICAST_PAYLOAD)
+            len = MULTICAST_PAYLOAD;
+
+        if (self->rtp) {
+            unsigned char *header = self->header[count];
+
+            header[0] = 0x80;
+            header[1] = MULTICAST_RTP_TYPE;
+            multicast_put_u16(header + 2, self->sequence++);
+            multicast_put_u32(header + 4, timestamp);
+            multicast_put_u32(header + 8, self->ssrc);
+            iov[parts].iov_base = header;
+            iov[parts].iov_len = MULTICAST_RTP_HEADER;
+            parts++;
+        }
+        iov[parts].iov_base = refbuf->data + offset;
+        iov[parts].iov_len = len;
+        parts++;
+
+#ifdef HAVE_SENDMMSG
+        msg = &(self->msg[count].msg_hdr);
+#else
+        msg = &(self->msg[count]);
+#endif
+        memset(msg, 0, sizeof(*msg));
+        msg->msg_name = &self->addr;
+        msg->msg_namelen = self->addr_len;
+        msg->msg_iov = iov;
+        msg->msg_iovlen = parts;
+
+        offset += len;
+        count++;
+
+        if (count == MULTICAST_BATCH || offset == refbuf->len) {
+#ifdef HAVE_SENDMMSG
+            int ret = sendmmsg(self->fd, self->msg, count, 0);
+
+            if (ret > 0)
+                sent += ret;
+            if (ret < (int)count)
+                atomic_u64_add(&self->dropped, count - (ret > 0 ? ret : 0));
+#else
+            size_t i;
+
+            for (i = 0; i < count; i++) {
+                if (sendmsg(self->fd, &(self->msg[i]), 0) < 0) {
+                    atomic_u64_add(&self->dropped, count - i);
+                    break;
+                }
+                sent++;
+            }
+#endif
+            count = 0;
+        }
+    }
+
+    atomic_u64_add(&self->sent, sent);
+}
+
+void multicast_close(multicast_t *self)
+{
+    if (!self)
+        return;
+
+    close(self->fd);
+    free(self);
+}
+#else
+multicast_t *multicast_open(const char *group, unsigned int port, unsigned int ttl, const char *iface, int rtp)
+{
+    (void)group;
+    (void)port;
+    (void)ttl;
+    (void)iface;
+    (void)rtp;
+    errno = ENOSYS;
+    return NULL;
+}
+
+void multicast_write(multicast_t *self, refbuf_t *refbuf)
+{
+    (void)self;
+    (void)refbuf;
+}
+
+void multicast_close(multicast_t *self)
+{
+    free(self);
+}
+#endif
+
+uint64_t multicast_get_sent(multicast_t *self)
+{
+    return self ? atomic_u64_load(&self->sent) : 0;
+}
+
+uint64_t multicast_get_dropped(multicast_t *self)
+{
+    return self ? atomic_u64_load(&self->dropped) : 0;
+}
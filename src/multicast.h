@@ -0,0 +1,38 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* multicast.h
+ *
+ * Sends the stream of a source to a UDP multicast group, so any number of
+ * receivers in the LAN cost one send per packet. The source thread passes
+ * every queued buffer, which is cut into packets that fit into an Ethernet
+ * frame. Packets are RTP with a dynamic payload type by default, which gives
+ * receivers sequence numbers to detect loss, or the plain stream data. The
+ * socket does not block, packets that do not fit into its buffer are
+ * dropped and counted.
+ */
+
+#ifndef __MULTICAST_H__
+#define __MULTICAST_H__
+
+#include <stdint.h>
+
+#include "refbuf.h"
+
+typedef struct multicast_tag multicast_t;
+
+/* Sets up sending to group and port with the given TTL, from the local
+ * address or interface name iface if not NULL. Returns NULL on error with
+ * errno set. */
+multicast_t *multicast_open(const char *group, unsigned int port, unsigned int ttl, const char *iface, int rtp);
+/* Sends a queued buffer. Only called by the source thread. */
+void         multicast_write(multicast_t *self, refbuf_t *refbuf);
+/* number of packets sent and dropped */
+uint64_t     multicast_get_sent(multicast_t *self);
+uint64_t     multicast_get_dropped(multicast_t *self);
+void         multicast_close(multicast_t *self);
+
+#endif  /* __MULTICAST_H__ */
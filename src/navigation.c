@@ -10,19 +10,40 @@
 #include <config.h>
 #endif
 
-#include "common/avl/avl.h"
+#include <stdbool.h>
+
+#include "common/thread/thread.h"
 
 #include "navigation.h"
+#include "util.h"
 
 #include "logging.h"
 #define CATMODULE "navigation"
 
+/* number of chains of the table of identifiers, a power of two */
+#define MOUNT_IDENTIFIER_BUCKETS    256
+
 struct mount_identifier_tag {
     /* base object */
     refobject_base_t __base;
+
+    uint32_t hash;
+    /* next identifier in the same chain of the table */
+    mount_identifier_t *next;
 };
 
-REFOBJECT_DEFINE_TYPE(mount_identifier_t);
+static void mount_identifier_free(refobject_t self, void **userdata);
+
+REFOBJECT_DEFINE_TYPE(mount_identifier_t,
+        REFOBJECT_DEFINE_TYPE_FREE(mount_identifier_free)
+        );
+
+/* Every identifier that is alive, so there is only one per mount.
+ * The table holds no reference, identifiers remove themselves on free.
+ */
+static mutex_t mount_identifier_lock;
+static bool mount_identifier_table_initialized;
+static mount_identifier_t *mount_identifier_table[MOUNT_IDENTIFIER_BUCKETS];
 
 const char * navigation_direction_to_str(navigation_direction_t dir)
 {
@@ -58,6 +79,10 @@ static int mount_identifier_compare__for_tree(void *compare_arg, void *a, void *
 {
     const char *id_a, *id_b;
 
+    /* there is only one identifier per mount */
+    if (a == b)
+        return 0;
+
     id_a = mount_identifier_get_mount(a);
     id_b = mount_identifier_get_mount(b);
 
@@ -68,29 +93,92 @@ static int mount_identifier_compare__for_tree(void *compare_arg, void *a, void *
     }
 }
 
+static void mount_identifier_free(refobject_t self, void **userdata)
+{
+    mount_identifier_t *identifier = REFOBJECT_TO_TYPE(self, mount_identifier_t *);
+    mount_identifier_t **p;
+
+    (void)userdata;
+
+    if (!mount_identifier_table_initialized)
+        return;
+
+    thread_mutex_lock(&mount_identifier_lock);
+    for (p = &(mount_identifier_table[identifier->hash % MOUNT_IDENTIFIER_BUCKETS]); *p; p = &((*p)->next)) {
+        if (*p == identifier) {
+            *p = identifier->next;
+            break;
+        }
+    }
+    thread_mutex_unlock(&mount_identifier_lock);
+}
+
 void navigation_initialize(void)
 {
+    thread_mutex_create(&mount_identifier_lock);
+    mount_identifier_table_initialized = true;
 }
 
 void navigation_shutdown(void)
 {
+    size_t i;
+
+    /* identifiers still referenced are unlinked, they free themselves later */
+    thread_mutex_lock(&mount_identifier_lock);
+    mount_identifier_table_initialized = false;
+    for (i = 0; i < MOUNT_IDENTIFIER_BUCKETS; i++)
+        mount_identifier_table[i] = NULL;
+    thread_mutex_unlock(&mount_identifier_lock);
+    thread_mutex_destroy(&mount_identifier_lock);
 }
 
-
 mount_identifier_t * mount_identifier_new(const char *mount)
 {
     mount_identifier_t *n;
+    uint32_t hash;
+    size_t bucket;
 
     if (!mount)
         return NULL;
 
+    hash = util_hash_string(mount);
+    bucket = hash % MOUNT_IDENTIFIER_BUCKETS;
+
+    if (!mount_identifier_table_initialized) {
+        n = refobject_new__new(mount_identifier_t, NULL, mount, NULL);
+        if (n)
+            n->hash = hash;
+        return n;
+    }
+
+    thread_mutex_lock(&mount_identifier_lock);
+    for (n = mount_identifier_table[bucket]; n; n = n->next) {
+        /* one that is being freed is skipped, it is replaced below */
+        if (n->hash == hash && strcmp(mount_identifier_get_mount(n), mount) == 0 && refobject_try_ref(n) == 0) {
+            thread_mutex_unlock(&mount_identifier_lock);
+            return n;
+        }
+    }
+
     n = refobject_new__new(mount_identifier_t, NULL, mount, NULL);
-    if (!n)
-        return NULL;
+    if (n) {
+        n->hash = hash;
+        n->next = mount_identifier_table[bucket];
+        mount_identifier_table[bucket] = n;
+    }
+    thread_mutex_unlock(&mount_identifier_lock);
 
     return n;
 }
 
+uint32_t                mount_identifier_get_hash(mount_identifier_t *identifier)
+{
+    if (!identifier)
+        return 0;
+
+    return identifier->hash;
+}
+
 int                     mount_identifier_compare(mount_identifier_t *a, mount_identifier_t *b)
 {
     return mount_identifier_compare__for_tree(NULL, a, b);
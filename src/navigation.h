@@ -10,6 +10,7 @@
 #define __NAVIGATION_H__
 
 #include <string.h>
+#include <stdint.h>
 
 #include "refobject.h"
 
@@ -35,8 +36,14 @@ navigation_direction_t navigation_str_to_direction(const char *str, navigation_d
 void navigation_initialize(void);
 void navigation_shutdown(void);
 
+/* Identifiers are interned: while one for a mount is alive, mount_identifier_new()
+ * returns a new reference to it. So two identifiers are for the same mount
+ * exactly if they are the same pointer.
+ */
 mount_identifier_t *    mount_identifier_new(const char *mount);
 #define mount_identifier_get_mount(identifier)  refobject_get_name((identifier))
+/* the hash of the mount as by util_hash_string(), computed once */
+uint32_t                mount_identifier_get_hash(mount_identifier_t *identifier);
 int                     mount_identifier_compare(mount_identifier_t *a, mount_identifier_t *b);
 
 #define navigation_history_init(history) memset((history), 0, sizeof(navigation_history_t))
@@ -0,0 +1,205 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "objpool.h"
+
+#include "logging.h"
+#define CATMODULE "objpool"
+
+/* objects held by a single thread */
+#define OBJPOOL_CACHE_MAX   32
+/* objects moved between thread cache and global list in one go */
+#define OBJPOOL_CACHE_BATCH 8
+/* objects held by the global list */
+#define OBJPOOL_POOL_MAX    1024
+
+/* released objects are linked through their first bytes */
+typedef struct objpool_free_tag {
+    struct objpool_free_tag *next;
+} objpool_free_t;
+
+typedef struct {
+    objpool_t *pool;
+    objpool_free_t *head;
+    size_t count;
+} objpool_cache_t;
+
+/* moves count objects of the cache into the global list, objects the
+ * global list can not take anymore are freed */
+static void objpool_cache_spill(objpool_cache_t *cache, size_t count)
+{
+    objpool_t *pool = cache->pool;
+    objpool_free_t *to_free = NULL;
+
+    thread_spin_lock(&pool->lock);
+    while (count && cache->head) {
+        objpool_free_t *obj = cache->head;
+
+        cache->head = obj->next;
+        cache->count--;
+        count--;
+
+        if (pool->running && pool->count < OBJPOOL_POOL_MAX) {
+            obj->next = pool->head;
+            pool->head = obj;
+            pool->count++;
+        } else {
+            obj->next = to_free;
+            to_free = obj;
+        }
+    }
+    thread_spin_unlock(&pool->lock);
+
+    while (to_free) {
+        objpool_free_t *obj = to_free;
+        to_free = obj->next;
+        free(obj);
+    }
+}
+
+static void objpool_cache_refill(objpool_cache_t *cache)
+{
+    objpool_t *pool = cache->pool;
+    size_t count = OBJPOOL_CACHE_BATCH;
+
+    thread_spin_lock(&pool->lock);
+    while (count && pool->head) {
+        objpool_free_t *obj = pool->head;
+
+        pool->head = obj->next;
+        pool->count--;
+        count--;
+
+        obj->next = cache->head;
+        cache->head = obj;
+        cache->count++;
+    }
+    thread_spin_unlock(&pool->lock);
+}
+
+/* called by pthread on thread exit */
+static void objpool_cache_free(void *arg)
+{
+    objpool_cache_t *cache = arg;
+
+    objpool_cache_spill(cache, cache->count);
+    free(cache);
+}
+
+static objpool_cache_t *objpool_cache_get(objpool_t *pool)
+{
+    objpool_cache_t *cache;
+
+    if (!pool->running)
+        return NULL;
+
+    cache = pthread_getspecific(pool->key);
+    if (!cache) {
+        cache = calloc(1, sizeof(*cache));
+        if (!cache)
+            return NULL;
+        cache->pool = pool;
+        if (pthread_setspecific(pool->key, cache) != 0) {
+            free(cache);
+            return NULL;
+        }
+    }
+
+    return cache;
+}
+
+void objpool_initialize(objpool_t *pool, size_t size)
+{
+    memset(pool, 0, sizeof(*pool));
+    pool->size = size < sizeof(objpool_free_t) ? sizeof(objpool_free_t) : size;
+
+    if (pthread_key_create(&pool->key, objpool_cache_free) != 0) {
+        ICECAST_LOG_ERROR("Can not create thread key, object pool disabled");
+        return;
+    }
+
+    thread_spin_create(&pool->lock);
+    pool->running = 1;
+}
+
+void objpool_shutdown(objpool_t *pool)
+{
+    objpool_cache_t *cache;
+
+    if (!pool->running)
+        return;
+
+    /* the calling thread's cache is not released by pthread */
+    cache = pthread_getspecific(pool->key);
+    if (cache) {
+        pthread_setspecific(pool->key, NULL);
+        objpool_cache_free(cache);
+    }
+
+    /* objects still released by other threads from now on go to free() */
+    thread_spin_lock(&pool->lock);
+    pool->running = 0;
+    thread_spin_unlock(&pool->lock);
+
+    while (pool->head) {
+        objpool_free_t *obj = pool->head;
+        pool->head = obj->next;
+        free(obj);
+    }
+    pool->count = 0;
+
+    /* other threads may still hold their cache, so we keep the spinlock and
+     * the thread key around. */
+}
+
+void *objpool_alloc(objpool_t *pool)
+{
+    objpool_cache_t *cache = objpool_cache_get(pool);
+    objpool_free_t *obj = NULL;
+
+    if (cache) {
+        if (!cache->head)
+            objpool_cache_refill(cache);
+
+        if (cache->head) {
+            obj = cache->head;
+            cache->head = obj->next;
+            cache->count--;
+            memset(obj, 0, pool->size);
+            return obj;
+        }
+    }
+
+    return calloc(1, pool->size);
+}
+
+void objpool_release(objpool_t *pool, void *obj)
+{
+    objpool_cache_t *cache;
+    objpool_free_t *entry = obj;
+
+    if (!obj)
+        return;
+
+    cache = objpool_cache_get(pool);
+    if (!cache) {
+        free(obj);
+        return;
+    }
+
+    entry->next = cache->head;
+    cache->head = entry;
+    cache->count++;
+    if (cache->count > OBJPOOL_CACHE_MAX)
+        objpool_cache_spill(cache, OBJPOOL_CACHE_BATCH);
+}
@@ -0,0 +1,47 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* objpool.h
+ *
+ * Keeps released objects of one fixed size for reuse, so objects that come
+ * and go with every request, such as connections and clients, do not hit
+ * malloc() each time. As with the refbuf pool every thread has a small cache
+ * used without any locking, which exchanges batches of objects with a global
+ * list of limited size.
+ */
+
+#ifndef __OBJPOOL_H__
+#define __OBJPOOL_H__
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "common/thread/thread.h"
+
+/* Pools are meant to be static, the thread caches refer to them until the
+ * threads exit. The members are private to objpool.c. */
+typedef struct {
+    size_t size;
+    int running;
+    spin_t lock;
+    pthread_key_t key;
+    /* global list, protected by lock */
+    void *head;
+    size_t count;
+} objpool_t;
+
+/* Sets up pool for objects of size bytes. If this fails objects are simply
+ * allocated and freed. */
+void    objpool_initialize(objpool_t *pool, size_t size);
+/* Frees the objects held. Objects released afterwards are freed. */
+void    objpool_shutdown(objpool_t *pool);
+
+/* Returns a zeroed object or NULL if out of memory. */
+void   *objpool_alloc(objpool_t *pool);
+/* Gives obj, which came from objpool_alloc() on the same pool, back. */
+void    objpool_release(objpool_t *pool, void *obj);
+
+#endif  /* __OBJPOOL_H__ */
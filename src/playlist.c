@@ -32,6 +32,10 @@ struct playlist_tag {
     size_t refc;
     ssize_t max_tracks;
     playlist_track_t *first;
+    playlist_track_t *last;
+    size_t tracks;
+    /* result of the last playlist_render_xspf(), dropped by playlist_push_track() */
+    xmlNodePtr rendered;
 };
 
 struct playlist_track_tag {
@@ -99,6 +103,9 @@ int          playlist_release(playlist_t *playlist)
         __free_track(track);
     }
 
+    if (playlist->rendered)
+        xmlFreeNode(playlist->rendered);
+
     free(playlist);
     return 0;
 }
@@ -114,8 +121,7 @@ int          playlist_set_max_tracks(playlist_t *playlist, ssize_t max_tracks)
 
 int          playlist_push_track(playlist_t *playlist, vorbis_comment *vc)
 {
-    playlist_track_t *track, **cur;
-    ssize_t num = 0;
+    playlist_track_t *track;
 
     if (!playlist)
         return -1;
@@ -124,20 +130,24 @@ int          playlist_push_track(playlist_t *playlist, vorbis_comment *vc)
     if (!track)
         return -1;
 
-    cur = &playlist->first;
-    while (*cur) {
-        cur = &(*cur)->next;
-        num++;
+    if (playlist->last) {
+        playlist->last->next = track;
+    } else {
+        playlist->first = track;
     }
-    *cur = track;
+    playlist->last = track;
+    playlist->tracks++;
 
-    num++; /* the extra track we just inserted */
-
-    while (playlist->max_tracks > 0 && num > playlist->max_tracks) {
+    while (playlist->max_tracks > 0 && playlist->tracks > (size_t)playlist->max_tracks) {
         playlist_track_t *to_free = playlist->first;
         playlist->first = to_free->next;
         __free_track(to_free);
-        num--;
+        playlist->tracks--;
+    }
+
+    if (playlist->rendered) {
+        xmlFreeNode(playlist->rendered);
+        playlist->rendered = NULL;
     }
 
     if (vc) {
@@ -163,6 +173,9 @@ xmlNodePtr   playlist_render_xspf(playlist_t *playlist)
     if (!playlist)
         return NULL;
 
+    if (playlist->rendered)
+        return xmlCopyNode(playlist->rendered, 1);
+
     rootnode = xmlNewNode(NULL, XMLSTR("playlist"));
     xmlSetProp(rootnode, XMLSTR("version"), XMLSTR("1"));
     xmlSetProp(rootnode, XMLSTR("xmlns"), XMLSTR(XMLNS_XSPF));
@@ -186,5 +199,8 @@ xmlNodePtr   playlist_render_xspf(playlist_t *playlist)
         track = track->next;
     }
 
+    /* keep a copy for the following requests until the next track is pushed */
+    playlist->rendered = xmlCopyNode(rootnode, 1);
+
     return rootnode;
 }
@@ -18,6 +18,8 @@
 #include <fcntl.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
 
 #ifdef HAVE_UNAME
 #include <sys/utsname.h>
@@ -34,6 +36,7 @@
 #include "prng.h"
 #include "digest.h"
 #include "cfgfile.h"
+#include "atomic.h"
 
 #include "logging.h"
 #define CATMODULE "prng"
@@ -43,12 +46,30 @@
 #define SEEDING_FACTOR              128
 #define SEEDING_MAX_BEFORE_RESEED   32768
 
+/* Bytes a thread's stream may return before it is seeded again from the pool */
+#define STREAM_MAX_BEFORE_RESEED    65536
+
+/* Per thread stream of random bytes, seeded from the global pool.
+ * Reading from it does not take any lock.
+ */
+typedef struct {
+    digest_t *digest;
+    size_t before_reseed;
+    unsigned int generation;
+} prng_stream_t;
+
 static int initialized = 0;
 static mutex_t digest_a_lock;
 static mutex_t digest_b_lock;
 static digest_t * digest_a; // protected by digest_a_lock
 static digest_t * digest_b; // protected by digest_b_lock
 static size_t before_reseed; // protected by digest_a_lock
+static pthread_key_t stream_key;
+static int stream_key_valid = 0;
+/* changed by prng_write() so streams pick up new entropy */
+static volatile unsigned int seed_generation;
+
+static ssize_t prng_read_pool(void *buffer, size_t len);
 
 static void prng_initial_seed(void)
 {
@@ -103,7 +124,7 @@ static void prng_cross_seed(void)
     } else {
         ERR_get_error(); // clear error
     }
-    len = prng_read(buffer, sizeof(buffer));
+    len = prng_read_pool(buffer, sizeof(buffer));
     if (len > 0)
         RAND_add(buffer, len, len/10.);
 #endif
@@ -141,11 +162,27 @@ static void prng_read_seeds(prng_seed_config_t *seed, int configure_time)
     }
 }
 
+static void prng_stream_free(void *arg)
+{
+    prng_stream_t *stream = arg;
+
+    refobject_unref(stream->digest);
+    free(stream);
+}
+
 void prng_initialize(void)
 {
     if (initialized)
         return;
 
+    if (!stream_key_valid) {
+        if (pthread_key_create(&stream_key, prng_stream_free) == 0) {
+            stream_key_valid = 1;
+        } else {
+            ICECAST_LOG_ERROR("Can not create thread key, all random data is read from the global pool");
+        }
+    }
+
     thread_mutex_create(&digest_a_lock);
     thread_mutex_create(&digest_b_lock);
     digest_a = digest_new(DIGEST_ALGO_SHA3_512);
@@ -157,9 +194,22 @@ void prng_initialize(void)
 
 void prng_shutdown(void)
 {
+    prng_stream_t *stream;
+
     if (!initialized)
         return;
 
+    /* the main thread's stream is not released by pthread */
+    if (stream_key_valid) {
+        stream = pthread_getspecific(stream_key);
+        if (stream) {
+            pthread_setspecific(stream_key, NULL);
+            prng_stream_free(stream);
+        }
+    }
+
+    /* other threads may still hold their stream, so we keep the thread key around. */
+
     refobject_unref(digest_b);
     refobject_unref(digest_a);
     thread_mutex_destroy(&digest_b_lock);
@@ -230,6 +280,8 @@ void prng_write(const void *buffer, size_t len)
     if (before_reseed > SEEDING_MAX_BEFORE_RESEED)
         before_reseed = SEEDING_MAX_BEFORE_RESEED;
     thread_mutex_unlock(&digest_a_lock);
+
+    atomic_uint_add(&seed_generation, 1);
 }
 
 static ssize_t prng_read_block(void *froma, void *buffer, size_t len)
@@ -254,7 +306,7 @@ static ssize_t prng_read_block(void *froma, void *buffer, size_t len)
     return len;
 }
 
-ssize_t prng_read(void *buffer, size_t len)
+static ssize_t prng_read_pool(void *buffer, size_t len)
 {
     digest_t *copy;
     char froma[BLOCK_LENGTH];
@@ -296,6 +348,109 @@ ssize_t prng_read(void *buffer, size_t len)
     return ret;
 }
 
+static prng_stream_t *prng_stream_get(void)
+{
+    prng_stream_t *stream;
+    char seed[BLOCK_LENGTH];
+    unsigned int generation;
+    digest_t *digest;
+
+    if (!stream_key_valid)
+        return NULL;
+
+    stream = pthread_getspecific(stream_key);
+    if (!stream) {
+        stream = calloc(1, sizeof(*stream));
+        if (!stream)
+            return NULL;
+        if (pthread_setspecific(stream_key, stream) != 0) {
+            free(stream);
+            return NULL;
+        }
+    }
+
+    generation = atomic_uint_load(&seed_generation);
+    if (stream->digest && stream->before_reseed && stream->generation == generation)
+        return stream;
+
+    if (prng_read_pool(seed, sizeof(seed)) != sizeof(seed))
+        return stream->digest ? stream : NULL;
+
+    digest = digest_new(DIGEST_ALGO_SHA3_512);
+    if (!digest)
+        return stream->digest ? stream : NULL;
+
+    /* keep what was left of the old state */
+    if (stream->digest) {
+        char old[BLOCK_LENGTH];
+
+        if (digest_read(stream->digest, old, sizeof(old)) == sizeof(old))
+            digest_write(digest, old, sizeof(old));
+        refobject_unref(stream->digest);
+    }
+
+    digest_write(digest, seed, sizeof(seed));
+    stream->digest = digest;
+    stream->before_reseed = STREAM_MAX_BEFORE_RESEED;
+    stream->generation = generation;
+
+    return stream;
+}
+
+static ssize_t prng_stream_read_block(prng_stream_t *stream, void *buffer, size_t len)
+{
+    char block[BLOCK_LENGTH];
+
+    if (digest_read(stream->digest, block, sizeof(block)) != sizeof(block))
+        return -1;
+
+    /* The first half is returned and the second half becomes the new state,
+     * so nothing of the state can be learned from the output. */
+    refobject_unref(stream->digest);
+    stream->digest = digest_new(DIGEST_ALGO_SHA3_512);
+    if (!stream->digest)
+        return -1;
+    digest_write(stream->digest, block + BLOCK_LENGTH/2, BLOCK_LENGTH/2);
+
+    if (len > BLOCK_LENGTH/2)
+        len = BLOCK_LENGTH/2;
+
+    memcpy(buffer, block, len);
+
+    return len;
+}
+
+ssize_t prng_read(void *buffer, size_t len)
+{
+    prng_stream_t *stream;
+    size_t ret = 0;
+    ssize_t res;
+
+    if (!initialized)
+        return -1;
+
+    stream = prng_stream_get();
+    if (!stream)
+        return prng_read_pool(buffer, len);
+
+    digest_write(stream->digest, &len, sizeof(len));
+
+    while (ret < len) {
+        res = prng_stream_read_block(stream, buffer + ret, len - ret);
+        if (res < 0)
+            return -1;
+        ret += res;
+    }
+
+    if (stream->before_reseed > len) {
+        stream->before_reseed -= len;
+    } else {
+        stream->before_reseed = 0;
+    }
+
+    return ret;
+}
+
 int prng_write_file(const char *filename, ssize_t len)
 {
     char buffer[BLOCK_LENGTH*16];
@@ -23,48 +23,584 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "common/thread/thread.h"
 
 #include "refbuf.h"
+#include "affinity.h"
+#include "atomic.h"
 
 #define CATMODULE "refbuf"
 
 #include "logging.h"
 
+/* Buffers are allocated with the header and the data in one block. Blocks
+ * up to the largest size class are kept on free lists after release so
+ * that the common case does not hit malloc() at all.
+ *
+ * Every thread has a small cache per size class which is used without any
+ * locking. If a cache runs empty or grows too large it exchanges a batch
+ * of buffers with the global free list. The global list is limited in size
+ * to give memory back to the system after bursts.
+ *
+ * With threads pinned to CPUs there is a global list for each NUMA node.
+ * A thread's cache belongs to the node it runs on and only takes buffers of
+ * that node, so listener workers send from memory local to them. Buffers
+ * released on another node go straight back to the list of their own node.
+ *
+ * With <huge-pages> the blocks of the larger size classes, which hold the
+ * stream data, are carved from slabs of 2 MB backed by huge pages, from
+ * hugetlbfs if pages are reserved there or else by transparent huge pages.
+ * Each thread carves from a slab of its own, so the buffers a source queues
+ * one after the other lie next to each other. When a thread ends, what is
+ * left of its slab goes to a list of its node and is carved from by the
+ * next thread needing a slab there. Such blocks can not be freed one by
+ * one, they stay on the free lists beyond their limit instead and the slabs
+ * are kept until the process ends, so they are bound by the most memory
+ * the stream buffers ever took.
+ */
+
+#define REFBUF_POOL_CLASSES         9
+/* buffers per size class held by a single thread */
+#define REFBUF_CACHE_MAX            64
+/* buffers moved between thread cache and global list in one go */
+#define REFBUF_CACHE_BATCH          16
+/* upper limit for the memory held by the global list of one size class */
+#define REFBUF_POOL_MAX_BYTES       (4*1024*1024)
+/* NUMA nodes with a global list of their own, higher ones share them */
+#define REFBUF_POOL_NODES           8
+#if !defined(_WIN32) && defined(MADV_HUGEPAGE)
+#define REFBUF_HAVE_HUGE_PAGES
+#endif
+#define REFBUF_HUGE_SLAB_SIZE       (2*1024*1024)
+/* size classes from this one on come from the huge page slabs */
+#define REFBUF_HUGE_MIN_CLASS       5
+
+static const unsigned int refbuf_pool_size[REFBUF_POOL_CLASSES] = {
+    128, 256, 512, 1024, 1536, 2048, 4096, 8192, 16384
+};
+
+typedef struct {
+    refbuf_t *head;
+    size_t count;
+} refbuf_freelist_t;
+
+/* the rest of a slab of a thread that ended, kept at its start */
+typedef struct refbuf_slab_rest_tag {
+    struct refbuf_slab_rest_tag *next;
+    char *end;
+} refbuf_slab_rest_t;
+
+typedef struct {
+    refbuf_freelist_t list[REFBUF_POOL_CLASSES];
+    int node;
+    uint64_t hits;
+    uint64_t misses;
+    /* rest of the huge page slab of this thread */
+    char *slab_pos;
+    char *slab_end;
+} refbuf_cache_t;
+
+static int refbuf_pool_running = 0;
+static spin_t refbuf_pool_lock;
+static pthread_key_t refbuf_cache_key;
+static refbuf_freelist_t refbuf_pool[REFBUF_POOL_NODES][REFBUF_POOL_CLASSES];
+static uint64_t refbuf_pool_hits;
+static uint64_t refbuf_pool_misses;
+static volatile unsigned int refbuf_huge_enabled = 0;
+/* slabs mapped and those of them from hugetlbfs, and the rests of slabs per
+ * node, protected by refbuf_pool_lock */
+static size_t refbuf_huge_slabs;
+static size_t refbuf_huge_slabs_hugetlb;
+static refbuf_slab_rest_t *refbuf_slab_rests[REFBUF_POOL_NODES];
+
+static inline int refbuf_pool_class(unsigned int size)
+{
+    int i;
+
+    for (i = 0; i < REFBUF_POOL_CLASSES; i++)
+        if (size <= refbuf_pool_size[i])
+            return i;
+
+    return -1;
+}
+
+static inline size_t refbuf_pool_limit(int pool)
+{
+    size_t limit = REFBUF_POOL_MAX_BYTES / refbuf_pool_size[pool];
+
+    return limit < REFBUF_CACHE_MAX ? REFBUF_CACHE_MAX : limit;
+}
+
+/* blocks from a huge page slab stay with it */
+static inline void refbuf_pool_discard(refbuf_t *refbuf)
+{
+    if (!refbuf->_huge)
+        free(refbuf);
+}
+
+static inline void refbuf_free_block(refbuf_t *self)
+{
+    if (self->data != (char *)(self + 1))
+        free(self->data);
+    refbuf_pool_discard(self);
+}
+
+/* puts the buffer on the global list of its node, returns 0 if that list
+ * can not take it anymore. Must be called with refbuf_pool_lock held.
+ */
+static inline int refbuf_pool_push(refbuf_t *refbuf)
+{
+    refbuf_freelist_t *global = &(refbuf_pool[refbuf->_node][refbuf->_pool]);
+
+    if (!refbuf_pool_running || (global->count >= refbuf_pool_limit(refbuf->_pool) && !refbuf->_huge))
+        return 0;
+
+    refbuf->next = global->head;
+    global->head = refbuf;
+    global->count++;
+
+    return 1;
+}
+
+/* moves the counters and count buffers of the cache's list into the global
+ * list, buffers the global list can not take anymore are freed.
+ */
+static void refbuf_cache_spill(refbuf_cache_t *cache, int pool, size_t count)
+{
+    refbuf_freelist_t *list = &(cache->list[pool]);
+    refbuf_t *to_free = NULL;
+
+    thread_spin_lock(&refbuf_pool_lock);
+    refbuf_pool_hits += cache->hits;
+    refbuf_pool_misses += cache->misses;
+    cache->hits = 0;
+    cache->misses = 0;
+
+    while (count && list->head) {
+        refbuf_t *refbuf = list->head;
+
+        list->head = refbuf->next;
+        list->count--;
+        count--;
+
+        if (!refbuf_pool_push(refbuf)) {
+            refbuf->next = to_free;
+            to_free = refbuf;
+        }
+    }
+    thread_spin_unlock(&refbuf_pool_lock);
+
+    while (to_free) {
+        refbuf_t *refbuf = to_free;
+        to_free = refbuf->next;
+        refbuf_pool_discard(refbuf);
+    }
+}
+
+static void refbuf_cache_refill(refbuf_cache_t *cache, int pool)
+{
+    refbuf_freelist_t *list = &(cache->list[pool]);
+    refbuf_freelist_t *global = &(refbuf_pool[cache->node][pool]);
+    size_t count = REFBUF_CACHE_BATCH;
+
+    thread_spin_lock(&refbuf_pool_lock);
+    while (count && global->head) {
+        refbuf_t *refbuf = global->head;
+
+        global->head = refbuf->next;
+        global->count--;
+        count--;
+
+        refbuf->next = list->head;
+        list->head = refbuf;
+        list->count++;
+    }
+    thread_spin_unlock(&refbuf_pool_lock);
+}
+
+/* gives the rest of the slab of the cache to its node, a rest too short
+ * for the smallest block taken from slabs is left unused */
+static void refbuf_cache_put_slab(refbuf_cache_t *cache)
+{
+    size_t min = (sizeof(refbuf_t) + refbuf_pool_size[REFBUF_HUGE_MIN_CLASS] + 15) & ~(size_t)15;
+    refbuf_slab_rest_t *rest = (refbuf_slab_rest_t *)cache->slab_pos;
+
+    if (!cache->slab_pos || (size_t)(cache->slab_end - cache->slab_pos) < min)
+        return;
+
+    rest->end = cache->slab_end;
+    thread_spin_lock(&refbuf_pool_lock);
+    rest->next = refbuf_slab_rests[cache->node];
+    refbuf_slab_rests[cache->node] = rest;
+    thread_spin_unlock(&refbuf_pool_lock);
+
+    cache->slab_pos = NULL;
+    cache->slab_end = NULL;
+}
+
+/* called by pthread on thread exit */
+static void refbuf_cache_free(void *arg)
+{
+    refbuf_cache_t *cache = arg;
+    int i;
+
+    for (i = 0; i < REFBUF_POOL_CLASSES; i++)
+        refbuf_cache_spill(cache, i, cache->list[i].count);
+    refbuf_cache_put_slab(cache);
+
+    free(cache);
+}
+
+static refbuf_cache_t *refbuf_cache_get(void)
+{
+    refbuf_cache_t *cache;
+
+    if (!refbuf_pool_running)
+        return NULL;
+
+    cache = pthread_getspecific(refbuf_cache_key);
+    if (!cache) {
+        cache = calloc(1, sizeof(*cache));
+        if (!cache)
+            return NULL;
+        if (pthread_setspecific(refbuf_cache_key, cache) != 0) {
+            free(cache);
+            return NULL;
+        }
+        /* threads pin themselves when they start, before they get here */
+        cache->node = affinity_current_node() % REFBUF_POOL_NODES;
+    }
+
+    return cache;
+}
+
+#ifdef REFBUF_HAVE_HUGE_PAGES
+/* maps a slab aligned to a huge page, sets *hugetlb if it is from hugetlbfs */
+static char *refbuf_huge_map(int *hugetlb)
+{
+    char *map;
+    char *slab;
+
+#ifdef MAP_HUGETLB
+    map = mmap(NULL, REFBUF_HUGE_SLAB_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+    if (map != MAP_FAILED) {
+        *hugetlb = 1;
+        return map;
+    }
+#endif
+
+    /* twice the size, so an aligned slab fits in, the rest is unmapped */
+    map = mmap(NULL, 2 * REFBUF_HUGE_SLAB_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    slab = (char *)(((uintptr_t)map + REFBUF_HUGE_SLAB_SIZE - 1) & ~((uintptr_t)REFBUF_HUGE_SLAB_SIZE - 1));
+    if (slab > map)
+        munmap(map, slab - map);
+    if (map + REFBUF_HUGE_SLAB_SIZE > slab)
+        munmap(slab + REFBUF_HUGE_SLAB_SIZE, map + REFBUF_HUGE_SLAB_SIZE - slab);
+
+    if (madvise(slab, REFBUF_HUGE_SLAB_SIZE, MADV_HUGEPAGE) != 0)
+        ICECAST_LOG_DEBUG("Transparent huge pages not available for buffer slab");
+
+    *hugetlb = 0;
+    return slab;
+}
+#endif
+
+/* carves a block of the size class from the slab of the thread, the tail
+ * of a slab too short for it is left unused. A new slab is the rest of one
+ * of an ended thread of the node if there is one. Returns NULL if no slab
+ * can be mapped. */
+static refbuf_t *refbuf_huge_alloc(refbuf_cache_t *cache, int pool)
+{
+#ifdef REFBUF_HAVE_HUGE_PAGES
+    size_t size = (sizeof(refbuf_t) + refbuf_pool_size[pool] + 15) & ~(size_t)15;
+    refbuf_t *refbuf;
+
+    if ((size_t)(cache->slab_end - cache->slab_pos) < size) {
+        refbuf_slab_rest_t *rest;
+        int hugetlb = 0;
+        char *slab;
+
+        /* a rest too short for this class is left to smaller ones */
+        thread_spin_lock(&refbuf_pool_lock);
+        rest = refbuf_slab_rests[cache->node];
+        if (rest && (size_t)(rest->end - (char *)rest) >= size) {
+            refbuf_slab_rests[cache->node] = rest->next;
+        } else {
+            rest = NULL;
+        }
+        thread_spin_unlock(&refbuf_pool_lock);
+
+        if (rest) {
+            cache->slab_pos = (char *)rest;
+            cache->slab_end = rest->end;
+        } else {
+            slab = refbuf_huge_map(&hugetlb);
+            if (!slab) {
+                ICECAST_LOG_WARN("Can not map a buffer slab, buffers are allocated without huge pages from now on");
+                atomic_uint_store(&refbuf_huge_enabled, 0);
+                return NULL;
+            }
+
+            thread_spin_lock(&refbuf_pool_lock);
+            refbuf_huge_slabs++;
+            if (hugetlb)
+                refbuf_huge_slabs_hugetlb++;
+            thread_spin_unlock(&refbuf_pool_lock);
+
+            cache->slab_pos = slab;
+            cache->slab_end = slab + REFBUF_HUGE_SLAB_SIZE;
+        }
+    }
+
+    refbuf = (refbuf_t *)cache->slab_pos;
+    cache->slab_pos += size;
+    refbuf->_huge = 1;
+
+    return refbuf;
+#else
+    (void)cache, (void)pool;
+    return NULL;
+#endif
+}
+
+void refbuf_set_huge_pages(int enabled)
+{
+#ifdef REFBUF_HAVE_HUGE_PAGES
+    atomic_uint_store(&refbuf_huge_enabled, enabled && refbuf_pool_running);
+    if (atomic_uint_load(&refbuf_huge_enabled))
+        ICECAST_LOG_INFO("Stream buffers are allocated from huge pages");
+#else
+    if (enabled)
+        ICECAST_LOG_WARN("Huge pages are not supported on this system");
+#endif
+}
 
 void refbuf_initialize(void)
 {
+    memset(refbuf_pool, 0, sizeof(refbuf_pool));
+    refbuf_pool_hits = 0;
+    refbuf_pool_misses = 0;
+
+    if (pthread_key_create(&refbuf_cache_key, refbuf_cache_free) != 0) {
+        ICECAST_LOG_ERROR("Can not create thread key, buffer pool disabled");
+        return;
+    }
+
+    thread_spin_create(&refbuf_pool_lock);
+    refbuf_pool_running = 1;
 }
 
 void refbuf_shutdown(void)
 {
+    refbuf_cache_t *cache;
+    int node;
+    int i;
+
+    if (!refbuf_pool_running)
+        return;
+
+    /* the main thread's cache is not released by pthread */
+    cache = pthread_getspecific(refbuf_cache_key);
+    if (cache) {
+        pthread_setspecific(refbuf_cache_key, NULL);
+        refbuf_cache_free(cache);
+    }
+
+    /* buffers still released by other threads from now on go to free() */
+    thread_spin_lock(&refbuf_pool_lock);
+    refbuf_pool_running = 0;
+    thread_spin_unlock(&refbuf_pool_lock);
+
+    for (node = 0; node < REFBUF_POOL_NODES; node++) {
+        for (i = 0; i < REFBUF_POOL_CLASSES; i++) {
+            refbuf_freelist_t *global = &(refbuf_pool[node][i]);
+
+            while (global->head) {
+                refbuf_t *refbuf = global->head;
+                global->head = refbuf->next;
+                refbuf_pool_discard(refbuf);
+            }
+            global->count = 0;
+        }
+    }
+
+    /* other threads may still hold their cache, so we keep the spinlock and
+     * the thread key around. */
+}
+
+size_t refbuf_trim_pool(void)
+{
+    refbuf_t *freed = NULL;
+    size_t ret = 0;
+    int node;
+    int i;
+
+    if (!refbuf_pool_running)
+        return 0;
+
+    /* the lists are taken off under the spinlock, free() is done without it */
+    thread_spin_lock(&refbuf_pool_lock);
+    for (node = 0; node < REFBUF_POOL_NODES; node++) {
+        for (i = 0; i < REFBUF_POOL_CLASSES; i++) {
+            refbuf_freelist_t *global = &(refbuf_pool[node][i]);
+
+            refbuf_t *keep = NULL;
+            size_t kept = 0;
+
+            while (global->head) {
+                refbuf_t *refbuf = global->head;
+                global->head = refbuf->next;
+                if (refbuf->_huge) {
+                    refbuf->next = keep;
+                    keep = refbuf;
+                    kept++;
+                } else {
+                    refbuf->next = freed;
+                    freed = refbuf;
+                }
+            }
+            ret += (global->count - kept) * refbuf_pool_size[i];
+            global->head = keep;
+            global->count = kept;
+        }
+    }
+    thread_spin_unlock(&refbuf_pool_lock);
+
+    while (freed) {
+        refbuf_t *refbuf = freed;
+        freed = refbuf->next;
+        refbuf_free_block(refbuf);
+    }
+
+    return ret;
+}
+
+void refbuf_get_pool_stats(refbuf_pool_stats_t *stats)
+{
+    int node;
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+
+    if (!refbuf_pool_running)
+        return;
+
+    thread_spin_lock(&refbuf_pool_lock);
+    stats->hits = refbuf_pool_hits;
+    stats->misses = refbuf_pool_misses;
+    stats->huge_bytes = refbuf_huge_slabs * REFBUF_HUGE_SLAB_SIZE;
+    stats->huge_bytes_hugetlb = refbuf_huge_slabs_hugetlb * REFBUF_HUGE_SLAB_SIZE;
+    for (node = 0; node < REFBUF_POOL_NODES; node++) {
+        for (i = 0; i < REFBUF_POOL_CLASSES; i++) {
+            stats->cached += refbuf_pool[node][i].count;
+            stats->cached_bytes += refbuf_pool[node][i].count * refbuf_pool_size[i];
+        }
+    }
+    thread_spin_unlock(&refbuf_pool_lock);
 }
 
 refbuf_t *refbuf_new (unsigned int size)
 {
-    refbuf_t *refbuf;
+    refbuf_t *refbuf = NULL;
+    refbuf_cache_t *cache = NULL;
+    int pool = -1;
 
-    refbuf = (refbuf_t *)malloc(sizeof(refbuf_t));
-    if (refbuf == NULL)
-        abort();
-    refbuf->data = NULL;
-    if (size)
-    {
-        refbuf->data = malloc (size);
-        if (refbuf->data == NULL)
+    if (size) {
+        pool = refbuf_pool_class(size);
+        if (pool >= 0)
+            cache = refbuf_cache_get();
+        if (!cache)
+            pool = -1;
+    }
+
+    if (cache) {
+        refbuf_freelist_t *list = &(cache->list[pool]);
+
+        if (!list->head)
+            refbuf_cache_refill(cache, pool);
+
+        if (list->head) {
+            refbuf = list->head;
+            list->head = refbuf->next;
+            list->count--;
+            cache->hits++;
+        } else {
+            cache->misses++;
+        }
+    }
+
+    if (!refbuf && cache && pool >= REFBUF_HUGE_MIN_CLASS && atomic_uint_load(&refbuf_huge_enabled))
+        refbuf = refbuf_huge_alloc(cache, pool);
+    if (!refbuf) {
+        refbuf = malloc(sizeof(refbuf_t) + (pool >= 0 ? refbuf_pool_size[pool] : size));
+        if (refbuf == NULL)
             abort();
+        refbuf->_huge = 0;
     }
+
+    refbuf->data = size ? (char *)(refbuf + 1) : NULL;
     refbuf->len = size;
     refbuf->sync_point = 0;
+    refbuf->sync_offset = 0;
+    refbuf->stream_offset = 0;
     refbuf->_count = 1;
+    refbuf->_pool = pool;
+    refbuf->_node = cache ? cache->node : 0;
     refbuf->next = NULL;
     refbuf->associated = NULL;
+    refbuf->variant = NULL;
+    refbuf->_owner = NULL;
 
     return refbuf;
 }
 
+refbuf_t *refbuf_slice(refbuf_t *owner, unsigned int offset, unsigned int len)
+{
+    /* from the smallest pool class, the block only holds the header */
+    refbuf_t *self = refbuf_new(1);
+
+    refbuf_addref(owner);
+    self->_owner = owner;
+    self->data = owner->data + offset;
+    self->len = len;
+
+    return self;
+}
+
+int refbuf_resize(refbuf_t *self, unsigned int size)
+{
+    char *data;
+
+    if (self->data == (char *)(self + 1)) {
+        /* data lives in the same block as the header, move it out */
+        data = malloc(size ? size : 1);
+        if (!data)
+            return -1;
+        memcpy(data, self->data, self->len < size ? self->len : size);
+    } else {
+        data = realloc(self->data, size ? size : 1);
+        if (!data)
+            return -1;
+    }
+
+    self->data = data;
+    self->len = size;
+
+    return 0;
+}
+
 void refbuf_addref(refbuf_t *self)
 {
-    self->_count++;
+    atomic_uint_add(&(self->_count), 1);
 }
 
 static void refbuf_release_associated (refbuf_t *ref)
@@ -75,7 +611,7 @@ static void refbuf_release_associated (refbuf_t *ref)
     {
         refbuf_t *to_go = ref;
         ref = to_go->next;
-        if ( to_go->_count == 1 )
+        if (refbuf_get_count(to_go) == 1)
             to_go->next = NULL;
         refbuf_release (to_go);
     }
@@ -83,16 +619,49 @@ static void refbuf_release_associated (refbuf_t *ref)
 
 void refbuf_release(refbuf_t *self)
 {
+    refbuf_cache_t *cache;
+
     if (self == NULL)
         return;
-    self->_count--;
-    if (self->_count == 0)
+    if (atomic_uint_sub(&(self->_count), 1) == 0)
     {
         refbuf_release_associated (self->associated);
+        refbuf_release (self->variant);
         if (self->next)
             ICECAST_LOG_ERROR("next not null");
-        free(self->data);
-        free(self);
+        if (self->_owner) {
+            refbuf_release(self->_owner);
+            self->_owner = NULL;
+            self->data = (char *)(self + 1);
+        }
+
+        if (self->_pool >= 0 && (cache = refbuf_cache_get()))
+        {
+            refbuf_freelist_t *list = &(cache->list[self->_pool]);
+
+            /* only the block itself goes back to the pool */
+            if (self->data != (char *)(self + 1))
+                free(self->data);
+
+            if (self->_node != cache->node) {
+                int pushed;
+
+                thread_spin_lock(&refbuf_pool_lock);
+                pushed = refbuf_pool_push(self);
+                thread_spin_unlock(&refbuf_pool_lock);
+                if (!pushed)
+                    refbuf_pool_discard(self);
+                return;
+            }
+
+            self->next = list->head;
+            list->head = self;
+            list->count++;
+            if (list->count > REFBUF_CACHE_MAX)
+                refbuf_cache_spill(cache, self->_pool, REFBUF_CACHE_BATCH);
+            return;
+        }
+
+        refbuf_free_block(self);
     }
 }
-
@@ -18,24 +18,106 @@
 #ifndef __REFBUF_H__
 #define __REFBUF_H__
 
+#include "compat.h"
+#include "atomic.h"
+
+/* Reference counting is atomic, so a refbuf can be shared by any number of
+ * threads. The rules for the stream queue (source->stream_data) are:
+ *  - Only the source thread appends to the queue. A new refbuf must be fully
+ *    set up (data, len, sync_point, sync_offset) before it is linked in with
+ *    refbuf_set_next(), which has release semantics.
+ *  - Readers walking the queue must use refbuf_get_next(), which has acquire
+ *    semantics, so that they see the contents of the refbuf they got.
+ *  - Readers must hold a reference to the refbuf they are positioned on. The
+ *    source thread only unlinks refbufs from the head of the queue once their
+ *    count shows that only the queue itself refers to them.
+ */
 typedef struct _refbuf_tag
 {
     unsigned int len;
-    unsigned int _count;
+    volatile unsigned int _count;
     char *data;
     struct _refbuf_tag *associated;
     struct _refbuf_tag *next;
+    /* the same data prepared for sending to some of the listeners, set up
+     * by the format plugin before queueing. Released with this buffer. */
+    struct _refbuf_tag *variant;
     int sync_point;
+    /* where in data a listener starting on this buffer begins, for formats
+     * where the buffers do not start on a frame */
+    unsigned int sync_offset;
+    /* position of the first byte of data in the stream, set by the source
+     * when the buffer is queued */
+    uint64_t stream_offset;
 
+    /* the buffer data points into for a slice, see refbuf_slice(), NULL
+     * if the buffer has data of its own */
+    struct _refbuf_tag *_owner;
+
+    /* size class of the pool this buffer belongs to, -1 if not pooled */
+    int _pool;
+    /* NUMA node the buffer was allocated on, see affinity.h */
+    int _node;
+    /* set if the block is part of a huge page slab and can not be freed */
+    int _huge;
 } refbuf_t;
 
+typedef struct {
+    /* buffers handed out from a free list */
+    uint64_t hits;
+    /* buffers that needed a fresh allocation */
+    uint64_t misses;
+    /* buffers and bytes currently kept in the global free lists */
+    size_t cached;
+    size_t cached_bytes;
+    /* bytes of huge pages mapped for the buffers, and those of them from
+     * hugetlbfs rather than transparent huge pages */
+    size_t huge_bytes;
+    size_t huge_bytes_hugetlb;
+} refbuf_pool_stats_t;
+
 void refbuf_initialize(void);
 void refbuf_shutdown(void);
+/* Allocates the blocks of the larger size classes from huge pages from now
+ * on, see <huge-pages> */
+void refbuf_set_huge_pages(int enabled);
 
 refbuf_t *refbuf_new(unsigned int size);
 void refbuf_addref(refbuf_t *self);
 void refbuf_release(refbuf_t *self);
 
+/* Changes the size of the data of self. Existing data is kept up to the
+ * smaller of the two sizes. Use this instead of realloc() on self->data.
+ * Returns 0 on success and -1 on error, in which case self is unchanged.
+ */
+int refbuf_resize(refbuf_t *self, unsigned int size);
+
+/* A buffer for len bytes of the data of owner from offset on, without
+ * copying them. It holds a reference to owner until it is released itself.
+ * The data is shared, so neither may be changed or resized afterwards.
+ */
+refbuf_t *refbuf_slice(refbuf_t *owner, unsigned int offset, unsigned int len);
+
+void refbuf_get_pool_stats(refbuf_pool_stats_t *stats);
+/* Frees the buffers kept in the global free lists, returns their bytes.
+ * The caches of the threads and buffers from huge pages are left alone. */
+size_t refbuf_trim_pool(void);
+
+static inline unsigned int refbuf_get_count(refbuf_t *self)
+{
+    return atomic_uint_load(&(self->_count));
+}
+
+static inline refbuf_t *refbuf_get_next(refbuf_t *self)
+{
+    return atomic_ptr_load((void * volatile *)&(self->next));
+}
+
+static inline void refbuf_set_next(refbuf_t *self, refbuf_t *next)
+{
+    atomic_ptr_store((void * volatile *)&(self->next), next);
+}
+
 #define PER_CLIENT_REFBUF_SIZE  4096
 
 #endif  /* __REFBUF_H__ */
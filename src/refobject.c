@@ -16,6 +16,7 @@
 #include "common/thread/thread.h"
 
 #include "refobject.h"
+#include "atomic.h"
 
 #define TO_BASE(x) REFOBJECT_TO_TYPE((x), refobject_base_t *)
 
@@ -105,9 +106,24 @@ int             refobject_ref(refobject_t self)
     if (REFOBJECT_IS_NULL(self))
         return -1;
 
-    thread_mutex_lock(&(TO_BASE(self)->lock));
-    TO_BASE(self)->refc++;
-    thread_mutex_unlock(&(TO_BASE(self)->lock));
+    atomic_uint_add(&(TO_BASE(self)->refc), 1);
+
+    return 0;
+}
+
+int             refobject_try_ref(refobject_t self)
+{
+    register refobject_base_t *base = TO_BASE(self);
+    unsigned int refc;
+
+    if (REFOBJECT_IS_NULL(self))
+        return -1;
+
+    do {
+        refc = atomic_uint_load(&(base->refc));
+        if (!refc)
+            return -1;
+    } while (!atomic_uint_cas(&(base->refc), refc, refc + 1));
 
     return 0;
 }
@@ -119,12 +135,10 @@ int             refobject_unref(refobject_t self)
     if (REFOBJECT_IS_NULL(self))
         return -1;
 
-    thread_mutex_lock(&(base->lock));
-    base->refc--;
-    if (base->refc) {
-        thread_mutex_unlock(&(base->lock));
+    /* The one dropping the last reference is the only one left with access
+     * to the object, so no lock is needed to free it. */
+    if (atomic_uint_sub(&(base->refc), 1))
         return 0;
-    }
 
     if (base->type->type_freecb)
         base->type->type_freecb(self, &(base->userdata));
@@ -135,7 +149,6 @@ int             refobject_unref(refobject_t self)
     if (base->name)
         free(base->name);
 
-    thread_mutex_unlock(&(base->lock));
     thread_mutex_destroy(&(base->lock));
 
     free(base);
@@ -171,28 +184,18 @@ int             refobject_set_userdata(refobject_t self, void *userdata)
 
 const char *    refobject_get_name(refobject_t self)
 {
-    const char *ret;
-
     if (REFOBJECT_IS_NULL(self))
         return NULL;
 
-    thread_mutex_lock(&(TO_BASE(self)->lock));
-    ret = TO_BASE(self)->name;
-    thread_mutex_unlock(&(TO_BASE(self)->lock));
-
-    return ret;
+    /* set on creation only */
+    return TO_BASE(self)->name;
 }
 
 refobject_t     refobject_get_associated(refobject_t self)
 {
-    refobject_t ret;
-
     if (REFOBJECT_IS_NULL(self))
         return REFOBJECT_NULL;
 
-    thread_mutex_lock(&(TO_BASE(self)->lock));
-    ret = TO_BASE(self)->associated;
-    thread_mutex_unlock(&(TO_BASE(self)->lock));
-
-    return ret;
+    /* set on creation only */
+    return TO_BASE(self)->associated;
 }
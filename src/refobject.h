@@ -160,7 +160,9 @@ struct refobject_type_tag {
  */
 struct refobject_base_tag {
     const refobject_type_t* type;
-    size_t refc;
+    /* only changed with the atomic operations from atomic.h */
+    volatile unsigned int refc;
+    /* protects userdata */
     mutex_t lock;
     void *userdata;
     char *name;
@@ -187,6 +189,13 @@ refobject_t     refobject_new__simple(const refobject_type_t *type, void *userda
 
 /* This increases the reference counter of the object */
 int             refobject_ref(refobject_t self);
+/* This increases the reference counter of the object unless it already
+ * dropped to zero, that is the object is about to be freed by another thread.
+ * Returns -1 in that case. Only useful for objects that are still reachable
+ * from somewhere while being freed, e.g. from a table their free callback
+ * removes them from.
+ */
+int             refobject_try_ref(refobject_t self);
 /* This decreases the reference counter of the object.
  * If the object's reference counter reaches zero the object is freed.
  */
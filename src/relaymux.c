@@ -0,0 +1,1231 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#ifdef HAVE_PIPE
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+#ifndef _WIN32
+#include <sys/socket.h>
+#endif
+
+#include "common/thread/thread.h"
+#include "common/timing/timing.h"
+
+#include "relaymux.h"
+#include "fdpoll.h"
+#include "connection.h"
+#include "client.h"
+#include "cfgfile.h"
+#include "util.h"
+
+#include "logging.h"
+#define CATMODULE "relaymux"
+
+/* there are no socket pairs to stand in for the connections */
+#ifndef _WIN32
+
+/* Each frame starts with its type, the length of what follows in 24 bits
+ * and the id of its channel, all in network byte order */
+#define RELAYMUX_FRAME_HEADER   8
+#define RELAYMUX_MAX_PAYLOAD    16384
+
+#define RELAYMUX_FRAME_OPEN     1
+#define RELAYMUX_FRAME_DATA     2
+/* the sender has room for as many bytes more as the 32 bit payload says */
+#define RELAYMUX_FRAME_WINDOW   3
+#define RELAYMUX_FRAME_CLOSE    4
+
+/* bytes a side may send on a channel before the other hands out room again,
+ * that is returned once a quarter of it was passed on */
+#define RELAYMUX_WINDOW         (256*1024)
+/* the channels are not read while more than this waits to be sent on the
+ * connection, they are again once half of it is sent */
+#define RELAYMUX_OUT_LIMIT      (1024*1024)
+
+#define RELAYMUX_CHANNEL_BUCKETS 256
+#define RELAYMUX_MAX_EVENTS     256
+/* ms the master has to accept the connection and answer the request */
+#define RELAYMUX_CONNECT_TIMEOUT 10000
+/* how often deadlines are checked, without a wakeup pipe new channels are
+ * only picked up this often */
+#ifdef HAVE_PIPE
+#define RELAYMUX_TICK           1000
+#else
+#define RELAYMUX_TICK           50
+#endif
+
+typedef enum {
+    RELAYMUX_KIND_WAKEUP,
+    RELAYMUX_KIND_MUX,
+    RELAYMUX_KIND_CHANNEL
+} relaymux_kind_t;
+
+typedef enum {
+    /* only on the slave, until the master answered the request */
+    RELAYMUX_STATE_CONNECTING,
+    RELAYMUX_STATE_REQUESTING,
+    RELAYMUX_STATE_RESPONSE,
+    RELAYMUX_STATE_OPEN,
+    RELAYMUX_STATE_CLOSED
+} relaymux_state_t;
+
+typedef struct relaymux_tag relaymux_t;
+typedef struct relaymux_channel_tag relaymux_channel_t;
+
+struct relaymux_channel_tag {
+    /* first, poll results are told apart by it */
+    relaymux_kind_t kind;
+    relaymux_t *mux;
+    uint32_t id;
+    /* our end of the socket pair, SOCK_ERROR once closed */
+    sock_t sock;
+    unsigned int events;
+
+    /* bytes we may still send to the other side, and bytes of it that were
+     * passed on but not handed out as room again yet */
+    uint32_t credit;
+    uint32_t consumed;
+    /* data of the other side not passed on yet, only allocated while there
+     * is some, in_size grows up to RELAYMUX_WINDOW */
+    char *in;
+    size_t in_size;
+    size_t in_pos;
+    size_t in_len;
+    /* the other side closed it, it is closed once in is passed on */
+    int remote_closed;
+    /* not read while the connection has too much to send */
+    int stalled;
+
+    relaymux_channel_t *prev;
+    relaymux_channel_t *next;
+    relaymux_channel_t *hash_next;
+    /* on the list of channels to free at the end of the pass */
+    relaymux_channel_t *dead_next;
+};
+
+struct relaymux_tag {
+    relaymux_kind_t kind;
+    relaymux_t *prev;
+    relaymux_t *next;
+    relaymux_state_t state;
+    connection_t *con;
+    unsigned int events;
+
+    /* the slave: where it connects to and the request it makes */
+    char *server;
+    int port;
+    uint64_t deadline;
+    char *request;
+    size_t request_len;
+    size_t request_sent;
+    /* the master: the client it came in as */
+    client_t *client;
+
+    char in[RELAYMUX_FRAME_HEADER + RELAYMUX_MAX_PAYLOAD];
+    size_t in_len;
+    char *out;
+    size_t out_pos;
+    size_t out_len;
+    size_t out_size;
+    /* channels are not read until out is sent down to half the limit */
+    int throttled;
+
+    relaymux_channel_t *channels;
+    relaymux_channel_t *buckets[RELAYMUX_CHANNEL_BUCKETS];
+    uint32_t next_id;
+
+    /* on the list of connections to send on at the end of the pass */
+    int dirty;
+    relaymux_t *dirty_next;
+    relaymux_t *dead_next;
+};
+
+/* a channel or connection handed over by another thread */
+typedef struct relaymux_pending_tag {
+    struct relaymux_pending_tag *next;
+    relaymux_channel_t *channel;
+    char *server;
+    int port;
+    char *auth;
+    client_t *client;
+} relaymux_pending_t;
+
+static int __inited = 0;
+static thread_type *_thread;
+static fdpoll_t *_poll;
+#ifdef HAVE_PIPE
+static int _wakeup[2];
+#endif
+static relaymux_kind_t _wakeup_kind = RELAYMUX_KIND_WAKEUP;
+
+static mutex_t _lock;
+/* protected by _lock */
+static int _running;
+static relaymux_pending_t *_pending;
+
+/* only used by the thread */
+static relaymux_t *_muxes;
+static relaymux_t *_dirty;
+static relaymux_t *_dead_muxes;
+static relaymux_channel_t *_dead_channels;
+
+static void relaymux_wakeup(void)
+{
+#ifdef HAVE_PIPE
+    char c = 0;
+
+    /* if the pipe is full the thread is going to wake up anyway */
+    if (write(_wakeup[1], &c, 1) < 0)
+        return;
+#endif
+}
+
+static void relaymux_drain_wakeup(void)
+{
+#ifdef HAVE_PIPE
+    char buf[64];
+
+    while (read(_wakeup[0], buf, sizeof(buf)) > 0);
+#endif
+}
+
+static inline void relaymux_put_header(char *buf, unsigned int type, size_t len, uint32_t id)
+{
+    buf[0] = type;
+    buf[1] = (len >> 16) & 0xFF;
+    buf[2] = (len >> 8) & 0xFF;
+    buf[3] = len & 0xFF;
+    buf[4] = (id >> 24) & 0xFF;
+    buf[5] = (id >> 16) & 0xFF;
+    buf[6] = (id >> 8) & 0xFF;
+    buf[7] = id & 0xFF;
+}
+
+static inline uint32_t relaymux_get_u32(const char *buf)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void relaymux_set_events(sock_t sock, unsigned int *armed, unsigned int events, void *userdata)
+{
+    if (*armed == events)
+        return;
+
+    if (events) {
+        if (fdpoll_arm(_poll, sock, events, userdata) == 0)
+            *armed = events;
+    } else {
+        fdpoll_disarm(_poll, sock);
+        *armed = 0;
+    }
+}
+
+static void relaymux_mark_dirty(relaymux_t *mux)
+{
+    if (mux->dirty)
+        return;
+    mux->dirty = 1;
+    mux->dirty_next = _dirty;
+    _dirty = mux;
+}
+
+/* Reserves room for a frame at the end of out, returns NULL if there is no memory */
+static char *relaymux_frame(relaymux_t *mux, unsigned int type, size_t len, uint32_t id)
+{
+    char *frame;
+
+    if (mux->out_pos && mux->out_pos == mux->out_len) {
+        mux->out_pos = 0;
+        mux->out_len = 0;
+    }
+
+    if (mux->out_len + RELAYMUX_FRAME_HEADER + len > mux->out_size) {
+        size_t size = mux->out_size ? mux->out_size : 65536;
+        char *n;
+
+        /* what was sent already is dropped first */
+        if (mux->out_pos) {
+            memmove(mux->out, mux->out + mux->out_pos, mux->out_len - mux->out_pos);
+            mux->out_len -= mux->out_pos;
+            mux->out_pos = 0;
+        }
+
+        while (mux->out_len + RELAYMUX_FRAME_HEADER + len > size)
+            size *= 2;
+        if (size != mux->out_size) {
+            n = realloc(mux->out, size);
+            if (!n)
+                return NULL;
+            mux->out = n;
+            mux->out_size = size;
+        }
+    }
+
+    frame = mux->out + mux->out_len;
+    relaymux_put_header(frame, type, len, id);
+    mux->out_len += RELAYMUX_FRAME_HEADER + len;
+    relaymux_mark_dirty(mux);
+
+    if ((mux->out_len - mux->out_pos) > RELAYMUX_OUT_LIMIT)
+        mux->throttled = 1;
+
+    return frame + RELAYMUX_FRAME_HEADER;
+}
+
+static void relaymux_send_window(relaymux_t *mux, uint32_t id, uint32_t bytes)
+{
+    char *payload = relaymux_frame(mux, RELAYMUX_FRAME_WINDOW, 4, id);
+
+    if (!payload)
+        return;
+
+    payload[0] = (bytes >> 24) & 0xFF;
+    payload[1] = (bytes >> 16) & 0xFF;
+    payload[2] = (bytes >> 8) & 0xFF;
+    payload[3] = bytes & 0xFF;
+}
+
+static void relaymux_channel_update(relaymux_channel_t *channel)
+{
+    unsigned int events = FDPOLL_EVENT_NONE;
+
+    if (channel->sock == SOCK_ERROR)
+        return;
+
+    if (channel->credit && !channel->stalled && !channel->remote_closed && channel->mux->state == RELAYMUX_STATE_OPEN)
+        events |= FDPOLL_EVENT_READ;
+    if (channel->in_pos < channel->in_len)
+        events |= FDPOLL_EVENT_WRITE;
+
+    relaymux_set_events(channel->sock, &(channel->events), events, channel);
+}
+
+static relaymux_channel_t *relaymux_channel_find(relaymux_t *mux, uint32_t id)
+{
+    relaymux_channel_t *channel = mux->buckets[id % RELAYMUX_CHANNEL_BUCKETS];
+
+    while (channel && channel->id != id)
+        channel = channel->hash_next;
+
+    return channel;
+}
+
+static void relaymux_channel_link(relaymux_t *mux, relaymux_channel_t *channel)
+{
+    size_t bucket = channel->id % RELAYMUX_CHANNEL_BUCKETS;
+
+    channel->mux = mux;
+    channel->credit = RELAYMUX_WINDOW;
+    channel->prev = NULL;
+    channel->next = mux->channels;
+    if (mux->channels)
+        mux->channels->prev = channel;
+    mux->channels = channel;
+    channel->hash_next = mux->buckets[bucket];
+    mux->buckets[bucket] = channel;
+}
+
+static relaymux_channel_t *relaymux_channel_new(sock_t sock)
+{
+    relaymux_channel_t *channel = calloc(1, sizeof(*channel));
+
+    if (!channel)
+        return NULL;
+
+    channel->kind = RELAYMUX_KIND_CHANNEL;
+    channel->sock = sock;
+
+    return channel;
+}
+
+/* Closes the channel, telling the other side if tell is set. It is freed at
+ * the end of the pass, as there may still be poll results for it. */
+static void relaymux_channel_close(relaymux_channel_t *channel, int tell)
+{
+    relaymux_t *mux = channel->mux;
+    relaymux_channel_t **link;
+
+    if (channel->sock == SOCK_ERROR)
+        return;
+
+    relaymux_set_events(channel->sock, &(channel->events), FDPOLL_EVENT_NONE, channel);
+    sock_close(channel->sock);
+    channel->sock = SOCK_ERROR;
+
+    if (mux) {
+        if (tell && mux->state == RELAYMUX_STATE_OPEN)
+            relaymux_frame(mux, RELAYMUX_FRAME_CLOSE, 0, channel->id);
+
+        if (channel->prev) {
+            channel->prev->next = channel->next;
+        } else {
+            mux->channels = channel->next;
+        }
+        if (channel->next)
+            channel->next->prev = channel->prev;
+
+        link = &(mux->buckets[channel->id % RELAYMUX_CHANNEL_BUCKETS]);
+        while (*link && *link != channel)
+            link = &((*link)->hash_next);
+        if (*link)
+            *link = channel->hash_next;
+        channel->mux = NULL;
+    }
+
+    channel->dead_next = _dead_channels;
+    _dead_channels = channel;
+}
+
+/* Passes on what the other side sent on the channel as far as the socket
+ * takes it. Returns -1 if the channel was closed. */
+static int relaymux_channel_flush(relaymux_channel_t *channel)
+{
+    relaymux_t *mux = channel->mux;
+
+    while (channel->in_pos < channel->in_len) {
+        int ret = sock_write_bytes(channel->sock, channel->in + channel->in_pos, channel->in_len - channel->in_pos);
+
+        if (ret < 0 && sock_recoverable(sock_error()))
+            break;
+        if (ret <= 0) {
+            relaymux_channel_close(channel, 1);
+            return -1;
+        }
+        channel->in_pos += ret;
+        channel->consumed += ret;
+    }
+
+    if (channel->in_pos == channel->in_len) {
+        free(channel->in);
+        channel->in = NULL;
+        channel->in_size = 0;
+        channel->in_pos = 0;
+        channel->in_len = 0;
+        if (channel->remote_closed) {
+            relaymux_channel_close(channel, 0);
+            return -1;
+        }
+    }
+
+    if (channel->consumed >= RELAYMUX_WINDOW / 4) {
+        relaymux_send_window(mux, channel->id, channel->consumed);
+        channel->consumed = 0;
+    }
+
+    relaymux_channel_update(channel);
+    return 0;
+}
+
+/* Reads what the local end wrote to the channel and sends it on */
+static void relaymux_channel_read(relaymux_channel_t *channel)
+{
+    relaymux_t *mux = channel->mux;
+
+    /* the connection has enough to send, the channel waits for it */
+    if (mux->throttled) {
+        channel->stalled = 1;
+        relaymux_channel_update(channel);
+        return;
+    }
+
+    while (channel->credit && !mux->throttled) {
+        size_t len = channel->credit < RELAYMUX_MAX_PAYLOAD ? channel->credit : RELAYMUX_MAX_PAYLOAD;
+        char *payload = relaymux_frame(mux, RELAYMUX_FRAME_DATA, len, channel->id);
+        int ret;
+
+        if (!payload) {
+            relaymux_channel_close(channel, 1);
+            return;
+        }
+
+        ret = sock_read_bytes(channel->sock, payload, len);
+        if (ret <= 0) {
+            /* the frame was not filled, take it back */
+            mux->out_len -= RELAYMUX_FRAME_HEADER + len;
+            if (ret < 0 && sock_recoverable(sock_error()))
+                break;
+            relaymux_channel_close(channel, 1);
+            return;
+        }
+
+        if ((size_t)ret < len) {
+            /* the length goes into the header of the frame */
+            mux->out_len -= len - ret;
+            relaymux_put_header(payload - RELAYMUX_FRAME_HEADER, RELAYMUX_FRAME_DATA, ret, channel->id);
+        }
+        channel->credit -= ret;
+    }
+
+    relaymux_channel_update(channel);
+}
+
+/* Makes the local end of a channel the slave opened, queued like a
+ * connection accepted on the listen socket the connection of the slave
+ * came in on */
+static void relaymux_accept_channel(relaymux_t *mux, uint32_t id)
+{
+    relaymux_channel_t *channel;
+    connection_t *con;
+    sock_t fds[2];
+
+    if (relaymux_channel_find(mux, id))
+        return;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        ICECAST_LOG_ERROR("Can not create a socket pair for a relay channel of %s", mux->con->ip);
+        relaymux_frame(mux, RELAYMUX_FRAME_CLOSE, 0, id);
+        return;
+    }
+    sock_set_blocking(fds[0], 0);
+    sock_set_blocking(fds[1], 0);
+
+    channel = relaymux_channel_new(fds[0]);
+    if (!channel) {
+        sock_close(fds[0]);
+        sock_close(fds[1]);
+        relaymux_frame(mux, RELAYMUX_FRAME_CLOSE, 0, id);
+        return;
+    }
+    channel->id = id;
+    relaymux_channel_link(mux, channel);
+
+    con = connection_create(fds[1], mux->con->listensocket_real, mux->con->listensocket_effective, strdup(mux->con->ip));
+    if (!con) {
+        sock_close(fds[1]);
+        relaymux_channel_close(channel, 1);
+        return;
+    }
+    con->local = true;
+    connection_queue(con);
+
+    relaymux_channel_update(channel);
+}
+
+/* Handles the frames received on the connection. Returns -1 if the other
+ * side broke the protocol. */
+static int relaymux_process(relaymux_t *mux)
+{
+    size_t pos = 0;
+
+    while (mux->in_len - pos >= RELAYMUX_FRAME_HEADER) {
+        const char *frame = mux->in + pos;
+        unsigned int type = (unsigned char)frame[0];
+        size_t len = ((size_t)(unsigned char)frame[1] << 16) | ((size_t)(unsigned char)frame[2] << 8) | (unsigned char)frame[3];
+        uint32_t id = relaymux_get_u32(frame + 4);
+        const char *payload = frame + RELAYMUX_FRAME_HEADER;
+        relaymux_channel_t *channel;
+
+        if (len > RELAYMUX_MAX_PAYLOAD)
+            return -1;
+        if (mux->in_len - pos < RELAYMUX_FRAME_HEADER + len)
+            break;
+        pos += RELAYMUX_FRAME_HEADER + len;
+
+        if (type == RELAYMUX_FRAME_OPEN) {
+            /* only the slave opens channels */
+            if (mux->client)
+                relaymux_accept_channel(mux, id);
+            continue;
+        }
+
+        /* frames may still arrive for channels closed in the meantime */
+        channel = relaymux_channel_find(mux, id);
+        if (!channel)
+            continue;
+
+        switch (type) {
+            case RELAYMUX_FRAME_DATA:
+                if (channel->remote_closed)
+                    return -1;
+                /* with nothing waiting, as much as the socket takes is
+                 * passed on right away and only the rest is kept */
+                if (channel->in_pos == channel->in_len && len) {
+                    int ret = sock_write_bytes(channel->sock, payload, len);
+
+                    if (ret < 0 && sock_recoverable(sock_error()))
+                        ret = 0;
+                    else if (ret <= 0) {
+                        relaymux_channel_close(channel, 1);
+                        break;
+                    }
+                    payload += ret;
+                    len -= ret;
+                    channel->consumed += ret;
+                }
+                /* all the other side may send fits, as it only sends what
+                 * there is room for */
+                if (channel->in_pos && channel->in_len + len > channel->in_size) {
+                    memmove(channel->in, channel->in + channel->in_pos, channel->in_len - channel->in_pos);
+                    channel->in_len -= channel->in_pos;
+                    channel->in_pos = 0;
+                }
+                if (channel->in_len + len > RELAYMUX_WINDOW)
+                    return -1;
+                if (channel->in_len + len > channel->in_size) {
+                    size_t size = channel->in_size * 2;
+                    char *in;
+
+                    if (size < channel->in_len + len)
+                        size = channel->in_len + len;
+                    if (size > RELAYMUX_WINDOW)
+                        size = RELAYMUX_WINDOW;
+                    in = realloc(channel->in, size);
+                    if (!in) {
+                        relaymux_channel_close(channel, 1);
+                        break;
+                    }
+                    channel->in = in;
+                    channel->in_size = size;
+                }
+                memcpy(channel->in + channel->in_len, payload, len);
+                channel->in_len += len;
+                relaymux_channel_flush(channel);
+                break;
+            case RELAYMUX_FRAME_WINDOW:
+                if (len != 4)
+                    return -1;
+                channel->credit += relaymux_get_u32(payload);
+                if (channel->credit > RELAYMUX_WINDOW)
+                    return -1;
+                relaymux_channel_update(channel);
+                break;
+            case RELAYMUX_FRAME_CLOSE:
+                channel->remote_closed = 1;
+                relaymux_channel_flush(channel);
+                break;
+            default:
+                /* unknown frames are skipped, for later extensions */
+                break;
+        }
+    }
+
+    if (pos) {
+        memmove(mux->in, mux->in + pos, mux->in_len - pos);
+        mux->in_len -= pos;
+    }
+
+    return 0;
+}
+
+static void relaymux_close(relaymux_t *mux)
+{
+    if (mux->state == RELAYMUX_STATE_CLOSED)
+        return;
+
+    if (mux->server) {
+        ICECAST_LOG_WARN("Multiplexed relay connection to %s:%d closed", mux->server, mux->port);
+    } else {
+        ICECAST_LOG_INFO("Multiplexed relay connection of %s closed", mux->con->ip);
+    }
+
+    mux->state = RELAYMUX_STATE_CLOSED;
+
+    /* the relays see their connection close */
+    while (mux->channels)
+        relaymux_channel_close(mux->channels, 0);
+
+    relaymux_set_events(mux->con->sock, &(mux->events), FDPOLL_EVENT_NONE, mux);
+
+    if (mux->prev) {
+        mux->prev->next = mux->next;
+    } else {
+        _muxes = mux->next;
+    }
+    if (mux->next)
+        mux->next->prev = mux->prev;
+
+    mux->dead_next = _dead_muxes;
+    _dead_muxes = mux;
+}
+
+static void relaymux_free(relaymux_t *mux)
+{
+    if (mux->client) {
+        client_destroy(mux->client);
+    } else if (mux->con) {
+        connection_close(mux->con);
+    }
+    free(mux->server);
+    free(mux->request);
+    free(mux->out);
+    free(mux);
+}
+
+/* Sends what is waiting to be sent and arms the socket as is needed */
+static void relaymux_flush(relaymux_t *mux)
+{
+    unsigned int events = FDPOLL_EVENT_READ;
+
+    if (mux->state == RELAYMUX_STATE_CLOSED)
+        return;
+
+    if (mux->state == RELAYMUX_STATE_OPEN) {
+        while (mux->out_pos < mux->out_len) {
+            ssize_t ret = connection_send_bytes(mux->con, mux->out + mux->out_pos, mux->out_len - mux->out_pos);
+
+            if (ret <= 0)
+                break;
+            mux->out_pos += ret;
+        }
+        if (mux->con->error) {
+            relaymux_close(mux);
+            return;
+        }
+        if (mux->out_pos == mux->out_len) {
+            mux->out_pos = 0;
+            mux->out_len = 0;
+        } else {
+            events |= FDPOLL_EVENT_WRITE;
+        }
+
+        /* enough is sent, the channels waiting for it go on */
+        if (mux->throttled && (mux->out_len - mux->out_pos) <= RELAYMUX_OUT_LIMIT / 2) {
+            relaymux_channel_t *channel;
+
+            mux->throttled = 0;
+            for (channel = mux->channels; channel; channel = channel->next) {
+                if (channel->stalled) {
+                    channel->stalled = 0;
+                    relaymux_channel_update(channel);
+                }
+            }
+        }
+    } else if (mux->state == RELAYMUX_STATE_CONNECTING || mux->state == RELAYMUX_STATE_REQUESTING) {
+        events = FDPOLL_EVENT_WRITE;
+    }
+
+    relaymux_set_events(mux->con->sock, &(mux->events), events, mux);
+}
+
+/* the response of the master to the request of the slave, once it is there
+ * the channels opened in the meantime can go on */
+static int relaymux_read_response(relaymux_t *mux)
+{
+    relaymux_channel_t *channel;
+    char *end;
+    size_t header_len;
+
+    mux->in[mux->in_len < sizeof(mux->in) ? mux->in_len : sizeof(mux->in) - 1] = 0;
+    end = strstr(mux->in, "\r\n\r\n");
+    if (!end)
+        return mux->in_len < sizeof(mux->in) - 1 ? 0 : -1;
+
+    if (strncmp(mux->in, "HTTP/1.0 200", 12) != 0 && strncmp(mux->in, "HTTP/1.1 200", 12) != 0) {
+        ICECAST_LOG_WARN("Master %s:%d rejected the multiplexed relay connection", mux->server, mux->port);
+        return -1;
+    }
+
+    ICECAST_LOG_INFO("Multiplexed relay connection to %s:%d is up", mux->server, mux->port);
+
+    /* frames may follow right after the header */
+    header_len = end + 4 - mux->in;
+    memmove(mux->in, mux->in + header_len, mux->in_len - header_len);
+    mux->in_len -= header_len;
+    mux->state = RELAYMUX_STATE_OPEN;
+
+    for (channel = mux->channels; channel; channel = channel->next)
+        relaymux_channel_update(channel);
+
+    return 0;
+}
+
+static void relaymux_step(relaymux_t *mux)
+{
+    if (mux->state == RELAYMUX_STATE_CONNECTING) {
+        int ret = sock_connected(mux->con->sock, 0);
+
+        if (ret == SOCK_ERROR) {
+            ICECAST_LOG_WARN("Failed to connect to %s:%d for multiplexed relays", mux->server, mux->port);
+            relaymux_close(mux);
+            return;
+        }
+        if (ret != 1)
+            return;
+        mux->state = RELAYMUX_STATE_REQUESTING;
+    }
+
+    if (mux->state == RELAYMUX_STATE_REQUESTING) {
+        while (mux->request_sent < mux->request_len) {
+            ssize_t ret = connection_send_bytes(mux->con, mux->request + mux->request_sent, mux->request_len - mux->request_sent);
+
+            if (ret <= 0)
+                break;
+            mux->request_sent += ret;
+        }
+        if (mux->con->error) {
+            relaymux_close(mux);
+            return;
+        }
+        if (mux->request_sent == mux->request_len)
+            mux->state = RELAYMUX_STATE_RESPONSE;
+        relaymux_mark_dirty(mux);
+        return;
+    }
+
+    while (mux->state == RELAYMUX_STATE_RESPONSE || mux->state == RELAYMUX_STATE_OPEN) {
+        size_t room = sizeof(mux->in) - mux->in_len;
+        ssize_t ret;
+
+        /* the response is read up to its end only */
+        if (mux->state == RELAYMUX_STATE_RESPONSE)
+            room = room ? room - 1 : 0;
+        if (!room)
+            break;
+
+        ret = connection_read_bytes(mux->con, mux->in + mux->in_len, room);
+        if (ret <= 0)
+            break;
+        mux->in_len += ret;
+
+        if (mux->state == RELAYMUX_STATE_RESPONSE && relaymux_read_response(mux) != 0) {
+            relaymux_close(mux);
+            return;
+        }
+
+        if (mux->state == RELAYMUX_STATE_OPEN && relaymux_process(mux) != 0) {
+            ICECAST_LOG_ERROR("Multiplexed relay connection of %s sent an invalid frame", mux->con->ip);
+            relaymux_close(mux);
+            return;
+        }
+    }
+
+    if (mux->con->error) {
+        relaymux_close(mux);
+        return;
+    }
+
+    relaymux_mark_dirty(mux);
+}
+
+/* Finds the connection of the slave to server, making it if there is none */
+static relaymux_t *relaymux_connect(const char *server, int port, const char *auth)
+{
+    relaymux_t *mux;
+    ice_config_t *config;
+    char *server_id;
+    sock_t sock;
+    int ret;
+
+    for (mux = _muxes; mux; mux = mux->next) {
+        if (mux->server && mux->port == port && strcmp(mux->server, server) == 0)
+            return mux;
+    }
+
+    mux = calloc(1, sizeof(*mux));
+    if (!mux)
+        return NULL;
+    mux->kind = RELAYMUX_KIND_MUX;
+    mux->state = RELAYMUX_STATE_CONNECTING;
+    mux->server = strdup(server);
+    mux->port = port;
+    mux->next_id = 1;
+
+    config = config_get_config();
+    server_id = strdup(config->server_id);
+    config_release_config();
+
+    mux->request = malloc(1024);
+    if (mux->request && server_id) {
+        ret = snprintf(mux->request, 1024, "GET /admin/relaymux HTTP/1.0\r\n"
+                "User-Agent: %s\r\n"
+                "Host: %s\r\n"
+                "%s"
+                "\r\n",
+                server_id, server, auth ? auth : "");
+        if (ret > 0 && ret < 1024)
+            mux->request_len = ret;
+    }
+    free(server_id);
+
+    if (!mux->server || !mux->request_len) {
+        relaymux_free(mux);
+        return NULL;
+    }
+
+    ICECAST_LOG_INFO("Connecting to %s:%d for multiplexed relays", server, port);
+    sock = sock_connect_non_blocking(server, port);
+    if (sock == SOCK_ERROR) {
+        ICECAST_LOG_WARN("Failed to connect to %s:%d for multiplexed relays", server, port);
+        relaymux_free(mux);
+        return NULL;
+    }
+    sock_set_blocking(sock, 0);
+
+    mux->con = connection_create(sock, NULL, NULL, strdup(server));
+    if (!mux->con) {
+        sock_close(sock);
+        relaymux_free(mux);
+        return NULL;
+    }
+    mux->deadline = timing_get_time() + RELAYMUX_CONNECT_TIMEOUT;
+
+    mux->next = _muxes;
+    if (_muxes)
+        _muxes->prev = mux;
+    _muxes = mux;
+
+    relaymux_mark_dirty(mux);
+
+    return mux;
+}
+
+static void relaymux_take_pending(relaymux_pending_t *pending)
+{
+    while (pending) {
+        relaymux_pending_t *next = pending->next;
+
+        if (pending->client) {
+            relaymux_t *mux = calloc(1, sizeof(*mux));
+
+            if (mux) {
+                mux->kind = RELAYMUX_KIND_MUX;
+                mux->state = RELAYMUX_STATE_OPEN;
+                mux->client = pending->client;
+                mux->con = pending->client->con;
+                mux->next = _muxes;
+                if (_muxes)
+                    _muxes->prev = mux;
+                _muxes = mux;
+                ICECAST_LOG_INFO("Multiplexed relay connection of %s is up", mux->con->ip);
+                relaymux_mark_dirty(mux);
+            } else {
+                client_destroy(pending->client);
+            }
+        } else {
+            relaymux_t *mux = relaymux_connect(pending->server, pending->port, pending->auth);
+            relaymux_channel_t *channel = pending->channel;
+
+            if (mux) {
+                channel->id = mux->next_id++;
+                relaymux_channel_link(mux, channel);
+                /* sent once the master answered */
+                relaymux_frame(mux, RELAYMUX_FRAME_OPEN, 0, channel->id);
+                relaymux_channel_update(channel);
+            } else {
+                relaymux_channel_close(channel, 0);
+            }
+        }
+
+        free(pending->server);
+        free(pending->auth);
+        free(pending);
+        pending = next;
+    }
+}
+
+static void *relaymux_thread(void *arg)
+{
+    fdpoll_result_t results[RELAYMUX_MAX_EVENTS];
+
+    (void)arg;
+
+    while (1) {
+        relaymux_pending_t *pending;
+        relaymux_t *mux;
+        uint64_t now;
+        ssize_t ret;
+        ssize_t i;
+
+        thread_mutex_lock(&_lock);
+        if (!_running) {
+            thread_mutex_unlock(&_lock);
+            break;
+        }
+        pending = _pending;
+        _pending = NULL;
+        thread_mutex_unlock(&_lock);
+
+        relaymux_take_pending(pending);
+
+        ret = fdpoll_wait(_poll, RELAYMUX_TICK, results, RELAYMUX_MAX_EVENTS);
+        if (ret < 0) {
+            ICECAST_LOG_ERROR("Waiting for multiplexed relay events failed");
+            thread_sleep(RELAYMUX_TICK * 1000);
+        }
+
+        for (i = 0; i < ret; i++) {
+            relaymux_kind_t *kind = results[i].userdata;
+
+            if (*kind == RELAYMUX_KIND_WAKEUP) {
+                relaymux_drain_wakeup();
+            } else if (*kind == RELAYMUX_KIND_MUX) {
+                mux = results[i].userdata;
+                if (mux->state != RELAYMUX_STATE_CLOSED)
+                    relaymux_step(mux);
+            } else {
+                relaymux_channel_t *channel = results[i].userdata;
+
+                /* closed earlier in this pass */
+                if (channel->sock == SOCK_ERROR)
+                    continue;
+                mux = channel->mux;
+                if ((results[i].events & FDPOLL_EVENT_WRITE) && relaymux_channel_flush(channel) != 0)
+                    continue;
+                if (results[i].events & (FDPOLL_EVENT_READ | FDPOLL_EVENT_ERROR))
+                    relaymux_channel_read(channel);
+                relaymux_mark_dirty(mux);
+            }
+        }
+
+        now = timing_get_time();
+        for (mux = _muxes; mux; mux = mux->next) {
+            if (mux->state != RELAYMUX_STATE_OPEN && mux->deadline && now >= mux->deadline) {
+                ICECAST_LOG_WARN("Multiplexed relay connection to %s:%d timed out", mux->server, mux->port);
+                relaymux_close(mux);
+            }
+        }
+
+        while (_dirty) {
+            mux = _dirty;
+            _dirty = mux->dirty_next;
+            mux->dirty = 0;
+            relaymux_flush(mux);
+        }
+
+        while (_dead_channels) {
+            relaymux_channel_t *channel = _dead_channels;
+
+            _dead_channels = channel->dead_next;
+            free(channel->in);
+            free(channel);
+        }
+
+        while (_dead_muxes) {
+            mux = _dead_muxes;
+            _dead_muxes = mux->dead_next;
+            relaymux_free(mux);
+        }
+    }
+
+    while (_muxes)
+        relaymux_close(_muxes);
+    while (_dead_channels) {
+        relaymux_channel_t *channel = _dead_channels;
+
+        _dead_channels = channel->dead_next;
+        free(channel->in);
+        free(channel);
+    }
+    while (_dead_muxes) {
+        relaymux_t *mux = _dead_muxes;
+
+        _dead_muxes = mux->dead_next;
+        relaymux_free(mux);
+    }
+
+    return NULL;
+}
+
+void relaymux_initialize(void)
+{
+    if (__inited)
+        return;
+
+    thread_mutex_create(&_lock);
+    __inited = 1;
+
+    _poll = fdpoll_new();
+    if (!_poll) {
+        ICECAST_LOG_INFO("No polling available, multiplexed relay connections can not be used");
+        return;
+    }
+
+#ifdef HAVE_PIPE
+    if (pipe(_wakeup) != 0) {
+        fdpoll_free(_poll);
+        _poll = NULL;
+        return;
+    }
+    fcntl(_wakeup[0], F_SETFL, O_NONBLOCK);
+    fcntl(_wakeup[1], F_SETFL, O_NONBLOCK);
+    fdpoll_arm(_poll, _wakeup[0], FDPOLL_EVENT_READ, &_wakeup_kind);
+#endif
+
+    _running = 1;
+    _thread = thread_create("Relay Multiplexer", relaymux_thread, NULL, THREAD_ATTACHED);
+    if (!_thread) {
+        _running = 0;
+        ICECAST_LOG_ERROR("Can not start the relay multiplexer thread");
+    }
+}
+
+void relaymux_shutdown(void)
+{
+    relaymux_pending_t *pending;
+
+    if (!__inited)
+        return;
+
+    thread_mutex_lock(&_lock);
+    _running = 0;
+    pending = _pending;
+    _pending = NULL;
+    thread_mutex_unlock(&_lock);
+
+    if (_thread) {
+        relaymux_wakeup();
+        thread_join(_thread);
+        _thread = NULL;
+    }
+
+    /* handed over while the thread stopped */
+    while (pending) {
+        relaymux_pending_t *next = pending->next;
+
+        if (pending->client)
+            client_destroy(pending->client);
+        if (pending->channel) {
+            sock_close(pending->channel->sock);
+            free(pending->channel);
+        }
+        free(pending->server);
+        free(pending->auth);
+        free(pending);
+        pending = next;
+    }
+
+    if (_poll) {
+#ifdef HAVE_PIPE
+        fdpoll_disarm(_poll, _wakeup[0]);
+        close(_wakeup[0]);
+        close(_wakeup[1]);
+#endif
+        fdpoll_free(_poll);
+        _poll = NULL;
+    }
+
+    thread_mutex_destroy(&_lock);
+    __inited = 0;
+}
+
+/* Hands pending over to the thread, returns -1 if it is not running */
+static int relaymux_add_pending(relaymux_pending_t *pending)
+{
+    thread_mutex_lock(&_lock);
+    if (!_running) {
+        thread_mutex_unlock(&_lock);
+        return -1;
+    }
+    pending->next = _pending;
+    _pending = pending;
+    thread_mutex_unlock(&_lock);
+
+    relaymux_wakeup();
+
+    return 0;
+}
+
+sock_t relaymux_open(const char *server, int port, const char *username, const char *password)
+{
+    relaymux_pending_t *pending;
+    sock_t fds[2];
+
+    if (!server)
+        return SOCK_ERROR;
+
+    pending = calloc(1, sizeof(*pending));
+    if (!pending)
+        return SOCK_ERROR;
+
+    pending->server = strdup(server);
+    pending->port = port;
+    if (username && password) {
+        size_t len = strlen(username) + strlen(password) + 2;
+        char *auth = malloc(len);
+
+        if (auth) {
+            char *data;
+
+            snprintf(auth, len, "%s:%s", username, password);
+            data = util_base64_encode(auth, strlen(auth));
+            free(auth);
+            if (data) {
+                len = strlen(data) + 24;
+                pending->auth = malloc(len);
+                if (pending->auth)
+                    snprintf(pending->auth, len, "Authorization: Basic %s\r\n", data);
+                free(data);
+            }
+        }
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        free(pending->server);
+        free(pending->auth);
+        free(pending);
+        return SOCK_ERROR;
+    }
+    sock_set_blocking(fds[0], 0);
+    sock_set_blocking(fds[1], 0);
+
+    pending->channel = relaymux_channel_new(fds[0]);
+    if (!pending->server || !pending->channel || relaymux_add_pending(pending) != 0) {
+        free(pending->channel);
+        free(pending->server);
+        free(pending->auth);
+        free(pending);
+        sock_close(fds[0]);
+        sock_close(fds[1]);
+        return SOCK_ERROR;
+    }
+
+    return fds[1];
+}
+
+void relaymux_accept(client_t *client)
+{
+    relaymux_pending_t *pending = calloc(1, sizeof(*pending));
+
+    if (!pending) {
+        client_destroy(client);
+        return;
+    }
+
+    pending->client = client;
+    if (relaymux_add_pending(pending) != 0) {
+        free(pending);
+        client_destroy(client);
+    }
+}
+
+#else
+
+void relaymux_initialize(void)
+{
+}
+
+void relaymux_shutdown(void)
+{
+}
+
+sock_t relaymux_open(const char *server, int port, const char *username, const char *password)
+{
+    (void)server;
+    (void)port;
+    (void)username;
+    (void)password;
+    return SOCK_ERROR;
+}
+
+void relaymux_accept(client_t *client)
+{
+    client_destroy(client);
+}
+
+#endif
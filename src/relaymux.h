@@ -0,0 +1,42 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* relaymux.h
+ *
+ * Carries the connections of the relays of a slave to its master over one
+ * connection, see <master-relay-mux>, instead of one TCP connection per
+ * relayed mount. The slave asks for /admin/relaymux and from then on both
+ * sides exchange frames that each belong to one channel. A channel stands in
+ * for one connection: on the slave one end of a socket pair is used by the
+ * relay like a socket connected to the master, on the master the other end
+ * of a socket pair is queued like an accepted connection, so the request of
+ * the relay is handled like that of any listener. Each side may only send
+ * as much on a channel as the other side has room for, which it hands out
+ * again as it passes the data on, so a channel whose reader is slow does not
+ * hold up the others. One thread moves the data of all of them.
+ */
+
+#ifndef __RELAYMUX_H__
+#define __RELAYMUX_H__
+
+#include "icecasttypes.h"
+#include "common/net/sock.h"
+
+void    relaymux_initialize(void);
+void    relaymux_shutdown(void);
+
+/* Opens a channel to server and port, connecting to it with the credentials
+ * given first if there is no connection to it yet. Returns the socket to
+ * use like a non-blocking one connected to the server, the caller closes it
+ * once done. Returns SOCK_ERROR if no channel can be opened.
+ */
+sock_t  relaymux_open(const char *server, int port, const char *username, const char *password);
+
+/* Takes over client, which asked for /admin/relaymux and got its response
+ * header, and serves the channels the slave opens on its connection. */
+void    relaymux_accept(client_t *client);
+
+#endif  /* __RELAYMUX_H__ */
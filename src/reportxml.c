@@ -15,15 +15,16 @@
 #endif
 
 #include <string.h>
+#include <stdint.h>
 
 #include "common/thread/thread.h"
-#include "common/avl/avl.h"
 
 #include "reportxml.h"
 #include "refobject.h"
 
 /* For XMLSTR() */
 #include "cfgfile.h"
+#include "util.h"
 
 #include "logging.h"
 #define CATMODULE "reportxml"
@@ -59,9 +60,19 @@ struct reportxml_database_tag {
     /* base object */
     refobject_base_t __base;
     /* the lock used to ensure the database object is thread safe. */
-    mutex_t lock;
-    /* The tree of definitions */
-    avl_tree *definitions;
+    rwlock_t lock;
+    /* The definitions, hashed by their ID (open addressing) */
+    struct reportxml_database_entry *definitions;
+    /* number of definitions */
+    size_t definitions_len;
+    /* size of definitions minus one, 0 if not allocated */
+    size_t definitions_mask;
+};
+
+struct reportxml_database_entry {
+    char *id;
+    uint32_t hash;
+    reportxml_node_t *node;
 };
 
 /* The nodeattr structure is used to store definition of node attributes */
@@ -974,42 +985,81 @@ xmlNodePtr              reportxml_node_get_xml_child(reportxml_node_t *node, siz
 static void __database_free(refobject_t self, void **userdata)
 {
     reportxml_database_t *db = REFOBJECT_TO_TYPE(self, reportxml_database_t *);
+    size_t i;
 
-    if (db->definitions)
-        avl_tree_free(db->definitions, (avl_free_key_fun_type)refobject_unref);
+    if (db->definitions) {
+        for (i = 0; i <= db->definitions_mask; i++) {
+            if (!db->definitions[i].id)
+                continue;
+            free(db->definitions[i].id);
+            refobject_unref(db->definitions[i].node);
+        }
+        free(db->definitions);
+    }
 
-    thread_mutex_destroy(&(db->lock));
+    thread_rwlock_destroy(&(db->lock));
 }
 
-static int __compare_definitions(void *arg, void *a, void *b)
+static struct reportxml_database_entry * __find_definition_slot(struct reportxml_database_entry *definitions, size_t mask, const char *id, uint32_t hash)
 {
-    char *id_a, *id_b;
-    int ret = 0;
+    size_t i = hash & mask;
 
-    id_a = reportxml_node_get_attribute(a, "defines");
-    id_b = reportxml_node_get_attribute(b, "defines");
+    while (definitions[i].id) {
+        if (definitions[i].hash == hash && strcmp(definitions[i].id, id) == 0)
+            break;
+        i = (i + 1) & mask;
+    }
 
-    if (!id_a || !id_b || id_a == id_b) {
-        ret = 0;
-    } else {
-        ret = strcmp(id_a, id_b);
+    return &(definitions[i]);
+}
+
+/* Must be called with the lock held for writing. Takes over node and id. */
+static int __add_definition(reportxml_database_t *db, char *id, reportxml_node_t *node)
+{
+    struct reportxml_database_entry *slot;
+    uint32_t hash = util_hash_string(id);
+
+    /* keep the load factor at or below one half */
+    if (!db->definitions || (db->definitions_len + 1) * 2 > (db->definitions_mask + 1)) {
+        size_t size = db->definitions ? (db->definitions_mask + 1) * 2 : 64;
+        struct reportxml_database_entry *n = calloc(size, sizeof(*n));
+        size_t i;
+
+        if (!n)
+            return -1;
+
+        if (db->definitions) {
+            for (i = 0; i <= db->definitions_mask; i++) {
+                if (db->definitions[i].id)
+                    *__find_definition_slot(n, size - 1, db->definitions[i].id, db->definitions[i].hash) = db->definitions[i];
+            }
+            free(db->definitions);
+        }
+
+        db->definitions = n;
+        db->definitions_mask = size - 1;
     }
 
-    free(id_a);
-    free(id_b);
+    slot = __find_definition_slot(db->definitions, db->definitions_mask, id, hash);
+    if (slot->id) {
+        /* the first definition of an ID wins */
+        ICECAST_LOG_WARN("Duplicate definition of \"%H\" ignored", id);
+        return -1;
+    }
 
-    return ret;
+    slot->id = id;
+    slot->hash = hash;
+    slot->node = node;
+    db->definitions_len++;
+
+    return 0;
 }
 
 static int __database_new(refobject_t self, const refobject_type_t *type, va_list ap)
 {
     reportxml_database_t *ret = REFOBJECT_TO_TYPE(self, reportxml_database_t*);
 
-    thread_mutex_create(&(ret->lock));
-
-    ret->definitions = avl_tree_new(__compare_definitions, NULL);
-    if (!ret->definitions)
-        return -1;
+    thread_rwlock_create(&(ret->lock));
 
     return 0;
 }
@@ -1041,11 +1091,12 @@ int                     reportxml_database_add_report(reportxml_database_t *db,
     if (count < 0)
         return -1;
 
-    thread_mutex_lock(&(db->lock));
+    thread_rwlock_wlock(&(db->lock));
 
     for (i = 0; i < (size_t)count; i++) {
         reportxml_node_t *node = reportxml_node_get_child(root, i);
         reportxml_node_t *copy;
+        char *id;
 
         if (reportxml_node_get_type(node) != REPORTXML_NODE_TYPE_DEFINITION) {
             refobject_unref(node);
@@ -1058,10 +1109,19 @@ int                     reportxml_database_add_report(reportxml_database_t *db,
         if (!copy)
             continue;
 
-        avl_insert(db->definitions, copy);
+        id = reportxml_node_get_attribute(copy, "defines");
+        if (!id) {
+            refobject_unref(copy);
+            continue;
+        }
+
+        if (__add_definition(db, id, copy) != 0) {
+            free(id);
+            refobject_unref(copy);
+        }
     }
 
-    thread_mutex_unlock(&(db->lock));
+    thread_rwlock_unlock(&(db->lock));
 
     refobject_unref(root);
 
@@ -1141,8 +1201,8 @@ static int __attach_copy_of_node_or_definition(reportxml_node_t *parent, reportx
 
 static reportxml_node_t *      __reportxml_database_build_node_ext(reportxml_database_t *db, const char *id, ssize_t depth, reportxml_node_type_t *acst_type_ret)
 {
-    reportxml_node_t *search;
-    reportxml_node_t *found;
+    struct reportxml_database_entry *slot;
+    reportxml_node_t *found = NULL;
     reportxml_node_t *ret;
     enum {
         ACST_FIRST,
@@ -1166,29 +1226,16 @@ static reportxml_node_t *      __reportxml_database_build_node_ext(reportxml_dat
     if (!depth)
         return NULL;
 
-    search = reportxml_node_new(REPORTXML_NODE_TYPE_DEFINITION, NULL, NULL, NULL);
-    if (!search)
-        return NULL;
-
-    if (reportxml_node_set_attribute(search, "defines", id) != 0) {
-        refobject_unref(search);
-        return NULL;
-    }
-
-    thread_mutex_lock(&(db->lock));
-    if (avl_get_by_key(db->definitions, REFOBJECT_TO_TYPE(search, void *), (void**)&found) != 0) {
-        thread_mutex_unlock(&(db->lock));
-        refobject_unref(search);
-        return NULL;
+    thread_rwlock_rlock(&(db->lock));
+    if (db->definitions) {
+        slot = __find_definition_slot(db->definitions, db->definitions_mask, id, util_hash_string(id));
+        if (slot->id && refobject_ref(slot->node) == 0)
+            found = slot->node;
     }
+    thread_rwlock_unlock(&(db->lock));
 
-    refobject_unref(search);
-
-    if (refobject_ref(found) != 0) {
-        thread_mutex_unlock(&(db->lock));
+    if (!found)
         return NULL;
-    }
-    thread_mutex_unlock(&(db->lock));
 
     count = reportxml_node_count_child(found);
     if (count < 0) {
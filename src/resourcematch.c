@@ -192,6 +192,183 @@ resourcematch_result_t resourcematch_match(const char *pattern, const char *stri
     }
 }
 
+/* A compiled pattern is a list of tokens, each either a literal to be
+ * found as it is or a group. Literals are kept unescaped in one buffer
+ * following the tokens. */
+typedef struct {
+    /* type of the group, 0 for a literal */
+    char type;
+    int base;
+    const char *literal;
+    size_t len;
+} resourcematch_token_t;
+
+struct resourcematch_tag {
+    size_t groups;
+    size_t tokens;
+    resourcematch_token_t *token;
+};
+
+static inline int group_base(char type)
+{
+    switch (type) {
+        case 'i':
+            return 0;
+        case 'd':
+            return 10;
+        case 'x':
+            return 16;
+        case 'o':
+            return 8;
+        case 's':
+            return -1;
+        default:
+            return -2;
+    }
+}
+
+resourcematch_t *resourcematch_compile(const char *pattern)
+{
+    resourcematch_t *matcher;
+    resourcematch_token_t *token;
+    const char *p;
+    char *literal;
+    size_t tokens = 0;
+    size_t groups = 0;
+    size_t bytes = 0;
+    int in_literal = 0;
+
+    if (!pattern) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* count what is needed and validate the pattern */
+    for (p = pattern; *p; p++) {
+        if (*p == '%') {
+            p++;
+            if (*p == '%') {
+                bytes++;
+                if (!in_literal)
+                    tokens++;
+                in_literal = 1;
+            } else if (group_base(*p) > -2) {
+                tokens++;
+                groups++;
+                in_literal = 0;
+            } else {
+                errno = EINVAL;
+                return NULL;
+            }
+        } else {
+            bytes++;
+            if (!in_literal)
+                tokens++;
+            in_literal = 1;
+        }
+    }
+
+    matcher = calloc(1, sizeof(*matcher) + tokens * sizeof(*token) + bytes + 1);
+    if (!matcher)
+        return NULL;
+
+    matcher->groups = groups;
+    matcher->tokens = tokens;
+    matcher->token = (resourcematch_token_t *)(matcher + 1);
+    literal = (char *)(matcher->token + tokens);
+
+    token = NULL;
+    for (p = pattern; *p; p++) {
+        if (*p == '%' && p[1] != '%') {
+            p++;
+            token = token ? token + 1 : matcher->token;
+            token->type = *p;
+            token->base = group_base(*p);
+            /* a literal after this starts a new token */
+            token->literal = NULL;
+            continue;
+        }
+
+        if (*p == '%')
+            p++;
+
+        if (!token || token->type) {
+            token = token ? token + 1 : matcher->token;
+            token->literal = literal;
+        }
+        *literal++ = *p;
+        token->len++;
+    }
+
+    return matcher;
+}
+
+void resourcematch_free(resourcematch_t *matcher)
+{
+    free(matcher);
+}
+
+size_t resourcematch_get_groups(const resourcematch_t *matcher)
+{
+    return matcher ? matcher->groups : 0;
+}
+
+resourcematch_result_t resourcematch_exec(const resourcematch_t *matcher, const char *string, resourcematch_extract_t *extract)
+{
+    size_t idx = 0;
+    size_t i;
+
+    if (!matcher || !string)
+        return RESOURCEMATCH_ERROR;
+
+    if (extract && extract->groups < matcher->groups)
+        return RESOURCEMATCH_ERROR;
+
+    for (i = 0; i < matcher->tokens; i++) {
+        const resourcematch_token_t *token = &(matcher->token[i]);
+
+        if (!token->type) {
+            if (strncmp(string, token->literal, token->len) != 0)
+                return RESOURCEMATCH_NOMATCH;
+            string += token->len;
+        } else if (token->base < 0) {
+            if (extract) {
+                extract->group[idx].type = token->type;
+                extract->group[idx].raw = NULL;
+                extract->group[idx].result.string = string;
+            }
+            string += strlen(string);
+            idx++;
+        } else {
+            long long int value;
+            char *endptr;
+
+            errno = 0;
+            value = strtoll(string, &endptr, token->base);
+            if (endptr == string)
+                return RESOURCEMATCH_NOMATCH;
+            if (errno != 0)
+                return RESOURCEMATCH_ERROR;
+
+            if (extract) {
+                extract->group[idx].type = token->type;
+                extract->group[idx].raw = NULL;
+                extract->group[idx].result.lli = value;
+            }
+            string = endptr;
+            idx++;
+        }
+    }
+
+    if (*string)
+        return RESOURCEMATCH_NOMATCH;
+
+    if (extract)
+        extract->groups = idx;
+
+    return RESOURCEMATCH_MATCH;
+}
+
 void resourcematch_extract_free(resourcematch_extract_t *extract)
 {
     size_t i;
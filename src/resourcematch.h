@@ -31,7 +31,22 @@ typedef struct {
     resourcematch_group_t *group;
 } resourcematch_extract_t;
 
+/* A pattern compiled for matching many strings against it */
+typedef struct resourcematch_tag resourcematch_t;
+
 resourcematch_result_t resourcematch_match(const char *pattern, const char *string, resourcematch_extract_t **extract);
 void resourcematch_extract_free(resourcematch_extract_t *extract);
 
+/* Returns NULL with errno set if the pattern is not valid */
+resourcematch_t *resourcematch_compile(const char *pattern);
+void resourcematch_free(resourcematch_t *matcher);
+/* Number of groups a match extracts */
+size_t resourcematch_get_groups(const resourcematch_t *matcher);
+/* Like resourcematch_match() but nothing is allocated. The extract is given
+ * by the caller with group pointing to an array of groups, the size of
+ * which is passed in groups and replaced by the number of groups found.
+ * String groups point into string. Must not be freed with
+ * resourcematch_extract_free(). */
+resourcematch_result_t resourcematch_exec(const resourcematch_t *matcher, const char *string, resourcematch_extract_t *extract);
+
 #endif
@@ -0,0 +1,184 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#include "shmring.h"
+#include "atomic.h"
+
+#include "logging.h"
+#define CATMODULE "shmring"
+
+struct shmring_tag {
+    char *filename;
+    int fd;
+    char *map;
+    size_t map_size;
+    shmring_header_t *header;
+    char *data;
+    uint64_t size;
+};
+
+#ifndef _WIN32
+static void shmring_wake(shmring_t *self)
+{
+    shmring_header_t *header = self->header;
+
+    atomic_uint_add((volatile unsigned int *)&header->sequence, 1);
+#ifdef __linux__
+    /* consumers can not tell us they wait as they map the file read only,
+     * waking nobody is a cheap system call once per buffer */
+    syscall(SYS_futex, &header->sequence, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+shmring_t *shmring_open(const char *filename, uint64_t size, const char *content_type)
+{
+    shmring_t *self = calloc(1, sizeof(*self));
+    int err;
+
+    if (!self) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    self->fd = -1;
+    self->map = MAP_FAILED;
+    self->size = size;
+    self->map_size = SHMRING_HEADER_SIZE + size;
+    self->filename = strdup(filename);
+    if (!self->filename) {
+        err = ENOMEM;
+        goto fail;
+    }
+
+    /* consumers may still have the old file mapped, truncating it would
+     * pull it away from under them */
+    if (unlink(filename) != 0 && errno != ENOENT) {
+        err = errno;
+        goto fail;
+    }
+    self->fd = open(filename, O_RDWR|O_CREAT|O_EXCL, 0644);
+    if (self->fd < 0 || ftruncate(self->fd, self->map_size) != 0) {
+        err = errno;
+        goto fail;
+    }
+    self->map = mmap(NULL, self->map_size, PROT_READ|PROT_WRITE, MAP_SHARED, self->fd, 0);
+    if (self->map == MAP_FAILED) {
+        err = errno;
+        goto fail;
+    }
+
+    self->header = (shmring_header_t *)self->map;
+    self->data = self->map + SHMRING_HEADER_SIZE;
+
+    self->header->header_size = SHMRING_HEADER_SIZE;
+    self->header->size = size;
+    if (content_type)
+        snprintf(self->header->content_type, sizeof(self->header->content_type), "%s", content_type);
+    atomic_uint_store((volatile unsigned int *)&self->header->state, SHMRING_STATE_LIVE);
+    /* consumers check the magic last */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(self->header->magic, SHMRING_MAGIC, sizeof(self->header->magic));
+
+    ICECAST_LOG_DEBUG("Sharing %" PRIu64 " bytes of stream in \"%s\"", size, filename);
+
+    return self;
+
+fail:
+    if (self->fd >= 0) {
+        close(self->fd);
+        unlink(filename);
+    }
+    free(self->filename);
+    free(self);
+    errno = err;
+    return NULL;
+}
+
+void shmring_write(shmring_t *self, refbuf_t *refbuf)
+{
+    shmring_header_t *header = self->header;
+    const char *data = refbuf->data;
+    size_t len = refbuf->len;
+    uint64_t position;
+
+    if (!len)
+        return;
+
+    /* only the last size bytes of a huge buffer fit */
+    if (len > self->size) {
+        data += len - self->size;
+        atomic_u64_add(&header->reserved, len - self->size);
+        atomic_u64_add(&header->written, len - self->size);
+        len = self->size;
+    }
+
+    position = atomic_u64_load(&header->written);
+    atomic_u64_add(&header->reserved, len);
+    while (len) {
+        size_t offset = position % self->size;
+        size_t piece = self->size - offset;
+
+        if (piece > len)
+            piece = len;
+        memcpy(self->data + offset, data, piece);
+        position += piece;
+        data += piece;
+        len -= piece;
+    }
+    atomic_u64_store(&header->written, position);
+
+    shmring_wake(self);
+}
+
+void shmring_close(shmring_t *self)
+{
+    if (!self)
+        return;
+
+    atomic_uint_store((volatile unsigned int *)&self->header->state, SHMRING_STATE_ENDED);
+    shmring_wake(self);
+
+    unlink(self->filename);
+    munmap(self->map, self->map_size);
+    close(self->fd);
+    free(self->filename);
+    free(self);
+}
+#else
+shmring_t *shmring_open(const char *filename, uint64_t size, const char *content_type)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+void shmring_write(shmring_t *self, refbuf_t *refbuf)
+{
+}
+
+void shmring_close(shmring_t *self)
+{
+}
+#endif
@@ -0,0 +1,71 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* shmring.h
+ *
+ * Hands the stream of a source to consumers on the same host through a
+ * ring in a shared memory file, so they do not need a TCP connection and
+ * HTTP each. The source thread copies every queued buffer into the ring
+ * once, however many consumers map it. Consumers only read and may fall
+ * behind or go away without the server noticing.
+ *
+ * The file starts with a shmring_header_t of SHMRING_HEADER_SIZE bytes,
+ * the ring of size bytes follows. Positions count the bytes written since
+ * the ring was created, the byte at a position is at data[position % size].
+ * To read from position a consumer
+ *  - loads written, anything before it is complete,
+ *  - copies the bytes from position up to written,
+ *  - issues an acquire fence, so the copy is not done after the next load,
+ *  - loads reserved, the copy is good if reserved - position <= size, else
+ *    it was overwritten meanwhile and the consumer restarts from
+ *    written - size / 2 or the like.
+ * The loads must be acquire loads. When it has caught up a consumer waits
+ * for sequence to change, on Linux with FUTEX_WAIT on it, so the file can
+ * be mapped read only. Once the source is gone
+ * state is SHMRING_STATE_ENDED and the file is removed. A new source
+ * creates a new file, so consumers of the old one are never overwritten
+ * and should map the file again after the ring ended.
+ */
+
+#ifndef __SHMRING_H__
+#define __SHMRING_H__
+
+#include <stdint.h>
+
+#include "refbuf.h"
+
+#define SHMRING_MAGIC           "ICESHMR1"
+#define SHMRING_HEADER_SIZE     4096
+
+#define SHMRING_STATE_LIVE      1
+#define SHMRING_STATE_ENDED     2
+
+typedef struct {
+    char magic[8];
+    uint32_t header_size;
+    volatile uint32_t state;
+    uint64_t size;
+    volatile uint64_t reserved;
+    volatile uint64_t written;
+    /* changes with every write and when the ring ends */
+    volatile uint32_t sequence;
+    uint32_t unused;
+    /* Content-Type of the stream, zero terminated */
+    char content_type[128];
+} shmring_header_t;
+
+typedef struct shmring_tag shmring_t;
+
+/* Creates filename, replacing an old one, with a ring of size bytes and
+ * maps it. Returns NULL on error with errno set. */
+shmring_t *shmring_open(const char *filename, uint64_t size, const char *content_type);
+/* Appends a queued buffer and wakes the waiting consumers. Only called by
+ * the source thread. */
+void       shmring_write(shmring_t *self, refbuf_t *refbuf);
+/* Marks the ring as ended, removes and unmaps the file. */
+void       shmring_close(shmring_t *self);
+
+#endif  /* __SHMRING_H__ */
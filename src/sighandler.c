@@ -31,6 +31,8 @@
 
 #ifndef _WIN32
 void _sig_hup(int signo);
+void _sig_usr1(int signo);
+void _sig_usr2(int signo);
 void _sig_die(int signo);
 void _sig_ignore(int signo);
 #endif
@@ -39,6 +41,8 @@ void sighandler_initialize(void)
 {
 #ifndef _WIN32
     signal(SIGHUP, _sig_hup);
+    signal(SIGUSR1, _sig_usr1);
+    signal(SIGUSR2, _sig_usr2);
     signal(SIGINT, _sig_die);
     signal(SIGTERM, _sig_die);
     signal(SIGPIPE, SIG_IGN);
@@ -64,6 +68,28 @@ void _sig_hup(int signo)
     signal(SIGHUP, _sig_hup);
 }
 
+void _sig_usr1(int signo)
+{
+    ICECAST_LOG_INFO("Caught signal %d, scheduling flight recorder dump...", signo);
+
+    global_lock();
+    global . schedule_flightrec_dump = 1;
+    global_unlock();
+
+    signal(SIGUSR1, _sig_usr1);
+}
+
+void _sig_usr2(int signo)
+{
+    ICECAST_LOG_INFO("Caught signal %d, scheduling upgrade to a new process...", signo);
+
+    global_lock();
+    global . schedule_upgrade = 1;
+    global_unlock();
+
+    signal(SIGUSR2, _sig_usr2);
+}
+
 void _sig_die(int signo)
 {
     ICECAST_LOG_INFO("Caught signal %d, shutting down...", signo);
@@ -31,8 +31,10 @@
 #ifndef _WIN32
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <strings.h>
 #else
 #include <winsock2.h>
+#define strncasecmp strnicmp
 #endif
 
 #include "compat.h"
@@ -42,6 +44,7 @@
 #include "common/avl/avl.h"
 #include "common/net/sock.h"
 #include "common/httpp/httpp.h"
+#include "common/timing/timing.h"
 
 #include "slave.h"
 #include "cfgfile.h"
@@ -53,11 +56,31 @@
 #include "stats.h"
 #include "logging.h"
 #include "source.h"
+#include "sourceloop.h"
 #include "format.h"
 #include "prng.h"
+#include "fdpoll.h"
+#include "cluster.h"
+#include "upgrade.h"
+#include "flightrec.h"
+#include "memgov.h"
+#include "relaymux.h"
 
 #define CATMODULE "slave"
 
+/* ms the relay connector gives an upstream to accept the connection */
+#define RELAY_CONNECT_TIMEOUT       10000
+#define RELAY_CONNECT_POLL_MS       100
+#define RELAY_CONNECT_MAX_EVENTS    64
+/* seconds until another standby connection is tried after one failed */
+#define RELAY_STANDBY_RETRY         10
+
+/* seconds the master may hold back a request for changes of the stream list */
+#define MASTER_WAIT                 30
+#define MASTER_POLL_MS              500
+/* seconds the master may pause while sending the stream list */
+#define MASTER_READ_TIMEOUT         10
+
 struct relay_tag {
     relay_config_t *config;
     source_t *source;
@@ -66,6 +89,16 @@ struct relay_tag {
     time_t start;
     thread_type *thread;
     relay_t *next;
+
+    /* the upstream in use, and with <standby> a connection to another one
+     * that is switched to once the input is lost. Both are protected by
+     * relay_standby_mutex. */
+    size_t upstream;
+    client_t *standby;
+    size_t standby_upstream;
+    /* set while the relay connector makes the standby connection */
+    volatile int standby_pending;
+    time_t standby_retry;
 };
 
 static void *_slave_thread(void *arg);
@@ -74,7 +107,31 @@ static int slave_running = 0;
 static volatile int update_settings = 0;
 static volatile int update_all_mounts = 0;
 static volatile unsigned int max_interval = 0;
-static mutex_t _slave_mutex; // protects slave_running, update_settings, update_all_mounts, max_interval
+/* mounts to recheck after an incremental reload, see slave_update_mounts() */
+static char **update_mounts = NULL;
+static size_t update_mounts_length = 0;
+static mutex_t _slave_mutex; // protects slave_running, update_settings, update_all_mounts, max_interval, update_mounts
+
+/* NULL if the relay connector is not running */
+static fdpoll_t *relay_connect_poll;
+static int relay_connect_header_timeout;
+static void relay_connect_initialize(void);
+static void relay_connect_shutdown(void);
+static mutex_t relay_standby_mutex;
+
+/* the stream list of the master, kept by the master thread */
+static void *_master_thread(void *arg);
+static int master_streams_free(void *key);
+static thread_type *_master_thread_id;
+static volatile int master_running = 0;
+static mutex_t _master_mutex; // protects all but master_etag below
+static avl_tree *master_streams; /* NULL until the first list is fetched */
+static char *master_server;
+static int master_server_port;
+static int master_streams_changed = 0;
+static int master_fetch_now = 0;
+/* ETag of master_streams, only used by the master thread */
+static char master_etag[64];
 
 static inline void relay_config_upstream_free (relay_config_upstream_t *upstream)
 {
@@ -160,6 +217,9 @@ static inline relay_config_t *relay_config_copy (relay_config_t *r)
 
     copy->localmount = (char *)xmlCharStrdup(r->localmount);
     copy->on_demand = r->on_demand;
+    copy->on_demand_linger = r->on_demand_linger;
+    copy->standby = r->standby;
+    copy->mux = r->mux;
 
     relay_config_upstream_copy(&(copy->upstream_default), &(r->upstream_default));
 
@@ -199,6 +259,56 @@ void slave_update_all_mounts(void)
 }
 
 
+/* Request slave thread to only update the given mounts, as found to have
+ * changed by config_diff(). Takes ownership of mounts and its strings.
+ */
+void slave_update_mounts(char **mounts, size_t mounts_length, bool rescan_relays)
+{
+    char **n;
+    size_t i;
+
+    thread_mutex_lock(&_slave_mutex);
+    if (rescan_relays)
+        max_interval = 0;
+
+    if (mounts_length && !update_all_mounts) {
+        if (!update_mounts) {
+            update_mounts = mounts;
+            update_mounts_length = mounts_length;
+            mounts = NULL;
+            mounts_length = 0;
+        } else {
+            n = realloc(update_mounts, sizeof(*n) * (update_mounts_length + mounts_length));
+            if (n) {
+                memcpy(n + update_mounts_length, mounts, sizeof(*n) * mounts_length);
+                update_mounts = n;
+                update_mounts_length += mounts_length;
+                mounts_length = 0;
+            } else {
+                update_all_mounts = 1;
+                update_settings = 1;
+            }
+        }
+    }
+    thread_mutex_unlock(&_slave_mutex);
+
+    for (i = 0; i < mounts_length; i++)
+        free(mounts[i]);
+    free(mounts);
+}
+
+static void slave_clear_update_mounts(void)
+{
+    size_t i;
+
+    for (i = 0; i < update_mounts_length; i++)
+        free(update_mounts[i]);
+    free(update_mounts);
+    update_mounts = NULL;
+    update_mounts_length = 0;
+}
+
+
 /* Request slave thread to check the relay list for changes and to
  * update the stats for the current streams.
  */
@@ -218,6 +328,15 @@ void slave_initialize(void)
     slave_running = 1;
     max_interval = 0;
     thread_mutex_create (&_slave_mutex);
+    thread_mutex_create (&relay_standby_mutex);
+    relay_connect_initialize();
+
+    thread_mutex_create (&_master_mutex);
+    master_streams = NULL;
+    master_etag[0] = 0;
+    master_running = 1;
+    _master_thread_id = thread_create("Master Thread", _master_thread, NULL, THREAD_ATTACHED);
+
     _slave_thread_id = thread_create("Slave Thread", _slave_thread, NULL, THREAD_ATTACHED);
 }
 
@@ -231,55 +350,198 @@ void slave_shutdown(void)
     }
     slave_running = 0;
     thread_mutex_unlock(&_slave_mutex);
+    global_wake();
 
     ICECAST_LOG_DEBUG("waiting for slave thread");
     thread_join (_slave_thread_id);
+    slave_clear_update_mounts();
+    relay_connect_shutdown();
+    thread_mutex_destroy (&relay_standby_mutex);
+
+    ICECAST_LOG_DEBUG("waiting for master thread");
+    master_running = 0;
+    global_wake();
+    thread_join (_master_thread_id);
+    if (master_streams)
+        avl_tree_free(master_streams, master_streams_free);
+    master_streams = NULL;
+    free(master_server);
+    master_server = NULL;
+    thread_mutex_destroy (&_master_mutex);
 }
 
 
-/* Actually open the connection and do some http parsing, handle any 302
- * responses within here.
+/* Builds the request for mount on server, returns the length or -1 if it
+ * does not fit.
  */
 #define _GET_UPSTREAM_SETTING(n) ((upstream && upstream->n) ? upstream->n : relay->config->upstream_default.n)
-static client_t *open_relay_connection (relay_t *relay, relay_config_upstream_t *upstream)
+static int relay_build_request(relay_t *relay, relay_config_upstream_t *upstream, const char *server, const char *mount, char *buf, size_t len)
 {
-    int redirects = 0;
-    char *server_id = NULL;
     ice_config_t *config;
-    http_parser_t *parser = NULL;
-    connection_t *con=NULL;
-    char *server = strdup (_GET_UPSTREAM_SETTING(server));
-    char *mount = strdup (_GET_UPSTREAM_SETTING(mount));
-    int port = _GET_UPSTREAM_SETTING(port);
+    char *server_id;
     char *auth_header;
-    char header[4096];
+    int ret;
 
     config = config_get_config ();
     server_id = strdup (config->server_id);
     config_release_config ();
 
-    /* build any authentication header before connecting */
+    /* build any authentication header */
     if (_GET_UPSTREAM_SETTING(username) && _GET_UPSTREAM_SETTING(password))
     {
         char *esc_authorisation;
-        unsigned len = strlen(_GET_UPSTREAM_SETTING(username)) + strlen(_GET_UPSTREAM_SETTING(password)) + 2;
+        unsigned alen = strlen(_GET_UPSTREAM_SETTING(username)) + strlen(_GET_UPSTREAM_SETTING(password)) + 2;
 
-        auth_header = malloc (len);
-        snprintf (auth_header, len, "%s:%s", _GET_UPSTREAM_SETTING(username), _GET_UPSTREAM_SETTING(password));
-        esc_authorisation = util_base64_encode(auth_header, len);
+        auth_header = malloc (alen);
+        snprintf (auth_header, alen, "%s:%s", _GET_UPSTREAM_SETTING(username), _GET_UPSTREAM_SETTING(password));
+        esc_authorisation = util_base64_encode(auth_header, alen);
         free(auth_header);
-        len = strlen (esc_authorisation) + 24;
-        auth_header = malloc (len);
-        snprintf (auth_header, len,
+        alen = strlen (esc_authorisation) + 24;
+        auth_header = malloc (alen);
+        snprintf (auth_header, alen,
                 "Authorization: Basic %s\r\n", esc_authorisation);
         free(esc_authorisation);
     }
     else
         auth_header = strdup ("");
 
+    /* At this point we may not know if we are relaying an mp3 or vorbis
+     * stream, but only send the icy-metadata header if the relay details
+     * state so (the typical case).  It's harmless in the vorbis case. If
+     * we don't send in this header then relay will not have mp3 metadata.
+     */
+    ret = snprintf(buf, len, "GET %s HTTP/1.0\r\n"
+            "User-Agent: %s\r\n"
+            "Host: %s\r\n"
+            "Icecast-Relay: 1\r\n"
+            "%s"
+            "%s"
+            "\r\n",
+            mount,
+            server_id,
+            server,
+            _GET_UPSTREAM_SETTING(mp3metadata) ? "Icy-MetaData: 1\r\n" : "",
+            auth_header);
+
+    free (server_id);
+    free (auth_header);
+
+    if (ret <= 0 || (size_t)ret >= len)
+        return -1;
+
+    return ret;
+}
+
+/* Parses the response header of an upstream. Returns RELAY_RESPONSE_OK with
+ * *parser set, RELAY_RESPONSE_REDIRECT with server, mount and port replaced
+ * by the new location or RELAY_RESPONSE_ERROR.
+ */
+#define RELAY_RESPONSE_ERROR    -1
+#define RELAY_RESPONSE_OK       0
+#define RELAY_RESPONSE_REDIRECT 1
+static int relay_parse_response(relay_t *relay, const char *header, http_parser_t **parser_out, char **server, char **mount, int *port)
+{
+    http_parser_t *parser;
+
+    prng_write(header, strlen(header));
+    parser = httpp_create_parser();
+    httpp_initialize (parser, NULL);
+    if (! httpp_parse_response (parser, header, strlen(header), relay->config->localmount))
+    {
+        ICECAST_LOG_ERROR("Error parsing relay request for %s (%s:%d%s)", relay->config->localmount,
+                *server, *port, *mount);
+        httpp_destroy (parser);
+        return RELAY_RESPONSE_ERROR;
+    }
+    if (strcmp (httpp_getvar (parser, HTTPP_VAR_ERROR_CODE), "302") == 0)
+    {
+        /* better retry the connection again but with different details */
+        const char *uri, *mountpoint;
+        int len;
+
+        uri = httpp_getvar (parser, "location");
+        ICECAST_LOG_INFO("redirect received %s", uri);
+        if (strncmp (uri, "http://", 7) != 0)
+        {
+            httpp_destroy (parser);
+            return RELAY_RESPONSE_ERROR;
+        }
+        uri += 7;
+        mountpoint = strchr (uri, '/');
+        free (*mount);
+        if (mountpoint)
+            *mount = strdup (mountpoint);
+        else
+            *mount = strdup ("/");
+
+        len = strcspn (uri, ":/");
+        *port = 80;
+        if (uri [len] == ':')
+            *port = atoi (uri+len+1);
+        free (*server);
+        *server = calloc (1, len+1);
+        strncpy (*server, uri, len);
+        httpp_destroy (parser);
+        return RELAY_RESPONSE_REDIRECT;
+    }
+
+    if (httpp_getvar (parser, HTTPP_VAR_ERROR_MESSAGE))
+    {
+        ICECAST_LOG_ERROR("Error from relay request: %s (%s)", relay->config->localmount,
+                httpp_getvar(parser, HTTPP_VAR_ERROR_MESSAGE));
+        httpp_destroy (parser);
+        return RELAY_RESPONSE_ERROR;
+    }
+
+    *parser_out = parser;
+    return RELAY_RESPONSE_OK;
+}
+
+/* takes con and parser, also on failure */
+static client_t *relay_create_client(connection_t *con, http_parser_t *parser)
+{
+    client_t *client = NULL;
+
+    global_lock ();
+    if (client_create (&client, con, parser) < 0)
+    {
+        global_unlock ();
+        client_destroy (client);
+        return NULL;
+    }
+    global_unlock ();
+    sock_set_blocking (con->sock, 0);
+    client_set_queue (client, NULL);
+    client_complete(client);
+
+    return client;
+}
+
+/* Actually open the connection and do some http parsing, handle any 302
+ * responses within here. This blocks, it is only used if the relay
+ * connector can not run.
+ */
+static client_t *open_relay_connection (relay_t *relay, relay_config_upstream_t *upstream)
+{
+    int redirects = 0;
+    http_parser_t *parser = NULL;
+    connection_t *con=NULL;
+    char *server = strdup (_GET_UPSTREAM_SETTING(server));
+    char *mount = strdup (_GET_UPSTREAM_SETTING(mount));
+    int port = _GET_UPSTREAM_SETTING(port);
+    char request[4096];
+    char header[4096];
+
     while (redirects < 10)
     {
         sock_t streamsock;
+        int ret;
+
+        if (relay_build_request(relay, upstream, server, mount, request, sizeof(request)) < 0)
+        {
+            ICECAST_LOG_ERROR("Request for relay %s (%s:%d%s) is too long", relay->config->localmount, server, port, mount);
+            break;
+        }
 
         ICECAST_LOG_INFO("connecting to %s:%d", server, port);
 
@@ -291,204 +553,748 @@ static client_t *open_relay_connection (relay_t *relay, relay_config_upstream_t
         }
         con = connection_create(streamsock, NULL, NULL, strdup(server));
 
-        /* At this point we may not know if we are relaying an mp3 or vorbis
-         * stream, but only send the icy-metadata header if the relay details
-         * state so (the typical case).  It's harmless in the vorbis case. If
-         * we don't send in this header then relay will not have mp3 metadata.
-         */
-        sock_write(streamsock, "GET %s HTTP/1.0\r\n"
-                "User-Agent: %s\r\n"
-                "Host: %s\r\n"
-                "%s"
-                "%s"
-                "\r\n",
-                mount,
-                server_id,
-                server,
-                _GET_UPSTREAM_SETTING(mp3metadata) ? "Icy-MetaData: 1\r\n" : "",
-                auth_header);
+        sock_write_string(streamsock, request);
         memset (header, 0, sizeof(header));
         if (util_read_header (con->sock, header, 4096, READ_ENTIRE_HEADER) == 0)
         {
             ICECAST_LOG_ERROR("Header read failed for %s (%s:%d%s)", relay->config->localmount, server, port, mount);
             break;
         }
-        prng_write(header, strlen(header));
-        parser = httpp_create_parser();
-        httpp_initialize (parser, NULL);
-        if (! httpp_parse_response (parser, header, strlen(header), relay->config->localmount))
+
+        ret = relay_parse_response(relay, header, &parser, &server, &mount, &port);
+        if (ret == RELAY_RESPONSE_ERROR)
+            break;
+
+        if (ret == RELAY_RESPONSE_OK)
+        {
+            client_t *client = relay_create_client(con, parser);
+
+            free (server);
+            free (mount);
+
+            return client;
+        }
+
+        connection_close (con);
+        con = NULL;
+        redirects++;
+    }
+    /* failed, better clean up */
+    free (server);
+    free (mount);
+    if (con)
+        connection_close (con);
+    return NULL;
+}
+
+
+/* called by the source loop once a relayed source has stopped */
+static void relay_source_finished (source_t *source, void *userdata)
+{
+    relay_t *relay = userdata;
+
+    if (relay->config->on_demand == 0)
+    {
+        /* only keep refreshing YP entries for inactive on-demand relays */
+        yp_remove (relay->config->localmount);
+        source->yp_public = -1;
+        relay->start = time(NULL) + 10; /* prevent busy looping if failing */
+        slave_update_all_mounts();
+    }
+
+    /* we've finished, now get cleaned up */
+    relay->cleanup = 1;
+    slave_rebuild_mounts();
+}
+
+
+/* called by the source loop once the input of a relay with <standby> is
+ * lost, switches to the standby connection if there is one */
+static int relay_input_lost (source_t *source, void *userdata)
+{
+    relay_t *relay = userdata;
+    client_t *client;
+    size_t upstream;
+
+    thread_mutex_lock(&relay_standby_mutex);
+    client = relay->standby;
+    upstream = relay->standby_upstream;
+    relay->standby = NULL;
+    thread_mutex_unlock(&relay_standby_mutex);
+
+    if (client == NULL || !relay->running)
+    {
+        client_destroy (client);
+        return -1;
+    }
+
+    if (source_replace_input (source, client) != 0)
+    {
+        client_destroy (client);
+        return -1;
+    }
+
+    ICECAST_LOG_INFO("Relay \"%s\" switched to standby upstream #%zu", relay->config->localmount, upstream);
+    stats_global_inc(STATS_GLOBAL_SOURCE_RELAY_CONNECTIONS);
+
+    thread_mutex_lock(&relay_standby_mutex);
+    relay->upstream = upstream;
+    /* right away a standby for the new one */
+    relay->standby_retry = 0;
+    thread_mutex_unlock(&relay_standby_mutex);
+
+    return 0;
+}
+
+/* drops the standby connection of the relay */
+static void relay_standby_drop (relay_t *relay)
+{
+    client_t *client;
+
+    thread_mutex_lock(&relay_standby_mutex);
+    client = relay->standby;
+    relay->standby = NULL;
+    thread_mutex_unlock(&relay_standby_mutex);
+
+    client_destroy (client);
+}
+
+/* Reads and discards what the standby upstream sent, so it keeps sending
+ * and the stream goes on from where it is now when it is switched to. */
+static void relay_standby_drain (relay_t *relay)
+{
+    char buf[4096];
+    int failed = 0;
+
+    thread_mutex_lock(&relay_standby_mutex);
+    if (relay->standby)
+    {
+        while (1)
         {
-            ICECAST_LOG_ERROR("Error parsing relay request for %s (%s:%d%s)", relay->config->localmount,
-                    server, port, mount);
+            int ret = sock_read_bytes (relay->standby->con->sock, buf, sizeof(buf));
+
+            if (ret > 0)
+                continue;
+            if (ret < 0 && sock_recoverable (sock_error()))
+                break;
+            failed = 1;
+            break;
+        }
+    }
+    thread_mutex_unlock(&relay_standby_mutex);
+
+    if (failed)
+    {
+        ICECAST_LOG_WARN("Standby upstream of relay \"%s\" went away", relay->config->localmount);
+        relay_standby_drop (relay);
+        relay->standby_retry = time(NULL) + RELAY_STANDBY_RETRY;
+    }
+}
+
+/* Hands the source of a relay connected to its upstream over to the source
+ * loop. Returns -1 if the source could not be set up, client is freed then.
+ */
+static int relay_start_source(relay_t *relay, client_t *client)
+{
+    source_t *src = relay->source;
+
+    src->client = client;
+    src->parser = client->parser;
+    src->con = client->con;
+
+    if (connection_complete_source (src, 0) < 0)
+    {
+        ICECAST_LOG_INFO("Failed to complete source initialisation");
+        client_destroy (client);
+        src->client = NULL;
+        return -1;
+    }
+    stats_global_inc(STATS_GLOBAL_SOURCE_RELAY_CONNECTIONS);
+    stats_event (relay->config->localmount, "source_ip", client->con->ip);
+
+    src->input_lost = relay->config->standby ? relay_input_lost : NULL;
+    src->input_lost_userdata = relay;
+
+    /* the source loop takes it from here */
+    sourceloop_add (relay->source, relay_source_finished, relay);
+
+    return 0;
+}
+
+/* None of the upstreams of the relay could be used */
+static void relay_failed(relay_t *relay)
+{
+    if (relay->source->fallback_mount)
+    {
+        source_t *fallback_source;
+
+        ICECAST_LOG_DEBUG("failed relay, fallback to %s", relay->source->fallback_mount);
+        avl_tree_rlock(global.source_tree);
+        fallback_source = source_find_mount(relay->source->fallback_mount);
+
+        if (fallback_source != NULL)
+            source_move_clients(relay->source, fallback_source, NULL, NAVIGATION_DIRECTION_DOWN);
+
+        avl_tree_unlock(global.source_tree);
+    }
+
+    source_clear_source(relay->source);
+
+    /* cleanup relay, but prevent this relay from starting up again too soon.
+     * Like relay_source_finished() this is done without the relay_lock, which
+     * the slave thread may hold while it waits for cleanup. */
+    relay->source->on_demand = 0;
+    relay->start = time(NULL) + max_interval;
+    relay->cleanup = 1;
+}
+
+
+/* This does the actual connection for a relay if the relay connector is
+ * not running. A thread is started off to acquire a connection, the stream
+ * itself is then run by the source loop.
+ */
+static void *start_relay_stream (void *arg)
+{
+    relay_t *relay = arg;
+    client_t *client = NULL;
+    size_t i;
+
+    ICECAST_LOG_INFO("Starting relayed source at mountpoint \"%s\"", relay->config->localmount);
+
+    for (i = 0; i < relay->config->upstreams; i++) {
+        ICECAST_LOG_DEBUG("For relay on mount \"%s\", trying upstream #%zu", relay->config->localmount, i);
+        client = open_relay_connection(relay, &(relay->config->upstream[i]));
+        if (client)
+            break;
+    }
+
+    /* if we have no upstreams defined, use the default upstream */
+    if (!relay->config->upstreams) {
+        ICECAST_LOG_DEBUG("For relay on mount \"%s\" with no upstreams trying upstream default", relay->config->localmount);
+        client = open_relay_connection(relay, NULL);
+    }
+
+    if (client == NULL || relay_start_source(relay, client) < 0)
+        relay_failed(relay);
+
+    return NULL;
+}
+
+
+/* A relay waiting for its upstream, run by the relay connector */
+typedef enum {
+    RELAY_CONNECT_CONNECTING,
+    RELAY_CONNECT_SENDING,
+    RELAY_CONNECT_READING
+} relay_connect_state_t;
+
+typedef struct relay_connect_tag {
+    struct relay_connect_tag *next;
+    relay_t *relay;
+    /* a standby connection, not to the upstream skip_upstream */
+    int standby;
+    size_t skip_upstream;
+    /* index of the next upstream to try */
+    size_t next_upstream;
+    relay_config_upstream_t *upstream;
+    char *server;
+    char *mount;
+    int port;
+    int redirects;
+    sock_t sock;
+    relay_connect_state_t state;
+    /* ms as by timing_get_time() */
+    uint64_t deadline;
+    char request[4096];
+    size_t request_len;
+    size_t sent;
+    char header[4096];
+    size_t header_len;
+} relay_connect_t;
+
+static mutex_t relay_connect_mutex;
+/* relays handed over by relay_connect_add(), protected by relay_connect_mutex */
+static relay_connect_t *relay_connect_new;
+static volatile int relay_connect_running = 0;
+static thread_type *relay_connect_thread;
+
+static void relay_connect_close(fdpoll_t *poll, relay_connect_t *connect)
+{
+    if (connect->sock != SOCK_ERROR)
+    {
+        fdpoll_disarm(poll, connect->sock);
+        sock_close(connect->sock);
+        connect->sock = SOCK_ERROR;
+    }
+}
+
+static void relay_connect_free(fdpoll_t *poll, relay_connect_t *connect)
+{
+    relay_connect_close(poll, connect);
+    free(connect->server);
+    free(connect->mount);
+    free(connect);
+}
+
+/* Starts connecting to server, port and mount of connect. Returns -1 if the
+ * connection can not even be started. */
+static int relay_connect_start(fdpoll_t *poll, relay_connect_t *connect)
+{
+    relay_t *relay = connect->relay;
+    relay_config_upstream_t *upstream = connect->upstream;
+    int ret;
+
+    ret = relay_build_request(relay, upstream, connect->server, connect->mount, connect->request, sizeof(connect->request));
+    if (ret < 0)
+    {
+        ICECAST_LOG_ERROR("Request for relay %s (%s:%d%s) is too long", relay->config->localmount, connect->server, connect->port, connect->mount);
+        return -1;
+    }
+    connect->request_len = ret;
+    connect->sent = 0;
+    connect->header_len = 0;
+
+    ICECAST_LOG_INFO("connecting to %s:%d", connect->server, connect->port);
+
+    if (relay->config->mux && !connect->redirects)
+    {
+        ice_config_t *config = config_get_config();
+
+        /* a channel on the connection to the master, it is ready to take
+         * the request right away */
+        connect->sock = relaymux_open(connect->server, connect->port, config->master_username, config->master_password);
+        config_release_config();
+        connect->state = RELAY_CONNECT_SENDING;
+    }
+    else if (_GET_UPSTREAM_SETTING(bind))
+    {
+        /* there is no non-blocking connect with a bind address */
+        connect->sock = sock_connect_wto_bind (connect->server, connect->port, _GET_UPSTREAM_SETTING(bind), 10);
+        connect->state = RELAY_CONNECT_SENDING;
+    }
+    else
+    {
+        connect->sock = sock_connect_non_blocking (connect->server, connect->port);
+        connect->state = RELAY_CONNECT_CONNECTING;
+    }
+
+    if (connect->sock == SOCK_ERROR)
+    {
+        ICECAST_LOG_WARN("Failed to connect to %s:%d", connect->server, connect->port);
+        return -1;
+    }
+
+    sock_set_blocking (connect->sock, 0);
+    connect->deadline = timing_get_time() + RELAY_CONNECT_TIMEOUT;
+
+    if (fdpoll_arm(poll, connect->sock, FDPOLL_EVENT_WRITE, connect) != 0)
+    {
+        sock_close(connect->sock);
+        connect->sock = SOCK_ERROR;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Neither of the upstreams could be used */
+static void relay_connect_failed(relay_connect_t *connect)
+{
+    relay_t *relay = connect->relay;
+
+    if (!connect->standby)
+    {
+        relay_failed(relay);
+        return;
+    }
+
+    thread_mutex_lock(&relay_standby_mutex);
+    relay->standby_retry = time(NULL) + RELAY_STANDBY_RETRY;
+    /* the relay is not touched after this */
+    relay->standby_pending = 0;
+    thread_mutex_unlock(&relay_standby_mutex);
+}
+
+/* a standby connection is made, the relay is not touched after this */
+static void relay_connect_standby(relay_connect_t *connect, client_t *client)
+{
+    relay_t *relay = connect->relay;
+
+    thread_mutex_lock(&relay_standby_mutex);
+    if (relay->running && !relay->cleanup && relay->standby == NULL)
+    {
+        ICECAST_LOG_INFO("Relay \"%s\" has upstream #%zu on standby", relay->config->localmount, connect->next_upstream - 1);
+        relay->standby = client;
+        relay->standby_upstream = connect->next_upstream - 1;
+        client = NULL;
+    }
+    relay->standby_pending = 0;
+    thread_mutex_unlock(&relay_standby_mutex);
+
+    client_destroy (client);
+}
+
+/* Moves on to the next upstream of the relay, returns -1 if there is none left */
+static int relay_connect_next(fdpoll_t *poll, relay_connect_t *connect)
+{
+    relay_t *relay = connect->relay;
+
+    relay_connect_close(poll, connect);
+
+    while (1)
+    {
+        relay_config_upstream_t *upstream;
+
+        if (relay->config->upstreams)
+        {
+            if (connect->standby && connect->next_upstream == connect->skip_upstream)
+                connect->next_upstream++;
+            if (connect->next_upstream >= relay->config->upstreams)
+                return -1;
+            ICECAST_LOG_DEBUG("For relay on mount \"%s\", trying upstream #%zu", relay->config->localmount, connect->next_upstream);
+            upstream = &(relay->config->upstream[connect->next_upstream]);
+        }
+        else
+        {
+            /* if we have no upstreams defined, use the default upstream */
+            if (connect->next_upstream)
+                return -1;
+            ICECAST_LOG_DEBUG("For relay on mount \"%s\" with no upstreams trying upstream default", relay->config->localmount);
+            upstream = NULL;
+        }
+        connect->next_upstream++;
+
+        free(connect->server);
+        free(connect->mount);
+        connect->upstream = upstream;
+        connect->server = strdup (_GET_UPSTREAM_SETTING(server));
+        connect->mount = strdup (_GET_UPSTREAM_SETTING(mount));
+        connect->port = _GET_UPSTREAM_SETTING(port);
+        connect->redirects = 0;
+
+        if (relay_connect_start(poll, connect) == 0)
+            return 0;
+    }
+}
+
+/* Handles the response header. Returns 1 if the relay is done with, either
+ * started or failed, and 0 if it goes on with another connection. */
+static int relay_connect_response(fdpoll_t *poll, relay_connect_t *connect)
+{
+    relay_t *relay = connect->relay;
+    http_parser_t *parser = NULL;
+    connection_t *con;
+    client_t *client;
+    int ret;
+
+    ret = relay_parse_response(relay, connect->header, &parser, &connect->server, &connect->mount, &connect->port);
+    if (ret == RELAY_RESPONSE_REDIRECT && ++connect->redirects < 10)
+    {
+        relay_connect_close(poll, connect);
+        if (relay_connect_start(poll, connect) == 0)
+            return 0;
+    }
+
+    if (ret != RELAY_RESPONSE_OK)
+    {
+        if (relay_connect_next(poll, connect) == 0)
+            return 0;
+        relay_connect_failed(connect);
+        return 1;
+    }
+
+    fdpoll_disarm(poll, connect->sock);
+    con = connection_create(connect->sock, NULL, NULL, strdup(connect->server));
+    connect->sock = SOCK_ERROR;
+
+    client = relay_create_client(con, parser);
+    if (client == NULL)
+    {
+        if (relay_connect_next(poll, connect) == 0)
+            return 0;
+        relay_connect_failed(connect);
+        return 1;
+    }
+
+    if (connect->standby)
+    {
+        relay_connect_standby(connect, client);
+        return 1;
+    }
+
+    relay->upstream = connect->next_upstream - 1;
+    if (relay_start_source(relay, client) < 0)
+        relay_failed(relay);
+
+    return 1;
+}
+
+/* Moves the relay on as far as its socket allows. Returns 1 if it is done
+ * with, 0 if it still waits for the upstream. */
+static int relay_connect_process(fdpoll_t *poll, relay_connect_t *connect)
+{
+    relay_t *relay = connect->relay;
+    int ret;
+
+    if (connect->state == RELAY_CONNECT_CONNECTING)
+    {
+        ret = sock_connected(connect->sock, 0);
+        if (ret == SOCK_ERROR)
+        {
+            ICECAST_LOG_WARN("Failed to connect to %s:%d", connect->server, connect->port);
+            goto next;
+        }
+        if (ret != 1)
+            return 0;
+        connect->state = RELAY_CONNECT_SENDING;
+    }
+
+    if (connect->state == RELAY_CONNECT_SENDING)
+    {
+        while (connect->sent < connect->request_len)
+        {
+            ret = sock_write_bytes(connect->sock, connect->request + connect->sent, connect->request_len - connect->sent);
+            if (ret < 0 && sock_recoverable(sock_error()))
+                return 0;
+            if (ret <= 0)
+            {
+                ICECAST_LOG_WARN("Failed to send request to %s:%d", connect->server, connect->port);
+                goto next;
+            }
+            connect->sent += ret;
+        }
+
+        connect->state = RELAY_CONNECT_READING;
+        connect->deadline = timing_get_time() + relay_connect_header_timeout * 1000;
+        if (fdpoll_arm(poll, connect->sock, FDPOLL_EVENT_READ, connect) != 0)
+            goto next;
+    }
+
+    /* byte by byte like util_read_header(), so nothing of the stream after
+     * the header is taken */
+    while (connect->header_len < (sizeof(connect->header) - 1))
+    {
+        char c;
+
+        ret = sock_read_bytes(connect->sock, &c, 1);
+        if (ret < 0 && sock_recoverable(sock_error()))
+            return 0;
+        if (ret <= 0)
             break;
+
+        if (c == '\r')
+            continue;
+        connect->header[connect->header_len++] = c;
+        if (connect->header_len > 1 && connect->header[connect->header_len - 1] == '\n' && connect->header[connect->header_len - 2] == '\n')
+        {
+            connect->header[connect->header_len] = 0;
+            return relay_connect_response(poll, connect);
         }
-        if (strcmp (httpp_getvar (parser, HTTPP_VAR_ERROR_CODE), "302") == 0)
+    }
+
+    ICECAST_LOG_ERROR("Header read failed for %s (%s:%d%s)", relay->config->localmount, connect->server, connect->port, connect->mount);
+
+next:
+    if (relay_connect_next(poll, connect) == 0)
+        return 0;
+    relay_connect_failed(connect);
+    return 1;
+}
+
+static void *relay_connect_run(void *arg)
+{
+    fdpoll_t *poll = arg;
+    relay_connect_t *active = NULL;
+    fdpoll_result_t results[RELAY_CONNECT_MAX_EVENTS];
+
+    ICECAST_LOG_INFO("Relay connector started");
+
+    while (relay_connect_running || active)
+    {
+        relay_connect_t **prev;
+        relay_connect_t *connect;
+        ssize_t count;
+        ssize_t i;
+        uint64_t now;
+
+        thread_mutex_lock(&relay_connect_mutex);
+        connect = relay_connect_new;
+        relay_connect_new = NULL;
+        thread_mutex_unlock(&relay_connect_mutex);
+
+        while (connect)
         {
-            /* better retry the connection again but with different details */
-            const char *uri, *mountpoint;
-            int len;
+            relay_connect_t *next = connect->next;
 
-            uri = httpp_getvar (parser, "location");
-            ICECAST_LOG_INFO("redirect received %s", uri);
-            if (strncmp (uri, "http://", 7) != 0)
-                break;
-            uri += 7;
-            mountpoint = strchr (uri, '/');
-            free (mount);
-            if (mountpoint)
-                mount = strdup (mountpoint);
+            if (connect->standby)
+                ICECAST_LOG_DEBUG("Connecting standby upstream for mountpoint \"%s\"", connect->relay->config->localmount);
             else
-                mount = strdup ("/");
-
-            len = strcspn (uri, ":/");
-            port = 80;
-            if (uri [len] == ':')
-                port = atoi (uri+len+1);
-            free (server);
-            server = calloc (1, len+1);
-            strncpy (server, uri, len);
-            connection_close (con);
-            httpp_destroy (parser);
-            con = NULL;
-            parser = NULL;
+                ICECAST_LOG_INFO("Starting relayed source at mountpoint \"%s\"", connect->relay->config->localmount);
+            if (relay_connect_next(poll, connect) == 0)
+            {
+                connect->next = active;
+                active = connect;
+            }
+            else
+            {
+                relay_connect_failed(connect);
+                relay_connect_free(poll, connect);
+            }
+            connect = next;
         }
-        else
+
+        count = fdpoll_wait(poll, RELAY_CONNECT_POLL_MS, results, RELAY_CONNECT_MAX_EVENTS);
+        for (i = 0; i < count; i++)
         {
-            client_t *client = NULL;
+            connect = results[i].userdata;
+            if (relay_connect_process(poll, connect))
+                connect->relay = NULL;
+        }
 
-            if (httpp_getvar (parser, HTTPP_VAR_ERROR_MESSAGE))
+        /* drop the ones done with, time out the ones that take too long */
+        now = timing_get_time();
+        prev = &active;
+        while ((connect = *prev))
+        {
+            if (connect->relay && (!connect->relay->running || !relay_connect_running))
             {
-                ICECAST_LOG_ERROR("Error from relay request: %s (%s)", relay->config->localmount,
-                        httpp_getvar(parser, HTTPP_VAR_ERROR_MESSAGE));
-                break;
+                ICECAST_LOG_INFO("Giving up on relay \"%s\"", connect->relay->config->localmount);
+                relay_connect_close(poll, connect);
+                relay_connect_failed(connect);
+                connect->relay = NULL;
             }
-            global_lock ();
-            if (client_create (&client, con, parser) < 0)
+            else if (connect->relay && now >= connect->deadline)
             {
-                global_unlock ();
-                /* make sure only the client_destroy frees these */
-                con = NULL;
-                parser = NULL;
-                client_destroy (client);
-                break;
+                ICECAST_LOG_WARN("Upstream %s:%d of relay \"%s\" timed out", connect->server, connect->port, connect->relay->config->localmount);
+                if (relay_connect_next(poll, connect) != 0)
+                {
+                    relay_connect_failed(connect);
+                    connect->relay = NULL;
+                }
             }
-            global_unlock ();
-            sock_set_blocking (streamsock, 0);
-            client_set_queue (client, NULL);
-            client_complete(client);
-            free (server);
-            free (mount);
-            free (server_id);
-            free (auth_header);
 
-            return client;
+            if (!connect->relay)
+            {
+                *prev = connect->next;
+                relay_connect_free(poll, connect);
+                continue;
+            }
+            prev = &(connect->next);
         }
-        redirects++;
     }
-    /* failed, better clean up */
-    free (server);
-    free (mount);
-    free (server_id);
-    free (auth_header);
-    if (con)
-        connection_close (con);
-    if (parser)
-        httpp_destroy (parser);
+
+    ICECAST_LOG_INFO("Relay connector stopped");
     return NULL;
 }
 
-
-/* This does the actual connection for a relay. A thread is
- * started off if a connection can be acquired
- */
-static void *start_relay_stream (void *arg)
+static void relay_connect_initialize(void)
 {
-    relay_t *relay = arg;
-    source_t *src = relay->source;
-    client_t *client;
+    fdpoll_t *poll;
+    ice_config_t *config;
 
-    ICECAST_LOG_INFO("Starting relayed source at mountpoint \"%s\"", relay->config->localmount);
-    do
+    config = config_get_config();
+    relay_connect_header_timeout = config->header_timeout;
+    config_release_config();
+
+    poll = fdpoll_new();
+    if (!poll)
     {
-        size_t i;
+        ICECAST_LOG_WARN("No poll backend, relays connect with a thread each");
+        return;
+    }
 
-        for (i = 0; i < relay->config->upstreams; i++) {
-            ICECAST_LOG_DEBUG("For relay on mount \"%s\", trying upstream #%zu", relay->config->localmount, i);
-            client = open_relay_connection(relay, &(relay->config->upstream[i]));
-            if (client)
-                break;
-        }
+    thread_mutex_create(&relay_connect_mutex);
+    relay_connect_new = NULL;
+    relay_connect_running = 1;
+    relay_connect_thread = thread_create("Relay Connector", relay_connect_run, poll, THREAD_ATTACHED);
+    if (!relay_connect_thread)
+    {
+        relay_connect_running = 0;
+        thread_mutex_destroy(&relay_connect_mutex);
+        fdpoll_free(poll);
+        relay_connect_poll = NULL;
+        return;
+    }
+    relay_connect_poll = poll;
+}
 
-        /* if we have no upstreams defined, use the default upstream */
-        if (!relay->config->upstreams) {
-            ICECAST_LOG_DEBUG("For relay on mount \"%s\" with no upstreams trying upstream default", relay->config->localmount);
-            client = open_relay_connection(relay, NULL);
-        }
+static void relay_connect_shutdown(void)
+{
+    if (!relay_connect_poll)
+        return;
 
-        if (client == NULL)
-            continue;
+    relay_connect_running = 0;
+    thread_join(relay_connect_thread);
+    relay_connect_thread = NULL;
 
-        src->client = client;
-        src->parser = client->parser;
-        src->con = client->con;
+    /* nothing can be added anymore, the slave thread is gone */
+    while (relay_connect_new)
+    {
+        relay_connect_t *connect = relay_connect_new;
 
-        if (connection_complete_source (src, 0) < 0)
-        {
-            ICECAST_LOG_INFO("Failed to complete source initialisation");
-            client_destroy (client);
-            src->client = NULL;
-            continue;
-        }
-        stats_event_inc(NULL, "source_relay_connections");
-        stats_event (relay->config->localmount, "source_ip", client->con->ip);
+        relay_connect_new = connect->next;
+        relay_connect_failed(connect);
+        relay_connect_free(relay_connect_poll, connect);
+    }
 
-        source_main (relay->source);
+    thread_mutex_destroy(&relay_connect_mutex);
+    fdpoll_free(relay_connect_poll);
+    relay_connect_poll = NULL;
+}
 
-        if (relay->config->on_demand == 0)
-        {
-            /* only keep refreshing YP entries for inactive on-demand relays */
-            yp_remove (relay->config->localmount);
-            relay->source->yp_public = -1;
-            relay->start = time(NULL) + 10; /* prevent busy looping if failing */
-            slave_update_all_mounts();
-        }
+/* Hands the relay to the relay connector, returns -1 if it is not running.
+ * With standby set a standby connection is made for the running relay. */
+static int relay_connect_add(relay_t *relay, int standby)
+{
+    relay_connect_t *connect;
 
-        /* we've finished, now get cleaned up */
-        relay->cleanup = 1;
-        slave_rebuild_mounts();
+    if (!relay_connect_poll)
+        return -1;
 
-        return NULL;
-    } while (0); /* TODO allow looping through multiple servers */
+    connect = calloc(1, sizeof(*connect));
+    if (!connect)
+        return -1;
 
-    if (relay->source->fallback_mount)
+    connect->relay = relay;
+    connect->sock = SOCK_ERROR;
+    if (standby)
     {
-        source_t *fallback_source;
+        connect->standby = 1;
+        connect->skip_upstream = relay->upstream;
+        relay->standby_pending = 1;
+    }
 
-        ICECAST_LOG_DEBUG("failed relay, fallback to %s", relay->source->fallback_mount);
-        avl_tree_rlock(global.source_tree);
-        fallback_source = source_find_mount(relay->source->fallback_mount);
+    thread_mutex_lock(&relay_connect_mutex);
+    connect->next = relay_connect_new;
+    relay_connect_new = connect;
+    thread_mutex_unlock(&relay_connect_mutex);
 
-        if (fallback_source != NULL)
-            source_move_clients(relay->source, fallback_source, NULL, NAVIGATION_DIRECTION_DOWN);
+    return 0;
+}
 
-        avl_tree_unlock(global.source_tree);
+
+/* keeps the standby connection of a running relay */
+static void relay_check_standby (relay_t *relay)
+{
+    if (!relay->config->standby || !relay->running || relay->cleanup || !relay->source->running)
+    {
+        relay_standby_drop (relay);
+        return;
     }
 
-    source_clear_source(relay->source);
+    if (relay->standby)
+    {
+        relay_standby_drain (relay);
+        return;
+    }
 
-    /* cleanup relay, but prevent this relay from starting up again too soon */
-    thread_mutex_lock(&_slave_mutex);
-    thread_mutex_lock(&(config_locks()->relay_lock));
-    relay->source->on_demand = 0;
-    relay->start = time(NULL) + max_interval;
-    relay->cleanup = 1;
-    thread_mutex_unlock(&(config_locks()->relay_lock));
-    thread_mutex_unlock(&_slave_mutex);
+    /* there has to be another upstream to be on standby */
+    if (relay->config->upstreams < 2 || relay->standby_pending || relay->standby_retry > time(NULL))
+        return;
 
-    return NULL;
+    relay_connect_add (relay, 1);
 }
 
-
 /* wrapper for starting the provided relay stream */
 static void check_relay_stream (relay_t *relay)
 {
@@ -510,6 +1316,8 @@ static void check_relay_stream (relay_t *relay)
                 ice_config_t *config = config_get_config ();
                 mount_proxy *mountinfo = config_find_mount (config, relay->config->localmount, MOUNT_TYPE_NORMAL);
                 relay->source->on_demand = relay->config->on_demand;
+                relay->source->on_demand_linger = relay->config->on_demand_linger;
+                source_fallback_changed();
                 if (mountinfo == NULL)
                     source_update_settings (config, relay->source, mountinfo);
                 config_release_config ();
@@ -527,6 +1335,9 @@ static void check_relay_stream (relay_t *relay)
             return;
         }
     }
+    if (relay->standby || relay->config->standby)
+        relay_check_standby (relay);
+
     do
     {
         source_t *source = relay->source;
@@ -537,6 +1348,8 @@ static void check_relay_stream (relay_t *relay)
         if (relay->config->on_demand && source->on_demand_req == 0)
         {
             relay->source->on_demand = relay->config->on_demand;
+            relay->source->on_demand_linger = relay->config->on_demand_linger;
+            source_fallback_changed();
 
             if (source->fallback_mount && source->fallback_override != FALLBACK_OVERRIDE_NONE)
             {
@@ -556,8 +1369,9 @@ static void check_relay_stream (relay_t *relay)
 
         relay->start = time(NULL) + 5;
         relay->running = 1;
-        relay->thread = thread_create ("Relay Thread", start_relay_stream,
-                relay, THREAD_ATTACHED);
+        if (relay_connect_add(relay, 0) != 0)
+            relay->thread = thread_create ("Relay Thread", start_relay_stream,
+                    relay, THREAD_ATTACHED);
         return;
 
     } while (0);
@@ -632,6 +1446,9 @@ static int relay_has_changed (const relay_config_t *new, relay_config_t *old)
 
     /* Why do we do this here? */
     old->on_demand = new->on_demand;
+    old->on_demand_linger = new->on_demand_linger;
+    old->standby = new->standby;
+    old->mux = new->mux;
 
     return 0;
 }
@@ -718,11 +1535,20 @@ static void relay_check_streams (relay_t *to_start,
                 ICECAST_LOG_DEBUG("source shutdown request on \"%s\"", to_free->config->localmount);
                 to_free->running = 0;
                 to_free->source->running = 0;
-                thread_join (to_free->thread);
+                if (to_free->thread)
+                    thread_join (to_free->thread);
+                /* the source may still be run by the source loop */
+                while (!to_free->cleanup)
+                    thread_sleep (10000);
             }
             else
                 stats_event (to_free->config->localmount, NULL, NULL);
         }
+        /* a standby connected from now on is closed by the relay connector */
+        to_free->running = 0;
+        while (to_free->standby_pending)
+            thread_sleep (10000);
+        relay_standby_drop (to_free);
         to_free = relay_free (to_free);
     }
 
@@ -737,39 +1563,156 @@ static void relay_check_streams (relay_t *to_start,
 }
 
 
-static int update_from_master(ice_config_t *config)
+/* builds the relay for a line of the stream list of the master */
+static relay_config_t *master_relay_config(const char *line, const char *master, int port, int on_demand, unsigned int on_demand_linger, int mux)
+{
+    relay_config_t *c;
+    xmlURIPtr parsed_uri = xmlParseURI(line);
+
+    if (parsed_uri == NULL) {
+        ICECAST_LOG_DEBUG("Error while parsing line from master. Ignoring line.");
+        return NULL;
+    }
+
+    c = calloc(1, sizeof(*c));
+    if (c) {
+        if (parsed_uri->server != NULL) {
+            c->upstream_default.server = (char *)xmlCharStrdup(parsed_uri->server);
+            if (parsed_uri->port == 0) {
+                c->upstream_default.port = 80;
+            } else {
+                c->upstream_default.port = parsed_uri->port;
+            }
+        } else {
+            c->upstream_default.server = (char *)xmlCharStrdup(master);
+            c->upstream_default.port = port;
+            c->mux = mux;
+        }
+        if (parsed_uri->user && strchr(parsed_uri->user, ':')) {
+            char *pw;
+
+            c->upstream_default.username = (char *)xmlCharStrdup(parsed_uri->user);
+            pw = strchr(c->upstream_default.username, ':');
+            if (pw) {
+                *(pw++) = 0;
+                c->upstream_default.password = (char *)xmlCharStrdup(pw);
+            }
+        }
+
+        c->upstream_default.mount = (char *)xmlCharStrdup(parsed_uri->path);
+        c->localmount = (char *)xmlCharStrdup(parsed_uri->path);
+        c->upstream_default.mp3metadata = 1;
+        c->on_demand = on_demand;
+        c->on_demand_linger = on_demand_linger;
+        ICECAST_LOG_DEBUG("Added relay host=\"%s\", port=%d, mount=\"%s\"", c->upstream_default.server, c->upstream_default.port, c->upstream_default.mount);
+    }
+    xmlFreeURI(parsed_uri);
+
+    return c;
+}
+
+static int master_streams_compare(void *arg, void *a, void *b)
+{
+    (void)arg;
+    return strcmp((const char *)a, (const char *)b);
+}
+
+static int master_streams_free(void *key)
+{
+    free(key);
+    return 1;
+}
+
+static void master_streams_add(avl_tree *streams, const char *line)
+{
+    void *found;
+
+    if (avl_get_by_key(streams, (void *)line, &found) == 0)
+        return;
+    avl_insert(streams, strdup(line));
+}
+
+/* a change of the stream list as read from the master, "+mount" or "-mount" */
+typedef struct master_change_tag {
+    struct master_change_tag *next;
+    char line[];
+} master_change_t;
+
+static void master_changes_free(master_change_t *changes)
+{
+    while (changes) {
+        master_change_t *next = changes->next;
+
+        free(changes);
+        changes = next;
+    }
+}
+
+/* Waits for the master to answer, up to timeout seconds. Returns 0 once
+ * there is something to read. */
+static int master_wait(fdpoll_t *poll, sock_t sock, unsigned int timeout)
+{
+    time_t deadline = time(NULL) + timeout;
+    fdpoll_result_t result;
+    int ret = -1;
+
+    if (fdpoll_arm(poll, sock, FDPOLL_EVENT_READ, NULL) != 0)
+        return 0;
+
+    while (master_running && time(NULL) < deadline) {
+        ssize_t count = fdpoll_wait(poll, MASTER_POLL_MS, &result, 1);
+
+        if (count > 0) {
+            ret = 0;
+            break;
+        }
+        if (count < 0)
+            break;
+    }
+
+    fdpoll_disarm(poll, sock);
+    return ret;
+}
+
+/* Fetches the stream list from the master, or only the changes to the list
+ * fetched last. Returns 1 if the master can be asked for the changes next,
+ * 0 if it only sends full lists and -1 on error.
+ */
+static int master_fetch(fdpoll_t *poll)
 {
+    ice_config_t *config;
     char *master = NULL, *password = NULL, *username= NULL;
     int port;
     sock_t mastersock;
-    int ret = 0;
+    int ret = -1;
     char buf[256];
-    do
-    {
-        char *authheader, *data;
-        relay_t *cleanup_relays;
-        relay_config_t **new_relays = NULL;
-        size_t new_relays_length = 0;
-        int len, count = 1;
-        int on_demand;
-        size_t i;
-
-        username = strdup(config->master_username);
-        if (config->master_password)
-            password = strdup(config->master_password);
-
-        if (config->master_server)
-            master = strdup(config->master_server);
+    char etag[sizeof(master_etag)] = "";
+    int delta = 0;
+    int count = 1;
+    char *authheader, *data;
+    avl_tree *lines = NULL;
+    master_change_t *changes = NULL;
+    master_change_t **changes_tail = &changes;
+    long long content_length = -1;
+    long long body_length = 0;
+    int complete;
+    int len;
 
-        port = config->master_server_port;
+    config = config_get_config();
+    username = strdup(config->master_username);
+    if (config->master_password)
+        password = strdup(config->master_password);
+    if (config->master_server)
+        master = strdup(config->master_server);
+    port = config->master_server_port;
+    config_release_config();
 
+    do
+    {
         if (password == NULL || master == NULL || port == 0)
             break;
-        on_demand = config->on_demand;
-        ret = 1;
-        config_release_config();
-        mastersock = sock_connect_wto(master, port, 10);
 
+        mastersock = sock_connect_wto(master, port, 10);
         if (mastersock == SOCK_ERROR)
         {
             ICECAST_LOG_WARN("Relay slave failed to contact master server to fetch stream list");
@@ -780,13 +1723,32 @@ static int update_from_master(ice_config_t *config)
         authheader = malloc(len);
         snprintf (authheader, len, "%s:%s", username, password);
         data = util_base64_encode(authheader, len);
-        sock_write (mastersock,
-                "GET /admin/streamlist.txt HTTP/1.0\r\n"
-                "Authorization: Basic %s\r\n"
-                "\r\n", data);
+        if (master_etag[0])
+        {
+            /* the master holds this back until there are changes */
+            sock_write (mastersock,
+                    "GET /admin/streamlist.txt?since=%s&wait=%d HTTP/1.0\r\n"
+                    "Authorization: Basic %s\r\n"
+                    "\r\n", master_etag, poll ? MASTER_WAIT : 0, data);
+        }
+        else
+        {
+            sock_write (mastersock,
+                    "GET /admin/streamlist.txt HTTP/1.0\r\n"
+                    "Authorization: Basic %s\r\n"
+                    "\r\n", data);
+        }
         free(authheader);
         free(data);
 
+        if (poll && master_wait(poll, mastersock, MASTER_WAIT + 10) != 0)
+        {
+            sock_close (mastersock);
+            if (master_running)
+                ICECAST_LOG_WARN("Master did not answer streamlist request");
+            break;
+        }
+
         if (sock_read_line(mastersock, buf, sizeof(buf)) == 0 ||
                 ((strncmp (buf, "HTTP/1.0 200", 12) != 0) && (strncmp (buf, "HTTP/1.1 200", 12) != 0)))
         {
@@ -794,7 +1756,7 @@ static int update_from_master(ice_config_t *config)
             ICECAST_LOG_WARN("Master rejected streamlist request");
             break;
         } else {
-            ICECAST_LOG_INFO("Master accepted streamlist request");
+            ICECAST_LOG_DEBUG("Master accepted streamlist request");
         }
 
         while (sock_read_line(mastersock, buf, sizeof(buf))) {
@@ -802,78 +1764,106 @@ static int update_from_master(ice_config_t *config)
             if (!len)
                 break;
             prng_write(buf, len);
+
+            if (strncasecmp(buf, "ETag:", 5) == 0) {
+                const char *value = buf + 5 + strspn(buf + 5, " \"");
+
+                snprintf(etag, sizeof(etag), "%.*s", (int)strcspn(value, "\" "), value);
+            } else if (strncasecmp(buf, "Icecast-Streamlist:", 19) == 0) {
+                delta = strstr(buf + 19, "delta") != NULL;
+            } else if (strncasecmp(buf, "Content-Length:", 15) == 0) {
+                content_length = strtoll(buf + 15, NULL, 10);
+            }
         }
+
+        /* masters that do not know of deltas send the full list anyway */
+        if (!master_etag[0] || !etag[0])
+            delta = 0;
+
+        /* all of it is read before anything is applied, without holding
+         * the lock, and a master that stops sending is given up on */
+        util_set_read_timeout(mastersock, MASTER_READ_TIMEOUT);
+        if (!delta)
+            lines = avl_tree_new(master_streams_compare, NULL);
         while (sock_read_line(mastersock, buf, sizeof(buf))) {
             size_t len = strlen(buf);
-            relay_config_t *c = NULL;
-            relay_config_t **n;
 
+            /* every line ends in CRLF */
+            body_length += len + 2;
             if (!len)
                 continue;
             prng_write(buf, len);
 
-            ICECAST_LOG_DEBUG("read %d from master \"%s\"", count++, buf);
-            xmlURIPtr parsed_uri = xmlParseURI(buf);
-            if (parsed_uri == NULL) {
-                ICECAST_LOG_DEBUG("Error while parsing line from master. Ignoring line.");
-                continue;
-            }
-
-            n = realloc(new_relays, sizeof(*new_relays)*(new_relays_length + 1));
-            if (n) {
-                new_relays = n;
-
-                c = calloc(1, sizeof(*c));
-                new_relays[new_relays_length++] = c;
-            }
-
-            if (c) {
-                if (parsed_uri->server != NULL) {
-                    c->upstream_default.server = (char *)xmlCharStrdup(parsed_uri->server);
-                    if (parsed_uri->port == 0) {
-                        c->upstream_default.port = 80;
-                    } else {
-                        c->upstream_default.port = parsed_uri->port;
-                    }
-                } else {
-                    c->upstream_default.server = (char *)xmlCharStrdup(master);
-                    c->upstream_default.port = port;
-                }
-                if (parsed_uri->user && strchr(parsed_uri->user, ':')) {
-                    char *pw;
-
-                    c->upstream_default.username = (char *)xmlCharStrdup(parsed_uri->user);
-                    pw = strchr(c->upstream_default.username, ':');
-                    if (pw) {
-                        *(pw++) = 0;
-                        c->upstream_default.password = (char *)xmlCharStrdup(pw);
-                    }
-                }
-
-                c->upstream_default.mount = (char *)xmlCharStrdup(parsed_uri->path);
-                c->localmount = (char *)xmlCharStrdup(parsed_uri->path);
-                c->upstream_default.mp3metadata = 1;
-                c->on_demand = on_demand;
-                ICECAST_LOG_DEBUG("Added relay host=\"%s\", port=%d, mount=\"%s\"", c->upstream_default.server, c->upstream_default.port, c->upstream_default.mount);
+            if (lines) {
+                ICECAST_LOG_DEBUG("read %d from master \"%s\"", count++, buf);
+                master_streams_add(lines, buf);
+            } else if (len >= 2 && (buf[0] == '+' || buf[0] == '-')) {
+                master_change_t *change = malloc(sizeof(*change) + len + 1);
+
+                if (!change)
+                    continue;
+                ICECAST_LOG_DEBUG("read change %d from master \"%s\"", count++, buf);
+                memcpy(change->line, buf, len + 1);
+                change->next = NULL;
+                *changes_tail = change;
+                changes_tail = &(change->next);
             }
-            xmlFreeURI(parsed_uri);
         }
         sock_close (mastersock);
 
-        thread_mutex_lock (&(config_locks()->relay_lock));
-        cleanup_relays = update_relays (&global.master_relays, new_relays, new_relays_length);
-
-        relay_check_streams (global.master_relays, cleanup_relays, 0);
-
-        for (i = 0; i < new_relays_length; i++) {
-            relay_config_free(new_relays[i]);
+        /* a delta can only be told complete by its length, full lists of
+         * masters that do not send one are taken as they are */
+        complete = content_length >= 0 ? body_length == content_length : !delta;
+        if (!complete)
+        {
+            ICECAST_LOG_WARN("Stream list from master was cut short");
+            if (lines)
+                avl_tree_free(lines, master_streams_free);
+            master_changes_free(changes);
+            break;
         }
-        free(new_relays);
 
-        thread_mutex_unlock (&(config_locks()->relay_lock));
+        thread_mutex_lock(&_master_mutex);
+        if (lines)
+        {
+            if (master_streams)
+                avl_tree_free(master_streams, master_streams_free);
+            master_streams = lines;
+            lines = NULL;
+            ICECAST_LOG_INFO("Got stream list from master");
+        }
+        else if (!master_streams)
+        {
+            /* nothing to apply the changes to, the full list is asked for next */
+            thread_mutex_unlock(&_master_mutex);
+            master_changes_free(changes);
+            break;
+        }
+        else
+        {
+            master_change_t *change;
 
+            for (change = changes; change; change = change->next) {
+                if (change->line[0] == '+')
+                    master_streams_add(master_streams, change->line + 1);
+                else
+                    avl_delete(master_streams, change->line + 1, master_streams_free);
+            }
+        }
+        master_streams_changed = 1;
+        free(master_server);
+        master_server = strdup(master);
+        master_server_port = port;
+        thread_mutex_unlock(&_master_mutex);
+        master_changes_free(changes);
+
+        snprintf(master_etag, sizeof(master_etag), "%s", etag);
+        ret = etag[0] ? 1 : 0;
     } while(0);
 
+    if (ret < 0)
+        master_etag[0] = 0;
+
     if (master)
         free (master);
     if (username)
@@ -884,6 +1874,117 @@ static int update_from_master(ice_config_t *config)
     return ret;
 }
 
+/* Keeps the stream list of the master, long polling it for changes if it
+ * supports that, and fetching it whenever the slave thread asks for it
+ * otherwise.
+ */
+static void *_master_thread(void *arg)
+{
+    fdpoll_t *poll = fdpoll_new();
+    int longpoll = 0;
+
+    (void)arg;
+
+    while (master_running)
+    {
+        int fetch;
+
+        thread_mutex_lock(&_master_mutex);
+        fetch = master_fetch_now;
+        master_fetch_now = 0;
+        thread_mutex_unlock(&_master_mutex);
+
+        if (!fetch && !longpoll)
+        {
+            global_sleep(MASTER_POLL_MS);
+            continue;
+        }
+
+        longpoll = master_fetch(poll) > 0 && poll;
+    }
+
+    if (poll)
+        fdpoll_free(poll);
+
+    return NULL;
+}
+
+/* Asks the master thread to fetch the stream list, unless it is waiting for
+ * changes anyway. With rebuild set the relays of the master are rebuilt as
+ * well, the settings they take may have changed. */
+static void master_request_fetch(int rebuild)
+{
+    thread_mutex_lock(&_master_mutex);
+    master_fetch_now = 1;
+    if (rebuild)
+        master_streams_changed = 1;
+    thread_mutex_unlock(&_master_mutex);
+}
+
+/* brings the relays of the master in line with its stream list if that changed */
+static void update_from_master(void)
+{
+    ice_config_t *config;
+    relay_t *cleanup_relays;
+    relay_config_t **new_relays = NULL;
+    size_t new_relays_length = 0;
+    avl_tree *mounts;
+    avl_node *node;
+    int on_demand;
+    unsigned int on_demand_linger;
+    int mux;
+    size_t i;
+
+    config = config_get_config();
+    on_demand = config->on_demand;
+    on_demand_linger = config->on_demand_linger;
+    mux = config->master_relay_mux;
+    config_release_config();
+
+    thread_mutex_lock(&_master_mutex);
+    if (!master_streams_changed || !master_streams)
+    {
+        thread_mutex_unlock(&_master_mutex);
+        return;
+    }
+    master_streams_changed = 0;
+
+    /* cluster.c gets a copy, so listeners are never held up by this lock */
+    mounts = avl_tree_new(master_streams_compare, NULL);
+    for (node = avl_get_first(master_streams); node && mounts; node = avl_get_next(node)) {
+        char *mount = strdup(node->key);
+
+        if (mount)
+            avl_insert(mounts, mount);
+    }
+
+    if (avl_get_first(master_streams))
+        new_relays = calloc(master_streams->length, sizeof(*new_relays));
+    for (node = avl_get_first(master_streams); node && new_relays; node = avl_get_next(node)) {
+        relay_config_t *c = master_relay_config(node->key, master_server, master_server_port, on_demand, on_demand_linger, mux);
+
+        if (c && new_relays_length < master_streams->length)
+            new_relays[new_relays_length++] = c;
+        else if (c)
+            relay_config_free(c);
+    }
+    thread_mutex_unlock(&_master_mutex);
+
+    cluster_set_master_mounts(mounts);
+
+    thread_mutex_lock (&(config_locks()->relay_lock));
+    cleanup_relays = update_relays (&global.master_relays, new_relays, new_relays_length);
+
+    relay_check_streams (global.master_relays, cleanup_relays, 0);
+
+    for (i = 0; i < new_relays_length; i++) {
+        relay_config_free(new_relays[i]);
+    }
+    free(new_relays);
+
+    thread_mutex_unlock (&(config_locks()->relay_lock));
+}
+
 
 static void *_slave_thread(void *arg)
 {
@@ -906,6 +2007,8 @@ static void *_slave_thread(void *arg)
     {
         relay_t *cleanup_relays = NULL;
         int skip_timer = 0;
+        int upgrade;
+        int dump_flightrec;
 
         /* re-read xml file if requested */
         global_lock();
@@ -913,17 +2016,31 @@ static void *_slave_thread(void *arg)
             config_reread_config();
             global.schedule_config_reread = 0;
         }
+        upgrade = global.schedule_upgrade;
+        global.schedule_upgrade = 0;
+        dump_flightrec = global.schedule_flightrec_dump;
+        global.schedule_flightrec_dump = 0;
         global_unlock();
 
-        thread_sleep(1000000);
+        if (upgrade)
+            upgrade_start();
+        if (dump_flightrec)
+            flightrec_dump_to_file();
+
+        global_sleep(1000);
         prng_auto_reseed();
+        memgov_check();
         thread_mutex_lock(&_slave_mutex);
-        if (slave_running == 0) {
+        /* on shutdown the relays are stopped right away, along with
+         * everything else, rather than once slave_shutdown() is reached */
+        if (slave_running == 0 || global.running != ICECAST_RUNNING) {
             thread_mutex_unlock(&_slave_mutex);
             break;
         }
         thread_mutex_unlock(&_slave_mutex);
 
+        update_from_master();
+
         ++interval;
 
         /* only update relays lists when required */
@@ -939,9 +2056,7 @@ static void *_slave_thread(void *arg)
             max_interval = config->master_update_interval;
             thread_mutex_unlock(&_slave_mutex);
 
-            /* the connection could take some time, so the lock can drop */
-            if (update_from_master (config))
-                config = config_get_config();
+            master_request_fetch(skip_timer);
 
             thread_mutex_lock (&(config_locks()->relay_lock));
 
@@ -963,9 +2078,16 @@ static void *_slave_thread(void *arg)
         if (update_settings)
         {
             source_recheck_mounts (update_all_mounts);
+            if (update_all_mounts)
+                slave_clear_update_mounts();
             update_settings = 0;
             update_all_mounts = 0;
         }
+        if (update_mounts_length)
+        {
+            source_recheck_mount_list ((const char * const *)update_mounts, update_mounts_length);
+            slave_clear_update_mounts();
+        }
         thread_mutex_unlock(&_slave_mutex);
     }
     ICECAST_LOG_INFO("shutting down current relays");
@@ -21,6 +21,7 @@
 void slave_initialize(void);
 void slave_shutdown(void);
 void slave_update_all_mounts (void);
+void slave_update_mounts(char **mounts, size_t mounts_length, bool rescan_relays);
 void slave_rebuild_mounts (void);
 void relay_config_free (relay_config_t *relay);
 relay_t *relay_free (relay_t *relay);
@@ -28,6 +28,8 @@
 #include <unistd.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/wait.h>
 #include <limits.h>
 #ifndef PATH_MAX
@@ -40,6 +42,7 @@
 #endif
 
 #include "common/thread/thread.h"
+#include "common/timing/timing.h"
 #include "common/avl/avl.h"
 #include "common/httpp/httpp.h"
 
@@ -48,6 +51,7 @@
 #include "connection.h"
 #include "global.h"
 #include "refbuf.h"
+#include "atomic.h"
 #include "client.h"
 #include "errors.h"
 #include "stats.h"
@@ -59,20 +63,142 @@
 #include "auth.h"
 #include "event.h"
 #include "slave.h"
+#include "sourceloop.h"
 #include "acl.h"
 #include "navigation.h"
+#include "coarsetime.h"
+#include "upgrade.h"
+#include "timerwheel.h"
+#include "memgov.h"
 
 #undef CATMODULE
 #define CATMODULE "source"
 
 #define MAX_FALLBACK_DEPTH 10
 
+/* buckets of the fallback cache, and entries kept before it is emptied */
+#define FALLBACK_CACHE_BUCKETS  1024
+#define FALLBACK_CACHE_MAX      4096
+
+/* max number of readiness events handled per pass over a source */
+#define MAX_POLL_EVENTS 128
+
+/* max number of pending listeners added per pass, the rest is left for the
+ * next passes so a large move does not stall the source */
+#define SOURCE_MAX_PENDING_PER_PASS 1024
+
+/* max amount of input read in one pass before the listeners get it */
+#define SOURCE_MAX_READ_BYTES   (64*1024)
+
+/* how often a source is run without any events, in milliseconds. Sources that
+ * can not be fully waited on are checked as often as before. */
+#define SOURCE_IDLE_DELAY       1000
+#define SOURCE_POLL_DELAY       250
+
+/* below this many listeners per worker the pass is done by the source thread
+ * alone, as waking up the workers costs more than it saves */
+#define MIN_LISTENERS_PER_WORKER 64
+/* listeners at different places of the queue that are sent to as groups
+ * in one pass, the others are sent to one by one */
+#define SOURCE_MAX_COHORTS      4
+/* listeners in cohorts from which on io_uring is used to send to them, and
+ * the number of sends handed to the kernel at once */
+#define SOURCE_URING_MIN_LISTENERS  32
+#define SOURCE_URING_ENTRIES        256
+
+/* initial number of buckets of the listener id index */
+#define SOURCE_INDEX_MIN_SIZE   64
+/* initial number of buckets of the username and role index */
+#define SOURCE_USER_INDEX_MIN_SIZE  16
+/* listeners handed to a source_walk_listeners() callback per hold of the
+ * client_lock */
+#define SOURCE_WALK_BATCH       256
+/* once a listener got more than this in a pass the others get their turn */
+#define SOURCE_LISTENER_PASS_BYTES  20000
+/* bytes the arena of a source allocates at a time, enough for the format
+ * state of most mounts */
+#define SOURCE_ARENA_CHUNK_SIZE (4*1024)
+
+/* the queue of a source is sized for the lag that this share (in percent)
+ * of its listeners stays within, plus a quarter for them to fall back */
+#define QUEUE_LAG_QUANTILE      95
+#define QUEUE_LAG_BUCKETS       64
+/* upper bounds in seconds of the buckets of the listener lag histogram,
+ * the last bucket takes everything above */
+static const unsigned int lag_histogram_bounds[] = {1, 2, 5, 10, 30};
+#define LAG_HISTOGRAM_BUCKETS   (sizeof(lag_histogram_bounds) / sizeof(*lag_histogram_bounds) + 1)
+/* never cut a queue down to less than the burst plus this */
+#define QUEUE_MIN_SLACK         (64*1024)
+
+/* with <burst-size-max>, a listener gets the larger burst if it took the
+ * first burst_size bytes, but at least this many, at this many times the
+ * stream rate */
+#define BURST_PROBE_MIN         (16*1024)
+#define BURST_KEEPUP_FACTOR     4
+
+/* never make the send buffer of a listener socket smaller than this */
+#define SOURCE_MIN_LISTENER_SNDBUF      (8*1024)
+#define SOURCE_MAX_LISTENER_SNDBUF      (16*1024*1024)
+
+/* size of the timeshift ring if only the file is given */
+#define SOURCE_DEFAULT_TIMESHIFT_SIZE   (64*1024*1024)
+
+/* size of the shared memory ring if only the file is given */
+#define SOURCE_DEFAULT_SHM_SIZE         (4*1024*1024)
+
+/* HLS segment duration in seconds and segments in the playlist */
+#define SOURCE_DEFAULT_HLS_SEGMENT_DURATION 6
+#define SOURCE_DEFAULT_HLS_SEGMENTS         6
+
+/* multicast port and TTL if not given, the TTL keeps it in the LAN */
+#define SOURCE_DEFAULT_MULTICAST_PORT   5004
+#define SOURCE_DEFAULT_MULTICAST_TTL    1
+
 mutex_t move_clients_mutex;
 
-/* avl tree helper */
+/* Resolved fallback chains of mounts that are not running themselves.
+ * An entry is only used while its generation is current, which is bumped
+ * by source_fallback_changed().
+ */
+typedef struct fallback_entry_tag {
+    char *mount;
+    uint32_t hash;
+    unsigned int generation;
+    /* the mounts visited, including mount itself, for the navigation history */
+    mount_identifier_t *hops[MAX_FALLBACK_DEPTH];
+    size_t hops_length;
+    /* the mount the chain ends at, NULL if no source was found */
+    char *target;
+    struct fallback_entry_tag *next;
+} fallback_entry_t;
+
+static rwlock_t fallback_cache_lock;
+static fallback_entry_t *fallback_cache[FALLBACK_CACHE_BUCKETS];
+static size_t fallback_cache_entries;
+static volatile unsigned int fallback_generation;
+
+/* sum of queue_demand and of retained_bytes over all sources, used to share
+ * out <queue-memory-limit> */
+static volatile uint64_t queue_demand_total;
+static volatile uint64_t queue_retained_total;
+/* sum of pending_count over all sources, for the admission by the
+ * <max-bandwidth> of the server */
+static volatile unsigned int pending_total;
+
+typedef struct {
+    unsigned int limit;
+    unsigned int lag[QUEUE_LAG_BUCKETS];
+    unsigned int lag_seconds[LAG_HISTOGRAM_BUCKETS];
+    uint64_t lag_max;
+    size_t listeners;
+    size_t intro_bytes;
+} queue_sample_t;
+
+/* frees a listener or sends it an error if nothing was sent yet */
 static int _free_client(void *key);
 static void _parse_audio_info (source_t *source, const char *s);
-static void source_shutdown (source_t *source);
+static void source_unblock_listener(source_t *source, client_t *client);
+static void source_release_queue_budget(source_t *source);
 
 /* Allocate a new source with the stated mountpoint, if one already
  * exists with that mountpoint in the global source tree then return
@@ -100,8 +226,7 @@ source_t *source_reserve (const char *mount)
         if (src == NULL)
             break;
 
-        src->client_tree = avl_tree_new(client_compare, NULL);
-        src->pending_tree = avl_tree_new(client_compare, NULL);
+        thread_rwlock_create(&src->client_lock);
         src->history = playlist_new(10 /* DOCUMENT: default is max_tracks=10. */);
 
         /* make duplicates for strings or similar */
@@ -110,8 +235,19 @@ source_t *source_reserve (const char *mount)
         src->max_listeners = -1;
         src->allow_direct_access = true;
         thread_mutex_create(&src->lock);
+        egress_init(&src->egress);
+        arena_initialize(&src->arena, SOURCE_ARENA_CHUNK_SIZE);
+        src->stats_connections = stats_counter_new(mount, "connections", STATS_COUNTER_COUNTER);
+        src->stats_listener_connections = stats_counter_new(mount, "listener_connections", STATS_COUNTER_COUNTER);
+        src->stats_slow_listeners = stats_counter_new(mount, "slow_listeners", STATS_COUNTER_COUNTER);
+        src->stats_lag_skips = stats_counter_new(mount, "lag_skips", STATS_COUNTER_COUNTER);
+        src->stats_burst_cuts = stats_counter_new(mount, "burst_cuts", STATS_COUNTER_COUNTER);
+        src->stats_lag_fallbacks = stats_counter_new(mount, "lag_fallbacks", STATS_COUNTER_COUNTER);
+        src->stats_bytes_read = stats_counter_new(mount, "total_bytes_read", STATS_COUNTER_COUNTER);
+        src->stats_bytes_sent = stats_counter_new(mount, "total_bytes_sent", STATS_COUNTER_COUNTER);
 
         avl_insert(global.source_tree, src);
+        source_fallback_changed();
 
     } while (0);
 
@@ -155,34 +291,176 @@ source_t *source_find_mount_raw(const char *mount)
  * check the fallback, and so on.  Must have a global source lock to call
  * this function.
  */
+static void fallback_entry_free(fallback_entry_t *entry)
+{
+    size_t i;
+
+    for (i = 0; i < entry->hops_length; i++)
+        refobject_unref(entry->hops[i]);
+    free(entry->mount);
+    free(entry->target);
+    free(entry);
+}
+
+/* must be called with fallback_cache_lock write locked */
+static void fallback_cache_clear(void)
+{
+    size_t i;
+
+    for (i = 0; i < FALLBACK_CACHE_BUCKETS; i++) {
+        while (fallback_cache[i]) {
+            fallback_entry_t *entry = fallback_cache[i];
+            fallback_cache[i] = entry->next;
+            fallback_entry_free(entry);
+        }
+    }
+    fallback_cache_entries = 0;
+}
+
+void source_fallback_initialize(void)
+{
+    thread_rwlock_create(&fallback_cache_lock);
+}
+
+void source_fallback_shutdown(void)
+{
+    thread_rwlock_wlock(&fallback_cache_lock);
+    fallback_cache_clear();
+    thread_rwlock_unlock(&fallback_cache_lock);
+    thread_rwlock_destroy(&fallback_cache_lock);
+}
+
+/* Makes all cached fallback chains stale. Called when a source is added,
+ * removed or becomes available, and when the config is reloaded. A target
+ * that stopped is noticed when a cached chain is used.
+ */
+void source_fallback_changed(void)
+{
+    atomic_uint_add(&fallback_generation, 1);
+}
+
+/* Looks up a cached chain. Returns true and sets *source on a hit, with
+ * the history updated the same way the walk does.
+ */
+static bool fallback_cache_find(const char *mount, navigation_history_t *history, source_t **source)
+{
+    unsigned int generation = atomic_uint_load(&fallback_generation);
+    fallback_entry_t *entry;
+    uint32_t hash = util_hash_string(mount);
+    bool ret = false;
+    size_t i;
+
+    thread_rwlock_rlock(&fallback_cache_lock);
+    for (entry = fallback_cache[hash % FALLBACK_CACHE_BUCKETS]; entry; entry = entry->next) {
+        if (entry->hash != hash || strcmp(entry->mount, mount) != 0)
+            continue;
+        if (entry->generation != generation)
+            break;
+
+        *source = source_find_mount_raw(entry->target);
+        if (entry->target && (!*source || !((*source)->running || (*source)->on_demand)))
+            break;
+
+        if (history) {
+            for (i = 0; i < entry->hops_length; i++)
+                navigation_history_navigate_to(history, entry->hops[i], NAVIGATION_DIRECTION_DOWN);
+        }
+        ret = true;
+        break;
+    }
+    thread_rwlock_unlock(&fallback_cache_lock);
+
+    return ret;
+}
+
+static void fallback_cache_add(fallback_entry_t *new)
+{
+    fallback_entry_t **entry;
+    size_t bucket = new->hash % FALLBACK_CACHE_BUCKETS;
+
+    thread_rwlock_wlock(&fallback_cache_lock);
+    for (entry = &(fallback_cache[bucket]); *entry; entry = &((*entry)->next)) {
+        if ((*entry)->hash == new->hash && strcmp((*entry)->mount, new->mount) == 0) {
+            fallback_entry_t *old = *entry;
+            new->next = old->next;
+            *entry = new;
+            fallback_entry_free(old);
+            thread_rwlock_unlock(&fallback_cache_lock);
+            return;
+        }
+    }
+
+    /* unknown mounts with a default mount that has a fallback are cached
+     * too, so the cache is bounded */
+    if (fallback_cache_entries >= FALLBACK_CACHE_MAX)
+        fallback_cache_clear();
+
+    new->next = fallback_cache[bucket];
+    fallback_cache[bucket] = new;
+    fallback_cache_entries++;
+    thread_rwlock_unlock(&fallback_cache_lock);
+}
+
 source_t *source_find_mount_with_history(const char *mount, navigation_history_t *history)
 {
     source_t *source = NULL;
     ice_config_t *config;
     mount_proxy *mountinfo;
+    fallback_entry_t *entry = NULL;
     int depth = 0;
 
+    if (!mount)
+        return NULL;
+
+    /* the common case, the mount itself is up */
+    source = source_find_mount_raw(mount);
+    if (source && (source->running || source->on_demand)) {
+        if (history)
+            navigation_history_navigate_to(history, source->identifier, NAVIGATION_DIRECTION_DOWN);
+        return source;
+    }
+
+    if (fallback_cache_find(mount, history, &source))
+        return source;
+
+    entry = calloc(1, sizeof(*entry));
+    if (entry) {
+        entry->generation = atomic_uint_load(&fallback_generation);
+        entry->hash = util_hash_string(mount);
+        entry->mount = strdup(mount);
+        if (!entry->mount) {
+            free(entry);
+            entry = NULL;
+        }
+    }
+
     config = config_get_config();
     while (mount && depth < MAX_FALLBACK_DEPTH)
     {
+        mount_identifier_t *identifier;
+
         source = source_find_mount_raw(mount);
 
         if (source) {
-            if (history)
-                navigation_history_navigate_to(history, source->identifier, NAVIGATION_DIRECTION_DOWN);
-
-            if (source->running || source->on_demand)
-                break;
+            identifier = source->identifier;
+            refobject_ref(identifier);
         } else {
-            if (history) {
-                mount_identifier_t *identifier = mount_identifier_new(mount);
-                if (identifier) {
-                    navigation_history_navigate_to(history, identifier, NAVIGATION_DIRECTION_DOWN);
-                    refobject_unref(identifier);
-                }
+            identifier = mount_identifier_new(mount);
+        }
+
+        if (identifier) {
+            if (history)
+                navigation_history_navigate_to(history, identifier, NAVIGATION_DIRECTION_DOWN);
+            if (entry) {
+                entry->hops[entry->hops_length++] = identifier;
+            } else {
+                refobject_unref(identifier);
             }
         }
 
+        if (source && (source->running || source->on_demand))
+            break;
+
         /* we either have a source which is not active (relay) or no source
          * at all. Check the mounts list for fallback settings
          */
@@ -195,6 +473,18 @@ source_t *source_find_mount_with_history(const char *mount, navigation_history_t
         depth++;
     }
 
+    if (entry) {
+        if (source) {
+            entry->target = strdup(source->mount);
+            if (!entry->target) {
+                fallback_entry_free(entry);
+                entry = NULL;
+            }
+        }
+        if (entry)
+            fallback_cache_add(entry);
+    }
+
     config_release_config();
     return source;
 }
@@ -210,404 +500,2200 @@ int source_compare_sources(void *arg, void *a, void *b)
 }
 
 
-void source_clear_source (source_t *source)
+/* Queue a listener to be added by the next pass over the source. The
+ * listener is not counted in source->listeners until then.
+ */
+void source_add_pending(source_t *source, client_t *client)
 {
-    int c;
+    void *head;
 
-    ICECAST_LOG_DEBUG("clearing source \"%s\"", source->mount);
+    do {
+        head = atomic_ptr_load(&source->pending);
+        client->pending_next = head;
+    } while (!atomic_ptr_cas(&source->pending, head, client));
 
-    avl_tree_wlock (source->pending_tree);
-    client_destroy(source->client);
-    source->client = NULL;
-    source->parser = NULL;
-    source->con = NULL;
+    atomic_uint_add(&source->pending_count, 1);
+    atomic_uint_add(&pending_total, 1);
+}
 
-    /* log bytes read in access log */
-    if (source->client && source->format)
-        source->client->con->sent_bytes = source->format->read_bytes;
+/* Queue a chain of listeners linked by pending_next with one exchange. The
+ * chain must be in reverse order, first is the one queued last.
+ */
+static void source_add_pending_chain(source_t *source, client_t *first, client_t *last, unsigned int count)
+{
+    void *head;
 
-    if (source->dumpfile)
-    {
-        ICECAST_LOG_INFO("Closing dumpfile for %s", source->mount);
-        fclose (source->dumpfile);
-        source->dumpfile = NULL;
-    }
+    if (!first)
+        return;
 
-    /* lets kick off any clients that are left on here */
-    avl_tree_wlock (source->client_tree);
-    c=0;
-    while (1)
-    {
-        avl_node *node = avl_get_first (source->client_tree);
-        if (node)
-        {
-            client_t *client = node->key;
-            if (client->respcode == 200)
-                c++; /* only count clients that have had some processing */
-            avl_delete (source->client_tree, client, _free_client);
-            continue;
-        }
-        break;
+    do {
+        head = atomic_ptr_load(&source->pending);
+        last->pending_next = head;
+    } while (!atomic_ptr_cas(&source->pending, head, first));
+
+    atomic_uint_add(&source->pending_count, count);
+    atomic_uint_add(&pending_total, count);
+}
+
+/* Puts back the rest of a list as returned by source_take_pending(), it is
+ * taken again first, ahead of the listeners that were queued meanwhile.
+ * Must be called with client_lock write locked.
+ */
+static void source_requeue_pending(source_t *source, client_t *list)
+{
+    client_t *client;
+    unsigned int count = 0;
+
+    for (client = list; client; client = client->pending_next)
+        count++;
+
+    source->pending_held = list;
+    atomic_uint_add(&source->pending_count, count);
+    atomic_uint_add(&pending_total, count);
+}
+
+/* Take all pending listeners in the order they were queued. As the whole
+ * list is swapped out at once this is safe alongside any number of
+ * source_add_pending() calls. Must be called with client_lock write locked.
+ */
+static client_t *source_take_pending(source_t *source)
+{
+    client_t *list = atomic_ptr_exchange(&source->pending, NULL);
+    client_t *ret = NULL;
+    client_t **tail;
+    unsigned int count = 0;
+
+    while (list) {
+        client_t *next = list->pending_next;
+
+        list->pending_next = ret;
+        ret = list;
+        list = next;
+        count++;
     }
-    if (c)
-    {
-        stats_event_sub (NULL, "listeners", source->listeners);
-        ICECAST_LOG_INFO("%d active listeners on %s released", c, source->mount);
+
+    if (source->pending_held) {
+        for (tail = &(source->pending_held); *tail; tail = &((*tail)->pending_next))
+            count++;
+        *tail = ret;
+        ret = source->pending_held;
+        source->pending_held = NULL;
     }
-    avl_tree_unlock (source->client_tree);
 
-    while (avl_get_first (source->pending_tree))
-    {
-        avl_delete (source->pending_tree,
-                avl_get_first(source->pending_tree)->key, _free_client);
+    if (count) {
+        atomic_uint_sub(&source->pending_count, count);
+        atomic_uint_sub(&pending_total, count);
     }
 
-    if (source->format && source->format->free_plugin)
-        source->format->free_plugin (source->format);
-    source->format = NULL;
+    return ret;
+}
 
-    /* Lets clear out the source queue too */
-    while (source->stream_data)
-    {
-        refbuf_t *p = source->stream_data;
-        source->stream_data = p->next;
-        p->next = NULL;
-        /* can be referenced by burst handler as well */
-        while (p->_count > 1)
-            refbuf_release (p);
-        refbuf_release (p);
+/* The burst kept for new listeners, those on an adaptive burst that do not
+ * keep up are cut down to burst_size. Under memory pressure there is no
+ * adaptive burst and once new listeners are rejected it is halved, see
+ * memgov.h. */
+static inline unsigned int source_burst_limit(source_t *source)
+{
+    switch (memgov_get_level()) {
+        case MEMGOV_LEVEL_NORMAL:
+        break;
+        case MEMGOV_LEVEL_SHED:
+            return source->burst_size;
+        case MEMGOV_LEVEL_REJECT:
+            return source->burst_size / 2;
     }
-    source->stream_data_tail = NULL;
 
-    source->burst_point = NULL;
-    source->burst_size = 0;
-    source->burst_offset = 0;
-    source->queue_size = 0;
-    source->queue_size_limit = 0;
-    source->listeners = 0;
-    source->max_listeners = -1;
-    source->prev_listeners = 0;
-    source->hidden = 0;
-    source->shoutcast_compat = 0;
-    source->client_stats_update = 0;
-    util_dict_free(source->audio_info);
-    source->audio_info = NULL;
+    return source->burst_size_max > source->burst_size ? source->burst_size_max : source->burst_size;
+}
 
-    free(source->fallback_mount);
-    source->fallback_mount = NULL;
+/* Work out the send buffer and pacing rate of listener sockets from the
+ * bitrate */
+static void source_size_listener_sockets(source_t *source)
+{
+    uint64_t size;
 
-    free(source->dumpfilename);
-    source->dumpfilename = NULL;
+    source->listener_sndbuf = 0;
+    source->listener_pacing_rate = 0;
 
-    playlist_release(source->history);
-    source->history = NULL;
+    if (!source->bitrate)
+        return;
 
-    if (source->intro_file)
-    {
-        fclose (source->intro_file);
-        source->intro_file = NULL;
+    if (source->listener_pacing) {
+        /* kbit/s to bytes per second, times the factor in percent */
+        uint64_t rate = (uint64_t)source->bitrate * 1000 / 8 * source->listener_pacing / 100;
+
+        source->listener_pacing_rate = rate > UINT32_MAX - 1 ? UINT32_MAX - 1 : rate;
+        ICECAST_LOG_DEBUG("Listeners on %s paced to %u bytes/s after their burst", source->mount, source->listener_pacing_rate);
     }
 
-    source->on_demand_req = 0;
-    avl_tree_unlock (source->pending_tree);
+    if (!source->listener_send_buffer_time)
+        return;
+
+    /* kbit/s times ms are bits */
+    size = (uint64_t)source->bitrate * source->listener_send_buffer_time / 8;
+    if (size < SOURCE_MIN_LISTENER_SNDBUF)
+        size = SOURCE_MIN_LISTENER_SNDBUF;
+    if (size > SOURCE_MAX_LISTENER_SNDBUF)
+        size = SOURCE_MAX_LISTENER_SNDBUF;
+
+    source->listener_sndbuf = size;
+    ICECAST_LOG_DEBUG("Send buffer of listeners on %s set to %i bytes for %u kbit/s", source->mount, source->listener_sndbuf, source->bitrate);
 }
 
+/* Sets the rate the kernel paces the socket of a listener to, ~0U lifts it
+ * again. Needs the fq qdisc or TCP internal pacing to have an effect. */
+static inline void source_set_listener_pacing(client_t *client, uint32_t rate)
+{
+#ifdef SO_MAX_PACING_RATE
+    setsockopt(client->con->sock, SOL_SOCKET, SO_MAX_PACING_RATE, (const char *)&rate, sizeof(rate));
+#else
+    (void)client;
+    (void)rate;
+#endif
+}
 
-/* Remove the provided source from the global tree and free it */
-void source_free_source (source_t *source)
+/* Keep the kernel from buffering more of the stream for a listener than it
+ * needs to keep the connection busy. The queue of the source holds the data
+ * anyway and a slow listener blocks on its socket much earlier.
+ */
+static void source_setup_listener_socket(source_t *source, client_t *client)
 {
-    ICECAST_LOG_DEBUG("freeing source \"%s\"", source->mount);
-    avl_tree_wlock (global.source_tree);
-    avl_delete (global.source_tree, source, NULL);
-    avl_tree_unlock (global.source_tree);
+    if (!client->con || client->con->sock == SOCK_ERROR)
+        return;
 
-    avl_tree_free(source->pending_tree, _free_client);
-    avl_tree_free(source->client_tree, _free_client);
+    if (source->listener_sndbuf)
+        sock_set_send_buffer(client->con->sock, source->listener_sndbuf);
 
-    /* make sure all YP entries have gone */
-    yp_remove (source->mount);
+    /* TLS encrypts into its own buffers, so there is nothing to gain */
+    if (source->listener_zerocopy && !client->zerocopy && connection_get_plain_socket(client->con) != SOCK_ERROR)
+        client->zerocopy = zerocopy_new(client->con->sock);
 
-    refobject_unref(source->identifier);
-    free (source->mount);
-    free (source);
+#ifdef TCP_NOTSENT_LOWAT
+    if (source->listener_notsent_lowat) {
+        int val = source->listener_notsent_lowat;
 
-    return;
-}
+        setsockopt(client->con->sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (const char *)&val, sizeof(val));
+    }
+#endif
+
+    /* the burst goes out at full speed, pacing starts once it is sent, see
+     * send_to_listener(). A listener moved here from a paced mount is let
+     * go until then as well. */
+    if (client->paced) {
+        source_set_listener_pacing(client, ~0U);
+        client->paced = 0;
+    }
+    client->pace_after = 0;
+    if (source->listener_pacing_rate) {
+        /* a burst kept on a keyframe can be larger than burst_size */
+        unsigned int burst = source->burst_offset > source_burst_limit(source) ? source->burst_offset : source_burst_limit(source);
 
+        client->pace_after = client->con->sent_bytes + burst + 1;
+    }
 
-client_t *source_find_client(source_t *source, connection_id_t id)
+    /* only new listeners start on the burst, see source_check_burst() */
+    client->burst_start = 0;
+    if (source->burst_size_max > source->burst_size && client->respcode == 0) {
+        client->burst_start = coarsetime_get_ms();
+        client->burst_sent = client->con->sent_bytes;
+    }
+}
+
+static void source_free_pending(source_t *source)
 {
-    client_t fakeclient;
-    void *result;
-    connection_t fakecon;
+    client_t *client;
 
-    fakeclient.con = &fakecon;
-    fakeclient.con->id = id;
+    thread_rwlock_wlock(&source->client_lock);
+    client = source_take_pending(source);
+    thread_rwlock_unlock(&source->client_lock);
 
-    avl_tree_rlock(source->client_tree);
-    if(avl_get_by_key(source->client_tree, &fakeclient, &result) == 0)
-    {
-        avl_tree_unlock(source->client_tree);
-        return result;
+    while (client) {
+        client_t *next = client->pending_next;
+
+        client->pending_next = NULL;
+        _free_client(client);
+        client = next;
     }
+}
 
-    avl_tree_unlock(source->client_tree);
-    return NULL;
+/* Connection ids are handed out in sequence, so the low bits alone spread
+ * the listeners evenly over the buckets. */
+static inline size_t source_index_bucket(source_t *source, connection_id_t id)
+{
+    return id & (source->client_index_size - 1);
 }
 
-static inline int source_move_clients__single(source_t *source, source_t *dest, avl_tree *from, avl_tree *to, client_t *client, navigation_direction_t direction) {
-    if (navigation_history_navigate_to(&(client->history), dest->identifier, direction) != 0) {
-        ICECAST_LOG_DWARN("Can not change history: navigation of client=%p{.con->id=%llu, ...} from source=%p{.mount=%#H, ...} to dest=%p{.mount=%#H, ...} with direction %s failed",
-                client, (unsigned long long int)client->con->id, source, source->mount, dest, dest->mount, navigation_direction_to_str(direction));
+/* Doubles the id index and refills it from the listener list.
+ * Returns 0 on success, if there is no memory the old index is kept.
+ */
+static int source_index_grow(source_t *source)
+{
+    size_t size = source->client_index_size ? source->client_index_size * 2 : SOURCE_INDEX_MIN_SIZE;
+    client_t **index = calloc(size, sizeof(*index));
+    client_t *client;
+
+    if (!index)
         return -1;
-    }
 
-    avl_delete(from, client, NULL);
+    free(source->client_index);
+    source->client_index = index;
+    source->client_index_size = size;
 
-    /* when switching a client to a different queue, be wary of the
-     * refbuf it's referring to, if it's http headers then we need
-     * to write them so don't release it.
-     */
-    if (client->check_buffer != format_check_http_buffer) {
-        client_set_queue(client, NULL);
-        client->check_buffer = format_check_file_buffer;
-        if (source->con == NULL)
-            client->intro_offset = -1;
+    for (client = source->client_list; client; client = client->listener_next) {
+        size_t bucket = source_index_bucket(source, client->con->id);
+
+        client->index_next = index[bucket];
+        index[bucket] = client;
     }
 
-    avl_insert(to, (void *)client);
     return 0;
 }
 
-/* Move clients from source to dest provided dest is running
- * and that the stream format is the same.
- * The only lock that should be held when this is called is the
- * source tree lock
- */
-void source_move_clients(source_t *source, source_t *dest, connection_id_t *id, navigation_direction_t direction)
+typedef struct source_user_tag {
+    struct source_user_tag *next;
+    uint32_t hash;
+    size_t count;
+    /* points into username */
+    const char *role;
+    char username[];
+} source_user_t;
+
+static uint32_t source_user_hash(const char *username, const char *role)
 {
-    unsigned long count = 0;
-    if (strcmp(source->mount, dest->mount) == 0) {
-        ICECAST_LOG_WARN("src and dst are the same \"%s\", skipping", source->mount);
-        return;
-    }
-    /* we don't want the two write locks to deadlock in here */
-    thread_mutex_lock(&move_clients_mutex);
+    uint32_t hash = util_hash_string(username);
 
-    /* if the destination is not running then we can't move clients */
+    /* the terminator keeps "ab" + "c" apart from "a" + "bc" */
+    hash = util_hash_word(hash, 0);
 
-    avl_tree_wlock(dest->pending_tree);
-    if (dest->running == 0 && dest->on_demand == 0) {
-        ICECAST_LOG_WARN("destination mount %s not running, unable to move clients ", dest->mount);
-        avl_tree_unlock(dest->pending_tree);
-        thread_mutex_unlock(&move_clients_mutex);
-        return;
-    }
+    return util_hash_string_continue(hash, role);
+}
 
-    /* we need to move the client and pending trees - we must take the
-     * locks in this order to avoid deadlocks */
-    avl_tree_wlock(source->pending_tree);
-    avl_tree_wlock(source->client_tree);
+/* returns the link to the entry, or to the end of its bucket if there is none */
+static source_user_t **source_user_find(source_t *source, const char *username, const char *role, uint32_t hash)
+{
+    source_user_t **link = &(source->user_index[hash & (source->user_index_size - 1)]);
 
-    do {
-        if (source->on_demand == 0 && source->format == NULL) {
-            ICECAST_LOG_INFO("source mount %s is not available", source->mount);
+    for (; *link; link = &((*link)->next)) {
+        if ((*link)->hash == hash && strcmp((*link)->username, username) == 0 && strcmp((*link)->role, role) == 0)
             break;
-        }
+    }
 
-        if (source->format && dest->format) {
-            if (source->format->type != dest->format->type) {
-                ICECAST_LOG_WARN("stream %s and %s are of different types, ignored", source->mount, dest->mount);
-                break;
-            }
-        }
+    return link;
+}
 
-        if (id) {
-            client_t fakeclient;
-            connection_t fakecon;
-            void *result;
+static void source_user_index_grow(source_t *source)
+{
+    size_t size = source->user_index_size ? source->user_index_size * 2 : SOURCE_USER_INDEX_MIN_SIZE;
+    source_user_t **index = calloc(size, sizeof(*index));
+    size_t i;
 
-            fakeclient.con = &fakecon;
-            fakeclient.con->id = *id;
+    if (!index)
+        return;
 
-            if (avl_get_by_key(source->client_tree, &fakeclient, &result) == 0) {
-                if (source_move_clients__single(source, dest, source->client_tree, dest->pending_tree, result, direction) == 0)
-                    count++;
-            }
-        } else {
-            avl_node *next;
+    for (i = 0; i < source->user_index_size; i++) {
+        while (source->user_index[i]) {
+            source_user_t *entry = source->user_index[i];
 
-            next = avl_get_first(source->pending_tree);
-            while (next) {
-                avl_node *node = next;
+            source->user_index[i] = entry->next;
+            entry->next = index[entry->hash & (size - 1)];
+            index[entry->hash & (size - 1)] = entry;
+        }
+    }
 
-                next = avl_get_next(next);
+    free(source->user_index);
+    source->user_index = index;
+    source->user_index_size = size;
+}
 
-                if (source_move_clients__single(source, dest, source->pending_tree, dest->pending_tree, node->key, direction) == 0)
-                    count++;
-            }
+/* Counts a listener joining (1) or leaving (-1) in the username and role
+ * index. Must be called with client_lock write locked.
+ */
+static void source_user_update(source_t *source, client_t *client, int delta)
+{
+    source_user_t **link;
+    source_user_t *entry;
+    uint32_t hash;
 
-            next = avl_get_first(source->client_tree);
-            while (next) {
-                avl_node *node = next;
+    if (!client->username || !client->role)
+        return;
+
+    if (delta > 0 && source->user_index_count >= source->user_index_size)
+        source_user_index_grow(source);
+    if (!source->user_index_size)
+        return;
+
+    hash = source_user_hash(client->username, client->role);
+    link = source_user_find(source, client->username, client->role, hash);
+    entry = *link;
+
+    if (delta < 0) {
+        if (entry && --entry->count == 0) {
+            *link = entry->next;
+            source->user_index_count--;
+            free(entry);
+        }
+        return;
+    }
+
+    if (!entry) {
+        size_t username_len = strlen(client->username) + 1;
+        size_t role_len = strlen(client->role) + 1;
+
+        entry = malloc(sizeof(*entry) + username_len + role_len);
+        if (!entry)
+            return;
+        entry->next = NULL;
+        entry->hash = hash;
+        entry->count = 0;
+        memcpy(entry->username, client->username, username_len);
+        memcpy(entry->username + username_len, client->role, role_len);
+        entry->role = entry->username + username_len;
+        *link = entry;
+        source->user_index_count++;
+    }
+    entry->count++;
+}
+
+/* Appends a listener to the list and adds it to the id index. The index is
+ * grown once there are more listeners than buckets which keeps the chains
+ * at about one entry. Must be called with client_lock write locked.
+ */
+static void source_link_listener(source_t *source, client_t *client)
+{
+    if (client->con->discon_time) {
+        if (!source->listener_timers)
+            source->listener_timers = timerwheel_new(coarsetime_get());
+        /* without the wheel the limit is not enforced, like other things
+         * given up on when out of memory */
+        if (source->listener_timers)
+            timerwheel_add(source->listener_timers, &(client->discon_timer), client->con->discon_time);
+    }
+
+    client->listener_prev = source->client_list_tail;
+    client->listener_next = NULL;
+    if (source->client_list_tail) {
+        source->client_list_tail->listener_next = client;
+    } else {
+        source->client_list = client;
+    }
+    source->client_list_tail = client;
+
+    source_user_update(source, client, 1);
+
+    if (source->listeners >= source->client_index_size && source_index_grow(source) == 0)
+        return;
+
+    if (source->client_index_size) {
+        size_t bucket = source_index_bucket(source, client->con->id);
+
+        client->index_next = source->client_index[bucket];
+        source->client_index[bucket] = client;
+    }
+}
+
+/* Must be called with client_lock write locked */
+/* the listener a walk goes on with once it got client_lock again */
+typedef struct source_walk_cursor_tag {
+    struct source_walk_cursor_tag *next;
+    client_t *client;
+} source_walk_cursor_t;
+
+/* These two must be called with client_lock write locked, the walk itself
+ * may only hold it read locked as it only changes its own cursor. */
+static void source_walk_cursor_add(source_t *source, source_walk_cursor_t *cursor)
+{
+    cursor->client = source->client_list;
+    cursor->next = source->walk_cursors;
+    source->walk_cursors = cursor;
+}
+
+static void source_walk_cursor_remove(source_t *source, source_walk_cursor_t *cursor)
+{
+    source_walk_cursor_t **prev;
+
+    for (prev = &(source->walk_cursors); *prev; prev = &((*prev)->next)) {
+        if (*prev == cursor) {
+            *prev = cursor->next;
+            return;
+        }
+    }
+}
+
+static void source_unlink_listener(source_t *source, client_t *client)
+{
+    source_walk_cursor_t *cursor;
+
+    for (cursor = source->walk_cursors; cursor; cursor = cursor->next) {
+        if (cursor->client == client)
+            cursor->client = client->listener_next;
+    }
+
+    if (client->listener_prev) {
+        client->listener_prev->listener_next = client->listener_next;
+    } else {
+        source->client_list = client->listener_next;
+    }
+    if (client->listener_next) {
+        client->listener_next->listener_prev = client->listener_prev;
+    } else {
+        source->client_list_tail = client->listener_prev;
+    }
+    client->listener_prev = NULL;
+    client->listener_next = NULL;
+
+    if (source->listener_timers)
+        timerwheel_remove(source->listener_timers, &(client->discon_timer));
+
+    source_user_update(source, client, -1);
+
+    if (source->client_index_size) {
+        client_t **link = &(source->client_index[source_index_bucket(source, client->con->id)]);
+
+        while (*link && *link != client)
+            link = &((*link)->index_next);
+        if (*link)
+            *link = client->index_next;
+        client->index_next = NULL;
+    }
+}
+
+/* Takes the whole listener list at once and empties the indexes, which
+ * is cheaper than unlinking every listener. Must be called with
+ * client_lock write locked.
+ */
+static client_t *source_unlink_all_listeners(source_t *source)
+{
+    client_t *list = source->client_list;
+    source_walk_cursor_t *cursor;
+    size_t i;
+
+    source->client_list = NULL;
+    source->client_list_tail = NULL;
+
+    for (cursor = source->walk_cursors; cursor; cursor = cursor->next)
+        cursor->client = NULL;
+
+    if (source->client_index_size)
+        memset(source->client_index, 0, source->client_index_size * sizeof(*source->client_index));
+
+    /* expiring them all would move the clock of the wheel to the end of
+     * time, so later deadlines would all have passed */
+    if (source->listener_timers && timerwheel_count(source->listener_timers)) {
+        client_t *client;
+
+        for (client = list; client; client = client->listener_next)
+            timerwheel_remove(source->listener_timers, &(client->discon_timer));
+    }
+
+    for (i = 0; i < source->user_index_size; i++) {
+        while (source->user_index[i]) {
+            source_user_t *entry = source->user_index[i];
+
+            source->user_index[i] = entry->next;
+            free(entry);
+        }
+    }
+    source->user_index_count = 0;
+
+    return list;
+}
+
+/* Must be called with client_lock locked */
+static client_t *source_lookup_listener(source_t *source, connection_id_t id)
+{
+    client_t *client;
+
+    /* without an index (out of memory) fall back to walking the list */
+    if (source->client_index_size) {
+        client = source->client_index[source_index_bucket(source, id)];
+        for (; client; client = client->index_next)
+            if (client->con->id == id)
+                return client;
+        return NULL;
+    }
+
+    for (client = source->client_list; client; client = client->listener_next)
+        if (client->con->id == id)
+            return client;
+
+    return NULL;
+}
+
+
+void source_clear_source (source_t *source)
+{
+    int c;
+
+    ICECAST_LOG_DEBUG("clearing source \"%s\"", source->mount);
+
+    /* no listeners may be moved here while clearing */
+    thread_mutex_lock(&move_clients_mutex);
+    client_destroy(source->client);
+    source->client = NULL;
+    source->parser = NULL;
+    source->con = NULL;
+
+    /* log bytes read in access log */
+    if (source->client && source->format)
+        source->client->con->sent_bytes = source->format->read_bytes;
+
+    if (source->dumpfile)
+    {
+        ICECAST_LOG_INFO("Closing dumpfile for %s", source->mount);
+        dumpfile_close (source->dumpfile);
+        source->dumpfile = NULL;
+    }
+
+    /* the source client that recorded to it is gone by now */
+    dumpfile_close (source->capture);
+    source->capture = NULL;
+
+    /* lets kick off any clients that are left on here */
+    thread_rwlock_wlock(&source->client_lock);
+
+    /* this also drops all registrations of blocked listeners */
+    fdpoll_free(source->listener_poll);
+    source->listener_poll = NULL;
+
+    workpool_free(source->listener_pool);
+    source->listener_pool = NULL;
+    free(source->listener_batch);
+    source->listener_batch = NULL;
+    free(source->listener_cohort);
+    source->listener_cohort = NULL;
+    source->listener_batch_len = 0;
+    uring_free(source->listener_uring);
+    source->listener_uring = NULL;
+    source->listener_uring_failed = 0;
+
+    c=0;
+    while (source->client_list)
+    {
+        client_t *client = source->client_list;
+
+        if (client->respcode == 200)
+            c++; /* only count clients that have had some processing */
+        source_unlink_listener(source, client);
+        _free_client(client);
+    }
+    if (c)
+    {
+        stats_global_add(STATS_GLOBAL_LISTENERS, -(int64_t)source->listeners);
+        ICECAST_LOG_INFO("%d active listeners on %s released", c, source->mount);
+    }
+    thread_rwlock_unlock(&source->client_lock);
+
+    source_free_pending(source);
+
+    /* no listener is left to read from it */
+    timeshift_close(source->timeshift);
+    source->timeshift = NULL;
+
+    shmring_close(source->shmring);
+    source->shmring = NULL;
+
+    hls_close(source->hls);
+    source->hls = NULL;
+
+    multicast_close(source->multicast);
+    source->multicast = NULL;
+
+    if (source->format && source->format->free_plugin)
+        source->format->free_plugin (source->format);
+    source->format = NULL;
+
+    /* Lets clear out the source queue too */
+    while (source->stream_data)
+    {
+        refbuf_t *p = source->stream_data;
+        source->stream_data = p->next;
+        p->next = NULL;
+        /* can be referenced by burst handler as well */
+        while (refbuf_get_count(p) > 1)
+            refbuf_release (p);
+        refbuf_release (p);
+    }
+    source->stream_data_tail = NULL;
+
+    source->burst_point = NULL;
+    source->sync_index_count = 0;
+    source->stream_rate = 0;
+    source->stream_rate_start = 0;
+    source->burst_size = 0;
+    source->burst_offset = 0;
+    source->queue_size = 0;
+    source->queue_size_limit = 0;
+    source->queue_offset = 0;
+    source->queue_sample = 0;
+    source_release_queue_budget(source);
+    source->listeners = 0;
+    source->max_listeners = -1;
+    source->prev_listeners = 0;
+    source->hidden = 0;
+    source->shoutcast_compat = 0;
+    source->client_stats_update = 0;
+    util_dict_free(source->audio_info);
+    source->audio_info = NULL;
+    source->bitrate = 0;
+    source->listener_sndbuf = 0;
+    source->listener_pacing_rate = 0;
+
+    free(source->fallback_mount);
+    source->fallback_mount = NULL;
+    free(source->dumpfilename);
+    source->dumpfilename = NULL;
+    free(source->capturefilename);
+    source->capturefilename = NULL;
+    free(source->timeshiftfilename);
+    source->timeshiftfilename = NULL;
+    free(source->shmfilename);
+    source->shmfilename = NULL;
+    free(source->multicast_group);
+    source->multicast_group = NULL;
+    free(source->multicast_interface);
+    source->multicast_interface = NULL;
+
+    playlist_release(source->history);
+    source->history = NULL;
+
+    if (source->intro_file)
+    {
+        fclose (source->intro_file);
+        source->intro_file = NULL;
+    }
+    introcache_set(&source->intro, NULL);
+
+    source->on_demand_req = 0;
+    source->on_demand_idle = 0;
+
+    arena_reset(&source->arena);
+    thread_mutex_unlock(&move_clients_mutex);
+}
+
+
+/* Remove the provided source from the global tree and free it */
+void source_free_source (source_t *source)
+{
+    ICECAST_LOG_DEBUG("freeing source \"%s\"", source->mount);
+    avl_tree_wlock (global.source_tree);
+    avl_delete (global.source_tree, source, NULL);
+    avl_tree_unlock (global.source_tree);
+    source_fallback_changed();
+
+    fdpoll_free(source->listener_poll);
+    workpool_free(source->listener_pool);
+    free(source->listener_batch);
+    free(source->listener_cohort);
+    uring_free(source->listener_uring);
+    source_free_pending(source);
+    while (source->client_list) {
+        client_t *client = source->client_list;
+
+        source_unlink_listener(source, client);
+        _free_client(client);
+    }
+    free(source->client_index);
+    free(source->user_index);
+    timerwheel_free(source->listener_timers);
+    thread_rwlock_destroy(&source->client_lock);
+    introcache_set(&source->intro, NULL);
+    timeshift_close(source->timeshift);
+    shmring_close(source->shmring);
+    hls_close(source->hls);
+    multicast_close(source->multicast);
+    egress_destroy(&source->egress);
+    stats_counter_free(source->stats_connections);
+    stats_counter_free(source->stats_listener_connections);
+    stats_counter_free(source->stats_slow_listeners);
+    stats_counter_free(source->stats_lag_skips);
+    stats_counter_free(source->stats_burst_cuts);
+    stats_counter_free(source->stats_lag_fallbacks);
+    stats_counter_free(source->stats_bytes_read);
+    stats_counter_free(source->stats_bytes_sent);
+
+    /* make sure all YP entries have gone */
+    yp_remove (source->mount);
+
+    refobject_unref(source->identifier);
+    arena_shutdown(&source->arena);
+    free (source->mount);
+    free (source);
+
+    return;
+}
+
+
+client_t *source_find_client(source_t *source, connection_id_t id)
+{
+    client_t *result;
+
+    thread_rwlock_rlock(&source->client_lock);
+    result = source_lookup_listener(source, id);
+    thread_rwlock_unlock(&source->client_lock);
+
+    return result;
+}
+
+size_t source_count_user(source_t *source, const char *username, const char *role)
+{
+    source_user_t *entry;
+    size_t ret = 0;
+
+    if (!username || !role)
+        return 0;
+
+    thread_rwlock_rlock(&source->client_lock);
+    if (source->user_index_size) {
+        entry = *source_user_find(source, username, role, source_user_hash(username, role));
+        if (entry)
+            ret = entry->count;
+    }
+    thread_rwlock_unlock(&source->client_lock);
+
+    return ret;
+}
+
+void source_walk_listeners(source_t *source, source_walk_callback_t callback, void *userdata)
+{
+    source_walk_cursor_t cursor;
+    client_t *client;
+
+    thread_rwlock_wlock(&source->client_lock);
+    source_walk_cursor_add(source, &cursor);
+    thread_rwlock_unlock(&source->client_lock);
+
+    do {
+        size_t count;
+
+        thread_rwlock_rlock(&source->client_lock);
+        for (client = cursor.client, count = 0; client && count < SOURCE_WALK_BATCH; client = client->listener_next, count++) {
+            if (callback(client, userdata) != 0) {
+                client = NULL;
+                break;
+            }
+        }
+        cursor.client = client;
+        thread_rwlock_unlock(&source->client_lock);
+    } while (client);
+
+    thread_rwlock_wlock(&source->client_lock);
+    source_walk_cursor_remove(source, &cursor);
+    thread_rwlock_unlock(&source->client_lock);
+}
+
+/* Detaches the client from source so it can be queued on dest. The client
+ * must already be off the listener list of source. */
+static inline int source_move_clients__prepare(source_t *source, source_t *dest, client_t *client, navigation_direction_t direction) {
+    if (navigation_history_navigate_to(&(client->history), dest->identifier, direction) != 0) {
+        ICECAST_LOG_DWARN("Can not change history: navigation of client=%p{.con->id=%llu, ...} from source=%p{.mount=%#H, ...} to dest=%p{.mount=%#H, ...} with direction %s failed",
+                client, (unsigned long long int)client->con->id, source, source->mount, dest, dest->mount, navigation_direction_to_str(direction));
+        return -1;
+    }
+
+    if (client->write_blocked) {
+        source_unblock_listener(source, client);
+        source->listener_poll_generation++;
+    }
+
+    /* when switching a client to a different queue, be wary of the
+     * refbuf it's referring to, if it's http headers then we need
+     * to write them so don't release it. A client in the middle of a
+     * buffer of the stream finishes it first, the following ones of the
+     * old queue are not touched any more, so the writer gathering them is
+     * swapped for the plain one until the client starts on the new queue.
+     */
+    if (client->check_buffer == format_advance_queue)
+        client->write_to_client = source->format->write_buf_to_client;
+    if (client->check_buffer == format_advance_queue && client->refbuf && client->pos < client->refbuf->len) {
+        client->check_buffer = format_check_handoff_buffer;
+        client->intro_offset = -1;
+    } else if (client->check_buffer != format_check_http_buffer) {
+        client_set_queue(client, NULL);
+        client->check_buffer = format_check_file_buffer;
+        if (source->con == NULL)
+            client->intro_offset = -1;
+    }
+    client->lag_fallback = 0;
+    client->burst_start = 0;
+
+    return 0;
+}
+
+/* linked tells if the client is on the listener list of source, otherwise
+ * it was taken from the pending ones */
+static inline int source_move_clients__single(source_t *source, source_t *dest, bool linked, client_t *client, navigation_direction_t direction) {
+    if (linked)
+        source_unlink_listener(source, client);
+
+    if (source_move_clients__prepare(source, dest, client, direction) != 0) {
+        if (linked)
+            source_link_listener(source, client);
+        return -1;
+    }
+
+    source_add_pending(dest, client);
+    return 0;
+}
+
+/* Move clients from source to dest provided dest is running
+ * and that the stream format is the same.
+ * The only lock that should be held when this is called is the
+ * source tree lock
+ */
+void source_move_clients(source_t *source, source_t *dest, connection_id_t *id, navigation_direction_t direction)
+{
+    unsigned long count = 0;
+    unsigned long active = 0;
+    if (strcmp(source->mount, dest->mount) == 0) {
+        ICECAST_LOG_WARN("src and dst are the same \"%s\", skipping", source->mount);
+        return;
+    }
+    /* we don't want the two write locks to deadlock in here, this also
+     * keeps both sources from being cleared while we move */
+    thread_mutex_lock(&move_clients_mutex);
+
+    /* if the destination is not running then we can't move clients */
+    if (dest->running == 0 && dest->on_demand == 0) {
+        ICECAST_LOG_WARN("destination mount %s not running, unable to move clients ", dest->mount);
+        thread_mutex_unlock(&move_clients_mutex);
+        return;
+    }
+
+    thread_rwlock_wlock(&source->client_lock);
+
+    do {
+        if (source->on_demand == 0 && source->format == NULL) {
+            ICECAST_LOG_INFO("source mount %s is not available", source->mount);
+            break;
+        }
+
+        if (source->format && dest->format) {
+            if (source->format->type != dest->format->type) {
+                ICECAST_LOG_WARN("stream %s and %s are of different types, ignored", source->mount, dest->mount);
+                break;
+            }
+        }
+
+        if (id) {
+            client_t *client = source_lookup_listener(source, *id);
+
+            if (client) {
+                if (source_move_clients__single(source, dest, true, client, direction) == 0)
+                    active++;
+            }
+        } else {
+            /* everything is queued on dest as one chain, dest sorts the
+             * listeners into its list on its next pass */
+            client_t *pending = source_take_pending(source);
+            client_t *next = source_unlink_all_listeners(source);
+            client_t *first = NULL;
+            client_t *last = NULL;
+            unsigned int moved = 0;
+
+            while (pending) {
+                client_t *client = pending;
+
+                pending = client->pending_next;
+                client->pending_next = NULL;
+
+                if (source_move_clients__prepare(source, dest, client, direction) == 0) {
+                    client->pending_next = first;
+                    first = client;
+                    if (!last)
+                        last = client;
+                    moved++;
+                    count++;
+                } else {
+                    source_add_pending(source, client);
+                }
+            }
+
+            while (next) {
+                client_t *client = next;
+
+                next = client->listener_next;
+                client->listener_prev = NULL;
+                client->listener_next = NULL;
+                client->index_next = NULL;
+
+                if (source_move_clients__prepare(source, dest, client, direction) == 0) {
+                    client->pending_next = first;
+                    first = client;
+                    if (!last)
+                        last = client;
+                    moved++;
+                    active++;
+                } else {
+                    source_link_listener(source, client);
+                }
+            }
+
+            source_add_pending_chain(dest, first, last, moved);
+        }
+
+        count += active;
+        ICECAST_LOG_INFO("passing %lu listeners to \"%s\"", count, dest->mount);
+
+        /* pending listeners have not been counted yet */
+        source->listeners -= active;
+        stats_event_sub(source->mount, "listeners", active);
+    } while (0);
+
+    thread_rwlock_unlock(&source->client_lock);
+
+    /* see if we need to wake up an on-demand relay */
+    if (dest->running == 0 && dest->on_demand && count)
+        dest->on_demand_req = 1;
+
+    thread_mutex_unlock(&move_clients_mutex);
+}
+
+
+/* Like source_move_clients() but moves the listeners for which match
+ * returns non-zero. Listeners are looked at in batches, the client_lock is
+ * write locked once per batch so moving off a large mount does not hold up
+ * the source for long. Pending listeners are not looked at. Returns the
+ * number of listeners moved.
+ */
+size_t source_move_clients_matching(source_t *source, source_t *dest, source_walk_callback_t match, void *userdata, navigation_direction_t direction)
+{
+    source_walk_cursor_t cursor;
+    bool started = false;
+    size_t total = 0;
+
+    if (strcmp(source->mount, dest->mount) == 0) {
+        ICECAST_LOG_WARN("src and dst are the same \"%s\", skipping", source->mount);
+        return 0;
+    }
+
+    thread_mutex_lock(&move_clients_mutex);
+
+    if (dest->running == 0 && dest->on_demand == 0) {
+        ICECAST_LOG_WARN("destination mount %s not running, unable to move clients ", dest->mount);
+        thread_mutex_unlock(&move_clients_mutex);
+        return 0;
+    }
+
+    while (1) {
+        client_t *client;
+        client_t *first = NULL;
+        client_t *last = NULL;
+        unsigned int moved = 0;
+        size_t count;
+
+        thread_rwlock_wlock(&source->client_lock);
+
+        if (source->on_demand == 0 && source->format == NULL) {
+            ICECAST_LOG_INFO("source mount %s is not available", source->mount);
+            client = NULL;
+        } else if (source->format && dest->format && source->format->type != dest->format->type) {
+            ICECAST_LOG_WARN("stream %s and %s are of different types, ignored", source->mount, dest->mount);
+            client = NULL;
+        } else {
+            /* the cursor goes on where the last batch stopped, even if that
+             * listener left meanwhile */
+            if (!started) {
+                source_walk_cursor_add(source, &cursor);
+                started = true;
+            }
+            client = cursor.client;
+        }
+
+        for (count = 0; client && count < SOURCE_WALK_BATCH; count++) {
+            client_t *next = client->listener_next;
+
+            /* with client_lock write locked the source does not touch the
+             * client, so it can be prepared before it is unlinked, which
+             * keeps its place on the list if that fails */
+            if (match(client, userdata) != 0 && source_move_clients__prepare(source, dest, client, direction) == 0) {
+                source_unlink_listener(source, client);
+                client->pending_next = first;
+                first = client;
+                if (!last)
+                    last = client;
+                moved++;
+            }
+
+            client = next;
+        }
+
+        if (started) {
+            cursor.client = client;
+            if (!client)
+                source_walk_cursor_remove(source, &cursor);
+        }
+        source->listeners -= moved;
+        thread_rwlock_unlock(&source->client_lock);
+
+        if (moved) {
+            stats_event_sub(source->mount, "listeners", moved);
+            source_add_pending_chain(dest, first, last, moved);
+            total += moved;
+        }
+
+        if (!client)
+            break;
+    }
+
+    ICECAST_LOG_INFO("passing %zu listeners to \"%s\"", total, dest->mount);
+
+    /* see if we need to wake up an on-demand relay */
+    if (dest->running == 0 && dest->on_demand && total)
+        dest->on_demand_req = 1;
+
+    thread_mutex_unlock(&move_clients_mutex);
+
+    return total;
+}
+
+
+static void source_block_listener(source_t *source, client_t *client)
+{
+    if (!source->listener_poll)
+        return;
+
+    if (fdpoll_arm(source->listener_poll, client->con->sock, FDPOLL_EVENT_WRITE, client) == 0)
+        client->write_blocked = 1;
+}
+
+/* must be called with client_lock write locked or from the source thread
+ * once the client has been removed from the list.
+ */
+static void source_unblock_listener(source_t *source, client_t *client)
+{
+    if (!client->write_blocked)
+        return;
+
+    client->write_blocked = 0;
+    if (source->listener_poll)
+        fdpoll_disarm(source->listener_poll, client->con->sock);
+}
+
+/* wait for the source socket to become readable or for any blocked listener
+ * to become writable. Listeners that are ready are unblocked so that the
+ * next pass in source_main() services them.
+ * Returns >0 if the source socket is readable, 0 if not, or -1 on error.
+ */
+static int source_wait_for_events(source_t *source, int delay)
+{
+    fdpoll_result_t results[MAX_POLL_EVENTS];
+    unsigned int generation = source->listener_poll_generation;
+    int source_ready = 0;
+    int have_listeners = 0;
+    ssize_t ret;
+    ssize_t i;
+
+    ret = fdpoll_wait(source->listener_poll, delay, results, MAX_POLL_EVENTS);
+    if (ret <= 0)
+        return ret;
+
+    for (i = 0; i < ret; i++) {
+        if (results[i].userdata == source) {
+            source_ready = 1;
+        } else {
+            have_listeners = 1;
+        }
+    }
+
+    if (have_listeners) {
+        thread_rwlock_wlock(&source->client_lock);
+        /* if a blocked listener was moved away while we waited the results
+         * may refer to clients we no longer own. As events are level
+         * triggered the remaining ones are reported again on the next wait. */
+        if (generation == source->listener_poll_generation) {
+            for (i = 0; i < ret; i++) {
+                if (results[i].userdata != source)
+                    source_unblock_listener(source, results[i].userdata);
+            }
+        }
+        thread_rwlock_unlock(&source->client_lock);
+    }
+
+    return source_ready;
+}
+
+/* Move the burst point on by one buffer. */
+static void source_release_burst_head(source_t *source)
+{
+    refbuf_t *to_release = source->burst_point;
+
+    if (source->sync_index_count && source->sync_index[0] == to_release)
+    {
+        source->sync_index_count--;
+        memmove(source->sync_index, source->sync_index + 1, source->sync_index_count * sizeof(refbuf_t *));
+    }
+    source->burst_point = to_release->next;
+    source->burst_offset -= to_release->len;
+    refbuf_release(to_release);
+}
+
+/* For formats with sync points far apart, keep the burst point on the
+ * newest sync point that still leaves burst_size bytes to send, so new
+ * listeners get the burst from a keyframe on rather than data they can
+ * not decode. Returns 0 if there is no such sync point yet. */
+static int source_burst_on_sync_point(source_t *source, refbuf_t *refbuf)
+{
+    refbuf_t *target = NULL;
+    unsigned int i;
+
+    if (refbuf->sync_point)
+    {
+        if (source->sync_index_count == SOURCE_SYNC_INDEX)
+        {
+            source->sync_index_count--;
+            memmove(source->sync_index, source->sync_index + 1, source->sync_index_count * sizeof(refbuf_t *));
+        }
+        source->sync_index[source->sync_index_count++] = refbuf;
+    }
+
+    for (i = source->sync_index_count; i > 0; i--)
+    {
+        if (source->queue_offset - source->sync_index[i - 1]->stream_offset >= source_burst_limit(source))
+        {
+            target = source->sync_index[i - 1];
+            break;
+        }
+    }
+    if (target == NULL)
+        return 0;
+
+    while (source->burst_point != target)
+        source_release_burst_head(source);
+    return 1;
+}
+
+/* Append a buffer read from the source to the in-flight data queue and
+ * update the burst point and dumpfile. */
+void source_queue_buffer(source_t *source, refbuf_t *refbuf)
+{
+    if (source->stream_data == NULL)
+    {
+        source->stream_data = refbuf;
+        source->burst_point = refbuf;
+    }
+    if (source->stream_data_tail)
+        refbuf_set_next(source->stream_data_tail, refbuf);
+    source->stream_data_tail = refbuf;
+    source->queue_size += refbuf->len;
+    refbuf->stream_offset = source->queue_offset;
+    source->queue_offset += refbuf->len;
+    /* new buffer is referenced for burst */
+    refbuf_addref(refbuf);
+
+    /* new data on queue, so check the burst point */
+    source->burst_offset += refbuf->len;
+    if (!source->format->sparse_sync || !source_burst_on_sync_point(source, refbuf))
+    {
+        /* without a usable sync point the burst is cut by size, waiting
+         * for one up to half the queue */
+        unsigned int limit = source_burst_limit(source);
+
+        if (source->format->sparse_sync && limit < source->queue_size_limit / 2)
+            limit = source->queue_size_limit / 2;
+        while (source->burst_offset > limit && source->burst_point->next)
+            source_release_burst_head(source);
+    }
+
+    if (source->timeshift)
+        timeshift_write(source->timeshift, refbuf);
+
+    if (source->shmring)
+        shmring_write(source->shmring, refbuf);
+
+    if (source->hls)
+        hls_write(source->hls, refbuf);
+
+    if (source->multicast)
+        multicast_write(source->multicast, refbuf);
+
+    /* save stream to file */
+    if (source->dumpfile && source->format->write_buf_to_file)
+        source->format->write_buf_to_file(source, refbuf);
+}
+
+/* Release the buffers at the head of the queue that neither a listener
+ * nor the burst still refers to. */
+void source_trim_queue(source_t *source)
+{
+    if (source->stream_data == NULL)
+        return;
+
+    /* normal unreferenced queue data will have a refcount 1, but
+     * burst queue data will be at least 2, active clients will also
+     * increase refcount */
+    while (refbuf_get_count(source->stream_data) == 1)
+    {
+        refbuf_t *to_go = source->stream_data;
+
+        if (to_go->next == NULL || source->burst_point == to_go)
+        {
+            /* this should not happen */
+            ICECAST_LOG_ERROR("queue state is unexpected");
+            source->running = 0;
+            break;
+        }
+        source->stream_data = to_go->next;
+        source->queue_size -= to_go->len;
+        to_go->next = NULL;
+        refbuf_release (to_go);
+    }
+}
+
+/* Publish what is sent to the listeners of the source and, as far as it
+ * changed, of the server */
+static void source_update_egress_stats(source_t *source)
+{
+    uint64_t rate = egress_get_rate(&source->egress);
+    uint64_t limit = atomic_u64_load(&source->egress.rate);
+
+    stats_event_args(source->mount, "outgoing_kbitrate", "%" PRIu64, rate * 8 / 1000);
+    if (limit) {
+        stats_event_args(source->mount, "bandwidth_utilization", "%" PRIu64, rate * 100 / limit);
+    } else {
+        stats_event(source->mount, "bandwidth_utilization", NULL);
+    }
+
+    egress_update_global_stats();
+}
+
+/* The bandwidth a new listener is going to take, by the bitrate if known, else
+ * by what the listeners take on average right now. */
+static uint64_t source_listener_bandwidth(source_t *source)
+{
+    if (source->bitrate)
+        return (uint64_t)source->bitrate * 1000 / 8;
+
+    if (!source->listeners)
+        return 0;
+
+    return egress_get_rate(&source->egress) / source->listeners;
+}
+
+int source_egress_admit(source_t *source)
+{
+    uint64_t limit;
+    uint64_t need = source_listener_bandwidth(source);
+    const char *reason = NULL;
+
+    limit = atomic_u64_load(&source->egress.rate);
+    if (limit) {
+        /* listeners queued but not yet added are going to take their share as well */
+        uint64_t projected = source->bitrate ?
+            need * (source->listeners + atomic_uint_load(&source->pending_count) + 1) :
+            egress_get_rate(&source->egress) + need * (atomic_uint_load(&source->pending_count) + 1);
+
+        if (projected > limit)
+            reason = "mount";
+    }
+
+    /* those queued on other mounts are taken to need as much as this one */
+    limit = atomic_u64_load(&egress_global.rate);
+    if (!reason && limit && (egress_get_rate(&egress_global) + need * (atomic_uint_load(&pending_total) + 1)) > limit)
+        reason = "server";
+
+    if (!reason)
+        return 0;
+
+    ICECAST_LOG_INFO("Bandwidth of the %s is used up, not adding another listener to %s", reason, source->mount);
+    stats_global_inc(STATS_GLOBAL_LISTENERS_REJECTED_BANDWIDTH);
+    return -1;
+}
+
+/* The input of the source is gone. Unless the input_lost callback puts a
+ * new one in place the source is stopped. */
+static void source_input_lost (source_t *source)
+{
+    if (source->input_lost && source->input_lost(source, source->input_lost_userdata) == 0)
+        return;
+
+    source->running = 0;
+}
+
+int source_replace_input (source_t *source, client_t *client)
+{
+    const char *contenttype = httpp_getvar (client->parser, "content-type");
+    client_t *old = source->client;
+    http_parser_t *parser;
+
+    /* the source loop waits on listener_poll, which can take the new socket */
+    if (!source->listener_poll || !source->format->reset_input || !old)
+        return -1;
+
+    if (contenttype == NULL || format_get_type (contenttype) != source->format->type)
+    {
+        ICECAST_LOG_WARN("New input for %s is of a different type", source->mount);
+        return -1;
+    }
+
+    if (source->format->reset_input (source->format, client->parser) != 0)
+        return -1;
+
+    fdpoll_disarm (source->listener_poll, source->con->sock);
+    if (fdpoll_arm (source->listener_poll, client->con->sock, FDPOLL_EVENT_READ, source) != 0)
+    {
+        ICECAST_LOG_WARN("Cannot poll new input for %s", source->mount);
+        return -1;
+    }
+
+    /* the format plugin refers to the headers of the first input, so those
+     * are kept and go with the new client */
+    parser = old->parser;
+    old->parser = client->parser;
+    client->parser = parser;
+
+    source->client = client;
+    source->con = client->con;
+    client_destroy (old);
+
+    source->last_read = time (NULL);
+    stats_event (source->mount, "source_ip", client->con->ip);
+    ICECAST_LOG_INFO("Input of %s continues from %s", source->mount, client->con->ip);
+
+    return 0;
+}
 
-                next = avl_get_next(next);
+/* Collect the pending events for the source and its blocked listeners and
+ * read all the stream data that is available, up to SOURCE_MAX_READ_BYTES,
+ * onto the queue. This never waits, the source loop only runs the source
+ * once it has something to do or a timer expired.
+ */
+static void source_read_input (source_t *source)
+{
+    size_t read = 0;
+    int fds = 0;
+    time_t current = coarsetime_get();
 
-                if (source_move_clients__single(source, dest, source->client_tree, dest->pending_tree, node->key, direction) == 0)
-                    count++;
-            }
+    if (source->listener_poll)
+    {
+        fds = source_wait_for_events (source, 0);
+        if (!source->client)
+            source->last_read = current;
+    }
+    else if (source->client)
+        fds = util_timed_wait_for_fd (source->con->sock, 0);
+    else
+        source->last_read = current;
+
+    if (current >= source->client_stats_update)
+    {
+        if (source->dumpfile)
+            stats_event_args (source->mount, "dumpfile_dropped",
+                    "%"PRIu64, dumpfile_get_dropped(source->dumpfile));
+        if (source->timeshift)
+            stats_event_args (source->mount, "timeshift_seconds",
+                    "%u", timeshift_get_duration(source->timeshift));
+        if (source->multicast)
+        {
+            stats_event_args (source->mount, "multicast_packets",
+                    "%"PRIu64, multicast_get_sent(source->multicast));
+            stats_event_args (source->mount, "multicast_dropped",
+                    "%"PRIu64, multicast_get_dropped(source->multicast));
+        }
+        source_update_egress_stats(source);
+        source->client_stats_update = current + 5;
+        source->queue_sample = 1;
+    }
+    if (fds < 0)
+    {
+        if (! sock_recoverable (sock_error()))
+        {
+            ICECAST_LOG_WARN("Error while waiting on socket, Disconnecting source");
+            source_input_lost (source);
+        }
+        return;
+    }
+    if (fds == 0)
+    {
+        thread_mutex_lock(&source->lock);
+        if ((source->last_read + (time_t)source->timeout) < current)
+        {
+            ICECAST_LOG_DEBUG("last %ld, timeout %d, now %ld", (long)source->last_read,
+                    source->timeout, (long)current);
+            ICECAST_LOG_WARN("Disconnecting source due to socket timeout");
+            thread_mutex_unlock(&source->lock);
+            source_input_lost (source);
+            return;
         }
+        thread_mutex_unlock(&source->lock);
+        return;
+    }
+    source->last_read = current;
 
-        ICECAST_LOG_INFO("passing %lu listeners to \"%s\"", count, dest->mount);
+    /* the format may hand out several buffers for one read, so keep going
+     * until it has nothing left rather than waiting for the next event */
+    while (read < SOURCE_MAX_READ_BYTES)
+    {
+        refbuf_t *refbuf = source->format->get_buffer (source);
 
-        source->listeners -= count;
-        stats_event_sub(source->mount, "listeners", count);
-    } while (0);
+        if (refbuf)
+        {
+            source_queue_buffer (source, refbuf);
+            read += refbuf->len;
+        }
+        if (client_body_eof(source->client)) {
+            ICECAST_LOG_INFO("End of Stream %s", source->mount);
+            source_input_lost (source);
+            break;
+        }
+        if (refbuf == NULL)
+            break;
+    }
+}
 
-    avl_tree_unlock(source->pending_tree);
-    avl_tree_unlock(source->client_tree);
 
-    /* see if we need to wake up an on-demand relay */
-    if (dest->running == 0 && dest->on_demand && count)
-        dest->on_demand_req = 1;
+/* Bytes a listener on the queue is behind its end, 0 if it is elsewhere. */
+static inline uint64_t source_listener_lag(source_t *source, client_t *client)
+{
+    uint64_t position;
 
-    avl_tree_unlock(dest->pending_tree);
-    thread_mutex_unlock(&move_clients_mutex);
+    if (client->check_buffer != format_advance_queue || !client->refbuf)
+        return 0;
+
+    position = client->refbuf->stream_offset + client->pos;
+    if (position >= source->queue_offset)
+        return 0;
+
+    return source->queue_offset - position;
+}
+
+/* The newest buffer of the queue a listener can start playing on. */
+static refbuf_t *source_newest_sync_point(source_t *source)
+{
+    refbuf_t *refbuf;
+    refbuf_t *found = NULL;
+
+    if (source->stream_data_tail && source->stream_data_tail->sync_point)
+        return source->stream_data_tail;
+    if (source->format->sparse_sync && source->sync_index_count)
+        return source->sync_index[source->sync_index_count - 1];
+
+    for (refbuf = source->burst_point; refbuf; refbuf = refbuf_get_next(refbuf))
+        if (refbuf->sync_point)
+            found = refbuf;
+
+    return found;
+}
+
+/* Takes the <lag-action> of the mount on a listener that fell more than
+ * <max-lag> seconds behind. Runs where send_to_listener() runs, so moving
+ * the listener to the fallback is left to the source thread.
+ */
+static void source_handle_lagging_listener(source_t *source, client_t *client, uint64_t lag)
+{
+    refbuf_t *refbuf;
+
+    switch (source->lag_action) {
+        case LAG_ACTION_SKIP:
+            refbuf = source_newest_sync_point(source);
+            if (refbuf && refbuf->stream_offset > client->refbuf->stream_offset) {
+                ICECAST_LOG_INFO("Client %lu (%s) is %" PRIu64 " bytes behind, skipping ahead",
+                        client->con->id, client->con->ip, lag);
+                client_set_queue(client, refbuf);
+                client->pos = refbuf->sync_offset;
+                stats_counter_inc(source->stats_lag_skips);
+                return;
+            }
+            break;
+        case LAG_ACTION_FALLBACK:
+            /* the move is tried once, if it failed the listener is dropped */
+            if (source->fallback_mount && !client->lag_fallback) {
+                client->lag_fallback = 1;
+                return;
+            }
+            break;
+        default:
+            break;
+    }
+
+    ICECAST_LOG_INFO("Client %lu (%s) is %" PRIu64 " bytes behind, removing",
+            client->con->id, client->con->ip, lag);
+    stats_counter_inc(source->stats_slow_listeners);
+    client->con->discon_reason = "too-slow";
+    client->con->error = 1;
+}
+
+/* Decides on the burst of a new listener on a mount with <burst-size-max>
+ * once it got the first burst_size bytes. All of the larger burst is kept
+ * for it if it took those at BURST_KEEPUP_FACTOR times the stream rate,
+ * otherwise it skips to the newest sync point, which leaves it about the
+ * burst_size it already got. Like send_to_listener() it only touches the
+ * client itself.
+ */
+static void source_check_burst(source_t *source, client_t *client)
+{
+    uint64_t sent = client->con->sent_bytes - client->burst_sent;
+    uint64_t probe = source->burst_size > BURST_PROBE_MIN ? source->burst_size : BURST_PROBE_MIN;
+    uint64_t elapsed;
+    uint64_t rate;
+    refbuf_t *refbuf;
+
+    /* the headers and intro go first, the burst is decided on the queue */
+    if (sent < probe || client->check_buffer != format_advance_queue || !client->refbuf)
+        return;
+
+    elapsed = coarsetime_get_ms() - client->burst_start;
+    client->burst_start = 0;
+    rate = source->stream_rate ? source->stream_rate : (uint64_t)source->bitrate * 1000 / 8;
+    if (!rate || sent * 1000 >= elapsed * rate * BURST_KEEPUP_FACTOR)
+        return;
+
+    if (source_listener_lag(source, client) <= source->burst_size)
+        return;
+
+    refbuf = source_newest_sync_point(source);
+    if (refbuf && refbuf->stream_offset > client->refbuf->stream_offset) {
+        ICECAST_LOG_DEBUG("Client %lu (%s) took %" PRIu64 " bytes in %" PRIu64 " ms, cutting its burst",
+                client->con->id, client->con->ip, sent, elapsed);
+        client_set_queue(client, refbuf);
+        client->pos = refbuf->sync_offset;
+        if (client->pace_after)
+            client->pace_after = client->con->sent_bytes + source_listener_lag(source, client) + 1;
+        stats_counter_inc(source->stats_burst_cuts);
+    }
 }
 
+#define CLIENT_OF_TIMER(entry) ((client_t *)((char *)(entry) - offsetof(client_t, discon_timer)))
+
+/* Marks the listeners whose listening time is up, so the pass drops them.
+ * Must be called with client_lock write locked.
+ */
+static void source_expire_listeners(source_t *source)
+{
+    timerwheel_entry_t *entry;
+
+    if (!source->listener_timers)
+        return;
+
+    while ((entry = timerwheel_expire(source->listener_timers, coarsetime_get()))) {
+        client_t *client = CLIENT_OF_TIMER(entry);
 
-/* get some data from the source. The stream data is placed in a refbuf
- * and sent back, however NULL is also valid as in the case of a short
- * timeout and there's no data pending.
+        ICECAST_LOG_INFO("time limit reached for client #%lu", client->con->id);
+        client->con->discon_reason = "time-limit";
+        client->con->error = 1;
+    }
+}
+
+/* general send routine per listener.  The deletion_expected tells us whether
+ * the last in the queue is about to disappear, so if this client is still
+ * referring to it after writing then drop the client as it's fallen too far
+ * behind. Listeners whose socket is known to be full are skipped until the
+ * poller reports them as writable again.
+ * This may run in a listener worker, so it must only touch the client itself
+ * and source state that does not change while client_lock is held.
+ * Returns true if the client has more data pending and the source thread
+ * should not wait long before the next pass.
  */
-static refbuf_t *get_next_buffer (source_t *source)
+static int send_to_listener (source_t *source, client_t *client, int deletion_expected)
 {
-    refbuf_t *refbuf = NULL;
-    int delay = 250;
+    int (*check_buffer)(source_t *source, client_t *client);
+    int short_delay = 0;
+    int bytes;
+    int loop = 10;   /* max number of iterations in one go */
+    int total_written = 0;
+    unsigned int pass_sent = client->pass_sent;
 
-    if (source->short_delay)
-        delay = 0;
-    while (global.running == ICECAST_RUNNING && source->running)
+    client->pass_sent = 0;
+
+    while (!client->write_blocked)
     {
-        int fds = 0;
-        time_t current = time (NULL);
+        /* jump out if client connection has died */
+        if (client->con->error)
+            break;
 
-        if (source->client)
-            fds = util_timed_wait_for_fd (source->con->sock, delay);
-        else
+        /* lets not send too much to one client in one go, but don't
+           sleep for too long if more data can be sent */
+        if ((pass_sent + total_written) > SOURCE_LISTENER_PASS_BYTES || loop == 0)
         {
-            thread_sleep (delay*1000);
-            source->last_read = current;
+            if (client->check_buffer != format_check_file_buffer)
+                short_delay = 1;
+            break;
         }
 
-        if (current >= source->client_stats_update)
+        loop--;
+
+        check_buffer = client->check_buffer;
+        if (client->check_buffer(source, client) < 0)
         {
-            stats_event_args (source->mount, "total_bytes_read",
-                    "%"PRIu64, source->format->read_bytes);
-            stats_event_args (source->mount, "total_bytes_sent",
-                    "%"PRIu64, source->format->sent_bytes);
-            source->client_stats_update = current + 5;
+            /* the client moved on from its headers or the intro to the
+             * stream queue, so don't make it wait for the next pass to get
+             * the burst */
+            if (client->check_buffer != check_buffer)
+                continue;
+            break;
         }
-        if (fds < 0)
+
+        /* over the bandwidth limit, try again shortly */
+        if (!egress_allowed(&source->egress) || !egress_allowed(&egress_global))
         {
-            if (! sock_recoverable (sock_error()))
-            {
-                ICECAST_LOG_WARN("Error while waiting on socket, Disconnecting source");
-                source->running = 0;
-            }
+            short_delay = 1;
             break;
         }
-        if (fds == 0)
+
+        bytes = client->write_to_client(client);
+        if (bytes <= 0)
         {
-            thread_mutex_lock(&source->lock);
-            if ((source->last_read + (time_t)source->timeout) < current)
-            {
-                ICECAST_LOG_DEBUG("last %ld, timeout %d, now %ld", (long)source->last_read,
-                        source->timeout, (long)current);
-                ICECAST_LOG_WARN("Disconnecting source due to socket timeout");
-                source->running = 0;
-            }
-            thread_mutex_unlock(&source->lock);
+            /* can't write any more, wait for the socket to drain */
+            if (!client->con->error)
+                source_block_listener(source, client);
             break;
         }
-        source->last_read = current;
-        refbuf = source->format->get_buffer (source);
-        if (client_body_eof(source->client)) {
-            ICECAST_LOG_INFO("End of Stream %s", source->mount);
-            source->running = 0;
+
+        egress_count(&source->egress, bytes);
+        egress_count(&egress_global, bytes);
+        total_written += bytes;
+    }
+    if (total_written)
+        atomic_u64_add(&source->format->sent_bytes, total_written);
+
+    if (client->burst_start && !client->con->error)
+        source_check_burst(source, client);
+
+    if (client->pace_after && client->con->sent_bytes >= client->pace_after && source->listener_pacing_rate) {
+        source_set_listener_pacing(client, source->listener_pacing_rate);
+        client->paced = 1;
+        client->pace_after = 0;
+    }
+
+    if (source->max_lag && source->stream_rate && !client->con->error) {
+        uint64_t lag = source_listener_lag(source, client);
+
+        if (lag > (uint64_t)source->max_lag * source->stream_rate) {
+            source_handle_lagging_listener(source, client, lag);
+        } else {
+            client->lag_fallback = 0;
+        }
+    }
+
+    /* the refbuf referenced at head (last in queue) may be marked for deletion
+     * if so, check to see if this client is still referring to it */
+    if (deletion_expected && client->refbuf && client->refbuf == source->stream_data)
+    {
+        ICECAST_LOG_INFO("Client %lu (%s) has fallen too far behind, removing",
+                client->con->id, client->con->ip);
+        stats_counter_inc(source->stats_slow_listeners);
+        client->con->discon_reason = "too-slow";
+        client->con->error = 1;
+    }
+
+    return short_delay;
+}
+
+
+typedef struct {
+    source_t *source;
+    size_t count;
+    int deletion_expected;
+    volatile unsigned int short_delay;
+} listener_job_t;
+
+static void send_to_listener_slice(size_t index, size_t slices, void *userdata)
+{
+    listener_job_t *job = userdata;
+    size_t start = job->count * index / slices;
+    size_t end = job->count * (index + 1) / slices;
+    int short_delay = 0;
+    size_t i;
+
+    for (i = start; i < end; i++)
+        short_delay |= send_to_listener(job->source, job->source->listener_batch[i], job->deletion_expected);
+
+    if (short_delay)
+        atomic_uint_store(&job->short_delay, 1);
+}
+
+/* Start, resize or stop the listener workers to match the mount setting.
+ * Called by the source thread with client_lock held.
+ */
+static void source_update_listener_pool(source_t *source)
+{
+    size_t want = source->listener_workers > 1 ? source->listener_workers : 0;
+
+    if (workpool_get_slices(source->listener_pool) == want)
+        return;
+
+    workpool_free(source->listener_pool);
+    source->listener_pool = NULL;
+
+    if (want) {
+        source->listener_pool = workpool_new("Listener Worker", want);
+        if (source->listener_pool) {
+            ICECAST_LOG_INFO("Using %zu listener workers for %s", want, source->mount);
+        } else {
+            ICECAST_LOG_ERROR("Can not start listener workers for %s, using the source thread only", source->mount);
+            /* don't retry on every pass */
+            source->listener_workers = 0;
+        }
+    }
+}
+
+/* Makes listener_batch large enough for all listeners. */
+static int source_grow_listener_batch(source_t *source)
+{
+    size_t len;
+    client_t **batch;
+    unsigned char *cohort;
+
+    if (source->listener_batch_len >= source->listeners)
+        return 0;
+
+    len = source->listeners + source->listeners / 2;
+    batch = realloc(source->listener_batch, sizeof(*batch) * len);
+    if (!batch)
+        return -1;
+    source->listener_batch = batch;
+
+    cohort = realloc(source->listener_cohort, sizeof(*cohort) * len);
+    if (!cohort)
+        return -1;
+    source->listener_cohort = cohort;
+
+    source->listener_batch_len = len;
+
+    return 0;
+}
+
+typedef struct {
+    refbuf_t *refbuf;
+    unsigned int pos;
+    struct iovec iov[FORMAT_MAX_IOV];
+    size_t count;
+} listener_cohort_t;
+
+typedef struct {
+    source_t *source;
+    uint64_t sent;
+    /* bytes counted against the limits for each send on the ring, all of
+     * them are of the same cohort */
+    uint64_t charged;
+} cohort_send_t;
+
+/* Takes the result of a write to a listener of a cohort. */
+static void source_cohort_sent(void *userdata, ssize_t ret, void *arg)
+{
+    client_t *client = userdata;
+    cohort_send_t *send = arg;
+
+    if (ret <= 0) {
+        if (!client->con->error)
+            source_block_listener(send->source, client);
+        return;
+    }
+
+    format_move_client(client, ret);
+    client->pass_sent += ret;
+    send->sent += ret;
+}
+
+static void source_cohort_uring_sent(void *userdata, ssize_t ret, void *arg)
+{
+    client_t *client = userdata;
+    cohort_send_t *send = arg;
+    uint64_t shortfall = ret > 0 ? send->charged - ret : send->charged;
+
+    if (shortfall) {
+        egress_refund(&send->source->egress, shortfall);
+        egress_refund(&egress_global, shortfall);
+    }
+
+    connection_sent_on_socket(client->con, ret);
+    source_cohort_sent(userdata, ret, arg);
+}
+
+/* Sends the batch queued on the ring, which is given up if it fails. */
+static void source_complete_uring(source_t *source, cohort_send_t *send)
+{
+    if (uring_complete(source->listener_uring, source_cohort_uring_sent, send) != 0) {
+        ICECAST_LOG_WARN("Giving up on io_uring for %s", source->mount);
+        uring_free(source->listener_uring);
+        source->listener_uring = NULL;
+        source->listener_uring_failed = 1;
+    }
+}
+
+/* In the steady state most listeners are caught up and wait at the same
+ * place of the queue. Those that are sent to with the generic write routine
+ * are grouped by that place, so what to send is worked out once per group
+ * and then only written to each of them. Whatever is left to do for each
+ * listener, like the rest of the data or dropping it, is done by
+ * send_to_listener() afterwards, which finds nothing to send for the ones
+ * that got everything and counts what was sent here against its per pass
+ * cap, so a listener gets no more than with send_to_listener() alone. Must be called with client_lock write locked.
+ * Returns true if the source thread should not wait long before the next
+ * pass.
+ */
+static int source_send_to_cohorts(source_t *source)
+{
+    listener_cohort_t cohorts[SOURCE_MAX_COHORTS];
+    cohort_send_t send;
+    size_t used = 0;
+    size_t members = 0;
+    size_t i, c;
+    ssize_t ret;
+    int short_delay = 0;
+    client_t *client;
+
+    if (source_grow_listener_batch(source) != 0)
+        return 0;
+
+    for (client = source->client_list; client && members < source->listener_batch_len; client = client->listener_next) {
+        refbuf_t *refbuf = client->refbuf;
+        unsigned int pos = client->pos;
+
+        if (client->check_buffer != format_advance_queue || client->write_to_client != format_queue_write_to_client ||
+                client->write_blocked || client->con->error || !refbuf)
             continue;
+
+        /* a listener done with its buffer waits for the next one */
+        if (pos == refbuf->len) {
+            refbuf = refbuf_get_next(refbuf);
+            pos = 0;
+            if (!refbuf)
+                continue;
         }
-        if (refbuf)
+
+        for (c = 0; c < used; c++)
+            if (cohorts[c].refbuf == refbuf && cohorts[c].pos == pos)
+                break;
+        if (c == used) {
+            if (used == SOURCE_MAX_COHORTS)
+                continue;
+            cohorts[c].refbuf = refbuf;
+            cohorts[c].pos = pos;
+            used++;
+        }
+
+        source->listener_batch[members] = client;
+        source->listener_cohort[members] = c;
+        members++;
+    }
+
+    /* with many listeners their sends are handed to the kernel in one go */
+    if (!source->listener_uring && !source->listener_uring_failed && members >= SOURCE_URING_MIN_LISTENERS) {
+        source->listener_uring = uring_new(SOURCE_URING_ENTRIES);
+        if (source->listener_uring) {
+            ICECAST_LOG_INFO("Using io_uring to send to the listeners of %s", source->mount);
+        } else {
+            source->listener_uring_failed = 1;
+        }
+    }
+
+    send.source = source;
+    send.sent = 0;
+    send.charged = 0;
+
+    for (c = 0; c < used && !short_delay; c++) {
+        listener_cohort_t *cohort = &(cohorts[c]);
+        refbuf_t *refbuf = cohort->refbuf;
+        size_t total;
+
+        cohort->iov[0].iov_base = refbuf->data + cohort->pos;
+        cohort->iov[0].iov_len = refbuf->len - cohort->pos;
+        total = cohort->iov[0].iov_len;
+        cohort->count = 1;
+        for (refbuf = refbuf_get_next(refbuf); refbuf && cohort->count < FORMAT_MAX_IOV && total < FORMAT_MAX_IOV_BYTES; refbuf = refbuf_get_next(refbuf)) {
+            cohort->iov[cohort->count].iov_base = refbuf->data;
+            cohort->iov[cohort->count].iov_len = refbuf->len;
+            total += refbuf->len;
+            cohort->count++;
+        }
+        send.charged = total;
+
+        for (i = 0; i < members; i++) {
+            sock_t sock;
+
+            if (source->listener_cohort[i] != c)
+                continue;
+
+            /* over the bandwidth limit, the rest waits for the next pass */
+            if (!egress_allowed(&source->egress) || !egress_allowed(&egress_global)) {
+                short_delay = 1;
+                break;
+            }
+
+            client = source->listener_batch[i];
+            sock = source->listener_uring ? connection_get_plain_socket(client->con) : SOCK_ERROR;
+            if (sock != SOCK_ERROR) {
+                /* the send is counted in full when queued, so a batch does
+                 * not go past the limit before it completes */
+                if (uring_queue_send(source->listener_uring, sock, cohort->iov, cohort->count, client) == 0) {
+                    egress_count(&source->egress, total);
+                    egress_count(&egress_global, total);
+                    continue;
+                }
+                /* the ring is full, send what is on it and start again */
+                source_complete_uring(source, &send);
+                if (source->listener_uring && uring_queue_send(source->listener_uring, sock, cohort->iov, cohort->count, client) == 0) {
+                    egress_count(&source->egress, total);
+                    egress_count(&egress_global, total);
+                    continue;
+                }
+            }
+
+            ret = client_send_vector(client, cohort->iov, cohort->count);
+            if (ret > 0) {
+                egress_count(&source->egress, ret);
+                egress_count(&egress_global, ret);
+            }
+            source_cohort_sent(client, ret, &send);
+        }
+
+        /* the iovec of the cohort is only good for this loop */
+        if (source->listener_uring)
+            source_complete_uring(source, &send);
+    }
+
+    if (send.sent)
+        atomic_u64_add(&source->format->sent_bytes, send.sent);
+
+    return short_delay;
+}
+
+/* Send to all listeners that are reading from the stream queue using the
+ * listener workers. Each worker gets a share of those listeners. Listeners
+ * still sending headers or the intro file use state owned by the source
+ * thread and are left for the caller.
+ * Returns true if this was done, false if the caller should send to all
+ * listeners itself. Must be called with client_lock write locked.
+ */
+static int source_send_to_listeners_parallel(source_t *source, int deletion_expected)
+{
+    listener_job_t job;
+    size_t slices;
+    client_t *client;
+
+    source_update_listener_pool(source);
+    slices = workpool_get_slices(source->listener_pool);
+    if (!slices || source->listeners < slices * MIN_LISTENERS_PER_WORKER)
+        return 0;
+
+    if (source_grow_listener_batch(source) != 0)
+        return 0;
+
+    job.source = source;
+    job.count = 0;
+    job.deletion_expected = deletion_expected;
+    job.short_delay = 0;
+
+    for (client = source->client_list; client && job.count < source->listener_batch_len; client = client->listener_next) {
+        if (client->check_buffer == format_advance_queue && !client->con->error)
+            source->listener_batch[job.count++] = client;
+    }
+
+    workpool_run(source->listener_pool, send_to_listener_slice, &job);
+
+    if (job.short_delay)
+        source->short_delay = 1;
+
+    return 1;
+}
+
+
+/* Adds the lag of a listener on the queue or the intro buffer it holds to
+ * the sample.
+ */
+static void source_sample_listener(source_t *source, queue_sample_t *sample, client_t *client)
+{
+    uint64_t position;
+    uint64_t bucket;
+    size_t i;
+
+    client->lag = 0;
+    if (!client->refbuf)
+        return;
+
+    /* cached intro buffers are shared and counted once per source */
+    if (client->check_buffer == format_check_file_buffer) {
+        if (source->intro_file)
+            sample->intro_bytes += client->refbuf->len;
+        return;
+    }
+
+    if (client->check_buffer != format_advance_queue)
+        return;
+
+    /* lag is counted back from the end of the queue, in buckets of
+     * 1/QUEUE_LAG_BUCKETS of the queue limit */
+    position = client->refbuf->stream_offset + client->pos;
+    bucket = 0;
+    if (position < source->queue_offset)
+        bucket = (source->queue_offset - position) * QUEUE_LAG_BUCKETS / ((uint64_t)sample->limit + 1);
+    if (bucket >= QUEUE_LAG_BUCKETS)
+        bucket = QUEUE_LAG_BUCKETS - 1;
+
+    sample->lag[bucket]++;
+    sample->listeners++;
+
+    client->lag = source_listener_lag(source, client);
+    if (client->lag > sample->lag_max)
+        sample->lag_max = client->lag;
+    for (i = 0; i < LAG_HISTOGRAM_BUCKETS - 1; i++)
+        if (source->stream_rate && client->lag < (uint64_t)lag_histogram_bounds[i] * source->stream_rate)
             break;
+    sample->lag_seconds[i]++;
+}
+
+/* Measures the rate the stream is queued at, which turns the lag of the
+ * listeners into seconds. Until there is a measurement the bitrate of the
+ * mount is used. */
+static void source_update_stream_rate(source_t *source, uint64_t now)
+{
+    if (!source->stream_rate_start) {
+        if (source->bitrate)
+            source->stream_rate = source->bitrate * 1000 / 8;
+    } else if (now > source->stream_rate_start && source->queue_offset > source->stream_rate_offset) {
+        source->stream_rate = (source->queue_offset - source->stream_rate_offset) * 1000 / (now - source->stream_rate_start);
     }
+    source->stream_rate_start = now;
+    source->stream_rate_offset = source->queue_offset;
+}
 
-    return refbuf;
+static int source_match_lag_fallback(client_t *client, void *userdata)
+{
+    (void)userdata;
+    return client->lag_fallback;
 }
 
+/* Moves the listeners that lagged too far to the fallback mount, the ones
+ * that can not be moved are dropped by the next pass. Called by the source
+ * thread without client_lock. */
+static void source_move_lagging_listeners(source_t *source)
+{
+    source_t *fallback_source;
+    size_t moved = 0;
+
+    avl_tree_rlock(global.source_tree);
+    fallback_source = source_find_mount(source->fallback_mount);
+    if (fallback_source)
+        moved = source_move_clients_matching(source, fallback_source, source_match_lag_fallback, NULL, NAVIGATION_DIRECTION_DOWN);
+    avl_tree_unlock(global.source_tree);
 
-/* general send routine per listener.  The deletion_expected tells us whether
- * the last in the queue is about to disappear, so if this client is still
- * referring to it after writing then drop the client as it's fallen too far
- * behind
+    if (moved) {
+        ICECAST_LOG_INFO("Moved %zu lagging listeners of %s to %s", moved, source->mount, source->fallback_mount);
+        stats_counter_add(source->stats_lag_fallbacks, moved);
+    }
+}
+
+/* Works out from the sampled lag how much queue the listeners of this source
+ * need and what share of <queue-memory-limit> it gets, then publishes the
+ * memory the source retains. With the budget exhausted every source gets a
+ * share in proportion to its demand, otherwise the spare part of the budget
+ * is handed out the same way. Called by the source thread every few seconds.
  */
-static void send_to_listener (source_t *source, client_t *client, int deletion_expected)
+static void source_update_queue_budget(source_t *source, const queue_sample_t *sample)
 {
-    int bytes;
-    int loop = 10;   /* max number of iterations in one go */
-    int total_written = 0;
+    ice_config_t *config;
+    uint64_t budget;
+    uint64_t demand;
+    uint64_t total;
+    uint64_t allowed;
+    uint64_t floor;
+    uint64_t retained;
+    size_t wanted;
+    size_t seen = 0;
+    size_t i;
+
+    floor = (uint64_t)(source->burst_offset > source_burst_limit(source) ? source->burst_offset : source_burst_limit(source)) + QUEUE_MIN_SLACK;
+
+    demand = 0;
+    wanted = (sample->listeners * QUEUE_LAG_QUANTILE + 99) / 100;
+    for (i = 0; i < QUEUE_LAG_BUCKETS && seen < wanted; i++) {
+        seen += sample->lag[i];
+        demand = ((uint64_t)sample->limit + 1) * (i + 1) / QUEUE_LAG_BUCKETS;
+    }
+    demand += demand / 4;
+    if (demand < floor)
+        demand = floor;
+    if (demand > sample->limit)
+        demand = sample->limit;
 
-    while (1)
-    {
-        /* check for limited listener time */
-        if (client->con->discon_time)
-            if (time(NULL) >= client->con->discon_time)
-            {
-                ICECAST_LOG_INFO("time limit reached for client #%lu", client->con->id);
-                client->con->error = 1;
-            }
+    /* unsigned wrap around makes this a subtraction for a smaller demand */
+    total = atomic_u64_add(&queue_demand_total, demand - source->queue_demand);
+    source->queue_demand = demand;
 
-        /* jump out if client connection has died */
-        if (client->con->error)
-            break;
+    config = config_get_config();
+    budget = config->queue_memory_limit;
+    config_release_config();
 
-        /* lets not send too much to one client in one go, but don't
-           sleep for too long if more data can be sent */
-        if (total_written > 20000 || loop == 0)
-        {
-            if (client->check_buffer != format_check_file_buffer)
-                source->short_delay = 1;
-            break;
+    allowed = 0;
+    if (budget && total) {
+        if (total <= budget) {
+            allowed = demand + (budget - total) * demand / total;
+        } else {
+            allowed = budget * demand / total;
         }
+        if (allowed < floor)
+            allowed = floor;
+        if (allowed > sample->limit)
+            allowed = sample->limit;
+    }
 
-        loop--;
+    source->intro_bytes = sample->intro_bytes + introcache_get_size(&source->intro);
+    source->header_bytes = 0;
+    if (source->format && source->format->get_header_bytes)
+        source->header_bytes = source->format->get_header_bytes(source->format);
+    source->arena_bytes = arena_get_used(&source->arena);
+    if (source->format && source->format->get_arena_bytes)
+        source->arena_bytes += source->format->get_arena_bytes(source->format);
 
-        if (client->check_buffer(source, client) < 0)
-            break;
+    /* the burst is part of the queue so it is not added again */
+    retained = (uint64_t)source->queue_size + source->intro_bytes + source->header_bytes;
+    total = atomic_u64_add(&queue_retained_total, retained - source->retained_bytes);
+    source->retained_bytes = retained;
 
-        bytes = client->write_to_client(client);
-        if (bytes <= 0)
-            break; /* can't write any more */
+    thread_mutex_lock(&source->lock);
+    source->queue_size_allowed = allowed;
+    thread_mutex_unlock(&source->lock);
 
-        total_written += bytes;
+    stats_event_args(source->mount, "queue_bytes", "%u", source->queue_size);
+    stats_event_args(source->mount, "queue_limit", "%u", allowed ? (unsigned int)allowed : sample->limit);
+    stats_event_args(source->mount, "burst_bytes", "%u", source->burst_offset);
+    stats_event_args(source->mount, "intro_bytes", "%zu", source->intro_bytes);
+    stats_event_args(source->mount, "header_bytes", "%zu", source->header_bytes);
+    stats_event_args(source->mount, "arena_bytes", "%zu", source->arena_bytes);
+    stats_event_args(source->mount, "retained_bytes", "%" PRIu64, retained);
+    stats_event_args(source->mount, "lag_max_bytes", "%" PRIu64, sample->lag_max);
+    if (source->stream_rate) {
+        char name[32];
+
+        for (i = 0; i < LAG_HISTOGRAM_BUCKETS; i++) {
+            if (i < LAG_HISTOGRAM_BUCKETS - 1) {
+                snprintf(name, sizeof(name), "lag_under_%us", lag_histogram_bounds[i]);
+            } else {
+                snprintf(name, sizeof(name), "lag_over_%us", lag_histogram_bounds[i - 1]);
+            }
+            stats_event_args(source->mount, name, "%u", sample->lag_seconds[i]);
+        }
     }
-    source->format->sent_bytes += total_written;
+    stats_event_args(NULL, "queue_memory", "%" PRIu64, total);
+}
 
-    /* the refbuf referenced at head (last in queue) may be marked for deletion
-     * if so, check to see if this client is still referring to it */
-    if (deletion_expected && client->refbuf && client->refbuf == source->stream_data)
-    {
-        ICECAST_LOG_INFO("Client %lu (%s) has fallen too far behind, removing",
-                client->con->id, client->con->ip);
-        stats_event_inc (source->mount, "slow_listeners");
-        client->con->error = 1;
-    }
+/* Drops what the source counted against the queue memory budget. */
+static void source_release_queue_budget(source_t *source)
+{
+    uint64_t total;
+
+    atomic_u64_add(&queue_demand_total, -(uint64_t)source->queue_demand);
+    total = atomic_u64_add(&queue_retained_total, -source->retained_bytes);
+    if (source->queue_demand || source->retained_bytes)
+        stats_event_args(NULL, "queue_memory", "%" PRIu64, total);
+
+    source->queue_demand = 0;
+    source->queue_size_allowed = 0;
+    source->retained_bytes = 0;
+    source->intro_bytes = 0;
+    source->header_bytes = 0;
+}
+
+uint64_t source_get_queue_memory(void)
+{
+    return atomic_u64_load(&queue_retained_total);
 }
 
 
-/* Open the file for stream dumping.
+/* Open the file for stream dumping, or for a capture if header is given.
  * This function should do all processing of the filename.
  */
-static FILE * source_open_dumpfile(const char * filename) {
+static dumpfile_t * source_open_dumpfile(const char * filename, const char *header) {
 #ifndef _WIN32
     /* some of the below functions seems not to be standard winapi functions */
     char buffer[PATH_MAX];
@@ -624,13 +2710,38 @@ static FILE * source_open_dumpfile(const char * filename) {
     filename = buffer;
 #endif
 
-    return fopen (filename, "ab");
+    if (header)
+        return dumpfile_open_capture (filename, header);
+    return dumpfile_open (filename);
+}
+
+/* The request headers of the source client that describe the stream, so a
+ * replay of the capture sets up the mount the same way. Credentials and the
+ * like are left out. */
+static void source_capture_header(source_t *source, char *buffer, size_t len)
+{
+    static const char *names[] = {"ice-name", "ice-description", "ice-genre", "ice-url", "ice-bitrate", "ice-audio-info", "icy-metaint"};
+    size_t used;
+    size_t i;
+
+    used = snprintf(buffer, len, "Content-Type: %s\r\n", source->format->contenttype);
+    for (i = 0; i < (sizeof(names)/sizeof(*names)) && used < len; i++) {
+        const char *value = httpp_getvar(source->parser, names[i]);
+
+        if (value && !strpbrk(value, "\r\n"))
+            used += snprintf(buffer + used, len - used, "%s: %s\r\n", names[i], value);
+    }
+
+    /* a header cut short would break the capture */
+    if (used >= len)
+        snprintf(buffer, len, "Content-Type: %s\r\n", source->format->contenttype);
 }
 
 /* Perform any initialisation just before the stream data is processed, the header
- * info is processed by now and the format details are setup
+ * info is processed by now and the format details are setup. Called by the
+ * source loop that is going to run the source.
  */
-static void source_init (source_t *source)
+void source_start (source_t *source)
 {
     char listenurl[512];
     const char *str;
@@ -643,12 +2754,22 @@ static void source_init (source_t *source)
         stats_event (source->mount, "audio_info", str);
     }
 
+    /* the source client may only tell its bitrate in ice-audio-info */
+    if (!source->bitrate) {
+        str = util_dict_get(source->audio_info, "ice-bitrate");
+        if (!str)
+            str = util_dict_get(source->audio_info, "bitrate");
+        if (str)
+            source->bitrate = atoi(str);
+    }
+    source_size_listener_sockets(source);
+
     client_get_baseurl(NULL, NULL, listenurl, sizeof(listenurl), NULL, NULL, NULL, NULL, NULL);
     stats_event (source->mount, "listenurl", listenurl);
 
     if (source->dumpfilename != NULL)
     {
-        source->dumpfile = source_open_dumpfile (source->dumpfilename);
+        source->dumpfile = source_open_dumpfile (source->dumpfilename, NULL);
         if (source->dumpfile == NULL)
         {
             ICECAST_LOG_WARN("Cannot open dump file \"%s\" for appending: %s, disabling.",
@@ -656,13 +2777,112 @@ static void source_init (source_t *source)
         }
     }
 
+    if (source->capturefilename != NULL)
+    {
+        char header[1024];
+
+        source_capture_header (source, header, sizeof(header));
+        source->capture = source_open_dumpfile (source->capturefilename, header);
+        if (source->capture == NULL)
+        {
+            ICECAST_LOG_WARN("Cannot open capture file \"%s\": %s, disabling.",
+                    source->capturefilename, strerror(errno));
+        }
+        source->client->capture = source->capture;
+    }
+
+    if (source->timeshiftfilename != NULL)
+    {
+        /* joining at an earlier point needs headers for other formats */
+        if (source->format->type != FORMAT_TYPE_GENERIC)
+        {
+            ICECAST_LOG_WARN("Timeshift is not supported for the format of %s, disabling.", source->mount);
+        }
+        else
+        {
+            source->timeshift = timeshift_open (source->timeshiftfilename, source->timeshift_size);
+            if (source->timeshift == NULL)
+                ICECAST_LOG_WARN("Cannot open timeshift file \"%s\": %s, disabling.",
+                        source->timeshiftfilename, strerror(errno));
+        }
+    }
+
+    if (source->shmfilename != NULL)
+    {
+        /* consumers join at any point, like timeshifted listeners */
+        if (source->format->type != FORMAT_TYPE_GENERIC)
+        {
+            ICECAST_LOG_WARN("Shared memory output is not supported for the format of %s, disabling.", source->mount);
+        }
+        else
+        {
+            source->shmring = shmring_open (source->shmfilename, source->shm_size, source->format->contenttype);
+            if (source->shmring == NULL)
+                ICECAST_LOG_WARN("Cannot create shared memory file \"%s\": %s, disabling.",
+                        source->shmfilename, strerror(errno));
+        }
+    }
+
+    if (source->hls_enabled)
+    {
+        source->hls = hls_open (source->mount, source->format->contenttype,
+                source->hls_segment_duration, source->hls_segments);
+        if (source->hls == NULL)
+            ICECAST_LOG_WARN("Cannot segment %s for HLS: %s, disabling.", source->mount,
+                    errno == EINVAL ? "only MP3 and AAC streams can be segmented" : strerror(errno));
+    }
+
+    if (source->multicast_group != NULL)
+    {
+        /* receivers join at any point and there is no way to send them
+         * the headers other formats need */
+        if (source->format->type != FORMAT_TYPE_GENERIC)
+        {
+            ICECAST_LOG_WARN("Multicast is not supported for the format of %s, disabling.", source->mount);
+        }
+        else
+        {
+            source->multicast = multicast_open (source->multicast_group, source->multicast_port,
+                    source->multicast_ttl, source->multicast_interface, !source->multicast_raw);
+            if (source->multicast == NULL)
+                ICECAST_LOG_WARN("Cannot send %s to multicast group %s port %u: %s, disabling.",
+                        source->mount, source->multicast_group, source->multicast_port, strerror(errno));
+        }
+    }
+
+    /* listeners are only polled for writability once their socket is full */
+    source->listener_poll = fdpoll_new();
+    if (source->listener_poll && source->con)
+    {
+        if (fdpoll_arm(source->listener_poll, source->con->sock, FDPOLL_EVENT_READ, source) != 0)
+        {
+            ICECAST_LOG_WARN("Cannot poll source socket for %s, falling back to plain writes", source->mount);
+            fdpoll_free(source->listener_poll);
+            source->listener_poll = NULL;
+        }
+    }
+
+    /* the source loop waits on the whole set if it can, so readable input
+     * and writable listeners both wake it up without a timer */
+    source->event_sock = SOCK_ERROR;
+    source->idle_delay = SOURCE_POLL_DELAY;
+    if (source->listener_poll)
+        source->event_sock = fdpoll_get_sock(source->listener_poll);
+    if (source->event_sock != SOCK_ERROR && source->con)
+        source->idle_delay = SOURCE_IDLE_DELAY;
+    else if (source->event_sock == SOCK_ERROR && source->con)
+        source->event_sock = source->con->sock;
+
     /* grab a read lock, to make sure we get a chance to cleanup */
     thread_rwlock_rlock (source->shutdown_rwlock);
 
     /* start off the statistics */
     source->listeners = 0;
-    stats_event_inc (NULL, "source_total_connections");
-    stats_event (source->mount, "slow_listeners", "0");
+    stats_global_inc(STATS_GLOBAL_SOURCE_TOTAL_CONNECTIONS);
+    stats_counter_set(source->stats_slow_listeners, 0);
+    stats_counter_set(source->stats_lag_skips, 0);
+    stats_counter_set(source->stats_burst_cuts, 0);
+    stats_counter_set(source->stats_lag_fallbacks, 0);
     stats_event_args (source->mount, "listeners", "%lu", source->listeners);
     stats_event_args (source->mount, "listener_peak", "%lu", source->peak_listeners);
     stats_event_time (source->mount, "stream_start");
@@ -672,6 +2892,7 @@ static void source_init (source_t *source)
     source->last_read = time (NULL);
     source->prev_listeners = -1;
     source->running = 1;
+    source_fallback_changed();
 
     event_emit_clientevent("source-connect", source->client, source->mount);
 
@@ -706,180 +2927,211 @@ static void source_init (source_t *source)
 
         avl_tree_unlock(global.source_tree);
     }
+
+    /* listeners handed over by the process we replaced, see upgrade.c */
+    upgrade_attach_listeners(source);
 }
 
 
-void source_main (source_t *source)
+/* One pass over the source. Reads whatever input is available, sends the
+ * new data to the listeners and adds the pending ones.
+ * Returns the number of milliseconds after which the source wants to run again
+ * even if no event arrives, or -1 once it has stopped and needs to be shut
+ * down by source_shutdown().
+ */
+int source_process (source_t *source)
 {
-    refbuf_t *refbuf;
     client_t *client;
-    avl_node *client_node;
+    client_t *next;
+    queue_sample_t sample;
+    int remove_from_q = 0;
+    int parallel;
+    int handover;
+    unsigned int added;
+    size_t lagging = 0;
+    uint64_t now;
+
+    if (global.running != ICECAST_RUNNING || !source->running)
+        return -1;
 
-    source_init (source);
+    source->short_delay = 0;
 
-    while (global.running == ICECAST_RUNNING && source->running) {
-        int remove_from_q;
+    source_read_input (source);
 
-        refbuf = get_next_buffer (source);
+    now = coarsetime_get_ms();
+    egress_refill(&source->egress, now);
+    egress_refill(&egress_global, now);
 
-        remove_from_q = 0;
-        source->short_delay = 0;
+    /* lets see if we have too much data in the queue, but don't remove it until later */
+    thread_mutex_lock(&source->lock);
+    if (source->queue_size > source->queue_size_limit ||
+            (source->queue_size_allowed && source->queue_size > source->queue_size_allowed))
+        remove_from_q = 1;
+    if (source->queue_sample) {
+        memset(&sample, 0, sizeof(sample));
+        sample.limit = source->queue_size_limit;
+    }
+    thread_mutex_unlock(&source->lock);
 
-        if (refbuf)
-        {
-            /* append buffer to the in-flight data queue,  */
-            if (source->stream_data == NULL)
-            {
-                source->stream_data = refbuf;
-                source->burst_point = refbuf;
-            }
-            if (source->stream_data_tail)
-                source->stream_data_tail->next = refbuf;
-            source->stream_data_tail = refbuf;
-            source->queue_size += refbuf->len;
-            /* new buffer is referenced for burst */
-            refbuf_addref(refbuf);
-
-            /* new data on queue, so check the burst point */
-            source->burst_offset += refbuf->len;
-            while (source->burst_offset > source->burst_size)
-            {
-                refbuf_t *to_release = source->burst_point;
+    if (source->queue_sample)
+        source_update_stream_rate(source, now);
 
-                if (to_release->next)
-                {
-                    source->burst_point = to_release->next;
-                    source->burst_offset -= to_release->len;
-                    refbuf_release(to_release);
-                    continue;
-                }
-                break;
-            }
+    /* acquire write lock on the listener list */
+    thread_rwlock_wlock(&source->client_lock);
 
-            /* save stream to file */
-            if (source->dumpfile && source->format->write_buf_to_file)
-                source->format->write_buf_to_file(source, refbuf);
-        }
-        /* lets see if we have too much data in the queue, but don't remove it until later */
-        thread_mutex_lock(&source->lock);
-        if (source->queue_size > source->queue_size_limit)
-            remove_from_q = 1;
-        thread_mutex_unlock(&source->lock);
+    source_expire_listeners(source);
 
-        /* acquire write lock on pending_tree */
-        avl_tree_wlock(source->pending_tree);
+    parallel = source_send_to_listeners_parallel(source, remove_from_q);
+    if (!parallel && source_send_to_cohorts(source))
+        source->short_delay = 1;
+    handover = upgrade_handing_over();
 
-        /* acquire write lock on client_tree */
-        avl_tree_wlock(source->client_tree);
+    next = source->client_list;
+    while (next) {
+        client = next;
+        next = client->listener_next;
 
-        client_node = avl_get_first(source->client_tree);
-        while (client_node) {
-            client = (client_t *) client_node->key;
+        /* those have been done by the workers already */
+        if (!parallel || client->check_buffer != format_advance_queue) {
+            if (send_to_listener(source, client, remove_from_q))
+                source->short_delay = 1;
+        }
 
-            send_to_listener(source, client, remove_from_q);
+        /* the process replacing us goes on sending to it, the upgrade
+         * thread owns the listener from here */
+        if (handover && !client->con->error && upgrade_handover_listener(source, client) == 0) {
+            client->con->error = 1;
+            source_unblock_listener(source, client);
+            stats_global_dec(STATS_GLOBAL_LISTENERS);
+            source_unlink_listener(source, client);
+            source->listeners--;
+            continue;
+        }
 
-            if (client->con->error) {
-                client_node = avl_get_next(client_node);
-                if (client->respcode == 200)
-                    stats_event_dec(NULL, "listeners");
-                avl_delete(source->client_tree, (void *) client, _free_client);
-                source->listeners--;
-                ICECAST_LOG_DEBUG("Client removed");
-                continue;
-            }
-            client_node = avl_get_next(client_node);
+        if (client->con->error) {
+            source_unblock_listener(source, client);
+            if (client->respcode == 200)
+                stats_global_dec(STATS_GLOBAL_LISTENERS);
+            source_unlink_listener(source, client);
+            _free_client(client);
+            source->listeners--;
+            ICECAST_LOG_DEBUG("Client removed");
+            continue;
         }
 
-        /** add pending clients **/
-        client_node = avl_get_first(source->pending_tree);
-        while (client_node) {
+        /* the request is done with once the headers were sent */
+        if (!client->memory && client->respcode == 200 && client->check_buffer != format_check_http_buffer)
+            client_trim_request(client);
 
-            if(source->max_listeners != -1 &&
-                    source->listeners >= (unsigned long)source->max_listeners)
-            {
-                /* The common case is caught in the main connection handler,
-                 * this deals with rarer cases (mostly concerning fallbacks)
-                 * and doesn't give the listening client any information about
-                 * why they were disconnected
-                 */
-                client = (client_t *)client_node->key;
-                client_node = avl_get_next(client_node);
-                avl_delete(source->pending_tree, (void *)client, _free_client);
-
-                ICECAST_LOG_INFO("Client deleted, exceeding maximum listeners for this "
-                        "mountpoint (%s).", source->mount);
-                continue;
-            }
+        if (client->lag_fallback)
+            lagging++;
 
-            /* Otherwise, the client is accepted, add it */
-            avl_insert(source->client_tree, client_node->key);
+        if (source->queue_sample)
+            source_sample_listener(source, &sample, client);
+    }
 
-            source->listeners++;
-            ICECAST_LOG_DEBUG("Client added for mountpoint (%s)", source->mount);
-            stats_event_inc(source->mount, "connections");
+    stats_counter_set(source->stats_bytes_read, source->format->read_bytes);
+    stats_counter_set(source->stats_bytes_sent, atomic_u64_load(&source->format->sent_bytes));
 
-            client_node = avl_get_next(client_node);
-        }
+    /** add pending clients **/
+    client = source_take_pending(source);
+    added = 0;
+    while (client) {
+        client_t *next = client->pending_next;
 
-        /** clear pending tree **/
-        while (avl_get_first(source->pending_tree)) {
-            avl_delete(source->pending_tree,
-                    avl_get_first(source->pending_tree)->key,
-                    source_remove_client);
+        if (added == SOURCE_MAX_PENDING_PER_PASS) {
+            source_requeue_pending(source, client);
+            source->short_delay = 1;
+            break;
         }
+        added++;
 
-        /* release write lock on pending_tree */
-        avl_tree_unlock(source->pending_tree);
+        client->pending_next = NULL;
 
-        /* update the stats if need be */
-        if (source->listeners != source->prev_listeners)
+        if(source->max_listeners != -1 &&
+                source->listeners >= (unsigned long)source->max_listeners)
         {
-            source->prev_listeners = source->listeners;
-            ICECAST_LOG_INFO("listener count on %s now %lu", source->mount, source->listeners);
-            if (source->listeners > source->peak_listeners)
-            {
-                source->peak_listeners = source->listeners;
-                stats_event_args (source->mount, "listener_peak", "%lu", source->peak_listeners);
+            /* The common case is caught in the main connection handler, but
+             * it can not see listeners that are queued at the same time. As
+             * long as nothing was sent yet the client still gets an error,
+             * otherwise (mostly concerning fallbacks) it is disconnected
+             * without any information about why.
+             */
+            ICECAST_LOG_INFO("Client deleted, exceeding maximum listeners for this "
+                    "mountpoint (%s).", source->mount);
+            if (client->respcode == 0) {
+                client_send_error_by_id(client, ICECAST_ERROR_SOURCE_MAX_LISTENERS);
+            } else {
+                _free_client(client);
             }
-            stats_event_args (source->mount, "listeners", "%lu", source->listeners);
-            if (source->listeners == 0 && source->on_demand)
-                source->running = 0;
+            client = next;
+            continue;
         }
 
-        /* lets reduce the queue, any lagging clients should of been
-         * terminated by now
-         */
-        if (source->stream_data)
+        /* Otherwise, the client is accepted, add it */
+        source_setup_listener_socket(source, client);
+        source_link_listener(source, client);
+
+        source->listeners++;
+        ICECAST_LOG_DEBUG("Client added for mountpoint (%s)", source->mount);
+        stats_counter_inc(source->stats_connections);
+
+        client = next;
+    }
+
+    /* update the stats if need be */
+    if (source->listeners != source->prev_listeners)
+    {
+        source->prev_listeners = source->listeners;
+        ICECAST_LOG_INFO("listener count on %s now %lu", source->mount, source->listeners);
+        if (source->listeners > source->peak_listeners)
         {
-            /* normal unreferenced queue data will have a refcount 1, but
-             * burst queue data will be at least 2, active clients will also
-             * increase refcount */
-            while (source->stream_data->_count == 1)
-            {
-                refbuf_t *to_go = source->stream_data;
-
-                if (to_go->next == NULL || source->burst_point == to_go)
-                {
-                    /* this should not happen */
-                    ICECAST_LOG_ERROR("queue state is unexpected");
-                    source->running = 0;
-                    break;
-                }
-                source->stream_data = to_go->next;
-                source->queue_size -= to_go->len;
-                to_go->next = NULL;
-                refbuf_release (to_go);
-            }
+            source->peak_listeners = source->listeners;
+            stats_event_args (source->mount, "listener_peak", "%lu", source->peak_listeners);
         }
+        stats_event_args (source->mount, "listeners", "%lu", source->listeners);
+        if (source->listeners == 0 && source->on_demand)
+            source->on_demand_idle = now;
+    }
+
+    /* an on-demand source lingers for a while, so a listener coming back
+     * finds the burst queue filled */
+    if (source->on_demand_idle)
+    {
+        if (source->listeners || !source->on_demand)
+            source->on_demand_idle = 0;
+        else if ((now - source->on_demand_idle) >= (uint64_t)source->on_demand_linger * 1000)
+        {
+            ICECAST_LOG_DEBUG("no listeners on on-demand mount %s, stopping", source->mount);
+            source->running = 0;
+        }
+    }
+
+    /* lets reduce the queue, any lagging clients should of been
+     * terminated by now
+     */
+    source_trim_queue(source);
+
+    /* release write lock on the listener list */
+    thread_rwlock_unlock(&source->client_lock);
 
-        /* release write lock on client_tree */
-        avl_tree_unlock(source->client_tree);
+    /* this takes source->lock, so not while holding client_lock */
+    if (source->queue_sample) {
+        source_update_queue_budget(source, &sample);
+        source->queue_sample = 0;
     }
-    source_shutdown (source);
+
+    if (lagging)
+        source_move_lagging_listeners(source);
+
+    if (source->short_delay || global.running != ICECAST_RUNNING || !source->running)
+        return 0;
+
+    return source->idle_delay;
 }
 
 
-static void source_shutdown (source_t *source)
+void source_shutdown (source_t *source)
 {
     source->running = 0;
     if (source->con && source->con->ip) {
@@ -908,6 +3160,14 @@ static void source_shutdown (source_t *source)
 
     /* delete this sources stats */
     stats_event(source->mount, NULL, NULL);
+    stats_counter_set(source->stats_connections, 0);
+    stats_counter_set(source->stats_listener_connections, 0);
+    stats_counter_set(source->stats_slow_listeners, 0);
+    stats_counter_set(source->stats_lag_skips, 0);
+    stats_counter_set(source->stats_burst_cuts, 0);
+    stats_counter_set(source->stats_lag_fallbacks, 0);
+    stats_counter_set(source->stats_bytes_read, 0);
+    stats_counter_set(source->stats_bytes_sent, 0);
 
     if (source->client && source->parser) {
         /* For PUT support we check for 100-continue and send back a final 200. */
@@ -1004,6 +3264,19 @@ static void _parse_audio_info (source_t *source, const char *s)
 }
 
 
+/* Replaces the current setting of the mount with a copy of setting, unless
+ * it did not change. These can change with every reload, so they are kept on
+ * the heap rather than in the arena, which only shrinks once the source is
+ * cleared. */
+static void source_update_setting(char **current, const char *setting)
+{
+    if (*current && setting && strcmp(*current, setting) == 0)
+        return;
+
+    free(*current);
+    *current = setting ? strdup(setting) : NULL;
+}
+
 /* Apply the mountinfo details to the source */
 static void source_apply_mount (ice_config_t *config, source_t *source, mount_proxy *mountinfo)
 {
@@ -1013,7 +3286,7 @@ static void source_apply_mount (ice_config_t *config, source_t *source, mount_pr
     acl_t *acl = NULL;
 
     ICECAST_LOG_DEBUG("Applying mount information for \"%s\"", source->mount);
-    avl_tree_rlock (source->client_tree);
+    thread_rwlock_rlock(&source->client_lock);
     stats_event_args (source->mount, "listener_peak", "%lu", source->peak_listeners);
 
     if (mountinfo)
@@ -1151,6 +3424,8 @@ static void source_apply_mount (ice_config_t *config, source_t *source, mount_pr
         } while (0);
     }
     stats_event (source->mount, "bitrate", str);
+    if (str)
+        source->bitrate = atoi(str);
 
     /* handle MIME-type */
     if (mountinfo && mountinfo->type)
@@ -1172,29 +3447,39 @@ static void source_apply_mount (ice_config_t *config, source_t *source, mount_pr
         stats_event (source->mount, "authenticator", NULL);
     acl_release(acl);
 
-    if (mountinfo && mountinfo->fallback_mount)
+    source_update_setting(&source->fallback_mount, mountinfo ? mountinfo->fallback_mount : NULL);
+    source_update_setting(&source->dumpfilename, mountinfo ? mountinfo->dumpfile : NULL);
+    source_update_setting(&source->capturefilename, mountinfo ? mountinfo->capture_file : NULL);
+
+    source_update_setting(&source->timeshiftfilename, mountinfo ? mountinfo->timeshift_filename : NULL);
+    if (source->timeshiftfilename)
     {
-        char *mount = source->fallback_mount;
-        source->fallback_mount = strdup (mountinfo->fallback_mount);
-        free (mount);
+        source->timeshift_size = mountinfo->timeshift_size ? mountinfo->timeshift_size : SOURCE_DEFAULT_TIMESHIFT_SIZE;
     }
-    else
-        source->fallback_mount = NULL;
 
-    if (mountinfo && mountinfo->dumpfile)
+    source_update_setting(&source->shmfilename, mountinfo ? mountinfo->shm_filename : NULL);
+    if (source->shmfilename)
     {
-        char *filename = source->dumpfilename;
-        source->dumpfilename = strdup (mountinfo->dumpfile);
-        free (filename);
+        source->shm_size = mountinfo->shm_size ? mountinfo->shm_size : SOURCE_DEFAULT_SHM_SIZE;
     }
-    else
-        source->dumpfilename = NULL;
 
-    if (source->intro_file)
+    source->hls_enabled = mountinfo ? mountinfo->hls : 0;
+    if (source->hls_enabled)
     {
-        fclose (source->intro_file);
-        source->intro_file = NULL;
+        source->hls_segment_duration = mountinfo->hls_segment_duration ? mountinfo->hls_segment_duration : SOURCE_DEFAULT_HLS_SEGMENT_DURATION;
+        source->hls_segments = mountinfo->hls_segments ? mountinfo->hls_segments : SOURCE_DEFAULT_HLS_SEGMENTS;
+    }
+
+    source_update_setting(&source->multicast_group, mountinfo ? mountinfo->multicast_group : NULL);
+    source_update_setting(&source->multicast_interface,
+            mountinfo && mountinfo->multicast_group ? mountinfo->multicast_interface : NULL);
+    if (source->multicast_group)
+    {
+        source->multicast_port = mountinfo->multicast_port ? mountinfo->multicast_port : SOURCE_DEFAULT_MULTICAST_PORT;
+        source->multicast_ttl = mountinfo->multicast_ttl ? mountinfo->multicast_ttl : SOURCE_DEFAULT_MULTICAST_TTL;
+        source->multicast_raw = mountinfo->multicast_raw;
     }
+
     if (mountinfo && mountinfo->intro_filename)
     {
         ice_config_t *config = config_get_config_unlocked ();
@@ -1203,18 +3488,15 @@ static void source_apply_mount (ice_config_t *config, source_t *source, mount_pr
         char *path = malloc (len);
         if (path)
         {
-            FILE *f;
             snprintf (path, len, "%s" PATH_SEPARATOR "%s", config->webroot_dir,
                     mountinfo->intro_filename);
 
-            f = fopen (path, "rb");
-            if (f)
-                source->intro_file = f;
-            else
-                ICECAST_LOG_WARN("Cannot open intro file \"%s\": %s", path, strerror(errno));
+            introcache_set(&source->intro, path);
             free (path);
         }
     }
+    else
+        introcache_set(&source->intro, NULL);
 
     if (mountinfo && mountinfo->queue_size_limit)
         source->queue_size_limit = mountinfo->queue_size_limit;
@@ -1225,13 +3507,43 @@ static void source_apply_mount (ice_config_t *config, source_t *source, mount_pr
     if (mountinfo && mountinfo->burst_size >= 0)
         source->burst_size = (unsigned int) mountinfo->burst_size;
 
+    /* the queue has to hold the larger burst */
+    source->burst_size_max = mountinfo ? mountinfo->burst_size_max : 0;
+    if (source->burst_size_max > source->burst_size && source->queue_size_limit < source->burst_size_max + QUEUE_MIN_SLACK) {
+        ICECAST_LOG_WARN("Queue size of %s raised to %u bytes for its burst-size-max", source->mount, source->burst_size_max + QUEUE_MIN_SLACK);
+        source->queue_size_limit = source->burst_size_max + QUEUE_MIN_SLACK;
+    }
+
+    if (mountinfo && mountinfo->listener_workers)
+        source->listener_workers = mountinfo->listener_workers;
+
+    egress_set_rate(&source->egress, mountinfo ? (uint64_t)mountinfo->max_bandwidth * 1000 / 8 : 0);
+
+    source->listener_send_buffer_time = mountinfo ? mountinfo->listener_send_buffer_time : 0;
+    source->listener_notsent_lowat = mountinfo ? mountinfo->listener_notsent_lowat : 0;
+    source->listener_pacing = mountinfo ? mountinfo->listener_pacing : 0;
+    source->listener_zerocopy = mountinfo ? mountinfo->listener_zerocopy : 0;
+    source->max_lag = mountinfo ? mountinfo->max_lag : 0;
+    source->lag_action = mountinfo ? mountinfo->lag_action : LAG_ACTION_DROP;
+    if (source->lag_action == LAG_ACTION_FALLBACK && source->max_lag && !source->fallback_mount)
+        ICECAST_LOG_WARN("<lag-action> fallback needs a <fallback-mount>, dropping lagging listeners of %s instead.", source->mount);
+#ifndef SO_MAX_PACING_RATE
+    if (source->listener_pacing)
+        ICECAST_LOG_WARN("<listener-pacing> is not supported on this system, ignoring it for %s.", source->mount);
+#endif
+#ifndef TCP_NOTSENT_LOWAT
+    if (source->listener_notsent_lowat)
+        ICECAST_LOG_WARN("<listener-notsent-lowat> is not supported on this system, ignoring it for %s.", source->mount);
+#endif
+    source_size_listener_sockets(source);
+
     if (mountinfo && mountinfo->fallback_when_full)
         source->fallback_when_full = mountinfo->fallback_when_full;
 
     if (mountinfo && mountinfo->max_history > 0)
         playlist_set_max_tracks(source->history, mountinfo->max_history);
 
-    avl_tree_unlock(source->client_tree);
+    thread_rwlock_unlock(&source->client_lock);
 }
 
 
@@ -1253,6 +3565,7 @@ void source_update_settings (ice_config_t *config, source_t *source, mount_proxy
     source->queue_size_limit = config->queue_size_limit;
     source->timeout = config->source_timeout;
     source->burst_size = config->burst_size;
+    source->listener_workers = 1;
 
     stats_event_args (source->mount, "listenurl", "http://%s:%d%s",
             config->hostname, config->port, source->mount);
@@ -1294,25 +3607,19 @@ void source_update_settings (ice_config_t *config, source_t *source, mount_proxy
     ICECAST_LOG_DEBUG("max listeners to %ld", source->max_listeners);
     ICECAST_LOG_DEBUG("queue size to %u", source->queue_size_limit);
     ICECAST_LOG_DEBUG("burst size to %u", source->burst_size);
+    ICECAST_LOG_DEBUG("maximum burst size to %u", source->burst_size_max);
     ICECAST_LOG_DEBUG("source timeout to %u", source->timeout);
     ICECAST_LOG_DEBUG("fallback_when_full to %u", source->fallback_when_full);
     thread_mutex_unlock(&source->lock);
 }
 
 
-void *source_client_thread (void *arg)
+static void source_client_finished (source_t *source, void *userdata)
 {
-    source_t *source = arg;
-
-    stats_event_inc(NULL, "source_client_connections");
-    stats_event (source->mount, "listeners", "0");
-
-    source_main (source);
+    (void)userdata;
 
     source_free_source (source);
     slave_update_all_mounts();
-
-    return NULL;
 }
 
 
@@ -1338,8 +3645,19 @@ void source_client_callback (client_t *client, void *arg)
     if (agent)
         stats_event (source->mount, "user_agent", agent);
 
-    thread_create ("Source Thread", source_client_thread,
-            source, THREAD_DETACHED);
+    stats_global_inc(STATS_GLOBAL_SOURCE_CLIENT_CONNECTIONS);
+    stats_event (source->mount, "listeners", "0");
+
+    sourceloop_add (source, source_client_finished, NULL);
+}
+
+static void source_fallback_file_finished (source_t *source, void *userdata)
+{
+    http_parser_t *parser = userdata;
+
+    source_free_source (source);
+    slave_update_all_mounts();
+    httpp_destroy (parser);
 }
 
 static void *source_fallback_file (void *arg)
@@ -1396,8 +3714,9 @@ static void *source_fallback_file (void *arg)
 
         if (connection_complete_source (source, 0) < 0)
             break;
-        source_client_thread (source);
-        httpp_destroy (parser);
+        stats_global_inc(STATS_GLOBAL_SOURCE_CLIENT_CONNECTIONS);
+        stats_event (source->mount, "listeners", "0");
+        sourceloop_add (source, source_fallback_file_finished, parser);
     } while (0);
     if (file)
         fclose (file);
@@ -1406,6 +3725,49 @@ static void *source_fallback_file (void *arg)
 }
 
 
+/* update the source and stats of one mount, called with the source tree
+ * and the config locked
+ */
+static void source_recheck_mount (ice_config_t *config, mount_proxy *mount, int update_all)
+{
+    source_t *source = source_find_mount (mount->mountname);
+
+    if (source)
+    {
+        source = source_find_mount_raw (mount->mountname);
+        if (source)
+        {
+            mount_proxy *mountinfo = config_find_mount (config, source->mount, MOUNT_TYPE_NORMAL);
+            source_update_settings (config, source, mountinfo);
+        }
+        else if (update_all)
+        {
+            stats_event_hidden (mount->mountname, NULL, mount->hidden);
+            stats_event_args (mount->mountname, "listenurl", "http://%s:%d%s",
+                    config->hostname, config->port, mount->mountname);
+            stats_event (mount->mountname, "listeners", "0");
+            if (mount->max_listeners < 0)
+                stats_event (mount->mountname, "max_listeners", "unlimited");
+            else
+                stats_event_args (mount->mountname, "max_listeners", "%d", mount->max_listeners);
+        }
+    }
+    else
+        stats_event (mount->mountname, NULL, NULL);
+
+    /* check for fallback to file */
+    if (global.running == ICECAST_RUNNING && mount->fallback_mount)
+    {
+        source_t *fallback = source_find_mount (mount->fallback_mount);
+        if (fallback == NULL)
+        {
+            thread_create ("Fallback file thread", source_fallback_file,
+                    strdup (mount->fallback_mount), THREAD_DETACHED);
+        }
+    }
+}
+
+
 /* rescan the mount list, so that xsl files are updated to show
  * unconnected but active fallback mountpoints
  */
@@ -1426,40 +3788,41 @@ void source_recheck_mounts (int update_all)
         if (mount->mounttype != MOUNT_TYPE_NORMAL)
             continue;
 
-        source_t *source = source_find_mount (mount->mountname);
+        source_recheck_mount (config, mount, update_all);
+    }
+    avl_tree_unlock (global.source_tree);
+    config_release_config();
+}
+
 
-        if (source)
+/* like source_recheck_mounts() but only for the named mounts, which were
+ * added, changed or removed by a reload
+ */
+void source_recheck_mount_list (const char * const *mounts, size_t mounts_length)
+{
+    ice_config_t *config;
+    size_t i;
+
+    avl_tree_rlock (global.source_tree);
+    config = config_get_config();
+
+    for (i = 0; i < mounts_length; i++)
+    {
+        mount_proxy *mount = config_find_mount (config, mounts[i], MOUNT_TYPE_NORMAL);
+
+        if (mount && mount->mounttype == MOUNT_TYPE_NORMAL)
         {
-            source = source_find_mount_raw (mount->mountname);
-            if (source)
-            {
-                mount_proxy *mountinfo = config_find_mount (config, source->mount, MOUNT_TYPE_NORMAL);
-                source_update_settings (config, source, mountinfo);
-            }
-            else if (update_all)
-            {
-                stats_event_hidden (mount->mountname, NULL, mount->hidden);
-                stats_event_args (mount->mountname, "listenurl", "http://%s:%d%s",
-                        config->hostname, config->port, mount->mountname);
-                stats_event (mount->mountname, "listeners", "0");
-                if (mount->max_listeners < 0)
-                    stats_event (mount->mountname, "max_listeners", "unlimited");
-                else
-                    stats_event_args (mount->mountname, "max_listeners", "%d", mount->max_listeners);
-            }
+            source_recheck_mount (config, mount, 1);
         }
         else
-            stats_event (mount->mountname, NULL, NULL);
-
-        /* check for fallback to file */
-        if (global.running == ICECAST_RUNNING && mount->fallback_mount)
         {
-            source_t *fallback = source_find_mount (mount->fallback_mount);
-            if (fallback == NULL)
-            {
-                thread_create ("Fallback file thread", source_fallback_file,
-                        strdup (mount->fallback_mount), THREAD_DETACHED);
-            }
+            /* removed, fall back to the default mount if there is a source */
+            source_t *source = source_find_mount_raw (mounts[i]);
+
+            if (source)
+                source_update_settings (config, source, mount);
+            else
+                stats_event (mounts[i], NULL, NULL);
         }
     }
     avl_tree_unlock (global.source_tree);
@@ -25,7 +25,23 @@
 #include "yp.h"
 #include "util.h"
 #include "format.h"
+#include "uring.h"
 #include "playlist.h"
+#include "fdpoll.h"
+#include "workpool.h"
+#include "dumpfile.h"
+#include "introcache.h"
+#include "timeshift.h"
+#include "multicast.h"
+#include "shmring.h"
+#include "hls.h"
+#include "egress.h"
+#include "arena.h"
+#include "stats.h"
+#include "timerwheel.h"
+
+/* number of sync points kept for placing the burst of sparse_sync formats */
+#define SOURCE_SYNC_INDEX 16
 
 struct source_tag {
     mutex_t lock;
@@ -46,16 +62,77 @@ struct source_tag {
 
     struct _format_plugin_tag *format;
 
-    avl_tree *client_tree;
-    avl_tree *pending_tree;
+    /* listeners in the order they were added, linked through
+     * client->listener_prev and listener_next so a pass can walk and drop
+     * them without touching any tree. client_index finds them by connection
+     * id, it is a hash table of client_index_size buckets chained through
+     * client->index_next. Both are protected by client_lock. */
+    rwlock_t client_lock;
+    client_t *client_list;
+    client_t *client_list_tail;
+    /* where the walks over client_list that drop client_lock in between
+     * go on, moved on when that listener is unlinked */
+    struct source_walk_cursor_tag *walk_cursors;
+    client_t **client_index;
+    size_t client_index_size;
+    /* number of listeners by username and role, for <max-connections-per-user>.
+     * A hash table of user_index_size buckets holding user_index_count
+     * entries, also protected by client_lock. */
+    struct source_user_tag **user_index;
+    size_t user_index_size;
+    size_t user_index_count;
+    /* deadlines of the listeners with a limited listening time, in seconds
+     * of coarsetime_get(), entered by source_link_listener(). Created with
+     * the first of them, protected by client_lock. */
+    timerwheel_t *listener_timers;
+
+    /* listeners waiting to be added to client_list by the next pass, a list
+     * of client_t linked by pending_next. Any thread may push onto it with
+     * source_add_pending() without taking a lock, the source takes the whole
+     * list at once. */
+    void * volatile pending;
+    volatile unsigned int pending_count;
+    /* those a pass could not add, ahead of pending and in the order they
+     * came in. Protected by client_lock, counted in pending_count. */
+    client_t *pending_held;
 
     rwlock_t *shutdown_rwlock;
     util_dict *audio_info;
 
+    /* intro sent to new listeners, use through introcache.h */
+    introcache_t *intro;
+    /* file the stream is read from by file fallbacks */
     FILE *intro_file;
 
     char *dumpfilename; /* Name of a file to dump incoming stream to */
-    FILE *dumpfile;
+    dumpfile_t *dumpfile;
+    /* file the reads of the source client are recorded to, see dumpfile.h */
+    char *capturefilename;
+    dumpfile_t *capture;
+
+    /* ring of the stream on disk for listeners joining in the past */
+    char *timeshiftfilename;
+    unsigned int timeshift_size;
+    timeshift_t *timeshift;
+
+    /* ring in shared memory for consumers on this host */
+    char *shmfilename;
+    unsigned int shm_size;
+    shmring_t *shmring;
+
+    /* segments and playlist for HLS */
+    int hls_enabled;
+    unsigned int hls_segment_duration;
+    unsigned int hls_segments;
+    hls_t *hls;
+
+    /* copy of the stream sent to a multicast group */
+    char *multicast_group;
+    char *multicast_interface;
+    unsigned int multicast_port;
+    unsigned int multicast_ttl;
+    int multicast_raw;
+    multicast_t *multicast;
 
     unsigned long peak_listeners;
     unsigned long listeners;
@@ -68,15 +145,49 @@ struct source_tag {
 
     /* per source burst handling for connecting clients */
     unsigned int burst_size;    /* trigger level for burst on connect */
+    /* from <burst-size-max>, the burst kept for listeners that keep up with
+     * the first burst_size bytes, 0 if the burst is fixed */
+    unsigned int burst_size_max;
     unsigned int burst_offset; 
     refbuf_t *burst_point;
+    /* the latest sync points from burst_point on, oldest first, for
+     * formats with sparse_sync */
+    refbuf_t *sync_index[SOURCE_SYNC_INDEX];
+    unsigned int sync_index_count;
 
     unsigned int queue_size;
     unsigned int queue_size_limit;
+    /* queue_size_limit cut down to the share of <queue-memory-limit> this
+     * source got at the last sample, 0 if not limited */
+    unsigned int queue_size_allowed;
+    /* queue size this source needs for its listeners, counted against the
+     * budget of all sources */
+    unsigned int queue_demand;
+    /* number of bytes ever queued, so the stream offset of the queue end */
+    uint64_t queue_offset;
+    /* set to have the next pass sample listener lag and memory use */
+    int queue_sample;
+    /* bytes per second queued, measured between samples, and where the
+     * current measurement started */
+    uint32_t stream_rate;
+    uint64_t stream_rate_offset;
+    uint64_t stream_rate_start;
+    /* from <max-lag> and <lag-action> */
+    unsigned int max_lag;
+    lag_action_t lag_action;
+    /* memory held at the last sample besides the queue itself */
+    size_t intro_bytes;
+    size_t header_bytes;
+    size_t arena_bytes;
+    uint64_t retained_bytes;
 
     unsigned timeout;  /* source timeout in seconds */
     int on_demand;
     int on_demand_req;
+    /* seconds an on-demand source keeps running without listeners, and
+     * when the last one left in ms, 0 while there are listeners */
+    unsigned int on_demand_linger;
+    uint64_t on_demand_idle;
     int hidden;
     bool allow_direct_access; // copy of mount_proxy->allow_direct_access
     time_t last_read;
@@ -85,24 +196,115 @@ struct source_tag {
     refbuf_t *stream_data;
     refbuf_t *stream_data_tail;
 
+    /* listeners waiting for their socket to become writable, and the source
+     * socket itself. NULL if not supported on this platform. */
+    fdpoll_t *listener_poll;
+    /* what the source loop waits on and how long it may wait without events,
+     * set by source_start() */
+    sock_t event_sock;
+    int idle_delay;
+    /* incremented whenever a blocked listener is taken off this source */
+    unsigned int listener_poll_generation;
+
+    /* optional, called by the source thread when the input is lost. Returns
+     * 0 if it put a new input in place with source_replace_input(), the
+     * source then carries on with the same queue and listeners. */
+    int (*input_lost)(source_t *source, void *userdata);
+    void *input_lost_userdata;
+
+    /* bitrate in kbit/s as given by the mount or the source client, 0 if not known */
+    unsigned int bitrate;
+    /* from <listener-send-buffer-time>, <listener-notsent-lowat> and
+     * <listener-pacing> */
+    unsigned int listener_send_buffer_time;
+    unsigned int listener_notsent_lowat;
+    unsigned int listener_pacing;
+    /* from <listener-zerocopy> */
+    int listener_zerocopy;
+    /* send buffer set on the sockets of new listeners, 0 to leave it alone */
+    int listener_sndbuf;
+    /* bytes per second listeners are paced to after their burst, 0 if not */
+    uint32_t listener_pacing_rate;
+
+    /* limits what is sent to the listeners, from <max-bandwidth> */
+    egress_t egress;
+
+    /* the format state of the mount, released as the source is cleared,
+     * see arena.h */
+    arena_t arena;
+
+    /* the statistics of the mount that change most often */
+    stats_counter_t *stats_connections;
+    stats_counter_t *stats_listener_connections;
+    stats_counter_t *stats_slow_listeners;
+    stats_counter_t *stats_lag_skips;
+    stats_counter_t *stats_burst_cuts;
+    stats_counter_t *stats_lag_fallbacks;
+    stats_counter_t *stats_bytes_read;
+    stats_counter_t *stats_bytes_sent;
+
+    /* number of threads sending to listeners, from <listener-workers> */
+    unsigned int listener_workers;
+    /* only used by the source thread */
+    workpool_t *listener_pool;
+    client_t **listener_batch;
+    /* cohort of each listener in listener_batch when sending by cohorts */
+    unsigned char *listener_cohort;
+    size_t listener_batch_len;
+    /* sends to the listeners of cohorts in batches, NULL if not used */
+    uring_t *listener_uring;
+    int listener_uring_failed;
+
     playlist_t *history;
 };
 
 source_t *source_reserve (const char *mount);
-void *source_client_thread (void *arg);
 void source_client_callback (client_t *client, void *source);
 void source_update_settings (ice_config_t *config, source_t *source, mount_proxy *mountinfo);
 void source_clear_source (source_t *source);
 #define source_find_mount(mount) source_find_mount_with_history((mount), NULL)
 source_t *source_find_mount_with_history(const char *mount, navigation_history_t *history);
+void source_fallback_initialize(void);
+void source_fallback_shutdown(void);
+void source_fallback_changed(void);
 source_t *source_find_mount_raw(const char *mount);
 client_t *source_find_client(source_t *source, connection_id_t id);
+/* number of listeners of source authenticated as username in role */
+size_t source_count_user(source_t *source, const char *username, const char *role);
+/* Calls callback for every listener of source with the client_lock read
+ * locked. The lock is dropped every few hundred listeners so walking a large
+ * mount does not hold up the source for long, the walk then goes on where
+ * it left off even if that listener left meanwhile. Listeners that join
+ * during the walk may or may not be seen. The walk stops early once callback
+ * returns non-zero.
+ */
+typedef int (*source_walk_callback_t)(client_t *client, void *userdata);
+void source_walk_listeners(source_t *source, source_walk_callback_t callback, void *userdata);
+/* bytes of stream data retained by all sources at their last sample */
+uint64_t source_get_queue_memory(void);
+/* tells if one more listener fits into the <max-bandwidth> of the source and
+ * of the server, 0 if it does, -1 if not */
+int source_egress_admit(source_t *source);
 int source_compare_sources(void *arg, void *a, void *b);
 void source_free_source(source_t *source);
 void source_move_clients(source_t *source, source_t *dest, connection_id_t *id, navigation_direction_t direction);
+/* moves the listeners for which match returns non-zero, see source_walk_listeners() */
+size_t source_move_clients_matching(source_t *source, source_t *dest, source_walk_callback_t match, void *userdata, navigation_direction_t direction);
 int source_remove_client(void *key);
-void source_main(source_t *source);
+void source_add_pending(source_t *source, client_t *client);
+void source_start(source_t *source);
+int source_process(source_t *source);
+/* The queue handling of source_process(), also used by the benchmarks */
+void source_queue_buffer(source_t *source, refbuf_t *refbuf);
+void source_trim_queue(source_t *source);
+/* Continues the stream of the source from client, a new connection to the
+ * same stream. Only called from the input_lost callback. Returns 0 on
+ * success, or -1 if the client can not be used and was left alone.
+ */
+int source_replace_input(source_t *source, client_t *client);
+void source_shutdown(source_t *source);
 void source_recheck_mounts (int update_all);
+void source_recheck_mount_list (const char * const *mounts, size_t mounts_length);
 
 extern mutex_t move_clients_mutex;
 
@@ -0,0 +1,481 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#ifdef HAVE_PIPE
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+#include "common/thread/thread.h"
+#include "common/timing/timing.h"
+
+#include "sourceloop.h"
+#include "source.h"
+#include "fdpoll.h"
+#include "atomic.h"
+#include "stats.h"
+#include "cfgfile.h"
+#include "util.h"
+#include "fastevent.h"
+#include "histogram.h"
+#include "affinity.h"
+
+#include "logging.h"
+#define CATMODULE "sourceloop"
+
+/* max number of events handled per wakeup of the loop */
+#define SOURCELOOP_MAX_EVENTS   256
+
+/* without a wakeup pipe new sources are picked up this often */
+#define SOURCELOOP_PENDING_DELAY    250
+
+/* how often the load of each loop is reported, in milliseconds */
+#define SOURCELOOP_STATS_INTERVAL   5000
+
+typedef struct sourceloop_entry_tag {
+    source_t *source;
+    sourceloop_done_t done;
+    void *userdata;
+    /* the socket armed in the loop, SOCK_ERROR if the source runs on its timer only */
+    sock_t sock;
+    uint64_t next_run;
+    int ready;
+    struct sourceloop_entry_tag *next;
+} sourceloop_entry_t;
+
+typedef struct {
+    unsigned int index;
+    thread_type *thread;
+    fdpoll_t *poll;
+#ifdef HAVE_PIPE
+    int wakeup[2];
+#endif
+
+    /* number of sources assigned to this loop, including pending ones */
+    volatile unsigned int sources;
+
+    /* only used by the loop thread */
+    sourceloop_entry_t *entries;
+    uint64_t stats_start;
+    uint64_t busy;
+    uint64_t passes;
+
+    mutex_t lock;
+    /* all below are protected by lock */
+    int running;
+    sourceloop_entry_t *pending;
+} sourceloop_t;
+
+static sourceloop_t *_loops;
+static size_t _loops_count;
+static int __inited = 0;
+
+static void sourceloop_wakeup(sourceloop_t *self)
+{
+#ifdef HAVE_PIPE
+    char c = 0;
+
+    /* if the pipe is full the loop is going to wake up anyway */
+    if (write(self->wakeup[1], &c, 1) < 0)
+        return;
+#else
+    (void)self;
+#endif
+}
+
+static void sourceloop_drain_wakeup(sourceloop_t *self)
+{
+#ifdef HAVE_PIPE
+    char buf[64];
+
+    while (read(self->wakeup[0], buf, sizeof(buf)) > 0);
+#else
+    (void)self;
+#endif
+}
+
+/* start the sources handed over since the last pass.
+ * Returns false once the loop has been asked to stop and has no sources left.
+ */
+static int sourceloop_take_pending(sourceloop_t *self, uint64_t now)
+{
+    sourceloop_entry_t *pending;
+    int running;
+
+    thread_mutex_lock(&self->lock);
+    pending = self->pending;
+    self->pending = NULL;
+    running = self->running;
+    thread_mutex_unlock(&self->lock);
+
+    while (pending) {
+        sourceloop_entry_t *entry = pending;
+
+        pending = entry->next;
+
+        source_start(entry->source);
+
+        entry->sock = entry->source->event_sock;
+        if (entry->sock != SOCK_ERROR && fdpoll_arm(self->poll, entry->sock, FDPOLL_EVENT_READ, entry) != 0) {
+            ICECAST_LOG_WARN("Can not wait on source %s, running it on a timer", entry->source->mount);
+            entry->sock = SOCK_ERROR;
+        }
+        entry->next_run = now;
+        entry->next = self->entries;
+        self->entries = entry;
+    }
+
+    return running || self->entries;
+}
+
+/* source_process(), timed while the latency histograms want it */
+static inline int sourceloop_process(source_t *source)
+{
+    uint64_t start;
+    int delay;
+
+    if (!fastevent_active(FASTEVENT_TYPE_SOURCE_ITERATION))
+        return source_process(source);
+
+    start = histogram_time();
+    delay = source_process(source);
+    fastevent_emit(FASTEVENT_TYPE_SOURCE_ITERATION, FASTEVENT_FLAG_NONE, FASTEVENT_DATATYPE_OT, source, histogram_time() - start);
+
+    return delay;
+}
+
+/* run all sources that had an event or whose timer expired */
+static void sourceloop_run_sources(sourceloop_t *self, uint64_t now)
+{
+    sourceloop_entry_t **prev = &self->entries;
+
+    while (*prev) {
+        sourceloop_entry_t *entry = *prev;
+        int delay;
+
+        if (!entry->ready && entry->next_run > now) {
+            prev = &entry->next;
+            continue;
+        }
+
+        entry->ready = 0;
+        self->passes++;
+        delay = sourceloop_process(entry->source);
+        if (delay >= 0) {
+            entry->next_run = now + delay;
+            prev = &entry->next;
+            continue;
+        }
+
+        *prev = entry->next;
+        if (entry->sock != SOCK_ERROR)
+            fdpoll_disarm(self->poll, entry->sock);
+        source_shutdown(entry->source);
+        entry->done(entry->source, entry->userdata);
+        free(entry);
+        atomic_uint_sub(&self->sources, 1);
+    }
+}
+
+/* publish how busy the loop was since the last report */
+static void sourceloop_update_stats(sourceloop_t *self, uint64_t now)
+{
+    char name[64];
+    uint64_t interval = now - self->stats_start;
+
+    if (interval < SOURCELOOP_STATS_INTERVAL)
+        return;
+
+    snprintf(name, sizeof(name), "source_worker_%u_sources", self->index);
+    stats_event_args(NULL, name, "%u", atomic_uint_load(&self->sources));
+    snprintf(name, sizeof(name), "source_worker_%u_load", self->index);
+    stats_event_args(NULL, name, "%u", (unsigned int)(self->busy * 100 / interval));
+    snprintf(name, sizeof(name), "source_worker_%u_passes", self->index);
+    stats_event_args(NULL, name, "%"PRIu64, self->passes);
+
+    self->stats_start = now;
+    self->busy = 0;
+}
+
+static int sourceloop_get_timeout(sourceloop_t *self, uint64_t now)
+{
+    sourceloop_entry_t *entry;
+    int timeout = -1;
+
+    for (entry = self->entries; entry; entry = entry->next) {
+        int delay = entry->next_run > now ? (int)(entry->next_run - now) : 0;
+
+        if (timeout < 0 || delay < timeout)
+            timeout = delay;
+    }
+
+#ifndef HAVE_PIPE
+    if (timeout < 0 || timeout > SOURCELOOP_PENDING_DELAY)
+        timeout = SOURCELOOP_PENDING_DELAY;
+#endif
+
+    return timeout;
+}
+
+static void *sourceloop_thread(void *arg)
+{
+    sourceloop_t *self = arg;
+    fdpoll_result_t results[SOURCELOOP_MAX_EVENTS];
+
+    affinity_apply(CPU_AFFINITY_SOURCE);
+
+    self->stats_start = timing_get_time();
+
+    while (sourceloop_take_pending(self, timing_get_time())) {
+        uint64_t now = timing_get_time();
+        uint64_t done;
+        int timeout = sourceloop_get_timeout(self, now);
+        ssize_t ret;
+        ssize_t i;
+
+        if (timeout < 0 || timeout > SOURCELOOP_STATS_INTERVAL)
+            timeout = SOURCELOOP_STATS_INTERVAL;
+
+        ret = fdpoll_wait(self->poll, timeout, results, SOURCELOOP_MAX_EVENTS);
+        if (ret < 0) {
+            ICECAST_LOG_ERROR("Waiting for source events failed");
+            /* don't spin, the timers keep the sources going */
+            thread_sleep(SOURCELOOP_PENDING_DELAY * 1000);
+        }
+
+        for (i = 0; i < ret; i++) {
+            if (results[i].userdata == self) {
+                sourceloop_drain_wakeup(self);
+            } else {
+                ((sourceloop_entry_t*)results[i].userdata)->ready = 1;
+            }
+        }
+
+        now = timing_get_time();
+        sourceloop_run_sources(self, now);
+        done = timing_get_time();
+        self->busy += done - now;
+        sourceloop_update_stats(self, done);
+    }
+
+    return NULL;
+}
+
+/* fallback used when the loop is not running: the source gets a thread of
+ * its own that waits on the source the same way the loop would */
+static void *sourceloop_single_thread(void *arg)
+{
+    sourceloop_entry_t *entry = arg;
+    int delay;
+
+    affinity_apply(CPU_AFFINITY_SOURCE);
+
+    source_start(entry->source);
+    while ((delay = sourceloop_process(entry->source)) >= 0) {
+        if (delay && entry->source->event_sock != SOCK_ERROR) {
+            util_timed_wait_for_fd(entry->source->event_sock, delay);
+        } else if (delay) {
+            thread_sleep(delay * 1000);
+        }
+    }
+    source_shutdown(entry->source);
+    entry->done(entry->source, entry->userdata);
+    free(entry);
+
+    return NULL;
+}
+
+static int sourceloop_start(sourceloop_t *self, unsigned int index)
+{
+    self->index = index;
+    thread_mutex_create(&self->lock);
+
+    self->poll = fdpoll_new();
+    if (!self->poll)
+        return -1;
+
+#ifdef HAVE_PIPE
+    if (pipe(self->wakeup) != 0) {
+        fdpoll_free(self->poll);
+        self->poll = NULL;
+        return -1;
+    }
+    fcntl(self->wakeup[0], F_SETFL, O_NONBLOCK);
+    fcntl(self->wakeup[1], F_SETFL, O_NONBLOCK);
+    fdpoll_arm(self->poll, self->wakeup[0], FDPOLL_EVENT_READ, self);
+#endif
+
+    self->running = 1;
+    self->thread = thread_create("Source Loop", sourceloop_thread, self, THREAD_ATTACHED);
+    if (!self->thread) {
+        self->running = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void sourceloop_stop(sourceloop_t *self)
+{
+    char name[64];
+
+    thread_mutex_lock(&self->lock);
+    self->running = 0;
+    if (self->thread)
+        sourceloop_wakeup(self);
+    thread_mutex_unlock(&self->lock);
+
+    if (self->thread) {
+        thread_join(self->thread);
+        self->thread = NULL;
+    }
+
+    if (self->poll) {
+#ifdef HAVE_PIPE
+        fdpoll_disarm(self->poll, self->wakeup[0]);
+        close(self->wakeup[0]);
+        close(self->wakeup[1]);
+#endif
+        fdpoll_free(self->poll);
+        self->poll = NULL;
+    }
+
+    thread_mutex_destroy(&self->lock);
+
+    snprintf(name, sizeof(name), "source_worker_%u_sources", self->index);
+    stats_event(NULL, name, NULL);
+    snprintf(name, sizeof(name), "source_worker_%u_load", self->index);
+    stats_event(NULL, name, NULL);
+    snprintf(name, sizeof(name), "source_worker_%u_passes", self->index);
+    stats_event(NULL, name, NULL);
+}
+
+void sourceloop_initialize(void)
+{
+    ice_config_t *config;
+    unsigned int workers;
+    unsigned int i;
+
+    if (__inited)
+        return;
+
+    config = config_get_config();
+    workers = config->source_workers;
+    config_release_config();
+
+    _loops = calloc(workers, sizeof(*_loops));
+    if (!_loops) {
+        ICECAST_LOG_ERROR("Can not allocate source loops, running every source in its own thread");
+        return;
+    }
+
+    for (i = 0; i < workers; i++) {
+        _loops_count++;
+        if (sourceloop_start(&(_loops[i]), i) != 0) {
+            ICECAST_LOG_ERROR("Can not start source loop %u, running every source in its own thread", i);
+            break;
+        }
+    }
+
+    if (_loops_count != workers) {
+        while (_loops_count)
+            sourceloop_stop(&(_loops[--_loops_count]));
+        free(_loops);
+        _loops = NULL;
+        return;
+    }
+
+    __inited = 1;
+    stats_event_args(NULL, "source_workers", "%u", workers);
+    ICECAST_LOG_INFO("%u source loops started", workers);
+}
+
+void sourceloop_shutdown(void)
+{
+    if (!__inited)
+        return;
+
+    ICECAST_LOG_DEBUG("waiting for source loops");
+    __inited = 0;
+    while (_loops_count)
+        sourceloop_stop(&(_loops[--_loops_count]));
+    free(_loops);
+    _loops = NULL;
+    stats_event(NULL, "source_workers", NULL);
+}
+
+/* the loop with the fewest sources, or NULL if there is none */
+static sourceloop_t *sourceloop_select(void)
+{
+    sourceloop_t *ret = NULL;
+    unsigned int min = 0;
+    size_t i;
+
+    if (!__inited)
+        return NULL;
+
+    for (i = 0; i < _loops_count; i++) {
+        unsigned int sources = atomic_uint_load(&(_loops[i].sources));
+
+        if (!ret || sources < min) {
+            ret = &(_loops[i]);
+            min = sources;
+        }
+    }
+
+    return ret;
+}
+
+void sourceloop_add(source_t *source, sourceloop_done_t done, void *userdata)
+{
+    sourceloop_entry_t *entry = calloc(1, sizeof(*entry));
+    sourceloop_t *loop;
+
+    if (!entry) {
+        ICECAST_LOG_ERROR("Out of memory, dropping source %s", source->mount);
+        source_start(source);
+        source_shutdown(source);
+        done(source, userdata);
+        return;
+    }
+
+    entry->source = source;
+    entry->done = done;
+    entry->userdata = userdata;
+    entry->sock = SOCK_ERROR;
+
+    /* a source stays on the loop it was given to, so all passes over it are
+     * done in order by the same thread */
+    loop = sourceloop_select();
+    if (loop) {
+        thread_mutex_lock(&loop->lock);
+        if (loop->running) {
+            atomic_uint_add(&loop->sources, 1);
+            entry->next = loop->pending;
+            loop->pending = entry;
+            sourceloop_wakeup(loop);
+            thread_mutex_unlock(&loop->lock);
+            return;
+        }
+        thread_mutex_unlock(&loop->lock);
+    }
+
+    if (!thread_create("Source Thread", sourceloop_single_thread, entry, THREAD_DETACHED)) {
+        ICECAST_LOG_ERROR("Can not start thread for source %s, dropping it", source->mount);
+        source_start(source);
+        source_shutdown(source);
+        done(source, userdata);
+        free(entry);
+    }
+}
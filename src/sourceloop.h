@@ -0,0 +1,35 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* sourceloop.h
+ *
+ * Runs all sources on a fixed number of event loops rather than giving every
+ * source a thread of its own, see <source-workers>. A loop waits for any of
+ * its source sockets to become readable or any blocked listener to become
+ * writable and then runs that source for one pass with source_process(), which
+ * reads all the input available and sends it on to the listeners.
+ * A source is run by one loop for its whole life.
+ */
+
+#ifndef __SOURCELOOP_H__
+#define __SOURCELOOP_H__
+
+#include "icecasttypes.h"
+
+/* called by the loop once the source has stopped and source_shutdown() is
+ * done. The loop no longer references the source afterwards. */
+typedef void (*sourceloop_done_t)(source_t *source, void *userdata);
+
+void sourceloop_initialize(void);
+void sourceloop_shutdown(void);
+
+/* Hands a source which completed connection_complete_source() over to the
+ * loop with the fewest sources. If no loop is running the source gets a
+ * thread of its own.
+ */
+void sourceloop_add(source_t *source, sourceloop_done_t done, void *userdata);
+
+#endif  /* __SOURCELOOP_H__ */
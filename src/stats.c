@@ -18,19 +18,25 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <libxml/xmlmemory.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 
 #include "common/thread/thread.h"
+#include "common/timing/timing.h"
 #include "common/avl/avl.h"
 #include "common/httpp/httpp.h"
 #include "common/net/sock.h"
 
 #include "stats.h"
+#include "waitlock.h"
 #include "connection.h"
 #include "source.h"
 #include "global.h"
@@ -40,6 +46,13 @@
 #include "xslt.h"
 #include "util.h"
 #include "auth.h"
+#include "xml2json.h"
+#include "json.h"
+#include "listensocket.h"
+#include "fdpoll.h"
+#include "fserve.h"
+#include "histogram.h"
+#include "affinity.h"
 #define CATMODULE "stats"
 #include "logging.h"
 
@@ -65,17 +78,49 @@ typedef struct _event_queue_tag
 
 #define event_queue_init(qp)    { (qp)->head = NULL; (qp)->tail = &(qp)->head; }
 
-typedef struct _event_listener_tag
+/* STATS streams, see stats_callback(), and server-sent events, see
+ * stats_send_events(). Every event is rendered only once into _stream_ring
+ * and a single thread feeds all stats clients from it, each client keeps
+ * its own position in the ring.
+ */
+#define STATS_STREAM_RING_LEN   4096
+#define STATS_STREAM_MAX_EVENTS 64
+/* how long clients that can not take more are waited on before the new
+ * events for the others are sent */
+#define STATS_STREAM_POLL_MS    100
+
+typedef struct {
+    /* the event as sent to STATS clients */
+    refbuf_t *line;
+    /* the event as sent to server-sent events clients, only rendered while
+     * there are any, and what they filter on: the mount of the event (NULL
+     * for global ones) and whether it is part of the public view */
+    refbuf_t *sse;
+    char *mount;
+    int public;
+} stats_stream_entry_t;
+
+typedef struct _stats_subscriber_tag
 {
-    event_queue_t queue;
-    mutex_t mutex;
+    client_t *client;
+    /* set for server-sent events clients, which get only the events of
+     * mount if set and only those of the public view if public is set */
+    int sse;
+    int public;
+    char *mount;
+    /* the stats as they were on connect, sent before anything of the ring */
+    refbuf_t *backlog;
+    /* sequence of the next event of the ring to send and how much of the
+     * current line was sent already */
+    uint64_t cursor;
+    size_t offset;
+    int armed;
 
-    struct _event_listener_tag *next;
-} event_listener_t;
+    struct _stats_subscriber_tag *next;
+} stats_subscriber_t;
 
 static volatile int _stats_running = 0;
 static thread_type *_stats_thread_id;
-static volatile int _stats_threads = 0;
 
 static stats_t _stats;
 static mutex_t _stats_mutex;
@@ -83,7 +128,146 @@ static mutex_t _stats_mutex;
 static event_queue_t _global_event_queue;
 mutex_t _global_event_mutex;
 
-static volatile event_listener_t *_event_listeners;
+/* _stream_mutex is taken after the _stats_mutex */
+static waitlock_t _stream_mutex = WAITLOCK_INITIALIZER;
+static waitcond_t _stream_cond = WAITCOND_INITIALIZER;
+static stats_stream_entry_t _stream_ring[STATS_STREAM_RING_LEN];
+/* sequence of the next event added to the ring */
+static uint64_t _stream_head = 0;
+/* clients not yet picked up by the stream thread */
+static stats_subscriber_t *_stream_new;
+static volatile unsigned int _stream_clients = 0;
+/* the server-sent events clients among them, changed with _stats_mutex locked */
+static volatile unsigned int _stream_sse_clients = 0;
+static int _stream_running = 0;
+static thread_type *_stream_thread_id;
+
+#define GLOBAL_COUNTER(id, counter_type, counter_name) [id] = {.type = counter_type, .name = counter_name}
+
+stats_counter_t stats_global_counters[STATS_GLOBAL_MAX] = {
+    /* currently active */
+    GLOBAL_COUNTER(STATS_GLOBAL_CLIENTS, STATS_COUNTER_GAUGE, "clients"),
+    GLOBAL_COUNTER(STATS_GLOBAL_LISTENERS, STATS_COUNTER_GAUGE, "listeners"),
+    /* accumulating */
+    GLOBAL_COUNTER(STATS_GLOBAL_CONNECTIONS, STATS_COUNTER_COUNTER, "connections"),
+    GLOBAL_COUNTER(STATS_GLOBAL_CLIENT_CONNECTIONS, STATS_COUNTER_COUNTER, "client_connections"),
+    GLOBAL_COUNTER(STATS_GLOBAL_FILE_CONNECTIONS, STATS_COUNTER_COUNTER, "file_connections"),
+    GLOBAL_COUNTER(STATS_GLOBAL_LISTENER_CONNECTIONS, STATS_COUNTER_COUNTER, "listener_connections"),
+    GLOBAL_COUNTER(STATS_GLOBAL_SOURCE_CLIENT_CONNECTIONS, STATS_COUNTER_COUNTER, "source_client_connections"),
+    GLOBAL_COUNTER(STATS_GLOBAL_SOURCE_RELAY_CONNECTIONS, STATS_COUNTER_COUNTER, "source_relay_connections"),
+    GLOBAL_COUNTER(STATS_GLOBAL_SOURCE_TOTAL_CONNECTIONS, STATS_COUNTER_COUNTER, "source_total_connections"),
+    GLOBAL_COUNTER(STATS_GLOBAL_STATS_CONNECTIONS, STATS_COUNTER_COUNTER, "stats_connections"),
+    GLOBAL_COUNTER(STATS_GLOBAL_CONNECTIONS_REJECTED_IP_LIMIT, STATS_COUNTER_COUNTER, "connections_rejected_ip_limit"),
+    GLOBAL_COUNTER(STATS_GLOBAL_CONNECTIONS_REJECTED_IP_RATE, STATS_COUNTER_COUNTER, "connections_rejected_ip_rate"),
+    GLOBAL_COUNTER(STATS_GLOBAL_LISTENERS_REJECTED_BANDWIDTH, STATS_COUNTER_COUNTER, "listeners_rejected_bandwidth"),
+    GLOBAL_COUNTER(STATS_GLOBAL_TLS_HANDSHAKES, STATS_COUNTER_COUNTER, "tls_handshakes"),
+    GLOBAL_COUNTER(STATS_GLOBAL_TLS_RESUMED_SESSIONS, STATS_COUNTER_COUNTER, "tls_resumed_sessions"),
+    GLOBAL_COUNTER(STATS_GLOBAL_TLS_HANDSHAKE_FAILURES, STATS_COUNTER_COUNTER, "tls_handshake_failures"),
+    GLOBAL_COUNTER(STATS_GLOBAL_TLS_HANDSHAKE_MS_LE_5, STATS_COUNTER_COUNTER, "tls_handshake_ms_le_5"),
+    GLOBAL_COUNTER(STATS_GLOBAL_TLS_HANDSHAKE_MS_LE_10, STATS_COUNTER_COUNTER, "tls_handshake_ms_le_10"),
+    GLOBAL_COUNTER(STATS_GLOBAL_TLS_HANDSHAKE_MS_LE_25, STATS_COUNTER_COUNTER, "tls_handshake_ms_le_25"),
+    GLOBAL_COUNTER(STATS_GLOBAL_TLS_HANDSHAKE_MS_LE_50, STATS_COUNTER_COUNTER, "tls_handshake_ms_le_50"),
+    GLOBAL_COUNTER(STATS_GLOBAL_TLS_HANDSHAKE_MS_LE_100, STATS_COUNTER_COUNTER, "tls_handshake_ms_le_100"),
+    GLOBAL_COUNTER(STATS_GLOBAL_TLS_HANDSHAKE_MS_LE_250, STATS_COUNTER_COUNTER, "tls_handshake_ms_le_250"),
+    GLOBAL_COUNTER(STATS_GLOBAL_TLS_HANDSHAKE_MS_LE_500, STATS_COUNTER_COUNTER, "tls_handshake_ms_le_500"),
+    GLOBAL_COUNTER(STATS_GLOBAL_TLS_HANDSHAKE_MS_LE_1000, STATS_COUNTER_COUNTER, "tls_handshake_ms_le_1000"),
+    GLOBAL_COUNTER(STATS_GLOBAL_TLS_HANDSHAKE_MS_GT_1000, STATS_COUNTER_COUNTER, "tls_handshake_ms_gt_1000"),
+    GLOBAL_COUNTER(STATS_GLOBAL_AUTH_QUEUED, STATS_COUNTER_GAUGE, "auth_queued"),
+    GLOBAL_COUNTER(STATS_GLOBAL_AUTH_IN_FLIGHT, STATS_COUNTER_GAUGE, "auth_in_flight"),
+    GLOBAL_COUNTER(STATS_GLOBAL_AUTH_REQUESTS, STATS_COUNTER_COUNTER, "auth_requests"),
+    GLOBAL_COUNTER(STATS_GLOBAL_AUTH_REQUEST_MS, STATS_COUNTER_COUNTER, "auth_request_ms"),
+    GLOBAL_COUNTER(STATS_GLOBAL_AUTH_CACHE_HITS, STATS_COUNTER_COUNTER, "auth_cache_hits"),
+    GLOBAL_COUNTER(STATS_GLOBAL_YP_IN_FLIGHT, STATS_COUNTER_GAUGE, "yp_in_flight"),
+    GLOBAL_COUNTER(STATS_GLOBAL_YP_REQUESTS, STATS_COUNTER_COUNTER, "yp_requests"),
+    GLOBAL_COUNTER(STATS_GLOBAL_YP_REQUEST_FAILURES, STATS_COUNTER_COUNTER, "yp_request_failures"),
+    GLOBAL_COUNTER(STATS_GLOBAL_YP_REQUEST_MS, STATS_COUNTER_COUNTER, "yp_request_ms"),
+    GLOBAL_COUNTER(STATS_GLOBAL_EVENTS_QUEUED, STATS_COUNTER_GAUGE, "events_queued"),
+    GLOBAL_COUNTER(STATS_GLOBAL_EVENTS_DROPPED, STATS_COUNTER_COUNTER, "events_dropped"),
+    GLOBAL_COUNTER(STATS_GLOBAL_CONNECTION_WRITES, STATS_COUNTER_COUNTER, "connection_writes"),
+    GLOBAL_COUNTER(STATS_GLOBAL_CONNECTION_PARTIAL_WRITES, STATS_COUNTER_COUNTER, "connection_partial_writes"),
+    GLOBAL_COUNTER(STATS_GLOBAL_LOG_RECORDS_QUEUED, STATS_COUNTER_GAUGE, "log_records_queued"),
+    GLOBAL_COUNTER(STATS_GLOBAL_LOG_RECORDS_DROPPED, STATS_COUNTER_COUNTER, "log_records_dropped"),
+    GLOBAL_COUNTER(STATS_GLOBAL_LISTENER_MEMORY, STATS_COUNTER_GAUGE, "listener_memory"),
+    GLOBAL_COUNTER(STATS_GLOBAL_LISTENERS_REDIRECTED_CLUSTER, STATS_COUNTER_COUNTER, "listeners_redirected_cluster"),
+    GLOBAL_COUNTER(STATS_GLOBAL_MEMORY_SHEDS, STATS_COUNTER_COUNTER, "memory_sheds"),
+    GLOBAL_COUNTER(STATS_GLOBAL_LISTENERS_REJECTED_MEMORY, STATS_COUNTER_COUNTER, "listeners_rejected_memory")
+};
+
+/* the counters of one mount, so rendering a mount does not go through the
+ * counters of all others */
+typedef struct {
+    char *mount;
+    stats_counter_t *counters;
+    stats_index_entry_t index_entry;
+} stats_counter_mount_t;
+
+/* the counters of mounts, all of them and by mount. _counters_mutex is
+ * taken last, no other lock is taken while it is held. */
+static stats_counter_t *_counters;
+static stats_index_t _counter_mounts;
+static mutex_t _counters_mutex;
+
+/* hands out the shards of the counters to the threads in turn */
+static pthread_once_t _shard_once = PTHREAD_ONCE_INIT;
+static pthread_key_t _shard_key;
+static int _shard_key_failed = 0;
+static volatile unsigned int _shard_next = 0;
+
+/* buckets of a stats index when the first entry is added */
+#define STATS_INDEX_SIZE    16
+
+/* stats rendered by stats_get_xml() and stats_get_rendered() are kept
+ * until the next event or for this many ms at most, as the counters,
+ * metadata and config they include do not go through events */
+#define STATS_SNAPSHOT_MAX_AGE  1000
+/* snapshots kept at once */
+#define STATS_SNAPSHOT_MAX      32
+
+typedef struct stats_snapshot_tag {
+    struct stats_snapshot_tag *next;
+    /* what was requested */
+    unsigned int flags;
+    char *mount;
+    char *baseurl;
+    uint64_t generation;
+    uint64_t created;
+    /* the document and its renderings, made on first request */
+    xmlDocPtr doc;
+    char *xml;
+    size_t xml_len;
+    char *json;
+    size_t json_len;
+} stats_snapshot_t;
+
+/* counts the events processed, a snapshot is outdated once this changed */
+static volatile uint64_t _stats_generation = 0;
+static stats_snapshot_t *_snapshots;
+static mutex_t _snapshots_mutex;
+
+/* changes of the stream list kept for incremental updates of slaves, see
+ * stats_send_streams(). All of this is protected by _stats_mutex. */
+#define STATS_STREAMS_LOG_LEN   4096
+/* longest a request for the stream list is held back until a change */
+#define STATS_STREAMS_WAIT_MAX  60
+
+typedef struct {
+    char *mount;
+    int added;
+} stats_streams_change_t;
+
+typedef struct stats_streams_waiter_tag {
+    struct stats_streams_waiter_tag *next;
+    client_t *client;
+    uint64_t since;
+    time_t deadline;
+} stats_streams_waiter_t;
+
+/* makes the generations of this run differ from those of a previous one */
+static uint64_t _streams_epoch;
+/* the change that made generation g is at _streams_log[g % STATS_STREAMS_LOG_LEN] */
+static uint64_t _streams_generation = 0;
+static stats_streams_change_t _streams_log[STATS_STREAMS_LOG_LEN];
+static stats_streams_waiter_t *_streams_waiters;
 
 
 static void *_stats_thread(void *arg);
@@ -92,9 +276,17 @@ static int _compare_source_stats(void *arg, void *a, void *b);
 static int _free_stats(void *key);
 static int _free_source_stats(void *key);
 static void _add_event_to_queue(stats_event_t *event, event_queue_t *queue);
-static stats_node_t *_find_node(avl_tree *tree, const char *name);
-static stats_source_t *_find_source(avl_tree *tree, const char *source);
+static stats_node_t *_find_node(stats_index_t *index, const char *name);
+static stats_source_t *_find_source(stats_index_t *index, const char *source);
+static stats_counter_t *_find_counters(const char *mount);
+static stats_index_entry_t *_index_find(stats_index_t *index, const char *key);
+static int _index_insert(stats_index_t *index, stats_index_entry_t *entry, const char *key);
+static void _index_remove(stats_index_t *index, stats_index_entry_t *entry);
+static void _index_free(stats_index_t *index);
 static void _free_event(stats_event_t *event);
+static void _free_snapshot(stats_snapshot_t *snapshot);
+static void *_stream_thread(void *arg);
+static void _streams_wake(int all);
 static stats_event_t *_get_event_from_queue(event_queue_t *queue);
 static void __add_metadata(xmlNodePtr node, const char *tag);
 
@@ -128,14 +320,18 @@ static void queue_global_event (stats_event_t *event)
 
 void stats_initialize(void)
 {
-    _event_listeners = NULL;
-
     /* set up global struct */
     _stats.global_tree = avl_tree_new(_compare_stats, NULL);
     _stats.source_tree = avl_tree_new(_compare_source_stats, NULL);
 
     /* set up global mutex */
     thread_mutex_create(&_stats_mutex);
+    thread_mutex_create(&_counters_mutex);
+    thread_mutex_create(&_snapshots_mutex);
+
+    _streams_epoch = timing_get_time();
+    _streams_generation = 0;
+    _streams_waiters = NULL;
 
     /* set up stats queues */
     event_queue_init(&_global_event_queue);
@@ -144,38 +340,72 @@ void stats_initialize(void)
     /* fire off the stats thread */
     _stats_running = 1;
     _stats_thread_id = thread_create("Stats Thread", _stats_thread, NULL, THREAD_ATTACHED);
+
+    _stream_running = 1;
+    _stream_thread_id = thread_create("Stats Stream", _stream_thread, NULL, THREAD_ATTACHED);
 }
 
 void stats_shutdown(void)
 {
-    int n;
+    size_t i;
 
     if (!_stats_running) /* We can't shutdown if we're not running. */
         return;
 
+    /* the stream thread drops all stats clients on exit */
+    waitlock_lock(&_stream_mutex);
+    _stream_running = 0;
+    waitcond_signal(&_stream_cond);
+    waitlock_unlock(&_stream_mutex);
+    thread_join(_stream_thread_id);
+
     /* wait for thread to exit */
     thread_mutex_lock(&_stats_mutex);
     _stats_running = 0;
     thread_mutex_unlock(&_stats_mutex);
+    global_wake();
     thread_join(_stats_thread_id);
-
-    /* wait for other threads to shut down */
-    do {
-        thread_sleep(300000);
-        thread_mutex_lock(&_stats_mutex);
-        n = _stats_threads;
-        thread_mutex_unlock(&_stats_mutex);
-    } while (n > 0);
     ICECAST_LOG_INFO("stats thread finished");
 
+    /* slaves still waiting for a change of the stream list are dropped */
+    while (_streams_waiters) {
+        stats_streams_waiter_t *waiter = _streams_waiters;
+
+        _streams_waiters = waiter->next;
+        client_destroy(waiter->client);
+        free(waiter);
+    }
+    for (i = 0; i < STATS_STREAMS_LOG_LEN; i++) {
+        free(_streams_log[i].mount);
+        _streams_log[i].mount = NULL;
+    }
+
+    for (i = 0; i < STATS_STREAM_RING_LEN; i++) {
+        refbuf_release(_stream_ring[i].line);
+        refbuf_release(_stream_ring[i].sse);
+        free(_stream_ring[i].mount);
+        memset(&(_stream_ring[i]), 0, sizeof(_stream_ring[i]));
+    }
+
     /* free the queues */
 
     /* destroy the queue mutexes */
     thread_mutex_destroy(&_global_event_mutex);
 
     thread_mutex_destroy(&_stats_mutex);
+
+    while (_snapshots) {
+        stats_snapshot_t *snapshot = _snapshots;
+        _snapshots = snapshot->next;
+        _free_snapshot(snapshot);
+    }
+    thread_mutex_destroy(&_snapshots_mutex);
+
+    /* _counters_mutex is kept, counters of mounts may still be freed */
     avl_tree_free(_stats.source_tree, _free_source_stats);
     avl_tree_free(_stats.global_tree, _free_stats);
+    _index_free(&_stats.source_index);
+    _index_free(&_stats.global_index);
 
     while (1)
     {
@@ -286,6 +516,155 @@ void stats_event_args(const char *source, char *name, char *format, ...)
     stats_event(source, name, buf);
 }
 
+/* the shard of a thread is kept as its index plus one, so NULL means it has none yet */
+static void _create_shard_key(void)
+{
+    if (pthread_key_create(&_shard_key, NULL) != 0)
+        _shard_key_failed = 1;
+}
+
+unsigned int stats_counter_shard(void)
+{
+    void *shard;
+
+    pthread_once(&_shard_once, _create_shard_key);
+    if (_shard_key_failed)
+        return 0;
+
+    shard = pthread_getspecific(_shard_key);
+    if (!shard) {
+        shard = (void *)(uintptr_t)((atomic_uint_add(&_shard_next, 1) % STATS_COUNTER_SHARDS) + 1);
+        if (pthread_setspecific(_shard_key, shard) != 0)
+            return 0;
+    }
+
+    return (unsigned int)(uintptr_t)shard - 1;
+}
+
+static inline void _format_counter(stats_counter_t *counter, char *buf, size_t len)
+{
+    snprintf(buf, len, "%" PRId64, stats_counter_get(counter));
+}
+
+stats_counter_t *stats_counter_new(const char *mount, const char *name, stats_counter_type_t type)
+{
+    stats_counter_t *counter;
+    stats_counter_mount_t *counter_mount;
+    stats_index_entry_t *entry;
+
+    /* so each shard is on a cache line of its own */
+    if (posix_memalign((void **)&counter, STATS_COUNTER_ALIGN, sizeof(*counter)) != 0)
+        return NULL;
+    memset(counter, 0, sizeof(*counter));
+
+    counter->type = type;
+    counter->mount = strdup(mount);
+    counter->name = strdup(name);
+    if (!counter->mount || !counter->name) {
+        free(counter->mount);
+        free(counter->name);
+        free(counter);
+        return NULL;
+    }
+
+    thread_mutex_lock(&_counters_mutex);
+    entry = _index_find(&_counter_mounts, mount);
+    if (entry) {
+        counter_mount = (stats_counter_mount_t *)((char *)entry - offsetof(stats_counter_mount_t, index_entry));
+    } else {
+        counter_mount = calloc(1, sizeof(*counter_mount));
+        if (counter_mount)
+            counter_mount->mount = strdup(mount);
+        if (!counter_mount || !counter_mount->mount ||
+                _index_insert(&_counter_mounts, &(counter_mount->index_entry), counter_mount->mount) != 0) {
+            thread_mutex_unlock(&_counters_mutex);
+            if (counter_mount)
+                free(counter_mount->mount);
+            free(counter_mount);
+            free(counter->mount);
+            free(counter->name);
+            free(counter);
+            return NULL;
+        }
+    }
+    counter->mount_next = counter_mount->counters;
+    counter_mount->counters = counter;
+    counter->next = _counters;
+    _counters = counter;
+    thread_mutex_unlock(&_counters_mutex);
+
+    return counter;
+}
+
+void stats_counter_free(stats_counter_t *counter)
+{
+    stats_counter_t **prev;
+    stats_index_entry_t *entry;
+
+    if (!counter)
+        return;
+
+    thread_mutex_lock(&_counters_mutex);
+    for (prev = &_counters; *prev; prev = &((*prev)->next)) {
+        if (*prev == counter) {
+            *prev = counter->next;
+            break;
+        }
+    }
+    entry = _index_find(&_counter_mounts, counter->mount);
+    if (entry) {
+        stats_counter_mount_t *counter_mount = (stats_counter_mount_t *)((char *)entry - offsetof(stats_counter_mount_t, index_entry));
+
+        for (prev = &(counter_mount->counters); *prev; prev = &((*prev)->mount_next)) {
+            if (*prev == counter) {
+                *prev = counter->mount_next;
+                break;
+            }
+        }
+        if (!counter_mount->counters) {
+            _index_remove(&_counter_mounts, entry);
+            free(counter_mount->mount);
+            free(counter_mount);
+        }
+    }
+    thread_mutex_unlock(&_counters_mutex);
+
+    free(counter->mount);
+    free(counter->name);
+    free(counter);
+}
+
+/* returns the value of a counter as a string or NULL if there is no such
+ * counter */
+static char *_get_counter(const char *source, const char *name)
+{
+    stats_counter_t *counter;
+    char buf[32];
+    size_t i;
+
+    if (source == NULL) {
+        for (i = 0; i < STATS_GLOBAL_MAX; i++) {
+            if (strcmp(stats_global_counters[i].name, name) == 0) {
+                _format_counter(&(stats_global_counters[i]), buf, sizeof(buf));
+                return strdup(buf);
+            }
+        }
+        return NULL;
+    }
+
+    thread_mutex_lock(&_counters_mutex);
+    for (counter = _find_counters(source); counter; counter = counter->mount_next) {
+        if (strcmp(counter->name, name) == 0) {
+            _format_counter(counter, buf, sizeof(buf));
+            thread_mutex_unlock(&_counters_mutex);
+            return strdup(buf);
+        }
+    }
+    thread_mutex_unlock(&_counters_mutex);
+
+    return NULL;
+}
+
 static char *_get_stats(const char *source, const char *name)
 {
     stats_node_t *stats = NULL;
@@ -295,11 +674,11 @@ static char *_get_stats(const char *source, const char *name)
     thread_mutex_lock(&_stats_mutex);
 
     if (source == NULL) {
-        stats = _find_node(_stats.global_tree, name);
+        stats = _find_node(&_stats.global_index, name);
     } else {
-        src = _find_source(_stats.source_tree, source);
+        src = _find_source(&_stats.source_index, source);
         if (src) {
-            stats = _find_node(src->stats_tree, name);
+            stats = _find_node(&src->stats_index, name);
         }
     }
 
@@ -307,6 +686,9 @@ static char *_get_stats(const char *source, const char *name)
 
     thread_mutex_unlock(&_stats_mutex);
 
+    if (!value)
+        value = _get_counter(source, name);
+
     return value;
 }
 
@@ -364,80 +746,129 @@ void stats_event_dec(const char *source, const char *name)
     }
 }
 
-/* note: you must call this function only when you have exclusive access
-** to the avl_tree
-*/
-static stats_node_t *_find_node(avl_tree *stats_tree, const char *name)
+static stats_index_entry_t *_index_find(stats_index_t *index, const char *key)
 {
-    stats_node_t *stats;
-    avl_node *node;
-    int cmp;
-
-    /* get the root node */
-    node = stats_tree->root->right;
-
-    while (node) {
-        stats = (stats_node_t *) node->key;
-        cmp = strcmp(name, stats->name);
-        if (cmp < 0)
-            node = node->left;
-        else if (cmp > 0)
-            node = node->right;
-        else
-            return stats;
+    stats_index_entry_t *entry;
+    uint32_t hash;
+
+    if (!index->size)
+        return NULL;
+
+    hash = util_hash_string(key);
+    for (entry = index->buckets[hash & (index->size - 1)]; entry; entry = entry->next) {
+        if (entry->hash == hash && strcmp(entry->key, key) == 0)
+            return entry;
     }
 
-    /* didn't find it */
     return NULL;
 }
 
+/* doubles the number of buckets, if that fails the chains just get longer */
+static void _index_grow(stats_index_t *index)
+{
+    size_t size = index->size ? index->size * 2 : STATS_INDEX_SIZE;
+    stats_index_entry_t **buckets = calloc(size, sizeof(*buckets));
+    size_t i;
+
+    if (!buckets)
+        return;
+
+    for (i = 0; i < index->size; i++) {
+        while (index->buckets[i]) {
+            stats_index_entry_t *entry = index->buckets[i];
+            index->buckets[i] = entry->next;
+            entry->next = buckets[entry->hash & (size - 1)];
+            buckets[entry->hash & (size - 1)] = entry;
+        }
+    }
+
+    free(index->buckets);
+    index->buckets = buckets;
+    index->size = size;
+}
+
+/* key must stay valid as long as the entry is in the index.
+ * Returns -1 if there is no memory for the index. */
+static int _index_insert(stats_index_t *index, stats_index_entry_t *entry, const char *key)
+{
+    stats_index_entry_t **head;
+
+    if (index->count >= index->size)
+        _index_grow(index);
+    if (!index->size)
+        return -1;
+
+    entry->key = key;
+    entry->hash = util_hash_string(key);
+    head = &(index->buckets[entry->hash & (index->size - 1)]);
+    entry->next = *head;
+    *head = entry;
+    index->count++;
+
+    return 0;
+}
+
+static void _index_remove(stats_index_t *index, stats_index_entry_t *entry)
+{
+    stats_index_entry_t **prev;
+
+    if (!index->size)
+        return;
+
+    for (prev = &(index->buckets[entry->hash & (index->size - 1)]); *prev; prev = &((*prev)->next)) {
+        if (*prev == entry) {
+            *prev = entry->next;
+            index->count--;
+            return;
+        }
+    }
+}
+
+static void _index_free(stats_index_t *index)
+{
+    free(index->buckets);
+    index->buckets = NULL;
+    index->size = 0;
+    index->count = 0;
+}
+
 /* note: you must call this function only when you have exclusive access
-** to the avl_tree
+** to the index
 */
-static stats_source_t *_find_source(avl_tree *source_tree, const char *source)
+static stats_node_t *_find_node(stats_index_t *index, const char *name)
 {
-    stats_source_t *stats;
-    avl_node *node;
-    int cmp;
-
-    /* get the root node */
-    node = source_tree->root->right;
-    while (node) {
-        stats = (stats_source_t *) node->key;
-        cmp = strcmp(source, stats->source);
-        if (cmp < 0)
-            node = node->left;
-        else if (cmp > 0)
-            node = node->right;
-        else
-            return stats;
-    }
+    stats_index_entry_t *entry = _index_find(index, name);
 
-    /* didn't find it */
-    return NULL;
+    if (!entry)
+        return NULL;
+
+    return (stats_node_t *)((char *)entry - offsetof(stats_node_t, index_entry));
 }
 
-static stats_event_t *_copy_event(stats_event_t *event)
+/* note: you must call this function only when you have exclusive access
+** to the index
+*/
+static stats_source_t *_find_source(stats_index_t *index, const char *source)
 {
-    stats_event_t *copy = (stats_event_t *)calloc(1, sizeof(stats_event_t));
-    if (event->source)
-        copy->source = (char *)strdup(event->source);
-    else
-        copy->source = NULL;
-    if (event->name)
-        copy->name = (char *)strdup(event->name);
-    if (event->value)
-        copy->value = (char *)strdup(event->value);
-    else
-        copy->value = NULL;
-    copy->hidden = event->hidden;
-    copy->next = NULL;
+    stats_index_entry_t *entry = _index_find(index, source);
+
+    if (!entry)
+        return NULL;
 
-    return copy;
+    return (stats_source_t *)((char *)entry - offsetof(stats_source_t, index_entry));
 }
 
+/* the counters of a mount, _counters_mutex must be held */
+static stats_counter_t *_find_counters(const char *mount)
+{
+    stats_index_entry_t *entry = _index_find(&_counter_mounts, mount);
+
+    if (!entry)
+        return NULL;
+
+    return ((stats_counter_mount_t *)((char *)entry - offsetof(stats_counter_mount_t, index_entry)))->counters;
+}
 
-/* helper to apply specialised changes to a stats node */
 static void modify_node_event(stats_node_t *node, stats_event_t *event)
 {
     char *str;
@@ -496,12 +927,14 @@ static void process_global_event (stats_event_t *event)
     if (event->action == STATS_EVENT_REMOVE)
     {
         /* we're deleting */
-        node = _find_node(_stats.global_tree, event->name);
-        if (node != NULL)
+        node = _find_node(&_stats.global_index, event->name);
+        if (node != NULL) {
+            _index_remove(&_stats.global_index, &node->index_entry);
             avl_delete(_stats.global_tree, (void *)node, _free_stats);
+        }
         return;
     }
-    node = _find_node(_stats.global_tree, event->name);
+    node = _find_node(&_stats.global_index, event->name);
     if (node)
     {
         modify_node_event (node, event);
@@ -513,14 +946,18 @@ static void process_global_event (stats_event_t *event)
         node->name = (char *)strdup(event->name);
         node->value = (char *)strdup(event->value);
 
+        if (_index_insert(&_stats.global_index, &node->index_entry, node->name) != 0) {
+            _free_stats(node);
+            return;
+        }
         avl_insert(_stats.global_tree, (void *)node);
     }
 }
 
 
-static void process_source_event (stats_event_t *event)
+static void _process_source_event (stats_event_t *event)
 {
-    stats_source_t *snode = _find_source(_stats.source_tree, event->source);
+    stats_source_t *snode = _find_source(&_stats.source_index, event->source);
     if (snode == NULL)
     {
         if (event->action == STATS_EVENT_REMOVE)
@@ -536,11 +973,15 @@ static void process_source_event (stats_event_t *event)
         else
             snode->hidden = 0;
 
+        if (_index_insert(&_stats.source_index, &snode->index_entry, snode->source) != 0) {
+            _free_source_stats(snode);
+            return;
+        }
         avl_insert(_stats.source_tree, (void *) snode);
     }
     if (event->name)
     {
-        stats_node_t *node = _find_node(snode->stats_tree, event->name);
+        stats_node_t *node = _find_node(&snode->stats_index, event->name);
         if (node == NULL)
         {
             if (event->action == STATS_EVENT_REMOVE)
@@ -554,6 +995,10 @@ static void process_source_event (stats_event_t *event)
                 node->value = (char *)strdup(event->value);
                 node->hidden = snode->hidden;
 
+                if (_index_insert(&snode->stats_index, &node->index_entry, node->name) != 0) {
+                    _free_stats(node);
+                    return;
+                }
                 avl_insert(snode->stats_tree, (void *)node);
             }
             return;
@@ -561,6 +1006,7 @@ static void process_source_event (stats_event_t *event)
         if (event->action == STATS_EVENT_REMOVE)
         {
             ICECAST_LOG_DEBUG("delete node %s", event->name);
+            _index_remove(&snode->stats_index, &node->index_entry);
             avl_delete(snode->stats_tree, (void *)node, _free_stats);
             return;
         }
@@ -586,10 +1032,35 @@ static void process_source_event (stats_event_t *event)
     if (event->action == STATS_EVENT_REMOVE)
     {
         ICECAST_LOG_DEBUG("delete source node %s", event->source);
+        _index_remove(&_stats.source_index, &snode->index_entry);
         avl_delete(_stats.source_tree, (void *)snode, _free_source_stats);
     }
 }
 
+/* records that mount was added to or removed from the stream list */
+static void _streams_changed(const char *mount, int added)
+{
+    stats_streams_change_t *change;
+
+    _streams_generation++;
+    change = &(_streams_log[_streams_generation % STATS_STREAMS_LOG_LEN]);
+    free(change->mount);
+    change->mount = strdup(mount);
+    change->added = added;
+}
+
+static void process_source_event (stats_event_t *event)
+{
+    stats_source_t *snode = _find_source(&_stats.source_index, event->source);
+    int visible = snode && snode->hidden == 0;
+
+    _process_source_event(event);
+
+    snode = _find_source(&_stats.source_index, event->source);
+    if (visible != (snode && snode->hidden == 0))
+        _streams_changed(event->source, !visible);
+}
+
 /* NOTE: implicit %z is added to format string. */
 static inline void __format_time(char * buffer, size_t len, const char * format) {
     time_t now = time(NULL);
@@ -666,31 +1137,266 @@ void stats_global (ice_config_t *config)
 }
 
 
+static void _update_refbuf_pool_stats(void)
+{
+    refbuf_pool_stats_t pool;
+
+    refbuf_get_pool_stats(&pool);
+    stats_event_args (NULL, "refbuf_pool_hits", "%" PRIu64, pool.hits);
+    stats_event_args (NULL, "refbuf_pool_misses", "%" PRIu64, pool.misses);
+    stats_event_args (NULL, "refbuf_pool_cached", "%zu", pool.cached);
+    stats_event_args (NULL, "refbuf_pool_cached_bytes", "%zu", pool.cached_bytes);
+    if (pool.huge_bytes) {
+        stats_event_args (NULL, "refbuf_huge_page_bytes", "%zu", pool.huge_bytes);
+        stats_event_args (NULL, "refbuf_huge_page_bytes_hugetlb", "%zu", pool.huge_bytes_hugetlb);
+    }
+}
+
+
+static void _update_listener_memory_stats(void)
+{
+    int64_t listeners = stats_counter_get(&(stats_global_counters[STATS_GLOBAL_LISTENERS]));
+    int64_t memory = stats_counter_get(&(stats_global_counters[STATS_GLOBAL_LISTENER_MEMORY]));
+
+    if (listeners <= 0 || memory <= 0) {
+        stats_event (NULL, "bytes_per_listener", "0");
+    } else {
+        stats_event_args (NULL, "bytes_per_listener", "%" PRId64, memory / listeners);
+    }
+}
+
+
+/* publishes percentiles of the latency histograms, in µs */
+static void _update_histogram_stats(void)
+{
+    static const struct {
+        const char *name;
+        double fraction;
+    } percentiles[] = {{"p50", .5}, {"p90", .9}, {"p99", .99}};
+    histogram_snapshot_t snapshot;
+    size_t i, j;
+
+    if (!histogram_enabled())
+        return;
+
+    for (i = 0; i < HISTOGRAM_MAX; i++) {
+        const char *name = histogram_get_name(i);
+        char key[128];
+
+        histogram_get(i, &snapshot);
+
+        snprintf(key, sizeof(key), "latency_%s_count", name);
+        stats_event_args(NULL, key, "%" PRIu64, snapshot.count);
+        for (j = 0; j < (sizeof(percentiles)/sizeof(*percentiles)); j++) {
+            snprintf(key, sizeof(key), "latency_%s_%s_us", name, percentiles[j].name);
+            stats_event_args(NULL, key, "%" PRIu64, histogram_percentile(&snapshot, percentiles[j].fraction));
+        }
+        snprintf(key, sizeof(key), "latency_%s_max_us", name);
+        stats_event_args(NULL, key, "%" PRIu64, snapshot.max);
+    }
+}
+
+
+static inline int __is_in_list(const char *key, const char *list[])
+{
+    size_t i;
+    for (i = 0; list[i]; i++)
+        if (strcmp(key, list[i]) == 0)
+            return 1;
+    return 0;
+}
+
+static inline int __include_node(unsigned int flags, const char *key, const char *list[])
+{
+    return !(flags & STATS_XML_FLAG_PUBLIC_VIEW) || __is_in_list(key, list);
+}
+
+/* keys shown by STATS_XML_FLAG_PUBLIC_VIEW */
+static const char *public_keys_global[] = {"admin", "location", "host", "server_id", "server_start_iso8601", NULL};
+static const char *public_keys_source[] = {"listeners", "server_name", "server_description", "stream_start_iso8601", "subtype", "content-type", "listenurl", "genre", "display-title", NULL};
+
+/* whether an event is part of the public view. You must have the
+ * _stats_mutex locked. */
+static int _stream_is_public(const char *source, const char *name)
+{
+    stats_source_t *src;
+
+    if (!source)
+        return name && __is_in_list(name, public_keys_global);
+
+    src = _find_source(&_stats.source_index, source);
+    if (src && src->hidden)
+        return 0;
+
+    /* the mount was removed */
+    if (!name)
+        return 1;
+
+    return __is_in_list(name, public_keys_source);
+}
+
+/* renders an event as server-sent event, with the change as JSON object */
+static refbuf_t *_stream_render_sse(const char *source, const char *name, const char *value)
+{
+    json_renderer_t *renderer = json_renderer_create(JSON_RENDERER_FLAGS_NONE);
+    refbuf_t *refbuf;
+    char *json;
+    int len;
+
+    if (!renderer)
+        return NULL;
+
+    json_renderer_begin(renderer, JSON_ELEMENT_TYPE_OBJECT);
+    json_renderer_write_key(renderer, "mount", JSON_RENDERER_FLAGS_NONE);
+    if (source) {
+        json_renderer_write_string(renderer, source, JSON_RENDERER_FLAGS_NONE);
+    } else {
+        json_renderer_write_null(renderer);
+    }
+    json_renderer_write_key(renderer, "name", JSON_RENDERER_FLAGS_NONE);
+    if (name) {
+        json_renderer_write_string(renderer, name, JSON_RENDERER_FLAGS_NONE);
+    } else {
+        json_renderer_write_null(renderer);
+    }
+    json_renderer_write_key(renderer, "value", JSON_RENDERER_FLAGS_NONE);
+    if (value) {
+        json_renderer_write_string(renderer, value, JSON_RENDERER_FLAGS_NONE);
+    } else {
+        json_renderer_write_null(renderer);
+    }
+    json_renderer_end(renderer);
+
+    json = json_renderer_finish(&renderer);
+    if (!json)
+        return NULL;
+
+    len = snprintf(NULL, 0, "event: stats\ndata: %s\n\n", json);
+    if (len < 0) {
+        free(json);
+        return NULL;
+    }
+
+    refbuf = refbuf_new(len + 1);
+    if (refbuf) {
+        snprintf(refbuf->data, len + 1, "event: stats\ndata: %s\n\n", json);
+        refbuf->len = len;
+    }
+    free(json);
+
+    return refbuf;
+}
+
+/* renders an event the way it is sent to STATS clients */
+static refbuf_t *_stream_render(const char *source, const char *name, const char *value)
+{
+    refbuf_t *refbuf;
+    int len;
+
+    if (!source)
+        source = "global";
+    if (!name)
+        name = "null";
+    if (!value)
+        value = "null";
+
+    len = snprintf(NULL, 0, "EVENT %s %s %s\n", source, name, value);
+    if (len < 0)
+        return NULL;
+
+    refbuf = refbuf_new(len + 1);
+    if (!refbuf)
+        return NULL;
+    snprintf(refbuf->data, len + 1, "EVENT %s %s %s\n", source, name, value);
+    refbuf->len = len;
+
+    return refbuf;
+}
+
+/* adds an event to the ring of the STATS streams and wakes up the stream
+ * thread. You must have the _stats_mutex locked. */
+static void _stream_event(const char *source, const char *name, const char *value)
+{
+    stats_stream_entry_t entry = {NULL, NULL, NULL, 0};
+    stats_stream_entry_t old;
+
+    if (!atomic_uint_load(&_stream_clients))
+        return;
+
+    entry.line = _stream_render(source, name, value);
+    if (!entry.line)
+        return;
+
+    if (atomic_uint_load(&_stream_sse_clients)) {
+        entry.sse = _stream_render_sse(source, name, value);
+        entry.mount = source ? strdup(source) : NULL;
+        entry.public = _stream_is_public(source, name);
+    }
+
+    waitlock_lock(&_stream_mutex);
+    old = _stream_ring[_stream_head % STATS_STREAM_RING_LEN];
+    _stream_ring[_stream_head % STATS_STREAM_RING_LEN] = entry;
+    _stream_head++;
+    waitcond_signal(&_stream_cond);
+    waitlock_unlock(&_stream_mutex);
+
+    /* clients still sending it hold their own reference, the mount is only
+     * looked at with the _stream_mutex locked */
+    refbuf_release(old.line);
+    refbuf_release(old.sse);
+    free(old.mount);
+}
+
+/* sends an event with the value of counter to every stats stream if it
+ * changed since it was last sent. You must have the _stats_mutex locked. */
+static void _publish_counter(stats_counter_t *counter)
+{
+    uint64_t value = (uint64_t)stats_counter_get(counter);
+    char buf[32];
+
+    if (value == counter->published)
+        return;
+    counter->published = value;
+
+    /* the counters of mounts without statistics are not shown */
+    if (!atomic_uint_load(&_stream_clients) || (counter->mount && !_find_source(&_stats.source_index, counter->mount)))
+        return;
+
+    _format_counter(counter, buf, sizeof(buf));
+    _stream_event(counter->mount, counter->name, buf);
+}
+
+static void _publish_counters(void)
+{
+    stats_counter_t *counter;
+    size_t i;
+
+    thread_mutex_lock(&_stats_mutex);
+    for (i = 0; i < STATS_GLOBAL_MAX; i++)
+        _publish_counter(&(stats_global_counters[i]));
+
+    thread_mutex_lock(&_counters_mutex);
+    for (counter = _counters; counter; counter = counter->next)
+        _publish_counter(counter);
+    thread_mutex_unlock(&_counters_mutex);
+    thread_mutex_unlock(&_stats_mutex);
+}
+
 static void *_stats_thread(void *arg)
 {
     stats_event_t *event;
-    stats_event_t *copy;
-    event_listener_t *listener;
+    time_t next_pool_update = 0;
 
     (void)arg;
 
+    affinity_apply(CPU_AFFINITY_STATS);
+
     stats_event_time (NULL, "server_start");
     stats_event_time_iso8601 (NULL, "server_start_iso8601");
 
-    /* global currently active stats */
-    stats_event (NULL, "clients", "0");
-    stats_event (NULL, "connections", "0");
+    /* global currently active stats, the counters are in stats_global_counters */
     stats_event (NULL, "sources", "0");
     stats_event (NULL, "stats", "0");
-    stats_event (NULL, "listeners", "0");
-
-    /* global accumulating stats */
-    stats_event (NULL, "client_connections", "0");
-    stats_event (NULL, "source_client_connections", "0");
-    stats_event (NULL, "source_relay_connections", "0");
-    stats_event (NULL, "source_total_connections", "0");
-    stats_event (NULL, "stats_connections", "0");
-    stats_event (NULL, "listener_connections", "0");
 
     ICECAST_LOG_INFO("stats thread started");
     while (1) {
@@ -701,6 +1407,13 @@ static void *_stats_thread(void *arg)
         }
         thread_mutex_unlock(&_stats_mutex);
 
+        if (time(NULL) >= next_pool_update) {
+            _update_refbuf_pool_stats();
+            _update_listener_memory_stats();
+            _update_histogram_stats();
+            next_pool_update = time(NULL) + 5;
+        }
+
         thread_mutex_lock(&_global_event_mutex);
         if (_global_event_queue.head != NULL) {
             /* grab the next event from the queue */
@@ -718,18 +1431,11 @@ static void *_stats_thread(void *arg)
                 process_global_event (event);
             else
                 process_source_event (event);
+            atomic_u64_add(&_stats_generation, 1);
 
             /* now we have an event that's been processed into the running stats */
-            /* this event should get copied to event listeners' queues */
-            listener = (event_listener_t *)_event_listeners;
-            while (listener) {
-                copy = _copy_event(event);
-                thread_mutex_lock (&listener->mutex);
-                _add_event_to_queue (copy, &listener->queue);
-                thread_mutex_unlock (&listener->mutex);
-
-                listener = listener->next;
-            }
+            /* this event should get sent to the stats clients */
+            _stream_event(event->source, event->name, event->value);
 
             /* now we need to destroy the event */
             _free_event(event);
@@ -742,49 +1448,15 @@ static void *_stats_thread(void *arg)
             thread_mutex_unlock(&_global_event_mutex);
         }
 
-        thread_sleep(300000);
+        _publish_counters();
+        _streams_wake(0);
+        global_sleep(300);
     }
 
     return NULL;
 }
 
-/* you must have the _stats_mutex locked here */
-static void _unregister_listener(event_listener_t *listener)
-{
-    event_listener_t **prev = (event_listener_t **)&_event_listeners,
-                     *current = *prev;
-    while (current)
-    {
-        if (current == listener)
-        {
-            *prev = current->next;
-            break;
-        }
-        prev = &current->next;
-        current = *prev;
-    }
-}
-
-
-static stats_event_t *_make_event_from_node(stats_node_t *node, char *source)
-{
-    stats_event_t *event = (stats_event_t *)malloc(sizeof(stats_event_t));
-
-    if (source != NULL)
-        event->source = (char *)strdup(source);
-    else
-        event->source = NULL;
-    event->name = (char *)strdup(node->name);
-    event->value = (char *)strdup(node->value);
-    event->hidden = node->hidden;
-    event->action = STATS_EVENT_SET;
-    event->next = NULL;
-
-    return event;
-}
-
-
-static void _add_event_to_queue(stats_event_t *event, event_queue_t *queue)
+static void _add_event_to_queue(stats_event_t *event, event_queue_t *queue)
 {
     *queue->tail = event;
     queue->tail = (volatile stats_event_t **)&event->next;
@@ -806,25 +1478,6 @@ static stats_event_t *_get_event_from_queue (event_queue_t *queue)
     return event;
 }
 
-static int _send_event_to_client(stats_event_t *event, client_t *client)
-{
-    int len;
-    char buf [200];
-
-    /* send data to the client!!!! */
-    len = snprintf (buf, sizeof (buf), "EVENT %s %s %s\n",
-            (event->source != NULL) ? event->source : "global",
-            event->name ? event->name : "null",
-            event->value ? event->value : "null");
-    if (len > 0 && len < (int)sizeof (buf))
-    {
-        client_send_bytes (client, buf, len);
-        if (client->con->error)
-            return -1;
-    }
-    return 0;
-}
-
 void stats_add_authstack(auth_stack_t *stack, xmlNodePtr parent)
 {
     xmlNodePtr authentication;
@@ -840,27 +1493,13 @@ void stats_add_authstack(auth_stack_t *stack, xmlNodePtr parent)
    }
 }
 
-static inline int __is_in_list(const char *key, const char *list[])
-{
-    size_t i;
-    for (i = 0; list[i]; i++)
-        if (strcmp(key, list[i]) == 0)
-            return 1;
-    return 0;
-}
-
-static inline int __include_node(unsigned int flags, const char *key, const char *list[])
-{
-    return !(flags & STATS_XML_FLAG_PUBLIC_VIEW) || __is_in_list(key, list);
-}
-
 static xmlNodePtr _dump_stats_to_doc (xmlNodePtr root, unsigned int flags, const char *show_mount, client_t *client) {
-    static const char *public_keys_global[] = {"admin", "location", "host", "server_id", "server_start_iso8601", NULL};
-    static const char *public_keys_source[] = {"listeners", "server_name", "server_description", "stream_start_iso8601", "subtype", "content-type", "listenurl", "genre", "display-title", NULL};
     int hidden = flags & STATS_XML_FLAG_SHOW_HIDDEN ? 1 : 0;
     avl_node *avlnode;
     xmlNodePtr ret = NULL;
     ice_config_t *config;
+    char buf[32];
+    size_t n;
 
     if (flags & STATS_XML_FLAG_PUBLIC_VIEW) {
         /* Ensure those flags are clear when rendering a public view */
@@ -881,6 +1520,14 @@ static xmlNodePtr _dump_stats_to_doc (xmlNodePtr root, unsigned int flags, const
             xmlNewTextChild (root, NULL, XMLSTR(stat->name), XMLSTR(stat->value));
         avlnode = avl_get_next (avlnode);
     }
+    for (n = 0; n < STATS_GLOBAL_MAX; n++) {
+        stats_counter_t *counter = &(stats_global_counters[n]);
+
+        if (__include_node(flags, counter->name, public_keys_global)) {
+            _format_counter(counter, buf, sizeof(buf));
+            xmlNewTextChild (root, NULL, XMLSTR(counter->name), XMLSTR(buf));
+        }
+    }
     /* now per mount stats */
     avlnode = avl_get_first(_stats.source_tree);
 
@@ -893,6 +1540,7 @@ static xmlNodePtr _dump_stats_to_doc (xmlNodePtr root, unsigned int flags, const
             xmlNodePtr metadata, history;
             source_t *source_real;
             mount_proxy *mountproxy;
+            stats_counter_t *counter;
             int i;
 
             avl_node *avlnode2 = avl_get_first (source->stats_tree);
@@ -916,6 +1564,14 @@ static xmlNodePtr _dump_stats_to_doc (xmlNodePtr root, unsigned int flags, const
                 avlnode2 = avl_get_next (avlnode2);
             }
 
+            thread_mutex_lock(&_counters_mutex);
+            for (counter = _find_counters(source->source); counter; counter = counter->mount_next) {
+                if (!__include_node(flags, counter->name, public_keys_source))
+                    continue;
+                _format_counter(counter, buf, sizeof(buf));
+                xmlNewTextChild (xmlnode, NULL, XMLSTR(counter->name), XMLSTR(buf));
+            }
+            thread_mutex_unlock(&_counters_mutex);
 
             avl_tree_rlock(global.source_tree);
             source_real = source_find_mount_raw(source->source);
@@ -953,275 +1609,1439 @@ static xmlNodePtr _dump_stats_to_doc (xmlNodePtr root, unsigned int flags, const
 }
 
 
-/* factoring out code for stats loops
-** this function copies all stats to queue, and registers
-** the queue for all new events atomically.
-** note: mutex must already be created!
-*/
-static void _register_listener (event_listener_t *listener)
+/* writes the roles of the <authentication> nodes below parent */
+static void _json_add_authentication(json_renderer_t *renderer, xmlNodePtr parent)
 {
-    avl_node *node;
-    avl_node *node2;
-    stats_event_t *event;
-    stats_source_t *source;
-
-    thread_mutex_lock(&_stats_mutex);
-
-    /* first we fill our queue with the current stats */
-
-    /* start with the global stats */
-    node = avl_get_first(_stats.global_tree);
-    while (node) {
-        event = _make_event_from_node((stats_node_t *) node->key, NULL);
-        _add_event_to_queue(event, &listener->queue);
+    xmlNodePtr authentication;
+    xmlNodePtr role;
 
-        node = avl_get_next(node);
+    json_renderer_write_key(renderer, "authentication", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_begin(renderer, JSON_ELEMENT_TYPE_ARRAY);
+    for (authentication = parent->xmlChildrenNode; authentication; authentication = authentication->next) {
+        for (role = authentication->xmlChildrenNode; role; role = role->next)
+            xml2json_render_node(renderer, NULL, role, XMLNS_LEGACY_STATS);
     }
+    json_renderer_end(renderer);
+}
 
-    /* now the stats for each source */
-    node = avl_get_first(_stats.source_tree);
-    while (node) {
-        source = (stats_source_t *)node->key;
-        node2 = avl_get_first(source->stats_tree);
-        while (node2) {
-            event = _make_event_from_node((stats_node_t *)node2->key, source->source);
-            _add_event_to_queue (event, &listener->queue);
+/* as __add_metadata() followed by xml2json */
+static void _json_add_metadata(json_renderer_t *renderer, const char *tag)
+{
+    const char *value = strstr(tag, "=");
+    char *name;
+    size_t namelen;
+    size_t i;
 
-            node2 = avl_get_next(node2);
-        }
+    if (!value || !value[1])
+        return;
 
-        node = avl_get_next(node);
-    }
+    namelen = value - tag + 1;
+    name = malloc(namelen);
+    if (!name)
+        return;
+
+    for (i = 0; i < (namelen - 1); i++)
+        name[i] = tolower(tag[i]);
+    name[namelen-1] = 0;
 
-    /* now we register to receive future event notices */
-    listener->next = (event_listener_t *)_event_listeners;
-    _event_listeners = listener;
+    json_renderer_write_key(renderer, name, JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_string(renderer, value + 1, JSON_RENDERER_FLAGS_NONE);
 
-    thread_mutex_unlock(&_stats_mutex);
+    free(name);
 }
 
-void *stats_connection(void *arg)
+/* renders what _dump_stats_to_doc() and xml2json_render_doc_simple() give
+ * for the stats, written straight from the stats. Only the parts that have
+ * their own XML renderers (modules, authentication, listeners and history)
+ * are built as XML nodes.
+ */
+static void _dump_stats_to_json(json_renderer_t *renderer, unsigned int flags, const char *show_mount, client_t *client)
 {
-    client_t *client = (client_t *)arg;
-    stats_event_t *event;
-    event_listener_t listener;
+    int hidden = flags & STATS_XML_FLAG_SHOW_HIDDEN ? 1 : 0;
+    avl_node *avlnode;
+    xmlNodePtr modules;
+    xmlNodePtr authentication = NULL;
+    ice_config_t *config;
+    int has_sources = 0;
+    char buf[32];
+    size_t n;
 
-    ICECAST_LOG_INFO("stats client starting");
+    if (flags & STATS_XML_FLAG_PUBLIC_VIEW) {
+        /* Ensure those flags are clear when rendering a public view */
+        flags &= ~(STATS_XML_FLAG_SHOW_LISTENERS|STATS_XML_FLAG_SHOW_HIDDEN);
+    } else {
+        authentication = xmlNewNode(NULL, XMLSTR("icestats"));
+        config = config_get_config();
+        stats_add_authstack(config->authstack, authentication);
+        config_release_config();
+    }
+
+    modules = module_container_get_modulelist_as_xml(global.modulecontainer);
+
+    json_renderer_begin(renderer, JSON_ELEMENT_TYPE_ARRAY);
+    json_renderer_begin(renderer, JSON_ELEMENT_TYPE_OBJECT);
+    json_renderer_write_key(renderer, "name", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_string(renderer, "icestats", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_key(renderer, "ns", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_string(renderer, XMLNS_LEGACY_STATS, JSON_RENDERER_FLAGS_NONE);
+    json_renderer_end(renderer);
+    json_renderer_begin(renderer, JSON_ELEMENT_TYPE_OBJECT);
 
-    event_queue_init (&listener.queue);
-    /* increment the thread count */
     thread_mutex_lock(&_stats_mutex);
-    _stats_threads++;
-    stats_event_args (NULL, "stats", "%d", _stats_threads);
-    thread_mutex_unlock(&_stats_mutex);
+    /* general stats first */
+    for (avlnode = avl_get_first(_stats.global_tree); avlnode; avlnode = avl_get_next(avlnode)) {
+        stats_node_t *stat = avlnode->key;
+        if (stat->hidden <= hidden && __include_node(flags, stat->name, public_keys_global))
+            xml2json_render_legacystats_value(renderer, 1, stat->name, stat->value);
+    }
+    for (n = 0; n < STATS_GLOBAL_MAX; n++) {
+        stats_counter_t *counter = &(stats_global_counters[n]);
 
-    thread_mutex_create (&(listener.mutex));
+        if (__include_node(flags, counter->name, public_keys_global)) {
+            _format_counter(counter, buf, sizeof(buf));
+            xml2json_render_legacystats_value(renderer, 1, counter->name, buf);
+        }
+    }
 
-    _register_listener (&listener);
+    if (modules) {
+        json_renderer_write_key(renderer, "modules", JSON_RENDERER_FLAGS_NONE);
+        xml2json_render_node(renderer, NULL, modules, XMLNS_LEGACY_STATS);
+        xmlFreeNode(modules);
+    }
 
-    while (1) {
-        thread_mutex_lock(&_stats_mutex);
-        if (!_stats_running) {
-            thread_mutex_unlock(&_stats_mutex);
-            break;
+    if (authentication) {
+        _json_add_authentication(renderer, authentication);
+        xmlFreeNode(authentication);
+    }
+
+    /* now per mount stats */
+    for (avlnode = avl_get_first(_stats.source_tree); avlnode; avlnode = avl_get_next(avlnode)) {
+        stats_source_t *source = (stats_source_t *)avlnode->key;
+        source_t *source_real;
+        mount_proxy *mountproxy;
+        stats_counter_t *counter;
+        avl_node *avlnode2;
+        int i;
+
+        if (source->hidden > hidden || (show_mount && strcmp(show_mount, source->source) != 0))
+            continue;
+
+        if (!has_sources) {
+            json_renderer_write_key(renderer, "source", JSON_RENDERER_FLAGS_NONE);
+            json_renderer_begin(renderer, JSON_ELEMENT_TYPE_OBJECT);
+            has_sources = 1;
         }
-        thread_mutex_unlock(&_stats_mutex);
 
-        thread_mutex_lock (&listener.mutex);
-        event = _get_event_from_queue (&listener.queue);
-        thread_mutex_unlock (&listener.mutex);
-        if (event != NULL) {
-            if (_send_event_to_client(event, client) < 0) {
-                _free_event(event);
-                break;
+        json_renderer_write_key(renderer, source->source, JSON_RENDERER_FLAGS_NONE);
+        json_renderer_begin(renderer, JSON_ELEMENT_TYPE_OBJECT);
+
+        for (avlnode2 = avl_get_first(source->stats_tree); avlnode2; avlnode2 = avl_get_next(avlnode2)) {
+            stats_node_t *stat = avlnode2->key;
+
+            if (!__include_node(flags, stat->name, public_keys_source))
+                continue;
+
+            if (client && strcmp(stat->name, "listenurl") == 0) {
+                char url[512];
+                client_get_baseurl(client, NULL, url, sizeof(url), NULL, NULL, NULL, source->source, NULL);
+                xml2json_render_legacystats_value(renderer, 0, stat->name, url);
+            } else {
+                xml2json_render_legacystats_value(renderer, 0, stat->name, stat->value);
             }
-            _free_event(event);
-            continue;
         }
-        thread_sleep (500000);
-    }
 
-    thread_mutex_lock(&_stats_mutex);
-    _unregister_listener (&listener);
-    _stats_threads--;
-    stats_event_args (NULL, "stats", "%d", _stats_threads);
-    thread_mutex_unlock(&_stats_mutex);
+        thread_mutex_lock(&_counters_mutex);
+        for (counter = _find_counters(source->source); counter; counter = counter->mount_next) {
+            if (!__include_node(flags, counter->name, public_keys_source))
+                continue;
+            _format_counter(counter, buf, sizeof(buf));
+            xml2json_render_legacystats_value(renderer, 0, counter->name, buf);
+        }
+        thread_mutex_unlock(&_counters_mutex);
 
-    thread_mutex_destroy (&listener.mutex);
-    client_destroy (client);
-    ICECAST_LOG_INFO("stats client finished");
+        avl_tree_rlock(global.source_tree);
+        source_real = source_find_mount_raw(source->source);
+        if (source_real) {
+            xmlNodePtr history;
 
-    return NULL;
-}
+            if (source_real->running)
+                xml2json_render_legacystats_value(renderer, 0, "content-type", source_real->format->contenttype);
 
+            history = playlist_render_xspf(source_real->history);
+            if (history) {
+                json_renderer_write_key(renderer, "playlist", JSON_RENDERER_FLAGS_NONE);
+                xml2json_render_node(renderer, NULL, history, XMLNS_LEGACY_STATS);
+                xmlFreeNode(history);
+            }
 
-void stats_callback (client_t *client, void *notused)
-{
-    (void)notused;
+            json_renderer_write_key(renderer, "metadata", JSON_RENDERER_FLAGS_NONE);
+            json_renderer_begin(renderer, JSON_ELEMENT_TYPE_OBJECT);
+            if (source_real->format) {
+                for (i = 0; i < source_real->format->vc.comments; i++)
+                    _json_add_metadata(renderer, source_real->format->vc.user_comments[i]);
+            }
+            json_renderer_end(renderer);
 
-    if (client->con->error)
-    {
-        client_destroy (client);
-        return;
-    }
-    client_set_queue (client, NULL);
-    thread_create("Stats Connection", stats_connection, (void *)client, THREAD_DETACHED);
-}
+            if (flags & STATS_XML_FLAG_SHOW_LISTENERS) {
+                xmlNodePtr listeners = xmlNewNode(NULL, XMLSTR("source"));
 
+                admin_add_listeners_to_mount(source_real, listeners, client->mode);
+                if (listeners->xmlChildrenNode) {
+                    xmlNodePtr listener;
 
-typedef struct _source_xml_tag {
-    char *mount;
-    xmlNodePtr node;
+                    json_renderer_write_key(renderer, "listener", JSON_RENDERER_FLAGS_NONE);
+                    json_renderer_begin(renderer, JSON_ELEMENT_TYPE_ARRAY);
+                    for (listener = listeners->xmlChildrenNode; listener; listener = listener->next)
+                        xml2json_render_node(renderer, NULL, listener, XMLNS_LEGACY_STATS);
+                    json_renderer_end(renderer);
+                }
+                xmlFreeNode(listeners);
+            }
+        }
+        avl_tree_unlock(global.source_tree);
 
-    struct _source_xml_tag *next;
-} source_xml_t;
+        if (!(flags & STATS_XML_FLAG_PUBLIC_VIEW)) {
+            xmlNodePtr mount_authentication = NULL;
 
+            config = config_get_config();
+            mountproxy = config_find_mount(config, source->source, MOUNT_TYPE_NORMAL);
+            if (mountproxy) {
+                mount_authentication = xmlNewNode(NULL, XMLSTR("source"));
+                stats_add_authstack(mountproxy->authstack, mount_authentication);
+            }
+            config_release_config();
 
-void stats_transform_xslt(client_t *client)
-{
-    xmlDocPtr doc;
-    char *xslpath = util_get_path_from_normalised_uri(client->uri);
-    const char *mount = httpp_get_param(client->parser, "mount");
+            if (mount_authentication) {
+                _json_add_authentication(renderer, mount_authentication);
+                xmlFreeNode(mount_authentication);
+            }
+        }
 
-    doc = stats_get_xml(STATS_XML_FLAG_NONE, mount, client);
+        json_renderer_end(renderer);
+    }
 
-    xslt_transform(doc, xslpath, client, 200, NULL, NULL);
+    if (has_sources)
+        json_renderer_end(renderer);
+    thread_mutex_unlock(&_stats_mutex);
 
-    xmlFreeDoc(doc);
-    free(xslpath);
+    json_renderer_end(renderer);
+    json_renderer_end(renderer);
 }
 
-static void __add_metadata(xmlNodePtr node, const char *tag) {
-    const char *value = strstr(tag, "=");
-    char *name = NULL;
-    size_t namelen = value - tag + 1;
-    size_t i;
-
-    if (!value)
-        return;
+/* renders an event for the backlog of subscriber, NULL if it does not get
+ * it. You must have the _stats_mutex locked. */
+static refbuf_t *_stream_render_for(stats_subscriber_t *subscriber, const char *source, const char *name, const char *value)
+{
+    if (!subscriber->sse)
+        return _stream_render(source, name, value);
 
-    name = malloc(namelen);
-    if (!name)
-        return;
+    if (subscriber->mount && (!source || strcmp(subscriber->mount, source) != 0))
+        return NULL;
+    if (subscriber->public && !_stream_is_public(source, name))
+        return NULL;
 
-    for (i = 0; i < (namelen - 1); i++)
-        name[i] = tolower(tag[i]);
+    return _stream_render_sse(source, name, value);
+}
 
-    name[namelen-1] = 0;
+/* whether subscriber gets the event of entry. You must have the
+ * _stream_mutex locked. */
+static int _stream_wants(stats_subscriber_t *subscriber, stats_stream_entry_t *entry)
+{
+    if (!subscriber->sse)
+        return 1;
 
-    xmlNewTextChild(node, NULL, XMLSTR(name), XMLSTR(value+1));
+    if (!entry->sse)
+        return 0;
+    if (subscriber->mount && (!entry->mount || strcmp(subscriber->mount, entry->mount) != 0))
+        return 0;
+    if (subscriber->public && !entry->public)
+        return 0;
 
-    free(name);
+    return 1;
 }
 
-xmlDocPtr stats_get_xml(unsigned int flags, const char *show_mount, client_t *client)
+/* renders all current stats for a new stats client and adds it to the
+ * stream, both under the _stats_mutex so no event is missed or doubled
+ */
+static int _stream_subscribe(stats_subscriber_t *subscriber)
 {
-    xmlDocPtr doc;
-    xmlNodePtr node;
-    xmlNodePtr modules;
+    avl_node *node;
+    avl_node *node2;
+    stats_source_t *source;
+    stats_counter_t *counter;
+    refbuf_t **tail = &subscriber->backlog;
+    unsigned int clients;
+    char buf[32];
+    size_t i;
 
-    doc = xmlNewDoc (XMLSTR("1.0"));
-    node = xmlNewDocNode (doc, NULL, XMLSTR("icestats"), NULL);
-    xmlDocSetRootElement(doc, node);
+    thread_mutex_lock(&_stats_mutex);
 
-    modules = module_container_get_modulelist_as_xml(global.modulecontainer);
-    xmlAddChild(node, modules);
+    /* start with the global stats */
+    for (node = avl_get_first(_stats.global_tree); node; node = avl_get_next(node)) {
+        stats_node_t *stats = node->key;
 
-    node = _dump_stats_to_doc(node, flags, show_mount, client);
+        if ((*tail = _stream_render_for(subscriber, NULL, stats->name, stats->value)))
+            tail = &((*tail)->next);
+    }
 
-    return doc;
-}
+    for (i = 0; i < STATS_GLOBAL_MAX; i++) {
+        _format_counter(&(stats_global_counters[i]), buf, sizeof(buf));
+        if ((*tail = _stream_render_for(subscriber, NULL, stats_global_counters[i].name, buf)))
+            tail = &((*tail)->next);
+    }
 
+    /* now the stats for each source */
+    for (node = avl_get_first(_stats.source_tree); node; node = avl_get_next(node)) {
+        source = (stats_source_t *)node->key;
+        for (node2 = avl_get_first(source->stats_tree); node2; node2 = avl_get_next(node2)) {
+            stats_node_t *stats = node2->key;
 
-static int _compare_stats(void *arg, void *a, void *b)
-{
-    stats_node_t *nodea = (stats_node_t *)a;
-    stats_node_t *nodeb = (stats_node_t *)b;
+            if ((*tail = _stream_render_for(subscriber, source->source, stats->name, stats->value)))
+                tail = &((*tail)->next);
+        }
+    }
 
-    (void)arg;
+    thread_mutex_lock(&_counters_mutex);
+    for (counter = _counters; counter; counter = counter->next) {
+        if (!_find_source(&_stats.source_index, counter->mount))
+            continue;
+        _format_counter(counter, buf, sizeof(buf));
+        if ((*tail = _stream_render_for(subscriber, counter->mount, counter->name, buf)))
+            tail = &((*tail)->next);
+    }
+    thread_mutex_unlock(&_counters_mutex);
 
-    return strcmp(nodea->name, nodeb->name);
-}
+    /* now we register to receive future events */
+    waitlock_lock(&_stream_mutex);
+    if (!_stream_running) {
+        waitlock_unlock(&_stream_mutex);
+        thread_mutex_unlock(&_stats_mutex);
+        return -1;
+    }
+    subscriber->cursor = _stream_head;
+    subscriber->next = _stream_new;
+    _stream_new = subscriber;
+    waitcond_signal(&_stream_cond);
+    waitlock_unlock(&_stream_mutex);
 
-static int _compare_source_stats(void *arg, void *a, void *b)
-{
-    stats_source_t *nodea = (stats_source_t *)a;
-    stats_source_t *nodeb = (stats_source_t *)b;
+    if (subscriber->sse)
+        atomic_uint_add(&_stream_sse_clients, 1);
+    clients = atomic_uint_add(&_stream_clients, 1);
+    stats_event_args (NULL, "stats", "%u", clients);
 
-    (void)arg;
+    thread_mutex_unlock(&_stats_mutex);
 
-    return strcmp(nodea->source, nodeb->source);
+    return 0;
 }
 
-static int _free_stats(void *key)
+static void _stream_free(stats_subscriber_t *subscriber)
 {
-    stats_node_t *node = (stats_node_t *)key;
-    free(node->value);
-    free(node->name);
-    free(node);
+    while (subscriber->backlog) {
+        refbuf_t *refbuf = subscriber->backlog;
 
-    return 1;
+        subscriber->backlog = refbuf->next;
+        refbuf->next = NULL;
+        refbuf_release(refbuf);
+    }
+    client_destroy(subscriber->client);
+    free(subscriber->mount);
+    free(subscriber);
 }
 
-static int _free_source_stats(void *key)
+static void _stream_drop(stats_subscriber_t *subscriber)
 {
-    stats_source_t *node = (stats_source_t *)key;
-    avl_tree_free(node->stats_tree, _free_stats);
-    free(node->source);
-    free(node);
+    unsigned int clients;
+    int sse = subscriber->sse;
 
-    return 1;
+    _stream_free(subscriber);
+
+    thread_mutex_lock(&_stats_mutex);
+    if (sse)
+        atomic_uint_sub(&_stream_sse_clients, 1);
+    clients = atomic_uint_sub(&_stream_clients, 1);
+    stats_event_args (NULL, "stats", "%u", clients);
+    thread_mutex_unlock(&_stats_mutex);
+
+    ICECAST_LOG_INFO("stats client finished");
 }
 
-static void _free_event(stats_event_t *event)
+/* sends the current line of refbuf to the client. Returns 0 if it was sent
+ * completely, 1 if the client can not take more right now and -1 on error. */
+static int _stream_send_line(stats_subscriber_t *subscriber, refbuf_t *refbuf)
 {
-    if (event->source) free(event->source);
-    if (event->name) free(event->name);
-    if (event->value) free(event->value);
-    free(event);
-}
+    int ret = client_send_bytes(subscriber->client, refbuf->data + subscriber->offset, refbuf->len - subscriber->offset);
 
+    if (ret < 0)
+        return subscriber->client->con->error ? -1 : 1;
 
-refbuf_t *stats_get_streams (void)
+    subscriber->offset += ret;
+    if (subscriber->offset < refbuf->len)
+        return 1;
+
+    subscriber->offset = 0;
+    return 0;
+}
+
+/* sends as much as the client takes, the return value is as for
+ * _stream_send_line() */
+static int _stream_send(stats_subscriber_t *subscriber)
 {
-#define STREAMLIST_BLKSIZE  4096
-    avl_node *node;
-    unsigned int remaining = STREAMLIST_BLKSIZE;
-    refbuf_t *start = refbuf_new (remaining), *cur = start;
-    char *buffer = cur->data;
+    int ret;
 
-    /* now the stats for each source */
-    thread_mutex_lock (&_stats_mutex);
-    node = avl_get_first(_stats.source_tree);
-    while (node)
-    {
-        int ret;
-        stats_source_t *source = (stats_source_t *)node->key;
+    while (subscriber->backlog) {
+        refbuf_t *refbuf = subscriber->backlog;
 
-        if (source->hidden == 0)
-        {
-            if (remaining <= strlen (source->source) + 3)
-            {
-                cur->len = STREAMLIST_BLKSIZE - remaining;
-                cur->next = refbuf_new (STREAMLIST_BLKSIZE);
-                remaining = STREAMLIST_BLKSIZE;
-                cur = cur->next;
-                buffer = cur->data;
+        if ((ret = _stream_send_line(subscriber, refbuf)) != 0)
+            return ret;
+
+        subscriber->backlog = refbuf->next;
+        refbuf->next = NULL;
+        refbuf_release(refbuf);
+    }
+
+    while (1) {
+        stats_stream_entry_t *entry;
+        refbuf_t *refbuf;
+
+        waitlock_lock(&_stream_mutex);
+        if (subscriber->cursor == _stream_head) {
+            waitlock_unlock(&_stream_mutex);
+            return 0;
+        }
+        if ((_stream_head - subscriber->cursor) > STATS_STREAM_RING_LEN) {
+            waitlock_unlock(&_stream_mutex);
+            ICECAST_LOG_WARN("Stats client can not keep up with the events, dropping it");
+            return -1;
+        }
+        entry = &(_stream_ring[subscriber->cursor % STATS_STREAM_RING_LEN]);
+        if (!_stream_wants(subscriber, entry)) {
+            waitlock_unlock(&_stream_mutex);
+            subscriber->cursor++;
+            continue;
+        }
+        refbuf = subscriber->sse ? entry->sse : entry->line;
+        refbuf_addref(refbuf);
+        waitlock_unlock(&_stream_mutex);
+
+        ret = _stream_send_line(subscriber, refbuf);
+        refbuf_release(refbuf);
+        if (ret != 0)
+            return ret;
+
+        subscriber->cursor++;
+    }
+}
+
+/* feeds all stats clients. It sleeps until a new event is added and only
+ * waits on the sockets of the clients that could not take everything. */
+static void *_stream_thread(void *arg)
+{
+    stats_subscriber_t *subscribers = NULL;
+    fdpoll_t *poll = fdpoll_new();
+    fdpoll_result_t results[STATS_STREAM_MAX_EVENTS];
+
+    (void)arg;
+
+    affinity_apply(CPU_AFFINITY_STATS);
+
+    waitlock_lock(&_stream_mutex);
+    while (_stream_running) {
+        stats_subscriber_t **prev;
+        uint64_t head;
+        size_t blocked = 0;
+
+        while (_stream_new) {
+            stats_subscriber_t *subscriber = _stream_new;
+
+            _stream_new = subscriber->next;
+            subscriber->next = subscribers;
+            subscribers = subscriber;
+        }
+        head = _stream_head;
+        waitlock_unlock(&_stream_mutex);
+
+        prev = &subscribers;
+        while (*prev) {
+            stats_subscriber_t *subscriber = *prev;
+            int ret = _stream_send(subscriber);
+
+            if (ret > 0 && !subscriber->armed && poll) {
+                if (fdpoll_arm(poll, subscriber->client->con->sock, FDPOLL_EVENT_WRITE, subscriber) == 0)
+                    subscriber->armed = 1;
+            } else if (ret <= 0 && subscriber->armed) {
+                fdpoll_disarm(poll, subscriber->client->con->sock);
+                subscriber->armed = 0;
+            }
+
+            if (ret < 0) {
+                *prev = subscriber->next;
+                _stream_drop(subscriber);
+                continue;
             }
-            ret = snprintf (buffer, remaining, "%s\r\n", source->source);
+
             if (ret > 0)
-            {
-                buffer += ret;
-                remaining -= ret;
+                blocked++;
+            prev = &(subscriber->next);
+        }
+
+        if (blocked && poll) {
+            fdpoll_wait(poll, STATS_STREAM_POLL_MS, results, STATS_STREAM_MAX_EVENTS);
+            waitlock_lock(&_stream_mutex);
+            continue;
+        }
+
+        waitlock_lock(&_stream_mutex);
+        if (!_stream_running || _stream_new || _stream_head != head)
+            continue;
+
+        if (blocked) {
+            struct timespec deadline;
+
+            /* no poll backend, try again a little later */
+            waitcond_deadline(&deadline, STATS_STREAM_POLL_MS);
+            waitcond_wait_until(&_stream_cond, &_stream_mutex, &deadline);
+        } else {
+            waitcond_wait(&_stream_cond, &_stream_mutex);
+        }
+    }
+
+    /* _stream_subscribe() does not add any after _stream_running is cleared */
+    while (_stream_new) {
+        stats_subscriber_t *subscriber = _stream_new;
+
+        _stream_new = subscriber->next;
+        subscriber->next = subscribers;
+        subscribers = subscriber;
+    }
+    waitlock_unlock(&_stream_mutex);
+
+    while (subscribers) {
+        stats_subscriber_t *subscriber = subscribers;
+
+        subscribers = subscriber->next;
+        if (subscriber->armed)
+            fdpoll_disarm(poll, subscriber->client->con->sock);
+        _stream_drop(subscriber);
+    }
+
+    if (poll)
+        fdpoll_free(poll);
+
+    return NULL;
+}
+
+
+/* hands a client asking for the STATS stream over to the stream thread */
+void stats_callback (client_t *client, void *notused)
+{
+    stats_subscriber_t *subscriber;
+
+    (void)notused;
+
+    if (client->con->error)
+    {
+        client_destroy (client);
+        return;
+    }
+    client_set_queue (client, NULL);
+
+    subscriber = calloc(1, sizeof(*subscriber));
+    if (!subscriber) {
+        client_destroy (client);
+        return;
+    }
+    subscriber->client = client;
+
+    ICECAST_LOG_INFO("stats client starting");
+    if (_stream_subscribe(subscriber) != 0)
+        _stream_free(subscriber);
+}
+
+/* subscribes the client to the stats as server-sent events once the
+ * response headers are sent, see stats_send_events() */
+static void _stats_events_callback(client_t *client, void *arg)
+{
+    stats_subscriber_t *subscriber = arg;
+
+    if (client->con->error) {
+        free(subscriber->mount);
+        free(subscriber);
+        client_destroy(client);
+        return;
+    }
+    client_set_queue(client, NULL);
+
+    subscriber->client = client;
+
+    ICECAST_LOG_INFO("stats events client starting");
+    if (_stream_subscribe(subscriber) != 0)
+        _stream_free(subscriber);
+}
+
+void stats_send_events(client_t *client, const char *mount, int public_view)
+{
+    stats_subscriber_t *subscriber;
+    ssize_t ret;
+
+    subscriber = calloc(1, sizeof(*subscriber));
+    if (!subscriber) {
+        client_send_error_by_id(client, ICECAST_ERROR_GEN_MEMORY_EXHAUSTED);
+        return;
+    }
+    subscriber->sse = 1;
+    subscriber->public = public_view;
+    if (mount && *mount) {
+        subscriber->mount = strdup(mount);
+        if (!subscriber->mount) {
+            free(subscriber);
+            client_send_error_by_id(client, ICECAST_ERROR_GEN_MEMORY_EXHAUSTED);
+            return;
+        }
+    }
+
+    ret = util_http_build_header(client->refbuf->data, PER_CLIENT_REFBUF_SIZE, 0,
+                                 0, 200, NULL,
+                                 "text/event-stream", "utf-8",
+                                 "", NULL, client);
+    if (ret == -1 || ret >= PER_CLIENT_REFBUF_SIZE) {
+        ICECAST_LOG_ERROR("Dropping client as we can not build response headers.");
+        free(subscriber->mount);
+        free(subscriber);
+        client_send_error_by_id(client, ICECAST_ERROR_GEN_HEADER_GEN_FAILED);
+        return;
+    }
+
+    stats_global_inc(STATS_GLOBAL_STATS_CONNECTIONS);
+
+    client->respcode = 200;
+    client->refbuf->len = strlen(client->refbuf->data);
+    fserve_add_client_callback(client, _stats_events_callback, subscriber);
+}
+
+
+typedef struct _source_xml_tag {
+    char *mount;
+    xmlNodePtr node;
+
+    struct _source_xml_tag *next;
+} source_xml_t;
+
+
+void stats_transform_xslt(client_t *client)
+{
+    xmlDocPtr doc;
+    char *xslpath = util_get_path_from_normalised_uri(client->uri);
+    const char *mount = httpp_get_param(client->parser, "mount");
+    uint64_t generation = atomic_u64_load(&_stats_generation);
+    int cacheable = 0;
+    char baseurl[512];
+    char key[1024];
+
+    /* the page depends on the mount asked for and the address the client
+     * connected to, as for the snapshots */
+    if (xslpath && client_get_baseurl(client, NULL, baseurl, sizeof(baseurl), NULL, NULL, NULL, NULL, NULL) >= 0) {
+        int ret = snprintf(key, sizeof(key), "%s\n%s", baseurl, mount ? mount : "");
+        cacheable = ret >= 0 && (size_t)ret < sizeof(key);
+    }
+
+    if (cacheable && xslt_send_cached(xslpath, key, generation, client) == 0) {
+        free(xslpath);
+        return;
+    }
+
+    doc = stats_get_xml(STATS_XML_FLAG_NONE, mount, client);
+
+    if (cacheable) {
+        xslt_transform_cached(doc, xslpath, key, generation, client);
+    } else {
+        xslt_transform(doc, xslpath, client, 200, NULL, NULL);
+    }
+
+    xmlFreeDoc(doc);
+    free(xslpath);
+}
+
+static void __add_metadata(xmlNodePtr node, const char *tag) {
+    const char *value = strstr(tag, "=");
+    char *name = NULL;
+    size_t namelen = value - tag + 1;
+    size_t i;
+
+    if (!value)
+        return;
+
+    name = malloc(namelen);
+    if (!name)
+        return;
+
+    for (i = 0; i < (namelen - 1); i++)
+        name[i] = tolower(tag[i]);
+
+    name[namelen-1] = 0;
+
+    xmlNewTextChild(node, NULL, XMLSTR(name), XMLSTR(value+1));
+
+    free(name);
+}
+
+static xmlDocPtr _build_xml(unsigned int flags, const char *show_mount, client_t *client)
+{
+    xmlDocPtr doc;
+    xmlNodePtr node;
+    xmlNodePtr modules;
+
+    doc = xmlNewDoc (XMLSTR("1.0"));
+    node = xmlNewDocNode (doc, NULL, XMLSTR("icestats"), NULL);
+    xmlDocSetRootElement(doc, node);
+
+    modules = module_container_get_modulelist_as_xml(global.modulecontainer);
+    xmlAddChild(node, modules);
+
+    node = _dump_stats_to_doc(node, flags, show_mount, client);
+
+    return doc;
+}
+
+static char *_render_xml(xmlDocPtr doc, size_t *len)
+{
+    xmlChar *buff = NULL;
+    int buff_len = 0;
+    char *ret = NULL;
+
+    xmlDocDumpMemory(doc, &buff, &buff_len);
+    if (buff) {
+        ret = malloc(buff_len + 1);
+        if (ret) {
+            memcpy(ret, buff, buff_len);
+            ret[buff_len] = 0;
+            *len = buff_len;
+        }
+        xmlFree(buff);
+    }
+
+    return ret;
+}
+
+static char *_build_json(unsigned int flags, const char *show_mount, client_t *client, size_t *len)
+{
+    json_renderer_t *renderer = json_renderer_create(JSON_RENDERER_FLAGS_NONE);
+    char *ret;
+
+    if (!renderer)
+        return NULL;
+
+    _dump_stats_to_json(renderer, flags, show_mount, client);
+
+    ret = json_renderer_finish(&renderer);
+    if (ret)
+        *len = strlen(ret);
+
+    return ret;
+}
+
+static void _free_snapshot(stats_snapshot_t *snapshot)
+{
+    xmlFreeDoc(snapshot->doc);
+    free(snapshot->xml);
+    free(snapshot->json);
+    free(snapshot->mount);
+    free(snapshot->baseurl);
+    free(snapshot);
+}
+
+/* returns the snapshot for the request, it is built if there is none yet.
+ * Outdated snapshots are dropped on the way. Returns NULL if the request
+ * can not be cached. Concurrent requests for the same stats wait for the
+ * first one to build the snapshot.
+ * You must hold _snapshots_mutex.
+ */
+static stats_snapshot_t *_get_snapshot(unsigned int flags, const char *show_mount, client_t *client)
+{
+    uint64_t generation = atomic_u64_load(&_stats_generation);
+    uint64_t now = timing_get_time();
+    stats_snapshot_t **prev = &_snapshots;
+    stats_snapshot_t *snapshot;
+    size_t count = 0;
+    char baseurl[512];
+
+    /* the listeners are not covered by the generation */
+    if ((flags & STATS_XML_FLAG_SHOW_LISTENERS) && !(flags & STATS_XML_FLAG_PUBLIC_VIEW))
+        return NULL;
+
+    /* listenurl is rendered for the address the client connected to */
+    baseurl[0] = 0;
+    if (client && client_get_baseurl(client, NULL, baseurl, sizeof(baseurl), NULL, NULL, NULL, NULL, NULL) < 0)
+        return NULL;
+
+    while (*prev) {
+        snapshot = *prev;
+
+        if (snapshot->generation != generation || (now - snapshot->created) >= STATS_SNAPSHOT_MAX_AGE || count >= STATS_SNAPSHOT_MAX) {
+            *prev = snapshot->next;
+            _free_snapshot(snapshot);
+            continue;
+        }
+
+        if (snapshot->flags == flags && strcmp(snapshot->baseurl, baseurl) == 0 &&
+                ((!snapshot->mount && !show_mount) || (snapshot->mount && show_mount && strcmp(snapshot->mount, show_mount) == 0)))
+            return snapshot;
+
+        count++;
+        prev = &(snapshot->next);
+    }
+
+    snapshot = calloc(1, sizeof(*snapshot));
+    if (!snapshot)
+        return NULL;
+
+    snapshot->flags = flags;
+    snapshot->generation = generation;
+    snapshot->created = now;
+    snapshot->baseurl = strdup(baseurl);
+    if (show_mount)
+        snapshot->mount = strdup(show_mount);
+
+    if (!snapshot->baseurl || (show_mount && !snapshot->mount)) {
+        _free_snapshot(snapshot);
+        return NULL;
+    }
+
+    snapshot->next = _snapshots;
+    _snapshots = snapshot;
+
+    return snapshot;
+}
+
+size_t stats_clear_snapshots(void)
+{
+    size_t ret = 0;
+
+    thread_mutex_lock(&_snapshots_mutex);
+    while (_snapshots) {
+        stats_snapshot_t *snapshot = _snapshots;
+        _snapshots = snapshot->next;
+        _free_snapshot(snapshot);
+        ret++;
+    }
+    thread_mutex_unlock(&_snapshots_mutex);
+
+    return ret;
+}
+
+xmlDocPtr stats_get_xml(unsigned int flags, const char *show_mount, client_t *client)
+{
+    stats_snapshot_t *snapshot;
+    xmlDocPtr doc = NULL;
+
+    thread_mutex_lock(&_snapshots_mutex);
+    snapshot = _get_snapshot(flags, show_mount, client);
+    if (snapshot) {
+        if (!snapshot->doc)
+            snapshot->doc = _build_xml(flags, show_mount, client);
+        if (snapshot->doc)
+            doc = xmlCopyDoc(snapshot->doc, 1);
+    }
+    thread_mutex_unlock(&_snapshots_mutex);
+
+    if (!doc)
+        doc = _build_xml(flags, show_mount, client);
+
+    return doc;
+}
+
+char *stats_get_rendered(unsigned int flags, const char *show_mount, client_t *client, admin_format_t format, size_t *len)
+{
+    stats_snapshot_t *snapshot;
+    char *ret = NULL;
+
+    if (format != ADMIN_FORMAT_RAW && format != ADMIN_FORMAT_JSON)
+        return NULL;
+
+    thread_mutex_lock(&_snapshots_mutex);
+    snapshot = _get_snapshot(flags, show_mount, client);
+    if (snapshot) {
+        char **rendering = format == ADMIN_FORMAT_RAW ? &(snapshot->xml) : &(snapshot->json);
+        size_t *rendering_len = format == ADMIN_FORMAT_RAW ? &(snapshot->xml_len) : &(snapshot->json_len);
+
+        if (!*rendering) {
+            if (format == ADMIN_FORMAT_JSON) {
+                *rendering = _build_json(flags, show_mount, client, rendering_len);
+            } else {
+                if (!snapshot->doc)
+                    snapshot->doc = _build_xml(flags, show_mount, client);
+                if (snapshot->doc)
+                    *rendering = _render_xml(snapshot->doc, rendering_len);
+            }
+        }
+
+        if (*rendering) {
+            ret = malloc(*rendering_len + 1);
+            if (ret) {
+                memcpy(ret, *rendering, *rendering_len + 1);
+                *len = *rendering_len;
             }
         }
-        node = avl_get_next(node);
     }
+    thread_mutex_unlock(&_snapshots_mutex);
+
+    if (!snapshot) {
+        if (format == ADMIN_FORMAT_JSON) {
+            ret = _build_json(flags, show_mount, client, len);
+        } else {
+            xmlDocPtr doc = _build_xml(flags, show_mount, client);
+
+            ret = _render_xml(doc, len);
+            xmlFreeDoc(doc);
+        }
+    }
+
+    return ret;
+}
+
+static int _compare_stats(void *arg, void *a, void *b)
+{
+    stats_node_t *nodea = (stats_node_t *)a;
+    stats_node_t *nodeb = (stats_node_t *)b;
+
+    (void)arg;
+
+    return strcmp(nodea->name, nodeb->name);
+}
+
+static int _compare_source_stats(void *arg, void *a, void *b)
+{
+    stats_source_t *nodea = (stats_source_t *)a;
+    stats_source_t *nodeb = (stats_source_t *)b;
+
+    (void)arg;
+
+    return strcmp(nodea->source, nodeb->source);
+}
+
+static int _free_stats(void *key)
+{
+    stats_node_t *node = (stats_node_t *)key;
+    free(node->value);
+    free(node->name);
+    free(node);
+
+    return 1;
+}
+
+static int _free_source_stats(void *key)
+{
+    stats_source_t *node = (stats_source_t *)key;
+    avl_tree_free(node->stats_tree, _free_stats);
+    _index_free(&node->stats_index);
+    free(node->source);
+    free(node);
+
+    return 1;
+}
+
+static void _free_event(stats_event_t *event)
+{
+    if (event->source) free(event->source);
+    if (event->name) free(event->name);
+    if (event->value) free(event->value);
+    free(event);
+}
+
+
+#define STREAMLIST_BLKSIZE  4096
+
+/* appends prefix and line as a line of its own to the blocks ending in cur,
+ * returns the block that ends them now */
+static refbuf_t *_streams_append(refbuf_t *cur, const char *prefix, const char *line)
+{
+    size_t len = strlen(prefix) + strlen(line) + 2;
+
+    if (len >= STREAMLIST_BLKSIZE)
+        return cur;
+
+    if (len > (STREAMLIST_BLKSIZE - cur->len)) {
+        refbuf_t *next = refbuf_new(STREAMLIST_BLKSIZE);
+
+        if (!next)
+            return cur;
+        next->len = 0;
+        cur->next = next;
+        cur = next;
+    }
+
+    snprintf(cur->data + cur->len, STREAMLIST_BLKSIZE - cur->len, "%s%s\r\n", prefix, line);
+    cur->len += len;
+
+    return cur;
+}
+
+/* You must have the _stats_mutex locked. */
+static refbuf_t *_streams_render_full(void)
+{
+    avl_node *node;
+    refbuf_t *start = refbuf_new (STREAMLIST_BLKSIZE), *cur = start;
+
+    start->len = 0;
+    for (node = avl_get_first(_stats.source_tree); node; node = avl_get_next(node))
+    {
+        stats_source_t *source = (stats_source_t *)node->key;
+
+        if (source->hidden == 0)
+            cur = _streams_append(cur, "", source->source);
+    }
+
+    return start;
+}
+
+/* the changes after generation since as lines of "+mount" or "-mount", in
+ * the order they happened. You must have the _stats_mutex locked. */
+static refbuf_t *_streams_render_delta(uint64_t since)
+{
+    refbuf_t *start = refbuf_new (STREAMLIST_BLKSIZE), *cur = start;
+    uint64_t generation;
+
+    start->len = 0;
+    for (generation = since + 1; generation <= _streams_generation; generation++) {
+        stats_streams_change_t *change = &(_streams_log[generation % STATS_STREAMS_LOG_LEN]);
+
+        cur = _streams_append(cur, change->added ? "+" : "-", change->mount);
+    }
+
+    return start;
+}
+
+refbuf_t *stats_get_streams (void)
+{
+    refbuf_t *start;
+
+    thread_mutex_lock (&_stats_mutex);
+    start = _streams_render_full();
     thread_mutex_unlock(&_stats_mutex);
-    cur->len = STREAMLIST_BLKSIZE - remaining;
+
     return start;
 }
 
+static void _streams_free(refbuf_t *body)
+{
+    while (body) {
+        refbuf_t *next = body->next;
+
+        body->next = NULL;
+        refbuf_release(body);
+        body = next;
+    }
+}
+
+/* sends the delta since the given generation, or the full list if it is
+ * not known (anymore) */
+static void _streams_send(client_t *client, int delta, uint64_t since)
+{
+    refbuf_t *body;
+    refbuf_t *cur;
+    size_t length = 0;
+    char etag[64];
+    ssize_t ret;
+
+    thread_mutex_lock(&_stats_mutex);
+    if (delta && (since > _streams_generation || (_streams_generation - since) > STATS_STREAMS_LOG_LEN))
+        delta = 0;
+    body = delta ? _streams_render_delta(since) : _streams_render_full();
+    snprintf(etag, sizeof(etag), "\"%llu-%llu\"", (unsigned long long)_streams_epoch, (unsigned long long)_streams_generation);
+    thread_mutex_unlock(&_stats_mutex);
+
+    /* slaves tell a list that was cut short by its length */
+    for (cur = body; cur; cur = cur->next)
+        length += cur->len;
+
+    ret = util_http_build_header(client->refbuf->data, PER_CLIENT_REFBUF_SIZE, 0,
+                                 0, 200, NULL,
+                                 "text/plain", "utf-8",
+                                 NULL, NULL, client);
+    if (ret == -1 || ret >= (PER_CLIENT_REFBUF_SIZE - 160)) {
+        ICECAST_LOG_ERROR("Dropping client as we can not build response headers.");
+        _streams_free(body);
+        client_send_error_by_id(client, ICECAST_ERROR_GEN_HEADER_GEN_FAILED);
+        return;
+    }
+
+    ret += snprintf(client->refbuf->data + ret, PER_CLIENT_REFBUF_SIZE - ret,
+                    "ETag: %s\r\nIcecast-Streamlist: %s\r\nContent-Length: %zu\r\n\r\n",
+                    etag, delta ? "delta" : "full", length);
+    client->refbuf->len = ret;
+    client->respcode = 200;
+
+    client->refbuf->next = body;
+    fserve_add_client (client, NULL);
+}
+
+/* answers the slaves waiting for a change of the stream list that got one
+ * or waited long enough, or all of them */
+static void _streams_wake(int all)
+{
+    stats_streams_waiter_t *ready = NULL;
+    stats_streams_waiter_t **prev;
+    time_t now = time(NULL);
+
+    thread_mutex_lock(&_stats_mutex);
+    prev = &_streams_waiters;
+    while (*prev) {
+        stats_streams_waiter_t *waiter = *prev;
+
+        if (all || waiter->since != _streams_generation || now >= waiter->deadline) {
+            *prev = waiter->next;
+            waiter->next = ready;
+            ready = waiter;
+            continue;
+        }
+        prev = &(waiter->next);
+    }
+    thread_mutex_unlock(&_stats_mutex);
+
+    while (ready) {
+        stats_streams_waiter_t *waiter = ready;
+
+        ready = waiter->next;
+        _streams_send(waiter->client, 1, waiter->since);
+        free(waiter);
+    }
+}
+
+void stats_send_streams (client_t *client, const char *since, int wait)
+{
+    unsigned long long epoch, generation;
+    int delta = 0;
+
+    if (since && *since == '"')
+        since++;
+
+    thread_mutex_lock(&_stats_mutex);
+    if (since && sscanf(since, "%llu-%llu", &epoch, &generation) == 2 && epoch == _streams_epoch)
+        delta = 1;
+
+    if (delta && wait > 0 && generation == _streams_generation && _stats_running) {
+        stats_streams_waiter_t *waiter = calloc(1, sizeof(*waiter));
+
+        if (waiter) {
+            waiter->client = client;
+            waiter->since = generation;
+            waiter->deadline = time(NULL) + (wait < STATS_STREAMS_WAIT_MAX ? wait : STATS_STREAMS_WAIT_MAX);
+            waiter->next = _streams_waiters;
+            _streams_waiters = waiter;
+            thread_mutex_unlock(&_stats_mutex);
+            return;
+        }
+    }
+    thread_mutex_unlock(&_stats_mutex);
+
+    _streams_send(client, delta, delta ? generation : 0);
+}
+
+/* OpenMetrics rendering for /admin/metrics, see stats_get_metrics() */
+#define METRICS_BLKSIZE     16384
+
+typedef struct {
+    refbuf_t *head;
+    refbuf_t *cur;
+    size_t used;
+} metrics_buffer_t;
+
+typedef struct {
+    char name[128];
+    /* NULL for global stats */
+    const char *mount;
+    char value[32];
+    stats_counter_type_t type;
+} metrics_sample_t;
+
+typedef struct {
+    metrics_sample_t *samples;
+    size_t len;
+    size_t size;
+} metrics_samples_t;
+
+static void _metrics_printf(metrics_buffer_t *buffer, const char *format, ...)
+{
+    va_list ap;
+    int ret;
+
+    va_start(ap, format);
+    ret = vsnprintf(buffer->cur->data + buffer->used, METRICS_BLKSIZE - buffer->used, format, ap);
+    va_end(ap);
+
+    if (ret < 0 || ret >= METRICS_BLKSIZE)
+        return;
+
+    if ((size_t)ret >= (METRICS_BLKSIZE - buffer->used)) {
+        /* does not fit anymore, continue with the next block */
+        buffer->cur->len = buffer->used;
+        buffer->cur->next = refbuf_new(METRICS_BLKSIZE);
+        buffer->cur = buffer->cur->next;
+        buffer->used = 0;
+
+        va_start(ap, format);
+        ret = vsnprintf(buffer->cur->data, METRICS_BLKSIZE, format, ap);
+        va_end(ap);
+
+        if (ret < 0)
+            return;
+    }
+
+    buffer->used += ret;
+}
+
+/* metric names only allow [a-zA-Z0-9_:] */
+static void _metrics_name(char *buf, size_t len, const char *name)
+{
+    size_t i;
+
+    for (i = 0; name[i] && i < (len - 1); i++) {
+        char c = name[i];
+
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_')
+            buf[i] = c;
+        else
+            buf[i] = '_';
+    }
+    buf[i] = 0;
+}
+
+static void _metrics_escape(char *buf, size_t len, const char *value)
+{
+    size_t i = 0;
+
+    for (; *value && i < (len - 2); value++) {
+        switch (*value) {
+            case '\\': buf[i++] = '\\'; buf[i++] = '\\'; break;
+            case '"':  buf[i++] = '\\'; buf[i++] = '"'; break;
+            case '\n': buf[i++] = '\\'; buf[i++] = 'n'; break;
+            default:   buf[i++] = *value; break;
+        }
+    }
+    buf[i] = 0;
+}
+
+static metrics_sample_t *_metrics_add_sample(metrics_samples_t *samples, const char *name, const char *mount, stats_counter_type_t type)
+{
+    metrics_sample_t *sample;
+
+    if (samples->len == samples->size) {
+        size_t size = samples->size ? samples->size * 2 : 256;
+        metrics_sample_t *n = realloc(samples->samples, size * sizeof(*n));
+
+        if (!n)
+            return NULL;
+        samples->samples = n;
+        samples->size = size;
+    }
+
+    sample = &(samples->samples[samples->len++]);
+    _metrics_name(sample->name, sizeof(sample->name), name);
+    sample->mount = mount;
+    sample->value[0] = 0;
+    sample->type = type;
+
+    return sample;
+}
+
+/* nodes of the trees are exported if their value is a number, as gauges */
+static void _metrics_add_node(metrics_samples_t *samples, stats_node_t *node, const char *mount)
+{
+    metrics_sample_t *sample;
+    char *end;
+
+    if (!node->value || !*node->value || strlen(node->value) >= sizeof(sample->value))
+        return;
+
+    (void)strtod(node->value, &end);
+    if (*end)
+        return;
+
+    sample = _metrics_add_sample(samples, node->name, mount, STATS_COUNTER_GAUGE);
+    if (sample)
+        strcpy(sample->value, node->value);
+}
+
+static int _metrics_compare(const void *a, const void *b)
+{
+    const metrics_sample_t *sa = a;
+    const metrics_sample_t *sb = b;
+    int ret;
+
+    /* global stats first */
+    if (!sa->mount != !sb->mount)
+        return sa->mount ? 1 : -1;
+
+    ret = strcmp(sa->name, sb->name);
+    if (ret || !sa->mount)
+        return ret;
+
+    return strcmp(sa->mount, sb->mount);
+}
+
+static void _metrics_add_listensockets(metrics_buffer_t *buffer)
+{
+    listensocket_t **sockets;
+    size_t i;
+    int rejected;
+
+    global_lock();
+    sockets = listensocket_container_list_sockets(global.listensockets);
+    global_unlock();
+
+    if (!sockets)
+        return;
+
+    for (rejected = 0; rejected < 2; rejected++) {
+        const char *name = rejected ? "icecast_listen_socket_rejected_connections" : "icecast_listen_socket_connections";
+
+        _metrics_printf(buffer, "# TYPE %s counter\n", name);
+        for (i = 0; sockets[i]; i++) {
+            const listener_t *listener = listensocket_get_listener(sockets[i]);
+            char id[256];
+            char bind_address[256];
+
+            if (!listener)
+                continue;
+
+            _metrics_escape(id, sizeof(id), listener->id ? listener->id : "");
+            _metrics_escape(bind_address, sizeof(bind_address), listener->bind_address ? listener->bind_address : "");
+            _metrics_printf(buffer, "%s_total{socket=\"%s\",bind_address=\"%s\",port=\"%d\"} %" PRIu64 "\n",
+                    name, id, bind_address, listener->port,
+                    rejected ? listensocket_get_rejected(sockets[i]) : listensocket_get_accepted(sockets[i]));
+            listensocket_release_listener(sockets[i]);
+        }
+    }
+
+    for (i = 0; sockets[i]; i++)
+        refobject_unref(sockets[i]);
+    free(sockets);
+}
+
+/* the latency histograms in seconds, with a bucket per power of two µs
+ * up to the largest value */
+static void _metrics_add_histograms(metrics_buffer_t *buffer)
+{
+    histogram_snapshot_t snapshot;
+    size_t i, j;
+
+    if (!histogram_enabled())
+        return;
+
+    for (i = 0; i < HISTOGRAM_MAX; i++) {
+        const char *name = histogram_get_name(i);
+        uint64_t seen = 0;
+        uint64_t end;
+
+        histogram_get(i, &snapshot);
+
+        _metrics_printf(buffer, "# TYPE icecast_latency_%s_seconds histogram\n", name);
+        for (j = 0; j < HISTOGRAM_BUCKETS && snapshot.count; j++) {
+            seen += snapshot.buckets[j];
+            if ((j % HISTOGRAM_SUB) != (HISTOGRAM_SUB - 1) || j == (HISTOGRAM_BUCKETS - 1))
+                continue;
+
+            end = histogram_bucket_end(j);
+            _metrics_printf(buffer, "icecast_latency_%s_seconds_bucket{le=\"%" PRIu64 ".%06" PRIu64 "\"} %" PRIu64 "\n",
+                    name, end / 1000000, end % 1000000, seen);
+            if (seen == snapshot.count)
+                break;
+        }
+        _metrics_printf(buffer, "icecast_latency_%s_seconds_bucket{le=\"+Inf\"} %" PRIu64 "\n", name, snapshot.count);
+        _metrics_printf(buffer, "icecast_latency_%s_seconds_count %" PRIu64 "\n", name, snapshot.count);
+        _metrics_printf(buffer, "icecast_latency_%s_seconds_sum %" PRIu64 ".%06" PRIu64 "\n",
+                name, snapshot.sum / 1000000, snapshot.sum % 1000000);
+    }
+}
+
+refbuf_t *stats_get_metrics(void)
+{
+    metrics_buffer_t buffer;
+    metrics_samples_t samples = {NULL, 0, 0};
+    stats_counter_t *counter;
+    avl_node *node;
+    size_t i;
+
+    buffer.head = buffer.cur = refbuf_new(METRICS_BLKSIZE);
+    buffer.used = 0;
+
+    _metrics_add_listensockets(&buffer);
+    _metrics_add_histograms(&buffer);
+
+    thread_mutex_lock(&_stats_mutex);
+    for (node = avl_get_first(_stats.global_tree); node; node = avl_get_next(node))
+        _metrics_add_node(&samples, node->key, NULL);
+
+    for (i = 0; i < STATS_GLOBAL_MAX; i++) {
+        metrics_sample_t *sample = _metrics_add_sample(&samples, stats_global_counters[i].name, NULL, stats_global_counters[i].type);
+        if (sample)
+            _format_counter(&(stats_global_counters[i]), sample->value, sizeof(sample->value));
+    }
+
+    for (node = avl_get_first(_stats.source_tree); node; node = avl_get_next(node)) {
+        stats_source_t *source = node->key;
+        avl_node *node2;
+
+        for (node2 = avl_get_first(source->stats_tree); node2; node2 = avl_get_next(node2))
+            _metrics_add_node(&samples, node2->key, source->source);
+    }
+
+    /* only mounts that have stats, as for the XML */
+    thread_mutex_lock(&_counters_mutex);
+    for (counter = _counters; counter; counter = counter->next) {
+        metrics_sample_t *sample;
+        stats_source_t *source = _find_source(&_stats.source_index, counter->mount);
+
+        if (!source)
+            continue;
+
+        /* the mount is taken from the stats so it stays valid after we unlock */
+        sample = _metrics_add_sample(&samples, counter->name, source->source, counter->type);
+        if (sample)
+            _format_counter(counter, sample->value, sizeof(sample->value));
+    }
+    thread_mutex_unlock(&_counters_mutex);
+
+    /* the samples of a metric must be next to each other */
+    qsort(samples.samples, samples.len, sizeof(*samples.samples), _metrics_compare);
+
+    for (i = 0; i < samples.len; i++) {
+        metrics_sample_t *sample = &(samples.samples[i]);
+        const char *prefix = sample->mount ? "icecast_mount_" : "icecast_";
+        const char *suffix = sample->type == STATS_COUNTER_COUNTER ? "_total" : "";
+        int new_metric = 1;
+
+        if (i > 0) {
+            metrics_sample_t *prev = &(samples.samples[i - 1]);
+
+            /* a node and a counter of the same name */
+            if (_metrics_compare(sample, prev) == 0)
+                continue;
+
+            new_metric = !sample->mount != !prev->mount || strcmp(sample->name, prev->name) != 0;
+        }
+
+        if (new_metric)
+            _metrics_printf(&buffer, "# TYPE %s%s %s\n", prefix, sample->name, sample->type == STATS_COUNTER_COUNTER ? "counter" : "gauge");
+
+        if (sample->mount) {
+            char mount[512];
+
+            _metrics_escape(mount, sizeof(mount), sample->mount);
+            _metrics_printf(&buffer, "%s%s%s{mount=\"%s\"} %s\n", prefix, sample->name, suffix, mount, sample->value);
+        } else {
+            _metrics_printf(&buffer, "%s%s%s %s\n", prefix, sample->name, suffix, sample->value);
+        }
+    }
+    thread_mutex_unlock(&_stats_mutex);
+
+    free(samples.samples);
+
+    _metrics_printf(&buffer, "# EOF\n");
+    buffer.cur->len = buffer.used;
+
+    return buffer.head;
+}
+
 
 
 /* This removes any source stats from virtual mountpoints, ie mountpoints
@@ -1244,6 +3064,7 @@ void stats_clear_virtual_mounts (void)
             /* no source_t is reserved so remove them now */
             snode = avl_get_next (snode);
             ICECAST_LOG_DEBUG("releasing %s stats", src->source);
+            _index_remove(&_stats.source_index, &src->index_entry);
             avl_delete (_stats.source_tree, src, _free_source_stats);
             continue;
         }
@@ -18,19 +18,40 @@
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 
+#include <stdint.h>
+
 #include "icecasttypes.h"
 #include "refbuf.h"
+#include "atomic.h"
 
 #define STATS_XML_FLAG_NONE             0x0000U
 #define STATS_XML_FLAG_SHOW_HIDDEN      0x0001U
 #define STATS_XML_FLAG_SHOW_LISTENERS   0x0002U
 #define STATS_XML_FLAG_PUBLIC_VIEW      0x0004U
 
+/* hash index over the keys of stats nodes and sources, so events find their
+ * node without walking the trees. The trees are kept for sorted output. */
+typedef struct _stats_index_entry_tag
+{
+    struct _stats_index_entry_tag *next;
+    uint32_t hash;
+    const char *key;
+} stats_index_entry_t;
+
+typedef struct _stats_index_tag
+{
+    /* size is a power of two */
+    stats_index_entry_t **buckets;
+    size_t size;
+    size_t count;
+} stats_index_t;
+
 typedef struct _stats_node_tag
 {
     char *name;
     char *value;
     int hidden;
+    stats_index_entry_t index_entry;
 } stats_node_t;
 
 typedef struct _stats_event_tag
@@ -49,11 +70,14 @@ typedef struct _stats_source_tag
     char *source;
     int  hidden;
     avl_tree *stats_tree;
+    stats_index_t stats_index;
+    stats_index_entry_t index_entry;
 } stats_source_t;
 
 typedef struct _stats_tag
 {
     avl_tree *global_tree;
+    stats_index_t global_index;
 
     /* global stats
     start_time
@@ -66,6 +90,7 @@ typedef struct _stats_tag
     */
 
     avl_tree *source_tree;
+    stats_index_t source_index;
 
     /* stats by source, and for stats
     start_time
@@ -75,12 +100,119 @@ typedef struct _stats_tag
 
 } stats_t;
 
+/* Numeric statistics that are updated often. They are plain atomic slots that
+ * are only turned into strings when the statistics are rendered, read by
+ * stats_get_value() or passed on to the stats streams by the stats thread.
+ * A counter only goes up, a gauge goes up and down and may be set.
+ *
+ * Each counter is split into shards on their own cache lines. A thread always
+ * updates the same shard, so threads updating the same counter at once
+ * rarely touch the same memory. Reading a counter sums up its shards.
+ */
+#define STATS_COUNTER_SHARDS    16
+#define STATS_COUNTER_ALIGN     64
+
+typedef struct {
+    volatile uint64_t value;
+    char padding[STATS_COUNTER_ALIGN - sizeof(uint64_t)];
+} __attribute__((aligned(STATS_COUNTER_ALIGN))) stats_counter_shard_t;
+
+typedef enum {
+    STATS_COUNTER_COUNTER = 0,
+    STATS_COUNTER_GAUGE
+} stats_counter_type_t;
+
+typedef struct stats_counter_tag stats_counter_t;
+
+struct stats_counter_tag {
+    stats_counter_shard_t shards[STATS_COUNTER_SHARDS];
+    stats_counter_type_t type;
+    /* NULL for the global ones */
+    char *mount;
+    char *name;
+    /* only used by the stats thread */
+    uint64_t published;
+    /* all counters of mounts and those of the same mount */
+    stats_counter_t *next;
+    stats_counter_t *mount_next;
+};
+
+/* the global counters, see stats_global_counters in stats.c for their names */
+typedef enum {
+    STATS_GLOBAL_CLIENTS = 0,
+    STATS_GLOBAL_CONNECTIONS,
+    STATS_GLOBAL_LISTENERS,
+    STATS_GLOBAL_CLIENT_CONNECTIONS,
+    STATS_GLOBAL_FILE_CONNECTIONS,
+    STATS_GLOBAL_LISTENER_CONNECTIONS,
+    STATS_GLOBAL_SOURCE_CLIENT_CONNECTIONS,
+    STATS_GLOBAL_SOURCE_RELAY_CONNECTIONS,
+    STATS_GLOBAL_SOURCE_TOTAL_CONNECTIONS,
+    STATS_GLOBAL_STATS_CONNECTIONS,
+    STATS_GLOBAL_CONNECTIONS_REJECTED_IP_LIMIT,
+    STATS_GLOBAL_CONNECTIONS_REJECTED_IP_RATE,
+    STATS_GLOBAL_LISTENERS_REJECTED_BANDWIDTH,
+    STATS_GLOBAL_TLS_HANDSHAKES,
+    STATS_GLOBAL_TLS_RESUMED_SESSIONS,
+    STATS_GLOBAL_TLS_HANDSHAKE_FAILURES,
+    /* one for each of the buckets of the handshake time, in order */
+    STATS_GLOBAL_TLS_HANDSHAKE_MS_LE_5,
+    STATS_GLOBAL_TLS_HANDSHAKE_MS_LE_10,
+    STATS_GLOBAL_TLS_HANDSHAKE_MS_LE_25,
+    STATS_GLOBAL_TLS_HANDSHAKE_MS_LE_50,
+    STATS_GLOBAL_TLS_HANDSHAKE_MS_LE_100,
+    STATS_GLOBAL_TLS_HANDSHAKE_MS_LE_250,
+    STATS_GLOBAL_TLS_HANDSHAKE_MS_LE_500,
+    STATS_GLOBAL_TLS_HANDSHAKE_MS_LE_1000,
+    STATS_GLOBAL_TLS_HANDSHAKE_MS_GT_1000,
+    /* clients waiting for an auth thread, clients a backend is working on,
+     * finished auth requests and the ms they took in total */
+    STATS_GLOBAL_AUTH_QUEUED,
+    STATS_GLOBAL_AUTH_IN_FLIGHT,
+    STATS_GLOBAL_AUTH_REQUESTS,
+    STATS_GLOBAL_AUTH_REQUEST_MS,
+    /* clients answered from a cache of the backend, without being queued */
+    STATS_GLOBAL_AUTH_CACHE_HITS,
+    /* requests to YP servers in flight, finished, failed and the ms they
+     * took in total */
+    STATS_GLOBAL_YP_IN_FLIGHT,
+    STATS_GLOBAL_YP_REQUESTS,
+    STATS_GLOBAL_YP_REQUEST_FAILURES,
+    STATS_GLOBAL_YP_REQUEST_MS,
+    /* events waiting for an event thread and events lost to a full queue */
+    STATS_GLOBAL_EVENTS_QUEUED,
+    STATS_GLOBAL_EVENTS_DROPPED,
+    STATS_GLOBAL_CONNECTION_WRITES,
+    STATS_GLOBAL_CONNECTION_PARTIAL_WRITES,
+    /* access and playlist log records waiting for the writer thread and lost to a full queue */
+    STATS_GLOBAL_LOG_RECORDS_QUEUED,
+    STATS_GLOBAL_LOG_RECORDS_DROPPED,
+    STATS_GLOBAL_LISTENER_MEMORY,
+    /* listeners sent to another server of the cluster, see cluster.h */
+    STATS_GLOBAL_LISTENERS_REDIRECTED_CLUSTER,
+    /* caches shed and listeners rejected for lack of memory, see memgov.h */
+    STATS_GLOBAL_MEMORY_SHEDS,
+    STATS_GLOBAL_LISTENERS_REJECTED_MEMORY,
+    STATS_GLOBAL_MAX
+} stats_global_t;
+
+extern stats_counter_t stats_global_counters[STATS_GLOBAL_MAX];
+
 void stats_initialize(void);
 void stats_shutdown(void);
 
 void stats_global(ice_config_t *config);
 stats_t *stats_get_stats(void);
 refbuf_t *stats_get_streams (void);
+/* Sends the stream list as plain text with its generation as ETag. With
+ * since set to such an ETag only the changes after it are sent, as lines of
+ * "+/mount" and "-/mount". If there are none yet the answer is held back for
+ * up to wait seconds until there are. The Icecast-Streamlist header of the
+ * response tells which of both it is, "full" or "delta".
+ */
+void stats_send_streams (client_t *client, const char *since, int wait);
+/* all numeric stats and counters in the OpenMetrics text format */
+refbuf_t *stats_get_metrics(void);
 void stats_clear_virtual_mounts (void);
 
 void stats_event(const char *source, const char *name, const char *value);
@@ -95,15 +227,77 @@ void stats_event_hidden (const char *source, const char *name, int hidden);
 void stats_event_time (const char *mount, const char *name);
 void stats_event_time_iso8601 (const char *mount, const char *name);
 
-void *stats_connection(void *arg);
 void stats_callback (client_t *client, void *notused);
+/* Sends the stats to client as server-sent events: all of them on connect,
+ * then each change. Only those of mount if not NULL, and only those of the
+ * public view if public_view is set. Fed by the same thread as STATS clients. */
+void stats_send_events(client_t *client, const char *mount, int public_view);
 
 void stats_transform_xslt(client_t *client);
 void stats_sendxml(client_t *client);
 xmlDocPtr stats_get_xml(unsigned int flags, const char *show_mount, client_t *client);
+/* like stats_get_xml() but rendered as ADMIN_FORMAT_RAW or ADMIN_FORMAT_JSON.
+ * Returns a string to be freed by the caller with its length in len.
+ */
+char *stats_get_rendered(unsigned int flags, const char *show_mount, client_t *client, admin_format_t format, size_t *len);
+/* drops the cached renderings of the stats, returns how many there were */
+size_t stats_clear_snapshots(void);
 char *stats_get_value(const char *source, const char *name);
 
 void stats_add_authstack(auth_stack_t *stack, xmlNodePtr parent);
 
+/* Counters of a mount, shown with the other statistics of the mount as long
+ * as it has any. */
+stats_counter_t *stats_counter_new(const char *mount, const char *name, stats_counter_type_t type);
+void stats_counter_free(stats_counter_t *counter);
+
+/* the shard the calling thread updates */
+unsigned int stats_counter_shard(void);
+
+/* counter may be NULL if stats_counter_new() failed, updates are then lost */
+static inline void stats_counter_add(stats_counter_t *counter, int64_t value)
+{
+    if (counter)
+        atomic_u64_add(&(counter->shards[stats_counter_shard()].value), (uint64_t)value);
+}
+
+static inline void stats_counter_inc(stats_counter_t *counter)
+{
+    stats_counter_add(counter, 1);
+}
+
+static inline void stats_counter_dec(stats_counter_t *counter)
+{
+    stats_counter_add(counter, -1);
+}
+
+static inline int64_t stats_counter_get(stats_counter_t *counter)
+{
+    uint64_t value = 0;
+    size_t i;
+
+    if (!counter)
+        return 0;
+
+    for (i = 0; i < STATS_COUNTER_SHARDS; i++)
+        value += atomic_u64_load(&(counter->shards[i].value));
+
+    return (int64_t)value;
+}
+
+/* adds the difference to the value, the shards are never overwritten so
+ * updates by other threads at the same time are kept, counting as done
+ * after it */
+static inline void stats_counter_set(stats_counter_t *counter, int64_t value)
+{
+    if (counter)
+        stats_counter_add(counter, value - stats_counter_get(counter));
+}
+
+#define stats_global_add(id, value) stats_counter_add(&(stats_global_counters[(id)]), (value))
+#define stats_global_inc(id)        stats_counter_inc(&(stats_global_counters[(id)]))
+#define stats_global_dec(id)        stats_counter_dec(&(stats_global_counters[(id)]))
+#define stats_global_set(id, value) stats_counter_set(&(stats_global_counters[(id)]), (value))
+
 #endif  /* __STATS_H__ */
 
@@ -0,0 +1,230 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* Benchmark of loading a large configuration. A config with the given number
+ * of mounts, each with an authentication block of its own, a relay for every
+ * fourth of them and a default mount is written to a temporary file and
+ * config_parse_file() is timed on it. Results are given as TAP diagnostics,
+ * the median of a number of runs.
+ *
+ * Usage: cbench_config [-r runs] [-n mounts]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ctest_lib.h"
+
+#include "../src/logging.h"
+
+#include "../src/global.h"
+#include "../src/cfgfile.h"
+#include "../src/main.h"
+#include "../src/coarsetime.h"
+#include "../src/fastevent.h"
+#include "../src/stats.h"
+#include "../src/refbuf.h"
+
+#define BENCH_RUNS          5
+#define BENCH_MAX_RUNS      31
+#define BENCH_MOUNTS        5000
+/* one mount in this many gets a relay as well */
+#define BENCH_RELAY_EVERY   4
+
+static unsigned int bench_runs = BENCH_RUNS;
+
+/* main.o is not linked in, the config is never reloaded here */
+void main_config_reload(ice_config_t *config)
+{
+    (void)config;
+}
+
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+    uint64_t na = *(const uint64_t *)a;
+    uint64_t nb = *(const uint64_t *)b;
+
+    return (na > nb) - (na < nb);
+}
+
+static int bench_write_config(FILE *file, unsigned int mounts)
+{
+    unsigned int i;
+
+    fprintf(file,
+            "<icecast>\n"
+            "    <limits><clients>100000</clients><sources>%u</sources></limits>\n"
+            "    <authentication>\n"
+            "        <role type=\"static\" allow-method=\"*\" allow-web=\"*\" allow-admin=\"*\">\n"
+            "            <option name=\"username\" value=\"admin\" />\n"
+            "            <option name=\"password\" value=\"hackme\" />\n"
+            "        </role>\n"
+            "        <role type=\"anonymous\" match-method=\"get,post,head,options\" allow-web=\"*\" deny-admin=\"*\" />\n"
+            "    </authentication>\n"
+            "    <hostname>localhost</hostname>\n"
+            "    <listen-socket><port>8000</port></listen-socket>\n"
+            "    <mount type=\"default\">\n"
+            "        <burst-size>65536</burst-size>\n"
+            "        <public>false</public>\n"
+            "    </mount>\n",
+            mounts);
+
+    for (i = 0; i < mounts; i++) {
+        fprintf(file,
+                "    <mount type=\"normal\">\n"
+                "        <mount-name>/bench%u.mp3</mount-name>\n"
+                "        <max-listeners>100</max-listeners>\n"
+                "        <fallback-mount>/bench%u.mp3</fallback-mount>\n"
+                "        <stream-name>Benchmark stream %u</stream-name>\n"
+                "        <authentication>\n"
+                "            <role type=\"static\" allow-method=\"source,put\" deny-web=\"*\" allow-admin=\"*\">\n"
+                "                <option name=\"username\" value=\"source%u\" />\n"
+                "                <option name=\"password\" value=\"hackme%u\" />\n"
+                "            </role>\n"
+                "            <role type=\"anonymous\" match-method=\"get,post,head,options\" allow-web=\"*\" deny-admin=\"*\" />\n"
+                "        </authentication>\n"
+                "    </mount>\n",
+                i, (i + 1) % mounts, i, i, i);
+
+        if ((i % BENCH_RELAY_EVERY) == 0) {
+            fprintf(file,
+                    "    <relay>\n"
+                    "        <local-mount>/relay%u.mp3</local-mount>\n"
+                    "        <on-demand>true</on-demand>\n"
+                    "        <upstream type=\"normal\">\n"
+                    "            <server>master%u.example.org</server>\n"
+                    "            <port>8000</port>\n"
+                    "            <mount>/bench%u.mp3</mount>\n"
+                    "        </upstream>\n"
+                    "    </relay>\n",
+                    i, i % 16, i);
+        }
+    }
+
+    fprintf(file, "</icecast>\n");
+
+    return ferror(file) ? -1 : 0;
+}
+
+static void bench_parse(const char *filename, unsigned int mounts)
+{
+    uint64_t runs[BENCH_MAX_RUNS];
+    unsigned int i;
+
+    for (i = 0; i < bench_runs; i++) {
+        ice_config_t config;
+        uint64_t start;
+        int ret;
+
+        memset(&config, 0, sizeof(config));
+        start = bench_now();
+        ret = config_parse_file(filename, &config);
+        runs[i] = bench_now() - start;
+
+        if (ret != 0) {
+            ctest_diagnostic_printf("parsing the config failed with %i", ret);
+            return;
+        }
+        config_clear(&config);
+    }
+
+    qsort(runs, bench_runs, sizeof(*runs), bench_compare);
+    ctest_diagnostic_printf("%-28s %10.1f ms %10.1f us/mount %10u mounts",
+            "config_parse_file", runs[bench_runs / 2] / 1000000.,
+            runs[bench_runs / 2] / 1000. / mounts, mounts);
+}
+
+int main (int argc, char **argv)
+{
+    unsigned int mounts = BENCH_MOUNTS;
+    char filename[] = "/tmp/cbench_config.XXXXXX";
+    FILE *file;
+    int fd;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:n:")) != -1) {
+        switch (opt) {
+            case 'r':
+                opt = atoi(optarg);
+                if (opt < 1)
+                    opt = 1;
+                if (opt > BENCH_MAX_RUNS)
+                    opt = BENCH_MAX_RUNS;
+                bench_runs = opt;
+            break;
+            case 'n':
+                opt = atoi(optarg);
+                mounts = opt < 1 ? 1 : opt;
+            break;
+            default:
+                fprintf(stderr, "Usage: %s [-r runs] [-n mounts]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    ctest_init();
+
+    log_initialize();
+    thread_initialize();
+    coarsetime_initialize();
+    global_initialize();
+    fastevent_initialize();
+    config_initialize();
+    stats_initialize();
+    refbuf_initialize();
+
+    fd = mkstemp(filename);
+    if (fd == -1) {
+        ctest_diagnostic("can not create the config file");
+    } else {
+        int ret = -1;
+
+        file = fdopen(fd, "w");
+        if (file) {
+            ret = bench_write_config(file, mounts);
+            if (fclose(file) != 0)
+                ret = -1;
+        } else {
+            close(fd);
+        }
+
+        if (ret == 0) {
+            bench_parse(filename, mounts);
+        } else {
+            ctest_diagnostic("can not write the config to parse");
+        }
+        unlink(filename);
+    }
+
+    refbuf_shutdown();
+    stats_shutdown();
+    config_shutdown();
+    fastevent_shutdown();
+    global_shutdown();
+    coarsetime_shutdown();
+    thread_shutdown();
+    log_shutdown();
+
+    ctest_fin();
+
+    return 0;
+}
@@ -0,0 +1,112 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* Benchmark of the reference count of refobjects. A number of threads take
+ * and drop references to the same object as fast as they can, which is the
+ * worst case of the atomic count. Results are given as TAP diagnostics.
+ *
+ * Usage: cbench_refobject [-t threads] [-n pairs per thread]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ctest_lib.h"
+
+#include "../refobject.h"
+#include "common/thread/thread.h"
+
+#define BENCH_THREADS       4
+#define BENCH_MAX_THREADS   64
+#define BENCH_PAIRS         1000000
+
+static unsigned int bench_pairs = BENCH_PAIRS;
+
+static void *bench_run(void *arg)
+{
+    refobject_base_t *a = arg;
+    unsigned int i;
+
+    for (i = 0; i < bench_pairs; i++) {
+        refobject_ref(a);
+        refobject_unref(a);
+    }
+
+    return NULL;
+}
+
+static void bench_threads(unsigned int count)
+{
+    refobject_base_t *a;
+    thread_type *threads[BENCH_MAX_THREADS];
+    struct timespec start, end;
+    double seconds;
+    unsigned int i;
+
+    a = refobject_new(refobject_base_t);
+    if (REFOBJECT_IS_NULL(a)) {
+        ctest_diagnostic("can not create the refobject");
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; i++)
+        threads[i] = thread_create("refobject bench", bench_run, a, THREAD_ATTACHED);
+    for (i = 0; i < count; i++) {
+        if (threads[i])
+            thread_join(threads[i]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    ctest_diagnostic_printf("%u threads did %u ref/unref pairs each in %.3fs (%.0f pairs/s)",
+            count, bench_pairs, seconds,
+            seconds > 0. ? (count * (double)bench_pairs) / seconds : 0.);
+
+    refobject_unref(a);
+}
+
+int main (int argc, char **argv)
+{
+    unsigned int threads = BENCH_THREADS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:n:")) != -1) {
+        switch (opt) {
+            case 't':
+                opt = atoi(optarg);
+                if (opt < 1)
+                    opt = 1;
+                if (opt > BENCH_MAX_THREADS)
+                    opt = BENCH_MAX_THREADS;
+                threads = opt;
+            break;
+            case 'n':
+                opt = atoi(optarg);
+                bench_pairs = opt < 1 ? 1 : opt;
+            break;
+            default:
+                fprintf(stderr, "Usage: %s [-t threads] [-n pairs]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    ctest_init();
+    thread_initialize();
+
+    bench_threads(threads);
+
+    thread_shutdown();
+    ctest_fin();
+
+    return 0;
+}
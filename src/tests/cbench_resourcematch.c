@@ -0,0 +1,109 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* Benchmark of resource matching. For each pattern the throughput of
+ * matching it anew every time is compared with that of matching a compiled
+ * one, as the admin and API requests are dispatched. Results are given as
+ * TAP diagnostics.
+ *
+ * Usage: cbench_resourcematch [-n matches per pattern]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ctest_lib.h"
+
+#include "../resourcematch.h"
+
+#define BENCH_MATCHES   100000
+
+static unsigned int bench_matches = BENCH_MATCHES;
+
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void bench_pattern(const char *pattern, const char *string)
+{
+    resourcematch_t *matcher = resourcematch_compile(pattern);
+    resourcematch_group_t group[8];
+    resourcematch_extract_t extract;
+    resourcematch_extract_t *allocated;
+    uint64_t start;
+    uint64_t plain;
+    uint64_t compiled;
+    size_t matched = 0;
+    unsigned int i;
+
+    if (!matcher) {
+        ctest_diagnostic_printf("can not compile \"%s\"", pattern);
+        return;
+    }
+
+    start = bench_now();
+    for (i = 0; i < bench_matches; i++) {
+        if (resourcematch_match(pattern, string, &allocated) == RESOURCEMATCH_MATCH) {
+            matched++;
+            resourcematch_extract_free(allocated);
+        }
+    }
+    plain = bench_now() - start;
+
+    start = bench_now();
+    for (i = 0; i < bench_matches; i++) {
+        extract.groups = 8;
+        extract.group = group;
+        if (resourcematch_exec(matcher, string, &extract) == RESOURCEMATCH_MATCH)
+            matched++;
+    }
+    compiled = bench_now() - start;
+
+    if (matched != 2 * (size_t)bench_matches)
+        ctest_diagnostic_printf("\"%s\" does not match \"%s\" every time", pattern, string);
+    ctest_diagnostic_printf("%-24s %-24s %8.1f ns per match %8.1f ns compiled",
+            pattern, string, (double)plain / bench_matches, (double)compiled / bench_matches);
+
+    resourcematch_free(matcher);
+}
+
+int main (int argc, char **argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+            case 'n':
+                opt = atoi(optarg);
+                bench_matches = opt < 1 ? 1 : opt;
+            break;
+            default:
+                fprintf(stderr, "Usage: %s [-n matches]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    ctest_init();
+
+    bench_pattern("listclients.xsl", "listclients.xsl");
+    bench_pattern("listener/%d/move/%x", "listener/42/move/1f");
+    bench_pattern("%s", "status-json.xsl");
+
+    ctest_fin();
+
+    return 0;
+}
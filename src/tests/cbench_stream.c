@@ -0,0 +1,606 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* Microbenchmarks of the per buffer work of a source: the format plugins
+ * parsing a recorded stream, refbuf allocation and the queue handling of
+ * source_process(). Results are given as TAP diagnostics in ns and bytes
+ * allocated per operation, the median of a number of runs.
+ *
+ * Without a WebM recording one is made up of a 6 Mbit/s video track, so the
+ * EBML parser is always measured.
+ *
+ * Usage: cbench_stream [-r runs] [-m mp3-file] [-o ogg-file] [-w webm-file]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ctest_lib.h"
+
+#include "../src/common/httpp/httpp.h"
+#include "../src/logging.h"
+
+#include "../src/global.h"
+#include "../src/cfgfile.h"
+#include "../src/main.h"
+#include "../src/coarsetime.h"
+#include "../src/fastevent.h"
+#include "../src/stats.h"
+#include "../src/refbuf.h"
+#include "../src/connection.h"
+#include "../src/client.h"
+#include "../src/source.h"
+#include "../src/format.h"
+#include "../src/format_mp3.h"
+
+#define BENCH_RUNS          5
+#define BENCH_MAX_RUNS      31
+#define BENCH_REFBUF_OPS    1000000
+#define BENCH_QUEUE_OPS     200000
+#define BENCH_QUEUE_BUFFER  1400
+#define BENCH_BURST_SIZE    65536
+/* inline metadata interval of the mp3 stream, a new title every few blocks */
+#define BENCH_METAINT       16000
+#define BENCH_TITLE_EVERY   8
+/* the WebM stream made up without a recording, one cluster per second */
+#define BENCH_WEBM_SECONDS  10
+#define BENCH_WEBM_FPS      25
+#define BENCH_WEBM_BITRATE  6000000
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t pos;
+} bench_input_t;
+
+typedef struct {
+    uint64_t ns;
+    size_t allocated;
+    size_t ops;
+} bench_run_t;
+
+static unsigned int bench_runs = BENCH_RUNS;
+static bench_input_t *bench_current_input;
+static char bench_mount[] = "/bench";
+
+/* main.o is not linked in, the config is never reloaded here */
+void main_config_reload(ice_config_t *config)
+{
+    (void)config;
+}
+
+#ifdef __GLIBC__
+/* Bytes allocated by this thread, the stats thread is not counted */
+static __thread size_t bench_allocated;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+    bench_allocated += size;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    bench_allocated += nmemb * size;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    bench_allocated += size;
+    return __libc_realloc(ptr, size);
+}
+
+#define BENCH_HAVE_ALLOCATED 1
+#define bench_get_allocated() (bench_allocated)
+#else
+#define BENCH_HAVE_ALLOCATED 0
+#define bench_get_allocated() ((size_t)0)
+#endif
+
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bench_run_compare(const void *a, const void *b)
+{
+    const bench_run_t *ra = a, *rb = b;
+    double na = ra->ops ? (double)ra->ns / ra->ops : 0.;
+    double nb = rb->ops ? (double)rb->ns / rb->ops : 0.;
+
+    return (na > nb) - (na < nb);
+}
+
+/* reports the run with the median time per operation, with the input rate
+ * when input_len is given */
+static void bench_report(const char *name, bench_run_t *runs, size_t input_len)
+{
+    bench_run_t *median;
+
+    qsort(runs, bench_runs, sizeof(*runs), bench_run_compare);
+    median = &(runs[bench_runs / 2]);
+
+    if (!median->ops) {
+        ctest_diagnostic_printf("%-28s no operations", name);
+        return;
+    }
+
+    if (BENCH_HAVE_ALLOCATED) {
+        ctest_diagnostic_printf("%-28s %10.1f ns/op %10.1f bytes/op %10zu ops",
+                name, (double)median->ns / median->ops,
+                (double)median->allocated / median->ops, median->ops);
+    } else {
+        ctest_diagnostic_printf("%-28s %10.1f ns/op %10s bytes/op %10zu ops",
+                name, (double)median->ns / median->ops, "n/a", median->ops);
+    }
+
+    if (input_len && median->ns)
+        ctest_diagnostic_printf("%-28s %10.1f MB/s", "", (double)input_len * 1000. / median->ns);
+}
+
+static int bench_load_file(bench_input_t *input, const char *filename)
+{
+    FILE *file = fopen(filename, "rb");
+    long len;
+
+    memset(input, 0, sizeof(*input));
+
+    if (!file)
+        return -1;
+
+    if (fseek(file, 0, SEEK_END) != 0 || (len = ftell(file)) <= 0 || fseek(file, 0, SEEK_SET) != 0) {
+        fclose(file);
+        return -1;
+    }
+
+    input->data = malloc(len);
+    if (input->data && fread(input->data, 1, len, file) == (size_t)len)
+        input->len = len;
+    fclose(file);
+
+    return input->len ? 0 : -1;
+}
+
+/* writes an EBML element size in as few bytes as it takes */
+static size_t bench_webm_size(unsigned char *out, uint64_t size)
+{
+    size_t len = 1;
+    size_t i;
+
+    while (len < 8 && size >= ((uint64_t)1 << (7 * len)) - 1)
+        len++;
+
+    for (i = len; i > 0; i--) {
+        out[i - 1] = size & 0xff;
+        size >>= 8;
+    }
+    out[0] |= 0x80 >> (len - 1);
+
+    return len;
+}
+
+static size_t bench_webm_element(unsigned char *out, const char *id, size_t id_len, const void *payload, size_t len)
+{
+    size_t pos = id_len;
+
+    memcpy(out, id, id_len);
+    pos += bench_webm_size(out + pos, len);
+    if (payload)
+        memcpy(out + pos, payload, len);
+
+    return pos + len;
+}
+
+/* makes up a WebM stream of a single video track as a live encoder sends it:
+ * a segment of unknown size and clusters starting with a keyframe */
+static int bench_make_webm(bench_input_t *input)
+{
+    size_t frame = BENCH_WEBM_BITRATE / 8 / BENCH_WEBM_FPS;
+    unsigned char element[64];
+    unsigned char *data;
+    unsigned char *block;
+    size_t cluster;
+    size_t pos = 0;
+    size_t len;
+    unsigned int second;
+    unsigned int i;
+
+    memset(input, 0, sizeof(*input));
+
+    /* a Timecode and the SimpleBlocks, each with the track number, its time
+     * and flags ahead of the frame */
+    cluster = 4 + BENCH_WEBM_FPS * (1 + bench_webm_size(element, 4 + frame) + 4 + frame);
+
+    data = malloc(256 + BENCH_WEBM_SECONDS * (4 + 8 + cluster));
+    block = malloc(4 + frame);
+    if (!data || !block) {
+        free(data);
+        free(block);
+        return -1;
+    }
+
+    /* EBML header with the EBMLVersion and DocType */
+    len = bench_webm_element(element, "\x42\x86", 2, "\x01", 1);
+    len += bench_webm_element(element + len, "\x42\x82", 2, "webm", 4);
+    pos += bench_webm_element(data + pos, "\x1A\x45\xDF\xA3", 4, element, len);
+
+    /* Segment of unknown size, Info with the TimecodeScale */
+    memcpy(data + pos, "\x18\x53\x80\x67\x01\xFF\xFF\xFF\xFF\xFF\xFF\xFF", 12);
+    pos += 12;
+    len = bench_webm_element(element, "\x2A\xD7\xB1", 3, "\x0F\x42\x40", 3);
+    pos += bench_webm_element(data + pos, "\x15\x49\xA9\x66", 4, element, len);
+
+    /* Tracks with a TrackEntry of TrackNumber 1, TrackType video and CodecID */
+    len = bench_webm_element(element + 2, "\xD7", 1, "\x01", 1);
+    len += bench_webm_element(element + 2 + len, "\x83", 1, "\x01", 1);
+    len += bench_webm_element(element + 2 + len, "\x86", 1, "V_VP8", 5);
+    len = bench_webm_element(element, "\xAE", 1, NULL, len);
+    pos += bench_webm_element(data + pos, "\x16\x54\xAE\x6B", 4, element, len);
+
+    /* the payload of the frames does not matter to the parser */
+    for (i = 0; i < frame; i++)
+        block[4 + i] = (i * 2654435761u) >> 24;
+
+    for (second = 0; second < BENCH_WEBM_SECONDS; second++) {
+        memcpy(data + pos, "\x1F\x43\xB6\x75", 4);
+        pos += 4;
+        pos += bench_webm_size(data + pos, cluster);
+
+        /* Timecode of the cluster in ms */
+        element[0] = ((second * 1000) >> 8) & 0xff;
+        element[1] = (second * 1000) & 0xff;
+        pos += bench_webm_element(data + pos, "\xE7", 1, element, 2);
+
+        /* SimpleBlocks of track 1 with their time relative to the cluster,
+         * the first one is a keyframe */
+        for (i = 0; i < BENCH_WEBM_FPS; i++) {
+            unsigned int timecode = i * 1000 / BENCH_WEBM_FPS;
+
+            block[0] = 0x81;
+            block[1] = (timecode >> 8) & 0xff;
+            block[2] = timecode & 0xff;
+            block[3] = i ? 0x00 : 0x80;
+            pos += bench_webm_element(data + pos, "\xA3", 1, block, 4 + frame);
+        }
+    }
+
+    free(block);
+    input->data = (char *)data;
+    input->len = pos;
+
+    return 0;
+}
+
+/* interleaves ICY metadata blocks into the mp3 data as a source client does */
+static int bench_add_metadata(bench_input_t *input)
+{
+    size_t blocks = input->len / BENCH_METAINT;
+    char *data = malloc(input->len + blocks * (1 + 255 * 16));
+    size_t in = 0, out = 0, block = 0;
+
+    if (!data)
+        return -1;
+
+    while (in < input->len) {
+        size_t len = input->len - in;
+
+        if (len > BENCH_METAINT)
+            len = BENCH_METAINT;
+        memcpy(data + out, input->data + in, len);
+        in += len;
+        out += len;
+
+        if (len < BENCH_METAINT)
+            break;
+
+        if ((block % BENCH_TITLE_EVERY) == 0) {
+            char meta[255 * 16 + 1];
+            int metalen = snprintf(meta, sizeof(meta), "StreamTitle='Benchmark artist - Track %zu';StreamUrl='';", block / BENCH_TITLE_EVERY);
+            size_t count = (metalen + 15) / 16;
+
+            data[out++] = count;
+            memset(data + out, 0, count * 16);
+            memcpy(data + out, meta, metalen);
+            out += count * 16;
+        } else {
+            data[out++] = 0;
+        }
+        block++;
+    }
+
+    free(input->data);
+    input->data = data;
+    input->len = out;
+
+    return 0;
+}
+
+static int bench_read(connection_t *con, void *buf, size_t len)
+{
+    bench_input_t *input = bench_current_input;
+    size_t left = input->len - input->pos;
+
+    (void)con;
+
+    if (len > left)
+        len = left;
+    memcpy(buf, input->data + input->pos, len);
+    input->pos += len;
+
+    return len;
+}
+
+/* feeds the recording through the format plugin of a source set up like
+ * connection_complete_source() does, the buffers produced are released */
+static void bench_format_run(bench_run_t *run, const char *contenttype, const char *metaint, bench_input_t *input)
+{
+    source_t source;
+    client_t client;
+    connection_t con;
+    http_parser_t *parser;
+    size_t allocated;
+    uint64_t start;
+
+    memset(&source, 0, sizeof(source));
+    memset(&client, 0, sizeof(client));
+    memset(&con, 0, sizeof(con));
+    memset(run, 0, sizeof(*run));
+
+    parser = httpp_create_parser();
+    httpp_initialize(parser, NULL);
+    httpp_setvar(parser, "content-type", contenttype);
+    if (metaint)
+        httpp_setvar(parser, "icy-metaint", metaint);
+
+    con.sock = -1;
+    con.read = bench_read;
+    client.con = &con;
+    client.parser = parser;
+    client.request_body_length = input->len;
+    source.mount = bench_mount;
+    source.parser = parser;
+    source.client = &client;
+    source.running = 1;
+    arena_initialize(&source.arena, 4096);
+
+    input->pos = 0;
+    bench_current_input = input;
+
+    if (format_get_plugin(format_get_type(contenttype), &source) < 0) {
+        arena_shutdown(&source.arena);
+        httpp_destroy(parser);
+        return;
+    }
+    if (source.format->apply_settings)
+        source.format->apply_settings(&client, source.format, NULL);
+
+    allocated = bench_get_allocated();
+    start = bench_now();
+    while (1) {
+        size_t pos = input->pos;
+        refbuf_t *refbuf = source.format->get_buffer(&source);
+
+        if (refbuf) {
+            run->ops++;
+            refbuf_release(refbuf);
+        } else if (input->pos == input->len || input->pos == pos) {
+            /* all read, or the plugin gave up on the stream */
+            break;
+        }
+    }
+    run->ns = bench_now() - start;
+    run->allocated = bench_get_allocated() - allocated;
+
+    source.format->free_plugin(source.format);
+    arena_shutdown(&source.arena);
+    httpp_destroy(parser);
+}
+
+static void bench_format(const char *name, const char *contenttype, const char *metaint, bench_input_t *input)
+{
+    bench_run_t runs[BENCH_MAX_RUNS];
+    unsigned int i;
+
+    for (i = 0; i < bench_runs; i++)
+        bench_format_run(&(runs[i]), contenttype, metaint, input);
+
+    ctest_test(name, runs[0].ops > 0);
+    bench_report(name, runs, input->len);
+}
+
+static void bench_refbuf(unsigned int size)
+{
+    bench_run_t runs[BENCH_MAX_RUNS];
+    char name[64];
+    unsigned int i;
+    size_t op;
+
+    for (i = 0; i < bench_runs; i++) {
+        size_t allocated = bench_get_allocated();
+        uint64_t start = bench_now();
+
+        for (op = 0; op < BENCH_REFBUF_OPS; op++)
+            refbuf_release(refbuf_new(size));
+
+        runs[i].ns = bench_now() - start;
+        runs[i].allocated = bench_get_allocated() - allocated;
+        runs[i].ops = BENCH_REFBUF_OPS;
+    }
+
+    snprintf(name, sizeof(name), "refbuf new/release %u", size);
+    bench_report(name, runs, 0);
+}
+
+/* the append and trim done for every buffer read by source_process() with
+ * no listeners, so the queue is kept at the burst size */
+static void bench_queue(void)
+{
+    bench_run_t runs[BENCH_MAX_RUNS];
+    refbuf_t **refbufs = calloc(BENCH_QUEUE_OPS, sizeof(*refbufs));
+    source_t *source = calloc(1, sizeof(*source));
+    int sane = 1;
+    unsigned int i;
+    size_t op;
+
+    if (!refbufs || !source) {
+        free(refbufs);
+        free(source);
+        ctest_test("queue benchmark set up", 0);
+        return;
+    }
+
+    for (i = 0; i < bench_runs; i++) {
+        size_t allocated;
+        uint64_t start;
+
+        for (op = 0; op < BENCH_QUEUE_OPS; op++)
+            refbufs[op] = refbuf_new(BENCH_QUEUE_BUFFER);
+
+        source->burst_size = BENCH_BURST_SIZE;
+        source->running = 1;
+
+        allocated = bench_get_allocated();
+        start = bench_now();
+        for (op = 0; op < BENCH_QUEUE_OPS; op++) {
+            source_queue_buffer(source, refbufs[op]);
+            source_trim_queue(source);
+        }
+        runs[i].ns = bench_now() - start;
+        runs[i].allocated = bench_get_allocated() - allocated;
+        runs[i].ops = BENCH_QUEUE_OPS;
+
+        if (!source->running || source->queue_size > BENCH_BURST_SIZE + 2 * BENCH_QUEUE_BUFFER)
+            sane = 0;
+
+        /* as source_clear_source() does */
+        while (source->stream_data) {
+            refbuf_t *p = source->stream_data;
+            source->stream_data = p->next;
+            p->next = NULL;
+            while (refbuf_get_count(p) > 1)
+                refbuf_release(p);
+            refbuf_release(p);
+        }
+        memset(source, 0, sizeof(*source));
+    }
+
+    ctest_test("queue kept at the burst size", sane);
+    bench_report("queue append/trim", runs, 0);
+
+    free(refbufs);
+    free(source);
+}
+
+int main (int argc, char **argv)
+{
+    const char *mp3 = NULL, *ogg = NULL, *webm = NULL;
+    bench_input_t input;
+    char metaint[16];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:m:o:w:")) != -1) {
+        switch (opt) {
+            case 'r':
+                opt = atoi(optarg);
+                if (opt < 1)
+                    opt = 1;
+                if (opt > BENCH_MAX_RUNS)
+                    opt = BENCH_MAX_RUNS;
+                bench_runs = opt;
+            break;
+            case 'm':
+                mp3 = optarg;
+            break;
+            case 'o':
+                ogg = optarg;
+            break;
+            case 'w':
+                webm = optarg;
+            break;
+            default:
+                fprintf(stderr, "Usage: %s [-r runs] [-m mp3-file] [-o ogg-file] [-w webm-file]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    ctest_init();
+
+    log_initialize();
+    thread_initialize();
+    coarsetime_initialize();
+    global_initialize();
+    fastevent_initialize();
+    config_initialize();
+    stats_initialize();
+    refbuf_initialize();
+    format_mp3_initialize();
+
+    if (!BENCH_HAVE_ALLOCATED)
+        ctest_diagnostic("allocations are only counted with glibc");
+
+    bench_refbuf(0);
+    bench_refbuf(BENCH_QUEUE_BUFFER);
+    bench_refbuf(4096);
+    bench_refbuf(65536);
+    bench_queue();
+
+    if (mp3 && bench_load_file(&input, mp3) == 0) {
+        bench_format("mp3", "audio/mpeg", NULL, &input);
+        snprintf(metaint, sizeof(metaint), "%d", BENCH_METAINT);
+        if (bench_add_metadata(&input) == 0)
+            bench_format("mp3 with inline metadata", "audio/mpeg", metaint, &input);
+        free(input.data);
+    } else {
+        ctest_diagnostic("no mp3 recording given, skipping the mp3 benchmarks");
+    }
+
+    if (ogg && bench_load_file(&input, ogg) == 0) {
+        bench_format("ogg", "application/ogg", NULL, &input);
+        free(input.data);
+    } else {
+        ctest_diagnostic("no ogg recording given, skipping the ogg benchmark");
+    }
+
+    if (webm && bench_load_file(&input, webm) == 0) {
+        bench_format("webm", "video/webm", NULL, &input);
+        free(input.data);
+    } else if (bench_make_webm(&input) == 0) {
+        bench_format("webm (made up)", "video/webm", NULL, &input);
+        free(input.data);
+    } else {
+        ctest_diagnostic("can not make up a webm stream, skipping the webm benchmark");
+    }
+
+    format_mp3_shutdown();
+    refbuf_shutdown();
+    stats_shutdown();
+    config_shutdown();
+    fastevent_shutdown();
+    global_shutdown();
+    coarsetime_shutdown();
+    thread_shutdown();
+    log_shutdown();
+
+    ctest_fin();
+
+    return 0;
+}
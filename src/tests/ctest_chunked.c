@@ -0,0 +1,187 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include "ctest_lib.h"
+
+#include "../src/chunked.h"
+
+/* Decodes input in reads of step bytes each, the payload is collected in
+ * out. Returns the payload length, or -1 once a read failed. */
+static ssize_t decode_in_steps(chunked_t *chunked, const char *input, size_t step, char *out, size_t outlen)
+{
+    char buf[256];
+    size_t len = strlen(input);
+    size_t pos = 0;
+    size_t total = 0;
+
+    while (pos < len) {
+        size_t part = len - pos;
+        ssize_t ret;
+
+        if (part > step)
+            part = step;
+        memcpy(buf, input + pos, part);
+        ret = chunked_decode(chunked, buf, part);
+        if (ret < 0)
+            return -1;
+        if (total + ret > outlen)
+            return -1;
+        memcpy(out + total, buf, ret);
+        total += ret;
+        pos += part;
+    }
+
+    return total;
+}
+
+/* Whether input decodes to expected with an end seen, in reads of any size */
+static int decodes_to(const char *input, const char *expected)
+{
+    size_t step;
+
+    for (step = 1; step <= strlen(input); step++) {
+        chunked_t *chunked = chunked_new();
+        char out[256];
+        ssize_t ret;
+        int eof;
+
+        if (!chunked)
+            return 0;
+        ret = decode_in_steps(chunked, input, step, out, sizeof(out));
+        eof = chunked_eof(chunked);
+        chunked_free(chunked);
+
+        if (ret != (ssize_t)strlen(expected) || memcmp(out, expected, ret) != 0 || !eof)
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Whether input is refused, in reads of any size */
+static int is_refused(const char *input)
+{
+    size_t step;
+
+    for (step = 1; step <= strlen(input); step++) {
+        chunked_t *chunked = chunked_new();
+        char out[256];
+        ssize_t ret;
+
+        if (!chunked)
+            return 0;
+        ret = decode_in_steps(chunked, input, step, out, sizeof(out));
+        chunked_free(chunked);
+
+        if (ret != -1)
+            return 0;
+    }
+
+    return 1;
+}
+
+static void test_create_free(void)
+{
+    chunked_t *chunked = chunked_new();
+
+    ctest_test("decoder created", chunked != NULL);
+    ctest_test("no end seen yet", !chunked_eof(chunked));
+    chunked_free(chunked);
+}
+
+static void test_simple(void)
+{
+    ctest_test("single chunk", decodes_to("5\r\nhello\r\n0\r\n\r\n", "hello"));
+    ctest_test("two chunks", decodes_to("5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n", "hello world"));
+    ctest_test("hex sizes in both cases", decodes_to("a\r\n0123456789\r\nB\r\nabcdefghijk\r\n0\r\n\r\n", "0123456789abcdefghijk"));
+    ctest_test("leading zeros", decodes_to("0003\r\nabc\r\n000\r\n\r\n", "abc"));
+    ctest_test("empty body", decodes_to("0\r\n\r\n", ""));
+}
+
+static void test_extensions(void)
+{
+    ctest_test("extension", decodes_to("5;name=value\r\nhello\r\n0\r\n\r\n", "hello"));
+    ctest_test("extension after whitespace", decodes_to("5 ;name=\"quoted\"\r\nhello\r\n0;last\r\n\r\n", "hello"));
+}
+
+static void test_trailers(void)
+{
+    ctest_test("one trailer", decodes_to("5\r\nhello\r\n0\r\nExpires: never\r\n\r\n", "hello"));
+    ctest_test("two trailers", decodes_to("5\r\nhello\r\n0\r\nA: 1\r\nB: 2\r\n\r\n", "hello"));
+}
+
+static void test_framing_only(void)
+{
+    chunked_t *chunked = chunked_new();
+    char buf[32];
+    ssize_t ret;
+
+    memcpy(buf, "5\r\n", 3);
+    ret = chunked_decode(chunked, buf, 3);
+    ctest_test("read of a chunk header only", ret == 0);
+
+    ret = chunked_decode(chunked, buf, 0);
+    ctest_test("read of nothing", ret == 0);
+
+    memcpy(buf, "hello", 5);
+    ret = chunked_decode(chunked, buf, 5);
+    ctest_test("read of the payload only", ret == 5 && memcmp(buf, "hello", 5) == 0);
+
+    memcpy(buf, "\r\n0\r\n", 5);
+    ret = chunked_decode(chunked, buf, 5);
+    ctest_test("read of the end of a chunk and the last chunk", ret == 0 && !chunked_eof(chunked));
+
+    memcpy(buf, "\r\n", 2);
+    ret = chunked_decode(chunked, buf, 2);
+    ctest_test("read of the end of the body", ret == 0 && chunked_eof(chunked));
+
+    chunked_free(chunked);
+}
+
+static void test_invalid(void)
+{
+    chunked_t *chunked;
+    char buf[32];
+
+    ctest_test("garbage after the last chunk", is_refused("5\r\nhello\r\n0\r\n\r\nX"));
+    ctest_test("oversize hex", is_refused("1000000000000000\r\n"));
+    ctest_test("no size", is_refused("\r\nhello\r\n"));
+    ctest_test("not hex", is_refused("g\r\n"));
+    ctest_test("bare LF after the size", is_refused("5\nhello\r\n"));
+    ctest_test("payload longer than its size", is_refused("3\r\nhello\r\n"));
+    ctest_test("bare LF after the payload", is_refused("5\r\nhello\n0\r\n\r\n"));
+
+    /* once broken, it stays so */
+    chunked = chunked_new();
+    memcpy(buf, "x", 1);
+    ctest_test("broken stream", chunked_decode(chunked, buf, 1) == -1);
+    memcpy(buf, "0\r\n\r\n", 5);
+    ctest_test("broken stream stays broken", chunked_decode(chunked, buf, 5) == -1 && !chunked_eof(chunked));
+    chunked_free(chunked);
+}
+
+int main (void)
+{
+    ctest_init();
+
+    test_create_free();
+    test_simple();
+    test_extensions();
+    test_trailers();
+    test_framing_only();
+    test_invalid();
+
+    ctest_fin();
+
+    return 0;
+}
@@ -0,0 +1,157 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "ctest_lib.h"
+
+#include "../src/digest.h"
+#include "../src/refobject.h"
+
+static void hex(char *out, const unsigned char *in, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        sprintf(out + i*2, "%02x", in[i]);
+}
+
+static void test_digest(digest_algo_t algo, const char *msg, size_t repeat, const char *expected)
+{
+    char desc[80];
+    unsigned char result[64];
+    char result_hex[129];
+    ssize_t len = digest_algo_length_bytes(algo);
+    digest_t *digest;
+    size_t i;
+
+    snprintf(desc, sizeof(desc), "%s known answer", digest_algo_id2str(algo));
+
+    digest = digest_new(algo);
+    if (!digest) {
+        ctest_test(desc, 0);
+        return;
+    }
+
+    for (i = 0; i < repeat; i++)
+        digest_write(digest, msg, strlen(msg));
+
+    ctest_test("digest read", digest_read(digest, result, sizeof(result)) == len);
+    refobject_unref(digest);
+
+    hex(result_hex, result, len);
+    ctest_test(desc, strcmp(result_hex, expected) == 0);
+}
+
+static void test_copy(void)
+{
+    unsigned char a[32], b[32];
+    digest_t *digest;
+    digest_t *copy;
+
+    digest = digest_new(DIGEST_ALGO_SHA3_256);
+    ctest_test("digest created", digest != NULL);
+    digest_write(digest, "ab", 2);
+
+    copy = digest_copy(digest);
+    ctest_test("digest copied", copy != NULL);
+
+    digest_write(digest, "c", 1);
+    digest_write(copy, "c", 1);
+
+    ctest_test("digest read", digest_read(digest, a, sizeof(a)) == sizeof(a));
+    ctest_test("copy read", digest_read(copy, b, sizeof(b)) == sizeof(b));
+    ctest_test("copy continues the state", memcmp(a, b, sizeof(a)) == 0);
+
+    refobject_unref(copy);
+    refobject_unref(digest);
+}
+
+static void test_hmac(digest_algo_t algo, const char *key, size_t keylen, const char *msg, const char *expected)
+{
+    char desc[80];
+    unsigned char result[64];
+    char result_hex[129];
+    ssize_t len = digest_algo_length_bytes(algo);
+    hmac_t *hmac;
+
+    snprintf(desc, sizeof(desc), "HMAC-%s known answer", digest_algo_id2str(algo));
+
+    hmac = hmac_new(algo, key, keylen);
+    if (!hmac) {
+        ctest_test(desc, 0);
+        return;
+    }
+
+    hmac_write(hmac, msg, strlen(msg));
+    ctest_test("hmac read", hmac_read(hmac, result, sizeof(result)) == len);
+    refobject_unref(hmac);
+
+    hex(result_hex, result, len);
+    ctest_test(desc, strcmp(result_hex, expected) == 0);
+}
+
+static void test_throughput(digest_algo_t algo)
+{
+    static char block[65536];
+    unsigned char result[64];
+    struct timespec start, end;
+    double seconds;
+    digest_t *digest;
+    size_t i;
+
+    digest = digest_new(algo);
+    if (!digest)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < 256; i++)
+        digest_write(digest, block, sizeof(block));
+    digest_read(digest, result, sizeof(result));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    refobject_unref(digest);
+
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    ctest_diagnostic_printf("%s: 16 MiB in %.3fs (%.1f MiB/s)", digest_algo_id2str(algo), seconds,
+            seconds > 0. ? 16. / seconds : 0.);
+}
+
+int main (void)
+{
+    char key[200];
+
+    ctest_init();
+
+    test_digest(DIGEST_ALGO_MD5, "abc", 1, "900150983cd24fb0d6963f7d28e17f72");
+    test_digest(DIGEST_ALGO_SHA3_224, "abc", 1, "e642824c3f8cf24ad09234ee7d3c766fc9a3a5168d0c94ad73b46fdf");
+    test_digest(DIGEST_ALGO_SHA3_256, "abc", 1, "3a985da74fe225b2045c172d6bd390bd855f086e3e9d525b46bfe24511431532");
+    test_digest(DIGEST_ALGO_SHA3_384, "abc", 1, "ec01498288516fc926459f58e2c6ad8df9b473cb0fc08c2596da7cf0e49be4b298d88cea927ac7f539f1edf228376d25");
+    test_digest(DIGEST_ALGO_SHA3_512, "abc", 1, "b751850b1a57168a5693cd924b6b096e08f621827444f70d884f5d0240d2712e10e116e9192af3c91a7ec57647e3934057340b4cf408d5a56592f8274eec53f0");
+    test_digest(DIGEST_ALGO_SHA3_256, "a", 1000000, "5c8875ae474a3634ba4fd55ec85bffd661f32aca75c6d699d0cdcb6c115891c1");
+
+    test_copy();
+
+    test_hmac(DIGEST_ALGO_SHA3_256, "key", 3, "The quick brown fox jumps over the lazy dog",
+            "8c6e0683409427f8931711b10ca92a506eb1fafa48fadd66d76126f47ac2c333");
+    /* key longer than the block size */
+    memset(key, 'k', sizeof(key));
+    test_hmac(DIGEST_ALGO_SHA3_512, key, sizeof(key), "The quick brown fox jumps over the lazy dog",
+            "0733f1f947887d6ad5deaca79b8e69ee625674ffa7cf7cc18c4ca7fbafe7efc44aa1f5ed233ce9af6b9252be19368e7247a938f694164e34f7311ca2830ad5a3");
+
+    test_throughput(DIGEST_ALGO_MD5);
+    test_throughput(DIGEST_ALGO_SHA3_256);
+    test_throughput(DIGEST_ALGO_SHA3_512);
+
+    ctest_fin();
+
+    return 0;
+}
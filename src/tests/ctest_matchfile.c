@@ -0,0 +1,171 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ctest_lib.h"
+
+#include "../src/matchfile.h"
+#include "common/thread/thread.h"
+
+/* logging.o and util.o are not linked in, matchfile.o only needs these */
+int errorlog = -1;
+
+int get_line(FILE *file, char *buf, size_t siz)
+{
+    if (fgets(buf, (int)siz, file)) {
+        size_t len = strlen(buf);
+        if (len > 0 && buf[len-1] == '\n') {
+            buf[--len] = 0;
+            if (len > 0 && buf[len-1] == '\r')
+                buf[--len] = 0;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/* writes lines to a temporary file and loads it */
+static matchfile_t *load(const char *lines)
+{
+    char filename[] = "/tmp/ctest_matchfile.XXXXXX";
+    matchfile_t *ret = NULL;
+    int fd = mkstemp(filename);
+    FILE *file;
+
+    if (fd == -1)
+        return NULL;
+
+    file = fdopen(fd, "w");
+    if (!file) {
+        close(fd);
+    } else {
+        fputs(lines, file);
+        if (fclose(file) == 0)
+            ret = matchfile_new(filename);
+    }
+    unlink(filename);
+
+    return ret;
+}
+
+static void test_prefixes(void)
+{
+    matchfile_t *file = load(
+            "# overlapping networks and hosts\n"
+            "10.0.0.0/8\n"
+            "10.1.0.0/16\n"
+            "10.1.2.3/32\n"
+            "192.168.1.0/24\n"
+            "2001:db8::/32\n"
+            "2001:db8:1::/48\n"
+            "2001:db8:1::1/128\n"
+            "fe80::1\n"
+            "198.51.100.7\n");
+
+    ctest_test("file loaded", file != NULL);
+    if (!file)
+        return;
+
+    ctest_test("v4 host in a /32 within a /16 within a /8", matchfile_match(file, "10.1.2.3") == 1);
+    ctest_test("v4 next to the /32, in the /16", matchfile_match(file, "10.1.2.4") == 1);
+    ctest_test("v4 in the /8 only", matchfile_match(file, "10.200.0.1") == 1);
+    ctest_test("v4 next to the /8", matchfile_match(file, "11.0.0.1") == 0);
+    ctest_test("v4 at the end of a /24", matchfile_match(file, "192.168.1.255") == 1);
+    ctest_test("v4 next to the /24", matchfile_match(file, "192.168.2.1") == 0);
+    ctest_test("v4 host without prefix", matchfile_match(file, "198.51.100.7") == 1);
+    ctest_test("v4 next to a host", matchfile_match(file, "198.51.100.8") == 0);
+    ctest_test("v4-mapped v6", matchfile_match(file, "::ffff:10.0.0.1") == 1);
+    ctest_test("v6 in a /128 within a /48 within a /32", matchfile_match(file, "2001:db8:1::1") == 1);
+    ctest_test("v6 in the /48", matchfile_match(file, "2001:db8:1::2") == 1);
+    ctest_test("v6 in the /32 only", matchfile_match(file, "2001:db8:ffff::1") == 1);
+    ctest_test("v6 next to the /32", matchfile_match(file, "2001:db9::1") == 0);
+    ctest_test("v6 host without prefix", matchfile_match(file, "fe80::1") == 1);
+    ctest_test("v6 next to a host", matchfile_match(file, "fe80::2") == 0);
+    ctest_test("a network is not a key", matchfile_match(file, "10.0.0.0/8") == 0);
+
+    matchfile_release(file);
+}
+
+static void test_default_routes(void)
+{
+    matchfile_t *file;
+
+    file = load("0.0.0.0/0\n");
+    ctest_test("v4 /0 loaded", file != NULL);
+    ctest_test("v4 /0 matches any v4", matchfile_match(file, "203.0.113.1") == 1 && matchfile_match(file, "0.0.0.0") == 1);
+    ctest_test("v4 /0 does not match v6", matchfile_match(file, "2001:db8::1") == 0);
+    matchfile_release(file);
+
+    file = load("::/0\n");
+    ctest_test("v6 /0 loaded", file != NULL);
+    ctest_test("v6 /0 matches v6", matchfile_match(file, "2001:db8::1") == 1 && matchfile_match(file, "::") == 1);
+    ctest_test("v6 /0 matches v4", matchfile_match(file, "203.0.113.1") == 1);
+    matchfile_release(file);
+}
+
+static void test_strings(void)
+{
+    matchfile_t *file = load(
+            "# a comment\n"
+            "\n"
+            "some-user\r\n"
+            "Mozilla/5.0\n"
+            "10.0.0.0/8\n");
+
+    ctest_test("file loaded", file != NULL);
+    if (!file)
+        return;
+
+    ctest_test("plain string", matchfile_match(file, "some-user") == 1);
+    ctest_test("string with a slash", matchfile_match(file, "Mozilla/5.0") == 1);
+    ctest_test("strings match exactly", matchfile_match(file, "some") == 0 && matchfile_match(file, "some-user2") == 0);
+    ctest_test("comments are skipped", matchfile_match(file, "# a comment") == 0);
+    ctest_test("empty lines are skipped", matchfile_match(file, "") == 0);
+    ctest_test("prefixes along with strings", matchfile_match(file, "10.9.8.7") == 1);
+
+    matchfile_release(file);
+}
+
+static void test_allow_deny(void)
+{
+    matchfile_t *allow = load("10.0.0.0/8\n");
+    matchfile_t *deny = load("10.1.0.0/16\n");
+
+    ctest_test("no file matches nothing", matchfile_match(NULL, "10.0.0.1") == -1);
+    ctest_test("allowed", matchfile_match_allow_deny(allow, deny, "10.2.0.1") == 1);
+    ctest_test("denied within allowed", matchfile_match_allow_deny(allow, deny, "10.1.0.1") == 0);
+    ctest_test("not allowed", matchfile_match_allow_deny(allow, NULL, "192.0.2.1") == 0);
+    ctest_test("no lists pass all", matchfile_match_allow_deny(NULL, NULL, "192.0.2.1") == 1);
+
+    matchfile_release(allow);
+    matchfile_release(deny);
+}
+
+int main (void)
+{
+    ctest_init();
+
+    thread_initialize();
+
+    test_prefixes();
+    test_default_routes();
+    test_strings();
+    test_allow_deny();
+
+    thread_shutdown();
+
+    ctest_fin();
+
+    return 0;
+}
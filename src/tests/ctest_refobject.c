@@ -15,6 +15,7 @@
 #include "ctest_lib.h"
 
 #include "../refobject.h"
+#include "common/thread/thread.h"
 
 static void test_ptr(void)
 {
@@ -39,6 +40,20 @@ static void test_create_ref_unref(void)
     ctest_test("un-referenced (2 of 2)", refobject_unref(a) == 0);
 }
 
+static void test_try_ref(void)
+{
+    refobject_base_t *a;
+
+    a = refobject_new(refobject_base_t);
+    ctest_test("refobject created", !REFOBJECT_IS_NULL(a));
+
+    ctest_test("referenced", refobject_try_ref(a) == 0);
+    ctest_test("un-referenced (1 of 2)", refobject_unref(a) == 0);
+    ctest_test("un-referenced (2 of 2)", refobject_unref(a) == 0);
+
+    ctest_test("NULL not referenced", refobject_try_ref(REFOBJECT_NULL) == -1);
+}
+
 static void test_typename(void)
 {
     refobject_base_t *a;
@@ -226,6 +241,42 @@ static void test_freecb(void)
     ctest_test("freecb called", test_freecb__called == 1);
 }
 
+/* enough to overlap, cbench_refobject measures how fast this is */
+#define TEST_THREADS_COUNT      4
+#define TEST_THREADS_ROUNDS     10000
+
+static void *test_threads__run(void *arg)
+{
+    refobject_base_t *a = arg;
+    size_t i;
+
+    for (i = 0; i < TEST_THREADS_ROUNDS; i++) {
+        refobject_ref(a);
+        refobject_unref(a);
+    }
+
+    return NULL;
+}
+
+static void test_threads(void)
+{
+    refobject_base_t *a;
+    thread_type *threads[TEST_THREADS_COUNT];
+    size_t i;
+
+    a = refobject_new(refobject_base_t);
+    ctest_test("refobject created", !REFOBJECT_IS_NULL(a));
+
+    for (i = 0; i < TEST_THREADS_COUNT; i++)
+        threads[i] = thread_create("refobject test", test_threads__run, a, THREAD_ATTACHED);
+    for (i = 0; i < TEST_THREADS_COUNT; i++) {
+        if (threads[i])
+            thread_join(threads[i]);
+    }
+
+    ctest_test("un-referenced after concurrent ref/unref", refobject_unref(a) == 0);
+}
+
 int main (void)
 {
     ctest_init();
@@ -238,6 +289,7 @@ int main (void)
     }
 
     test_create_ref_unref();
+    test_try_ref();
 
     test_typename();
     test_valid();
@@ -249,6 +301,10 @@ int main (void)
     test_associated();
     test_freecb();
 
+    thread_initialize();
+    test_threads();
+    thread_shutdown();
+
     ctest_fin();
 
     return 0;
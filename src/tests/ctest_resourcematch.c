@@ -12,6 +12,7 @@
 
 #include <stddef.h> /* for NULL */
 #include <stdio.h> /* for snprintf() */
+#include <string.h>
 
 #include "ctest_lib.h"
 
@@ -145,6 +146,42 @@ static inline void print_extract(resourcematch_extract_t *extract)
     }
 }
 
+/* Runs the test with a compiled pattern, which must give the same result
+ * and groups as the extract of resourcematch_match() */
+static void run_test_compiled(const struct test *test, resourcematch_extract_t *expected)
+{
+    char name[128];
+    resourcematch_t *matcher = resourcematch_compile(test->pattern);
+    resourcematch_group_t group[8];
+    resourcematch_extract_t extract = {8, group};
+    resourcematch_result_t ret;
+    int ok = 1;
+    size_t i;
+
+    ret = resourcematch_exec(matcher, test->string, &extract);
+
+    if (ret == RESOURCEMATCH_MATCH && expected) {
+        if (extract.groups != expected->groups) {
+            ok = 0;
+        } else {
+            for (i = 0; i < extract.groups; i++) {
+                if (group[i].type != expected->group[i].type) {
+                    ok = 0;
+                } else if (group[i].type == 's') {
+                    ok = ok && strcmp(group[i].result.string, expected->group[i].result.string) == 0;
+                } else {
+                    ok = ok && group[i].result.lli == expected->group[i].result.lli;
+                }
+            }
+        }
+    }
+
+    snprintf(name, sizeof(name), "pattern \"%s\" and string \"%s\" compiled", test->pattern, test->string);
+    ctest_test(name, test->expected_result == ret && ok);
+
+    resourcematch_free(matcher);
+}
+
 static void run_test(const struct test *test)
 {
     resourcematch_result_t ret;
@@ -153,6 +190,7 @@ static void run_test(const struct test *test)
     run_test_base(test, NULL);
 
     ret = run_test_base(test, &extract);
+    run_test_compiled(test, ret == RESOURCEMATCH_MATCH ? extract : NULL);
     if (extract) {
         if (ret == RESOURCEMATCH_MATCH)
             print_extract(extract);
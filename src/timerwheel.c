@@ -0,0 +1,198 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+
+#include "timerwheel.h"
+
+/* every level has 64 slots, each 64 times as wide as those of the level
+ * below, so four levels cover 2^24 ticks, which is over 194 days in
+ * seconds. Entries further out wait in the last slot of the top level. */
+#define TIMERWHEEL_BITS     6
+#define TIMERWHEEL_SLOTS    (1U << TIMERWHEEL_BITS)
+#define TIMERWHEEL_MASK     (TIMERWHEEL_SLOTS - 1)
+#define TIMERWHEEL_LEVELS   4
+#define TIMERWHEEL_RANGE    (UINT64_C(1) << (TIMERWHEEL_BITS * TIMERWHEEL_LEVELS))
+
+struct timerwheel_tag {
+    uint64_t now;
+    size_t count;
+    /* all lists are circular with the head as a sentinel */
+    timerwheel_entry_t expired;
+    timerwheel_entry_t slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+};
+
+static inline void timerwheel_list_init(timerwheel_entry_t *head)
+{
+    head->prev = head;
+    head->next = head;
+}
+
+static inline void timerwheel_list_append(timerwheel_entry_t *head, timerwheel_entry_t *entry)
+{
+    entry->next = head;
+    entry->prev = head->prev;
+    head->prev->next = entry;
+    head->prev = entry;
+}
+
+static inline void timerwheel_list_unlink(timerwheel_entry_t *entry)
+{
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+/* puts entry into the slot its deadline falls into, relative to now */
+static void timerwheel_place(timerwheel_t *self, timerwheel_entry_t *entry)
+{
+    uint64_t delta;
+    unsigned int level;
+
+    if (entry->deadline <= self->now) {
+        timerwheel_list_append(&(self->expired), entry);
+        return;
+    }
+
+    delta = entry->deadline - self->now;
+    for (level = 0; level < TIMERWHEEL_LEVELS; level++) {
+        if (delta < (UINT64_C(1) << (TIMERWHEEL_BITS * (level + 1)))) {
+            timerwheel_list_append(&(self->slots[level][(entry->deadline >> (TIMERWHEEL_BITS * level)) & TIMERWHEEL_MASK]), entry);
+            return;
+        }
+    }
+
+    /* the slot seen last, it is placed again from there */
+    level = TIMERWHEEL_LEVELS - 1;
+    timerwheel_list_append(&(self->slots[level][((self->now >> (TIMERWHEEL_BITS * level)) - 1) & TIMERWHEEL_MASK]), entry);
+}
+
+/* places all entries of the list again */
+static void timerwheel_replace_list(timerwheel_t *self, timerwheel_entry_t *head)
+{
+    timerwheel_entry_t list;
+
+    if (head->next == head)
+        return;
+
+    /* move them away first, some may end up in the same slot again */
+    list.next = head->next;
+    list.prev = head->prev;
+    list.next->prev = &list;
+    list.prev->next = &list;
+    timerwheel_list_init(head);
+
+    while (list.next != &list) {
+        timerwheel_entry_t *entry = list.next;
+
+        timerwheel_list_unlink(entry);
+        timerwheel_place(self, entry);
+    }
+}
+
+static void timerwheel_advance(timerwheel_t *self, uint64_t now)
+{
+    unsigned int level, slot;
+
+    if (now <= self->now)
+        return;
+
+    /* after a jump the whole wheel would be walked more than once */
+    if (now - self->now >= TIMERWHEEL_RANGE) {
+        self->now = now;
+        for (level = 0; level < TIMERWHEEL_LEVELS; level++)
+            for (slot = 0; slot < TIMERWHEEL_SLOTS; slot++)
+                timerwheel_replace_list(self, &(self->slots[level][slot]));
+        return;
+    }
+
+    while (self->now < now) {
+        timerwheel_entry_t *head;
+
+        self->now++;
+
+        /* move down entries from the coarser slot the new tick starts */
+        for (level = 1; level < TIMERWHEEL_LEVELS; level++) {
+            if (self->now & ((UINT64_C(1) << (TIMERWHEEL_BITS * level)) - 1))
+                break;
+            timerwheel_replace_list(self, &(self->slots[level][(self->now >> (TIMERWHEEL_BITS * level)) & TIMERWHEEL_MASK]));
+        }
+
+        head = &(self->slots[0][self->now & TIMERWHEEL_MASK]);
+        while (head->next != head) {
+            timerwheel_entry_t *entry = head->next;
+
+            timerwheel_list_unlink(entry);
+            timerwheel_list_append(&(self->expired), entry);
+        }
+    }
+}
+
+timerwheel_t *timerwheel_new(uint64_t now)
+{
+    timerwheel_t *self = calloc(1, sizeof(*self));
+    unsigned int level, slot;
+
+    if (!self)
+        return NULL;
+
+    self->now = now;
+    timerwheel_list_init(&(self->expired));
+    for (level = 0; level < TIMERWHEEL_LEVELS; level++)
+        for (slot = 0; slot < TIMERWHEEL_SLOTS; slot++)
+            timerwheel_list_init(&(self->slots[level][slot]));
+
+    return self;
+}
+
+void timerwheel_free(timerwheel_t *self)
+{
+    free(self);
+}
+
+void timerwheel_add(timerwheel_t *self, timerwheel_entry_t *entry, uint64_t deadline)
+{
+    timerwheel_remove(self, entry);
+
+    entry->deadline = deadline;
+    timerwheel_place(self, entry);
+    self->count++;
+}
+
+void timerwheel_remove(timerwheel_t *self, timerwheel_entry_t *entry)
+{
+    if (!timerwheel_is_added(entry))
+        return;
+
+    timerwheel_list_unlink(entry);
+    self->count--;
+}
+
+timerwheel_entry_t *timerwheel_expire(timerwheel_t *self, uint64_t now)
+{
+    timerwheel_entry_t *entry;
+
+    timerwheel_advance(self, now);
+
+    if (self->expired.next == &(self->expired))
+        return NULL;
+
+    entry = self->expired.next;
+    timerwheel_list_unlink(entry);
+    self->count--;
+
+    return entry;
+}
+
+size_t timerwheel_count(timerwheel_t *self)
+{
+    return self->count;
+}
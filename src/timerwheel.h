@@ -0,0 +1,51 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* timerwheel.h
+ *
+ * A hierarchical timer wheel for many deadlines of which most are removed
+ * again before they pass, like the timeouts of clients still sending their
+ * request. Adding and removing an entry takes constant time, expiring only
+ * costs for the entries that expire plus moving some down to a finer level
+ * now and then. Time is counted in ticks of whatever unit the caller uses.
+ * Entries are embedded in the structures of the caller and must be zeroed
+ * before first use. Nothing here is thread safe.
+ */
+
+#ifndef __TIMERWHEEL_H__
+#define __TIMERWHEEL_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct timerwheel_entry_tag timerwheel_entry_t;
+typedef struct timerwheel_tag timerwheel_t;
+
+struct timerwheel_entry_tag {
+    timerwheel_entry_t *prev;
+    timerwheel_entry_t *next;
+    uint64_t deadline;
+};
+
+timerwheel_t *      timerwheel_new(uint64_t now);
+/* entries still added are left alone */
+void                timerwheel_free(timerwheel_t *self);
+/* Adds entry to expire at deadline, or moves it there if already added. */
+void                timerwheel_add(timerwheel_t *self, timerwheel_entry_t *entry, uint64_t deadline);
+/* Does nothing if entry is not added. */
+void                timerwheel_remove(timerwheel_t *self, timerwheel_entry_t *entry);
+/* Removes and returns an entry whose deadline is not after now, or returns
+ * NULL if there is none. Called repeatedly to get all of them. */
+timerwheel_entry_t *timerwheel_expire(timerwheel_t *self, uint64_t now);
+size_t              timerwheel_count(timerwheel_t *self);
+
+static inline bool  timerwheel_is_added(const timerwheel_entry_t *entry)
+{
+    return entry->next != NULL;
+}
+
+#endif  /* __TIMERWHEEL_H__ */
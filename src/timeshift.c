@@ -0,0 +1,297 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include "common/thread/thread.h"
+#include "common/timing/timing.h"
+
+#include "timeshift.h"
+#include "atomic.h"
+
+#include "logging.h"
+#define CATMODULE "timeshift"
+
+/* how often (in ms) a sync point is noted, and the most noted at once */
+#define TIMESHIFT_MARK_INTERVAL     1000
+#define TIMESHIFT_MAX_MARKS         (24*3600)
+/* listeners are not started on the oldest 1/TIMESHIFT_HEADROOM of the ring,
+ * so they do not fall off its end right away */
+#define TIMESHIFT_HEADROOM          8
+
+typedef struct {
+    uint64_t time;
+    uint64_t position;
+} timeshift_mark_t;
+
+struct timeshift_tag {
+    char *filename;
+    int fd;
+    char *data;
+    uint64_t size;
+
+    /* stream offset of the first byte ever written */
+    uint64_t begin;
+    int started;
+    /* end of the data being written and of the data completely written.
+     * Only the source thread changes them. Readers check reserved after
+     * reading, anything less than size bytes before it is intact. */
+    volatile uint64_t reserved;
+    volatile uint64_t written;
+
+    /* all below are protected by lock */
+    mutex_t lock;
+    timeshift_mark_t *marks;
+    size_t marks_head;
+    size_t marks_count;
+};
+
+#ifndef _WIN32
+timeshift_t *timeshift_open(const char *filename, uint64_t size)
+{
+    timeshift_t *self = calloc(1, sizeof(*self));
+    int err;
+
+    if (!self) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    self->fd = -1;
+    self->data = MAP_FAILED;
+    self->size = size;
+    self->filename = strdup(filename);
+    self->marks = calloc(TIMESHIFT_MAX_MARKS, sizeof(*self->marks));
+    if (!self->filename || !self->marks) {
+        err = ENOMEM;
+        goto fail;
+    }
+
+    self->fd = open(filename, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if (self->fd < 0 || ftruncate(self->fd, size) != 0) {
+        err = errno;
+        goto fail;
+    }
+    self->data = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, self->fd, 0);
+    if (self->data == MAP_FAILED) {
+        err = errno;
+        goto fail;
+    }
+
+    thread_mutex_create(&self->lock);
+    ICECAST_LOG_DEBUG("Keeping %" PRIu64 " bytes of stream in \"%s\"", size, filename);
+
+    return self;
+
+fail:
+    if (self->fd >= 0)
+        close(self->fd);
+    free(self->marks);
+    free(self->filename);
+    free(self);
+    errno = err;
+    return NULL;
+}
+
+void timeshift_close(timeshift_t *self)
+{
+    if (!self)
+        return;
+
+    munmap(self->data, self->size);
+    close(self->fd);
+    thread_mutex_destroy(&self->lock);
+    free(self->marks);
+    free(self->filename);
+    free(self);
+}
+#else
+timeshift_t *timeshift_open(const char *filename, uint64_t size)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+void timeshift_close(timeshift_t *self)
+{
+}
+#endif
+
+/* copy between the ring and buffer, from or to the given stream offset */
+static void timeshift_copy(timeshift_t *self, uint64_t position, char *buffer, size_t len, int to_ring)
+{
+    while (len) {
+        size_t offset = position % self->size;
+        size_t piece = self->size - offset;
+
+        if (piece > len)
+            piece = len;
+        if (to_ring) {
+            memcpy(self->data + offset, buffer, piece);
+        } else {
+            memcpy(buffer, self->data + offset, piece);
+        }
+        position += piece;
+        buffer += piece;
+        len -= piece;
+    }
+}
+
+void timeshift_write(timeshift_t *self, refbuf_t *refbuf)
+{
+    uint64_t now;
+    size_t len = refbuf->len;
+    char *data = refbuf->data;
+
+    if (!self->started) {
+        /* readers only look at begin once something was written */
+        self->begin = refbuf->stream_offset;
+        atomic_u64_add(&self->reserved, self->begin);
+        atomic_u64_add(&self->written, self->begin);
+        self->started = 1;
+    }
+
+    /* only the last size bytes of a huge buffer fit */
+    if (len > self->size) {
+        data += len - self->size;
+        atomic_u64_add(&self->reserved, len - self->size);
+        atomic_u64_add(&self->written, len - self->size);
+        len = self->size;
+    }
+
+    atomic_u64_add(&self->reserved, len);
+    timeshift_copy(self, atomic_u64_load(&self->written), data, len, 1);
+    atomic_u64_add(&self->written, len);
+
+    if (!refbuf->sync_point)
+        return;
+
+    now = timing_get_time();
+    thread_mutex_lock(&self->lock);
+    if (self->marks_count == 0 ||
+            now >= self->marks[(self->marks_head + self->marks_count - 1) % TIMESHIFT_MAX_MARKS].time + TIMESHIFT_MARK_INTERVAL) {
+        timeshift_mark_t *mark;
+
+        if (self->marks_count == TIMESHIFT_MAX_MARKS) {
+            self->marks_head = (self->marks_head + 1) % TIMESHIFT_MAX_MARKS;
+            self->marks_count--;
+        }
+        mark = &(self->marks[(self->marks_head + self->marks_count) % TIMESHIFT_MAX_MARKS]);
+        mark->time = now;
+        mark->position = refbuf->stream_offset + refbuf->sync_offset;
+        self->marks_count++;
+    }
+    thread_mutex_unlock(&self->lock);
+}
+
+/* oldest position that can still be read */
+static uint64_t timeshift_oldest(timeshift_t *self)
+{
+    uint64_t reserved = atomic_u64_load(&self->reserved);
+
+    if (reserved < self->begin + self->size)
+        return self->begin;
+    return reserved - self->size;
+}
+
+int timeshift_seek(timeshift_t *self, unsigned int seconds, uint64_t *position)
+{
+    uint64_t now = timing_get_time();
+    uint64_t target = now > (uint64_t)seconds * 1000 ? now - (uint64_t)seconds * 1000 : 0;
+    uint64_t oldest;
+    int ret = -1;
+    size_t i;
+
+    if (!atomic_u64_load(&self->written))
+        return -1;
+
+    oldest = timeshift_oldest(self);
+    if (oldest > self->begin)
+        oldest += self->size / TIMESHIFT_HEADROOM;
+
+    thread_mutex_lock(&self->lock);
+    for (i = 0; i < self->marks_count; i++) {
+        const timeshift_mark_t *mark = &(self->marks[(self->marks_head + i) % TIMESHIFT_MAX_MARKS]);
+
+        if (mark->position < oldest)
+            continue;
+        *position = mark->position;
+        ret = 0;
+        if (mark->time >= target)
+            break;
+    }
+    thread_mutex_unlock(&self->lock);
+
+    return ret;
+}
+
+/* moves a reader the ring wrapped past onto the oldest sync point */
+static void timeshift_rebase(timeshift_t *self, uint64_t *position)
+{
+    if (timeshift_seek(self, UINT_MAX, position) < 0)
+        *position = atomic_u64_load(&self->written);
+}
+
+ssize_t timeshift_read(timeshift_t *self, uint64_t *position, char *buffer, size_t len)
+{
+    uint64_t written = atomic_u64_load(&self->written);
+
+    if (*position >= written)
+        return 0;
+    if (*position < timeshift_oldest(self)) {
+        timeshift_rebase(self, position);
+        return -1;
+    }
+
+    if (len > written - *position)
+        len = written - *position;
+    timeshift_copy(self, *position, buffer, len, 0);
+
+    /* the source may have written over it while it was copied, the copy
+     * must be done before reserved is looked at again */
+    atomic_fence_acquire();
+    if (*position < timeshift_oldest(self)) {
+        timeshift_rebase(self, position);
+        return -1;
+    }
+
+    *position += len;
+    return len;
+}
+
+unsigned int timeshift_get_duration(timeshift_t *self)
+{
+    uint64_t oldest = timeshift_oldest(self);
+    unsigned int ret = 0;
+    size_t i;
+
+    thread_mutex_lock(&self->lock);
+    for (i = 0; i < self->marks_count; i++) {
+        const timeshift_mark_t *mark = &(self->marks[(self->marks_head + i) % TIMESHIFT_MAX_MARKS]);
+
+        if (mark->position >= oldest) {
+            ret = (timing_get_time() - mark->time) / 1000;
+            break;
+        }
+    }
+    thread_mutex_unlock(&self->lock);
+
+    return ret;
+}
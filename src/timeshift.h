@@ -0,0 +1,47 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* timeshift.h
+ *
+ * Keeps the last part of a stream in a memory mapped file so listeners can
+ * join it some time in the past, far beyond what the queue holds. The
+ * source thread appends every queued buffer to the ring, positions in it
+ * are stream offsets as in refbuf->stream_offset. Listeners copy from the
+ * ring into their own buffer and check afterwards that the data was not
+ * overwritten meanwhile, so no lock is needed for reading. Once a second
+ * the position of a sync point is noted to find where to start a listener
+ * that wants to go back a given number of seconds.
+ */
+
+#ifndef __TIMESHIFT_H__
+#define __TIMESHIFT_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "refbuf.h"
+
+typedef struct timeshift_tag timeshift_t;
+
+/* Creates filename, or truncates it, to size bytes and maps it. Returns NULL
+ * on error with errno set. */
+timeshift_t *timeshift_open(const char *filename, uint64_t size);
+/* Appends a queued buffer. Only called by the source thread. */
+void         timeshift_write(timeshift_t *self, refbuf_t *refbuf);
+/* Sets *position to the sync point closest to the given number of seconds
+ * back, or to the oldest one still held. Returns -1 if there is none. */
+int          timeshift_seek(timeshift_t *self, unsigned int seconds, uint64_t *position);
+/* Copies up to len bytes from *position and advances it. Returns the number
+ * of bytes, 0 if there is nothing past *position yet or -1 if the data at
+ * *position has been overwritten. *position is then moved to the oldest sync
+ * point, or to the end if there is none. */
+ssize_t      timeshift_read(timeshift_t *self, uint64_t *position, char *buffer, size_t len);
+/* number of seconds that can be gone back */
+unsigned int timeshift_get_duration(timeshift_t *self);
+/* Unmaps and closes the file. No listener may read from it anymore. */
+void         timeshift_close(timeshift_t *self);
+
+#endif  /* __TIMESHIFT_H__ */
@@ -17,12 +17,25 @@
 #ifdef HAVE_OPENSSL
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
 #endif
 
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <time.h>
+
+#include "common/thread/thread.h"
+#include "common/avl/avl.h"
 
 #include "tls.h"
+#include "stats.h"
 
 #include "logging.h"
 #define CATMODULE "tls"
@@ -52,14 +65,37 @@ struct tls_tag {
     size_t refc;
     SSL *ssl;
     tls_ctx_t *ctx;
+    /* set once the handshake was counted in the stats */
+    int counted;
 };
 
+/* Keys for session tickets. They are kept here rather than in a context,
+ * as the context is created again on every reload and all tickets handed
+ * out would become useless. Tickets made with the previous key are still
+ * accepted, and are replaced with ones made with the current key.
+ */
+typedef struct {
+    unsigned char name[16];
+    unsigned char hmac_key[32];
+    unsigned char aes_key[32];
+    time_t created;
+} tls_ticket_key_t;
+
+/* protects everything below */
+static mutex_t tls_ticket_lock;
+static tls_ticket_key_t tls_ticket_keys[2];
+static size_t tls_ticket_keys_count;
+static time_t tls_ticket_lifetime;
+
 void       tls_initialize(void)
 {
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
     SSL_load_error_strings(); /* readable error messages */
     SSL_library_init(); /* initialize library */
 #endif
+    thread_mutex_create(&tls_ticket_lock);
+    tls_ticket_keys_count = 0;
+    tls_ticket_lifetime = 0;
 }
 
 void       tls_shutdown(void)
@@ -67,6 +103,99 @@ void       tls_shutdown(void)
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
     ERR_free_strings();
 #endif
+    thread_mutex_lock(&tls_ticket_lock);
+    OPENSSL_cleanse(tls_ticket_keys, sizeof(tls_ticket_keys));
+    tls_ticket_keys_count = 0;
+    thread_mutex_unlock(&tls_ticket_lock);
+    thread_mutex_destroy(&tls_ticket_lock);
+}
+
+/* Copies the key to encrypt a new ticket with, or the one named key_name,
+ * to *key. Returns 1 for the current key, 2 for the previous one, which
+ * makes OpenSSL issue a new ticket, and 0 if there is none. */
+static int tls_ticket_key_get(const unsigned char *key_name, tls_ticket_key_t *key)
+{
+    time_t now = time(NULL);
+    size_t i;
+    int ret = 0;
+
+    thread_mutex_lock(&tls_ticket_lock);
+    if (!key_name && (tls_ticket_keys_count == 0 || now >= tls_ticket_keys[0].created + tls_ticket_lifetime)) {
+        tls_ticket_keys[1] = tls_ticket_keys[0];
+        if (RAND_bytes(tls_ticket_keys[0].name, sizeof(tls_ticket_keys[0].name)) == 1 &&
+            RAND_bytes(tls_ticket_keys[0].hmac_key, sizeof(tls_ticket_keys[0].hmac_key)) == 1 &&
+            RAND_bytes(tls_ticket_keys[0].aes_key, sizeof(tls_ticket_keys[0].aes_key)) == 1) {
+            tls_ticket_keys[0].created = now;
+            if (tls_ticket_keys_count < 2)
+                tls_ticket_keys_count++;
+            ICECAST_LOG_DEBUG("Created new session ticket key");
+        } else {
+            ICECAST_LOG_ERROR("Can not create session ticket key, no tickets are issued");
+            tls_ticket_keys[0] = tls_ticket_keys[1];
+            thread_mutex_unlock(&tls_ticket_lock);
+            return 0;
+        }
+    }
+
+    for (i = 0; i < tls_ticket_keys_count; i++) {
+        /* keys older than two lifetimes are expired */
+        if (now >= tls_ticket_keys[i].created + 2 * tls_ticket_lifetime)
+            break;
+        if (!key_name || memcmp(key_name, tls_ticket_keys[i].name, sizeof(tls_ticket_keys[i].name)) == 0) {
+            *key = tls_ticket_keys[i];
+            ret = i + 1;
+            break;
+        }
+    }
+    thread_mutex_unlock(&tls_ticket_lock);
+
+    return ret;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int tls_ticket_key_cb(SSL *ssl, unsigned char key_name[16], unsigned char iv[EVP_MAX_IV_LENGTH], EVP_CIPHER_CTX *cipher, EVP_MAC_CTX *mac, int enc)
+#else
+static int tls_ticket_key_cb(SSL *ssl, unsigned char key_name[16], unsigned char iv[EVP_MAX_IV_LENGTH], EVP_CIPHER_CTX *cipher, HMAC_CTX *mac, int enc)
+#endif
+{
+    tls_ticket_key_t key;
+    int ret;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    OSSL_PARAM params[3];
+#endif
+
+    (void)ssl;
+
+    ret = tls_ticket_key_get(enc ? NULL : key_name, &key);
+    if (ret == 0)
+        return 0;
+
+    if (enc) {
+        memcpy(key_name, key.name, sizeof(key.name));
+        if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1 ||
+            EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key.aes_key, iv) != 1)
+            ret = -1;
+    } else {
+        if (EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key.aes_key, iv) != 1)
+            ret = -1;
+    }
+
+    if (ret > 0) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac_key, sizeof(key.hmac_key));
+        params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+        params[2] = OSSL_PARAM_construct_end();
+        if (EVP_MAC_CTX_set_params(mac, params) != 1)
+            ret = -1;
+#else
+        if (HMAC_Init_ex(mac, key.hmac_key, sizeof(key.hmac_key), EVP_sha256(), NULL) != 1)
+            ret = -1;
+#endif
+    }
+
+    OPENSSL_cleanse(&key, sizeof(key));
+
+    return ret;
 }
 
 tls_ctx_t *tls_ctx_new(const char *cert_file, const char *key_file, const char *cipher_list)
@@ -94,6 +223,9 @@ tls_ctx_t *tls_ctx_new(const char *cert_file, const char *key_file, const char *
 #ifdef SSL_OP_NO_COMPRESSION
     ssl_opts |= SSL_OP_NO_COMPRESSION;             // Never use compression
 #endif
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    ssl_opts |= SSL_OP_ENABLE_KTLS;                // Let the kernel encrypt where it can
+#endif
 
     /* Even though this function is called set, it adds the
      * flags to the already existing flags (possibly default
@@ -127,6 +259,40 @@ tls_ctx_t *tls_ctx_new(const char *cert_file, const char *key_file, const char *
     return NULL;
 }
 
+void       tls_ctx_set_sessions(tls_ctx_t *ctx, unsigned int cache_size, unsigned int timeout, unsigned int ticket_key_lifetime)
+{
+    static const unsigned char sid_ctx[] = "icecast";
+
+    if (!ctx)
+        return;
+
+    SSL_CTX_set_session_id_context(ctx->ctx, sid_ctx, sizeof(sid_ctx) - 1);
+    SSL_CTX_set_timeout(ctx->ctx, timeout);
+
+    if (cache_size) {
+        SSL_CTX_set_session_cache_mode(ctx->ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(ctx->ctx, cache_size);
+    } else {
+        SSL_CTX_set_session_cache_mode(ctx->ctx, SSL_SESS_CACHE_OFF);
+    }
+
+    if (ticket_key_lifetime) {
+        thread_mutex_lock(&tls_ticket_lock);
+        tls_ticket_lifetime = ticket_key_lifetime;
+        thread_mutex_unlock(&tls_ticket_lock);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx->ctx, tls_ticket_key_cb);
+#else
+        SSL_CTX_set_tlsext_ticket_key_cb(ctx->ctx, tls_ticket_key_cb);
+#endif
+    } else {
+        SSL_CTX_set_options(ctx->ctx, SSL_OP_NO_TICKET);
+    }
+
+    ICECAST_LOG_DEBUG("TLS session cache holds %u sessions for %u seconds, session tickets are %s",
+                      cache_size, timeout, ticket_key_lifetime ? "enabled" : "disabled");
+}
+
 void       tls_ctx_ref(tls_ctx_t *ctx)
 {
     if (!ctx)
@@ -239,6 +405,22 @@ int        tls_want_io(tls_t *tls)
     }
 }
 
+int        tls_ktls_send_active(tls_t *tls)
+{
+    if (!tls)
+        return -1;
+
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    /* nothing of the handshake must be left to send after switching */
+    if (!SSL_is_init_finished(tls->ssl) || SSL_want(tls->ssl) != SSL_NOTHING)
+        return 0;
+
+    return BIO_get_ktls_send(SSL_get_wbio(tls->ssl)) ? 1 : 0;
+#else
+    return 0;
+#endif
+}
+
 int        tls_got_shutdown(tls_t *tls)
 {
     if (!tls)
@@ -251,12 +433,62 @@ int        tls_got_shutdown(tls_t *tls)
     }
 }
 
+/* counts the handshake once it is done, to see how many were resumed */
+static inline void tls_count_handshake(tls_t *tls)
+{
+    if (tls->counted || !SSL_is_init_finished(tls->ssl))
+        return;
+
+    tls->counted = 1;
+    stats_global_inc(STATS_GLOBAL_TLS_HANDSHAKES);
+    if (SSL_session_reused(tls->ssl))
+        stats_global_inc(STATS_GLOBAL_TLS_RESUMED_SESSIONS);
+}
+
+int        tls_do_handshake(tls_t *tls)
+{
+    int ret;
+
+    if (!tls)
+        return -1;
+
+    ret = SSL_do_handshake(tls->ssl);
+    if (ret == 1) {
+        tls_count_handshake(tls);
+        return 1;
+    }
+
+    switch (SSL_get_error(tls->ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            return 0;
+        break;
+        default:
+            return -1;
+        break;
+    }
+}
+
+int        tls_want_write(tls_t *tls)
+{
+    if (!tls)
+        return -1;
+
+    return SSL_want(tls->ssl) == SSL_WRITING ? 1 : 0;
+}
+
 ssize_t    tls_read(tls_t *tls, void *buffer, size_t len)
 {
+    int ret;
+
     if (!tls)
         return -1;
 
-    return SSL_read(tls->ssl, buffer, len);
+    ret = SSL_read(tls->ssl, buffer, len);
+    if (ret > 0)
+        tls_count_handshake(tls);
+
+    return ret;
 }
 ssize_t    tls_write(tls_t *tls, const void *buffer, size_t len)
 {
@@ -266,6 +498,8 @@ ssize_t    tls_write(tls_t *tls, const void *buffer, size_t len)
         return -1;
 
     ret = SSL_write(tls->ssl, buffer, len);
+    if (ret > 0)
+        tls_count_handshake(tls);
 
     if (ret <= 0) {
         switch (SSL_get_error(tls->ssl, ret)) {
@@ -293,6 +527,9 @@ tls_ctx_t *tls_ctx_new(const char *cert_file, const char *key_file, const char *
 {
     return NULL;
 }
+void       tls_ctx_set_sessions(tls_ctx_t *ctx, unsigned int cache_size, unsigned int timeout, unsigned int ticket_key_lifetime)
+{
+}
 void       tls_ctx_ref(tls_ctx_t *ctx)
 {
 }
@@ -323,11 +560,26 @@ int        tls_want_io(tls_t *tls)
     return -1;
 }
 
+int        tls_ktls_send_active(tls_t *tls)
+{
+    return -1;
+}
+
 int        tls_got_shutdown(tls_t *tls)
 {
     return -1;
 }
 
+int        tls_do_handshake(tls_t *tls)
+{
+    return -1;
+}
+
+int        tls_want_write(tls_t *tls)
+{
+    return -1;
+}
+
 ssize_t    tls_read(tls_t *tls, void *buffer, size_t len)
 {
     return -1;
@@ -27,6 +27,10 @@ void       tls_initialize(void);
 void       tls_shutdown(void);
 
 tls_ctx_t *tls_ctx_new(const char *cert_file, const char *key_file, const char *cipher_list);
+/* Sets how many sessions are cached for how many seconds, and the number of
+ * seconds after which a new key for session tickets is made. 0 disables
+ * the cache or tickets respectively. */
+void       tls_ctx_set_sessions(tls_ctx_t *ctx, unsigned int cache_size, unsigned int timeout, unsigned int ticket_key_lifetime);
 void       tls_ctx_ref(tls_ctx_t *ctx);
 void       tls_ctx_unref(tls_ctx_t *ctx);
 
@@ -38,6 +42,16 @@ void       tls_set_incoming(tls_t *tls);
 void       tls_set_socket(tls_t *tls, sock_t sock);
 
 int        tls_want_io(tls_t *tls);
+/* Returns 1 if the handshake is done and the kernel encrypts all data sent
+ * on the socket (kTLS), so plain data can be written to it directly. */
+int        tls_ktls_send_active(tls_t *tls);
+
+/* Continues the handshake as far as the socket allows. Returns 1 once it is
+ * done, 0 if it has to wait for the socket and -1 on error. */
+int        tls_do_handshake(tls_t *tls);
+/* Returns 1 if the TLS layer waits for the socket to become writable,
+ * 0 if it waits for it to become readable. */
+int        tls_want_write(tls_t *tls);
 
 int        tls_got_shutdown(tls_t *tls);
 
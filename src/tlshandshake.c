@@ -0,0 +1,413 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef HAVE_PIPE
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+#include "common/thread/thread.h"
+#include "common/timing/timing.h"
+#include "common/avl/avl.h"
+
+#include "tlshandshake.h"
+#include "fdpoll.h"
+#include "timerwheel.h"
+#include "atomic.h"
+#include "stats.h"
+#include "cfgfile.h"
+
+#include "logging.h"
+#define CATMODULE "tlshandshake"
+
+/* max number of events handled per wakeup of a worker */
+#define TLSHANDSHAKE_MAX_EVENTS     256
+
+/* how often deadlines are checked while handshakes are running */
+#define TLSHANDSHAKE_TICK           100
+
+/* how long a worker without handshakes sleeps, without a wakeup pipe new
+ * handshakes are only picked up this often */
+#ifdef HAVE_PIPE
+#define TLSHANDSHAKE_IDLE_DELAY     1000
+#else
+#define TLSHANDSHAKE_IDLE_DELAY     20
+#endif
+
+typedef struct tlshandshake_entry_tag {
+    tls_t *tls;
+    sock_t sock;
+    tlshandshake_done_t done;
+    void *userdata;
+    uint64_t start;
+    uint64_t deadline;
+    /* events the socket is armed for, 0 if it is not armed */
+    unsigned int events;
+    timerwheel_entry_t timer;
+    struct tlshandshake_entry_tag *next;
+} tlshandshake_entry_t;
+
+#define ENTRY_OF_TIMER(entry) ((tlshandshake_entry_t *)((char *)(entry) - offsetof(tlshandshake_entry_t, timer)))
+
+typedef struct {
+    thread_type *thread;
+    fdpoll_t *poll;
+#ifdef HAVE_PIPE
+    int wakeup[2];
+#endif
+
+    /* number of handshakes assigned to this worker, including pending ones */
+    volatile unsigned int handshakes;
+
+    /* only used by the worker thread, every running handshake is in it */
+    timerwheel_t *timers;
+
+    mutex_t lock;
+    /* all below are protected by lock */
+    int running;
+    tlshandshake_entry_t *pending;
+} tlshandshake_t;
+
+/* upper bounds in milliseconds of the buckets of the handshake time, the
+ * slower handshakes are counted in tls_handshake_ms_gt_ of the last one */
+static const unsigned int tlshandshake_buckets[] = {5, 10, 25, 50, 100, 250, 500, 1000};
+
+static tlshandshake_t *_workers;
+static size_t _workers_count;
+static int __inited = 0;
+
+static void tlshandshake_wakeup(tlshandshake_t *self)
+{
+#ifdef HAVE_PIPE
+    char c = 0;
+
+    /* if the pipe is full the worker is going to wake up anyway */
+    if (write(self->wakeup[1], &c, 1) < 0)
+        return;
+#else
+    (void)self;
+#endif
+}
+
+static void tlshandshake_drain_wakeup(tlshandshake_t *self)
+{
+#ifdef HAVE_PIPE
+    char buf[64];
+
+    while (read(self->wakeup[0], buf, sizeof(buf)) > 0);
+#else
+    (void)self;
+#endif
+}
+
+static void tlshandshake_count_time(uint64_t duration)
+{
+    size_t i;
+
+    for (i = 0; i < (sizeof(tlshandshake_buckets)/sizeof(*tlshandshake_buckets)); i++) {
+        if (duration <= tlshandshake_buckets[i])
+            break;
+    }
+
+    /* the counters are in the same order, followed by the one for the rest */
+    stats_global_inc(STATS_GLOBAL_TLS_HANDSHAKE_MS_LE_5 + i);
+}
+
+static void tlshandshake_finish(tlshandshake_t *self, tlshandshake_entry_t *entry, int ok)
+{
+    /* the socket may be closed by done */
+    if (entry->events)
+        fdpoll_disarm(self->poll, entry->sock);
+    timerwheel_remove(self->timers, &(entry->timer));
+
+    if (ok) {
+        tlshandshake_count_time(timing_get_time() - entry->start);
+    } else {
+        stats_global_inc(STATS_GLOBAL_TLS_HANDSHAKE_FAILURES);
+    }
+
+    atomic_uint_sub(&self->handshakes, 1);
+    entry->done(entry->userdata, ok);
+    free(entry);
+}
+
+/* continue the handshake and wait for the socket as far as it got */
+static void tlshandshake_step(tlshandshake_t *self, tlshandshake_entry_t *entry)
+{
+    unsigned int events;
+    int ret;
+
+    ret = tls_do_handshake(entry->tls);
+    if (ret != 0) {
+        tlshandshake_finish(self, entry, ret == 1);
+        return;
+    }
+
+    events = tls_want_write(entry->tls) == 1 ? FDPOLL_EVENT_WRITE : FDPOLL_EVENT_READ;
+    if (events == entry->events)
+        return;
+
+    if (fdpoll_arm(self->poll, entry->sock, events, entry) != 0) {
+        ICECAST_LOG_WARN("Can not wait on the TLS handshake of socket %i, dropping it", (int)entry->sock);
+        tlshandshake_finish(self, entry, 0);
+        return;
+    }
+    entry->events = events;
+}
+
+/* start the handshakes handed over since the last pass.
+ * Returns false once the worker has been asked to stop.
+ */
+static int tlshandshake_take_pending(tlshandshake_t *self)
+{
+    tlshandshake_entry_t *pending;
+    int running;
+
+    thread_mutex_lock(&self->lock);
+    pending = self->pending;
+    self->pending = NULL;
+    running = self->running;
+    thread_mutex_unlock(&self->lock);
+
+    while (pending) {
+        tlshandshake_entry_t *entry = pending;
+
+        pending = entry->next;
+        entry->next = NULL;
+
+        timerwheel_add(self->timers, &(entry->timer), entry->deadline);
+        /* the client may have sent its hello already */
+        tlshandshake_step(self, entry);
+    }
+
+    return running;
+}
+
+static void *tlshandshake_thread(void *arg)
+{
+    tlshandshake_t *self = arg;
+    fdpoll_result_t results[TLSHANDSHAKE_MAX_EVENTS];
+    timerwheel_entry_t *timer;
+
+    while (tlshandshake_take_pending(self)) {
+        int timeout = timerwheel_count(self->timers) ? TLSHANDSHAKE_TICK : TLSHANDSHAKE_IDLE_DELAY;
+        ssize_t ret;
+        ssize_t i;
+
+        ret = fdpoll_wait(self->poll, timeout, results, TLSHANDSHAKE_MAX_EVENTS);
+        if (ret < 0) {
+            ICECAST_LOG_ERROR("Waiting for TLS handshake events failed");
+            /* don't spin, the deadlines still drop stuck clients */
+            thread_sleep(TLSHANDSHAKE_TICK * 1000);
+        }
+
+        for (i = 0; i < ret; i++) {
+            if (results[i].userdata == self) {
+                tlshandshake_drain_wakeup(self);
+            } else {
+                tlshandshake_step(self, results[i].userdata);
+            }
+        }
+
+        while ((timer = timerwheel_expire(self->timers, timing_get_time()))) {
+            tlshandshake_entry_t *entry = ENTRY_OF_TIMER(timer);
+
+            ICECAST_LOG_DEBUG("TLS handshake on socket %i timed out", (int)entry->sock);
+            tlshandshake_finish(self, entry, 0);
+        }
+    }
+
+    /* whatever is left is not going to finish */
+    while ((timer = timerwheel_expire(self->timers, UINT64_MAX)))
+        tlshandshake_finish(self, ENTRY_OF_TIMER(timer), 0);
+
+    return NULL;
+}
+
+static int tlshandshake_start(tlshandshake_t *self)
+{
+    thread_mutex_create(&self->lock);
+
+    self->timers = timerwheel_new(timing_get_time());
+    self->poll = self->timers ? fdpoll_new() : NULL;
+    if (!self->poll)
+        return -1;
+
+#ifdef HAVE_PIPE
+    if (pipe(self->wakeup) != 0) {
+        fdpoll_free(self->poll);
+        self->poll = NULL;
+        return -1;
+    }
+    fcntl(self->wakeup[0], F_SETFL, O_NONBLOCK);
+    fcntl(self->wakeup[1], F_SETFL, O_NONBLOCK);
+    fdpoll_arm(self->poll, self->wakeup[0], FDPOLL_EVENT_READ, self);
+#endif
+
+    self->running = 1;
+    self->thread = thread_create("TLS Handshake Worker", tlshandshake_thread, self, THREAD_ATTACHED);
+    if (!self->thread) {
+        self->running = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void tlshandshake_stop(tlshandshake_t *self)
+{
+    thread_mutex_lock(&self->lock);
+    self->running = 0;
+    if (self->thread)
+        tlshandshake_wakeup(self);
+    thread_mutex_unlock(&self->lock);
+
+    if (self->thread) {
+        thread_join(self->thread);
+        self->thread = NULL;
+    }
+
+    if (self->poll) {
+#ifdef HAVE_PIPE
+        fdpoll_disarm(self->poll, self->wakeup[0]);
+        close(self->wakeup[0]);
+        close(self->wakeup[1]);
+#endif
+        fdpoll_free(self->poll);
+        self->poll = NULL;
+    }
+
+    timerwheel_free(self->timers);
+    self->timers = NULL;
+
+    thread_mutex_destroy(&self->lock);
+}
+
+void tlshandshake_initialize(void)
+{
+    ice_config_t *config;
+    unsigned int workers;
+    unsigned int i;
+
+    if (__inited)
+        return;
+
+    config = config_get_config();
+    workers = config->tls_handshake_workers;
+    config_release_config();
+
+    if (!workers) {
+        ICECAST_LOG_INFO("No TLS handshake workers, doing handshakes on the main thread");
+        return;
+    }
+
+    _workers = calloc(workers, sizeof(*_workers));
+    if (!_workers) {
+        ICECAST_LOG_ERROR("Can not allocate TLS handshake workers, doing handshakes on the main thread");
+        return;
+    }
+
+    for (i = 0; i < workers; i++) {
+        _workers_count++;
+        if (tlshandshake_start(&(_workers[i])) != 0) {
+            ICECAST_LOG_ERROR("Can not start TLS handshake worker %u, doing handshakes on the main thread", i);
+            break;
+        }
+    }
+
+    if (_workers_count != workers) {
+        while (_workers_count)
+            tlshandshake_stop(&(_workers[--_workers_count]));
+        free(_workers);
+        _workers = NULL;
+        return;
+    }
+
+    __inited = 1;
+    stats_event_args(NULL, "tls_handshake_workers", "%u", workers);
+    ICECAST_LOG_INFO("%u TLS handshake workers started", workers);
+}
+
+void tlshandshake_shutdown(void)
+{
+    if (!__inited)
+        return;
+
+    ICECAST_LOG_DEBUG("waiting for TLS handshake workers");
+    __inited = 0;
+    while (_workers_count)
+        tlshandshake_stop(&(_workers[--_workers_count]));
+    free(_workers);
+    _workers = NULL;
+    stats_event(NULL, "tls_handshake_workers", NULL);
+}
+
+int tlshandshake_add(tls_t *tls, sock_t sock, uint64_t deadline, tlshandshake_done_t done, void *userdata)
+{
+    tlshandshake_entry_t *entry;
+    tlshandshake_t *worker = NULL;
+    unsigned int min = 0;
+    size_t i;
+
+    if (!__inited)
+        return -1;
+
+    for (i = 0; i < _workers_count; i++) {
+        unsigned int handshakes = atomic_uint_load(&(_workers[i].handshakes));
+
+        if (!worker || handshakes < min) {
+            worker = &(_workers[i]);
+            min = handshakes;
+        }
+    }
+
+    entry = calloc(1, sizeof(*entry));
+    if (!entry)
+        return -1;
+
+    entry->tls = tls;
+    entry->sock = sock;
+    entry->done = done;
+    entry->userdata = userdata;
+    entry->start = timing_get_time();
+    entry->deadline = deadline;
+
+    thread_mutex_lock(&worker->lock);
+    if (!worker->running) {
+        thread_mutex_unlock(&worker->lock);
+        free(entry);
+        return -1;
+    }
+    atomic_uint_add(&worker->handshakes, 1);
+    entry->next = worker->pending;
+    worker->pending = entry;
+    tlshandshake_wakeup(worker);
+    thread_mutex_unlock(&worker->lock);
+
+    return 0;
+}
+
+unsigned int tlshandshake_count(void)
+{
+    unsigned int ret = 0;
+    size_t i;
+
+    if (!__inited)
+        return 0;
+
+    for (i = 0; i < _workers_count; i++)
+        ret += atomic_uint_load(&(_workers[i].handshakes));
+
+    return ret;
+}
@@ -0,0 +1,42 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* tlshandshake.h
+ *
+ * Does the TLS handshakes of new connections on a small pool of threads, see
+ * <tls-handshake-workers>, so the main thread reading requests is not held up
+ * by the public key operations of many clients connecting at once. Each
+ * worker waits for the sockets of its connections as tls_do_handshake()
+ * asks for and hands every connection back once its handshake is done,
+ * failed or ran past its deadline. The time each handshake took from being
+ * added to being done is counted in the tls_handshake_ms_* statistics.
+ */
+
+#ifndef __TLSHANDSHAKE_H__
+#define __TLSHANDSHAKE_H__
+
+#include <stdint.h>
+
+#include "tls.h"
+
+/* called on the worker thread once the handshake is done (ok is true) or has
+ * failed or timed out. The worker no longer references tls afterwards. */
+typedef void (*tlshandshake_done_t)(void *userdata, int ok);
+
+void    tlshandshake_initialize(void);
+void    tlshandshake_shutdown(void);
+
+/* Hands the handshake of tls, which is on sock, over to the worker with the
+ * fewest handshakes. deadline is in milliseconds as by timing_get_time().
+ * Returns 0 if it was taken, -1 if no worker is running, in which case the
+ * handshake is to be done by the caller.
+ */
+int     tlshandshake_add(tls_t *tls, sock_t sock, uint64_t deadline, tlshandshake_done_t done, void *userdata);
+
+/* number of handshakes handed over that are not done yet */
+unsigned int tlshandshake_count(void);
+
+#endif  /* __TLSHANDSHAKE_H__ */
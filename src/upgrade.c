@@ -0,0 +1,1264 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#endif
+
+#include "common/thread/thread.h"
+#include "common/avl/avl.h"
+#include "common/httpp/httpp.h"
+
+#include "upgrade.h"
+#include "global.h"
+#include "connection.h"
+#include "listensocket.h"
+#include "client.h"
+#include "source.h"
+#include "format.h"
+#include "refbuf.h"
+#include "stats.h"
+#include "navigation.h"
+#include "coarsetime.h"
+#include "cfgfile.h"
+#include "auth.h"
+#include "acl.h"
+
+#include "logging.h"
+#define CATMODULE "upgrade"
+
+/* the new process finds its end of the channel in this variable */
+#define UPGRADE_ENV             "ICECAST_UPGRADE_FD"
+/* seconds the old process waits for the new one to be ready */
+#define UPGRADE_READY_TIMEOUT   60
+/* seconds the sources get to hand over their listeners */
+#define UPGRADE_HANDOVER_TIME   3
+/* seconds the new process holds listeners for the source of their mount */
+#define UPGRADE_HOLD_TIME       30
+/* seconds a write to the channel may block */
+#define UPGRADE_SEND_TIMEOUT    10
+/* ms between sending the listeners queued by the sources */
+#define UPGRADE_QUEUE_INTERVAL  10
+
+typedef enum {
+    /* old to new, a listen socket with upgrade_listen_t */
+    UPGRADE_MSG_LISTEN = 1,
+    /* old to new, all listen sockets have been sent */
+    UPGRADE_MSG_LISTEN_END,
+    /* new to old, up and accepting */
+    UPGRADE_MSG_READY,
+    /* old to new, a listener with upgrade_listener_t */
+    UPGRADE_MSG_LISTENER,
+    /* old to new, all listeners have been sent */
+    UPGRADE_MSG_END
+} upgrade_msg_type_t;
+
+/* every message starts with this, the socket of it, if any, comes along
+ * with the first byte */
+typedef struct {
+    uint32_t type;
+    uint32_t length;
+} upgrade_msg_t;
+
+/* followed by the bind address, empty for any */
+typedef struct {
+    int32_t port;
+    uint32_t shard;
+} upgrade_listen_t;
+
+/* followed by strings many NUL terminated strings: the mount, the URI, the
+ * IP, username and role, empty if not set, and name and value of each of
+ * the request headers kept. Then the pending bytes of the stream. */
+typedef struct {
+    uint64_t sent_bytes;
+    int64_t con_time;
+    int64_t discon_time;
+    int32_t port;
+    uint32_t position;
+    uint32_t strings;
+    uint32_t pending;
+} upgrade_listener_t;
+
+typedef struct upgrade_socket_tag {
+    struct upgrade_socket_tag *next;
+    int port;
+    size_t shard;
+    char *bind_address;
+    sock_t sock;
+} upgrade_socket_t;
+
+/* a listener queued by its source, sent by the upgrade thread */
+typedef struct upgrade_queued_tag {
+    struct upgrade_queued_tag *next;
+    upgrade_listener_t record;
+    /* the listener, its source let go of it, destroyed once sent */
+    client_t *client;
+    size_t len;
+    char data[];
+} upgrade_queued_t;
+
+typedef struct upgrade_held_tag {
+    struct upgrade_held_tag *next;
+    client_t *client;
+    char *mount;
+    refbuf_t *pending;
+    unsigned int position;
+    time_t since;
+} upgrade_held_t;
+
+static mutex_t upgrade_lock;
+static int upgrade_initialized;
+static char **upgrade_argv;
+/* the channel to the other process, taken with upgrade_lock */
+static int upgrade_channel = -1;
+static thread_type *upgrade_thread;
+/* upgrade_thread has not finished yet */
+static volatile int upgrade_running;
+static volatile int upgrade_handover;
+static volatile int upgrade_done;
+/* new process: listen sockets not taken yet and listeners not attached */
+static upgrade_socket_t *upgrade_sockets;
+static upgrade_held_t *upgrade_held;
+/* old process: listeners to send, only queued while upgrade_queue_open */
+static mutex_t upgrade_queue_lock;
+static upgrade_queued_t *upgrade_queue;
+static upgrade_queued_t **upgrade_queue_tail = &upgrade_queue;
+static int upgrade_queue_open;
+
+void upgrade_initialize(void)
+{
+    thread_mutex_create(&upgrade_lock);
+    thread_mutex_create(&upgrade_queue_lock);
+    upgrade_initialized = 1;
+}
+
+void upgrade_set_command(char **argv)
+{
+    upgrade_argv = argv;
+}
+
+#ifndef _WIN32
+static void upgrade_held_free(upgrade_held_t *held, int destroy_client)
+{
+    if (destroy_client)
+        client_destroy(held->client);
+    refbuf_release(held->pending);
+    free(held->mount);
+    free(held);
+}
+
+static void upgrade_close_channel(void)
+{
+    if (upgrade_channel != -1)
+        close(upgrade_channel);
+    upgrade_channel = -1;
+}
+
+/* sends a message, with upgrade_lock held */
+static int upgrade_send(upgrade_msg_type_t type, const void *data, size_t len, const void *extra, size_t extra_len, sock_t sock)
+{
+    upgrade_msg_t header;
+    struct iovec iov[3];
+    struct msghdr msg;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    size_t total = sizeof(header) + len + extra_len;
+    size_t done = 0;
+    ssize_t ret;
+
+    if (upgrade_channel == -1)
+        return -1;
+
+    header.type = type;
+    header.length = len + extra_len;
+
+    memset(&msg, 0, sizeof(msg));
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+    iov[2].iov_base = (void *)extra;
+    iov[2].iov_len = extra_len;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 3;
+
+    if (sock != SOCK_ERROR) {
+        struct cmsghdr *cmsg;
+
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &sock, sizeof(int));
+    }
+
+    /* the socket goes with the first part, what is left is written on */
+    while (done < total) {
+        ret = sendmsg(upgrade_channel, &msg, 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            ICECAST_LOG_ERROR("Can not write to the other process: %s", strerror(errno));
+            upgrade_close_channel();
+            return -1;
+        }
+
+        done += ret;
+        msg.msg_control = NULL;
+        msg.msg_controllen = 0;
+        while (ret > 0 && msg.msg_iovlen) {
+            if ((size_t)ret < msg.msg_iov->iov_len) {
+                msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + ret;
+                msg.msg_iov->iov_len -= ret;
+                break;
+            }
+            ret -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+    }
+
+    return 0;
+}
+
+/* reads exactly len bytes, the socket coming with them is stored in sock */
+static int upgrade_read(int fd, void *data, size_t len, sock_t *sock)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        struct msghdr msg;
+        struct iovec iov;
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } control;
+        struct cmsghdr *cmsg;
+        ssize_t ret;
+
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = (char *)data + done;
+        iov.iov_len = len - done;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        ret = recvmsg(fd, &msg, 0);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                int fd_received;
+
+                memcpy(&fd_received, CMSG_DATA(cmsg), sizeof(int));
+                if (sock && *sock == SOCK_ERROR) {
+                    *sock = fd_received;
+                } else {
+                    close(fd_received);
+                }
+            }
+        }
+
+        done += ret;
+    }
+
+    return 0;
+}
+
+/* reads a message, data is allocated and NUL terminated */
+static int upgrade_receive(int fd, upgrade_msg_t *header, char **data, sock_t *sock)
+{
+    *sock = SOCK_ERROR;
+    *data = NULL;
+
+    if (upgrade_read(fd, header, sizeof(*header), sock) != 0)
+        return -1;
+
+    *data = malloc(header->length + 1);
+    if (!*data || upgrade_read(fd, *data, header->length, sock) != 0) {
+        free(*data);
+        *data = NULL;
+        if (*sock != SOCK_ERROR)
+            sock_close(*sock);
+        return -1;
+    }
+    (*data)[header->length] = 0;
+
+    return 0;
+}
+
+/* returns the next of the NUL terminated strings in data, NULL at the end */
+static const char *upgrade_next_string(const char **p, const char *end)
+{
+    const char *ret = *p;
+    size_t len;
+
+    if (ret >= end)
+        return NULL;
+    len = strnlen(ret, end - ret);
+    if (ret + len == end)
+        return NULL;
+    *p = ret + len + 1;
+
+    return ret;
+}
+
+/* The process being replaced */
+
+static int upgrade_send_listen_sockets(void)
+{
+    listensocket_t **sockets = listensocket_container_list_sockets(global.listensockets);
+    size_t count = 0;
+    size_t i;
+
+    if (!sockets)
+        return -1;
+
+    thread_mutex_lock(&upgrade_lock);
+    for (i = 0; sockets[i]; i++) {
+        const listener_t *listener = listensocket_get_listener(sockets[i]);
+        const char *bind_address = "";
+        upgrade_listen_t listen;
+        sock_t sock;
+
+        if (listener) {
+            listen.port = listener->port;
+            if (listener->bind_address)
+                bind_address = listener->bind_address;
+
+            for (listen.shard = 0; (sock = listensocket_get_sock(sockets[i], listen.shard)) != SOCK_ERROR; listen.shard++) {
+                if (upgrade_send(UPGRADE_MSG_LISTEN, &listen, sizeof(listen), bind_address, strlen(bind_address) + 1, sock) == 0)
+                    count++;
+            }
+        }
+
+        listensocket_release_listener(sockets[i]);
+        refobject_unref(sockets[i]);
+    }
+    free(sockets);
+
+    upgrade_send(UPGRADE_MSG_LISTEN_END, NULL, 0, NULL, 0, SOCK_ERROR);
+    thread_mutex_unlock(&upgrade_lock);
+
+    ICECAST_LOG_INFO("Handed over %zu listen sockets", count);
+
+    return upgrade_channel == -1 ? -1 : 0;
+}
+
+/* looks up the binary like execvp() would, but before fork() */
+static char *upgrade_find_binary(const char *name)
+{
+    const char *path = getenv("PATH");
+    char buf[4096];
+
+    if (strchr(name, '/') || !path)
+        return strdup(name);
+
+    while (*path) {
+        size_t len = strcspn(path, ":");
+
+        snprintf(buf, sizeof(buf), "%.*s/%s", (int)(len ? len : 1), len ? path : ".", name);
+        if (access(buf, X_OK) == 0)
+            return strdup(buf);
+        path += len;
+        if (*path == ':')
+            path++;
+    }
+
+    return strdup(name);
+}
+
+/* the environment with UPGRADE_ENV set to fd */
+static char **upgrade_build_env(int fd)
+{
+    extern char **environ;
+    size_t count = 0;
+    size_t i, j;
+    char **env;
+
+    while (environ[count])
+        count++;
+
+    env = calloc(count + 2, sizeof(*env));
+    if (!env)
+        return NULL;
+
+    for (i = 0, j = 0; i < count; i++) {
+        if (strncmp(environ[i], UPGRADE_ENV "=", strlen(UPGRADE_ENV "=")) != 0)
+            env[j++] = environ[i];
+    }
+    env[j] = malloc(strlen(UPGRADE_ENV) + 24);
+    if (!env[j]) {
+        free(env);
+        return NULL;
+    }
+    sprintf(env[j], UPGRADE_ENV "=%d", fd);
+
+    return env;
+}
+
+static void upgrade_free_env(char **env)
+{
+    size_t count = 0;
+
+    if (!env)
+        return;
+
+    /* the variable is the last one, the others are the process' own */
+    while (env[count])
+        count++;
+    free(env[count - 1]);
+    free(env);
+}
+
+static pid_t upgrade_spawn(int fd)
+{
+    char *binary = upgrade_find_binary(upgrade_argv[0]);
+    char **env = upgrade_build_env(fd);
+    struct rlimit limit;
+    int maxfd = 1024;
+    pid_t pid;
+
+    if (!binary || !env) {
+        free(binary);
+        upgrade_free_env(env);
+        return -1;
+    }
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+        maxfd = limit.rlim_cur;
+
+    pid = fork();
+    if (pid == 0) {
+        sigset_t set;
+        int i;
+
+        /* only what is async-signal-safe from here, the other threads'
+         * locks may be held. The new process gets nothing else of ours,
+         * least the sockets of listeners, which would stay open with it. */
+        for (i = 3; i < maxfd; i++) {
+            if (i != fd)
+                close(i);
+        }
+        sigemptyset(&set);
+        sigprocmask(SIG_SETMASK, &set, NULL);
+
+        execve(binary, upgrade_argv, env);
+        _exit(1);
+    }
+
+    upgrade_free_env(env);
+    free(binary);
+
+    return pid;
+}
+
+static int upgrade_wait_ready(int fd)
+{
+    struct pollfd pfd;
+    upgrade_msg_t header;
+    char *data;
+    sock_t sock;
+    int ret;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    do {
+        ret = poll(&pfd, 1, UPGRADE_READY_TIMEOUT * 1000);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret != 1 || upgrade_receive(fd, &header, &data, &sock) != 0)
+        return -1;
+
+    free(data);
+    if (sock != SOCK_ERROR)
+        sock_close(sock);
+
+    return header.type == UPGRADE_MSG_READY ? 0 : -1;
+}
+
+/* sends the listeners queued so far, the sources are not held up by the
+ * channel as they only take the queue lock to add to it */
+static void upgrade_send_queued(void)
+{
+    upgrade_queued_t *queued;
+
+    thread_mutex_lock(&upgrade_queue_lock);
+    queued = upgrade_queue;
+    upgrade_queue = NULL;
+    upgrade_queue_tail = &upgrade_queue;
+    thread_mutex_unlock(&upgrade_queue_lock);
+
+    while (queued) {
+        upgrade_queued_t *next = queued->next;
+
+        thread_mutex_lock(&upgrade_lock);
+        if (upgrade_send(UPGRADE_MSG_LISTENER, &(queued->record), sizeof(queued->record), queued->data, queued->len, queued->client->con->sock) == 0) {
+            queued->client->con->discon_reason = "upgrade";
+            queued->client->handed_over = 1;
+        } else {
+            /* it leaves as any other listener does, logged and released
+             * with the authentication */
+            ICECAST_LOG_WARN("Listener %llu could not be handed over, it is disconnected", (unsigned long long int)queued->client->con->id);
+        }
+        thread_mutex_unlock(&upgrade_lock);
+
+        client_destroy(queued->client);
+        free(queued);
+        queued = next;
+    }
+}
+
+static void *upgrade_run(void *arg)
+{
+    int fds[2];
+    struct timeval timeout;
+    pid_t pid;
+    int status;
+    int i;
+
+    (void)arg;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        ICECAST_LOG_ERROR("Can not create a socket pair for the upgrade: %s", strerror(errno));
+        upgrade_running = 0;
+        return NULL;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+
+    pid = upgrade_spawn(fds[1]);
+    close(fds[1]);
+    if (pid < 0) {
+        ICECAST_LOG_ERROR("Can not start a new process for the upgrade: %s", strerror(errno));
+        close(fds[0]);
+        upgrade_running = 0;
+        return NULL;
+    }
+    ICECAST_LOG_INFO("Started new process %lli for the upgrade", (long long int)pid);
+
+    timeout.tv_sec = UPGRADE_SEND_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    thread_mutex_lock(&upgrade_lock);
+    upgrade_channel = fds[0];
+    thread_mutex_unlock(&upgrade_lock);
+
+    if (upgrade_send_listen_sockets() != 0 || upgrade_wait_ready(fds[0]) != 0) {
+        ICECAST_LOG_ERROR("New process %lli did not come up, going on without upgrading", (long long int)pid);
+        thread_mutex_lock(&upgrade_lock);
+        upgrade_close_channel();
+        thread_mutex_unlock(&upgrade_lock);
+        if (waitpid(pid, &status, WNOHANG) == 0) {
+            kill(pid, SIGTERM);
+            waitpid(pid, &status, 0);
+        }
+        upgrade_running = 0;
+        return NULL;
+    }
+
+    ICECAST_LOG_INFO("New process %lli is ready, handing over the listeners", (long long int)pid);
+    thread_mutex_lock(&upgrade_queue_lock);
+    upgrade_queue_open = 1;
+    thread_mutex_unlock(&upgrade_queue_lock);
+    upgrade_handover = 1;
+    for (i = 0; i < UPGRADE_HANDOVER_TIME * 1000 / UPGRADE_QUEUE_INTERVAL; i++) {
+        thread_sleep(UPGRADE_QUEUE_INTERVAL * 1000);
+        upgrade_send_queued();
+    }
+    upgrade_handover = 0;
+    /* listeners of sources that saw the handover late stay with us */
+    thread_mutex_lock(&upgrade_queue_lock);
+    upgrade_queue_open = 0;
+    thread_mutex_unlock(&upgrade_queue_lock);
+    upgrade_send_queued();
+
+    thread_mutex_lock(&upgrade_lock);
+    upgrade_send(UPGRADE_MSG_END, NULL, 0, NULL, 0, SOCK_ERROR);
+    upgrade_close_channel();
+    thread_mutex_unlock(&upgrade_lock);
+
+    upgrade_done = 1;
+    upgrade_running = 0;
+    ICECAST_LOG_INFO("Handed over to process %lli, shutting down", (long long int)pid);
+    global.running = ICECAST_HALTING;
+
+    return NULL;
+}
+
+void upgrade_start(void)
+{
+    thread_type *finished;
+
+    if (!upgrade_argv || !upgrade_argv[0]) {
+        ICECAST_LOG_ERROR("Can not upgrade, the command to start is not known");
+        return;
+    }
+
+    thread_mutex_lock(&upgrade_lock);
+    if (upgrade_running || upgrade_done) {
+        thread_mutex_unlock(&upgrade_lock);
+        ICECAST_LOG_WARN("An upgrade is already in progress");
+        return;
+    }
+    finished = upgrade_thread;
+    upgrade_running = 1;
+    upgrade_thread = NULL;
+    thread_mutex_unlock(&upgrade_lock);
+
+    /* of a failed upgrade or the one that brought us up */
+    if (finished)
+        thread_join(finished);
+
+    upgrade_thread = thread_create("Upgrade Thread", upgrade_run, NULL, THREAD_ATTACHED);
+}
+
+int upgrade_handing_over(void)
+{
+    return upgrade_handover;
+}
+
+int upgrade_is_done(void)
+{
+    return upgrade_done;
+}
+
+int upgrade_handover_listener(source_t *source, client_t *client)
+{
+    connection_t *con = client->con;
+    const listener_t *listener;
+    upgrade_listener_t record;
+    char strings[4096];
+    size_t len = 0;
+    const char *pending = NULL;
+    upgrade_queued_t *queued;
+    size_t i;
+    int ret;
+
+    if (con->tls || con->local || client->respcode != 200 || client->check_buffer == format_check_http_buffer)
+        return -1;
+    /* the header would be sent again in the middle of the stream */
+    if (source->format->type == FORMAT_TYPE_EBML)
+        return -1;
+
+    memset(&record, 0, sizeof(record));
+    if (source->format->get_client_position && source->format->get_client_position(client, &record.position) != 0)
+        return -1;
+
+    record.sent_bytes = con->sent_bytes;
+    record.con_time = con->con_time;
+    record.discon_time = con->discon_time;
+
+    listener = listensocket_get_listener(con->listensocket_real);
+    if (listener)
+        record.port = listener->port;
+    listensocket_release_listener(con->listensocket_real);
+
+    if (client->refbuf && client->pos < client->refbuf->len) {
+        pending = client->refbuf->data + client->pos;
+        record.pending = client->refbuf->len - client->pos;
+    }
+
+#define UPGRADE_ADD_STRING(str) do { \
+        const char *__str = (str) ? (str) : ""; \
+        size_t __len = strlen(__str) + 1; \
+        if ((len + __len) > sizeof(strings)) \
+            return -1; \
+        memcpy(strings + len, __str, __len); \
+        len += __len; \
+    } while (0)
+
+    UPGRADE_ADD_STRING(source->mount);
+    UPGRADE_ADD_STRING(client->uri);
+    UPGRADE_ADD_STRING(con->ip);
+    UPGRADE_ADD_STRING(client->username);
+    UPGRADE_ADD_STRING(client->role);
+    for (i = 0; client->parser && client_streaming_headers[i]; i++) {
+        const char *value = httpp_getvar(client->parser, client_streaming_headers[i]);
+
+        if (!value)
+            continue;
+        UPGRADE_ADD_STRING(client_streaming_headers[i]);
+        UPGRADE_ADD_STRING(value);
+    }
+#undef UPGRADE_ADD_STRING
+    record.strings = len;
+
+    /* the pending bytes follow the strings in the same message, it is sent
+     * by the upgrade thread */
+    queued = malloc(sizeof(*queued) + len + record.pending);
+    if (!queued)
+        return -1;
+    queued->next = NULL;
+    queued->record = record;
+    queued->len = len + record.pending;
+    memcpy(queued->data, strings, len);
+    if (record.pending)
+        memcpy(queued->data + len, pending, record.pending);
+    queued->client = client;
+
+    thread_mutex_lock(&upgrade_queue_lock);
+    ret = upgrade_queue_open ? 0 : -1;
+    if (ret == 0) {
+        *upgrade_queue_tail = queued;
+        upgrade_queue_tail = &(queued->next);
+    }
+    thread_mutex_unlock(&upgrade_queue_lock);
+
+    if (ret != 0) {
+        free(queued);
+        return -1;
+    }
+
+    ICECAST_LOG_DEBUG("Handing over listener %llu on %s", (unsigned long long int)con->id, source->mount);
+
+    return 0;
+}
+
+/* The process replacing it */
+
+int upgrade_receive_listen_sockets(void)
+{
+    const char *env = getenv(UPGRADE_ENV);
+    upgrade_msg_t header;
+    size_t count = 0;
+    char *data;
+    sock_t sock;
+    int fd;
+
+    if (!env)
+        return 0;
+
+    fd = atoi(env);
+    unsetenv(UPGRADE_ENV);
+    if (fd < 3)
+        return -1;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    upgrade_channel = fd;
+
+    while (upgrade_receive(fd, &header, &data, &sock) == 0) {
+        if (header.type == UPGRADE_MSG_LISTEN && sock != SOCK_ERROR && header.length >= sizeof(upgrade_listen_t)) {
+            upgrade_listen_t listen;
+            upgrade_socket_t *entry = calloc(1, sizeof(*entry));
+
+            memcpy(&listen, data, sizeof(listen));
+            if (entry) {
+                entry->port = listen.port;
+                entry->shard = listen.shard;
+                entry->bind_address = strdup(data + sizeof(listen));
+                entry->sock = sock;
+                entry->next = upgrade_sockets;
+                upgrade_sockets = entry;
+                count++;
+                sock = SOCK_ERROR;
+            }
+        }
+
+        if (sock != SOCK_ERROR)
+            sock_close(sock);
+        free(data);
+
+        if (header.type == UPGRADE_MSG_LISTEN_END) {
+            ICECAST_LOG_INFO("Taking over from the old process with %zu listen sockets", count);
+            return 0;
+        }
+    }
+
+    ICECAST_LOG_ERROR("Lost the old process while receiving the listen sockets");
+    upgrade_close_channel();
+    return -1;
+}
+
+sock_t upgrade_take_listen_socket(const listener_t *listener, size_t shard)
+{
+    upgrade_socket_t **prev = &upgrade_sockets;
+    const char *bind_address = listener->bind_address ? listener->bind_address : "";
+
+    for (; *prev; prev = &((*prev)->next)) {
+        upgrade_socket_t *entry = *prev;
+        sock_t sock;
+
+        if (entry->port != listener->port || entry->shard != shard || strcmp(entry->bind_address, bind_address) != 0)
+            continue;
+
+        sock = entry->sock;
+        *prev = entry->next;
+        free(entry->bind_address);
+        free(entry);
+        return sock;
+    }
+
+    return SOCK_ERROR;
+}
+
+void upgrade_release_listen_sockets(void)
+{
+    while (upgrade_sockets) {
+        upgrade_socket_t *entry = upgrade_sockets;
+
+        ICECAST_LOG_INFO("Closing listen socket on %s port %i, it is no longer configured",
+                *entry->bind_address ? entry->bind_address : "<ANY>", entry->port);
+        upgrade_sockets = entry->next;
+        sock_close(entry->sock);
+        free(entry->bind_address);
+        free(entry);
+    }
+}
+
+static listensocket_t *upgrade_find_listensocket(int port)
+{
+    listensocket_t **sockets = listensocket_container_list_sockets(global.listensockets);
+    listensocket_t *ret = NULL;
+    size_t i;
+
+    if (!sockets)
+        return NULL;
+
+    for (i = 0; sockets[i]; i++) {
+        const listener_t *listener = listensocket_get_listener(sockets[i]);
+
+        if (!ret && listener && listener->port == port) {
+            refobject_ref(sockets[i]);
+            ret = sockets[i];
+        }
+        listensocket_release_listener(sockets[i]);
+        refobject_unref(sockets[i]);
+    }
+    free(sockets);
+
+    return ret;
+}
+
+/* makes a listener of the old process ours again */
+static upgrade_held_t *upgrade_adopt_listener(const char *data, size_t length, sock_t sock)
+{
+    upgrade_listener_t record;
+    const char *p = data + sizeof(record);
+    const char *end;
+    const char *mount, *uri, *ip, *username, *role, *name, *value;
+    listensocket_t *listensocket;
+    http_parser_t *parser;
+    connection_t *con;
+    client_t *client;
+    upgrade_held_t *held;
+    char *ipcopy;
+
+    /* from here on the socket is ours to close if it can not be used */
+    if (length < sizeof(record)) {
+        sock_close(sock);
+        return NULL;
+    }
+    memcpy(&record, data, sizeof(record));
+    if ((sizeof(record) + record.strings + record.pending) != length) {
+        sock_close(sock);
+        return NULL;
+    }
+    end = p + record.strings;
+
+    mount = upgrade_next_string(&p, end);
+    uri = upgrade_next_string(&p, end);
+    ip = upgrade_next_string(&p, end);
+    username = upgrade_next_string(&p, end);
+    role = upgrade_next_string(&p, end);
+    if (!mount || !uri || !ip || !username || !role) {
+        sock_close(sock);
+        return NULL;
+    }
+
+    held = calloc(1, sizeof(*held));
+    ipcopy = strdup(ip);
+    if (!held || !ipcopy) {
+        free(held);
+        free(ipcopy);
+        sock_close(sock);
+        return NULL;
+    }
+
+    listensocket = upgrade_find_listensocket(record.port);
+    con = connection_create(sock, listensocket, listensocket, ipcopy);
+    refobject_unref(listensocket);
+    if (!con) {
+        free(ipcopy);
+        free(held);
+        sock_close(sock);
+        return NULL;
+    }
+    sock_set_blocking(sock, 0);
+    con->con_time = record.con_time;
+    con->discon_time = record.discon_time;
+    con->sent_bytes = record.sent_bytes;
+
+    parser = httpp_create_parser();
+    httpp_initialize(parser, NULL);
+    parser->req_type = httpp_req_get;
+    while ((name = upgrade_next_string(&p, end)) && (value = upgrade_next_string(&p, end)))
+        httpp_setvar(parser, name, value);
+
+    if (client_create(&client, con, parser) < 0) {
+        client_destroy(client);
+        free(held);
+        return NULL;
+    }
+
+    client->respcode = 200;
+    client->uri = strdup(*uri ? uri : mount);
+    if (*username)
+        client->username = strdup(username);
+    if (*role)
+        client->role = strdup(role);
+
+    held->client = client;
+    held->mount = strdup(mount);
+    held->position = record.position;
+    held->since = coarsetime_get();
+    if (record.pending) {
+        held->pending = refbuf_new(record.pending);
+        memcpy(held->pending->data, end, record.pending);
+    }
+
+    return held;
+}
+
+/* takes the auth of the role the listener had in the old process back, in
+ * the order the request would have gone through them */
+static void upgrade_attach_auth(client_t *client, const char *mount)
+{
+    const listener_t *listener;
+    ice_config_t *config;
+    mount_proxy *mountinfo;
+    auth_t *auth = NULL;
+
+    if (!client->role)
+        return;
+
+    listener = listensocket_get_listener(client->con->listensocket_effective);
+    if (listener)
+        auth = auth_stack_getbyrole(listener->authstack, client->role);
+    listensocket_release_listener(client->con->listensocket_effective);
+
+    config = config_get_config();
+    if (!auth) {
+        mountinfo = config_find_mount(config, mount, MOUNT_TYPE_NORMAL);
+        if (mountinfo && mountinfo->mounttype == MOUNT_TYPE_NORMAL)
+            auth = auth_stack_getbyrole(mountinfo->authstack, client->role);
+    }
+    if (!auth) {
+        mountinfo = config_find_mount(config, mount, MOUNT_TYPE_DEFAULT);
+        if (mountinfo)
+            auth = auth_stack_getbyrole(mountinfo->authstack, client->role);
+    }
+    if (!auth)
+        auth = auth_stack_getbyrole(config->authstack, client->role);
+    config_release_config();
+
+    if (!auth) {
+        ICECAST_LOG_WARN("Role %H of listener %llu is not configured anymore", client->role, (unsigned long long int)client->con->id);
+        return;
+    }
+
+    client->auth = auth;
+    acl_addref(client->acl = auth->acl);
+}
+
+static void upgrade_attach(source_t *source, upgrade_held_t *held)
+{
+    client_t *client = held->client;
+
+    /* the response went out from the old process, what the plugin adds to
+     * it ends up in a buffer that is dropped */
+    client->refbuf->len = 2;
+    memcpy(client->refbuf->data, "\r\n", 2);
+    if (source->format->create_client_data && source->format->create_client_data(source, client) < 0) {
+        ICECAST_LOG_WARN("Can not continue listener %llu on %s", (unsigned long long int)client->con->id, source->mount);
+        upgrade_held_free(held, 1);
+        return;
+    }
+    if (source->format->set_client_position)
+        source->format->set_client_position(client, held->position);
+
+    navigation_history_navigate_to(&(client->history), source->identifier, NAVIGATION_DIRECTION_REPLACE_ALL);
+    upgrade_attach_auth(client, source->mount);
+
+    /* the rest of the buffer the listener was in the middle of, after it
+     * joins at the live point like a listener moved from another mount */
+    client_set_queue(client, NULL);
+    client->write_to_client = source->format->write_buf_to_client;
+    if (held->pending) {
+        client->refbuf = held->pending;
+        held->pending = NULL;
+        client->pos = 0;
+        client->check_buffer = format_check_handoff_buffer;
+    } else {
+        client->check_buffer = format_check_file_buffer;
+    }
+    client->intro_offset = -1;
+
+    stats_global_inc(STATS_GLOBAL_LISTENERS);
+    source_add_pending(source, client);
+    ICECAST_LOG_DEBUG("Continuing listener %llu on %s", (unsigned long long int)client->con->id, source->mount);
+
+    upgrade_held_free(held, 0);
+}
+
+void upgrade_attach_listeners(source_t *source)
+{
+    upgrade_held_t **prev;
+
+    if (!upgrade_initialized)
+        return;
+
+    thread_mutex_lock(&upgrade_lock);
+    prev = &upgrade_held;
+    while (*prev) {
+        upgrade_held_t *held = *prev;
+
+        if (strcmp(held->mount, source->mount) != 0) {
+            prev = &(held->next);
+            continue;
+        }
+
+        *prev = held->next;
+        upgrade_attach(source, held);
+    }
+    thread_mutex_unlock(&upgrade_lock);
+}
+
+/* attaches the listener to its source if it is running, else holds it */
+static void upgrade_hold(upgrade_held_t *held)
+{
+    source_t *source;
+
+    thread_mutex_lock(&upgrade_lock);
+    avl_tree_rlock(global.source_tree);
+    source = source_find_mount_raw(held->mount);
+    if (source && source->running && source->format) {
+        upgrade_attach(source, held);
+    } else {
+        if (source && source->on_demand)
+            source->on_demand_req = 1;
+        held->next = upgrade_held;
+        upgrade_held = held;
+    }
+    avl_tree_unlock(global.source_tree);
+    thread_mutex_unlock(&upgrade_lock);
+}
+
+/* drops the held listeners whose source did not show up in time */
+static int upgrade_expire_held(int all)
+{
+    upgrade_held_t *expired = NULL;
+    upgrade_held_t **prev;
+    time_t now = coarsetime_get();
+    int left = 0;
+
+    thread_mutex_lock(&upgrade_lock);
+    prev = &upgrade_held;
+    while (*prev) {
+        upgrade_held_t *held = *prev;
+
+        if (!all && (now - held->since) < UPGRADE_HOLD_TIME) {
+            prev = &(held->next);
+            left++;
+            continue;
+        }
+
+        *prev = held->next;
+        held->next = expired;
+        expired = held;
+    }
+    thread_mutex_unlock(&upgrade_lock);
+
+    while (expired) {
+        upgrade_held_t *held = expired;
+
+        expired = held->next;
+        ICECAST_LOG_INFO("No source for %s, dropping the listener handed over", held->mount);
+        held->client->con->discon_reason = "upgrade";
+        upgrade_held_free(held, 1);
+    }
+
+    return left;
+}
+
+static void *upgrade_receive_listeners(void *arg)
+{
+    int fd = upgrade_channel;
+    size_t count = 0;
+
+    (void)arg;
+
+    while (global.running == ICECAST_RUNNING) {
+        struct pollfd pfd;
+        upgrade_msg_t header;
+        char *data;
+        sock_t sock;
+
+        if (fd == -1) {
+            if (!upgrade_expire_held(0))
+                break;
+            thread_sleep(1000000);
+            continue;
+        }
+
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 1000) < 1) {
+            upgrade_expire_held(0);
+            continue;
+        }
+
+        if (upgrade_receive(fd, &header, &data, &sock) != 0 || header.type == UPGRADE_MSG_END) {
+            ICECAST_LOG_INFO("Took over %zu listeners from the old process", count);
+            free(data);
+            thread_mutex_lock(&upgrade_lock);
+            upgrade_close_channel();
+            thread_mutex_unlock(&upgrade_lock);
+            fd = -1;
+            continue;
+        }
+
+        if (header.type == UPGRADE_MSG_LISTENER && sock != SOCK_ERROR) {
+            /* takes the socket in any case */
+            upgrade_held_t *held = upgrade_adopt_listener(data, header.length, sock);
+
+            if (held) {
+                upgrade_hold(held);
+                count++;
+            }
+            sock = SOCK_ERROR;
+        }
+
+        if (sock != SOCK_ERROR)
+            sock_close(sock);
+        free(data);
+    }
+
+    upgrade_expire_held(1);
+    upgrade_running = 0;
+
+    return NULL;
+}
+
+void upgrade_complete_startup(void)
+{
+    if (upgrade_channel == -1)
+        return;
+
+    thread_mutex_lock(&upgrade_lock);
+    upgrade_send(UPGRADE_MSG_READY, NULL, 0, NULL, 0, SOCK_ERROR);
+    if (upgrade_channel != -1) {
+        upgrade_running = 1;
+        upgrade_thread = thread_create("Upgrade Thread", upgrade_receive_listeners, NULL, THREAD_ATTACHED);
+    }
+    thread_mutex_unlock(&upgrade_lock);
+}
+
+void upgrade_shutdown(void)
+{
+    thread_type *thread;
+
+    if (!upgrade_initialized)
+        return;
+
+    thread_mutex_lock(&upgrade_lock);
+    thread = upgrade_thread;
+    upgrade_thread = NULL;
+    thread_mutex_unlock(&upgrade_lock);
+
+    if (thread)
+        thread_join(thread);
+
+    upgrade_expire_held(1);
+    upgrade_release_listen_sockets();
+    upgrade_close_channel();
+
+    upgrade_initialized = 0;
+    thread_mutex_destroy(&upgrade_queue_lock);
+    thread_mutex_destroy(&upgrade_lock);
+}
+#else
+void upgrade_start(void)
+{
+    ICECAST_LOG_ERROR("Upgrading to a new process is not supported on this system");
+}
+
+int upgrade_handing_over(void)
+{
+    return 0;
+}
+
+int upgrade_handover_listener(source_t *source, client_t *client)
+{
+    (void)source, (void)client;
+    return -1;
+}
+
+int upgrade_is_done(void)
+{
+    return 0;
+}
+
+int upgrade_receive_listen_sockets(void)
+{
+    return 0;
+}
+
+sock_t upgrade_take_listen_socket(const listener_t *listener, size_t shard)
+{
+    (void)listener, (void)shard;
+    return SOCK_ERROR;
+}
+
+void upgrade_release_listen_sockets(void)
+{
+}
+
+void upgrade_complete_startup(void)
+{
+}
+
+void upgrade_attach_listeners(source_t *source)
+{
+    (void)source;
+}
+
+void upgrade_shutdown(void)
+{
+    if (!upgrade_initialized)
+        return;
+
+    upgrade_initialized = 0;
+    thread_mutex_destroy(&upgrade_queue_lock);
+    thread_mutex_destroy(&upgrade_lock);
+}
+#endif
@@ -0,0 +1,63 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* upgrade.h
+ *
+ * Replacing the running server by a new process of the binary without
+ * listeners noticing. On SIGUSR2 the server starts the binary again with
+ * the same arguments and a UNIX socket to it. Over that the new process is
+ * given the listen sockets, which it uses instead of binding its own. Once
+ * it is ready the sources of the old process give it their listeners, with
+ * the part of the buffer they were in the middle of and where they are in
+ * the ICY metadata. The new process holds them until the source of their
+ * mount connects to it, sends them the rest of the buffer and has them join
+ * the stream at the live point like listeners moved between mounts. The
+ * old process then shuts down, so its sources connect to the new one.
+ *
+ * Listeners using TLS can not be handed over and are disconnected, as are
+ * ones still getting their response headers or in the middle of a metadata
+ * block. This is only available on UNIX-like systems.
+ */
+
+#ifndef __UPGRADE_H__
+#define __UPGRADE_H__
+
+#include <stddef.h>
+
+#include "common/net/sock.h"
+
+#include "icecasttypes.h"
+#include "cfgfile.h"
+
+void upgrade_initialize(void);
+void upgrade_shutdown(void);
+/* the arguments to start the new process with, from main() */
+void upgrade_set_command(char **argv);
+
+/* In the old process. upgrade_start() runs the upgrade in a thread of its
+ * own. While it hands over the listeners upgrade_handing_over() is true
+ * and the sources give each listener to upgrade_handover_listener(), which
+ * returns 0 if the upgrade thread took the listener. It only queues the
+ * listener, the upgrade thread sends it on and destroys it, so the source
+ * is not held up by a slow new process. One that can not be sent leaves as
+ * it would have here.
+ */
+void upgrade_start(void);
+int upgrade_handing_over(void);
+int upgrade_handover_listener(source_t *source, client_t *client);
+/* true once the new process took over, it then owns the pidfile */
+int upgrade_is_done(void);
+
+/* In the new process, before the listen sockets are set up, after that and
+ * once everything is running. */
+int upgrade_receive_listen_sockets(void);
+sock_t upgrade_take_listen_socket(const listener_t *listener, size_t shard);
+void upgrade_release_listen_sockets(void);
+void upgrade_complete_startup(void);
+/* gives the source the listeners handed over for its mount */
+void upgrade_attach_listeners(source_t *source);
+
+#endif  /* __UPGRADE_H__ */
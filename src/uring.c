@@ -0,0 +1,201 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#ifdef HAVE_URING
+#include <sys/socket.h>
+#include <liburing.h>
+#endif
+
+#include "uring.h"
+
+#include "logging.h"
+#define CATMODULE "uring"
+
+#ifdef HAVE_URING
+
+struct uring_tag {
+    struct io_uring ring;
+    unsigned int entries;
+    unsigned int queued;
+    /* the message of each queued send, they are read by the kernel, and
+     * its userdata, NULL once it was reported */
+    struct msghdr *msg;
+    void **userdata;
+    int broken;
+    /* -errno of what broke the ring */
+    int error;
+};
+
+uring_t *uring_new(unsigned int entries)
+{
+    uring_t *self = calloc(1, sizeof(*self));
+    int ret;
+
+    if (!self)
+        return NULL;
+
+    self->msg = calloc(entries, sizeof(*self->msg));
+    self->userdata = calloc(entries, sizeof(*self->userdata));
+    if (!self->msg || !self->userdata) {
+        free(self->msg);
+        free(self->userdata);
+        free(self);
+        return NULL;
+    }
+
+    ret = io_uring_queue_init(entries, &self->ring, 0);
+    if (ret != 0) {
+        ICECAST_LOG_INFO("io_uring can not be used: %s", strerror(-ret));
+        free(self->msg);
+        free(self->userdata);
+        free(self);
+        return NULL;
+    }
+    self->entries = entries;
+
+    return self;
+}
+
+void uring_free(uring_t *self)
+{
+    if (!self)
+        return;
+
+    io_uring_queue_exit(&self->ring);
+    free(self->msg);
+    free(self->userdata);
+    free(self);
+}
+
+int uring_queue_send(uring_t *self, int fd, const struct iovec *iov, size_t count, void *userdata)
+{
+    struct io_uring_sqe *sqe;
+    struct msghdr *msg;
+
+    if (self->broken || self->queued == self->entries)
+        return -1;
+
+    sqe = io_uring_get_sqe(&self->ring);
+    if (!sqe)
+        return -1;
+
+    msg = &(self->msg[self->queued]);
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_iov = (struct iovec *)iov;
+    msg->msg_iovlen = count;
+
+    /* MSG_DONTWAIT has the kernel fail with EAGAIN instead of waiting for
+     * the socket, so it behaves like a write to the non-blocking socket */
+    io_uring_prep_sendmsg(sqe, fd, msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    io_uring_sqe_set_data(sqe, (void *)(uintptr_t)self->queued);
+    self->userdata[self->queued] = userdata;
+    self->queued++;
+
+    return 0;
+}
+
+int uring_complete(uring_t *self, uring_callback_t callback, void *arg)
+{
+    unsigned int submitted = 0;
+    unsigned int done = 0;
+    unsigned int i;
+    int ret;
+
+    if (!self->queued)
+        return 0;
+
+    while (submitted < self->queued) {
+        ret = io_uring_submit_and_wait(&self->ring, self->queued - submitted);
+        if (ret == -EINTR)
+            continue;
+        if (ret <= 0) {
+            ICECAST_LOG_ERROR("io_uring submit failed: %s", strerror(-ret));
+            self->broken = 1;
+            self->error = ret < 0 ? ret : -EIO;
+            break;
+        }
+        submitted += ret;
+    }
+
+    while (done < submitted) {
+        struct io_uring_cqe *cqe;
+
+        ret = io_uring_wait_cqe(&self->ring, &cqe);
+        if (ret == -EINTR)
+            continue;
+        if (ret != 0) {
+            ICECAST_LOG_ERROR("io_uring wait failed: %s", strerror(-ret));
+            self->broken = 1;
+            self->error = ret;
+            break;
+        }
+
+        i = (uintptr_t)io_uring_cqe_get_data(cqe);
+        callback(self->userdata[i], cqe->res, arg);
+        self->userdata[i] = NULL;
+        io_uring_cqe_seen(&self->ring, cqe);
+        done++;
+    }
+
+    /* whether those were sent is not known, so they get an error that can
+     * not be taken for a socket that is just not writable */
+    if (done < self->queued) {
+        if (self->error == -EAGAIN || self->error == -EINTR)
+            self->error = -EIO;
+        for (i = 0; i < self->queued; i++) {
+            if (self->userdata[i]) {
+                callback(self->userdata[i], self->error, arg);
+                self->userdata[i] = NULL;
+            }
+        }
+    }
+
+    self->queued = 0;
+
+    return self->broken ? -1 : 0;
+}
+
+#else
+
+uring_t *uring_new(unsigned int entries)
+{
+    (void)entries;
+    return NULL;
+}
+
+void uring_free(uring_t *self)
+{
+    (void)self;
+}
+
+int uring_queue_send(uring_t *self, int fd, const struct iovec *iov, size_t count, void *userdata)
+{
+    (void)self;
+    (void)fd;
+    (void)iov;
+    (void)count;
+    (void)userdata;
+    return -1;
+}
+
+int uring_complete(uring_t *self, uring_callback_t callback, void *arg)
+{
+    (void)self;
+    (void)callback;
+    (void)arg;
+    return -1;
+}
+
+#endif
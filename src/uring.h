@@ -0,0 +1,44 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* uring.h
+ *
+ * Batches sends to many sockets into one system call with io_uring, where
+ * liburing is available. The sends are non-blocking like the ones done with
+ * writev(), they are only handed to the kernel together and their results
+ * collected together. Without io_uring uring_new() always fails and the
+ * callers send the usual way.
+ */
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <sys/types.h>
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
+typedef struct uring_tag uring_t;
+
+/* called with the userdata of a send and its result, the number of bytes
+ * sent or -errno */
+typedef void (*uring_callback_t)(void *userdata, ssize_t result, void *arg);
+
+/* Returns NULL if io_uring can not be used */
+uring_t *uring_new(unsigned int entries);
+void     uring_free(uring_t *self);
+
+/* Queues a send of the buffers to fd. They must stay as they are until
+ * uring_complete() returned, userdata must not be NULL. Returns -1 if the
+ * ring is full. */
+int      uring_queue_send(uring_t *self, int fd, const struct iovec *iov, size_t count, void *userdata);
+/* Submits the queued sends and calls callback for each once it is done.
+ * Returns -1 if the ring failed and must not be used any more, the sends
+ * that were not reaped are reported with the error that broke it, never as
+ * -EAGAIN, as they may have been made in part. */
+int      uring_complete(uring_t *self, uring_callback_t callback, void *arg);
+
+#endif  /* __URING_H__ */
@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 #ifdef HAVE_SYS_SOCKET_H
 #include <sys/socket.h>
@@ -145,6 +146,20 @@ int util_timed_wait_for_fd(sock_t fd, int timeout)
 #endif
 }
 
+int util_set_read_timeout(sock_t fd, unsigned int timeout)
+{
+#ifdef _WIN32
+    DWORD tv = timeout * 1000;
+#else
+    struct timeval tv;
+
+    tv.tv_sec = timeout;
+    tv.tv_usec = 0;
+#endif
+
+    return setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (const void *)&tv, sizeof(tv)) == 0 ? 0 : -1;
+}
+
 int util_read_header(sock_t sock, char *buff, unsigned long len, int entire)
 {
     int read_bytes, ret;
@@ -600,13 +615,61 @@ unsigned int util_str_to_unsigned_int(const char *str, const unsigned int defaul
     return (unsigned int)(unsigned long int)val;
 }
 
+/* Cache of the headers from <http-headers> as they only depend on the
+ * configuration, the mount, the listen socket, the auth and ACL of the
+ * client and the status. The header lists of auths and ACLs are parsed with
+ * the configuration, so the generation tells stale ones apart as well. The
+ * origin of the request is the only per client value: it is left out of the
+ * cached text and copied in at the recorded offsets.
+ */
+#define HEADER_CACHE_SIZE   256 /* must be a power of two */
+#define HEADER_CACHE_SLOTS  4
+
+typedef struct {
+    unsigned int generation;
+    const mount_proxy *mountproxy;
+    const listener_t *listener;
+    /* the headers of the auth and ACL of the client, if any */
+    const ice_config_http_header_t *auth_headers;
+    const ice_config_http_header_t *acl_headers;
+    int status;
+    const char *allow;
+    int has_origin;
+    char *text;
+    size_t text_len;
+    size_t slots[HEADER_CACHE_SLOTS];
+    size_t slots_len;
+} header_cache_entry_t;
+
+static header_cache_entry_t header_cache[HEADER_CACHE_SIZE];
+static rwlock_t header_cache_lock;
+
+void util_initialize(void)
+{
+    thread_rwlock_create(&header_cache_lock);
+}
+
+void util_shutdown(void)
+{
+    size_t i;
+
+    thread_rwlock_wlock(&header_cache_lock);
+    for (i = 0; i < HEADER_CACHE_SIZE; i++) {
+        free(header_cache[i].text);
+        header_cache[i].text = NULL;
+    }
+    thread_rwlock_unlock(&header_cache_lock);
+    thread_rwlock_destroy(&header_cache_lock);
+}
+
 /* TODO, FIXME: handle memory allocation errors better. */
-static inline void   _build_headers_loop(char **ret, size_t *len, const ice_config_http_header_t *header, int status, const char *allow, client_t *client) {
+static inline void   _build_headers_loop(char **ret, size_t *len, const ice_config_http_header_t *header, int status, const char *allow, const char *origin, size_t *slots, size_t *slots_len) {
     size_t headerlen;
     const char *name;
     const char *value;
     char *r = *ret;
     char *n;
+    int slot;
 
     if (!header)
         return;
@@ -625,34 +688,31 @@ static inline void   _build_headers_loop(char **ret, size_t *len, const ice_conf
                 value = header->value;
             break;
             case HTTP_HEADER_TYPE_CORS:
-                if (name && client && client->parser) {
-                    const char *origin = httpp_getvar(client->parser, "origin");
-                    if (origin) {
-                        value = header->value;
-                        if (!value) {
-                            if (strcasecmp(name, "Access-Control-Allow-Origin") == 0) {
-                                if (status >= 200 && status <= 299) {
-                                    value = origin;
-                                } else if (status >= 400 && status <= 599) {
-                                    value = "null";
-                                } else {
-                                    /* do not set as we do not have a default for that. */
-                                }
-                            } else if (strcasecmp(name, "Access-Control-Allow-Methods") == 0) {
-                                if (status >= 200 && status <= 299) {
-                                    /* only use the default if we are posive reply. */
-                                    value = allow;
-                                }
-                            } else if (strcasecmp(name, "Access-Control-Expose-Headers") == 0) {
-                                value = "content-range, icy-br, icy-description, icy-genre, icy-name, icy-pub, icy-url";
-                            } else if (strcasecmp(name, "Access-Control-Max-Age") == 0) {
-                                value = "300"; /* 300s = 5 minutes */
-                            } else if (strcasecmp(name, "Access-Control-Allow-Headers") == 0) {
-                                value = "range, if-range";
-                            /* No default (yet)
-                             * } else if (strcasecmp(name, "Access-Control-Allow-Credentials") == 0) {
-                             */
+                if (name && origin) {
+                    value = header->value;
+                    if (!value) {
+                        if (strcasecmp(name, "Access-Control-Allow-Origin") == 0) {
+                            if (status >= 200 && status <= 299) {
+                                value = origin;
+                            } else if (status >= 400 && status <= 599) {
+                                value = "null";
+                            } else {
+                                /* do not set as we do not have a default for that. */
+                            }
+                        } else if (strcasecmp(name, "Access-Control-Allow-Methods") == 0) {
+                            if (status >= 200 && status <= 299) {
+                                /* only use the default if we are posive reply. */
+                                value = allow;
                             }
+                        } else if (strcasecmp(name, "Access-Control-Expose-Headers") == 0) {
+                            value = "content-range, icy-br, icy-description, icy-genre, icy-name, icy-pub, icy-url";
+                        } else if (strcasecmp(name, "Access-Control-Max-Age") == 0) {
+                            value = "300"; /* 300s = 5 minutes */
+                        } else if (strcasecmp(name, "Access-Control-Allow-Headers") == 0) {
+                            value = "range, if-range";
+                        /* No default (yet)
+                         * } else if (strcasecmp(name, "Access-Control-Allow-Credentials") == 0) {
+                         */
                         }
                     }
                 }
@@ -663,6 +723,11 @@ static inline void   _build_headers_loop(char **ret, size_t *len, const ice_conf
         if (!name || !value)
             continue;
 
+        /* when building a template the origin is left out and its offset recorded */
+        slot = slots && value == origin;
+        if (slot)
+            value = "";
+
         /* append the header to the buffer */
         headerlen = strlen(name) + strlen(value) + 4;
         *len += headerlen;
@@ -671,6 +736,11 @@ static inline void   _build_headers_loop(char **ret, size_t *len, const ice_conf
             r = n;
             strcat(r, name);
             strcat(r, ": ");
+            if (slot) {
+                if (*slots_len < HEADER_CACHE_SLOTS)
+                    slots[*slots_len] = strlen(r);
+                (*slots_len)++;
+            }
             strcat(r, value);
             strcat(r, "\r\n");
         } else {
@@ -680,34 +750,140 @@ static inline void   _build_headers_loop(char **ret, size_t *len, const ice_conf
     } while ((header = header->next));
     *ret = r;
 }
-static inline char * _build_headers(int status, const char *allow, ice_config_t *config, source_t *source, client_t *client) {
-    const ice_config_http_header_t *header;
-    mount_proxy *mountproxy = NULL;
+static inline char * _build_headers(int status, const char *allow, ice_config_t *config, const mount_proxy *mountproxy, const ice_config_http_header_t *auth_headers, const ice_config_http_header_t *acl_headers, const listener_t *listener, const char *origin, size_t *slots, size_t *slots_len) {
     char *ret = NULL;
     size_t len = 1;
 
+    ret = calloc(1, 1);
+    if (!ret)
+        return NULL;
+
+    _build_headers_loop(&ret, &len, config->http_headers, status, allow, origin, slots, slots_len);
+    if (mountproxy)
+        _build_headers_loop(&ret, &len, mountproxy->http_headers, status, allow, origin, slots, slots_len);
+    _build_headers_loop(&ret, &len, auth_headers, status, allow, origin, slots, slots_len);
+    _build_headers_loop(&ret, &len, acl_headers, status, allow, origin, slots, slots_len);
+    if (listener)
+        _build_headers_loop(&ret, &len, listener->http_headers, status, allow, origin, slots, slots_len);
+
+    return ret;
+}
+
+static char * _header_cache_fill(const char *text, size_t text_len, const size_t *slots, size_t slots_len, const char *origin)
+{
+    size_t origin_len = origin ? strlen(origin) : 0;
+    size_t done = 0;
+    size_t i;
+    char *ret;
+    char *p;
+
+    ret = p = malloc(text_len + slots_len * origin_len + 1);
+    if (!ret)
+        return NULL;
+
+    for (i = 0; i < slots_len; i++) {
+        memcpy(p, text + done, slots[i] - done);
+        p += slots[i] - done;
+        memcpy(p, origin, origin_len);
+        p += origin_len;
+        done = slots[i];
+    }
+    memcpy(p, text + done, text_len - done + 1);
+
+    return ret;
+}
+
+static char * _header_cache_get(int status, const char *allow, ice_config_t *config, const mount_proxy *mountproxy, const ice_config_http_header_t *auth_headers, const ice_config_http_header_t *acl_headers, const listener_t *listener, const char *origin)
+{
+    header_cache_entry_t *entry;
+    size_t slots[HEADER_CACHE_SLOTS];
+    size_t slots_len = 0;
+    int has_origin = origin != NULL;
+    uint32_t hash = UTIL_HASH_INIT;
+    char *text;
+    char *ret;
+
+    /* over the words of the key */
+    hash = util_hash_word(hash, (uintptr_t)mountproxy >> 4);
+    hash = util_hash_word(hash, (uintptr_t)listener >> 4);
+    hash = util_hash_word(hash, (uintptr_t)auth_headers >> 4);
+    hash = util_hash_word(hash, (uintptr_t)acl_headers >> 4);
+    hash = util_hash_word(hash, (uintptr_t)allow >> 2);
+    hash = util_hash_word(hash, status);
+    hash = util_hash_word(hash, has_origin);
+    entry = &(header_cache[hash & (HEADER_CACHE_SIZE - 1)]);
+
+    thread_rwlock_rlock(&header_cache_lock);
+    if (entry->text && entry->generation == config->generation &&
+        entry->mountproxy == mountproxy && entry->listener == listener &&
+        entry->auth_headers == auth_headers && entry->acl_headers == acl_headers &&
+        entry->allow == allow && entry->status == status && entry->has_origin == has_origin) {
+        ret = _header_cache_fill(entry->text, entry->text_len, entry->slots, entry->slots_len, origin);
+        thread_rwlock_unlock(&header_cache_lock);
+        return ret;
+    }
+    thread_rwlock_unlock(&header_cache_lock);
+
+    text = _build_headers(status, allow, config, mountproxy, auth_headers, acl_headers, listener, origin, slots, &slots_len);
+    if (!text)
+        return NULL;
+
+    if (slots_len > HEADER_CACHE_SLOTS) {
+        /* too many places to fill in, build it the plain way */
+        free(text);
+        return _build_headers(status, allow, config, mountproxy, auth_headers, acl_headers, listener, origin, NULL, NULL);
+    }
+
+    ret = _header_cache_fill(text, strlen(text), slots, slots_len, origin);
+
+    thread_rwlock_wlock(&header_cache_lock);
+    free(entry->text);
+    entry->generation = config->generation;
+    entry->mountproxy = mountproxy;
+    entry->listener = listener;
+    entry->auth_headers = auth_headers;
+    entry->acl_headers = acl_headers;
+    entry->status = status;
+    entry->allow = allow;
+    entry->has_origin = has_origin;
+    entry->text = text;
+    entry->text_len = strlen(text);
+    memcpy(entry->slots, slots, sizeof(slots));
+    entry->slots_len = slots_len;
+    thread_rwlock_unlock(&header_cache_lock);
+
+    return ret;
+}
+
+static char * _get_headers(int status, const char *allow, ice_config_t *config, source_t *source, client_t *client)
+{
+    const ice_config_http_header_t *auth_headers = NULL;
+    const ice_config_http_header_t *acl_headers = NULL;
+    const listener_t *listener = NULL;
+    mount_proxy *mountproxy = NULL;
+    const char *origin = NULL;
+    listensocket_t *listensocket = NULL;
+    char *ret;
+
     if (source)
         mountproxy = config_find_mount(config, source->mount, MOUNT_TYPE_NORMAL);
 
-    ret = calloc(1, 1);
-    *ret = 0;
-
-    _build_headers_loop(&ret, &len, config->http_headers, status, allow, client);
-    if (mountproxy && mountproxy->http_headers)
-        _build_headers_loop(&ret, &len, mountproxy->http_headers, status, allow, client);
-    if (client && client->auth && (header = client->auth->http_headers))
-        _build_headers_loop(&ret, &len, header, status, allow, client);
-    if (client && client->acl && (header = acl_get_http_headers(client->acl)))
-        _build_headers_loop(&ret, &len, header, status, allow, client);
-
-    if (client && client->con && client->con->listensocket_effective) {
-        const listener_t * listener = listensocket_get_listener(client->con->listensocket_effective);
-
-        if ((header = listener->http_headers))
-            _build_headers_loop(&ret, &len, header, status, allow, client);
-        listensocket_release_listener(client->con->listensocket_effective);
+    if (client) {
+        if (client->parser)
+            origin = httpp_getvar(client->parser, "origin");
+        if (client->auth)
+            auth_headers = client->auth->http_headers;
+        if (client->acl)
+            acl_headers = acl_get_http_headers(client->acl);
+        if (client->con && (listensocket = client->con->listensocket_effective))
+            listener = listensocket_get_listener(listensocket);
     }
 
+    ret = _header_cache_get(status, allow, config, mountproxy, auth_headers, acl_headers, listener, origin);
+
+    if (listensocket)
+        listensocket_release_listener(listensocket);
+
     return ret;
 }
 
@@ -835,7 +1011,7 @@ ssize_t util_http_build_header(char * out, size_t len, ssize_t offset,
     }
 
     config = config_get_config();
-    extra_headers = _build_headers(status, allow_header, config, source, client);
+    extra_headers = _get_headers(status, allow_header, config, source, client);
     ret = snprintf (out, len, "%sServer: %s\r\nConnection: %s\r\nAccept-Encoding: identity\r\nAllow: %s\r\n%s%s%s%s%s%s%s%s",
                               status_buffer,
                               config->server_id,
@@ -848,7 +1024,7 @@ ssize_t util_http_build_header(char * out, size_t len, ssize_t offset,
                               (cache     ? "" : "Cache-Control: no-cache, no-store\r\n"
                                                 "Expires: Mon, 26 Jul 1997 05:00:00 GMT\r\n"
                                                 "Pragma: no-cache\r\n"),
-                              extra_headers,
+                              (extra_headers ? extra_headers : ""),
                               (datablock ? "\r\n" : ""),
                               (datablock ? datablock : ""));
     free(extra_headers);
@@ -1299,6 +1475,9 @@ void util_kva_free(icecast_kva_t *kva)
     free(kva);
 }
 
+/* the index is kept at most half full */
+#define UTIL_DICT_MIN_INDEX 8
+
 util_dict *util_dict_new(void)
 {
     return (util_dict *)calloc(1, sizeof(util_dict));
@@ -1306,125 +1485,165 @@ util_dict *util_dict_new(void)
 
 void util_dict_free(util_dict *dict)
 {
-    util_dict *next;
+    size_t i;
+
+    if (!dict)
+        return;
 
-    while (dict) {
-        next = dict->next;
+    for (i = 0; i < dict->length; i++) {
+        free(dict->entries[i].key);
+        free(dict->entries[i].val);
+    }
+    free(dict->entries);
+    free(dict->index);
+    free(dict);
+}
 
-        if (dict->key)
-            free (dict->key);
-        if (dict->val)
-            free (dict->val);
-        free (dict);
+/* returns the slot of key in the index, or the free slot it would go in */
+static size_t util_dict_slot(const util_dict *dict, const char *key, size_t hash)
+{
+    size_t i;
 
-        dict = next;
+    for (i = hash & dict->index_mask; dict->index[i]; i = (i + 1) & dict->index_mask) {
+        const util_dict_entry *entry = &(dict->entries[dict->index[i] - 1]);
+
+        if (entry->hash == hash && strcmp(entry->key, key) == 0)
+            break;
     }
+
+    return i;
+}
+
+static int util_dict_grow(util_dict *dict)
+{
+    size_t allocated = dict->allocated ? dict->allocated * 2 : UTIL_DICT_MIN_INDEX / 2;
+    size_t index_size = allocated * 2;
+    util_dict_entry *entries;
+    size_t *index;
+    size_t i;
+
+    entries = realloc(dict->entries, sizeof(*entries) * allocated);
+    if (!entries)
+        return -1;
+    dict->entries = entries;
+
+    index = calloc(index_size, sizeof(*index));
+    if (!index)
+        return -1;
+
+    free(dict->index);
+    dict->index = index;
+    dict->index_mask = index_size - 1;
+    dict->allocated = allocated;
+
+    for (i = 0; i < dict->length; i++)
+        dict->index[util_dict_slot(dict, dict->entries[i].key, dict->entries[i].hash)] = i + 1;
+
+    return 0;
 }
 
 const char *util_dict_get(util_dict *dict, const char *key)
 {
-    while (dict) {
-        if (dict->key && !strcmp(key, dict->key))
-            return dict->val;
-        dict = dict->next;
-    }
-    return NULL;
+    size_t slot;
+
+    if (!dict || !key || !dict->length)
+        return NULL;
+
+    slot = util_dict_slot(dict, key, util_hash_string(key));
+    if (!dict->index[slot])
+        return NULL;
+
+    return dict->entries[dict->index[slot] - 1].val;
 }
 
 int util_dict_set(util_dict *dict, const char *key, const char *val)
 {
-    util_dict *prev;
+    util_dict_entry *entry;
+    size_t hash;
+    size_t slot;
+    char *copy;
 
     if (!dict || !key) {
         ICECAST_LOG_ERROR("NULL values passed to util_dict_set()");
         return 0;
     }
 
-    prev = NULL;
-    while (dict) {
-        if (!dict->key || !strcmp(dict->key, key))
-            break;
-        prev = dict;
-        dict = dict->next;
+    if (dict->length == dict->allocated && util_dict_grow(dict) < 0) {
+        ICECAST_LOG_ERROR("unable to allocate new dictionary");
+        return 0;
     }
 
-    if (!dict) {
-        dict = util_dict_new();
-        if (!dict) {
-            ICECAST_LOG_ERROR("unable to allocate new dictionary");
-            return 0;
-        }
-        if (prev)
-            prev->next = dict;
+    copy = val ? strdup(val) : NULL;
+    if (val && !copy) {
+        ICECAST_LOG_ERROR("unable to allocate new dictionary value");
+        return 0;
     }
 
-    if (dict->key)
-        free (dict->val);
-    else if (!(dict->key = strdup(key))) {
-        if (prev)
-            prev->next = NULL;
-        util_dict_free (dict);
-
-        ICECAST_LOG_ERROR("unable to allocate new dictionary key");
-        return 0;
+    hash = util_hash_string(key);
+    slot = util_dict_slot(dict, key, hash);
+    if (dict->index[slot]) {
+        entry = &(dict->entries[dict->index[slot] - 1]);
+        free(entry->val);
+        entry->val = copy;
+        return 1;
     }
 
-    dict->val = strdup(val);
-    if (!dict->val) {
-        ICECAST_LOG_ERROR("unable to allocate new dictionary value");
+    entry = &(dict->entries[dict->length]);
+    entry->key = strdup(key);
+    if (!entry->key) {
+        free(copy);
+        ICECAST_LOG_ERROR("unable to allocate new dictionary key");
         return 0;
     }
+    entry->val = copy;
+    entry->hash = hash;
+    dict->index[slot] = ++dict->length;
 
     return 1;
 }
 
 /* given a dictionary, URL-encode each val and stringify it in order as
-   key=val&key=val... if val is set, or just key&key if val is NULL.
-   TODO: Memory management needs overhaul. */
+   key=val&key=val... if val is set, or just key&key if val is NULL. */
 char *util_dict_urlencode(util_dict *dict, char delim)
 {
-    char *res, *tmp;
-    char *enc;
-    int start = 1;
+    char **enc;
+    char *ret = NULL;
+    size_t len = 0;
+    size_t i;
+    char *p;
 
-    for (res = NULL; dict; dict = dict->next) {
-        /* encode key */
-        if (!dict->key)
-            continue;
-        if (start) {
-            if (!(res = malloc(strlen(dict->key) + 1))) {
-                return NULL;
-            }
-            sprintf(res, "%s", dict->key);
-            start = 0;
-        } else {
-            if (!(tmp = realloc(res, strlen(res) + strlen(dict->key) + 2))) {
-                free(res);
-                return NULL;
-            } else
-                res = tmp;
-            sprintf(res + strlen(res), "%c%s", delim, dict->key);
-        }
+    if (!dict || !dict->length)
+        return NULL;
 
-        /* encode value */
-        if (!dict->val)
-            continue;
-        if (!(enc = util_url_escape(dict->val))) {
-            free(res);
-            return NULL;
+    enc = calloc(dict->length, sizeof(*enc));
+    if (!enc)
+        return NULL;
+
+    for (i = 0; i < dict->length; i++) {
+        len += strlen(dict->entries[i].key) + 1;
+        if (dict->entries[i].val) {
+            if (!(enc[i] = util_url_escape(dict->entries[i].val)))
+                break;
+            len += strlen(enc[i]) + 1;
         }
+    }
 
-        if (!(tmp = realloc(res, strlen(res) + strlen(enc) + 2))) {
-            free(enc);
-            free(res);
-            return NULL;
-        } else
-            res = tmp;
-        sprintf(res + strlen(res), "=%s", enc);
-        free(enc);
+    if (i == dict->length && (ret = malloc(len))) {
+        p = ret;
+        for (i = 0; i < dict->length; i++) {
+            if (i)
+                *p++ = delim;
+            p += sprintf(p, "%s", dict->entries[i].key);
+            if (enc[i])
+                p += sprintf(p, "=%s", enc[i]);
+        }
     }
 
-    return res;
+    for (i = 0; i < dict->length; i++)
+        free(enc[i]);
+    free(enc);
+
+    return ret;
 }
 
 #ifndef HAVE_LOCALTIME_R
@@ -16,6 +16,7 @@
 
 /* for FILE* */
 #include <stdio.h>
+#include <stdint.h>
 
 #include "common/net/sock.h"
 #include "icecasttypes.h"
@@ -29,7 +30,37 @@
 
 #define MAX_LINE_LEN 512
 
+void util_initialize(void);
+void util_shutdown(void);
+
+/* FNV-1a, the hash of the hash tables. A hash over several parts starts
+ * with UTIL_HASH_INIT and goes on with util_hash_string_continue() and
+ * util_hash_word() for each of them. */
+#define UTIL_HASH_INIT  2166136261U
+#define UTIL_HASH_PRIME 16777619U
+
+static inline uint32_t util_hash_string_continue(uint32_t hash, const char *str)
+{
+    for (; *str; str++)
+        hash = (hash ^ (unsigned char)*str) * UTIL_HASH_PRIME;
+
+    return hash;
+}
+
+static inline uint32_t util_hash_string(const char *str)
+{
+    return util_hash_string_continue(UTIL_HASH_INIT, str);
+}
+
+static inline uint32_t util_hash_word(uint32_t hash, uint32_t word)
+{
+    return (hash ^ word) * UTIL_HASH_PRIME;
+}
+
 int util_timed_wait_for_fd(sock_t fd, int timeout);
+/* Makes blocking reads of fd, such as sock_read_line(), fail after timeout
+ * seconds without data. Returns 0 on success. */
+int util_set_read_timeout(sock_t fd, unsigned int timeout);
 int util_read_header(sock_t sock, char *buff, unsigned long len, int entire);
 int util_check_valid_extension(const char *uri);
 char *util_get_extension(const char *path);
@@ -108,11 +139,21 @@ icecast_kva_t * util_parse_http_cn(const char *cnstr);
 void util_kva_free(icecast_kva_t *kva);
 
 /* String dictionary type, without support for NULL keys, or multiple
- * instances of the same key */
-typedef struct _util_dict {
+ * instances of the same key. Entries are kept in the order they were first
+ * set, with an open addressing hash table over them for lookups. */
+typedef struct {
     char *key;
     char *val;
-    struct _util_dict *next;
+    size_t hash;
+} util_dict_entry;
+
+typedef struct _util_dict {
+    util_dict_entry *entries;
+    size_t length;
+    size_t allocated;
+    /* entry number plus one, 0 for a free slot */
+    size_t *index;
+    size_t index_mask;
 } util_dict;
 
 util_dict *util_dict_new(void);
@@ -0,0 +1,103 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* waitlock.h
+ *
+ * Mutexes and condition variables for waiting on a predicate. The cond_t of
+ * the thread library comes with a mutex of its own, so the lock protecting
+ * the predicate can not be held across checking it and waiting, and wakeups
+ * sent in between get lost. Its mutexes can not be set up statically either,
+ * which the locks used before thread_initialize() need.
+ *
+ * This is the only place pthread mutexes and condition variables are used
+ * directly, everything else uses these or the thread library.
+ */
+
+#ifndef __WAITLOCK_H__
+#define __WAITLOCK_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+typedef struct {
+    pthread_mutex_t mutex;
+} waitlock_t;
+
+typedef struct {
+    pthread_cond_t cond;
+} waitcond_t;
+
+#define WAITLOCK_INITIALIZER    {PTHREAD_MUTEX_INITIALIZER}
+#define WAITCOND_INITIALIZER    {PTHREAD_COND_INITIALIZER}
+
+static inline void waitlock_create(waitlock_t *lock)
+{
+    pthread_mutex_init(&lock->mutex, NULL);
+}
+
+static inline void waitlock_destroy(waitlock_t *lock)
+{
+    pthread_mutex_destroy(&lock->mutex);
+}
+
+static inline void waitlock_lock(waitlock_t *lock)
+{
+    pthread_mutex_lock(&lock->mutex);
+}
+
+static inline void waitlock_unlock(waitlock_t *lock)
+{
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+static inline void waitcond_create(waitcond_t *cond)
+{
+    pthread_cond_init(&cond->cond, NULL);
+}
+
+static inline void waitcond_destroy(waitcond_t *cond)
+{
+    pthread_cond_destroy(&cond->cond);
+}
+
+/* lock should be held by the caller for these two */
+static inline void waitcond_signal(waitcond_t *cond)
+{
+    pthread_cond_signal(&cond->cond);
+}
+
+static inline void waitcond_broadcast(waitcond_t *cond)
+{
+    pthread_cond_broadcast(&cond->cond);
+}
+
+/* Waits with lock held, as with pthread_cond_wait() there may be spurious
+ * wakeups so the predicate is to be checked again */
+static inline void waitcond_wait(waitcond_t *cond, waitlock_t *lock)
+{
+    pthread_cond_wait(&cond->cond, &lock->mutex);
+}
+
+/* Sets deadline to ms milliseconds from now, for waitcond_wait_until() */
+static inline void waitcond_deadline(struct timespec *deadline, uint64_t ms)
+{
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += ms / 1000;
+    deadline->tv_nsec += (long)(ms % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+/* As waitcond_wait(), returns -1 once the deadline passed and 0 otherwise */
+static inline int waitcond_wait_until(waitcond_t *cond, waitlock_t *lock, const struct timespec *deadline)
+{
+    return pthread_cond_timedwait(&cond->cond, &lock->mutex, deadline) == 0 ? 0 : -1;
+}
+
+#endif  /* __WAITLOCK_H__ */
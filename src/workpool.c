@@ -0,0 +1,180 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/thread/thread.h"
+
+#include "workpool.h"
+#include "waitlock.h"
+
+#include "logging.h"
+#define CATMODULE "workpool"
+
+typedef struct {
+    workpool_t *pool;
+    size_t index;
+    thread_type *thread;
+} workpool_thread_t;
+
+struct workpool_tag {
+    char *name;
+    size_t slices;
+    workpool_thread_t *threads;
+
+    waitlock_t lock;
+    waitcond_t start;
+    waitcond_t done;
+
+    /* all below are protected by lock */
+    int running;
+    unsigned int generation;
+    size_t pending;
+    workpool_job_t job;
+    void *userdata;
+};
+
+static void *workpool_thread(void *arg)
+{
+    workpool_thread_t *self = arg;
+    workpool_t *pool = self->pool;
+    unsigned int generation = 0;
+
+    waitlock_lock(&pool->lock);
+    while (1) {
+        workpool_job_t job;
+        void *userdata;
+
+        while (pool->running && pool->generation == generation)
+            waitcond_wait(&pool->start, &pool->lock);
+
+        if (!pool->running)
+            break;
+
+        generation = pool->generation;
+        job = pool->job;
+        userdata = pool->userdata;
+        waitlock_unlock(&pool->lock);
+
+        job(self->index, pool->slices, userdata);
+
+        waitlock_lock(&pool->lock);
+        if (--pool->pending == 0)
+            waitcond_signal(&pool->done);
+    }
+    waitlock_unlock(&pool->lock);
+
+    return NULL;
+}
+
+workpool_t *workpool_new(const char *name, size_t slices)
+{
+    workpool_t *self;
+    size_t i;
+
+    if (!name || slices < 1)
+        return NULL;
+
+    self = calloc(1, sizeof(*self));
+    if (!self)
+        return NULL;
+
+    self->name = strdup(name);
+    self->threads = calloc(slices, sizeof(*self->threads));
+    if (!self->name || !self->threads) {
+        free(self->name);
+        free(self->threads);
+        free(self);
+        return NULL;
+    }
+
+    waitlock_create(&self->lock);
+    waitcond_create(&self->start);
+    waitcond_create(&self->done);
+    self->running = 1;
+    self->slices = 1;
+
+    /* slice 0 is handled by the caller of workpool_run() */
+    for (i = 1; i < slices; i++) {
+        self->threads[i].pool = self;
+        self->threads[i].index = i;
+        self->threads[i].thread = thread_create(self->name, workpool_thread, &(self->threads[i]), THREAD_ATTACHED);
+        if (!self->threads[i].thread) {
+            ICECAST_LOG_ERROR("Can not start thread %zu for pool %s", i, self->name);
+            break;
+        }
+        self->slices++;
+    }
+
+    if (self->slices != slices) {
+        workpool_free(self);
+        return NULL;
+    }
+
+    ICECAST_LOG_DEBUG("Pool %s started with %zu slices", self->name, self->slices);
+
+    return self;
+}
+
+void workpool_free(workpool_t *self)
+{
+    size_t i;
+
+    if (!self)
+        return;
+
+    waitlock_lock(&self->lock);
+    self->running = 0;
+    waitcond_broadcast(&self->start);
+    waitlock_unlock(&self->lock);
+
+    for (i = 1; i < self->slices; i++)
+        thread_join(self->threads[i].thread);
+
+    waitcond_destroy(&self->done);
+    waitcond_destroy(&self->start);
+    waitlock_destroy(&self->lock);
+
+    free(self->threads);
+    free(self->name);
+    free(self);
+}
+
+size_t workpool_get_slices(workpool_t *self)
+{
+    if (!self)
+        return 0;
+
+    return self->slices;
+}
+
+void workpool_run(workpool_t *self, workpool_job_t job, void *userdata)
+{
+    if (self->slices == 1) {
+        job(0, 1, userdata);
+        return;
+    }
+
+    waitlock_lock(&self->lock);
+    self->job = job;
+    self->userdata = userdata;
+    self->pending = self->slices - 1;
+    self->generation++;
+    waitcond_broadcast(&self->start);
+    waitlock_unlock(&self->lock);
+
+    job(0, self->slices, userdata);
+
+    waitlock_lock(&self->lock);
+    while (self->pending)
+        waitcond_wait(&self->done, &self->lock);
+    waitlock_unlock(&self->lock);
+}
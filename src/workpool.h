@@ -0,0 +1,39 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* workpool.h
+ *
+ * A fixed set of helper threads used to split one piece of work into
+ * slices that are processed in parallel. workpool_run() hands every slice to
+ * a thread, processes slice 0 in the calling thread and only returns once all
+ * slices are done. This makes it a simple fork-join barrier: anything the
+ * caller did before the call is visible to the job and anything the job did
+ * is visible to the caller after the call.
+ */
+
+#ifndef __WORKPOOL_H__
+#define __WORKPOOL_H__
+
+#include <stddef.h>
+
+typedef struct workpool_tag workpool_t;
+
+/* called once per slice, index is in [0, slices) */
+typedef void (*workpool_job_t)(size_t index, size_t slices, void *userdata);
+
+/* Creates a pool processing work in the given number of slices. One less
+ * thread than slices is started as the caller takes part in the work.
+ * Returns NULL on error.
+ */
+workpool_t *    workpool_new(const char *name, size_t slices);
+/* Stops and joins all threads. Must not be called while a job is running. */
+void            workpool_free(workpool_t *self);
+size_t          workpool_get_slices(workpool_t *self);
+/* Runs job on all slices and waits for them to finish. Only one thread may
+ * run jobs on a pool at any time. */
+void            workpool_run(workpool_t *self, workpool_job_t job, void *userdata);
+
+#endif  /* __WORKPOOL_H__ */
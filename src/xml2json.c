@@ -261,81 +261,110 @@ static void render_node_legacyresponse(json_renderer_t *renderer, xmlDocPtr doc,
         render_node_generic(renderer, doc, node, parent, cache);
 }
 
-static int handle_simple_child(json_renderer_t *renderer, xmlDocPtr doc, xmlNodePtr node, xmlNodePtr parent, struct xml2json_cache *cache, xmlNodePtr child, const char * number_keys[], const char * boolean_keys[])
+/* writes key and value if key is one of the typed keys, returns 0 if not */
+static int handle_typed_value(json_renderer_t *renderer, const char *key, const char *value, const char * number_keys[], const char * boolean_keys[])
 {
-    if (child->type == XML_ELEMENT_NODE && child->name) {
-        const char *childname = (const char *)child->name;
-        size_t i;
+    size_t i;
 
-        for (i = 0; number_keys[i]; i++) {
-            if (strcmp(childname, number_keys[i]) == 0) {
-                xmlChar *value = xmlNodeListGetString(doc, child->xmlChildrenNode, 1);
-                if (value) {
-                    json_renderer_write_key(renderer, childname, JSON_RENDERER_FLAGS_NONE);
-                    json_renderer_write_int(renderer, strtoll((const char*)value, NULL, 10));
-                    xmlFree(value);
-                    return 1;
-                }
-            }
+    for (i = 0; number_keys[i]; i++) {
+        if (strcmp(key, number_keys[i]) == 0) {
+            json_renderer_write_key(renderer, key, JSON_RENDERER_FLAGS_NONE);
+            json_renderer_write_int(renderer, strtoll(value, NULL, 10));
+            return 1;
         }
+    }
 
-        for (i = 0; boolean_keys[i]; i++) {
-            if (strcmp(childname, boolean_keys[i]) == 0) {
-                handle_booleanchildnode(renderer, doc, child, node, cache);
-                return 1;
-            }
+    for (i = 0; boolean_keys[i]; i++) {
+        if (strcmp(key, boolean_keys[i]) == 0) {
+            json_renderer_write_key(renderer, key, JSON_RENDERER_FLAGS_NONE);
+            json_renderer_write_boolean(renderer, util_str_to_bool(value));
+            return 1;
         }
+    }
 
-        if (strcmp(childname, "max_listeners") == 0) {
-            xmlChar *value = xmlNodeListGetString(doc, child->xmlChildrenNode, 1);
-            if (value) {
-                json_renderer_write_key(renderer, childname, JSON_RENDERER_FLAGS_NONE);
-                if (strcmp((const char *)value, "unlimited") == 0) {
-                    json_renderer_write_null(renderer);
-                } else {
-                    json_renderer_write_int(renderer, strtoll((const char*)value, NULL, 10));
-                }
-                xmlFree(value);
-                return 1;
-            }
+    if (strcmp(key, "max_listeners") == 0) {
+        json_renderer_write_key(renderer, key, JSON_RENDERER_FLAGS_NONE);
+        if (strcmp(value, "unlimited") == 0) {
+            json_renderer_write_null(renderer);
+        } else {
+            json_renderer_write_int(renderer, strtoll(value, NULL, 10));
         }
+        return 1;
+    }
 
-        if (strcmp(childname, "authenticator") == 0) {
-            xmlChar *value = xmlNodeListGetString(doc, child->xmlChildrenNode, 1);
-            if (value) {
+    if (strcmp(key, "authenticator") == 0) {
+        json_renderer_write_key(renderer, key, JSON_RENDERER_FLAGS_NONE);
+        json_renderer_write_boolean(renderer, strlen(value));
+        return 1;
+    }
+
+    return 0;
+}
+
+static int handle_simple_child(json_renderer_t *renderer, xmlDocPtr doc, xmlNodePtr node, xmlNodePtr parent, struct xml2json_cache *cache, xmlNodePtr child, const char * number_keys[], const char * boolean_keys[])
+{
+    if (child->type == XML_ELEMENT_NODE && child->name) {
+        const char *childname = (const char *)child->name;
+        xmlChar *value = xmlNodeListGetString(doc, child->xmlChildrenNode, 1);
+        size_t i;
+
+        if (value) {
+            int handled = handle_typed_value(renderer, childname, (const char *)value, number_keys, boolean_keys);
+
+            if (!handled && child->xmlChildrenNode && !child->xmlChildrenNode->next && child->xmlChildrenNode->type == XML_TEXT_NODE) {
                 json_renderer_write_key(renderer, childname, JSON_RENDERER_FLAGS_NONE);
-                json_renderer_write_boolean(renderer, strlen((const char *)value));
-                xmlFree(value);
-                return 1;
+                json_renderer_write_string(renderer, (const char *)value, JSON_RENDERER_FLAGS_NONE);
+                handled = 1;
             }
+
+            xmlFree(value);
+            return handled;
         }
 
-        if (child->xmlChildrenNode && !child->xmlChildrenNode->next && child->xmlChildrenNode->type == XML_TEXT_NODE) {
-            handle_textchildnode(renderer, doc, child, node, cache);
-            return 1;
+        /* booleans without a value are dropped */
+        for (i = 0; boolean_keys[i]; i++) {
+            if (strcmp(childname, boolean_keys[i]) == 0)
+                return 1;
         }
     }
 
     return 0;
 }
 
+/* keys of <icestats> and <source> that are not strings */
+static const char * legacystats_number_keys_global[] = {
+    "listeners", "clients", "client_connections", "connections", "file_connections", "listener_connections",
+    "source_client_connections", "source_relay_connections", "source_total_connections", "sources", "stats", "stats_connections",
+    "connections_rejected_ip_limit", "connections_rejected_ip_rate",
+    "listeners_rejected_bandwidth", "outgoing_kbitrate", "bandwidth_utilization",
+    "tls_handshakes", "tls_resumed_sessions", "tls_handshake_failures", "tls_handshake_workers",
+    "request_workers",
+    "tls_handshake_ms_le_5", "tls_handshake_ms_le_10", "tls_handshake_ms_le_25", "tls_handshake_ms_le_50",
+    "tls_handshake_ms_le_100", "tls_handshake_ms_le_250", "tls_handshake_ms_le_500", "tls_handshake_ms_le_1000",
+    "tls_handshake_ms_gt_1000", "auth_queued", "auth_in_flight", "auth_requests", "auth_request_ms",
+    "auth_cache_hits", "yp_in_flight", "yp_requests", "yp_request_failures", "yp_request_ms",
+    "events_queued", "events_dropped", "connection_writes", "connection_partial_writes",
+    "log_records_queued", "log_records_dropped", "listener_memory", "bytes_per_listener",
+    "memory_used", "memory_limit", "memory_sheds", "listeners_rejected_memory",
+    "latency_connection_write_count", "latency_connection_write_p50_us", "latency_connection_write_p90_us", "latency_connection_write_p99_us", "latency_connection_write_max_us",
+    "latency_request_queue_count", "latency_request_queue_p50_us", "latency_request_queue_p90_us", "latency_request_queue_p99_us", "latency_request_queue_max_us",
+    "latency_auth_queue_count", "latency_auth_queue_p50_us", "latency_auth_queue_p90_us", "latency_auth_queue_p99_us", "latency_auth_queue_max_us",
+    "latency_source_iteration_count", "latency_source_iteration_p50_us", "latency_source_iteration_p90_us", "latency_source_iteration_p99_us", "latency_source_iteration_max_us",
+    NULL
+};
+static const char * legacystats_boolean_keys_global[] = {
+    NULL
+};
+static const char * legacystats_number_keys_source[] = {
+    "audio_bitrate", "audio_channels", "audio_samplerate", "ice-bitrate", "listener_peak", "listeners", "slow_listeners",
+    "total_bytes_read", "total_bytes_sent", "connected", "outgoing_kbitrate", "bandwidth_utilization", NULL
+};
+static const char * legacystats_boolean_keys_source[] = {
+    "public", NULL
+};
+
 static void render_node_legacystats(json_renderer_t *renderer, xmlDocPtr doc, xmlNodePtr node, xmlNodePtr parent, struct xml2json_cache *cache)
 {
-    static const char * number_keys_global[] = {
-        "listeners", "clients", "client_connections", "connections", "file_connections", "listener_connections",
-        "source_client_connections", "source_relay_connections", "source_total_connections", "sources", "stats", "stats_connections", NULL
-    };
-    static const char * boolean_keys_global[] = {
-        NULL
-    };
-    static const char * number_keys_source[] = {
-        "audio_bitrate", "audio_channels", "audio_samplerate", "ice-bitrate", "listener_peak", "listeners", "slow_listeners",
-        "total_bytes_read", "total_bytes_sent", "connected", NULL
-    };
-    static const char * boolean_keys_source[] = {
-        "public", NULL
-    };
-
     int handled = 0;
 
     if (node->type == XML_ELEMENT_NODE) {
@@ -358,8 +387,8 @@ static void render_node_legacystats(json_renderer_t *renderer, xmlDocPtr doc, xm
                 xmlNodePtr cur = node->xmlChildrenNode;
                 do {
                     if (!handle_simple_child(renderer, doc, node, parent, cache, cur,
-                                is_icestats ? number_keys_global : number_keys_source,
-                                is_icestats ? boolean_keys_global : boolean_keys_source
+                                is_icestats ? legacystats_number_keys_global : legacystats_number_keys_source,
+                                is_icestats ? legacystats_boolean_keys_global : legacystats_boolean_keys_source
                                 )) {
                         nodelist_push(&nodelist, cur);
                     }
@@ -544,6 +573,8 @@ static void render_node_legacystats(json_renderer_t *renderer, xmlDocPtr doc, xm
                 } while (cur);
             }
             json_renderer_end(renderer);
+        } else if (strcmp(nodename, "modules") == 0) {
+            handled = handle_node_modules(renderer, doc, node, parent, cache);
         } else {
             handled = 0;
         }
@@ -857,3 +888,24 @@ char * xml2json_render_doc_simple(xmlDocPtr doc, const char *default_namespace)
 
     return json_renderer_finish(&renderer);
 }
+
+void xml2json_render_node(json_renderer_t *renderer, xmlDocPtr doc, xmlNodePtr node, const char *default_namespace)
+{
+    struct xml2json_cache cache;
+
+    memset(&cache, 0, sizeof(cache));
+    cache.default_namespace = default_namespace;
+
+    render_node(renderer, doc, node, NULL, &cache);
+}
+
+void xml2json_render_legacystats_value(json_renderer_t *renderer, int is_icestats, const char *key, const char *value)
+{
+    if (handle_typed_value(renderer, key, value,
+                is_icestats ? legacystats_number_keys_global : legacystats_number_keys_source,
+                is_icestats ? legacystats_boolean_keys_global : legacystats_boolean_keys_source))
+        return;
+
+    json_renderer_write_key(renderer, key, JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_string(renderer, value, JSON_RENDERER_FLAGS_NONE);
+}
@@ -13,6 +13,17 @@
 
 #include <libxml/tree.h>
 
+#include "json.h"
+
 char * xml2json_render_doc_simple(xmlDocPtr doc, const char *default_namespace);
 
+/* Renders node as a value into a renderer that is used for other output as
+ * well. This is for the parts of a direct rendering that still come as XML.
+ */
+void xml2json_render_node(json_renderer_t *renderer, xmlDocPtr doc, xmlNodePtr node, const char *default_namespace);
+/* Writes a key and its value from the stats as xml2json_render_doc_simple()
+ * would for a child of <icestats> (is_icestats set) or <source>.
+ */
+void xml2json_render_legacystats_value(json_renderer_t *renderer, int is_icestats, const char *key, const char *value);
+
 #endif
@@ -16,6 +16,7 @@
 #endif
 
 #include <string.h>
+#include <stdint.h>
 #include <libxml/xmlmemory.h>
 #include <libxml/debugXML.h>
 #include <libxml/HTMLtree.h>
@@ -42,6 +43,7 @@
 #endif
 
 #include "common/thread/thread.h"
+#include "common/timing/timing.h"
 #include "common/avl/avl.h"
 #include "common/httpp/httpp.h"
 #include "common/net/sock.h"
@@ -54,18 +56,44 @@
 #include "fserve.h"
 #include "util.h"
 #include "cfgfile.h"
+#include "atomic.h"
 
 #define CATMODULE "xslt"
 
 #include "logging.h"
 
+/* a parsed stylesheet, it is freed once the cache and all transformations
+ * using it let go of it */
 typedef struct {
+    volatile unsigned int refs;
+    xsltStylesheetPtr stylesheet;
+} stylesheet_t;
+
+typedef struct stylesheet_cache_tag {
     char *filename;
     time_t last_modified;
-    time_t cache_age;
-    xsltStylesheetPtr stylesheet;
+    /* when the file was last checked for changes, under the write lock */
+    time_t last_checked;
+    /* updated under the read lock, for eviction */
+    volatile uint64_t last_used;
+    stylesheet_t *stylesheet;
+    struct stylesheet_cache_tag *next;
 } stylesheet_cache_t;
 
+/* a transformation result kept for xslt_send_cached() */
+typedef struct xslt_output_tag {
+    char *filename;
+    char *key;
+    uint64_t generation;
+    /* ms as by timing_get_time() */
+    uint64_t created;
+    char *mediatype;
+    char *charset;
+    xmlChar *data;
+    int len;
+    struct xslt_output_tag *next;
+} xslt_output_t;
+
 #ifndef HAVE_XSLTSAVERESULTTOSTRING
 int xsltSaveResultToString(xmlChar **doc_txt_ptr, int * doc_txt_len, xmlDocPtr result, xsltStylesheetPtr style) {
     xmlOutputBufferPtr buf;
@@ -92,11 +120,20 @@ int xsltSaveResultToString(xmlChar **doc_txt_ptr, int * doc_txt_len, xmlDocPtr r
 }
 #endif
 
-/* Keep it small... */
-#define CACHESIZE 3
+/* seconds a cached stylesheet is used before its file is checked again */
+#define STYLESHEET_CHECK_INTERVAL 2
+
+/* the stylesheets are looked up under the read lock, loading and checking
+ * them takes the write lock. Transformations run without it. */
+static stylesheet_cache_t *cache;
+static size_t cache_count;
+static rwlock_t xsltlock;
 
-static stylesheet_cache_t cache[CACHESIZE];
-static mutex_t xsltlock;
+/* results kept at most */
+#define OUTPUT_CACHE_MAX 32
+
+static xslt_output_t *output_cache;
+static mutex_t output_lock;
 
 /* Reference to the original xslt loader func */
 static xsltDocLoaderFunc xslt_loader;
@@ -105,8 +142,10 @@ static xmlChar *admin_URI = NULL;
 
 void xslt_initialize(void)
 {
-    memset(cache, 0, sizeof(stylesheet_cache_t) * CACHESIZE);
-    thread_mutex_create(&xsltlock);
+    cache = NULL;
+    cache_count = 0;
+    thread_rwlock_create(&xsltlock);
+    thread_mutex_create(&output_lock);
     xmlInitParser();
     LIBXML_TEST_VERSION
     xmlSubstituteEntitiesDefault(1);
@@ -118,105 +157,206 @@ void xslt_shutdown(void) {
 
     xslt_clear_cache();
 
-    thread_mutex_destroy (&xsltlock);
+    thread_rwlock_destroy (&xsltlock);
+    thread_mutex_destroy (&output_lock);
     xmlCleanupParser();
     xsltCleanupGlobals();
     if (admin_URI)
         xmlFree(admin_URI);
 }
 
-static void clear_cache_entry(size_t idx) {
-    free(cache[idx].filename);
-    cache[idx].filename = NULL;
-    if (cache[idx].stylesheet)
-        xsltFreeStylesheet(cache[idx].stylesheet);
-    cache[idx].stylesheet = NULL;
+static void release_stylesheet(stylesheet_t *stylesheet)
+{
+    if (atomic_uint_sub(&stylesheet->refs, 1) == 0) {
+        xsltFreeStylesheet(stylesheet->stylesheet);
+        free(stylesheet);
+    }
+}
+
+static void clear_cache_entry(stylesheet_cache_t *entry) {
+    free(entry->filename);
+    if (entry->stylesheet)
+        release_stylesheet(entry->stylesheet);
+    free(entry);
 }
 
-void xslt_clear_cache(void)
+static void free_output(xslt_output_t *output)
 {
-    size_t i;
+    free(output->filename);
+    free(output->key);
+    free(output->mediatype);
+    free(output->charset);
+    xmlFree(output->data);
+    free(output);
+}
 
+void xslt_clear_cache(void)
+{
     ICECAST_LOG_DEBUG("Clearing stylesheet cache.");
 
-    thread_mutex_lock(&xsltlock);
+    thread_mutex_lock(&output_lock);
+    while (output_cache) {
+        xslt_output_t *output = output_cache;
+        output_cache = output->next;
+        free_output(output);
+    }
+    thread_mutex_unlock(&output_lock);
+
+    thread_rwlock_wlock(&xsltlock);
 
-    for (i = 0; i < CACHESIZE; i++)
-        clear_cache_entry(i);
+    while (cache) {
+        stylesheet_cache_t *entry = cache;
+        cache = entry->next;
+        clear_cache_entry(entry);
+    }
+    cache_count = 0;
 
     if (admin_URI) {
         xmlFree(admin_URI);
         admin_URI = NULL;
     }
 
-    thread_mutex_unlock(&xsltlock);
+    thread_rwlock_unlock(&xsltlock);
 }
 
-static int evict_cache_entry(void) {
-    int i, age=0, oldest=0;
+/* drops the least recently used stylesheet, must hold the write lock */
+static void evict_cache_entry(void) {
+    stylesheet_cache_t **prev, **oldest = NULL;
 
-    for(i=0; i < CACHESIZE; i++) {
-        if(cache[i].cache_age > age) {
-            age = cache[i].cache_age;
-            oldest = i;
-        }
+    for (prev = &cache; *prev; prev = &((*prev)->next)) {
+        if (!oldest || atomic_u64_load(&(*prev)->last_used) < atomic_u64_load(&(*oldest)->last_used))
+            oldest = prev;
     }
 
-    clear_cache_entry(oldest);
+    if (oldest) {
+        stylesheet_cache_t *entry = *oldest;
 
-    return oldest;
+        ICECAST_LOG_DEBUG("Evicting stylesheet \"%s\"", entry->filename);
+        *oldest = entry->next;
+        clear_cache_entry(entry);
+        cache_count--;
+    }
 }
 
-static xsltStylesheetPtr xslt_get_stylesheet(const char *fn) {
-    int i;
-    int empty = -1;
+static stylesheet_cache_t *find_cache_entry(const char *fn)
+{
+    stylesheet_cache_t *entry;
+
+    for (entry = cache; entry; entry = entry->next) {
+#ifdef _WIN32
+        if (!stricmp(fn, entry->filename))
+#else
+        if (!strcmp(fn, entry->filename))
+#endif
+            return entry;
+    }
+
+    return NULL;
+}
+
+static stylesheet_t *parse_stylesheet(const char *fn)
+{
+    stylesheet_t *stylesheet = calloc(1, sizeof(*stylesheet));
+
+    if (!stylesheet)
+        return NULL;
+
+    stylesheet->stylesheet = xsltParseStylesheetFile(XMLSTR(fn));
+    if (!stylesheet->stylesheet) {
+        free(stylesheet);
+        return NULL;
+    }
+    stylesheet->refs = 1;
+
+    return stylesheet;
+}
+
+/* returns a reference to the stylesheet, to be released with
+ * release_stylesheet() once done */
+static stylesheet_t *xslt_get_stylesheet(const char *fn) {
+    time_t now = time(NULL);
+    stylesheet_cache_t *entry;
+    stylesheet_t *ret = NULL;
     struct stat file;
+    size_t size;
+    ice_config_t *config;
 
     ICECAST_LOG_DEBUG("Looking up stylesheet file \"%s\".", fn);
 
+    thread_rwlock_rlock(&xsltlock);
+    entry = find_cache_entry(fn);
+    if (entry && (now - entry->last_checked) < STYLESHEET_CHECK_INTERVAL) {
+        ret = entry->stylesheet;
+        atomic_uint_add(&ret->refs, 1);
+        atomic_u64_store(&entry->last_used, now);
+    }
+    thread_rwlock_unlock(&xsltlock);
+
+    if (ret)
+        return ret;
+
+    /* not loaded yet or due for a check */
     if (stat(fn, &file) != 0) {
         ICECAST_LOG_WARN("Error checking for stylesheet file \"%s\": %s", fn,
                 strerror(errno));
         return NULL;
     }
 
-    for (i = 0; i < CACHESIZE; i++) {
-        if(cache[i].filename) {
-#ifdef _WIN32
-            if(!stricmp(fn, cache[i].filename)) {
-#else
-            if(!strcmp(fn, cache[i].filename)) {
-#endif
-                if(file.st_mtime > cache[i].last_modified) {
-                    ICECAST_LOG_DEBUG("Source file newer than cached copy. Reloading slot %i", i);
-                    xsltFreeStylesheet(cache[i].stylesheet);
-
-                    cache[i].last_modified = file.st_mtime;
-                    cache[i].stylesheet = xsltParseStylesheetFile(XMLSTR(fn));
-                    cache[i].cache_age = time(NULL);
-                }
-                ICECAST_LOG_DEBUG("Using cached sheet %i", i);
-                return cache[i].stylesheet;
+    config = config_get_config();
+    size = config->xslt_cache_size;
+    config_release_config();
+
+    thread_rwlock_wlock(&xsltlock);
+    entry = find_cache_entry(fn);
+    if (entry) {
+        if (file.st_mtime > entry->last_modified) {
+            stylesheet_t *stylesheet;
+
+            ICECAST_LOG_DEBUG("Source file newer than cached copy. Reloading \"%s\"", fn);
+            stylesheet = parse_stylesheet(fn);
+            if (stylesheet) {
+                release_stylesheet(entry->stylesheet);
+                entry->stylesheet = stylesheet;
+                entry->last_modified = file.st_mtime;
             }
-        } else {
-            empty = i;
         }
-    }
-
-    if (empty >= 0) {
-        i = empty;
-        ICECAST_LOG_DEBUG("Using empty slot %i", i);
+        entry->last_checked = now;
+        ICECAST_LOG_DEBUG("Using cached sheet \"%s\"", fn);
     } else {
-        i = evict_cache_entry();
-        ICECAST_LOG_DEBUG("Using evicted slot %i", i);
+        stylesheet_t *stylesheet = parse_stylesheet(fn);
+
+        if (!stylesheet) {
+            thread_rwlock_unlock(&xsltlock);
+            return NULL;
+        }
+
+        entry = calloc(1, sizeof(*entry));
+        if (entry)
+            entry->filename = strdup(fn);
+        if (!entry || !entry->filename) {
+            /* used just this once */
+            free(entry);
+            thread_rwlock_unlock(&xsltlock);
+            return stylesheet;
+        }
+
+        while (cache_count && cache_count >= size)
+            evict_cache_entry();
+
+        entry->stylesheet = stylesheet;
+        entry->last_modified = file.st_mtime;
+        entry->last_checked = now;
+        entry->next = cache;
+        cache = entry;
+        cache_count++;
     }
 
-    cache[i].last_modified = file.st_mtime;
-    cache[i].filename = strdup(fn);
-    cache[i].stylesheet = xsltParseStylesheetFile(XMLSTR(fn));
-    cache[i].cache_age = time(NULL);
+    ret = entry->stylesheet;
+    atomic_uint_add(&ret->refs, 1);
+    atomic_u64_store(&entry->last_used, now);
+    thread_rwlock_unlock(&xsltlock);
 
-    return cache[i].stylesheet;
+    return ret;
 }
 
 /* Custom xslt loader */
@@ -320,9 +460,88 @@ static inline void _send_error(client_t *client, icecast_error_id_t id, int old_
     client_send_error_by_id(client, id);
 }
 
-void xslt_transform(xmlDocPtr doc, const char *xslfilename, client_t *client, int status, const char *location, const char **params)
+static unsigned int output_max_age(void)
+{
+    ice_config_t *config = config_get_config();
+    unsigned int max_age = config->xslt_output_cache_age;
+    config_release_config();
+
+    return max_age;
+}
+
+/* stores a copy of the result, the oldest one is dropped if the cache is full */
+static void store_output(const char *xslfilename, const char *key, uint64_t generation, const char *mediatype, const char *charset, const xmlChar *data, int len)
+{
+    xslt_output_t *output = calloc(1, sizeof(*output));
+    xslt_output_t **prev;
+    size_t count = 0;
+
+    if (!output)
+        return;
+
+    output->filename = strdup(xslfilename);
+    output->key = strdup(key);
+    output->generation = generation;
+    output->created = timing_get_time();
+    output->mediatype = mediatype ? strdup(mediatype) : NULL;
+    output->charset = charset ? strdup(charset) : NULL;
+    output->data = xmlStrndup(data, len);
+    output->len = len;
+
+    if (!output->filename || !output->key || !output->data) {
+        free_output(output);
+        return;
+    }
+
+    thread_mutex_lock(&output_lock);
+    /* drop the result it replaces, new ones are added to the front */
+    for (prev = &output_cache; *prev; ) {
+        xslt_output_t *old = *prev;
+
+        if (count >= (OUTPUT_CACHE_MAX - 1) || (strcmp(old->filename, xslfilename) == 0 && strcmp(old->key, key) == 0)) {
+            *prev = old->next;
+            free_output(old);
+            continue;
+        }
+        count++;
+        prev = &(old->next);
+    }
+    output->next = output_cache;
+    output_cache = output;
+    thread_mutex_unlock(&output_lock);
+}
+
+int xslt_send_cached(const char *xslfilename, const char *key, uint64_t generation, client_t *client)
+{
+    unsigned int max_age = output_max_age();
+    uint64_t now = timing_get_time();
+    xslt_output_t *output;
+
+    if (!max_age)
+        return -1;
+
+    thread_mutex_lock(&output_lock);
+    for (output = output_cache; output; output = output->next) {
+        if (strcmp(output->filename, xslfilename) != 0 || strcmp(output->key, key) != 0)
+            continue;
+
+        if (output->generation != generation || (now - output->created) > ((uint64_t)max_age * 1000))
+            break;
+
+        ICECAST_LOG_DEBUG("Using cached result of stylesheet \"%s\"", xslfilename);
+        client_send_buffer(client, 200, output->mediatype, output->charset, (const char *)output->data, output->len, "");
+        thread_mutex_unlock(&output_lock);
+        return 0;
+    }
+    thread_mutex_unlock(&output_lock);
+
+    return -1;
+}
+
+static void xslt_transform_real(xmlDocPtr doc, const char *xslfilename, client_t *client, int status, const char *location, const char **params, const char *key, uint64_t generation)
 {
     xmlDocPtr res;
+    stylesheet_t *stylesheet;
     xsltStylesheetPtr cur;
     xmlChar *string;
     int len, problem = 0;
@@ -333,16 +552,15 @@ void xslt_transform(xmlDocPtr doc, const char *xslfilename, client_t *client, in
     xsltSetGenericErrorFunc("", log_parse_failure);
     xsltSetLoaderFunc(custom_loader);
 
-    thread_mutex_lock(&xsltlock);
-    cur = xslt_get_stylesheet(xslfilename);
+    stylesheet = xslt_get_stylesheet(xslfilename);
 
-    if (cur == NULL)
+    if (stylesheet == NULL)
     {
-        thread_mutex_unlock(&xsltlock);
         ICECAST_LOG_ERROR("problem reading stylesheet \"%s\"", xslfilename);
         _send_error(client, ICECAST_ERROR_XSLT_PARSE, status);
         return;
     }
+    cur = stylesheet->stylesheet;
 
     res = xsltApplyStylesheet(cur, doc, params);
     if (res != NULL) {
@@ -373,20 +591,34 @@ void xslt_transform(xmlDocPtr doc, const char *xslfilename, client_t *client, in
         char extra_header[512] = "";
 
         if (location) {
-            int res = snprintf(extra_header, sizeof(extra_header), "Location: %s\r\n", location);
-            if (res < 0 || res >= (ssize_t)sizeof(extra_header)) {
+            int ret = snprintf(extra_header, sizeof(extra_header), "Location: %s\r\n", location);
+            if (ret < 0 || ret >= (ssize_t)sizeof(extra_header)) {
                 client_send_error_by_id(client, ICECAST_ERROR_GEN_HEADER_GEN_FAILED);
+                xmlFree(string);
+                release_stylesheet(stylesheet);
+                xmlFreeDoc(res);
                 return;
             }
         }
 
+        if (key)
+            store_output(xslfilename, key, generation, mediatype, charset, string, len);
         client_send_buffer(client, status, mediatype, charset, (const char *)string, len, extra_header);
         xmlFree(string);
     } else {
         ICECAST_LOG_WARN("problem applying stylesheet \"%s\"", xslfilename);
         _send_error(client, ICECAST_ERROR_XSLT_problem, status);
     }
-    thread_mutex_unlock (&xsltlock);
+    release_stylesheet(stylesheet);
     xmlFreeDoc(res);
 }
 
+void xslt_transform(xmlDocPtr doc, const char *xslfilename, client_t *client, int status, const char *location, const char **params)
+{
+    xslt_transform_real(doc, xslfilename, client, status, location, params, NULL, 0);
+}
+
+void xslt_transform_cached(xmlDocPtr doc, const char *xslfilename, const char *key, uint64_t generation, client_t *client)
+{
+    xslt_transform_real(doc, xslfilename, client, 200, NULL, NULL, output_max_age() ? key : NULL, generation);
+}
@@ -15,9 +15,22 @@
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 
+#include <stdint.h>
+
 #include "icecasttypes.h"
 
 void xslt_transform(xmlDocPtr doc, const char *xslfilename, client_t *client, int status, const char *location, const char **params);
+/* As xslt_transform() with status 200, but the result is kept for
+ * xslt_send_cached() if <xslt-output-cache-age> is set. key tells apart
+ * results of the same stylesheet that depend on the request, generation is
+ * the state of the stats the document was built from.
+ */
+void xslt_transform_cached(xmlDocPtr doc, const char *xslfilename, const char *key, uint64_t generation, client_t *client);
+/* Sends the kept result of xslfilename for key if it is for this generation
+ * and not older than <xslt-output-cache-age>. Returns 0 if it was sent and
+ * -1 if the document needs to be transformed.
+ */
+int xslt_send_cached(const char *xslfilename, const char *key, uint64_t generation, client_t *client);
 void xslt_initialize(void);
 void xslt_shutdown(void);
 void xslt_clear_cache(void);
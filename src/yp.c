@@ -19,8 +19,10 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <inttypes.h>
 
 #include "common/thread/thread.h"
+#include "common/timing/timing.h"
 
 #include "yp.h"
 #include "global.h"
@@ -38,6 +40,11 @@
 
 #define CATMODULE "yp"
 
+/* requests in flight to a single YP server at once */
+#define YP_MAX_REQUESTS     8
+/* seconds no requests are sent to a YP server that could not be reached */
+#define YP_SERVER_RETRY     900
+
 struct yp_server
 {
     char        *url;
@@ -47,10 +54,21 @@ struct yp_server
     int         remove;
     char        *listen_socket_id;
 
-    CURL *curl;
+    /* one handle per request in flight, they are kept so the connections
+     * to the server are reused */
+    CURL *curl[YP_MAX_REQUESTS];
+    struct ypdata_tag *busy[YP_MAX_REQUESTS];
+    uint64_t started[YP_MAX_REQUESTS];
+    time_t retry;
+    /* the stats of the server are published as yp_server_<index>_... */
+    unsigned int index;
+    /* requests finished, those of them that failed and the ms they took */
+    uint64_t requests;
+    uint64_t failures;
+    uint64_t request_ms;
     struct ypdata_tag *mounts, *pending_mounts;
     struct yp_server *next;
-    char curl_error[CURL_ERROR_SIZE];
+    char curl_error[YP_MAX_REQUESTS][CURL_ERROR_SIZE];
 };
 
 
@@ -80,6 +98,9 @@ typedef struct ypdata_tag
     unsigned touch_interval;
     char *error_msg;
     int (*process)(struct ypdata_tag *yp, char *s, unsigned len);
+    /* what the request in flight is for, NULL if there is none */
+    int (*request)(struct ypdata_tag *yp, char *s, unsigned len);
+    const char *request_cmd;
 
     struct ypdata_tag *next;
 } ypdata_t;
@@ -95,6 +116,9 @@ static time_t now;
 static thread_type *yp_thread;
 static volatile unsigned client_limit = 0;
 static volatile char *server_version = NULL;
+/* only used by the YP thread */
+static CURLM *yp_multi;
+static unsigned int yp_in_flight;
 
 static void *yp_update_thread(void *arg);
 static void add_yp_info(ypdata_t *yp, void *info, int type);
@@ -127,7 +151,7 @@ static size_t handle_returned_header (void *ptr, size_t size, size_t nmemb, void
             sscanf (ptr + 11, "%[^\r\n]", yp->error_msg);
     }
 
-    if (yp->process == do_yp_add)
+    if (yp->request == do_yp_add)
     {
         if (strncasecmp (ptr, "SID: ", 5) == 0)
         {
@@ -175,14 +199,90 @@ static struct yp_server *find_yp_server (const char *url)
 }
 
 
+/* publishes the counters of the server, or removes them if clear is set */
+static void yp_server_stats (struct yp_server *server, int clear)
+{
+    char name[64];
+    unsigned int in_flight = 0;
+    size_t i;
+
+    for (i = 0; i < YP_MAX_REQUESTS; i++)
+        if (server->busy[i])
+            in_flight++;
+
+    snprintf (name, sizeof (name), "yp_server_%u_url", server->index);
+    stats_event (NULL, name, clear ? NULL : server->url);
+    snprintf (name, sizeof (name), "yp_server_%u_requests", server->index);
+    if (clear)
+        stats_event (NULL, name, NULL);
+    else
+        stats_event_args (NULL, name, "%" PRIu64, server->requests);
+    snprintf (name, sizeof (name), "yp_server_%u_failures", server->index);
+    if (clear)
+        stats_event (NULL, name, NULL);
+    else
+        stats_event_args (NULL, name, "%" PRIu64, server->failures);
+    snprintf (name, sizeof (name), "yp_server_%u_in_flight", server->index);
+    if (clear)
+        stats_event (NULL, name, NULL);
+    else
+        stats_event_args (NULL, name, "%u", in_flight);
+}
+
+
+/* lowest index not taken by another server, yp_lock is held */
+static unsigned int yp_server_index (void)
+{
+    struct yp_server *server;
+    unsigned int index = 0;
+
+    do
+    {
+        for (server = (struct yp_server *)active_yps; server; server = server->next)
+            if (server->index == index)
+                break;
+        if (server == NULL)
+            for (server = (struct yp_server *)pending_yps; server; server = server->next)
+                if (server->index == index)
+                    break;
+        if (server)
+            index++;
+    } while (server);
+
+    return index;
+}
+
+
+/* drops the requests in flight to the server */
+static void yp_cancel_requests (struct yp_server *server)
+{
+    size_t i;
+
+    for (i = 0; i < YP_MAX_REQUESTS; i++)
+    {
+        if (server->busy[i] == NULL)
+            continue;
+        curl_multi_remove_handle (yp_multi, server->curl[i]);
+        server->busy[i]->request = NULL;
+        server->busy[i] = NULL;
+        yp_in_flight--;
+        stats_global_dec(STATS_GLOBAL_YP_IN_FLIGHT);
+    }
+}
+
+
 static void destroy_yp_server (struct yp_server *server)
 {
     ypdata_t *yp;
+    size_t i;
 
     if (server == NULL)
         return;
     ICECAST_LOG_DEBUG("Removing YP server entry for %s", server->url);
 
+    yp_cancel_requests (server);
+    yp_server_stats (server, 1);
+
     /* delete yps:
      * first move all pendings into main queue.
      * then mark all main queue entries for deleting.
@@ -196,7 +296,8 @@ static void destroy_yp_server (struct yp_server *server)
     }
     delete_marked_yp(server);
 
-    icecast_curl_free(server->curl);
+    for (i = 0; i < YP_MAX_REQUESTS; i++)
+        icecast_curl_free(server->curl[i]);
     if (server->mounts) ICECAST_LOG_WARN("active ypdata not freed");
     if (server->pending_mounts) ICECAST_LOG_WARN("pending ypdata not freed");
     free (server->url);
@@ -250,13 +351,21 @@ void yp_recheck_config (ice_config_t *config)
                 destroy_yp_server (server);
                 break;
             }
+            server->index = yp_server_index ();
             server->server_id = strdup ((char *)server_version);
             server->url = strdup (yp->url);
             server->url_timeout = yp->timeout;
             server->touch_interval = yp->touch_interval;
             server->listen_socket_id = yp->listen_socket_id;
-            server->curl = icecast_curl_new(server->url, &(server->curl_error[0]));
-            if (server->curl == NULL)
+            for (size_t i = 0; i < YP_MAX_REQUESTS; i++)
+            {
+                server->curl[i] = icecast_curl_new(server->url, &(server->curl_error[i][0]));
+                if (server->curl[i] == NULL)
+                    break;
+                curl_easy_setopt (server->curl[i], CURLOPT_HEADERFUNCTION, handle_returned_header);
+                curl_easy_setopt (server->curl[i], CURLOPT_PRIVATE, server);
+            }
+            if (server->curl[YP_MAX_REQUESTS - 1] == NULL)
             {
                 destroy_yp_server (server);
                 break;
@@ -265,7 +374,6 @@ void yp_recheck_config (ice_config_t *config)
                 server->url_timeout = 6;
             if (server->touch_interval < 30)
                 server->touch_interval = 30;
-            curl_easy_setopt (server->curl, CURLOPT_HEADERFUNCTION, handle_returned_header);
             server->next = (struct yp_server *)pending_yps;
             pending_yps = server;
             ICECAST_LOG_INFO("Adding new YP server \"%s\" (timeout %ds, default interval %ds)",
@@ -296,37 +404,73 @@ void yp_initialize(void)
 
 
 
-/* handler for curl, checks if successful handling occurred
- * return 0 for ok, -1 for this entry failed, -2 for server fail.
- * On failure case, update and process are modified
+/* Starts a request to the YP server, it is finished by yp_request_done()
+ * once the server answered. Returns 0 if it was started, -1 if not.
  */
 static int send_to_yp (const char *cmd, ypdata_t *yp, char *post)
 {
-    int curlcode;
     struct yp_server *server = yp->server;
+    size_t i;
+
+    for (i = 0; i < YP_MAX_REQUESTS; i++)
+        if (server->busy[i] == NULL)
+            break;
+    if (yp_multi == NULL || i == YP_MAX_REQUESTS)
+    {
+        yp->next_update = now + 60;
+        return -1;
+    }
 
     /* ICECAST_LOG_DEBUG("send YP (%s):%s", cmd, post); */
     yp->cmd_ok = 0;
-    curl_easy_setopt (server->curl, CURLOPT_POSTFIELDS, post);
-    curl_easy_setopt (server->curl, CURLOPT_WRITEHEADER, yp);
-    curlcode = curl_easy_perform (server->curl);
+    yp->request = yp->process;
+    yp->request_cmd = cmd;
+    curl_easy_setopt (server->curl[i], CURLOPT_COPYPOSTFIELDS, post);
+    curl_easy_setopt (server->curl[i], CURLOPT_WRITEHEADER, yp);
+    if (curl_multi_add_handle (yp_multi, server->curl[i]) != CURLM_OK)
+    {
+        ICECAST_LOG_ERROR("Can not start YP %s on %s", cmd, server->url);
+        yp->request = NULL;
+        yp->next_update = now + 60;
+        return -1;
+    }
+    server->busy[i] = yp;
+    server->started[i] = timing_get_time();
+    yp_in_flight++;
+    stats_global_inc(STATS_GLOBAL_YP_IN_FLIGHT);
+    yp_server_stats (server, 0);
+
+    return 0;
+}
+
+
+/* checks if successful handling occurred
+ * return 0 for ok, -1 for this entry failed, -2 for server fail.
+ * On failure case, update and process are modified
+ */
+static int check_yp_response (ypdata_t *yp, CURLcode curlcode, const char *curl_error)
+{
+    struct yp_server *server = yp->server;
+    const char *cmd = yp->request_cmd;
+
     if (curlcode)
     {
         yp->process = do_yp_add;
         yp->next_update = now + 1200;
-        ICECAST_LOG_ERROR("connection to %s failed with \"%s\"", server->url, server->curl_error);
+        ICECAST_LOG_ERROR("connection to %s failed with \"%s\" (%" PRIu64 " of %" PRIu64 " requests failed)",
+                server->url, curl_error, server->failures + 1, server->requests);
         return -2;
     }
     if (yp->cmd_ok == 0)
     {
         if (yp->error_msg == NULL)
             yp->error_msg = strdup ("no response from server");
-        if (yp->process == do_yp_add)
+        if (yp->request == do_yp_add)
         {
             ICECAST_LOG_ERROR("YP %s on %s failed: %s", cmd, server->url, yp->error_msg);
             yp->next_update = now + 7200;
         }
-        if (yp->process == do_yp_touch)
+        if (yp->request == do_yp_touch)
         {
             /* At this point the touch request failed, either because they rejected our session
              * or the server isn't accessible. This means we have to wait before doing another
@@ -350,6 +494,106 @@ static int send_to_yp (const char *cmd, ypdata_t *yp, char *post)
 }
 
 
+/* finishes the request in flight on handle i of the server */
+static void yp_request_done (struct yp_server *server, size_t i, CURLcode curlcode)
+{
+    ypdata_t *yp = server->busy[i];
+    uint64_t ms = timing_get_time() - server->started[i];
+    int (*request)(ypdata_t *yp, char *s, unsigned len);
+    int ret;
+
+    curl_multi_remove_handle (yp_multi, server->curl[i]);
+    server->busy[i] = NULL;
+    yp_in_flight--;
+    stats_global_dec(STATS_GLOBAL_YP_IN_FLIGHT);
+
+    server->requests++;
+    server->request_ms += ms;
+    stats_global_inc(STATS_GLOBAL_YP_REQUESTS);
+    stats_global_add(STATS_GLOBAL_YP_REQUEST_MS, ms);
+
+    now = time (NULL);
+    ret = check_yp_response (yp, curlcode, server->curl_error[i]);
+    request = yp->request;
+    yp->request = NULL;
+    if (ret < 0)
+    {
+        server->failures++;
+        stats_global_inc(STATS_GLOBAL_YP_REQUEST_FAILURES);
+    }
+    /* Assume YP server is dead and skip it for now */
+    if (ret == -2)
+        server->retry = now + YP_SERVER_RETRY;
+
+    if (request == do_yp_remove)
+    {
+        free (yp->sid);
+        yp->sid = NULL;
+        yp->remove = 1;
+        yp->process = do_yp_add;
+        yp_update = 1;
+    }
+    else if (ret == 0 && request == do_yp_add)
+    {
+        yp->process = do_yp_touch;
+        /* force first touch in 5 secs */
+        yp->next_update = now + 5;
+    }
+    else if (ret == 0 && request == do_yp_touch)
+    {
+        yp->next_update = now + yp->touch_interval;
+    }
+
+    ICECAST_LOG_DEBUG("YP server %s: %" PRIu64 " requests, %" PRIu64 " failed, %" PRIu64 " ms on average",
+            server->url, server->requests, server->failures, server->request_ms / server->requests);
+    yp_server_stats (server, 0);
+}
+
+
+/* runs the requests in flight and finishes the answered ones */
+static void yp_perform (void)
+{
+    CURLMsg *msg;
+    int running, left;
+
+    if (yp_multi == NULL || yp_in_flight == 0)
+        return;
+
+    curl_multi_perform (yp_multi, &running);
+    while ((msg = curl_multi_info_read (yp_multi, &left)) != NULL)
+    {
+        struct yp_server *server = NULL;
+        size_t i;
+
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+        curl_easy_getinfo (msg->easy_handle, CURLINFO_PRIVATE, (char **)&server);
+        if (server == NULL)
+            continue;
+        for (i = 0; i < YP_MAX_REQUESTS; i++)
+        {
+            if (server->curl[i] == msg->easy_handle && server->busy[i])
+            {
+                yp_request_done (server, i, msg->data.result);
+                break;
+            }
+        }
+    }
+}
+
+
+/* waits for the YP servers to answer, up to ms */
+static void yp_wait (int ms)
+{
+    if (yp_multi == NULL || yp_in_flight == 0)
+    {
+        global_sleep (ms);
+        return;
+    }
+    curl_multi_wait (yp_multi, NULL, 0, ms, NULL);
+}
+
+
 /* routines for building and issues requests to the YP server */
 static int do_yp_remove (ypdata_t *yp, char *s, unsigned len)
 {
@@ -362,9 +606,12 @@ static int do_yp_remove (ypdata_t *yp, char *s, unsigned len)
             return ret+1;
 
         ICECAST_LOG_INFO("clearing up YP entry for %s", yp->mount);
-        ret = send_to_yp ("remove", yp, s);
+        /* the entry is removed once the request is done */
+        if (send_to_yp ("remove", yp, s) == 0)
+            return 0;
         free (yp->sid);
         yp->sid = NULL;
+        ret = 0;
     }
     yp->remove = 1;
     yp->process = do_yp_add;
@@ -429,14 +676,7 @@ static int do_yp_add (ypdata_t *yp, char *s, unsigned len)
 
     if (ret >= (signed)len)
         return ret+1;
-    ret = send_to_yp ("add", yp, s);
-    if (ret == 0)
-    {
-        yp->process = do_yp_touch;
-        /* force first touch in 5 secs */
-        yp->next_update = time(NULL) + 5;
-    }
-    return ret;
+    return send_to_yp ("add", yp, s);
 }
 
 
@@ -497,12 +737,7 @@ static int do_yp_touch (ypdata_t *yp, char *s, unsigned len)
     if (ret >= (signed)len)
         return ret+1; /* space required for above text and nul*/
 
-    if (send_to_yp ("touch", yp, s) == 0)
-    {
-        yp->next_update = now + yp->touch_interval;
-        return 0;
-    }
-    return -1;
+    return send_to_yp ("touch", yp, s);
 }
 
 
@@ -541,27 +776,33 @@ static int process_ypdata(struct yp_server *server, ypdata_t *yp)
 }
 
 
+/* starts the requests that are due, as long as there are free handles */
 static void yp_process_server (struct yp_server *server)
 {
     ypdata_t *yp;
-    int state = 0;
+    size_t free_handles = 0;
+    size_t i;
+
+    now = time (NULL);
+    /* if one of the streams showed that the server cannot be contacted then
+     * the other entries are updated later */
+    if (now < server->retry)
+        return;
+
+    for (i = 0; i < YP_MAX_REQUESTS; i++)
+        if (server->busy[i] == NULL)
+            free_handles++;
 
     /* ICECAST_LOG_DEBUG("processing yp server %s", server->url); */
     yp = server->mounts;
-    while (yp)
+    while (yp && free_handles)
     {
-        now = time (NULL);
-        /* if one of the streams shows that the server cannot be contacted then mark the
-         * other entries for an update later. Assume YP server is dead and skip it for now
-         */
-        if (state == -2)
+        if (yp->request == NULL && yp->remove == 0)
         {
-            ICECAST_LOG_DEBUG("skipping %s on %s", yp->mount, server->url);
-            yp->process = do_yp_add;
-            yp->next_update += 900;
+            process_ypdata (server, yp);
+            if (yp->request)
+                free_handles--;
         }
-        else
-            state = process_ypdata (server, yp);
         yp = yp->next;
     }
 }
@@ -599,6 +840,7 @@ static ypdata_t *create_yp_entry (struct yp_server *server, const char *mount)
         yp->audio_info = strdup ("");
         yp->subtype = strdup ("");
         yp->process = do_yp_add;
+        yp->server = server;
 
         url = malloc (len);
         if (url == NULL)
@@ -679,6 +921,7 @@ static void check_servers (void)
         ICECAST_LOG_DEBUG("Add pending yps %s", server->url);
         server->next = (struct yp_server *)active_yps;
         active_yps = server;
+        yp_server_stats (server, 0);
 
         /* new YP server configured, need to populate with existing sources */
         avl_tree_rlock (global.source_tree);
@@ -731,7 +974,7 @@ static void delete_marked_yp(struct yp_server *server)
 
     while (yp)
     {
-        if (yp->remove)
+        if (yp->remove && yp->request == NULL)
         {
             ypdata_t *to_go = yp;
             ICECAST_LOG_DEBUG("removed %s from YP server %s", yp->mount, server->url);
@@ -754,10 +997,14 @@ static void *yp_update_thread(void *arg)
     yp_running = 1;
     running = 1;
 
+    yp_multi = curl_multi_init ();
+    if (yp_multi == NULL)
+        ICECAST_LOG_ERROR("Can not create curl multi handle, no YP updates are sent");
+
     while (running) {
         struct yp_server *server;
 
-        thread_sleep (200000);
+        yp_wait (200);
 
         /* do the YP communication */
         thread_rwlock_rlock (&yp_lock);
@@ -768,6 +1015,7 @@ static void *yp_update_thread(void *arg)
             yp_process_server (server);
             server = server->next;
         }
+        yp_perform ();
         /* update the local YP structure */
         if (yp_update)
         {
@@ -796,6 +1044,9 @@ static void *yp_update_thread(void *arg)
         active_yps = server->next;
         destroy_yp_server (server);
     }
+    if (yp_multi)
+        curl_multi_cleanup (yp_multi);
+    yp_multi = NULL;
 
     return NULL;
 }
@@ -1018,6 +1269,7 @@ void yp_shutdown (void)
     yp_running = 0;
     yp_update = 1;
     thread_rwlock_unlock(&yp_lock);
+    global_wake();
 
     if (yp_thread)
         thread_join (yp_thread);
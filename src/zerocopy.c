@@ -0,0 +1,210 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#ifdef HAVE_LINUX_ERRQUEUE_H
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#endif
+
+#include "zerocopy.h"
+
+#include "logging.h"
+#define CATMODULE "zerocopy"
+
+#if defined(HAVE_LINUX_ERRQUEUE_H) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+
+/* smaller sends are copied, pinning the pages costs more than that */
+#define ZEROCOPY_MIN_BYTES      (16*1024)
+/* buffers held for sends the kernel is not done with yet */
+#define ZEROCOPY_MAX_HELD       256
+/* zero copy is given up after so many sends in a row the kernel copied
+ * anyway, e.g. as the route goes through loopback */
+#define ZEROCOPY_MAX_COPIED     16
+
+typedef struct {
+    /* number of the send, counted like the kernel does */
+    uint32_t seq;
+    refbuf_t *refbuf;
+} zerocopy_held_t;
+
+struct zerocopy_tag {
+    zerocopy_held_t held[ZEROCOPY_MAX_HELD];
+    size_t head;
+    size_t count;
+    uint32_t next_seq;
+    unsigned int copied;
+    int disabled;
+};
+
+zerocopy_t *zerocopy_new(sock_t sock)
+{
+    zerocopy_t *self;
+    int val = 1;
+
+    if (setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &val, sizeof(val)) != 0)
+        return NULL;
+
+    self = calloc(1, sizeof(*self));
+
+    return self;
+}
+
+void zerocopy_free(zerocopy_t *self)
+{
+    size_t i;
+
+    if (!self)
+        return;
+
+    for (i = 0; i < self->count; i++)
+        refbuf_release(self->held[(self->head + i) % ZEROCOPY_MAX_HELD].refbuf);
+    free(self);
+}
+
+/* drops the buffers of the sends lo to hi */
+static void zerocopy_release(zerocopy_t *self, uint32_t lo, uint32_t hi)
+{
+    size_t i;
+
+    for (i = 0; i < self->count; i++) {
+        zerocopy_held_t *held = &(self->held[(self->head + i) % ZEROCOPY_MAX_HELD]);
+
+        if (held->refbuf && (uint32_t)(held->seq - lo) <= (uint32_t)(hi - lo)) {
+            refbuf_release(held->refbuf);
+            held->refbuf = NULL;
+        }
+    }
+
+    while (self->count && !self->held[self->head].refbuf) {
+        self->head = (self->head + 1) % ZEROCOPY_MAX_HELD;
+        self->count--;
+    }
+}
+
+/* takes the notifications of finished sends off the error queue */
+static void zerocopy_reap(zerocopy_t *self, sock_t sock)
+{
+    while (self->count) {
+        char control[128];
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            break;
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            struct sock_extended_err *err;
+
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                    !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+                continue;
+
+            err = (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                if (++self->copied == ZEROCOPY_MAX_COPIED) {
+                    ICECAST_LOG_DEBUG("Kernel copies the sends on socket %R anyway, not using zero copy", sock);
+                    self->disabled = 1;
+                }
+            } else {
+                self->copied = 0;
+            }
+
+            zerocopy_release(self, err->ee_info, err->ee_data);
+        }
+    }
+}
+
+ssize_t zerocopy_send(zerocopy_t *self, sock_t sock, const struct iovec *iov, size_t count, refbuf_t *refbuf)
+{
+    struct msghdr msg;
+    size_t total = 0;
+    size_t i;
+    ssize_t ret;
+    ssize_t left;
+    int flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+
+    zerocopy_reap(self, sock);
+
+    for (i = 0; i < count; i++)
+        total += iov[i].iov_len;
+    if (!self->disabled && total >= ZEROCOPY_MIN_BYTES && ZEROCOPY_MAX_HELD - self->count >= count)
+        flags |= MSG_ZEROCOPY;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = count;
+
+    ret = sendmsg(sock, &msg, flags);
+    /* out of memory to pin the pages, copy this one */
+    if (ret < 0 && errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+        flags &= ~MSG_ZEROCOPY;
+        ret = sendmsg(sock, &msg, flags);
+    }
+    if (ret < 0)
+        return -errno;
+
+    /* the kernel only numbers sends that sent something */
+    if (ret > 0 && (flags & MSG_ZEROCOPY)) {
+        uint32_t seq = self->next_seq++;
+
+        left = ret;
+        for (i = 0; i < count && left > 0 && refbuf; i++) {
+            zerocopy_held_t *held = &(self->held[(self->head + self->count) % ZEROCOPY_MAX_HELD]);
+
+            refbuf_addref(refbuf);
+            held->seq = seq;
+            held->refbuf = refbuf;
+            self->count++;
+
+            left -= iov[i].iov_len;
+            refbuf = refbuf_get_next(refbuf);
+        }
+    }
+
+    return ret;
+}
+
+#else
+
+zerocopy_t *zerocopy_new(sock_t sock)
+{
+    (void)sock;
+    return NULL;
+}
+
+void zerocopy_free(zerocopy_t *self)
+{
+    (void)self;
+}
+
+ssize_t zerocopy_send(zerocopy_t *self, sock_t sock, const struct iovec *iov, size_t count, refbuf_t *refbuf)
+{
+    (void)self;
+    (void)sock;
+    (void)iov;
+    (void)count;
+    (void)refbuf;
+    return -ENOSYS;
+}
+
+#endif
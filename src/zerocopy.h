@@ -0,0 +1,40 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* zerocopy.h
+ *
+ * Sends from the stream queue with MSG_ZEROCOPY, so the kernel sends the
+ * buffers from where they are instead of copying them into the socket for
+ * every listener. The buffers must not change until the kernel is done
+ * with them, so a reference to each is held until it says so on the error
+ * queue of the socket. Only worth it for large sends, smaller ones and
+ * systems without MSG_ZEROCOPY are sent the usual way.
+ */
+
+#ifndef __ZEROCOPY_H__
+#define __ZEROCOPY_H__
+
+#include <sys/types.h>
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
+#include "compat.h"
+#include "refbuf.h"
+#include "common/net/sock.h"
+
+typedef struct zerocopy_tag zerocopy_t;
+
+/* Enables zero copy sends on sock. Returns NULL if it is not supported. */
+zerocopy_t *zerocopy_new(sock_t sock);
+/* Drops the references still held, the socket may be closed already */
+void        zerocopy_free(zerocopy_t *self);
+
+/* Sends the buffers like writev(), iov[i] being data of the i-th buffer of
+ * the queue from refbuf on. Returns the number of bytes sent or -errno. */
+ssize_t     zerocopy_send(zerocopy_t *self, sock_t sock, const struct iovec *iov, size_t count, refbuf_t *refbuf);
+
+#endif  /* __ZEROCOPY_H__ */
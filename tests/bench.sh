@@ -0,0 +1,162 @@
+#!/bin/bash
+#
+# Runs the microbenchmarks of ../src/cbench_stream, then icecast-loadgen
+# against the Icecast built in ../src in a number of scenarios and prints
+# what it reports for each. The size of the runs can be changed with these
+# variables:
+#   BENCH_SOURCES     number of sources (4)
+#   BENCH_LISTENERS   number of listeners (1000)
+#   BENCH_DURATION    seconds the listeners stay connected (20)
+#   BENCH_SLOW        percent of slow listeners in the slow scenarios (20)
+#   BENCH_PORT        port Icecast listens on, BENCH_PORT+1 for TLS (18000)
+#   BENCH_CAPTURE     capture recorded with <capture-file> to replay in the
+#                     scenario capture, skipped if not set
+#   BENCH_SPEED       speed the capture is replayed at, 0 for as fast as
+#                     the server takes it (1)
+#   BENCH_SCENARIOS   scenarios to run, all that can run if not set, the
+#                     microbenchmarks are the scenario micro
+
+testdir=$(cd "$(dirname "$0")" && pwd)
+builddir=$(pwd)
+
+ICECAST="$builddir/../src/icecast"
+LOADGEN="$builddir/icecast-loadgen"
+CBENCH="$builddir/../src/cbench_stream"
+
+BENCH_SOURCES=${BENCH_SOURCES:-4}
+BENCH_LISTENERS=${BENCH_LISTENERS:-1000}
+BENCH_DURATION=${BENCH_DURATION:-20}
+BENCH_SLOW=${BENCH_SLOW:-20}
+BENCH_PORT=${BENCH_PORT:-18000}
+BENCH_SPEED=${BENCH_SPEED:-1}
+BENCH_TLS_PORT=$((BENCH_PORT + 1))
+
+if ! test -x "$ICECAST" || ! test -x "$LOADGEN"; then
+    echo "Build icecast and icecast-loadgen first, or use make bench" >&2
+    exit 1
+fi
+
+workdir=$(mktemp -d)
+trap 'rm -rf "$workdir"' EXIT
+
+ulimit -n $((BENCH_LISTENERS + BENCH_SOURCES + 256)) 2>/dev/null || \
+    echo "# can not raise the limit of open files, large runs may fail"
+
+# Sample streams for the formats Icecast parses
+have_ffmpeg=0
+if command -v ffmpeg >/dev/null 2>&1; then
+    have_ffmpeg=1
+    ffmpeg -loglevel error -f lavfi -i "sine=frequency=1000:duration=30" -c:a libmp3lame -b:a 128k "$workdir/sample.mp3" || have_ffmpeg=0
+    ffmpeg -loglevel error -f lavfi -i "sine=frequency=1000:duration=30" -c:a libvorbis -b:a 128k "$workdir/sample.ogg" || have_ffmpeg=0
+    ffmpeg -loglevel error -f lavfi -i "sine=frequency=1000:duration=30" -c:a libopus -b:a 128k "$workdir/sample.webm" || have_ffmpeg=0
+fi
+
+have_tls=0
+if ! "$LOADGEN" -S 2>&1 | grep -q "without TLS" && command -v openssl >/dev/null 2>&1; then
+    if openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj "/CN=localhost" \
+            -keyout "$workdir/icecast.pem" -out "$workdir/cert.pem" >/dev/null 2>&1; then
+        cat "$workdir/cert.pem" >> "$workdir/icecast.pem"
+        have_tls=1
+    fi
+fi
+
+tls_socket=""
+tls_context=""
+if test $have_tls -eq 1; then
+    tls_socket="<listen-socket><port>$BENCH_TLS_PORT</port><bind-address>127.0.0.1</bind-address><tls>auto_no_plain</tls></listen-socket>"
+    tls_context="<tls-context><tls-certificate>$workdir/icecast.pem</tls-certificate></tls-context>"
+fi
+
+cat > "$workdir/icecast.xml" <<EOF
+<icecast>
+    <location>Benchmark</location>
+    <admin>foo@example.org</admin>
+    <limits>
+        <clients>$((BENCH_LISTENERS + BENCH_SOURCES + 64))</clients>
+        <sources>$((BENCH_SOURCES + 1))</sources>
+        <client-timeout>30</client-timeout>
+        <header-timeout>15</header-timeout>
+        <source-timeout>10</source-timeout>
+    </limits>
+    <authentication>
+        <source-password>hackme</source-password>
+        <admin-user>admin</admin-user>
+        <admin-password>hackme</admin-password>
+    </authentication>
+    <hostname>localhost</hostname>
+    <listen-socket>
+        <port>$BENCH_PORT</port>
+        <bind-address>127.0.0.1</bind-address>
+    </listen-socket>
+    $tls_socket
+    <paths>
+        <logdir>$workdir</logdir>
+        <webroot>$testdir/../web</webroot>
+        <adminroot>$testdir/../admin</adminroot>
+    </paths>
+    <logging>
+        <accesslog>access.log</accesslog>
+        <errorlog>error.log</errorlog>
+        <loglevel>2</loglevel>
+    </logging>
+    <security>
+        <chroot>0</chroot>
+        $tls_context
+    </security>
+</icecast>
+EOF
+
+if test -x "$CBENCH" && { test -z "$BENCH_SCENARIOS" || echo " $BENCH_SCENARIOS " | grep -q " micro "; }; then
+    echo "# micro"
+    if test $have_ffmpeg -eq 1; then
+        "$CBENCH" -m "$workdir/sample.mp3" -o "$workdir/sample.ogg" -w "$workdir/sample.webm" | sed 's/^/    /'
+    else
+        "$CBENCH" | sed 's/^/    /'
+    fi
+fi
+
+# run_scenario name port loadgen-options...
+function run_scenario {
+    local name=$1
+    local port=$2
+    shift 2
+
+    if test -n "$BENCH_SCENARIOS" && ! echo " $BENCH_SCENARIOS " | grep -q " $name "; then
+        return
+    fi
+
+    echo "# $name"
+    "$ICECAST" -c "$workdir/icecast.xml" 2> /dev/null &
+    local pid=$!
+    sleep 2
+
+    "$LOADGEN" -H 127.0.0.1 -p "$port" -s "$BENCH_SOURCES" -l "$BENCH_LISTENERS" \
+        -d "$BENCH_DURATION" -P $pid "$@" | sed 's/^/    /'
+
+    kill $pid
+    wait $pid 2>/dev/null
+}
+
+run_scenario plain $BENCH_PORT -m "/bench%u"
+run_scenario plain-slow $BENCH_PORT -m "/bench%u" -w "$BENCH_SLOW"
+
+if test $have_ffmpeg -eq 1; then
+    run_scenario mp3 $BENCH_PORT -m "/bench%u.mp3" -f "$workdir/sample.mp3" -t audio/mpeg
+    run_scenario mp3-icy $BENCH_PORT -m "/bench%u.mp3" -f "$workdir/sample.mp3" -t audio/mpeg -i
+    run_scenario mp3-icy-slow $BENCH_PORT -m "/bench%u.mp3" -f "$workdir/sample.mp3" -t audio/mpeg -i -w "$BENCH_SLOW"
+    run_scenario ogg $BENCH_PORT -m "/bench%u.ogg" -f "$workdir/sample.ogg" -t application/ogg
+    run_scenario webm $BENCH_PORT -m "/bench%u.webm" -f "$workdir/sample.webm" -t video/webm
+else
+    echo "# skipping the mp3, ogg and webm scenarios, ffmpeg is required to create the samples"
+fi
+
+if test -n "$BENCH_CAPTURE"; then
+    run_scenario capture $BENCH_PORT -m "/bench%u" -c "$BENCH_CAPTURE" -x "$BENCH_SPEED"
+fi
+
+if test $have_tls -eq 1; then
+    run_scenario tls $BENCH_TLS_PORT -m "/bench%u" -S
+    run_scenario tls-slow $BENCH_TLS_PORT -m "/bench%u" -S -w "$BENCH_SLOW"
+else
+    echo "# skipping the TLS scenarios, icecast-loadgen with TLS and openssl are required"
+fi
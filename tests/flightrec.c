@@ -0,0 +1,152 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* Converts a dump of the flight recorder, see src/flightrec.h, to the trace
+ * event JSON read by chrome://tracing and Perfetto. Events with a duration
+ * become complete events, the others instant ones, each on the track of the
+ * thread that recorded it. The connection id and the bytes of reads and
+ * writes are given as arguments.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+
+/* see src/flightrec.h */
+#define FLIGHTREC_MAGIC     "ICEFLTR1"
+
+typedef struct {
+    uint64_t time;
+    uint64_t id;
+    int64_t value;
+    uint32_t duration;
+    uint16_t type;
+    uint16_t thread;
+} flightrec_record_t;
+
+static int convert(const unsigned char *data, size_t len, FILE *out)
+{
+    const char **names;
+    uint32_t header[4];
+    size_t pos = strlen(FLIGHTREC_MAGIC);
+    uint64_t first = UINT64_MAX;
+    size_t i;
+
+    if (len < pos + sizeof(header) || memcmp(data, FLIGHTREC_MAGIC, pos) != 0) {
+        fprintf(stderr, "Not a flight recorder dump\n");
+        return -1;
+    }
+    memcpy(header, data + pos, sizeof(header));
+    pos += sizeof(header);
+
+    if (header[0] != 0x01020304) {
+        fprintf(stderr, "The dump was written on a host of a different byte order\n");
+        return -1;
+    }
+    if (header[1] != sizeof(flightrec_record_t)) {
+        fprintf(stderr, "Unknown record size %" PRIu32 "\n", header[1]);
+        return -1;
+    }
+
+    names = calloc(header[2], sizeof(*names));
+    if (!names)
+        return -1;
+    for (i = 0; i < header[2]; i++) {
+        const unsigned char *end = memchr(data + pos, 0, len - pos);
+
+        if (!end) {
+            fprintf(stderr, "The dump is cut short\n");
+            free(names);
+            return -1;
+        }
+        names[i] = (const char *)data + pos;
+        pos = end + 1 - data;
+    }
+
+    if ((len - pos) / sizeof(flightrec_record_t) < header[3]) {
+        fprintf(stderr, "The dump is cut short\n");
+        free(names);
+        return -1;
+    }
+
+    /* times are given from the first event on, they are easier to read */
+    for (i = 0; i < header[3]; i++) {
+        flightrec_record_t record;
+
+        memcpy(&record, data + pos + i * sizeof(record), sizeof(record));
+        if (record.time < first)
+            first = record.time;
+    }
+
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", out);
+    for (i = 0; i < header[3]; i++) {
+        flightrec_record_t record;
+        const char *name;
+
+        memcpy(&record, data + pos + i * sizeof(record), sizeof(record));
+        name = record.type < header[2] && names[record.type][0] ? names[record.type] : "unknown";
+
+        fprintf(out, "%s{\"name\":\"%s\",\"pid\":1,\"tid\":%u,\"ts\":%" PRIu64,
+                i ? ",\n" : "", name, (unsigned int)record.thread, record.time - first);
+        if (record.duration) {
+            fprintf(out, ",\"ph\":\"X\",\"dur\":%" PRIu32, record.duration);
+        } else {
+            fputs(",\"ph\":\"i\",\"s\":\"t\"", out);
+        }
+        fprintf(out, ",\"args\":{\"connection\":%" PRIu64 ",\"bytes\":%" PRId64 "}}", record.id, record.value);
+    }
+    fputs("\n]}\n", out);
+
+    free(names);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    FILE *file;
+    unsigned char *data;
+    long len;
+    int ret;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s dump > trace.json\n", argv[0]);
+        return 1;
+    }
+
+    file = fopen(argv[1], "rb");
+    if (!file) {
+        perror(argv[1]);
+        return 1;
+    }
+    fseek(file, 0, SEEK_END);
+    len = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (len <= 0) {
+        fprintf(stderr, "%s is empty\n", argv[1]);
+        fclose(file);
+        return 1;
+    }
+
+    data = malloc(len);
+    if (!data || fread(data, 1, len, file) != (size_t)len) {
+        fprintf(stderr, "Can not read %s\n", argv[1]);
+        free(data);
+        fclose(file);
+        return 1;
+    }
+    fclose(file);
+
+    ret = convert(data, len, stdout);
+    free(data);
+
+    return ret == 0 ? 0 : 1;
+}
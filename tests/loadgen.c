@@ -0,0 +1,995 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* Load generator for benchmarking a running Icecast. It feeds a number of
+ * sources from a file at a fixed bitrate and connects listeners to them,
+ * optionally asking for ICY metadata, over TLS or with part of them reading
+ * slowly. At the end it reports what the listeners got and, given the pid
+ * of the server, the CPU time and memory it used meanwhile.
+ *
+ * Instead of a file at a fixed bitrate the sources can replay a capture a
+ * server recorded of a source, see <capture-file>, sending each read at the
+ * time it came in, or that many times faster, and starting over at its end.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+#define LOADGEN_HEADER_MAX      4096
+#define LOADGEN_READ_SIZE       16384
+#define LOADGEN_SOURCE_BURST    65536
+#define LOADGEN_SLOW_RCVBUF     4096
+/* see src/dumpfile.h */
+#define LOADGEN_CAPTURE_MAGIC   "ICECAST-CAPTURE/1\r\n"
+#define LOADGEN_CAPTURE_RECORD  12
+
+typedef enum {
+    CONN_CONNECTING,
+    CONN_HANDSHAKE,
+    CONN_REQUEST,
+    CONN_RESPONSE,
+    CONN_STREAMING,
+    CONN_DONE,
+    CONN_FAILED
+} conn_state_t;
+
+typedef struct {
+    int fd;
+    int is_source;
+    int slow;
+    unsigned int mount;
+    conn_state_t state;
+    int want_write;
+#ifdef HAVE_OPENSSL
+    SSL *ssl;
+#endif
+    char request[2048];
+    size_t request_len;
+    size_t request_pos;
+    char header[LOADGEN_HEADER_MAX];
+    size_t header_len;
+    uint64_t started;
+    uint64_t first_byte;
+    uint64_t streaming_since;
+    uint64_t bytes;
+} conn_t;
+
+typedef struct {
+    const char *host;
+    const char *port;
+    const char *mount_format;
+    const char *source_auth;
+    const char *content_type;
+    const char *feed;
+    const char *capture;
+    double speed;
+    unsigned int sources;
+    unsigned int listeners;
+    unsigned int bitrate;
+    unsigned int duration;
+    unsigned int warmup;
+    unsigned int slow_percent;
+    unsigned int slow_rate;
+    unsigned int ramp;
+    int icy;
+    int tls;
+    pid_t server;
+} options_t;
+
+static options_t options = {
+    .host = "127.0.0.1",
+    .port = "8000",
+    .mount_format = "/bench%u",
+    .source_auth = "source:hackme",
+    .content_type = "application/octet-stream",
+    .speed = 1,
+    .bitrate = 128,
+    .duration = 30,
+    .warmup = 2,
+    .slow_rate = 4000
+};
+
+static struct addrinfo *address;
+static char *feed;
+static size_t feed_len;
+/* the request headers of a capture and when each read of it came in, in
+ * microseconds, with the end of its data in feed */
+static char capture_header[1024];
+static uint64_t *capture_time;
+static size_t *capture_end;
+static size_t capture_count;
+static conn_t *conns;
+static size_t conns_count;
+static volatile sig_atomic_t stop;
+#ifdef HAVE_OPENSSL
+static SSL_CTX *tls_context;
+#endif
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -H host         server to connect to (%s)\n"
+            "  -p port         port to connect to (%s)\n"
+            "  -m format       mount names, %%u is the number of the source (%s)\n"
+            "  -s count        sources to feed, 0 for listeners on existing mounts (%u)\n"
+            "  -a user:pass    credentials of the sources (%s)\n"
+            "  -f file         data the sources send, random data if not given\n"
+            "  -c file         capture the sources replay, instead of -f, -t and -b\n"
+            "  -x speed        speed the capture is replayed at, 0 for as fast as\n"
+            "                  the server takes it (%g)\n"
+            "  -t type         content type of the sources (%s)\n"
+            "  -b kbit/s       bitrate the sources send at (%u)\n"
+            "  -l count        listeners, spread over the mounts (%u)\n"
+            "  -r count        listeners to connect per second, 0 for all at once (%u)\n"
+            "  -i              listeners ask for ICY metadata\n"
+            "  -w percent      share of listeners reading slowly (%u)\n"
+            "  -k bytes/s      rate slow listeners read at (%u)\n"
+            "  -W seconds      time between the sources and the listeners (%u)\n"
+            "  -d seconds      time the listeners stay connected (%u)\n"
+            "  -S              connect with TLS\n"
+            "  -P pid          pid of the server to report CPU and memory of\n",
+            name, options.host, options.port, options.mount_format, options.sources,
+            options.source_auth, options.speed, options.content_type, options.bitrate, options.listeners,
+            options.ramp, options.slow_percent, options.slow_rate, options.warmup, options.duration);
+}
+
+static void base64_encode(const char *in, char *out)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t len = strlen(in);
+    size_t i;
+
+    for (i = 0; i < len; i += 3) {
+        uint32_t block = (uint32_t)(unsigned char)in[i] << 16;
+
+        if (i + 1 < len)
+            block |= (uint32_t)(unsigned char)in[i + 1] << 8;
+        if (i + 2 < len)
+            block |= (unsigned char)in[i + 2];
+
+        *out++ = alphabet[(block >> 18) & 0x3f];
+        *out++ = alphabet[(block >> 12) & 0x3f];
+        *out++ = i + 1 < len ? alphabet[(block >> 6) & 0x3f] : '=';
+        *out++ = i + 2 < len ? alphabet[block & 0x3f] : '=';
+    }
+    *out = 0;
+}
+
+static uint64_t read_be(const unsigned char *data, size_t len)
+{
+    uint64_t ret = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        ret = (ret << 8) | data[i];
+
+    return ret;
+}
+
+/* Reads the capture into feed, which then holds the data of all reads. */
+static int load_capture(void)
+{
+    FILE *file = fopen(options.capture, "rb");
+    unsigned char *data;
+    const char *header;
+    const char *end;
+    size_t len, pos;
+    long size;
+
+    if (!file) {
+        perror(options.capture);
+        return -1;
+    }
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (size <= 0) {
+        fprintf(stderr, "%s is empty\n", options.capture);
+        fclose(file);
+        return -1;
+    }
+    len = size;
+    data = malloc(len + 1);
+    if (!data || fread(data, 1, len, file) != len) {
+        fprintf(stderr, "Can not read %s\n", options.capture);
+        free(data);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+    data[len] = 0;
+
+    header = (const char *)data + strlen(LOADGEN_CAPTURE_MAGIC);
+    end = strstr(header, "\r\n\r\n");
+    if (strncmp((const char *)data, LOADGEN_CAPTURE_MAGIC, strlen(LOADGEN_CAPTURE_MAGIC)) != 0 || !end ||
+            (size_t)(end + 2 - header) >= sizeof(capture_header)) {
+        fprintf(stderr, "%s is not a capture\n", options.capture);
+        free(data);
+        return -1;
+    }
+    memcpy(capture_header, header, end + 2 - header);
+    pos = end + 4 - (const char *)data;
+
+    /* there are at most as many reads as record headers fit */
+    feed = malloc(len - pos + 1);
+    capture_time = calloc((len - pos) / LOADGEN_CAPTURE_RECORD + 1, sizeof(*capture_time));
+    capture_end = calloc((len - pos) / LOADGEN_CAPTURE_RECORD + 1, sizeof(*capture_end));
+    if (!feed || !capture_time || !capture_end) {
+        free(data);
+        return -1;
+    }
+
+    while (len - pos >= LOADGEN_CAPTURE_RECORD) {
+        uint64_t time = read_be(data + pos, 8);
+        size_t record = read_be(data + pos + 8, 4);
+
+        /* cut short as the server stopped writing it */
+        if (len - pos - LOADGEN_CAPTURE_RECORD < record)
+            break;
+
+        memcpy(feed + feed_len, data + pos + LOADGEN_CAPTURE_RECORD, record);
+        feed_len += record;
+        capture_time[capture_count] = time;
+        capture_end[capture_count] = feed_len;
+        capture_count++;
+        pos += LOADGEN_CAPTURE_RECORD + record;
+    }
+    free(data);
+
+    if (!feed_len) {
+        fprintf(stderr, "%s holds no data\n", options.capture);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int load_feed(void)
+{
+    if (options.capture)
+        return load_capture();
+
+    if (options.feed) {
+        FILE *file = fopen(options.feed, "rb");
+        long len;
+
+        if (!file) {
+            perror(options.feed);
+            return -1;
+        }
+        fseek(file, 0, SEEK_END);
+        len = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        if (len <= 0) {
+            fprintf(stderr, "%s is empty\n", options.feed);
+            fclose(file);
+            return -1;
+        }
+        feed_len = len;
+        feed = malloc(feed_len);
+        if (!feed || fread(feed, 1, feed_len, file) != feed_len) {
+            fprintf(stderr, "Can not read %s\n", options.feed);
+            fclose(file);
+            return -1;
+        }
+        fclose(file);
+    } else {
+        size_t i;
+
+        feed_len = 1024 * 1024;
+        feed = malloc(feed_len);
+        if (!feed)
+            return -1;
+        srand(1);
+        for (i = 0; i < feed_len; i++)
+            feed[i] = rand();
+    }
+
+    return 0;
+}
+
+static int conn_start(conn_t *conn, int is_source, unsigned int mount, int slow)
+{
+    char path[256];
+    int flags;
+
+    memset(conn, 0, sizeof(*conn));
+    conn->is_source = is_source;
+    conn->mount = mount;
+    conn->slow = slow;
+    conn->started = now_us();
+
+    snprintf(path, sizeof(path), options.mount_format, mount);
+
+    if (is_source) {
+        char auth[(sizeof(conn->request) / 3 + 1) * 4 + 1];
+
+        base64_encode(options.source_auth, auth);
+        if (capture_count) {
+            conn->request_len = snprintf(conn->request, sizeof(conn->request),
+                    "PUT %s HTTP/1.1\r\nHost: %s:%s\r\nAuthorization: Basic %s\r\n%s"
+                    "Ice-Public: 0\r\n\r\n",
+                    path, options.host, options.port, auth, capture_header);
+        } else {
+            conn->request_len = snprintf(conn->request, sizeof(conn->request),
+                    "PUT %s HTTP/1.1\r\nHost: %s:%s\r\nAuthorization: Basic %s\r\nContent-Type: %s\r\n"
+                    "Ice-Public: 0\r\nIce-Bitrate: %u\r\n\r\n",
+                    path, options.host, options.port, auth, options.content_type, options.bitrate);
+        }
+    } else {
+        conn->request_len = snprintf(conn->request, sizeof(conn->request),
+                "GET %s HTTP/1.0\r\nHost: %s:%s\r\nUser-Agent: icecast-loadgen\r\n%s\r\n",
+                path, options.host, options.port, options.icy ? "Icy-MetaData: 1\r\n" : "");
+    }
+
+    if (conn->request_len >= sizeof(conn->request)) {
+        conn->state = CONN_FAILED;
+        return -1;
+    }
+
+    conn->fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if (conn->fd < 0) {
+        conn->state = CONN_FAILED;
+        return -1;
+    }
+
+    /* a small receive buffer lets a slow listener push back on the server */
+    if (slow) {
+        int size = LOADGEN_SLOW_RCVBUF;
+        setsockopt(conn->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+
+    flags = fcntl(conn->fd, F_GETFL);
+    fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK);
+
+    if (connect(conn->fd, address->ai_addr, address->ai_addrlen) != 0 && errno != EINPROGRESS) {
+        close(conn->fd);
+        conn->fd = -1;
+        conn->state = CONN_FAILED;
+        return -1;
+    }
+
+    conn->state = CONN_CONNECTING;
+    conn->want_write = 1;
+    return 0;
+}
+
+static void conn_close(conn_t *conn, conn_state_t state)
+{
+#ifdef HAVE_OPENSSL
+    if (conn->ssl) {
+        SSL_free(conn->ssl);
+        conn->ssl = NULL;
+    }
+#endif
+    if (conn->fd >= 0)
+        close(conn->fd);
+    conn->fd = -1;
+    conn->state = state;
+}
+
+/* these return the bytes done, 0 if the call would block and -1 on errors
+ * or the end of the connection */
+static ssize_t conn_write(conn_t *conn, const void *data, size_t len)
+{
+    ssize_t ret;
+
+#ifdef HAVE_OPENSSL
+    if (conn->ssl) {
+        ret = SSL_write(conn->ssl, data, len);
+        if (ret > 0)
+            return ret;
+        switch (SSL_get_error(conn->ssl, ret)) {
+            case SSL_ERROR_WANT_WRITE:
+                conn->want_write = 1;
+                return 0;
+            case SSL_ERROR_WANT_READ:
+                conn->want_write = 0;
+                return 0;
+            default:
+                return -1;
+        }
+    }
+#endif
+
+    ret = send(conn->fd, data, len, MSG_NOSIGNAL);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        conn->want_write = 1;
+        return 0;
+    }
+    return ret < 0 ? -1 : ret;
+}
+
+static ssize_t conn_read(conn_t *conn, void *data, size_t len)
+{
+    ssize_t ret;
+
+#ifdef HAVE_OPENSSL
+    if (conn->ssl) {
+        ret = SSL_read(conn->ssl, data, len);
+        if (ret > 0)
+            return ret;
+        switch (SSL_get_error(conn->ssl, ret)) {
+            case SSL_ERROR_WANT_READ:
+                conn->want_write = 0;
+                return 0;
+            case SSL_ERROR_WANT_WRITE:
+                conn->want_write = 1;
+                return 0;
+            default:
+                return -1;
+        }
+    }
+#endif
+
+    ret = recv(conn->fd, data, len, 0);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+    return ret <= 0 ? -1 : ret;
+}
+
+static void conn_connected(conn_t *conn)
+{
+    int error = 0;
+    socklen_t len = sizeof(error);
+
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0 || error) {
+        conn_close(conn, CONN_FAILED);
+        return;
+    }
+
+    if (conn->is_source) {
+        int one = 1;
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+#ifdef HAVE_OPENSSL
+    if (options.tls) {
+        conn->ssl = SSL_new(tls_context);
+        if (!conn->ssl || SSL_set_fd(conn->ssl, conn->fd) != 1) {
+            conn_close(conn, CONN_FAILED);
+            return;
+        }
+        SSL_set_tlsext_host_name(conn->ssl, options.host);
+        conn->state = CONN_HANDSHAKE;
+        return;
+    }
+#endif
+
+    conn->state = CONN_REQUEST;
+}
+
+static void conn_handshake(conn_t *conn)
+{
+#ifdef HAVE_OPENSSL
+    int ret = SSL_connect(conn->ssl);
+
+    if (ret == 1) {
+        conn->state = CONN_REQUEST;
+        conn->want_write = 1;
+        return;
+    }
+
+    switch (SSL_get_error(conn->ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+            conn->want_write = 0;
+        break;
+        case SSL_ERROR_WANT_WRITE:
+            conn->want_write = 1;
+        break;
+        default:
+            conn_close(conn, CONN_FAILED);
+        break;
+    }
+#else
+    conn_close(conn, CONN_FAILED);
+#endif
+}
+
+static void conn_send_request(conn_t *conn)
+{
+    ssize_t ret = conn_write(conn, conn->request + conn->request_pos, conn->request_len - conn->request_pos);
+
+    if (ret < 0) {
+        conn_close(conn, CONN_FAILED);
+        return;
+    }
+
+    conn->request_pos += ret;
+    if (conn->request_pos == conn->request_len) {
+        conn->state = CONN_RESPONSE;
+        conn->want_write = 0;
+    }
+}
+
+static void conn_body(conn_t *conn, size_t len, uint64_t now)
+{
+    if (!len)
+        return;
+    if (!conn->first_byte)
+        conn->first_byte = now;
+    conn->bytes += len;
+}
+
+static void conn_read_response(conn_t *conn, uint64_t now)
+{
+    ssize_t ret = conn_read(conn, conn->header + conn->header_len, sizeof(conn->header) - 1 - conn->header_len);
+    char *end;
+
+    if (ret < 0) {
+        conn_close(conn, CONN_FAILED);
+        return;
+    }
+
+    conn->header_len += ret;
+    conn->header[conn->header_len] = 0;
+
+    end = strstr(conn->header, "\r\n\r\n");
+    if (!end) {
+        if (conn->header_len == sizeof(conn->header) - 1)
+            conn_close(conn, CONN_FAILED);
+        return;
+    }
+
+    /* HTTP/1.x 200 and ICY 200 */
+    if (!strchr(conn->header, ' ') || atoi(strchr(conn->header, ' ') + 1) != 200) {
+        fprintf(stderr, "mount %u: %.*s\n", conn->mount, (int)strcspn(conn->header, "\r\n"), conn->header);
+        conn_close(conn, CONN_FAILED);
+        return;
+    }
+
+    conn->state = CONN_STREAMING;
+    conn->streaming_since = now;
+    conn->want_write = conn->is_source;
+    if (!conn->is_source)
+        conn_body(conn, conn->header_len - (end + 4 - conn->header), now);
+}
+
+/* the bytes a source should have sent by now */
+static uint64_t conn_feed_due(const conn_t *conn, uint64_t now)
+{
+    uint64_t elapsed, period, cycles, at;
+    size_t lo = 0, hi = capture_count;
+
+    if (!capture_count)
+        return LOADGEN_SOURCE_BURST + (now - conn->streaming_since) * options.bitrate / 8000;
+    if (options.speed <= 0)
+        return UINT64_MAX;
+
+    /* the reads of the capture that came in by now, over and over again */
+    elapsed = (now - conn->streaming_since) * options.speed;
+    period = capture_time[capture_count - 1] + 1;
+    cycles = elapsed / period;
+    at = elapsed % period;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (capture_time[mid] <= at) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return cycles * feed_len + (lo ? capture_end[lo - 1] : 0);
+}
+
+static void conn_feed(conn_t *conn, uint64_t now)
+{
+    uint64_t due = conn_feed_due(conn, now);
+
+    while (conn->bytes < due) {
+        size_t pos = conn->bytes % feed_len;
+        size_t len = feed_len - pos;
+        ssize_t ret;
+
+        if (len > due - conn->bytes)
+            len = due - conn->bytes;
+
+        ret = conn_write(conn, feed + pos, len);
+        if (ret < 0) {
+            conn_close(conn, CONN_FAILED);
+            return;
+        }
+        if (ret == 0)
+            return;
+        conn->bytes += ret;
+    }
+
+    conn->want_write = 0;
+}
+
+static void conn_listen(conn_t *conn, uint64_t now)
+{
+    static char buffer[LOADGEN_READ_SIZE];
+    size_t len = sizeof(buffer);
+    ssize_t ret;
+
+    if (conn->slow) {
+        uint64_t due = (now - conn->streaming_since) * options.slow_rate / 1000000;
+
+        if (conn->bytes >= due)
+            return;
+        if (due - conn->bytes < len)
+            len = due - conn->bytes;
+    }
+
+    ret = conn_read(conn, buffer, len);
+    if (ret < 0) {
+        conn_close(conn, CONN_FAILED);
+        return;
+    }
+    conn_body(conn, ret, now);
+}
+
+/* whether a slow listener wants to read now, the others always do */
+static int conn_wants_read(const conn_t *conn, uint64_t now)
+{
+    if (!conn->slow || conn->state != CONN_STREAMING)
+        return 1;
+
+    return conn->bytes < (now - conn->streaming_since) * options.slow_rate / 1000000;
+}
+
+static void conn_process(conn_t *conn, short revents, uint64_t now)
+{
+    if (conn->state == CONN_CONNECTING) {
+        if (!(revents & (POLLOUT|POLLERR|POLLHUP)))
+            return;
+        conn_connected(conn);
+    }
+
+    if (conn->state == CONN_HANDSHAKE)
+        conn_handshake(conn);
+
+    if (conn->state == CONN_REQUEST)
+        conn_send_request(conn);
+
+    if (conn->state == CONN_RESPONSE && (revents & (POLLIN|POLLERR|POLLHUP)))
+        conn_read_response(conn, now);
+
+    if (conn->state == CONN_STREAMING) {
+        if (conn->is_source) {
+            /* the server does not send anything, reading only shows errors */
+            if (revents & (POLLERR|POLLHUP))
+                conn_close(conn, CONN_FAILED);
+            else
+                conn_feed(conn, now);
+        } else if (revents & (POLLIN|POLLERR|POLLHUP)) {
+            conn_listen(conn, now);
+        }
+    }
+}
+
+typedef struct {
+    uint64_t cpu_ticks;
+    long rss_kb;
+    long hwm_kb;
+} server_usage_t;
+
+/* returns 0 if the usage of the server could be read from /proc */
+static int server_usage(server_usage_t *usage)
+{
+    char path[64];
+    char line[1024];
+    unsigned long long utime, stime;
+    FILE *file;
+    char *p;
+
+    memset(usage, 0, sizeof(*usage));
+    if (!options.server)
+        return -1;
+
+    snprintf(path, sizeof(path), "/proc/%ld/stat", (long)options.server);
+    file = fopen(path, "r");
+    if (!file)
+        return -1;
+    if (!fgets(line, sizeof(line), file)) {
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+
+    /* the fields after the command, which may contain spaces */
+    p = strrchr(line, ')');
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2)
+        return -1;
+    usage->cpu_ticks = utime + stime;
+
+    snprintf(path, sizeof(path), "/proc/%ld/status", (long)options.server);
+    file = fopen(path, "r");
+    if (file) {
+        while (fgets(line, sizeof(line), file)) {
+            if (strncmp(line, "VmRSS:", 6) == 0)
+                usage->rss_kb = atol(line + 6);
+            else if (strncmp(line, "VmHWM:", 6) == 0)
+                usage->hwm_kb = atol(line + 6);
+        }
+        fclose(file);
+    }
+
+    return 0;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void report(uint64_t listen_start, uint64_t listen_end, const server_usage_t *before, const server_usage_t *after, int have_usage)
+{
+    uint64_t *latency = calloc(options.listeners + 1, sizeof(*latency));
+    double seconds = (listen_end - listen_start) / 1000000.;
+    uint64_t bytes = 0;
+    size_t started = 0;
+    size_t streaming = 0;
+    size_t failed = 0;
+    size_t sources = 0;
+    size_t i;
+
+    for (i = 0; i < conns_count; i++) {
+        conn_t *conn = &(conns[i]);
+
+        if (conn->is_source) {
+            if (conn->state == CONN_STREAMING)
+                sources++;
+            continue;
+        }
+
+        bytes += conn->bytes;
+        if (conn->state == CONN_STREAMING)
+            streaming++;
+        else if (conn->state == CONN_FAILED)
+            failed++;
+        if (conn->first_byte && latency)
+            latency[started++] = conn->first_byte - conn->started;
+    }
+
+    printf("sources: %zu of %u streaming\n", sources, options.sources);
+    printf("listeners: %u, %zu started, %zu streaming at the end, %zu failed\n", options.listeners, started, streaming, failed);
+    if (seconds > 0) {
+        printf("throughput: %.2f Mbit/s\n", bytes * 8 / seconds / 1000000.);
+        if (started)
+            printf("throughput per listener: %.2f kbit/s\n", bytes * 8 / seconds / 1000. / started);
+    }
+
+    if (started && latency) {
+        qsort(latency, started, sizeof(*latency), compare_u64);
+        printf("start latency: p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+                latency[started / 2] / 1000., latency[(started * 99) / 100] / 1000., latency[started - 1] / 1000.);
+    }
+    free(latency);
+
+    if (have_usage && seconds > 0) {
+        double cpu = (after->cpu_ticks - before->cpu_ticks) / (double)sysconf(_SC_CLK_TCK);
+
+        printf("server cpu: %.1f %%\n", cpu * 100. / seconds);
+        if (streaming)
+            printf("server cpu per listener: %.3f ms/s\n", cpu * 1000. / seconds / streaming);
+        printf("server memory: %ld kB resident, %ld kB peak\n", after->rss_kb, after->hwm_kb);
+        if (streaming)
+            printf("server memory per listener: %.1f kB\n", (after->rss_kb - before->rss_kb) / (double)streaming);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct addrinfo hints;
+    struct pollfd *fds;
+    server_usage_t before, after;
+    int have_usage = 0;
+    uint64_t start, listen_start = 0, listen_end;
+    unsigned int mounts;
+    size_t next_listener = 0;
+    int opt;
+    int ret;
+
+    while ((opt = getopt(argc, argv, "H:p:m:s:a:f:c:x:t:b:l:r:iw:k:W:d:SP:h")) != -1) {
+        switch (opt) {
+            case 'H': options.host = optarg; break;
+            case 'p': options.port = optarg; break;
+            case 'm': options.mount_format = optarg; break;
+            case 's': options.sources = atoi(optarg); break;
+            case 'a': options.source_auth = optarg; break;
+            case 'f': options.feed = optarg; break;
+            case 'c': options.capture = optarg; break;
+            case 'x': options.speed = atof(optarg); break;
+            case 't': options.content_type = optarg; break;
+            case 'b': options.bitrate = atoi(optarg); break;
+            case 'l': options.listeners = atoi(optarg); break;
+            case 'r': options.ramp = atoi(optarg); break;
+            case 'i': options.icy = 1; break;
+            case 'w': options.slow_percent = atoi(optarg); break;
+            case 'k': options.slow_rate = atoi(optarg); break;
+            case 'W': options.warmup = atoi(optarg); break;
+            case 'd': options.duration = atoi(optarg); break;
+            case 'S': options.tls = 1; break;
+            case 'P': options.server = atol(optarg); break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+#ifndef HAVE_OPENSSL
+    if (options.tls) {
+        fprintf(stderr, "Built without TLS support\n");
+        return 1;
+    }
+#else
+    if (options.tls) {
+        tls_context = SSL_CTX_new(TLS_client_method());
+        if (!tls_context) {
+            fprintf(stderr, "Can not create TLS context\n");
+            return 1;
+        }
+        SSL_CTX_set_verify(tls_context, SSL_VERIFY_NONE, NULL);
+    }
+#endif
+
+    if ((!options.sources && !options.listeners) || strlen(options.source_auth) >= sizeof(conns->request) / 3) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    ret = getaddrinfo(options.host, options.port, &hints, &address);
+    if (ret != 0) {
+        fprintf(stderr, "%s: %s\n", options.host, gai_strerror(ret));
+        return 1;
+    }
+
+    if (options.sources && load_feed() != 0)
+        return 1;
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    conns_count = options.sources + options.listeners;
+    conns = calloc(conns_count, sizeof(*conns));
+    fds = calloc(conns_count, sizeof(*fds));
+    if (!conns || !fds) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    for (next_listener = 0; next_listener < conns_count; next_listener++)
+        conns[next_listener].fd = -1;
+
+    mounts = options.sources ? options.sources : 1;
+    for (next_listener = 0; next_listener < options.sources; next_listener++)
+        conn_start(&(conns[next_listener]), 1, next_listener, 0);
+
+    start = now_us();
+    listen_end = start + (uint64_t)(options.warmup + options.duration) * 1000000;
+
+    while (!stop) {
+        uint64_t now = now_us();
+        size_t i;
+
+        if (now >= listen_end)
+            break;
+
+        /* listeners join once the sources had time to start */
+        if (now >= start + (uint64_t)options.warmup * 1000000) {
+            size_t due = conns_count;
+
+            if (!listen_start) {
+                listen_start = now;
+                have_usage = server_usage(&before) == 0;
+            }
+            if (options.ramp)
+                due = options.sources + (now - listen_start) * options.ramp / 1000000 + 1;
+            if (due > conns_count)
+                due = conns_count;
+
+            for (; next_listener < due; next_listener++) {
+                size_t idx = next_listener - options.sources;
+
+                conn_start(&(conns[next_listener]), 0, idx % mounts, idx % 100 < options.slow_percent);
+            }
+        }
+
+        for (i = 0; i < next_listener; i++) {
+            conn_t *conn = &(conns[i]);
+
+            fds[i].fd = -1;
+            fds[i].events = 0;
+            fds[i].revents = 0;
+            if (conn->fd < 0)
+                continue;
+
+            /* sources are paced by time, not by the socket */
+            if (conn->is_source && conn->state == CONN_STREAMING) {
+                if (!conn->want_write)
+                    conn_feed(conn, now);
+                fds[i].fd = conn->fd;
+                fds[i].events = conn->want_write ? POLLOUT : 0;
+                continue;
+            }
+
+            if (!conn_wants_read(conn, now))
+                continue;
+
+            fds[i].fd = conn->fd;
+            fds[i].events = conn->want_write ? POLLOUT : POLLIN;
+        }
+
+        ret = poll(fds, next_listener, 10);
+        if (ret < 0 && errno != EINTR)
+            break;
+
+        now = now_us();
+        for (i = 0; i < next_listener; i++) {
+            if (fds[i].fd >= 0 && fds[i].revents)
+                conn_process(&(conns[i]), fds[i].revents, now);
+        }
+    }
+
+    listen_end = now_us();
+    if (have_usage)
+        have_usage = server_usage(&after) == 0;
+
+    report(listen_start ? listen_start : listen_end, listen_end, &before, &after, have_usage);
+
+    for (next_listener = 0; next_listener < conns_count; next_listener++)
+        conn_close(&(conns[next_listener]), conns[next_listener].state);
+
+    freeaddrinfo(address);
+    free(conns);
+    free(fds);
+    free(feed);
+    free(capture_time);
+    free(capture_end);
+#ifdef HAVE_OPENSSL
+    SSL_CTX_free(tls_context);
+#endif
+
+    return 0;
+}